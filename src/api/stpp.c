@@ -561,7 +561,7 @@ stpp_cmd_sub(stpp_t *stpp, unsigned int id, int propref, const char *path,
   }
 
   ss->ss_stpp = stpp;
-  ss->ss_sub = prop_subscribe(PROP_SUB_ALT_PATH | flags,
+  ss->ss_sub = prop_subscribe(PROP_SUB_ALT_PATH | PROP_SUB_COALESCE | flags,
 			      PROP_TAG_COURIER, asyncio_courier,
 			      PROP_TAG_NAMESTR, path,
 			      PROP_TAG_NAME_VECTOR, namevec,
@@ -1153,7 +1153,7 @@ stpp_binary(stpp_t *stpp, const uint8_t *data, int len)
       sir->sir_flags = flags;
       sir->sir_stpp = stpp;
       LIST_INSERT_HEAD(&stpp->stpp_imagereqs, sir, sir_link);
-      task_run(stpp_imagereq_do, sir);
+      task_run_prio(stpp_imagereq_do, sir, TASK_PRIO_HIGH);
     }
     break;
 
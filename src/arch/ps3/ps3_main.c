@@ -169,13 +169,16 @@ memlogger_fn(callout_t *co, void *aux)
 
   if(meminfo.avail < LOW_MEM_LOW_WATER && !low_mem_warning) {
     low_mem_warning = 1;
+    prop_set(memprop, "lowMemory", PROP_SET_INT, 1);
     notify_add(NULL, NOTIFY_ERROR, NULL, 5,
 	       _("System is low on memory (%d kB RAM available)"),
 	       meminfo.avail / 1024);
   }
 
-  if(meminfo.avail > LOW_MEM_HIGH_WATER)
+  if(meminfo.avail > LOW_MEM_HIGH_WATER && low_mem_warning) {
     low_mem_warning = 0;
+    prop_set(memprop, "lowMemory", PROP_SET_INT, 0);
+  }
 
   uint32_t temp;
   Lv2Syscall2(383, 0, (uint64_t)&temp); // CPU temp
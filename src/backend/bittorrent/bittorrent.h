@@ -47,6 +47,7 @@ LIST_HEAD(torrent_fh_list, torrent_fh);
 LIST_HEAD(torrent_request_list, torrent_request);
 TAILQ_HEAD(torrent_request_queue, torrent_request);
 TAILQ_HEAD(torrent_piece_queue, torrent_piece);
+TAILQ_HEAD(torrent_piece_work_queue, torrent_piece);
 LIST_HEAD(torrent_block_list, torrent_block);
 LIST_HEAD(torrent_piece_list, torrent_piece);
 LIST_HEAD(torrent_sendreq_list, torrent_sendreq);
@@ -294,6 +295,10 @@ typedef struct torrent_piece {
   TAILQ_ENTRY(torrent_piece) tp_link;
   LIST_ENTRY(torrent_piece) tp_serve_link;
 
+  TAILQ_ENTRY(torrent_piece) tp_work_link;
+  struct torrent_work_queue *tp_work_queue; // Hash or diskio queue we're on
+  struct torrent *tp_torrent;
+
   struct torrent_block_list tp_waiting_blocks;
   struct torrent_block_list tp_sent_blocks;
   struct torrent_sendreq_list tp_sendreqs;
@@ -325,6 +330,16 @@ typedef struct torrent_piece {
 } torrent_piece_t;
 
 
+/**
+ * Pieces waiting to be hashed or loaded/written by the diskio thread.
+ * Each queued piece holds a reference
+ */
+typedef struct torrent_work_queue {
+  struct torrent_piece_work_queue twq_pieces;
+  int twq_length;
+} torrent_work_queue_t;
+
+
 /**
  * Represent a block (part of a piece) that we want to request
  */
@@ -553,7 +568,11 @@ void torrent_io_do_requests(torrent_t *to);
 void torrent_receive_block(torrent_block_t *tb, const void *buf,
                            int begin, int len, torrent_t *to, peer_t *p);
 
-void torrent_hash_wakeup(void);
+void torrent_hash_enqueue(torrent_piece_t *tp);
+
+void torrent_work_enqueue(torrent_work_queue_t *twq, torrent_piece_t *tp);
+
+torrent_piece_t *torrent_work_dequeue(torrent_work_queue_t *twq);
 
 int torrent_parse_infodict(torrent_t *to, struct htsmsg *info,
                            char *errbuf, size_t errlen);
@@ -591,7 +610,7 @@ void peer_activate_pending_data(torrent_t *to);
  * Disk IO
  */
 
-void torrent_diskio_wakeup(void);
+void torrent_diskio_enqueue(torrent_piece_t *tp);
 
 void torrent_diskio_open(torrent_t *to);
 
@@ -36,6 +36,14 @@
 
 static int torrent_write_thread_running;
 
+// Loads are served before writes, someone is usually waiting for them
+static torrent_work_queue_t torrent_load_queue = {
+  TAILQ_HEAD_INITIALIZER(torrent_load_queue.twq_pieces)
+};
+static torrent_work_queue_t torrent_write_queue = {
+  TAILQ_HEAD_INITIALIZER(torrent_write_queue.twq_pieces)
+};
+
 static void
 diskio_trace(const torrent_t *t, const char *msg, ...)
   attribute_printf(2, 3);
@@ -273,7 +281,7 @@ torrent_read_from_disk(torrent_t *to, torrent_piece_t *tp)
   if(ok) {
     tp->tp_complete = 1;
     tp->tp_on_disk = 1;
-    torrent_hash_wakeup();
+    torrent_hash_enqueue(tp);
   } else {
     tp->tp_loadfail = 1;
     to->to_loadfail = 1;
@@ -289,38 +297,35 @@ torrent_read_from_disk(torrent_t *to, torrent_piece_t *tp)
 static void *
 bt_diskio_thread(void *aux)
 {
-  torrent_t *to;
-
   hts_mutex_lock(&bittorrent_mutex);
 
   while(1) {
 
-  restart:
-
     update_disk_avail();
 
-    LIST_FOREACH(to, &torrents, to_link) {
-      if(to->to_cachefile == NULL)
-        continue;
-
-      torrent_piece_t *tp;
-      TAILQ_FOREACH(tp, &to->to_active_pieces, tp_link) {
+    torrent_piece_t *tp = torrent_work_dequeue(&torrent_load_queue);
+    if(tp == NULL)
+      tp = torrent_work_dequeue(&torrent_write_queue);
+
+    if(tp == NULL) {
+      if(hts_cond_wait_timeout(&torrent_piece_io_needed_cond,
+                               &bittorrent_mutex, 60000) &&
+         TAILQ_FIRST(&torrent_load_queue.twq_pieces) == NULL &&
+         TAILQ_FIRST(&torrent_write_queue.twq_pieces) == NULL)
+        break;
+      continue;
+    }
 
-        if(tp->tp_load_req) {
-          torrent_read_from_disk(to, tp);
-          goto restart;
-        }
+    torrent_t *to = tp->tp_torrent;
 
-	if(tp->tp_hash_ok && !tp->tp_on_disk && !tp->tp_disk_fail) {
-	  torrent_write_to_disk(to, tp);
-	  goto restart;
-	}
+    if(to->to_cachefile != NULL) {
+      if(tp->tp_load_req) {
+        torrent_read_from_disk(to, tp);
+      } else if(tp->tp_hash_ok && !tp->tp_on_disk && !tp->tp_disk_fail) {
+        torrent_write_to_disk(to, tp);
       }
     }
-
-    if(hts_cond_wait_timeout(&torrent_piece_io_needed_cond,
-			     &bittorrent_mutex, 60000))
-      break;
+    torrent_piece_release(tp);
   }
 
   torrent_write_thread_running = 0;
@@ -330,11 +335,14 @@ bt_diskio_thread(void *aux)
 
 
 /**
- *
+ * Queue a piece for loading (if tp_load_req is set) or writing
  */
 void
-torrent_diskio_wakeup(void)
+torrent_diskio_enqueue(torrent_piece_t *tp)
 {
+  torrent_work_enqueue(tp->tp_load_req ?
+                       &torrent_load_queue : &torrent_write_queue, tp);
+
   if(!torrent_write_thread_running) {
     torrent_write_thread_running = 1;
     hts_thread_create_detached("btdiskio", bt_diskio_thread, NULL,
@@ -887,7 +887,7 @@ recv_request(peer_t *p, const uint8_t *buf, size_t len)
 
       tp = torrent_piece_create(to, piece);
       tp->tp_load_req = 1;
-      torrent_diskio_wakeup();
+      torrent_diskio_enqueue(tp);
 
     } else {
       peer_trace(p, PEER_DBG_UPLOAD,
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 
 #include "main.h"
 #include "navigator.h"
@@ -45,7 +46,14 @@ struct torrent_list torrents;
 static int torrent_pendings_signal;
 static int torrent_boot_periodic_signal;
 static int torrent_metainfo_signal;
-static int torrent_hash_thread_running;
+static int torrent_hash_threads;
+static int torrent_hash_threads_idle;
+static torrent_work_queue_t torrent_hash_queue = {
+  TAILQ_HEAD_INITIALIZER(torrent_hash_queue.twq_pieces)
+};
+#ifdef TORRENT_HASH_BENCHMARK
+static int torrent_hash_bench_threads;
+#endif
 
 hts_cond_t torrent_piece_hash_needed_cond;
 hts_cond_t torrent_piece_io_needed_cond;
@@ -490,7 +498,7 @@ torrent_receive_block(torrent_block_t *tb, const void *buf,
     // Piece complete
 
     tp->tp_complete = 1;
-    torrent_hash_wakeup();
+    torrent_hash_enqueue(tp);
   }
   torrent_io_do_requests(to);
 }
@@ -766,6 +774,7 @@ torrent_piece_create(torrent_t *to, int piece_index)
   torrent_piece_t *tp = calloc(1, sizeof(torrent_piece_t));
   tp->tp_refcount = 1;
   tp->tp_index = piece_index;
+  tp->tp_torrent = to;
   TAILQ_INSERT_TAIL(&to->to_active_pieces, tp, tp_link);
   tp->tp_deadline = INT64_MAX;
   LIST_INSERT_SORTED(&to->to_serve_order, tp, tp_serve_link, tp_deadline_cmp,
@@ -804,8 +813,8 @@ torrent_piece_find(torrent_t *to, int piece_index)
   if(to->to_cachefile_piece_map[piece_index] != -1) {
     // We have this piece on disk, signal that we want to load it
     tp->tp_load_req = 1;
-    // and wakeup diskio thread
-    torrent_diskio_wakeup();
+    // and hand it to the diskio thread
+    torrent_diskio_enqueue(tp);
     return tp;
   }
 
@@ -1184,6 +1193,64 @@ check_active_requests(torrent_t *to, torrent_piece_t *tp,
 }
 
 
+/**
+ * Put piece on a work queue, the queue holds a reference.
+ * A piece is only ever on one queue, moving it keeps the reference
+ */
+void
+torrent_work_enqueue(torrent_work_queue_t *twq, torrent_piece_t *tp)
+{
+  if(tp->tp_work_queue == twq)
+    return;
+
+  if(tp->tp_work_queue != NULL) {
+    TAILQ_REMOVE(&tp->tp_work_queue->twq_pieces, tp, tp_work_link);
+    tp->tp_work_queue->twq_length--;
+  } else {
+    tp->tp_refcount++;
+  }
+
+  TAILQ_INSERT_TAIL(&twq->twq_pieces, tp, tp_work_link);
+  twq->twq_length++;
+  tp->tp_work_queue = twq;
+}
+
+
+/**
+ * Returns first piece on queue (or NULL). The queue's reference is
+ * transfered to the caller
+ */
+torrent_piece_t *
+torrent_work_dequeue(torrent_work_queue_t *twq)
+{
+  torrent_piece_t *tp = TAILQ_FIRST(&twq->twq_pieces);
+  if(tp == NULL)
+    return NULL;
+
+  TAILQ_REMOVE(&twq->twq_pieces, tp, tp_work_link);
+  twq->twq_length--;
+  tp->tp_work_queue = NULL;
+  return tp;
+}
+
+
+/**
+ *
+ */
+static void
+torrent_work_cancel(torrent_piece_t *tp)
+{
+  torrent_work_queue_t *twq = tp->tp_work_queue;
+  if(twq == NULL)
+    return;
+
+  TAILQ_REMOVE(&twq->twq_pieces, tp, tp_work_link);
+  twq->twq_length--;
+  tp->tp_work_queue = NULL;
+  torrent_piece_release(tp);
+}
+
+
 /**
  *
  */
@@ -1217,6 +1284,7 @@ torrent_piece_destroy(torrent_t *to, torrent_piece_t *tp)
   TAILQ_REMOVE(&to->to_active_pieces, tp, tp_link);
   LIST_REMOVE(tp, tp_serve_link);
 
+  torrent_work_cancel(tp);
   torrent_piece_release(tp);
 }
 
@@ -1663,17 +1731,12 @@ static void
 torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
 {
   uint8_t digest[20];
-  sha1_decl(shactx);
 
   torrent_retain(to);
   tp->tp_refcount++;
 
   hts_mutex_unlock(&bittorrent_mutex);
-  int64_t ts = arch_get_ts();
-  sha1_init(shactx);
-  sha1_update(shactx, tp->tp_data, tp->tp_piece_length);
-  sha1_final(shactx, digest);
-  ts = arch_get_ts() - ts;
+  sha1_digest(tp->tp_data, tp->tp_piece_length, digest);
   hts_mutex_lock(&bittorrent_mutex);
 
   tp->tp_hash_computed = 1;
@@ -1695,8 +1758,8 @@ torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
 
   asyncio_wakeup_worker(torrent_pendings_signal);
 
-  if(tp->tp_hash_ok && to->to_cachefile != NULL)
-    torrent_diskio_wakeup();
+  if(tp->tp_hash_ok && to->to_cachefile != NULL && !tp->tp_on_disk)
+    torrent_diskio_enqueue(tp);
 
   torrent_piece_release(tp);
   torrent_release(to);
@@ -1707,39 +1770,34 @@ torrent_piece_verify_hash(torrent_t *to, torrent_piece_t *tp)
 
 
 /**
- *
+ * Hash workers pick pieces off torrent_hash_queue and verify them
+ * in parallel (the hashing itself is done without the lock held)
  */
 static void *
 bt_hash_thread(void *aux)
 {
-  torrent_t *to;
-
   hts_mutex_lock(&bittorrent_mutex);
 
   while(1) {
-
-  restart:
-
-    LIST_FOREACH(to, &torrents, to_link) {
-      torrent_piece_t *tp;
-      TAILQ_FOREACH(tp, &to->to_active_pieces, tp_link) {
-	if(tp->tp_complete && !tp->tp_hash_computed) {
-	  torrent_piece_verify_hash(to, tp);
-          /**
-           * 'to' may be invalid here because we have unlocked so restart
-           * from begining
-           */
-	  goto restart;
-	}
-      }
+    torrent_piece_t *tp = torrent_work_dequeue(&torrent_hash_queue);
+
+    if(tp == NULL) {
+      torrent_hash_threads_idle++;
+      int timeout = hts_cond_wait_timeout(&torrent_piece_hash_needed_cond,
+                                          &bittorrent_mutex, 60000);
+      torrent_hash_threads_idle--;
+      if(timeout && TAILQ_FIRST(&torrent_hash_queue.twq_pieces) == NULL)
+        break;
+      continue;
     }
 
-    if(hts_cond_wait_timeout(&torrent_piece_hash_needed_cond,
-			     &bittorrent_mutex, 60000))
-      break;
+    if(tp->tp_complete && !tp->tp_hash_computed)
+      torrent_piece_verify_hash(tp->tp_torrent, tp);
+
+    torrent_piece_release(tp);
   }
 
-  torrent_hash_thread_running = 0;
+  torrent_hash_threads--;
   hts_mutex_unlock(&bittorrent_mutex);
   return NULL;
 }
@@ -1748,11 +1806,29 @@ bt_hash_thread(void *aux)
 /**
  *
  */
+static int
+torrent_hash_max_threads(void)
+{
+#ifdef TORRENT_HASH_BENCHMARK
+  if(torrent_hash_bench_threads)
+    return torrent_hash_bench_threads;
+#endif
+  return MAX(1, MIN(gconf.concurrency, 4));
+}
+
+
+/**
+ * Queue a complete piece for hash verification. Spawns another
+ * worker if there is more work queued than idle workers
+ */
 void
-torrent_hash_wakeup(void)
+torrent_hash_enqueue(torrent_piece_t *tp)
 {
-  if(!torrent_hash_thread_running) {
-    torrent_hash_thread_running = 1;
+  torrent_work_enqueue(&torrent_hash_queue, tp);
+
+  if(torrent_hash_queue.twq_length > torrent_hash_threads_idle &&
+     torrent_hash_threads < torrent_hash_max_threads()) {
+    torrent_hash_threads++;
     hts_thread_create_detached("bthasher", bt_hash_thread, NULL,
 			       THREAD_PRIO_BGTASK);
   }
@@ -1760,6 +1836,132 @@ torrent_hash_wakeup(void)
 }
 
 
+#ifdef TORRENT_HASH_BENCHMARK
+
+#define TORRENT_BENCH_PIECE_SIZE (1024 * 1024)
+#define TORRENT_BENCH_PIECES     4096
+#define TORRENT_BENCH_INFLIGHT   64
+
+/**
+ * Load and verify every piece of the cache file through the diskio
+ * and hash queues, keeping at most TORRENT_BENCH_INFLIGHT pieces in
+ * memory
+ */
+static void
+torrent_hash_benchmark_run(torrent_t *to, int threads)
+{
+  torrent_piece_t *inflight[TORRENT_BENCH_INFLIGHT];
+  int issued = 0, done = 0, failed = 0;
+
+  torrent_hash_bench_threads = threads;
+
+  int64_t ts = arch_get_ts();
+
+  hts_mutex_lock(&bittorrent_mutex);
+
+  while(done < to->to_num_pieces) {
+
+    while(issued < to->to_num_pieces &&
+          issued - done < TORRENT_BENCH_INFLIGHT) {
+      torrent_piece_t *tp = torrent_piece_create(to, issued);
+      tp->tp_load_req = 1;
+      torrent_diskio_enqueue(tp);
+      inflight[issued % TORRENT_BENCH_INFLIGHT] = tp;
+      issued++;
+    }
+
+    torrent_piece_t *tp = inflight[done % TORRENT_BENCH_INFLIGHT];
+    if(!tp->tp_hash_computed && !tp->tp_loadfail) {
+      hts_cond_wait_timeout(&torrent_piece_verified_cond,
+                            &bittorrent_mutex, 1000);
+      continue;
+    }
+
+    failed += !tp->tp_hash_ok;
+    torrent_piece_destroy(to, tp);
+    done++;
+  }
+
+  hts_mutex_unlock(&bittorrent_mutex);
+
+  ts = arch_get_ts() - ts;
+
+  const double mb = (double)to->to_total_length / 1000000.0;
+  printf("%d hash thread(s): %d pieces (%.0f MB) in %.2fs, "
+         "%.1f MB/s, %d failed\n",
+         threads, done, mb, ts / 1000000.0, mb * 1000000.0 / ts, failed);
+}
+
+
+/**
+ * Write a 4GB synthetic torrent cache file and verify it with one
+ * hash worker and then with one worker per CPU. Build with
+ * -DTORRENT_HASH_BENCHMARK, drop the page cache between runs for
+ * cold disk numbers. The process exits when done
+ */
+static void *
+torrent_hash_benchmark(void *aux)
+{
+  const int pl = TORRENT_BENCH_PIECE_SIZE;
+  const int n = TORRENT_BENCH_PIECES;
+  char path[PATH_MAX];
+  char errbuf[256];
+
+  snprintf(path, sizeof(path), "%s/bt-hash-bench.tc", gconf.cache_path);
+
+  torrent_t *to = calloc(1, sizeof(torrent_t));
+  to->to_title = strdup("hashbench");
+  to->to_refcount = 1;
+  to->to_piece_length = pl;
+  to->to_num_pieces = n;
+  to->to_total_length = (uint64_t)n * pl - pl / 2; // Odd sized last piece
+  TAILQ_INIT(&to->to_active_pieces);
+  LIST_INIT(&to->to_serve_order);
+  to->to_piece_hashes = malloc(n * 20);
+  to->to_cachefile_piece_map = malloc(n * sizeof(int32_t));
+
+  fa_handle_t *fh = fa_open_ex(path, errbuf, sizeof(errbuf), FA_WRITE, NULL);
+  if(fh == NULL) {
+    printf("Unable to create %s -- %s\n", path, errbuf);
+    exit(1);
+  }
+
+  uint8_t *buf = malloc(pl);
+  uint32_t x = 1;
+  for(int i = 0; i < n; i++) {
+    const int len = i == n - 1 ? pl / 2 : pl;
+    for(int j = 0; j < len; j += 4) {
+      x = x * 1664525 + 1013904223;
+      wr32_be(buf + j, x);
+    }
+    sha1_digest(buf, len, to->to_piece_hashes + i * 20);
+    to->to_cachefile_piece_map[i] = i;
+
+    if(fa_write(fh, buf, len) != len) {
+      printf("Write to %s failed\n", path);
+      exit(1);
+    }
+  }
+  free(buf);
+  fa_close(fh);
+
+  to->to_cachefile = fa_open(path, errbuf, sizeof(errbuf));
+  if(to->to_cachefile == NULL) {
+    printf("Unable to open %s -- %s\n", path, errbuf);
+    exit(1);
+  }
+
+  torrent_hash_benchmark_run(to, 1);
+  torrent_hash_benchmark_run(to, MAX(1, gconf.concurrency));
+
+  fa_close(to->to_cachefile);
+  fa_unlink(path, NULL, 0);
+  exit(0);
+}
+
+#endif
+
+
 /**
  *
  */
@@ -1828,6 +2030,11 @@ torrent_asyncio_init(void)
   torrent_settings_init();
   hts_mutex_unlock(&bittorrent_mutex);
 
+#ifdef TORRENT_HASH_BENCHMARK
+  hts_thread_create_detached("bthashbench", torrent_hash_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+#endif
+
 }
 
 INITME(INIT_GROUP_ASYNCIO, torrent_asyncio_init, NULL, 0);
@@ -157,6 +157,7 @@ segment_destroy(hls_segment_t *hs)
 
   if(hs->hs_fh != NULL)
     fa_close(hs->hs_fh);
+  buf_release(hs->hs_prefetch_buf);
 
   TAILQ_REMOVE(&hs->hs_variant->hv_segments, hs, hs_link);
   free(hs->hs_url);
@@ -606,6 +607,14 @@ hls_segment_open(hls_segment_t *hs)
   assert(hs->hs_fh == NULL);
   hs->hs_open_time = arch_get_ts();
   hs->hs_blocked_counter = h->h_blocked;
+  hs->hs_download_time = 0;
+
+  if(!hls_prefetch_open(hd->hd_prefetch, hs, hd->hd_cancellable)) {
+    hs->hs_size = buf_size(hs->hs_prefetch_buf);
+    HLS_TRACE(h, "Opened %s (sequence %d) from prefetch, %d bytes",
+              hs->hs_url, hs->hs_seq, hs->hs_size);
+    return 0;
+  }
 
   foe.foe_open_timeout = 3000;
   foe.foe_cancellable = hd->hd_cancellable;
@@ -622,7 +631,6 @@ hls_segment_open(hls_segment_t *hs)
     if(cancellable_is_cancelled(hd->hd_cancellable))
       return HLS_ERROR_SEGMENT_NOT_FOUND;
 
-    usleep(500000);
     if(foe.foe_protocol_error == 404) {
       return HLS_ERROR_SEGMENT_NOT_FOUND;
     } else if(foe.foe_protocol_error == 403) {
@@ -680,40 +688,26 @@ hls_segment_close(hls_segment_t *hs)
   hls_t *h = hd->hd_hls;
 
   if(hs->hs_blocked_counter == h->h_blocked) {
-    int64_t ts = arch_get_ts() - hs->hs_open_time;
+    int64_t ts = hs->hs_download_time ?: arch_get_ts() - hs->hs_open_time;
     if(ts > 1000) {
       int64_t bw = 8000000LL * hs->hs_size / ts;
       bw = MIN(100000000, bw);
 
+      hls_abr_sample(&hd->hd_abr, hs->hs_size, ts);
+      hd->hd_bw = hls_abr_estimate(&hd->hd_abr);
 
-      int low_buffer = h->h_mp->mp_buffer_delay < 5000000;
-      const char *delta;
-      if(hd->hd_bw == 0) {
-        hd->hd_bw = bw;
-        delta = "Initial";
-      } else if(bw < hd->hd_bw) {
-        delta = "Decrease";
-        if(low_buffer)
-          hd->hd_bw = (hd->hd_bw + bw) / 2;
-        else
-          hd->hd_bw = (hd->hd_bw * 7 + bw) / 8;
-      } else {
-        delta = "Increase";
-        hd->hd_bw = (hd->hd_bw + bw) / 2;
-      }
       HLS_TRACE(h, "Estimated bandwidth updated %d bps "
-                "(most recent segment %d bps) "
-                "buffer: %ds (%s) delta: %s\n",
+                "(most recent segment %d bps) buffer: %ds\n",
                 hd->hd_bw, (int)bw,
-                (int)(h->h_mp->mp_buffer_delay / 1000000),
-                low_buffer ? "Low" : "OK",
-                delta);
+                (int)(h->h_mp->mp_buffer_delay / 1000000));
       hd->hd_bw_updated = 1;
     }
   }
 
   fa_close(hs->hs_fh);
   hs->hs_fh = NULL;
+  buf_release(hs->hs_prefetch_buf);
+  hs->hs_prefetch_buf = NULL;
 }
 
 
@@ -1053,6 +1047,61 @@ demuxer_select_variant_simple(hls_demuxer_t *hd, int64_t now, int bw)
 }
 
 
+/**
+ * Let the ABR policy pick among the variants that are currently
+ * working. Falls back to the simple selector if there is nothing
+ * to choose between
+ */
+static hls_variant_t *
+demuxer_select_variant_abr(hls_demuxer_t *hd, int64_t now, int bw)
+{
+  media_pipe_t *mp = hd->hd_hls->h_mp;
+  hls_variant_t *hv, *vec[HLS_ABR_MAX_VARIANTS];
+  int bitrates[HLS_ABR_MAX_VARIANTS];
+  int lcc = INT32_MAX;
+  int num = 0;
+  int current = -1;
+
+  TAILQ_FOREACH(hv, &hd->hd_variants, hv_link) {
+    if(hv->hv_audio_only)
+      continue;
+    if(hv->hv_corrupt_timer < now - HLS_CORRUPTION_MEASURE_PERIOD)
+      hv->hv_corruptions_last_period = 0;
+
+    lcc = MIN(lcc, hv->hv_corrupt_counter);
+  }
+
+  // Variants are sorted by descending bitrate, ABR wants ascending
+  TAILQ_FOREACH_REVERSE(hv, &hd->hd_variants, hls_variant_queue, hv_link) {
+    if(hv->hv_audio_only || hv->hv_corruptions_last_period >= 3 ||
+       hv->hv_corrupt_counter != lcc)
+      continue;
+    if(num == HLS_ABR_MAX_VARIANTS)
+      break;
+    if(hv == hd->hd_current)
+      current = num;
+    vec[num] = hv;
+    bitrates[num] = hv->hv_bitrate;
+    num++;
+  }
+
+  if(num < 2)
+    return demuxer_select_variant_simple(hd, now, bw);
+
+  int64_t segdur = 0;
+  if(hd->hd_current != NULL)
+    segdur = hd->hd_current->hv_target_duration * 1000000LL;
+
+  int idx = hls_abr_select(&hd->hd_abr, bitrates, num, current,
+                           mp->mp_buffer_delay, segdur);
+
+  HLS_TRACE(hd->hd_hls, "ABR (%s) selected %d bps, buffer: %ds",
+            hls_abr_strategy_name(hd->hd_abr.ha_strategy),
+            bitrates[idx], (int)(mp->mp_buffer_delay / 1000000));
+  return vec[idx];
+}
+
+
 /**
  *
  */
@@ -1091,7 +1140,7 @@ hls_demuxer_select_variant(hls_demuxer_t *hd, int64_t now, int bw)
   if(0)
     return demuxer_select_variant_random(hd);
 
-  return demuxer_select_variant_simple(hd, now, bw);
+  return demuxer_select_variant_abr(hd, now, bw);
 }
 
 
@@ -1123,16 +1172,6 @@ hls_check_bw_switch(hls_demuxer_t *hd)
   if(hv == NULL || hv == hd->hd_current)
     return;
 
-
-  if(hv->hv_bitrate > hd->hd_current->hv_bitrate) {
-    // Stepping up, only do it if we have more than 10s worth of buffer
-    if(mp->mp_buffer_delay < 10000000) {
-      hd->hd_last_switch = now;
-      return;
-    }
-  }
-
-
   hd->hd_last_switch = now;
   hd->hd_req = hv;
 
@@ -1513,6 +1552,8 @@ hls_demuxer_seek(media_pipe_t *mp, hls_demuxer_t *hd, int64_t pos)
 {
   hd->hd_seek_to_segment = pos;
 
+  hls_prefetch_flush(hd->hd_prefetch);
+
   if(hd->hd_current != NULL && hd->hd_current->hv_demuxer_flush)
     hd->hd_current->hv_demuxer_flush(hd->hd_current);
 
@@ -2144,6 +2185,8 @@ hls_demuxer_init(hls_demuxer_t *hd, hls_t *h, const char *type)
   hd->hd_seek_to_segment = PTS_UNSET;
   hd->hd_last_dts = PTS_UNSET;
   hd->hd_cancellable = cancellable_create();
+  hd->hd_prefetch = hls_prefetch_create(h, type);
+  hls_abr_init(&hd->hd_abr, video_settings.hls_abr_strategy);
 }
 
 
@@ -2153,6 +2196,7 @@ hls_demuxer_init(hls_demuxer_t *hd, hls_t *h, const char *type)
 static void
 hls_demuxer_close(media_pipe_t *mp, hls_demuxer_t *hd)
 {
+  hls_prefetch_destroy(hd->hd_prefetch);
   variants_destroy(&hd->hd_variants);
   if(hd->hd_audio_codec != NULL)
     media_codec_deref(hd->hd_audio_codec);
@@ -17,6 +17,8 @@
  *  This program is also available under a commercial proprietary license.
  *  For more information, contact andreas@lonelycoder.com
  */
+#include "hls_abr.h"
+
 event_t *hls_play_extm3u(char *s, const char *url, media_pipe_t *mp,
 			 char *errbuf, size_t errlen,
 			 video_queue_t *vq, struct vsource_list *vsl,
@@ -24,7 +26,6 @@ event_t *hls_play_extm3u(char *s, const char *url, media_pipe_t *mp,
 
 
 
-
 #define HLS_QUEUE_MERGE         0x1
 #define HLS_QUEUE_KEYFRAME_SEEN 0x2
 
@@ -81,8 +82,10 @@ typedef struct hls_segment {
   char hs_mark;
 
   fa_handle_t *hs_fh;
+  buf_t *hs_prefetch_buf;   // Backing store for hs_fh if prefetched
 
   int64_t hs_open_time;
+  int64_t hs_download_time; // Set if prefetched
   int hs_blocked_counter;
 
 } hls_segment_t;
@@ -186,6 +189,7 @@ typedef struct hls_demuxer {
 
   int hd_bw;
   int hd_bw_updated;
+  hls_abr_t hd_abr;
   int64_t hd_download_counter_reset_at;
   int64_t hd_download_counter;
   int64_t hd_download_counter2;
@@ -200,6 +204,8 @@ typedef struct hls_demuxer {
 
   cancellable_t *hd_cancellable;
 
+  struct hls_prefetch *hd_prefetch;
+
   struct hls *hd_hls;
 
   // When set, nothing seems to be working, bail out
@@ -298,6 +304,19 @@ hls_segment_t *hv_find_segment_by_seq(hls_variant_t *hv, int seq);
 
 void hls_bad_variant(hls_variant_t *hv, hls_error_t err);
 
+// Segment prefetcher
+
+struct hls_prefetch *hls_prefetch_create(const hls_t *h, const char *type);
+
+void hls_prefetch_destroy(struct hls_prefetch *hp);
+
+void hls_prefetch_flush(struct hls_prefetch *hp);
+
+void hls_prefetch_schedule(struct hls_prefetch *hp, const hls_segment_t *hs);
+
+int hls_prefetch_open(struct hls_prefetch *hp, hls_segment_t *hs,
+                      const cancellable_t *c);
+
 // TS demuxer
 
 media_buf_t *hls_ts_demuxer_read(hls_demuxer_t *hd);
@@ -0,0 +1,525 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <math.h>
+#include <string.h>
+
+#include "hls_abr.h"
+
+#define ABR_FAST_HALFLIFE 2.0  // seconds of download time
+#define ABR_SLOW_HALFLIFE 5.0
+
+#define ABR_THROUGHPUT_SAFETY 0.9
+
+#define ABR_STEP_UP_BUFFER 10000000  // Throughput rule only steps up above
+
+#define ABR_BOLA_MIN_BUFFER       10.0  // seconds
+#define ABR_BOLA_BUFFER_PER_LEVEL 2.0
+#define ABR_BOLA_STABLE_BUFFER    12.0
+
+// HLS_ABR_DYNAMIC switches to BOLA above ON and back below OFF
+#define ABR_DYNAMIC_BOLA_ON  12000000
+#define ABR_DYNAMIC_BOLA_OFF 6000000
+
+
+/**
+ *
+ */
+static double
+ewma_update(double est, double halflife, double weight, double value)
+{
+  const double adj = pow(0.5, weight / halflife);
+  return value * (1.0 - adj) + adj * est;
+}
+
+
+/**
+ *
+ */
+void
+hls_abr_init(hls_abr_t *ha, hls_abr_strategy_t strategy)
+{
+  memset(ha, 0, sizeof(hls_abr_t));
+  ha->ha_strategy = strategy < HLS_ABR_num ? strategy : HLS_ABR_DYNAMIC;
+}
+
+
+/**
+ * Feed a completed download into the estimator. 'duration' is in µs
+ */
+void
+hls_abr_sample(hls_abr_t *ha, int64_t bytes, int64_t duration)
+{
+  hls_abr_estimator_t *hae = &ha->ha_est;
+
+  if(duration <= 1000 || bytes <= 0)
+    return;
+
+  const double weight = duration / 1000000.0;
+  const double bps = bytes * 8.0 / weight;
+
+  hae->hae_fast = ewma_update(hae->hae_fast, ABR_FAST_HALFLIFE, weight, bps);
+  hae->hae_slow = ewma_update(hae->hae_slow, ABR_SLOW_HALFLIFE, weight, bps);
+  hae->hae_total_weight += weight;
+  hae->hae_samples++;
+}
+
+
+/**
+ * Current throughput estimate in bps, 0 if we know nothing yet
+ */
+int
+hls_abr_estimate(const hls_abr_t *ha)
+{
+  const hls_abr_estimator_t *hae = &ha->ha_est;
+
+  if(hae->hae_samples == 0)
+    return 0;
+
+  // Both averages start at zero, correct for that bias
+  const double w = hae->hae_total_weight;
+  const double fast = hae->hae_fast / (1.0 - pow(0.5, w / ABR_FAST_HALFLIFE));
+  const double slow = hae->hae_slow / (1.0 - pow(0.5, w / ABR_SLOW_HALFLIFE));
+  const double est = fast < slow ? fast : slow;
+  return est > 2e9 ? 2000000000 : (int)est;
+}
+
+
+/**
+ * Highest rendition we can sustain at current throughput
+ */
+static int
+abr_throughput_index(const hls_abr_t *ha, const int *bitrates, int num)
+{
+  const double budget = hls_abr_estimate(ha) * ABR_THROUGHPUT_SAFETY;
+  int i;
+  for(i = num - 1; i > 0; i--)
+    if(bitrates[i] <= budget)
+      break;
+  return i;
+}
+
+
+/**
+ * Pick the highest rendition the throughput estimate allows but only
+ * step up when there is some buffer to fall back on
+ */
+static int
+abr_select_throughput(hls_abr_t *ha, const int *bitrates, int num,
+                      int current, int64_t buffer, int64_t segment_duration)
+{
+  if(hls_abr_estimate(ha) == 0)
+    return current >= 0 ? current : 0;
+
+  int idx = abr_throughput_index(ha, bitrates, num);
+
+  if(current >= 0 && idx > current && buffer < ABR_STEP_UP_BUFFER)
+    return current;
+
+  // Only step down when the current rendition can't be sustained at
+  // all, the safety margin applies to stepping up
+  if(current >= 0 && current < num && idx < current &&
+     bitrates[current] <= hls_abr_estimate(ha))
+    return current;
+  return idx;
+}
+
+
+/**
+ * BOLA-BASIC (Spiteri et al.) with the oscillation guard from BOLA-O.
+ * Each rendition gets utility ln(bitrate / lowest bitrate) and we pick
+ * the one maximizing (V * (utility + gp) - Q) / size where Q is the
+ * buffer level. V and gp are derived from the buffer we want to keep
+ */
+static int
+abr_select_bola(hls_abr_t *ha, const int *bitrates, int num,
+                int current, int64_t buffer, int64_t segment_duration)
+{
+  if(bitrates[0] <= 0)
+    return abr_select_throughput(ha, bitrates, num, current, buffer,
+                                 segment_duration);
+
+  const double segdur =
+    segment_duration > 0 ? segment_duration / 1000000.0 : 6.0;
+
+  if(buffer > ha->ha_buffer_peak)
+    ha->ha_buffer_peak = buffer;
+
+  /*
+   * The buffer is limited in bytes rather than time so we don't know
+   * how much we can keep. Aim for a bit below the highest level seen,
+   * otherwise BOLA would never reach the top rendition
+   */
+  const double buffer_time =
+    fmin(fmax(ABR_BOLA_STABLE_BUFFER,
+              ABR_BOLA_MIN_BUFFER + ABR_BOLA_BUFFER_PER_LEVEL * num),
+         fmax(ha->ha_buffer_peak / 1000000.0 * 0.9, 2 * segdur));
+  const double min_buffer = fmin(ABR_BOLA_MIN_BUFFER, buffer_time / 2);
+
+  // Utilities are offset by one so the lowest rendition has utility 1
+  const double umax = log((double)bitrates[num - 1] / bitrates[0]) + 1.0;
+  const double gp = num > 1 ?
+    (umax - 1.0) / (buffer_time / min_buffer - 1.0) : 1.0;
+  const double vp = min_buffer / gp;
+
+  // BOLA works in units of segments, so scale accordingly
+  const double q = buffer / 1000000.0 / segdur;
+  const double v = vp / segdur;
+
+  int best = 0;
+  double best_score = -INFINITY;
+
+  for(int i = 0; i < num; i++) {
+    const double u = log((double)bitrates[i] / bitrates[0]) + 1.0;
+    const double score = (v * (u + gp) - q) / bitrates[i];
+    if(score >= best_score) {
+      best_score = score;
+      best = i;
+    }
+  }
+
+  if(current >= 0 && best > current && hls_abr_estimate(ha) > 0) {
+    // Never step up past what the network can sustain
+    int tput = abr_throughput_index(ha, bitrates, num);
+    if(best > tput)
+      best = tput > current ? tput : current;
+  }
+
+  // With a small buffer, don't pick anything that would drain it
+  // before the segment has arrived
+  const double est = hls_abr_estimate(ha);
+  if(est > 0) {
+    const double budget = est * buffer / 1000000.0 * 0.75;
+    while(best > 0 && bitrates[best] * segdur > budget)
+      best--;
+  }
+  return best;
+}
+
+
+/**
+ * Throughput while the buffer is filling up, BOLA when stable
+ */
+static int
+abr_select_dynamic(hls_abr_t *ha, const int *bitrates, int num,
+                   int current, int64_t buffer, int64_t segment_duration)
+{
+  if(ha->ha_bola_active && buffer < ABR_DYNAMIC_BOLA_OFF)
+    ha->ha_bola_active = 0;
+  else if(!ha->ha_bola_active && buffer >= ABR_DYNAMIC_BOLA_ON)
+    ha->ha_bola_active = 1;
+
+  if(ha->ha_bola_active)
+    return abr_select_bola(ha, bitrates, num, current, buffer,
+                           segment_duration);
+  return abr_select_throughput(ha, bitrates, num, current, buffer,
+                               segment_duration);
+}
+
+
+static const hls_abr_policy_t hls_abr_policies[HLS_ABR_num] = {
+  [HLS_ABR_DYNAMIC]    = { "dynamic",    abr_select_dynamic },
+  [HLS_ABR_THROUGHPUT] = { "throughput", abr_select_throughput },
+  [HLS_ABR_BOLA]       = { "bola",       abr_select_bola },
+};
+
+
+/**
+ *
+ */
+int
+hls_abr_select(hls_abr_t *ha, const int *bitrates, int num, int current,
+               int64_t buffer, int64_t segment_duration)
+{
+  if(num <= 1)
+    return 0;
+
+  const hls_abr_policy_t *hap = &hls_abr_policies[ha->ha_strategy];
+  return hap->select(ha, bitrates, num, current, buffer, segment_duration);
+}
+
+
+/**
+ *
+ */
+const char *
+hls_abr_strategy_name(hls_abr_strategy_t strategy)
+{
+  if(strategy >= HLS_ABR_num)
+    return "unknown";
+  return hls_abr_policies[strategy].name;
+}
+
+
+
+#ifdef HLS_ABR_SIMULATE
+
+/**
+ * Offline simulator. Replays a bandwidth trace against each strategy
+ * and reports average bitrate and rebuffering. Build with
+ *
+ *   cc -O2 -DHLS_ABR_SIMULATE -o abrsim src/backend/hls/hls_abr.c -lm
+ *
+ * Trace files have one "<seconds> <kbps>" pair per line ('#' starts a
+ * comment), the trace is looped if the session outlasts it. Without a
+ * trace file a synthetic one with periodic congestion is used
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SIM_MAX_TRACE  100000
+#define SIM_MAX_LEVELS 16
+
+typedef struct sim_trace {
+  double duration[SIM_MAX_TRACE];
+  double bps[SIM_MAX_TRACE];
+  int num;
+  int pos;
+  double left;  // Time left in current trace entry
+} sim_trace_t;
+
+typedef struct sim_result {
+  double avg_bitrate;
+  double rebuffer_time;
+  int rebuffer_events;
+  int switches;
+  double startup;
+} sim_result_t;
+
+
+static void
+sim_trace_rewind(sim_trace_t *st)
+{
+  st->pos = 0;
+  st->left = st->duration[0];
+}
+
+
+/**
+ * Advance trace time by 't' seconds
+ */
+static void
+sim_trace_idle(sim_trace_t *st, double t)
+{
+  while(t > 0) {
+    double d = t < st->left ? t : st->left;
+    st->left -= d;
+    t -= d;
+    if(st->left <= 0) {
+      st->pos = (st->pos + 1) % st->num;
+      st->left = st->duration[st->pos];
+    }
+  }
+}
+
+
+/**
+ * Download 'bits', returns time it took
+ */
+static double
+sim_trace_download(sim_trace_t *st, double bits)
+{
+  double t = 0.05; // Request round trip
+  sim_trace_idle(st, t);
+
+  while(bits > 0) {
+    const double bps = st->bps[st->pos];
+    if(bps <= 0) {
+      t += st->left;
+      sim_trace_idle(st, st->left);
+      continue;
+    }
+    double d = bits / bps;
+    if(d > st->left) {
+      d = st->left;
+      bits -= d * bps;
+    } else {
+      bits = 0;
+    }
+    t += d;
+    sim_trace_idle(st, d);
+  }
+  return t;
+}
+
+
+/**
+ *
+ */
+static void
+sim_run(sim_trace_t *st, hls_abr_strategy_t strategy, const int *ladder,
+        int levels, double segdur, double max_buffer, int segments,
+        sim_result_t *sr)
+{
+  hls_abr_t ha;
+  double buffer = 0;
+  double bitrate_sum = 0;
+  int current = -1;
+  int playing = 0;
+
+  hls_abr_init(&ha, strategy);
+  sim_trace_rewind(st);
+  memset(sr, 0, sizeof(sim_result_t));
+
+  for(int i = 0; i < segments; i++) {
+
+    int idx = hls_abr_select(&ha, ladder, levels, current,
+                             buffer * 1000000, segdur * 1000000);
+    if(current != -1 && idx != current)
+      sr->switches++;
+    current = idx;
+
+    const double bits = ladder[idx] * segdur;
+    const double t = sim_trace_download(st, bits);
+
+    hls_abr_sample(&ha, bits / 8, t * 1000000);
+
+    if(!playing) {
+      sr->startup += t;
+    } else if(t > buffer) {
+      sr->rebuffer_time += t - buffer;
+      sr->rebuffer_events++;
+      buffer = 0;
+    } else {
+      buffer -= t;
+    }
+
+    buffer += segdur;
+    playing = 1;
+    bitrate_sum += ladder[idx];
+
+    if(buffer > max_buffer) {
+      sim_trace_idle(st, buffer - max_buffer);
+      buffer = max_buffer;
+    }
+  }
+  sr->avg_bitrate = bitrate_sum / segments;
+}
+
+
+/**
+ *
+ */
+static void
+sim_load_trace(sim_trace_t *st, const char *path)
+{
+  char line[256];
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  while(st->num < SIM_MAX_TRACE && fgets(line, sizeof(line), fp) != NULL) {
+    double d, kbps;
+    if(line[0] == '#')
+      continue;
+    if(sscanf(line, "%lf %lf", &d, &kbps) != 2 || d <= 0)
+      continue;
+    st->duration[st->num] = d;
+    st->bps[st->num] = kbps * 1000;
+    st->num++;
+  }
+  fclose(fp);
+
+  if(st->num == 0) {
+    fprintf(stderr, "%s: No samples in trace\n", path);
+    exit(1);
+  }
+}
+
+
+/**
+ * 5 Mbps link that drops to 800 kbps for 20s every minute with
+ * some jitter
+ */
+static void
+sim_synthetic_trace(sim_trace_t *st)
+{
+  unsigned int seed = 1;
+  for(int i = 0; i < 600; i++) {
+    seed = seed * 1103515245 + 12345;
+    const double jitter = 0.75 + ((seed >> 16) % 1000) / 2000.0;
+    st->duration[i] = 1;
+    st->bps[i] = ((i % 60) < 40 ? 5000000 : 800000) * jitter;
+  }
+  st->num = 600;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  static sim_trace_t st;
+  int ladder[SIM_MAX_LEVELS] = {250000, 500000, 1000000,
+                                2000000, 3500000, 6000000};
+  int levels = 6;
+  double segdur = 4;
+  double max_buffer = 30;
+  int segments = 300;
+  int opt;
+
+  while((opt = getopt(argc, argv, "l:s:b:n:")) != -1) {
+    switch(opt) {
+    case 'l':
+      levels = 0;
+      for(char *s = optarg; *s && levels < SIM_MAX_LEVELS; ) {
+        ladder[levels++] = strtol(s, &s, 10) * 1000;
+        if(*s == ',')
+          s++;
+      }
+      break;
+    case 's':
+      segdur = atof(optarg);
+      break;
+    case 'b':
+      max_buffer = atof(optarg);
+      break;
+    case 'n':
+      segments = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-l kbps,kbps,...] [-s segment seconds] "
+              "[-b max buffer seconds] [-n segments] [trace]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if(optind < argc)
+    sim_load_trace(&st, argv[optind]);
+  else
+    sim_synthetic_trace(&st);
+
+  printf("%-10s %10s %10s %8s %8s %8s\n",
+         "strategy", "avg kbps", "rebuf (s)", "stalls", "switches",
+         "startup");
+
+  for(int i = 0; i < HLS_ABR_num; i++) {
+    sim_result_t sr;
+    sim_run(&st, i, ladder, levels, segdur, max_buffer, segments, &sr);
+    printf("%-10s %10.0f %10.1f %8d %8d %8.1f\n",
+           hls_abr_strategy_name(i), sr.avg_bitrate / 1000,
+           sr.rebuffer_time, sr.rebuffer_events, sr.switches, sr.startup);
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+#include <stdint.h>
+
+/**
+ * Adaptive bitrate selection
+ *
+ * Kept free of any media/HLS dependencies so it can be built standalone
+ * for the trace simulator (see HLS_ABR_SIMULATE in hls_abr.c)
+ */
+
+#define HLS_ABR_MAX_VARIANTS 32
+
+typedef enum {
+  HLS_ABR_DYNAMIC = 0,  // Throughput at low buffer, BOLA once buffered
+  HLS_ABR_THROUGHPUT,
+  HLS_ABR_BOLA,
+  HLS_ABR_num,
+} hls_abr_strategy_t;
+
+
+/**
+ * Throughput estimator, a fast and a slow EWMA weighted by download
+ * time. The estimate is the lower of the two so we react quickly to
+ * drops but are slow to believe in improvements
+ */
+typedef struct hls_abr_estimator {
+  double hae_fast;
+  double hae_slow;
+  double hae_total_weight;
+  int hae_samples;
+} hls_abr_estimator_t;
+
+
+/**
+ *
+ */
+typedef struct hls_abr {
+  hls_abr_estimator_t ha_est;
+  hls_abr_strategy_t ha_strategy;
+  int ha_bola_active;   // Used by HLS_ABR_DYNAMIC
+  int64_t ha_buffer_peak;
+} hls_abr_t;
+
+
+/**
+ * Selection policy. 'bitrates' is sorted in ascending order, 'current'
+ * is the index of the currently playing rendition (or -1). Buffer level
+ * and segment duration are in µs. Returns index to play next
+ */
+typedef struct hls_abr_policy {
+  const char *name;
+  int (*select)(hls_abr_t *ha, const int *bitrates, int num, int current,
+                int64_t buffer, int64_t segment_duration);
+} hls_abr_policy_t;
+
+
+void hls_abr_init(hls_abr_t *ha, hls_abr_strategy_t strategy);
+
+void hls_abr_sample(hls_abr_t *ha, int64_t bytes, int64_t duration);
+
+int hls_abr_estimate(const hls_abr_t *ha);
+
+int hls_abr_select(hls_abr_t *ha, const int *bitrates, int num, int current,
+                   int64_t buffer, int64_t segment_duration);
+
+const char *hls_abr_strategy_name(hls_abr_strategy_t strategy);
@@ -0,0 +1,518 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+#include "media/media.h"
+#include "backend/backend.h"
+#include "misc/str.h"
+#include "misc/minmax.h"
+#include "misc/cancellable.h"
+#include "fileaccess/fileaccess.h"
+#include "video/video_settings.h"
+#include "hls.h"
+
+/**
+ * Segment prefetcher
+ *
+ * When the demuxer opens a segment we queue download of the following
+ * hp_depth segments of the same variant. A worker thread fetches them
+ * (including the AES key and decryption) into memory so when the demuxer
+ * gets to the next segment it can be opened without any network
+ * round trip.
+ *
+ * Segments are downloaded one at a time. Parallel downloads would share
+ * the link and each would measure only a fraction of the bandwidth which
+ * makes the variant selection pick too low a bitrate. Downloading stops
+ * when HLS_PREFETCH_MAX_BUFFERED bytes are waiting for the demuxer
+ *
+ * Jobs copy everything they need from the segment so the demuxer is free
+ * to destroy segments (playlist reloads) while jobs are in flight. The
+ * variant pointer is only used for matching
+ */
+
+#define HLS_PREFETCH_MAX_DEPTH 8
+#define HLS_PREFETCH_MAX_BUFFERED (16 * 1024 * 1024)
+
+TAILQ_HEAD(hls_prefetch_job_queue, hls_prefetch_job);
+
+typedef enum {
+  HPJ_QUEUED,
+  HPJ_RUNNING,
+  HPJ_DONE,
+  HPJ_FAILED,
+} hpj_state_t;
+
+/**
+ *
+ */
+typedef struct hls_prefetch_job {
+  TAILQ_ENTRY(hls_prefetch_job) hpj_link;
+
+  const hls_variant_t *hpj_variant;
+  int hpj_seq;
+
+  char *hpj_url;
+  int hpj_byte_offset;
+  int hpj_byte_size;
+
+  uint8_t hpj_crypto;
+  uint8_t hpj_iv[16];
+  rstr_t *hpj_key_url;
+
+  hpj_state_t hpj_state;
+  char hpj_abandoned;  // Running job no longer wanted, worker frees it
+
+  cancellable_t *hpj_cancellable;
+
+  buf_t *hpj_buf;
+  int64_t hpj_download_time;
+
+} hls_prefetch_job_t;
+
+
+/**
+ *
+ */
+typedef struct hls_prefetch {
+  hts_mutex_t hp_mutex;
+  hts_cond_t hp_cond;
+
+  struct hls_prefetch_job_queue hp_jobs;
+
+  int hp_depth;
+  int hp_thread_running;
+  hts_thread_t hp_thread;
+  int hp_stop;
+
+  size_t hp_buffered; // Bytes in completed jobs
+
+  rstr_t *hp_key_url;
+  buf_t *hp_key;
+
+  const hls_t *hp_hls;
+  const char *hp_type;
+
+} hls_prefetch_t;
+
+
+/**
+ *
+ */
+static void
+hpj_destroy(hls_prefetch_job_t *hpj)
+{
+  cancellable_release(hpj->hpj_cancellable);
+  buf_release(hpj->hpj_buf);
+  rstr_release(hpj->hpj_key_url);
+  free(hpj->hpj_url);
+  free(hpj);
+}
+
+
+/**
+ * Drop a job from the queue. Running jobs are cancelled and freed
+ * by the worker once it returns
+ */
+static void
+hpj_discard(hls_prefetch_t *hp, hls_prefetch_job_t *hpj)
+{
+  TAILQ_REMOVE(&hp->hp_jobs, hpj, hpj_link);
+
+  if(hpj->hpj_buf != NULL) {
+    hp->hp_buffered -= buf_size(hpj->hpj_buf);
+    hts_cond_broadcast(&hp->hp_cond);
+  }
+
+  if(hpj->hpj_state == HPJ_RUNNING) {
+    hpj->hpj_abandoned = 1;
+    cancellable_cancel(hpj->hpj_cancellable);
+    return;
+  }
+  hpj_destroy(hpj);
+}
+
+
+/**
+ * Get the key for a job, the most recently used key is cached.
+ * Called without hp_mutex held
+ */
+static buf_t *
+hls_prefetch_get_key(hls_prefetch_t *hp, hls_prefetch_job_t *hpj)
+{
+  char errbuf[256];
+  buf_t *key = NULL;
+
+  hts_mutex_lock(&hp->hp_mutex);
+  if(rstr_eq(hp->hp_key_url, hpj->hpj_key_url))
+    key = buf_retain(hp->hp_key);
+  hts_mutex_unlock(&hp->hp_mutex);
+
+  if(key != NULL)
+    return key;
+
+  key = fa_load(rstr_get(hpj->hpj_key_url),
+                FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
+                FA_LOAD_CANCELLABLE(hpj->hpj_cancellable),
+                NULL);
+  if(key == NULL) {
+    HLS_TRACE(hp->hp_hls, "%s: Prefetch unable to load key %s -- %s",
+              hp->hp_type, rstr_get(hpj->hpj_key_url), errbuf);
+    return NULL;
+  }
+
+  hts_mutex_lock(&hp->hp_mutex);
+  rstr_set(&hp->hp_key_url, hpj->hpj_key_url);
+  buf_release(hp->hp_key);
+  hp->hp_key = buf_retain(key);
+  hts_mutex_unlock(&hp->hp_mutex);
+  return key;
+}
+
+
+/**
+ * Download (and decrypt) a segment into memory
+ */
+static buf_t *
+hls_prefetch_load(hls_prefetch_t *hp, hls_prefetch_job_t *hpj)
+{
+  fa_open_extra_t foe = {0};
+  char errbuf[256];
+
+  foe.foe_open_timeout = 3000;
+  foe.foe_cancellable = hpj->hpj_cancellable;
+
+  int flags = hpj->hpj_byte_offset != -1 ? 0 : FA_STREAMING;
+
+  fa_handle_t *fh = fa_open_ex(hpj->hpj_url, errbuf, sizeof(errbuf),
+                               flags, &foe);
+  if(fh == NULL) {
+    HLS_TRACE(hp->hp_hls, "%s: Prefetch of %s failed -- %s",
+              hp->hp_type, hpj->hpj_url, errbuf);
+    return NULL;
+  }
+
+  fa_set_read_timeout(fh, 3000);
+
+  if(hpj->hpj_byte_size != -1 && hpj->hpj_byte_offset != -1)
+    fh = fa_slice_open(fh, hpj->hpj_byte_offset, hpj->hpj_byte_size);
+
+  int64_t size = fa_fsize(fh);
+
+  if(hpj->hpj_crypto == HLS_CRYPTO_AES128) {
+    buf_t *key = hls_prefetch_get_key(hp, hpj);
+    if(key == NULL) {
+      fa_close(fh);
+      return NULL;
+    }
+    fh = fa_aescbc_open(fh, hpj->hpj_iv, buf_c8(key));
+    buf_release(key);
+  }
+
+  size_t alloced = size > 0 ? size : 1024 * 1024;
+  size_t used = 0;
+  uint8_t *mem = malloc(alloced);
+
+  while(mem != NULL) {
+    if(used >= HLS_PREFETCH_MAX_BUFFERED) {
+      HLS_TRACE(hp->hp_hls, "%s: Prefetch of %s skipped, segment too big",
+                hp->hp_type, hpj->hpj_url);
+      free(mem);
+      mem = NULL;
+      break;
+    }
+
+    if(used == alloced) {
+      alloced *= 2;
+      mem = myreallocf(mem, alloced);
+      if(mem == NULL)
+        break;
+    }
+
+    int r = fa_read(fh, mem + used, MIN(alloced - used, 65536));
+    if(r == 0)
+      break;
+
+    if(r < 0 || cancellable_is_cancelled(hpj->hpj_cancellable)) {
+      free(mem);
+      mem = NULL;
+      break;
+    }
+    used += r;
+  }
+
+  fa_close(fh);
+
+  if(mem == NULL)
+    return NULL;
+  return buf_create_and_adopt(used, mem, &free);
+}
+
+
+/**
+ *
+ */
+static void *
+hls_prefetch_thread(void *aux)
+{
+  hls_prefetch_t *hp = aux;
+  hls_prefetch_job_t *hpj;
+
+  hts_mutex_lock(&hp->hp_mutex);
+
+  while(!hp->hp_stop) {
+
+    TAILQ_FOREACH(hpj, &hp->hp_jobs, hpj_link)
+      if(hpj->hpj_state == HPJ_QUEUED)
+        break;
+
+    if(hpj == NULL || hp->hp_buffered >= HLS_PREFETCH_MAX_BUFFERED) {
+      hts_cond_wait(&hp->hp_cond, &hp->hp_mutex);
+      continue;
+    }
+
+    hpj->hpj_state = HPJ_RUNNING;
+    hts_mutex_unlock(&hp->hp_mutex);
+
+    int64_t ts = arch_get_ts();
+    buf_t *b = hls_prefetch_load(hp, hpj);
+    ts = arch_get_ts() - ts;
+
+    hts_mutex_lock(&hp->hp_mutex);
+
+    if(hpj->hpj_abandoned) {
+      buf_release(b);
+      hpj_destroy(hpj);
+      continue;
+    }
+
+    hpj->hpj_buf = b;
+    if(b != NULL)
+      hp->hp_buffered += buf_size(b);
+    hpj->hpj_download_time = ts;
+    hpj->hpj_state = b != NULL ? HPJ_DONE : HPJ_FAILED;
+
+    HLS_TRACE(hp->hp_hls, "%s: Prefetched sequence %d: %s, %d bytes in %d ms",
+              hp->hp_type, hpj->hpj_seq, b != NULL ? "OK" : "FAIL",
+              b != NULL ? (int)buf_size(b) : 0, (int)(ts / 1000));
+
+    hts_cond_broadcast(&hp->hp_cond);
+  }
+
+  hts_mutex_unlock(&hp->hp_mutex);
+  return NULL;
+}
+
+
+/**
+ *
+ */
+hls_prefetch_t *
+hls_prefetch_create(const hls_t *h, const char *type)
+{
+  const int depth = MIN(video_settings.hls_prefetch_segments,
+                        HLS_PREFETCH_MAX_DEPTH);
+  if(depth <= 0)
+    return NULL;
+
+  hls_prefetch_t *hp = calloc(1, sizeof(hls_prefetch_t));
+  hts_mutex_init(&hp->hp_mutex);
+  hts_cond_init(&hp->hp_cond, &hp->hp_mutex);
+  TAILQ_INIT(&hp->hp_jobs);
+  hp->hp_depth = depth;
+  hp->hp_hls = h;
+  hp->hp_type = type;
+  return hp;
+}
+
+
+/**
+ *
+ */
+void
+hls_prefetch_destroy(hls_prefetch_t *hp)
+{
+  hls_prefetch_job_t *hpj;
+
+  if(hp == NULL)
+    return;
+
+  hts_mutex_lock(&hp->hp_mutex);
+  hp->hp_stop = 1;
+  while((hpj = TAILQ_FIRST(&hp->hp_jobs)) != NULL)
+    hpj_discard(hp, hpj);
+  hts_cond_broadcast(&hp->hp_cond);
+  hts_mutex_unlock(&hp->hp_mutex);
+
+  if(hp->hp_thread_running)
+    hts_thread_join(&hp->hp_thread);
+
+  buf_release(hp->hp_key);
+  rstr_release(hp->hp_key_url);
+  hts_cond_destroy(&hp->hp_cond);
+  hts_mutex_destroy(&hp->hp_mutex);
+  free(hp);
+}
+
+
+/**
+ * Cancel all prefetching, used on seek and variant switch
+ */
+void
+hls_prefetch_flush(hls_prefetch_t *hp)
+{
+  hls_prefetch_job_t *hpj;
+
+  if(hp == NULL)
+    return;
+
+  hts_mutex_lock(&hp->hp_mutex);
+  while((hpj = TAILQ_FIRST(&hp->hp_jobs)) != NULL)
+    hpj_discard(hp, hpj);
+  hts_mutex_unlock(&hp->hp_mutex);
+}
+
+
+/**
+ * Called when the demuxer starts reading from 'hs'. Makes sure the
+ * following hp_depth segments are queued and drops everything else
+ */
+void
+hls_prefetch_schedule(hls_prefetch_t *hp, const hls_segment_t *hs)
+{
+  hls_prefetch_job_t *hpj, *next;
+  const hls_segment_t *want[HLS_PREFETCH_MAX_DEPTH];
+  int num_want = 0;
+
+  if(hp == NULL)
+    return;
+
+  const hls_variant_t *hv = hs->hs_variant;
+
+  for(const hls_segment_t *n = TAILQ_NEXT(hs, hs_link);
+      n != NULL && num_want < hp->hp_depth; n = TAILQ_NEXT(n, hs_link)) {
+    if(n->hs_permanent_error)
+      continue;
+    want[num_want++] = n;
+  }
+
+  hts_mutex_lock(&hp->hp_mutex);
+
+  for(hpj = TAILQ_FIRST(&hp->hp_jobs); hpj != NULL; hpj = next) {
+    next = TAILQ_NEXT(hpj, hpj_link);
+
+    int i;
+    for(i = 0; i < num_want; i++) {
+      if(want[i] != NULL && hpj->hpj_variant == hv &&
+         hpj->hpj_seq == want[i]->hs_seq) {
+        want[i] = NULL; // Already queued
+        break;
+      }
+    }
+
+    if(i == num_want)
+      hpj_discard(hp, hpj);
+  }
+
+  for(int i = 0; i < num_want; i++) {
+    const hls_segment_t *n = want[i];
+    if(n == NULL)
+      continue;
+
+    hpj = calloc(1, sizeof(hls_prefetch_job_t));
+    hpj->hpj_variant = hv;
+    hpj->hpj_seq = n->hs_seq;
+    hpj->hpj_url = strdup(n->hs_url);
+    hpj->hpj_byte_offset = n->hs_byte_offset;
+    hpj->hpj_byte_size = n->hs_byte_size;
+    hpj->hpj_crypto = n->hs_crypto;
+    memcpy(hpj->hpj_iv, n->hs_iv, 16);
+    hpj->hpj_key_url = rstr_dup(n->hs_key_url);
+    hpj->hpj_cancellable = cancellable_create();
+    hpj->hpj_state = HPJ_QUEUED;
+    TAILQ_INSERT_TAIL(&hp->hp_jobs, hpj, hpj_link);
+  }
+
+  if(!hp->hp_thread_running && num_want > 0) {
+    hts_thread_create_joinable("hlsprefetch", &hp->hp_thread,
+                               hls_prefetch_thread, hp, THREAD_PRIO_DEMUXER);
+    hp->hp_thread_running = 1;
+  }
+
+  hts_cond_broadcast(&hp->hp_cond);
+  hts_mutex_unlock(&hp->hp_mutex);
+}
+
+
+/**
+ * If 'hs' has been prefetched, hand the data to the segment and
+ * return 0. Waits for a queued or running download to finish.
+ * Returns -1 if the caller should open the segment itself
+ */
+int
+hls_prefetch_open(hls_prefetch_t *hp, hls_segment_t *hs,
+                  const cancellable_t *c)
+{
+  hls_prefetch_job_t *hpj;
+  int rval = -1;
+
+  if(hp == NULL)
+    return -1;
+
+  hts_mutex_lock(&hp->hp_mutex);
+
+  while(1) {
+    TAILQ_FOREACH(hpj, &hp->hp_jobs, hpj_link)
+      if(hpj->hpj_variant == hs->hs_variant && hpj->hpj_seq == hs->hs_seq)
+        break;
+
+    if(hpj == NULL || cancellable_is_cancelled(c))
+      break;
+
+    if(hpj->hpj_state == HPJ_QUEUED &&
+       hp->hp_buffered >= HLS_PREFETCH_MAX_BUFFERED) {
+      // Worker won't get to it until something is consumed
+      hpj_discard(hp, hpj);
+      break;
+    }
+
+    if(hpj->hpj_state == HPJ_QUEUED || hpj->hpj_state == HPJ_RUNNING) {
+      hts_cond_wait_timeout(&hp->hp_cond, &hp->hp_mutex, 100);
+      continue;
+    }
+
+    if(hpj->hpj_state == HPJ_DONE) {
+      hs->hs_prefetch_buf = hpj->hpj_buf;
+      hpj->hpj_buf = NULL;
+      hp->hp_buffered -= buf_size(hs->hs_prefetch_buf);
+      hts_cond_broadcast(&hp->hp_cond);
+      hs->hs_download_time = hpj->hpj_download_time;
+      hs->hs_fh = memfile_make(buf_data(hs->hs_prefetch_buf),
+                               buf_size(hs->hs_prefetch_buf));
+      rval = 0;
+    }
+
+    hpj_discard(hp, hpj);
+    break;
+  }
+
+  hts_mutex_unlock(&hp->hp_mutex);
+  return rval;
+}
@@ -1068,6 +1068,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       HLS_TRACE(h, "Switching from %s to %s",
                 hd->hd_current->hv_name, hd->hd_req->hv_name);
       hls_variant_close(hd->hd_current);
+      hls_prefetch_flush(hd->hd_prefetch);
 
       hd->hd_current = hd->hd_req;
       hd->hd_req = NULL;
@@ -1143,6 +1144,7 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
       }
 
       int attempts = 0;
+      int reopened = 0;
 
       while(1) {
 
@@ -1172,11 +1174,23 @@ hls_ts_demuxer_read(hls_demuxer_t *hd)
           }
         }
 
+        if(err == HLS_ERROR_SEGMENT_BROKEN && !reopened) {
+          /*
+           * Transient open failure (timeout, connection reset, etc).
+           * Retry right away once instead of stalling the demuxer,
+           * hls_bad_variant() throttles if it keeps failing
+           */
+          reopened = 1;
+          HLS_TRACE(h, "Segment %d failed to open, retrying", hs->hs_seq);
+          continue;
+        }
+
         if(err) {
           hls_bad_variant(hv, err);
           return NULL;
         }
         hv->hv_current_seg = hs;
+        hls_prefetch_schedule(hd->hd_prefetch, hs);
         td->td_mux_mode = TD_MUX_MODE_UNSET;
         break;
       }
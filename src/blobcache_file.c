@@ -28,6 +28,7 @@
 #include "misc/pool.h"
 #include "misc/sha.h"
 #include "misc/murmur3.h"
+#include "misc/callout.h"
 #include "arch/arch.h"
 #include "arch/threads.h"
 #include "arch/atomic.h"
@@ -36,16 +37,37 @@
 #include "misc/minmax.h"
 #include "fileaccess/fileaccess.h"
 
+#if ENABLE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 #define bcprintf(x...) // printf(x)
 
 // Flags
 
+#define BC2_MAGIC_08      0x62630208
 #define BC2_MAGIC_07      0x62630207
 #define BC2_MAGIC_06      0x62630206
 #define BC2_MAGIC_05      0x62630205
 
+#define BC2_SEGMENT_MAGIC 0x62637367
+
+/**
+ * Blobs up to this size are appended to segment files instead of
+ * being stored in a file of their own
+ */
+#define SEGMENT_BLOB_MAXSIZE (64 * 1024)
+
+/**
+ * Start a new segment file when the current one grows beyond this
+ */
+#define SEGMENT_MAXSIZE (16 * 1024 * 1024)
+
 typedef struct blobcache_item {
   struct blobcache_item *bi_link;
+  struct blobcache_flush *bi_flush; // Pending write, if any
   char *bi_etag;
   uint64_t bi_key_hash;
   uint64_t bi_content_hash;
@@ -53,8 +75,12 @@ typedef struct blobcache_item {
   uint32_t bi_expiry;
   uint32_t bi_modtime;
   uint32_t bi_size;
+  uint32_t bi_segment; // 0 if stored in a file of its own
+  uint32_t bi_offset;  // Offset of record in segment
+  uint32_t bi_stored;  // Bytes on disk, 0 if nothing written yet
   uint8_t bi_content_type_len;
   uint8_t bi_flags;
+  uint8_t bi_etag_mapped; // bi_etag points into the loaded index
 } blobcache_item_t;
 
 typedef struct blobcache_diskitem_06 {
@@ -82,6 +108,39 @@ typedef struct blobcache_diskitem_07 {
   uint8_t di_etag[0];
 } __attribute__((packed)) blobcache_diskitem_07_t;
 
+/**
+ * Fixed size records so the index can be used straight from a
+ * mapping. Etags are kept in a string area after the records
+ */
+typedef struct blobcache_diskitem_08 {
+  uint64_t di_key_hash;
+  uint64_t di_content_hash;
+  uint32_t di_lastaccess;
+  uint32_t di_expiry;
+  uint32_t di_modtime;
+  uint32_t di_size;
+  uint32_t di_segment;
+  uint32_t di_offset;
+  uint32_t di_stored;
+  uint32_t di_etag_offset; // 0 == no etag
+  uint8_t di_flags;
+  uint8_t di_content_type_len;
+  uint8_t di_pad[6];
+} blobcache_diskitem_08_t;
+
+#define BC2_HEADER_08_SIZE 16
+
+/**
+ * Header for each blob in a segment file
+ */
+typedef struct blobcache_segment_record {
+  uint32_t sr_magic;
+  uint32_t sr_size;
+  uint64_t sr_key_hash;
+  uint8_t sr_content_type_len;
+  uint8_t sr_pad[7];
+} blobcache_segment_record_t;
+
 
 TAILQ_HEAD(blobcache_flush_queue, blobcache_flush);
 
@@ -92,16 +151,42 @@ typedef struct blobcache_flush {
 } blobcache_flush_t;
 
 
+LIST_HEAD(blobcache_segment_list, blobcache_segment);
 
-#define ITEM_HASH_SIZE 256
-#define ITEM_HASH_MASK (ITEM_HASH_SIZE - 1)
+typedef struct blobcache_segment {
+  LIST_ENTRY(blobcache_segment) seg_link;
+  uint32_t seg_id;
+  uint32_t seg_size; // Bytes in file
+  uint32_t seg_live; // Bytes referenced by items
+} blobcache_segment_t;
 
-static blobcache_item_t *hashvector[ITEM_HASH_SIZE];
 
-static struct blobcache_flush_queue flush_queue;
+/**
+ * The item index is split in shards, each with its own lock and
+ * a hash table that grows with the number of items
+ */
+#define BC_SHARDS 16
+#define BC_SHARD_INITIAL_HASH_SIZE 64
 
-static pool_t *item_pool;
+typedef struct blobcache_shard {
+  hts_mutex_t bsh_lock;
+  blobcache_item_t **bsh_hash;
+  unsigned int bsh_hash_size;
+  unsigned int bsh_items;
+  pool_t *bsh_pool;
+} blobcache_shard_t;
+
+static blobcache_shard_t shards[BC_SHARDS];
+
+/**
+ * cache_lock protects the flush queue, segments and the global
+ * state below. If both are needed a shard lock must be taken first
+ */
+static struct blobcache_flush_queue flush_queue;
+static struct blobcache_segment_list segments;
+static pool_t *flush_pool;
 static hts_mutex_t cache_lock;
+static HTS_MUTEX_DECL(save_mutex); // Serializes writers of the index
 static hts_cond_t cache_cond;
 static hts_thread_t bcthread;
 static enum {
@@ -114,11 +199,29 @@ static int loaded_cache_is_from;
 
 static int index_dirty;
 
+// The loaded index, kept around as items refer to etags in it
+static void *index_base;
+static size_t index_size;
+static int index_is_mapped;
+
+// Segment currently appended to, only touched by the flush thread
+static blobcache_segment_t *active_segment;
+static fa_handle_t *active_segment_fh;
+static uint32_t next_segment_id = 1;
+
 #define BLOB_CACHE_MINSIZE   (10 * 1000 * 1000)
 #define BLOB_CACHE_MAXSIZE (1000 * 1000 * 1000)
 
 static uint64_t current_cache_size;
 
+// Stats
+static atomic_t bc_hits;
+static atomic_t bc_misses;
+static atomic_t bc_expired;
+static atomic_t bc_latency_sum; // µs
+static int bc_latency_max;      // µs, updated without locking
+static atomic_t bc_compactions;
+
 /**
  *
  */
@@ -186,87 +289,306 @@ make_filename(char *buf, size_t len, uint64_t hash, int for_write)
  *
  */
 static void
-save_index(void)
+make_segment_filename(char *buf, size_t len, uint32_t id)
+{
+  snprintf(buf, len, "%s/bc2/segments/%08x.seg", gconf.cache_path, id);
+}
+
+
+/**
+ *
+ */
+static blobcache_shard_t *
+shard_for(uint64_t dk)
+{
+  return &shards[dk >> 60];
+}
+
+
+/**
+ * Shard must be locked
+ */
+static blobcache_item_t **
+shard_bucket(blobcache_shard_t *bsh, uint64_t dk)
+{
+  return &bsh->bsh_hash[dk & (bsh->bsh_hash_size - 1)];
+}
+
+
+/**
+ * Shard must be locked
+ */
+static blobcache_item_t *
+lookup_item(blobcache_shard_t *bsh, uint64_t dk)
+{
+  blobcache_item_t *p;
+  for(p = *shard_bucket(bsh, dk); p != NULL; p = p->bi_link)
+    if(p->bi_key_hash == dk)
+      return p;
+  return NULL;
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+shard_grow(blobcache_shard_t *bsh)
+{
+  const unsigned int newsize = bsh->bsh_hash_size * 2;
+  blobcache_item_t **nh = calloc(newsize, sizeof(blobcache_item_t *));
+  blobcache_item_t *p, *n;
+
+  for(unsigned int i = 0; i < bsh->bsh_hash_size; i++) {
+    for(p = bsh->bsh_hash[i]; p != NULL; p = n) {
+      n = p->bi_link;
+      p->bi_link = nh[p->bi_key_hash & (newsize - 1)];
+      nh[p->bi_key_hash & (newsize - 1)] = p;
+    }
+  }
+  free(bsh->bsh_hash);
+  bsh->bsh_hash = nh;
+  bsh->bsh_hash_size = newsize;
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+shard_insert(blobcache_shard_t *bsh, blobcache_item_t *p)
+{
+  blobcache_item_t **b = shard_bucket(bsh, p->bi_key_hash);
+  p->bi_link = *b;
+  *b = p;
+  bsh->bsh_items++;
+  if(bsh->bsh_items > bsh->bsh_hash_size * 2)
+    shard_grow(bsh);
+}
+
+
+/**
+ *
+ */
+static void
+lock_all_shards(void)
+{
+  for(int i = 0; i < BC_SHARDS; i++)
+    hts_mutex_lock(&shards[i].bsh_lock);
+}
+
+
+/**
+ *
+ */
+static void
+unlock_all_shards(void)
+{
+  for(int i = BC_SHARDS - 1; i >= 0; i--)
+    hts_mutex_unlock(&shards[i].bsh_lock);
+}
+
+
+/**
+ *
+ */
+static void
+item_set_etag(blobcache_item_t *p, const char *etag)
+{
+  if(p->bi_etag_mapped) {
+    p->bi_etag = NULL;
+    p->bi_etag_mapped = 0;
+  }
+  mystrset(&p->bi_etag, etag);
+}
+
+
+/**
+ * cache_lock must be held
+ */
+static blobcache_segment_t *
+segment_find(uint32_t id)
+{
+  blobcache_segment_t *seg;
+  LIST_FOREACH(seg, &segments, seg_link)
+    if(seg->seg_id == id)
+      return seg;
+  return NULL;
+}
+
+
+/**
+ * Some bytes in a segment are no longer referenced.
+ * cache_lock must be held
+ */
+static void
+segment_dead(uint32_t id, uint32_t bytes)
+{
+  blobcache_segment_t *seg = segment_find(id);
+  if(seg != NULL)
+    seg->seg_live -= MIN(seg->seg_live, bytes);
+}
+
+
+/**
+ * Release the on-disk storage for an item.
+ * Shard must be locked, cache_lock must be held
+ */
+static void
+item_release_storage(blobcache_item_t *p)
+{
+  if(p->bi_segment) {
+    segment_dead(p->bi_segment, p->bi_stored);
+  } else if(p->bi_stored) {
+    char filename[PATH_MAX];
+    make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
+    fa_unlink(filename, NULL, 0);
+  }
+  p->bi_segment = 0;
+  p->bi_stored = 0;
+}
+
+
+/**
+ * Shard must be locked, cache_lock must be held
+ */
+static void
+prune_item(blobcache_shard_t *bsh, blobcache_item_t *p)
+{
+  item_release_storage(p);
+  if(!p->bi_etag_mapped)
+    free(p->bi_etag);
+  current_cache_size -= p->bi_size;
+  bsh->bsh_items--;
+  pool_put(bsh->bsh_pool, p);
+}
+
+
+/**
+ * save_mutex must be held
+ */
+static void
+save_index_locked(void)
 {
   char errbuf[512];
   char filename[PATH_MAX];
-  uint8_t *out, *base;
+  char tmpfile[PATH_MAX];
+  uint8_t *out, *base, *etags;
   int i;
   blobcache_item_t *p;
-  blobcache_diskitem_07_t *di;
-  size_t siz;
+  blobcache_diskitem_08_t *di;
+  size_t siz, etagsize = 1;
 
-  if(!index_dirty)
+  hts_mutex_lock(&cache_lock);
+  if(!index_dirty) {
+    hts_mutex_unlock(&cache_lock);
     return;
+  }
+  index_dirty = 0;
+  hts_mutex_unlock(&cache_lock);
 
   snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
+  snprintf(tmpfile, sizeof(tmpfile), "%s/bc2/index.tmp", gconf.cache_path);
 
-  fa_handle_t *fh = fa_open_ex(filename, errbuf, sizeof(errbuf),
-                               FA_WRITE, NULL);
-  if(fh == NULL) {
-    TRACE(TRACE_ERROR, "blobcache", "Unable to write index %s -- %s",
-          filename, errbuf);
-    return;
-  }
+  lock_all_shards();
 
   int items = 0;
-  siz = 12 + 20;
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      siz += sizeof(blobcache_diskitem_07_t);
-      siz += p->bi_etag ? strlen(p->bi_etag) : 0;
-      items++;
+  for(i = 0; i < BC_SHARDS; i++) {
+    const blobcache_shard_t *bsh = &shards[i];
+    for(int j = 0; j < bsh->bsh_hash_size; j++) {
+      for(p = bsh->bsh_hash[j]; p != NULL; p = p->bi_link) {
+        if(p->bi_stored == 0)
+          continue; // Not written yet, will be saved when it is
+        etagsize += p->bi_etag ? strlen(p->bi_etag) + 1 : 0;
+        items++;
+      }
     }
   }
 
+  siz = BC2_HEADER_08_SIZE + items * sizeof(blobcache_diskitem_08_t) +
+    etagsize + 20;
+
   base = out = mymalloc(siz);
   if(out == NULL) {
-    fa_close(fh);
+    unlock_all_shards();
     return;
   }
-  *(uint32_t *)out = BC2_MAGIC_07;
+
+  *(uint32_t *)out = BC2_MAGIC_08;
   out += 4;
   *(uint32_t *)out = items;
   out += 4;
   *(uint32_t *)out = time(NULL);
   out += 4;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      const int etaglen = p->bi_etag ? strlen(p->bi_etag) : 0;
-      di = (blobcache_diskitem_07_t *)out;
-      di->di_key_hash     = p->bi_key_hash;
-      di->di_content_hash = p->bi_content_hash;
-      di->di_lastaccess   = p->bi_lastaccess;
-      di->di_expiry       = p->bi_expiry;
-      di->di_modtime      = p->bi_modtime;
-      di->di_size         = p->bi_size;
-      di->di_flags        = p->bi_flags;
-      di->di_etaglen      = etaglen;
-      di->di_content_type_len = p->bi_content_type_len;
-      out += sizeof(blobcache_diskitem_07_t);
-      if(etaglen) {
-	memcpy(out, p->bi_etag, etaglen);
-	out += etaglen;
-      }
+  *(uint32_t *)out = etagsize;
+  out += 4;
 
+  etags = out + items * sizeof(blobcache_diskitem_08_t);
+  uint32_t etagoff = 1;
+  etags[0] = 0;
+
+  for(i = 0; i < BC_SHARDS; i++) {
+    const blobcache_shard_t *bsh = &shards[i];
+    for(int j = 0; j < bsh->bsh_hash_size; j++) {
+      for(p = bsh->bsh_hash[j]; p != NULL; p = p->bi_link) {
+        if(p->bi_stored == 0)
+          continue;
+        di = (blobcache_diskitem_08_t *)out;
+        memset(di, 0, sizeof(blobcache_diskitem_08_t));
+        di->di_key_hash     = p->bi_key_hash;
+        di->di_content_hash = p->bi_content_hash;
+        di->di_lastaccess   = p->bi_lastaccess;
+        di->di_expiry       = p->bi_expiry;
+        di->di_modtime      = p->bi_modtime;
+        di->di_size         = p->bi_size;
+        di->di_segment      = p->bi_segment;
+        di->di_offset       = p->bi_offset;
+        di->di_stored       = p->bi_stored;
+        di->di_flags        = p->bi_flags;
+        di->di_content_type_len = p->bi_content_type_len;
+        if(p->bi_etag != NULL) {
+          const int len = strlen(p->bi_etag) + 1;
+          memcpy(etags + etagoff, p->bi_etag, len);
+          di->di_etag_offset = etagoff;
+          etagoff += len;
+        }
+        out += sizeof(blobcache_diskitem_08_t);
+      }
     }
   }
+  unlock_all_shards();
+
+  out = etags + etagsize;
 
   sha1_decl(shactx);
   sha1_init(shactx);
   sha1_update(shactx, base, siz - 20);
   sha1_final(shactx, out);
 
+  // Write to a new file and rename it in place. The old index might
+  // still be mapped
+  fa_handle_t *fh = fa_open_ex(tmpfile, errbuf, sizeof(errbuf),
+                               FA_WRITE, NULL);
+  if(fh == NULL) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to write index %s -- %s",
+          tmpfile, errbuf);
+    free(base);
+    return;
+  }
+
   if(fa_write(fh, base, siz) != siz) {
     TRACE(TRACE_INFO, "blobcache", "Unable to store index file %s -- %s",
-	  filename, strerror(errno));
+	  tmpfile, strerror(errno));
+    fa_close(fh);
   } else {
-    index_dirty = 0;
+    fa_close(fh);
+    if(fa_rename(tmpfile, filename, errbuf, sizeof(errbuf)))
+      TRACE(TRACE_INFO, "blobcache", "Unable to rename index file -- %s",
+            errbuf);
   }
 
   free(base);
-  fa_close(fh);
 }
 
 
@@ -274,45 +596,136 @@ save_index(void)
  *
  */
 static void
-load_index(void)
+save_index(void)
 {
+  hts_mutex_lock(&save_mutex);
+  save_index_locked();
+  hts_mutex_unlock(&save_mutex);
+}
+
+
+/**
+ * Map (or read) the index file into memory
+ */
+static void *
+index_map(const char *filename, size_t *sizep)
+{
+#if ENABLE_MMAP
+  struct stat st;
+  void *p;
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1) {
+    TRACE(TRACE_DEBUG, "blobcache", "Unable to open index %s -- %s",
+          filename, strerror(errno));
+    return NULL;
+  }
+
+  if(fstat(fd, &st) || st.st_size < 20) {
+    close(fd);
+    return NULL;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED)
+    return NULL;
+
+  index_is_mapped = 1;
+  *sizep = st.st_size;
+  return p;
+#else
   char errbuf[512];
-  char filename[PATH_MAX];
-  const uint8_t *in;
   void *base;
-  int i;
-  blobcache_item_t *p;
-  uint8_t digest[20];
-
-  snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
 
   fa_handle_t *fh = fa_open(filename, errbuf, sizeof(errbuf));
   if(fh == NULL) {
     TRACE(TRACE_DEBUG, "blobcache", "Unable to open index %s -- %s",
           filename, errbuf);
-    return;
+    return NULL;
   }
 
   int64_t size = fa_fsize(fh);
 
   if(size < 20) {
     fa_close(fh);
-    return;
+    return NULL;
   }
 
-  in = base = mymalloc(size);
+  base = mymalloc(size);
   if(base == NULL) {
     fa_close(fh);
-    return;
+    return NULL;
   }
 
   size_t r = fa_read(fh, base, size);
   fa_close(fh);
   if(r != size) {
     free(base);
+    return NULL;
+  }
+  *sizep = size;
+  return base;
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+index_unmap(void)
+{
+  if(index_base == NULL)
     return;
+#if ENABLE_MMAP
+  if(index_is_mapped)
+    munmap(index_base, index_size);
+  else
+#endif
+    free(index_base);
+  index_base = NULL;
+}
+
+
+/**
+ * Account a stored item in the segment table.
+ * cache_lock must be held (or no other threads running)
+ */
+static void
+segment_account(const blobcache_item_t *p)
+{
+  blobcache_segment_t *seg = segment_find(p->bi_segment);
+  if(seg == NULL) {
+    seg = calloc(1, sizeof(blobcache_segment_t));
+    seg->seg_id = p->bi_segment;
+    LIST_INSERT_HEAD(&segments, seg, seg_link);
+    next_segment_id = MAX(next_segment_id, p->bi_segment + 1);
   }
+  seg->seg_live += p->bi_stored;
+}
+
+
+/**
+ *
+ */
+static void
+load_index(void)
+{
+  char filename[PATH_MAX];
+  const uint8_t *in;
+  const char *etagarea = NULL;
+  int i;
+  blobcache_item_t *p;
+  uint8_t digest[20];
+  size_t size;
+
+  snprintf(filename, sizeof(filename), "%s/bc2/index.dat", gconf.cache_path);
 
+  if((index_base = index_map(filename, &size)) == NULL)
+    return;
+
+  index_size = size;
+  in = index_base;
 
   sha1_decl(shactx);
   sha1_init(shactx);
@@ -320,7 +733,7 @@ load_index(void)
   sha1_final(shactx, digest);
 
   if(memcmp(digest, in + size - 20, 20)) {
-    free(base);
+    index_unmap();
     TRACE(TRACE_INFO, "blobcache", "Index file corrupt, throwing away cache");
     return;
   }
@@ -333,10 +746,23 @@ load_index(void)
   TRACE(TRACE_DEBUG, "blobcache", "Cache magic 0x%08x %d items", magic, items);
 
   switch(magic) {
+  case BC2_MAGIC_08:
+    loaded_cache_is_from = *(uint32_t *)in;
+    in += 4;
+    uint32_t etagsize = *(uint32_t *)in;
+    in += 4;
+    if(BC2_HEADER_08_SIZE + items * sizeof(blobcache_diskitem_08_t) +
+       etagsize + 20 != size) {
+      TRACE(TRACE_INFO, "blobcache", "Index file has bad size");
+      index_unmap();
+      return;
+    }
+    etagarea = (const char *)in + items * sizeof(blobcache_diskitem_08_t);
+    break;
+
   case BC2_MAGIC_06:
-    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
-    // FALLTHRU
   case BC2_MAGIC_07:
+    TRACE(TRACE_INFO, "blobcache", "Upgrading from older format 0x%08x", magic);
     loaded_cache_is_from = *(uint32_t *)in;
     in += 4;
     break;
@@ -347,14 +773,21 @@ load_index(void)
 
   default:
     TRACE(TRACE_INFO, "blobcache", "Invalid magic 0x%08x", magic);
-    free(base);
+    index_unmap();
     return;
   }
 
 
   for(i = 0; i < items; i++) {
-    p = pool_get(item_pool);
-    int etaglen;
+    int etaglen = 0;
+    const uint64_t dk = *(const uint64_t *)in;
+    blobcache_shard_t *bsh = shard_for(dk);
+    p = pool_get(bsh->bsh_pool);
+    p->bi_flush = NULL;
+    p->bi_etag = NULL;
+    p->bi_etag_mapped = 0;
+    p->bi_segment = 0;
+    p->bi_offset = 0;
 
     switch(magic) {
     case BC2_MAGIC_05:
@@ -369,6 +802,7 @@ load_index(void)
       p->bi_size             = di->di_size;
       p->bi_content_type_len = di->di_content_type_len;
       p->bi_flags            = 0;
+      p->bi_stored           = p->bi_size + p->bi_content_type_len;
       etaglen                = di->di_etaglen;
       in += sizeof(blobcache_diskitem_06_t);
     }
@@ -385,10 +819,34 @@ load_index(void)
       p->bi_size             = di->di_size;
       p->bi_content_type_len = di->di_content_type_len;
       p->bi_flags            = di->di_flags;
+      p->bi_stored           = p->bi_size + p->bi_content_type_len;
       etaglen                = di->di_etaglen;
       in += sizeof(blobcache_diskitem_07_t);
     }
       break;
+
+    case BC2_MAGIC_08: {
+      const blobcache_diskitem_08_t *di = (blobcache_diskitem_08_t *)in;
+
+      p->bi_key_hash         = di->di_key_hash;
+      p->bi_content_hash     = di->di_content_hash;
+      p->bi_lastaccess       = di->di_lastaccess;
+      p->bi_expiry           = di->di_expiry;
+      p->bi_modtime          = di->di_modtime;
+      p->bi_size             = di->di_size;
+      p->bi_segment          = di->di_segment;
+      p->bi_offset           = di->di_offset;
+      p->bi_stored           = di->di_stored;
+      p->bi_content_type_len = di->di_content_type_len;
+      p->bi_flags            = di->di_flags;
+      if(di->di_etag_offset) {
+        // Refer directly to the string in the loaded index
+        p->bi_etag = (char *)etagarea + di->di_etag_offset;
+        p->bi_etag_mapped = 1;
+      }
+      in += sizeof(blobcache_diskitem_08_t);
+    }
+      break;
     default:
       abort(); // Prevent compilers whining about etaglen not initialized
     }
@@ -398,14 +856,17 @@ load_index(void)
       memcpy(p->bi_etag, in, etaglen);
       p->bi_etag[etaglen] = 0;
       in += etaglen;
-    } else {
-      p->bi_etag = NULL;
     }
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
+
+    if(p->bi_segment)
+      segment_account(p);
+
+    shard_insert(bsh, p);
     current_cache_size += p->bi_size;
   }
-  free(base);
+
+  if(magic != BC2_MAGIC_08)
+    index_unmap(); // Nothing refers to old formats
 }
 
 
@@ -420,6 +881,7 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
   uint64_t dk = digest_key(key, stash);
   uint64_t dc = digest_content(b->b_ptr, b->b_size);
   uint32_t now = time(NULL);
+  blobcache_shard_t *bsh = shard_for(dk);
   blobcache_item_t *p;
 
   if(etag != NULL && strlen(etag) > 255)
@@ -427,26 +889,26 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
 
   bcprintf("cache: Writing %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
   if(bcstate != BLOBCACHE_RUN) {
     bcprintf("Cache not running\n");
-    hts_mutex_unlock(&cache_lock);
     return 0;
   }
 
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      break;
+  hts_mutex_lock(&bsh->bsh_lock);
 
-  hts_cond_signal(&cache_cond);
-  index_dirty = 1;
+  p = lookup_item(bsh, dk);
 
   if(p != NULL && p->bi_content_hash == dc && p->bi_size == b->b_size) {
     p->bi_modtime = mtime;
     p->bi_expiry = now + maxage;
     p->bi_lastaccess = now;
     p->bi_flags = flags;
-    mystrset(&p->bi_etag, etag);
+    item_set_etag(p, etag);
+    hts_mutex_unlock(&bsh->bsh_lock);
+
+    hts_mutex_lock(&cache_lock);
+    index_dirty = 1;
+    hts_cond_signal(&cache_cond);
     hts_mutex_unlock(&cache_lock);
     bcprintf("Already in\n");
     return 1;
@@ -454,37 +916,184 @@ blobcache_put(const char *key, const char *stash, buf_t *b,
 
   bcprintf("Ok\n");
 
-  blobcache_flush_t *bf = pool_get(item_pool);
-  bf->bf_key_hash = dk;
-  bf->bf_buf = buf_retain(b);
-  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
-  hts_cond_signal(&cache_cond);
-
   if(p == NULL) {
-    p = pool_get(item_pool);
+    p = pool_get(bsh->bsh_pool);
     p->bi_key_hash = dk;
     p->bi_size = 0;
     p->bi_content_type_len = 0;
-    p->bi_link = hashvector[dk & ITEM_HASH_MASK];
     p->bi_etag = NULL;
-    hashvector[dk & ITEM_HASH_MASK] = p;
+    p->bi_etag_mapped = 0;
+    p->bi_segment = 0;
+    p->bi_offset = 0;
+    p->bi_stored = 0;
+    shard_insert(bsh, p);
   }
 
   int64_t expiry = (int64_t)maxage + now;
 
   p->bi_modtime = mtime;
-  mystrset(&p->bi_etag, etag);
+  item_set_etag(p, etag);
   p->bi_expiry = MIN(INT32_MAX, expiry);
   p->bi_lastaccess = now;
   p->bi_content_hash = dc;
-  current_cache_size -= p->bi_size;
-  p->bi_size = b->b_size;
-  current_cache_size += p->bi_size;
   p->bi_content_type_len = b->b_content_type ?
     strlen(rstr_get(b->b_content_type)) : 0;
   p->bi_flags = flags;
+
+  hts_mutex_lock(&cache_lock);
+  blobcache_flush_t *bf = pool_get(flush_pool);
+  bf->bf_key_hash = dk;
+  bf->bf_buf = buf_retain(b);
+  TAILQ_INSERT_TAIL(&flush_queue, bf, bf_link);
+  p->bi_flush = bf;
+
+  current_cache_size -= p->bi_size;
+  p->bi_size = b->b_size;
+  current_cache_size += p->bi_size;
+  index_dirty = 1;
+  hts_cond_signal(&cache_cond);
+  hts_mutex_unlock(&cache_lock);
+
+  hts_mutex_unlock(&bsh->bsh_lock);
+  return 0;
+}
+
+
+/**
+ * Read a blob stored in a segment
+ */
+static buf_t *
+segment_read(uint32_t segment, uint32_t offset, uint64_t dk,
+             uint32_t size, int ctlen, int pad)
+{
+  char filename[PATH_MAX];
+  blobcache_segment_record_t sr;
+  buf_t *b;
+
+  make_segment_filename(filename, sizeof(filename), segment);
+  fa_handle_t *fh = fa_open(filename, NULL, 0);
+  if(fh == NULL)
+    return NULL;
+
+  if(fa_seek(fh, offset, SEEK_SET) != offset ||
+     fa_read(fh, &sr, sizeof(sr)) != sizeof(sr) ||
+     sr.sr_magic != BC2_SEGMENT_MAGIC || sr.sr_key_hash != dk ||
+     sr.sr_size != size || sr.sr_content_type_len != ctlen) {
+    fa_close(fh);
+    return NULL;
+  }
+
+  b = buf_create(size + pad);
+  if(b == NULL) {
+    fa_close(fh);
+    return NULL;
+  }
+  b->b_size = size;
+
+  if(ctlen) {
+    b->b_content_type = rstr_allocl(NULL, ctlen);
+    if(fa_read(fh, rstr_data(b->b_content_type), ctlen) != ctlen) {
+      buf_release(b);
+      fa_close(fh);
+      return NULL;
+    }
+  }
+
+  if(fa_read(fh, b->b_ptr, size) != size) {
+    buf_release(b);
+    fa_close(fh);
+    return NULL;
+  }
+  memset(b->b_ptr + size, 0, pad);
+  fa_close(fh);
+  return b;
+}
+
+
+/**
+ * Read a blob stored in a file of its own
+ */
+static buf_t *
+file_read(uint64_t dk, uint32_t size, int ctlen, int pad)
+{
+  char filename[PATH_MAX];
+  buf_t *b;
+
+  make_filename(filename, sizeof(filename), dk, 0);
+  fa_handle_t *fh = fa_open(filename, NULL, 0);
+  if(fh == NULL)
+    return NULL;
+
+  if(fa_fsize(fh) != size + ctlen) {
+    fa_close(fh);
+    fa_unlink(filename, NULL, 0);
+    return NULL;
+  }
+
+  b = buf_create(size + pad);
+  if(b == NULL) {
+    fa_close(fh);
+    return NULL;
+  }
+  b->b_size = size; // Get rid of padding in reported length
+  if(ctlen) {
+    b->b_content_type = rstr_allocl(NULL, ctlen);
+    if(fa_read(fh, rstr_data(b->b_content_type), ctlen) != ctlen) {
+      buf_release(b);
+      fa_close(fh);
+      return NULL;
+    }
+  }
+
+  if(fa_read(fh, b->b_ptr, size) != size) {
+    buf_release(b);
+    fa_close(fh);
+    return NULL;
+  }
+  memset(b->b_ptr + size, 0, pad);
+  fa_close(fh);
+  return b;
+}
+
+
+/**
+ * Shard must be locked, cache_lock must be held
+ */
+static void
+unlink_item(blobcache_shard_t *bsh, blobcache_item_t *p)
+{
+  blobcache_item_t **q;
+
+  for(q = shard_bucket(bsh, p->bi_key_hash); *q != p; q = &(*q)->bi_link) {}
+  *q = p->bi_link;
+  prune_item(bsh, p);
+  index_dirty = 1;
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+remove_item(blobcache_shard_t *bsh, blobcache_item_t *p)
+{
+  hts_mutex_lock(&cache_lock);
+  unlink_item(bsh, p);
   hts_mutex_unlock(&cache_lock);
-  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+blobcache_stats_latency(int64_t ts)
+{
+  const int lat = arch_get_ts() - ts;
+  if(atomic_add_and_fetch(&bc_latency_sum, lat) < 0)
+    atomic_set(&bc_latency_sum, 0);
+  if(lat > bc_latency_max)
+    bc_latency_max = lat;
 }
 
 
@@ -496,26 +1105,28 @@ blobcache_get(const char *key, const char *stash, int pad,
 	      int *ignore_expiry, char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
-  blobcache_item_t *p, **q;
-  char filename[PATH_MAX];
+  blobcache_shard_t *bsh = shard_for(dk);
+  blobcache_item_t *p;
   uint32_t now;
+  int64_t ts = arch_get_ts();
+  int retry = 0;
 
   bcprintf("cache: Reading %s ... ", key);
 
-  hts_mutex_lock(&cache_lock);
+ again:
+  hts_mutex_lock(&bsh->bsh_lock);
 
   if(bcstate == BLOBCACHE_STOPPING) {
     bcprintf("Cache stopped ... ");
     p = NULL;
   } else {
-    for(q = &hashvector[dk & ITEM_HASH_MASK]; (p = *q); q = &p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
+    p = lookup_item(bsh, dk);
   }
 
   if(p == NULL) {
     bcprintf("Item not found\n");
-    hts_mutex_unlock(&cache_lock);
+    hts_mutex_unlock(&bsh->bsh_lock);
+    atomic_inc(&bc_misses);
     return NULL;
   }
 
@@ -529,39 +1140,31 @@ blobcache_get(const char *key, const char *stash, int pad,
            expired ? "yes":"no",
            clock_ok ? "" : " (Bad system clock)");
 
-  if(expired && ignore_expiry == NULL)
-    goto bad;
-
-  blobcache_flush_t *bf;
-  buf_t *b = NULL;
-  fa_handle_t *fh = NULL;
-  TAILQ_FOREACH_REVERSE(bf, &flush_queue, blobcache_flush_queue, bf_link) {
-    if(bf->bf_key_hash == p->bi_key_hash) {
-      // Item is not yet written to disk
-      b = buf_retain(bf->bf_buf);
-      break;
-    }
+  if(expired && ignore_expiry == NULL) {
+    remove_item(bsh, p);
+    hts_mutex_unlock(&bsh->bsh_lock);
+    atomic_inc(&bc_expired);
+    return NULL;
   }
 
-  if(b == NULL) {
-    make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-    fh = fa_open(filename, NULL, 0);
-    if(fh == NULL) {
-    bad:
-      *q = p->bi_link;
-      pool_put(item_pool, p);
-      hts_mutex_unlock(&cache_lock);
-      return NULL;
-    }
-
-    int64_t size = fa_fsize(fh);
+  buf_t *b = NULL;
 
-    if(size != p->bi_size + p->bi_content_type_len) {
-      fa_unlink(filename, NULL, 0);
-      goto bad;
-    }
+  if(p->bi_flush != NULL) {
+    // Item is not yet written to disk
+    b = buf_retain(p->bi_flush->bf_buf);
+  } else if(p->bi_stored == 0) {
+    remove_item(bsh, p);
+    hts_mutex_unlock(&bsh->bsh_lock);
+    atomic_inc(&bc_misses);
+    return NULL;
   }
 
+  // Copy what we need to read the item without holding the lock
+  const uint32_t segment = p->bi_segment;
+  const uint32_t offset = p->bi_offset;
+  const uint32_t size = p->bi_size;
+  const int ctlen = p->bi_content_type_len;
+
   if(mtimep)
     *mtimep = p->bi_modtime;
 
@@ -572,39 +1175,47 @@ blobcache_get(const char *key, const char *stash, int pad,
   if(bcstate == BLOBCACHE_RUN)
     p->bi_lastaccess = now;
 
-  index_dirty = 1; // We don't deem it important enough to wakeup on get
-
   if(ignore_expiry != NULL)
     *ignore_expiry = expired;
 
-  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bsh->bsh_lock);
 
   if(b == NULL) {
 
-    b = buf_create(p->bi_size + pad);
+    if(segment)
+      b = segment_read(segment, offset, dk, size, ctlen, pad);
+    else
+      b = file_read(dk, size, ctlen, pad);
+
     if(b == NULL) {
-      fa_close(fh);
-      return NULL;
-    }
-    b->b_size = p->bi_size; // Get rid of padding in reported length
-    if(p->bi_content_type_len) {
-      b->b_content_type = rstr_allocl(NULL, p->bi_content_type_len);
-      if(fa_read(fh, rstr_data(b->b_content_type), p->bi_content_type_len) !=
-	 p->bi_content_type_len) {
-	buf_release(b);
-	fa_close(fh);
-	return NULL;
+      if(etagp != NULL) {
+        free(*etagp);
+        *etagp = NULL;
       }
-    }
 
-    if(fa_read(fh, b->b_ptr, p->bi_size) != p->bi_size) {
-      buf_release(b);
-      fa_close(fh);
+      hts_mutex_lock(&bsh->bsh_lock);
+      p = lookup_item(bsh, dk);
+      if(p != NULL && !retry &&
+         (p->bi_segment != segment || p->bi_offset != offset ||
+          p->bi_flush != NULL)) {
+        // Item was moved (segment compaction) or rewritten while we
+        // were reading, try again
+        hts_mutex_unlock(&bsh->bsh_lock);
+        retry = 1;
+        goto again;
+      }
+      if(p != NULL)
+        remove_item(bsh, p);
+      hts_mutex_unlock(&bsh->bsh_lock);
+      atomic_inc(&bc_misses);
       return NULL;
     }
-    memset(b->b_ptr + p->bi_size, 0, pad);
-    fa_close(fh);
   }
+
+  // We don't deem it important enough to wakeup on get
+  index_dirty = 1;
+  atomic_inc(&bc_hits);
+  blobcache_stats_latency(ts);
   return b;
 }
 
@@ -616,20 +1227,20 @@ blobcache_get(const char *key, const char *stash, int pad,
  *
  */
 int
-blobcache_get_meta(const char *key, const char *stash, 
+blobcache_get_meta(const char *key, const char *stash,
 		   char **etagp, time_t *mtimep)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_shard_t *bsh = shard_for(dk);
   blobcache_item_t *p;
   int r;
-  hts_mutex_lock(&cache_lock);
+
+  hts_mutex_lock(&bsh->bsh_lock);
 
   if(bcstate == BLOBCACHE_STOPPING) {
     p = NULL;
   } else {
-    for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-      if(p->bi_key_hash == dk)
-	break;
+    p = lookup_item(bsh, dk);
   }
 
   if(p != NULL) {
@@ -645,24 +1256,49 @@ blobcache_get_meta(const char *key, const char *stash,
     r = -1;
   }
 
-  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bsh->bsh_lock);
   return r;
 }
 
 
 /**
- * Assume we're locked
+ * Remove segment files we don't know about
  */
-static blobcache_item_t *
-lookup_item(uint64_t dk)
+static void
+prune_stale_segments(void)
 {
-  blobcache_item_t *p;
-  for(p = hashvector[dk & ITEM_HASH_MASK]; p != NULL; p = p->bi_link)
-    if(p->bi_key_hash == dk)
-      return p;
-  return NULL;
+  fa_dir_t *d;
+  fa_dir_entry_t *de;
+  char path[PATH_MAX];
+  char path2[PATH_MAX];
+  uint32_t id;
+
+  snprintf(path, sizeof(path), "%s/bc2/segments", gconf.cache_path);
+
+  if((d = fa_scandir(path, NULL, 0)) == NULL)
+    return;
+
+  RB_FOREACH(de, &d->fd_entries, fde_link) {
+    const char *n = rstr_get(de->fde_filename);
+    snprintf(path2, sizeof(path2), "%s/%s", path, n);
+
+    hts_mutex_lock(&cache_lock);
+    blobcache_segment_t *seg = NULL;
+    if(sscanf(n, "%08x.seg", &id) == 1)
+      seg = segment_find(id);
+
+    if(seg == NULL) {
+      TRACE(TRACE_DEBUG, "blobcache", "Removed stale segment %s", path2);
+      fa_unlink(path2, NULL, 0);
+    } else if(!fa_stat(path2, &de->fde_stat, NULL, 0)) {
+      seg->seg_size = de->fde_stat.fs_size;
+    }
+    hts_mutex_unlock(&cache_lock);
+  }
+  fa_dir_free(d);
 }
 
+
 /**
  *
  */
@@ -676,6 +1312,8 @@ prune_stale(void)
   char path3[PATH_MAX];
   uint64_t k;
 
+  prune_stale_segments();
+
   snprintf(path, sizeof(path), "%s/bc2", gconf.cache_path);
 
   if((d1 = fa_scandir(path, NULL, 0)) == NULL)
@@ -683,7 +1321,8 @@ prune_stale(void)
 
   RB_FOREACH(de1, &d1->fd_entries, fde_link) {
     const char *n1 = rstr_get(de1->fde_filename);
-    if(n1[0] != '.') {
+    if(n1[0] != '.' && de1->fde_type == CONTENT_DIR &&
+       strcmp(n1, "segments")) {
       snprintf(path2, sizeof(path2), "%s/bc2/%s",
 	       gconf.cache_path, n1);
 
@@ -696,14 +1335,19 @@ prune_stale(void)
 	    snprintf(path3, sizeof(path3), "%s/bc2/%s/%s",
 		     gconf.cache_path, n1, n2);
 
-            hts_mutex_lock(&cache_lock);
+            if(sscanf(n2, "%016"PRIx64, &k) != 1) {
+	      fa_unlink(path3, NULL, 0);
+              continue;
+            }
 
-	    if(sscanf(n2, "%016"PRIx64, &k) != 1 ||
-	       lookup_item(k) == NULL) {
+            blobcache_shard_t *bsh = shard_for(k);
+            hts_mutex_lock(&bsh->bsh_lock);
+            const blobcache_item_t *p = lookup_item(bsh, k);
+	    if(p == NULL || (p->bi_segment && p->bi_flush == NULL)) {
 	      TRACE(TRACE_DEBUG, "blobcache", "Removed stale file %s", path3);
 	      fa_unlink(path3, NULL, 0);
 	    }
-            hts_mutex_unlock(&cache_lock);
+            hts_mutex_unlock(&bsh->bsh_lock);
 	  }
 	}
         fa_dir_free(d2);
@@ -716,20 +1360,6 @@ prune_stale(void)
 
 
 
-/**
- *
- */
-static void
-prune_item(blobcache_item_t *p)
-{
-  char filename[PATH_MAX];
-  make_filename(filename, sizeof(filename), p->bi_key_hash, 0);
-  fa_unlink(filename, NULL, 0);
-  pool_put(item_pool, p);
-}
-
-
-
 /**
  *
  */
@@ -737,22 +1367,16 @@ void
 blobcache_evict(const char *key, const char *stash)
 {
   uint64_t dk = digest_key(key, stash);
+  blobcache_shard_t *bsh = shard_for(dk);
 
-  hts_mutex_lock(&cache_lock);
-  if(bcstate == BLOBCACHE_RUN) {
-    blobcache_item_t *p, **q;
-    q = &hashvector[dk & ITEM_HASH_MASK];
-    while((p = *q) != NULL) {
-      if(p->bi_key_hash == dk) {
-        current_cache_size -= p->bi_size;
-        *q = p->bi_link;
-        prune_item(p);
-        break;
-      }
-      q = &p->bi_link;
-    }
-  }
-  hts_mutex_unlock(&cache_lock);
+  if(bcstate != BLOBCACHE_RUN)
+    return;
+
+  hts_mutex_lock(&bsh->bsh_lock);
+  blobcache_item_t *p = lookup_item(bsh, dk);
+  if(p != NULL)
+    remove_item(bsh, p);
+  hts_mutex_unlock(&bsh->bsh_lock);
 }
 
 
@@ -776,7 +1400,7 @@ accesstimecmp(const void *A, const void *B)
 
 
 /**
- *
+ * All shards and cache_lock must be locked
  */
 static void
 prune_to_size(uint64_t maxsize)
@@ -784,18 +1408,21 @@ prune_to_size(uint64_t maxsize)
   int i, tot = 0, j = 0;
   blobcache_item_t *p, **sv;
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++)
-    for(p = hashvector[i]; p != NULL; p = p->bi_link)
-      tot++;
+  for(i = 0; i < BC_SHARDS; i++)
+    tot += shards[i].bsh_items;
 
   sv = malloc(sizeof(blobcache_item_t *) * tot);
   current_cache_size = 0;
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = p->bi_link) {
-      sv[j++] = p;
-      current_cache_size += p->bi_size;
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bsh = &shards[i];
+    for(int k = 0; k < bsh->bsh_hash_size; k++) {
+      for(p = bsh->bsh_hash[k]; p != NULL; p = p->bi_link) {
+        sv[j++] = p;
+        current_cache_size += p->bi_size;
+      }
+      bsh->bsh_hash[k] = NULL;
     }
-    hashvector[i] = NULL;
+    bsh->bsh_items = 0;
   }
 
   assert(j == tot);
@@ -805,23 +1432,23 @@ prune_to_size(uint64_t maxsize)
     p = sv[i];
     if(current_cache_size < maxsize)
       break;
-    current_cache_size -= p->bi_size;
-    prune_item(p);
+    if(p->bi_flush != NULL)
+      break; // Don't throw away stuff we haven't even written yet
+    blobcache_shard_t *bsh = shard_for(p->bi_key_hash);
+    bsh->bsh_items++; // prune_item() will decrease it
+    prune_item(bsh, p);
     index_dirty = 1;
   }
 
   for(; i < j; i++) {
     p = sv[i];
-    p->bi_link = hashvector[p->bi_key_hash & ITEM_HASH_MASK];
-    hashvector[p->bi_key_hash & ITEM_HASH_MASK] = p;
+    shard_insert(shard_for(p->bi_key_hash), p);
   }
 
   free(sv);
-  save_index();
 }
 
 
-
 /**
  *
  */
@@ -842,6 +1469,8 @@ blobcache_prune_old(void)
 }
 
 
+
+
 /**
  *
  */
@@ -849,25 +1478,361 @@ static void
 cache_clear(void *opaque, prop_event_t event, ...)
 {
   int i;
-  blobcache_item_t *p, *n;
+  blobcache_item_t *p, *n, *keep;
 
+  lock_all_shards();
   hts_mutex_lock(&cache_lock);
 
-  for(i = 0; i < ITEM_HASH_SIZE; i++) {
-    for(p = hashvector[i]; p != NULL; p = n) {
+  for(i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bsh = &shards[i];
+    keep = NULL;
+    for(int k = 0; k < bsh->bsh_hash_size; k++) {
+      for(p = bsh->bsh_hash[k]; p != NULL; p = n) {
+        n = p->bi_link;
+        if(p->bi_flush != NULL) {
+          // Not written yet, the flush thread expects to find it
+          p->bi_link = keep;
+          keep = p;
+          continue;
+        }
+        prune_item(bsh, p);
+      }
+      bsh->bsh_hash[k] = NULL;
+    }
+    bsh->bsh_items = 0;
+    for(p = keep; p != NULL; p = n) {
       n = p->bi_link;
-      prune_item(p);
-      index_dirty = 1;
+      shard_insert(bsh, p);
     }
-    hashvector[i] = NULL;
   }
-  current_cache_size = 0;
-  save_index();
+  index_dirty = 1;
   hts_mutex_unlock(&cache_lock);
+  unlock_all_shards();
+  save_index();
   notify_add(NULL, NOTIFY_INFO, NULL, 3, _("Cache cleared"));
 }
 
 
+/**
+ * Start a new segment file.
+ * Only called from flush thread
+ */
+static int
+segment_open_new(void)
+{
+  char filename[PATH_MAX];
+  char errbuf[512];
+
+  if(active_segment_fh != NULL)
+    fa_close(active_segment_fh);
+  active_segment_fh = NULL;
+  active_segment = NULL;
+
+  snprintf(filename, sizeof(filename), "%s/bc2/segments", gconf.cache_path);
+  fa_makedir(filename);
+
+  const uint32_t id = next_segment_id++;
+  make_segment_filename(filename, sizeof(filename), id);
+
+  active_segment_fh = fa_open_ex(filename, errbuf, sizeof(errbuf),
+                                 FA_WRITE, NULL);
+  if(active_segment_fh == NULL) {
+    TRACE(TRACE_ERROR, "blobcache", "Unable to create segment %s -- %s",
+          filename, errbuf);
+    return -1;
+  }
+
+  blobcache_segment_t *seg = calloc(1, sizeof(blobcache_segment_t));
+  seg->seg_id = id;
+
+  hts_mutex_lock(&cache_lock);
+  LIST_INSERT_HEAD(&segments, seg, seg_link);
+  active_segment = seg;
+  hts_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+
+/**
+ * Append a blob to the active segment. Returns number of bytes
+ * written or 0 on failure.
+ * Only called from flush thread, without cache_lock
+ */
+static uint32_t
+segment_append(const buf_t *b, uint64_t dk, uint32_t *segp, uint32_t *offp)
+{
+  blobcache_segment_record_t sr = {0};
+  const char *ct = b->b_content_type ? rstr_get(b->b_content_type) : NULL;
+  const int ctlen = ct ? strlen(ct) : 0;
+  const uint32_t len = sizeof(sr) + ctlen + b->b_size;
+
+  if(active_segment == NULL ||
+     active_segment->seg_size + len > SEGMENT_MAXSIZE) {
+    if(segment_open_new())
+      return 0;
+  }
+
+  sr.sr_magic = BC2_SEGMENT_MAGIC;
+  sr.sr_size = b->b_size;
+  sr.sr_key_hash = dk;
+  sr.sr_content_type_len = ctlen;
+
+  if(fa_write(active_segment_fh, &sr, sizeof(sr)) != sizeof(sr) ||
+     fa_write(active_segment_fh, ct, ctlen) != ctlen ||
+     fa_write(active_segment_fh, b->b_ptr, b->b_size) != b->b_size) {
+    // File is in an unknown state, don't append anything more to it
+    fa_close(active_segment_fh);
+    active_segment_fh = NULL;
+    active_segment = NULL;
+    return 0;
+  }
+
+  *segp = active_segment->seg_id;
+
+  hts_mutex_lock(&cache_lock);
+  *offp = active_segment->seg_size;
+  active_segment->seg_size += len;
+  hts_mutex_unlock(&cache_lock);
+  return len;
+}
+
+
+/**
+ * Write a blob to a file of its own. Returns number of bytes
+ * written or 0 on failure
+ */
+static uint32_t
+file_write(const buf_t *b, uint64_t dk)
+{
+  char filename[PATH_MAX];
+  make_filename(filename, sizeof(filename), dk, 1);
+  uint32_t len = 0;
+
+  fa_handle_t *fh = fa_open_ex(filename, NULL, 0, FA_WRITE, NULL);
+  if(fh == NULL)
+    return 0;
+
+  if(b->b_content_type != NULL) {
+    const char *str = rstr_get(b->b_content_type);
+    size_t ctlen = strlen(str);
+    if(fa_write(fh, str, ctlen) != ctlen)
+      goto bad;
+    len += ctlen;
+  }
+
+  if(fa_write(fh, b->b_ptr, b->b_size) != b->b_size)
+    goto bad;
+
+  fa_close(fh);
+  return len + b->b_size;
+
+ bad:
+  fa_close(fh);
+  fa_unlink(filename, NULL, 0);
+  return 0;
+}
+
+
+/**
+ * Write a queued blob and make the item refer to the new location.
+ * Called from flush thread without cache_lock
+ */
+static void
+flush_one(blobcache_flush_t *bf)
+{
+  const uint64_t dk = bf->bf_key_hash;
+  buf_t *b = bf->bf_buf;
+  uint32_t segment = 0, offset = 0, stored;
+  blobcache_shard_t *bsh = shard_for(dk);
+
+  if(b->b_size <= SEGMENT_BLOB_MAXSIZE)
+    stored = segment_append(b, dk, &segment, &offset);
+  else
+    stored = file_write(b, dk);
+
+  hts_mutex_lock(&bsh->bsh_lock);
+  blobcache_item_t *p = lookup_item(bsh, dk);
+  hts_mutex_lock(&cache_lock);
+
+  if(p != NULL && p->bi_flush == bf) {
+    p->bi_flush = NULL;
+
+    if(stored == 0) {
+      // Failed to write, the item does not have any valid data
+      unlink_item(bsh, p);
+
+    } else {
+
+      // Our own file has already been overwritten, everything else
+      // needs to be released
+      if(p->bi_segment || segment)
+        item_release_storage(p);
+
+      p->bi_segment = segment;
+      p->bi_offset = offset;
+      p->bi_stored = stored;
+      if(segment)
+        segment_account(p);
+      index_dirty = 1;
+    }
+
+  } else if(stored && !segment && p == NULL) {
+    // Item was removed while we were writing it
+    char filename[PATH_MAX];
+    make_filename(filename, sizeof(filename), dk, 0);
+    fa_unlink(filename, NULL, 0);
+  }
+  // Superseded segment records are never accounted as live and
+  // will be reclaimed by compaction
+
+  assert(TAILQ_FIRST(&flush_queue) == bf);
+  TAILQ_REMOVE(&flush_queue, bf, bf_link);
+  buf_t *buf = bf->bf_buf;
+  pool_put(flush_pool, bf);
+  hts_mutex_unlock(&cache_lock);
+  hts_mutex_unlock(&bsh->bsh_lock);
+
+  buf_release(buf);
+}
+
+
+/**
+ * Rewrite the live records of a mostly dead segment into the
+ * active one. Called from flush thread with cache_lock held.
+ * Returns 1 if anything was done
+ */
+static int
+segment_compact(void)
+{
+  blobcache_segment_t *seg;
+  char filename[PATH_MAX];
+
+  LIST_FOREACH(seg, &segments, seg_link) {
+    if(seg != active_segment &&
+       (seg->seg_live == 0 || seg->seg_live < seg->seg_size / 2))
+      break;
+  }
+
+  if(seg == NULL)
+    return 0;
+
+  const uint32_t id = seg->seg_id;
+
+  if(seg->seg_live > 0) {
+    int found = 0;
+    hts_mutex_unlock(&cache_lock);
+
+    for(int i = 0; i < BC_SHARDS; i++) {
+      blobcache_shard_t *bsh = &shards[i];
+      int num = 0;
+      blobcache_item_t *p;
+      struct {
+        uint64_t dk;
+        uint32_t offset;
+        uint32_t size;
+        int ctlen;
+      } *v;
+
+      hts_mutex_lock(&bsh->bsh_lock);
+      v = malloc(sizeof(v[0]) * (bsh->bsh_items + 1));
+      for(int k = 0; k < bsh->bsh_hash_size; k++) {
+        for(p = bsh->bsh_hash[k]; p != NULL; p = p->bi_link) {
+          if(p->bi_segment != id || p->bi_flush != NULL)
+            continue;
+          v[num].dk = p->bi_key_hash;
+          v[num].offset = p->bi_offset;
+          v[num].size = p->bi_size;
+          v[num].ctlen = p->bi_content_type_len;
+          num++;
+        }
+      }
+      hts_mutex_unlock(&bsh->bsh_lock);
+      found += num;
+
+      for(int j = 0; j < num; j++) {
+        uint32_t newseg = 0, newoff = 0, stored = 0;
+        buf_t *b = segment_read(id, v[j].offset, v[j].dk, v[j].size,
+                                v[j].ctlen, 0);
+        if(b != NULL) {
+          stored = segment_append(b, v[j].dk, &newseg, &newoff);
+          buf_release(b);
+        }
+
+        hts_mutex_lock(&bsh->bsh_lock);
+        p = lookup_item(bsh, v[j].dk);
+        hts_mutex_lock(&cache_lock);
+        if(p != NULL && p->bi_segment == id && p->bi_offset == v[j].offset &&
+           p->bi_flush == NULL) {
+          if(stored == 0) {
+            unlink_item(bsh, p);
+          } else {
+            segment_dead(id, p->bi_stored);
+            p->bi_segment = newseg;
+            p->bi_offset = newoff;
+            p->bi_stored = stored;
+            segment_account(p);
+            index_dirty = 1;
+          }
+        }
+        hts_mutex_unlock(&cache_lock);
+        hts_mutex_unlock(&bsh->bsh_lock);
+      }
+      free(v);
+    }
+
+    hts_mutex_lock(&cache_lock);
+
+    // If nothing refers to the segment anymore the live count has
+    // drifted and we can safely remove it anyway
+    if(seg->seg_live > 0 && found)
+      return 1; // Retry later
+  }
+
+  TRACE(TRACE_DEBUG, "blobcache", "Removing segment %08x (%d bytes)",
+        id, seg->seg_size);
+
+  LIST_REMOVE(seg, seg_link);
+  free(seg);
+  make_segment_filename(filename, sizeof(filename), id);
+  fa_unlink(filename, NULL, 0);
+  atomic_inc(&bc_compactions);
+  return 1;
+}
+
+
+/**
+ * Called with cache_lock held, which is released and reacquired
+ */
+static void
+prune_if_needed(void)
+{
+  uint64_t maxsize = blobcache_compute_maxsize();
+
+  if(maxsize >= current_cache_size)
+    return;
+
+  hts_mutex_unlock(&cache_lock);
+  lock_all_shards();
+  hts_mutex_lock(&cache_lock);
+  prune_to_size(maxsize);
+  hts_mutex_unlock(&cache_lock);
+  unlock_all_shards();
+  hts_mutex_lock(&cache_lock);
+}
+
+
+/**
+ *
+ */
+static int
+blobcache_num_items(void)
+{
+  int items = 0;
+  for(int i = 0; i < BC_SHARDS; i++)
+    items += shards[i].bsh_items;
+  return items;
+}
+
 
 /**
  *
@@ -883,14 +1848,16 @@ flushthread(void *aux)
 
   uint64_t maxsize = blobcache_compute_maxsize();
 
+  lock_all_shards();
   hts_mutex_lock(&cache_lock);
   prune_to_size(maxsize);
 
   TRACE(TRACE_INFO, "blobcache",
 	"Initialized: %d items consuming %.2f MB "
         "(out of maximum %.2f MB) on disk in %s/bc2",
-	pool_num(item_pool), current_cache_size / 1000000.0,
+	blobcache_num_items(), current_cache_size / 1000000.0,
         maxsize / 1000000.0, gconf.cache_path);
+  unlock_all_shards();
 
   // First make sure clock is valid
   while(bcstate == BLOBCACHE_RUN_BAD_CLOCK) {
@@ -910,9 +1877,15 @@ flushthread(void *aux)
 
     if((bf = TAILQ_FIRST(&flush_queue)) == NULL) {
 
+      if(segment_compact())
+        continue;
+
       if(index_dirty) {
-        if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000))
+        if(hts_cond_wait_timeout(&cache_cond, &cache_lock, 5000)) {
+          hts_mutex_unlock(&cache_lock);
           save_index();
+          hts_mutex_lock(&cache_lock);
+        }
       } else {
         hts_cond_wait(&cache_cond, &cache_lock);
       }
@@ -920,44 +1893,71 @@ flushthread(void *aux)
     }
 
     hts_mutex_unlock(&cache_lock);
-    char filename[PATH_MAX];
-    make_filename(filename, sizeof(filename), bf->bf_key_hash, 1);
-    buf_t *b = bf->bf_buf;
+    flush_one(bf);
+    hts_mutex_lock(&cache_lock);
 
-    fa_handle_t *fh = fa_open_ex(filename, NULL, 0, FA_WRITE, NULL);
-    if(fh != NULL) {
+    prune_if_needed();
+  }
+  hts_mutex_unlock(&cache_lock);
+  save_index();
 
-      if(b->b_content_type != NULL) {
-	const char *str = rstr_get(b->b_content_type);
-	size_t len = strlen(str);
-	if(fa_write(fh, str, len) != len)
-	  fa_unlink(filename, NULL, 0);
-      }
+  if(active_segment_fh != NULL)
+    fa_close(active_segment_fh);
+  active_segment_fh = NULL;
+  return NULL;
+}
 
-      if(fa_write(fh, b->b_ptr, b->b_size) != b->b_size)
-        fa_unlink(filename, NULL, 0);
 
-      fa_close(fh);
-    }
-    hts_mutex_lock(&cache_lock);
+static callout_t blobcache_stats_callout;
+static prop_t *blobcache_stats_root;
 
-    assert(TAILQ_FIRST(&flush_queue) == bf);
-    TAILQ_REMOVE(&flush_queue, bf, bf_link);
-    buf_release(bf->bf_buf);
-    pool_put(item_pool, bf);
+/**
+ *
+ */
+static void
+blobcache_stats_update(callout_t *c, void *aux)
+{
+  static int last_hits, last_misses, last_expired, last_latency_sum;
+  const int hits    = atomic_get(&bc_hits);
+  const int misses  = atomic_get(&bc_misses);
+  const int expired = atomic_get(&bc_expired);
+  const int latency_sum = atomic_get(&bc_latency_sum);
+  int num_segments = 0;
+  blobcache_segment_t *seg;
 
-    uint64_t maxsize = blobcache_compute_maxsize();
+  callout_arm(&blobcache_stats_callout, blobcache_stats_update, NULL, 1);
 
-    if(maxsize < current_cache_size)
-      prune_to_size(maxsize);
-  }
-  save_index();
+  hts_mutex_lock(&cache_lock);
+  LIST_FOREACH(seg, &segments, seg_link)
+    num_segments++;
+  const uint64_t size = current_cache_size;
   hts_mutex_unlock(&cache_lock);
-  return NULL;
+
+  prop_set(blobcache_stats_root, "hits", PROP_SET_INT, hits - last_hits);
+  prop_set(blobcache_stats_root, "misses", PROP_SET_INT,
+           misses - last_misses);
+  prop_set(blobcache_stats_root, "expired", PROP_SET_INT,
+           expired - last_expired);
+  prop_set(blobcache_stats_root, "avglatency", PROP_SET_INT,
+           hits - last_hits ?
+           (latency_sum - last_latency_sum) / (hits - last_hits) : 0);
+  prop_set(blobcache_stats_root, "maxlatency", PROP_SET_INT,
+           bc_latency_max);
+  prop_set(blobcache_stats_root, "items", PROP_SET_INT,
+           blobcache_num_items());
+  prop_set(blobcache_stats_root, "size", PROP_SET_INT,
+           (int)(size / 1000));
+  prop_set(blobcache_stats_root, "segments", PROP_SET_INT, num_segments);
+  prop_set(blobcache_stats_root, "compactions", PROP_SET_INT,
+           atomic_get(&bc_compactions));
+
+  last_hits = hits;
+  last_misses = misses;
+  last_expired = expired;
+  last_latency_sum = latency_sum;
+  bc_latency_max = 0;
 }
 
-static_assert(sizeof(blobcache_flush_t) <= sizeof(blobcache_item_t),
-              "blobcache_flush too big");
 
 /**
  *
@@ -969,6 +1969,7 @@ blobcache_init(void)
   char errbuf[512];
 
   TAILQ_INIT(&flush_queue);
+  LIST_INIT(&segments);
 
   blobcache_prune_old();
   snprintf(buf, sizeof(buf), "%s/bc2", gconf.cache_path);
@@ -979,11 +1980,22 @@ blobcache_init(void)
 
   hts_mutex_init(&cache_lock);
   hts_cond_init(&cache_cond, &cache_lock);
-  item_pool = pool_create("blobcacheitems", sizeof(blobcache_item_t), 0);
-
+  flush_pool = pool_create("blobcacheflush", sizeof(blobcache_flush_t), 0);
+
+  for(int i = 0; i < BC_SHARDS; i++) {
+    blobcache_shard_t *bsh = &shards[i];
+    hts_mutex_init(&bsh->bsh_lock);
+    bsh->bsh_hash_size = BC_SHARD_INITIAL_HASH_SIZE;
+    bsh->bsh_hash = calloc(bsh->bsh_hash_size, sizeof(blobcache_item_t *));
+    bsh->bsh_pool = pool_create("blobcacheitems",
+                                sizeof(blobcache_item_t), 0);
+  }
 
   load_index();
 
+  blobcache_stats_root =
+    prop_create(prop_create(prop_get_global(), "system"), "blobcache");
+  blobcache_stats_update(NULL, NULL);
 
   prop_t *dir = setting_get_dir("general:resets");
   settings_create_action(dir, _p("Clear cached files"),
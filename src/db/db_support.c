@@ -24,6 +24,7 @@
 #include "main.h"
 #include "fileaccess/fileaccess.h"
 #include "misc/minmax.h"
+#include "misc/murmur3.h"
 
 #include "db_support.h"
 
@@ -110,6 +111,182 @@ db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
   return rc;
 }
 
+/**
+ * Prepared statement cache.
+ *
+ * Compiling SQL is a large part of the cost for small statements so we
+ * keep compiled statements around per connection. A cached statement is
+ * handed out to one user at a time. If it's already busy (recursive use
+ * on the same connection) we fall back to a private statement that is
+ * finalized by db_release()
+ */
+#define DB_STMT_CACHE_HASH_SIZE 256
+#define DB_STMT_CACHE_MAX       512
+
+typedef struct db_stmt_cache_entry {
+  LIST_ENTRY(db_stmt_cache_entry) dsce_link;
+  sqlite3 *dsce_db;
+  sqlite3_stmt *dsce_stmt;
+  uint32_t dsce_hash;
+  int dsce_busy;
+} db_stmt_cache_entry_t;
+
+LIST_HEAD(db_stmt_cache_entry_list, db_stmt_cache_entry);
+
+static struct db_stmt_cache_entry_list db_stmt_cache[DB_STMT_CACHE_HASH_SIZE];
+static int db_stmt_cache_entries;
+static HTS_MUTEX_DECL(db_stmt_cache_mutex);
+
+static int db_stmt_cache_hits;
+static int db_stmt_cache_misses;
+
+
+/**
+ *
+ */
+static uint32_t
+db_stmt_hash(sqlite3 *db, const char *sql)
+{
+  return MurHash3_32(sql, strlen(sql), (uint32_t)(intptr_t)db);
+}
+
+
+/**
+ *
+ */
+int
+db_preparex_cached(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
+                   const char *file, int line)
+{
+  const uint32_t hash = db_stmt_hash(db, zSql);
+  struct db_stmt_cache_entry_list *bucket =
+    &db_stmt_cache[hash & (DB_STMT_CACHE_HASH_SIZE - 1)];
+  db_stmt_cache_entry_t *dsce;
+  int rc;
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  LIST_FOREACH(dsce, bucket, dsce_link) {
+    if(dsce->dsce_hash == hash && dsce->dsce_db == db && !dsce->dsce_busy &&
+       !strcmp(sqlite3_sql(dsce->dsce_stmt), zSql)) {
+      dsce->dsce_busy = 1;
+      db_stmt_cache_hits++;
+      hts_mutex_unlock(&db_stmt_cache_mutex);
+      *ppStmt = dsce->dsce_stmt;
+      return SQLITE_OK;
+    }
+  }
+  db_stmt_cache_misses++;
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+
+  rc = db_preparex(db, ppStmt, zSql, file, line);
+  if(rc != SQLITE_OK)
+    return rc;
+
+  // db_release() finds the entry using the SQL text kept by sqlite so
+  // only cache if that is what we were asked to compile
+  if(strcmp(sqlite3_sql(*ppStmt), zSql))
+    return SQLITE_OK;
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  if(db_stmt_cache_entries < DB_STMT_CACHE_MAX) {
+    dsce = malloc(sizeof(db_stmt_cache_entry_t));
+    dsce->dsce_db = db;
+    dsce->dsce_stmt = *ppStmt;
+    dsce->dsce_hash = hash;
+    dsce->dsce_busy = 1;
+    LIST_INSERT_HEAD(bucket, dsce, dsce_link);
+    db_stmt_cache_entries++;
+  }
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+  return SQLITE_OK;
+}
+
+
+/**
+ * Release a statement obtained from either db_prepare() or
+ * db_prepare_cached()
+ */
+void
+db_release(sqlite3_stmt *stmt)
+{
+  db_stmt_cache_entry_t *dsce;
+
+  if(stmt == NULL)
+    return;
+
+  const uint32_t hash = db_stmt_hash(sqlite3_db_handle(stmt),
+                                     sqlite3_sql(stmt));
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  LIST_FOREACH(dsce,
+               &db_stmt_cache[hash & (DB_STMT_CACHE_HASH_SIZE - 1)],
+               dsce_link) {
+    if(dsce->dsce_stmt == stmt) {
+      assert(dsce->dsce_busy);
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      dsce->dsce_busy = 0;
+      hts_mutex_unlock(&db_stmt_cache_mutex);
+      return;
+    }
+  }
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+  sqlite3_finalize(stmt);
+}
+
+
+/**
+ * Finalize all cached statements for a connection, must be done
+ * before closing it
+ */
+static void
+db_stmt_cache_flush(sqlite3 *db)
+{
+  db_stmt_cache_entry_t *dsce, *next;
+
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  for(int i = 0; i < DB_STMT_CACHE_HASH_SIZE; i++) {
+    for(dsce = LIST_FIRST(&db_stmt_cache[i]); dsce != NULL; dsce = next) {
+      next = LIST_NEXT(dsce, dsce_link);
+      if(dsce->dsce_db != db)
+        continue;
+      if(dsce->dsce_busy)
+        TRACE(TRACE_ERROR, "DB", "Statement still in use at close: %s",
+              sqlite3_sql(dsce->dsce_stmt));
+      sqlite3_finalize(dsce->dsce_stmt);
+      LIST_REMOVE(dsce, dsce_link);
+      free(dsce);
+      db_stmt_cache_entries--;
+    }
+  }
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+}
+
+
+/**
+ *
+ */
+void
+db_stmt_cache_stats(int *hits, int *misses)
+{
+  hts_mutex_lock(&db_stmt_cache_mutex);
+  *hits = db_stmt_cache_hits;
+  *misses = db_stmt_cache_misses;
+  hts_mutex_unlock(&db_stmt_cache_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+db_close(sqlite3 *db)
+{
+  db_stmt_cache_flush(db);
+  sqlite3_close(db);
+}
+
+
 /**
  *
  */
@@ -461,7 +638,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
     TRACE(TRACE_ERROR, "DB",
 	  "%s: db handle returned to pool while in transaction, closing handle",
 	  dp->dp_path);
-    sqlite3_close(db);
+    db_close(db);
     return;
   }
 
@@ -475,7 +652,7 @@ db_pool_put(db_pool_t *dp, sqlite3 *db)
   }
 
   hts_mutex_unlock(&dp->dp_mutex);
-  sqlite3_close(db);
+  db_close(db);
 }
 
 
@@ -493,7 +670,7 @@ db_pool_close(db_pool_t *dp)
   dp->dp_closed = 1;
   for(i = 0; i < dp->dp_size; i++)
     if(dp->dp_pool[i] != NULL)
-      sqlite3_close(dp->dp_pool[i]);
+      db_close(dp->dp_pool[i]);
   hts_mutex_unlock(&dp->dp_mutex);
 }
 
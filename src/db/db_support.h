@@ -45,6 +45,16 @@ int db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
 
 #define db_prepare(db, stmt, sql) db_preparex(db, stmt, sql, __FILE__, __LINE__)
 
+int db_preparex_cached(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
+                       const char *file, int line);
+
+#define db_prepare_cached(db, stmt, sql) \
+  db_preparex_cached(db, stmt, sql, __FILE__, __LINE__)
+
+void db_release(sqlite3_stmt *stmt);
+
+void db_stmt_cache_stats(int *hits, int *misses);
+
 #define db_begin(db)    db_begin0(db, __FUNCTION__)
 #define db_commit(db)   db_commit0(db, __FUNCTION__)
 #define db_rollback(db) db_rollback0(db, __FUNCTION__)
@@ -87,7 +87,7 @@ es_scrobble_video(vpi_op_t op, struct htsmsg *info, struct prop *p,
   vsa->p = prop_ref_inc(p);
   vsa->origin = prop_follow(origin);
 
-  task_run(scrobble_video_task, vsa);
+  task_run_prio(scrobble_video_task, vsa, TASK_PRIO_LOW);
 }
 
 VPI_REGISTER(es_scrobble_video)
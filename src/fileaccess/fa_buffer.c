@@ -18,6 +18,7 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #include "arch/halloc.h"
+#include "arch/arch.h"
 
 #include "main.h"
 #include "fileaccess.h"
@@ -32,6 +33,25 @@
 #define BF_ZONES 8
 #define BF_MASK (BF_ZONES - 1)
 
+/**
+ * Read-ahead
+ *
+ * Once we see sequential access a stream is started at the read
+ * position and a per-handle thread keeps a window of data ahead of
+ * the reader in flight. The window doubles whenever the reader has
+ * to wait or has consumed a full window.
+ *
+ * There are a few streams so that a demuxer reading the header, then
+ * the index at the end and then going back to the start (or reading
+ * interleaved positions of a non-interleaved file) does not throw
+ * away what has already been prefetched
+ */
+#define BF_RA_STREAMS  3
+#define BF_RA_TRIGGER  (128 * 1024)   // Sequential bytes before we start
+#define BF_RA_CHUNK    (1024 * 1024)  // Max size of a single fill
+#define BF_RA_RUNS     (BF_RA_STREAMS * 2)
+#define BF_RA_WINDOW   (256 * 1024)   // Initial window
+
 static HTS_MUTEX_DECL(buffered_global_mutex);
 
 typedef struct buffered_zone {
@@ -40,6 +60,36 @@ typedef struct buffered_zone {
   int bz_size;
 } buffered_zone_t;
 
+
+/**
+ * Recently seen sequential runs, used to detect sequential access
+ * even if the reader alternates between a few positions
+ */
+typedef struct fab_run {
+  int64_t fr_start;
+  int64_t fr_end;
+  int fr_last_use;
+} fab_run_t;
+
+
+/**
+ * Data in the ring is [fs_start, fs_start + fs_len), byte at file
+ * position 'x' lives at fs_buf[x % ring size]
+ */
+typedef struct fab_stream {
+  uint8_t *fs_buf;
+  int64_t fs_start;
+  int fs_len;
+  int64_t fs_cpos;      // Reader position within this stream
+  int64_t fs_used;      // Everything below this has been handed out
+  int64_t fs_grow_mark;
+  int fs_window;        // How far ahead of fs_cpos to stay
+  int fs_gen;           // Bumped on restart to discard fills in flight
+  int fs_eof;
+  int fs_error;
+  int fs_last_use;
+} fab_stream_t;
+
 /**
  *
  */
@@ -72,6 +122,30 @@ typedef struct buffered_file {
 
   buffered_zone_t bf_zones[BF_ZONES];
 
+  /*
+   * Read-ahead. bf_ra_mutex protects the streams and the stats,
+   * bf_src_mutex serializes access to bf_src between the reader
+   * and the read-ahead thread
+   */
+  int bf_ra_ring;         // Ring size per stream, 0 if disabled
+  int bf_use_counter;
+  fab_run_t bf_runs[BF_RA_RUNS];
+  fab_run_t *bf_run;      // Run the current read belongs to
+
+  hts_mutex_t bf_ra_mutex;
+  hts_mutex_t bf_src_mutex;
+  hts_cond_t bf_ra_cond;
+  hts_thread_t bf_ra_thread;
+  int bf_ra_thread_running;
+  int bf_ra_stop;
+  int bf_ra_paused;
+  int bf_ra_busy;
+
+  fab_stream_t bf_streams[BF_RA_STREAMS];
+
+  int64_t bf_ra_prefetched;
+  int64_t bf_ra_used;
+  int64_t bf_ra_stall;
 
 } buffered_file_t;
 
@@ -231,12 +305,50 @@ need_to_fill(const buffered_file_t *bf, int64_t fpos, size_t rd)
 }
 
 
+/**
+ *
+ */
+static void
+fab_ra_stop(buffered_file_t *bf)
+{
+  if(!bf->bf_ra_thread_running)
+    return;
+
+  hts_mutex_lock(&bf->bf_ra_mutex);
+  bf->bf_ra_stop = 1;
+  // Don't wait for a slow network read to complete
+  if(bf->bf_ra_busy)
+    cancellable_cancel(bf->bf_outbound_cancellable);
+  hts_cond_broadcast(&bf->bf_ra_cond);
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+
+  hts_thread_join(&bf->bf_ra_thread);
+  bf->bf_ra_thread_running = 0;
+}
+
+
 /**
  *
  */
 static void
 fab_destroy(buffered_file_t *bf)
 {
+  fab_ra_stop(bf);
+
+  if(bf->bf_ra_prefetched)
+    TRACE(TRACE_DEBUG, "FA",
+          "%s: Read-ahead prefetched %"PRId64" bytes, "
+          "%"PRId64" wasted, stalled for %"PRId64" ms",
+          bf->bf_url, bf->bf_ra_prefetched,
+          bf->bf_ra_prefetched - bf->bf_ra_used, bf->bf_ra_stall / 1000);
+
+  for(int i = 0; i < BF_RA_STREAMS; i++)
+    free(bf->bf_streams[i].fs_buf);
+
+  hts_cond_destroy(&bf->bf_ra_cond);
+  hts_mutex_destroy(&bf->bf_ra_mutex);
+  hts_mutex_destroy(&bf->bf_src_mutex);
+
   bf->bf_src->fh_proto->fap_close(bf->bf_src);
 
   if(bf->bf_mem != NULL)
@@ -287,6 +399,10 @@ fab_park(fa_handle_t *handle)
     return;
   }
 
+  hts_mutex_lock(&bf->bf_ra_mutex);
+  bf->bf_ra_paused = 1;
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+
   hts_mutex_lock(&buffered_global_mutex);
   if(parked)
     closeme = parked;
@@ -313,6 +429,250 @@ fab_close(fa_handle_t *handle)
 }
 
 
+/**
+ * Pick the stream most in need of data
+ */
+static fab_stream_t *
+fab_ra_next(buffered_file_t *bf)
+{
+  fab_stream_t *best = NULL;
+
+  if(bf->bf_ra_paused)
+    return NULL;
+
+  for(int i = 0; i < BF_RA_STREAMS; i++) {
+    fab_stream_t *fs = &bf->bf_streams[i];
+    if(fs->fs_buf == NULL || fs->fs_eof || fs->fs_error)
+      continue;
+    if(fs->fs_start + fs->fs_len - fs->fs_cpos >= fs->fs_window)
+      continue;
+    if(best == NULL || fs->fs_last_use > best->fs_last_use)
+      best = fs;
+  }
+  return best;
+}
+
+
+/**
+ *
+ */
+static void *
+fab_ra_thread(void *aux)
+{
+  buffered_file_t *bf = aux;
+  fa_handle_t *src = bf->bf_src;
+  const int ring = bf->bf_ra_ring;
+
+  hts_mutex_lock(&bf->bf_ra_mutex);
+
+  while(!bf->bf_ra_stop) {
+    fab_stream_t *fs = fab_ra_next(bf);
+    if(fs == NULL) {
+      hts_cond_wait(&bf->bf_ra_cond, &bf->bf_ra_mutex);
+      continue;
+    }
+
+    // Drop data well behind the reader to make room
+    const int keep = ring / 8;
+    if(fs->fs_cpos - keep > fs->fs_start) {
+      const int drop = MIN(fs->fs_len, fs->fs_cpos - keep - fs->fs_start);
+      fs->fs_start += drop;
+      fs->fs_len -= drop;
+    }
+
+    const int64_t pos = fs->fs_start + fs->fs_len;
+    const int offset = pos % ring;
+    int chunk = MIN(ring - fs->fs_len, ring - offset);
+    chunk = MIN(chunk, MAX(fs->fs_window / 2, 65536));
+    chunk = MIN(chunk, BF_RA_CHUNK);
+    if(chunk <= 0) {
+      hts_cond_wait(&bf->bf_ra_cond, &bf->bf_ra_mutex);
+      continue;
+    }
+
+    const int gen = fs->fs_gen;
+    bf->bf_ra_busy = 1;
+    hts_mutex_unlock(&bf->bf_ra_mutex);
+
+    int r = -1;
+    hts_mutex_lock(&bf->bf_src_mutex);
+    if(src->fh_proto->fap_seek(src, pos, SEEK_SET, 0) == pos)
+      r = src->fh_proto->fap_read(src, fs->fs_buf + offset, chunk);
+    hts_mutex_unlock(&bf->bf_src_mutex);
+
+    hts_mutex_lock(&bf->bf_ra_mutex);
+    bf->bf_ra_busy = 0;
+
+    if(r > 0)
+      bf->bf_ra_prefetched += r;
+
+    if(fs->fs_gen == gen) {
+      if(r < 0)
+        fs->fs_error = 1;
+      else if(r < chunk)
+        fs->fs_eof = 1;
+      if(r > 0)
+        fs->fs_len += r;
+    }
+    hts_cond_broadcast(&bf->bf_ra_cond);
+  }
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+  return NULL;
+}
+
+
+/**
+ * Start (or restart) a stream at 'pos'. The least recently used
+ * stream is recycled
+ */
+static fab_stream_t *
+fab_ra_start(buffered_file_t *bf, int64_t pos)
+{
+  fab_stream_t *fs = NULL;
+
+  for(int i = 0; i < BF_RA_STREAMS; i++) {
+    fab_stream_t *c = &bf->bf_streams[i];
+    if(fs == NULL || c->fs_last_use < fs->fs_last_use)
+      fs = c;
+  }
+
+  if(fs->fs_buf == NULL) {
+    fs->fs_buf = malloc(bf->bf_ra_ring);
+    if(fs->fs_buf == NULL)
+      return NULL;
+  }
+
+  fs->fs_start = pos;
+  fs->fs_len = 0;
+  fs->fs_cpos = pos;
+  fs->fs_used = pos;
+  fs->fs_grow_mark = pos;
+  fs->fs_window = MIN(BF_RA_WINDOW, bf->bf_ra_ring - bf->bf_ra_ring / 8);
+  fs->fs_gen++;
+  fs->fs_eof = 0;
+  fs->fs_error = 0;
+  fs->fs_last_use = ++bf->bf_use_counter;
+
+  if(!bf->bf_ra_thread_running) {
+    bf->bf_ra_thread_running = 1;
+    hts_thread_create_joinable("readahead", &bf->bf_ra_thread,
+                               fab_ra_thread, bf, THREAD_PRIO_FILESYSTEM);
+  }
+  hts_cond_broadcast(&bf->bf_ra_cond);
+  return fs;
+}
+
+
+/**
+ * Find stream that has, or soon will have, data for 'pos'
+ */
+static fab_stream_t *
+fab_ra_find(buffered_file_t *bf, int64_t pos)
+{
+  for(int i = 0; i < BF_RA_STREAMS; i++) {
+    fab_stream_t *fs = &bf->bf_streams[i];
+    if(fs->fs_buf == NULL || pos < fs->fs_start)
+      continue;
+    const int64_t end = fs->fs_start + fs->fs_len;
+    if(pos < end)
+      return fs;
+    if(!fs->fs_eof && !fs->fs_error && pos < end + fs->fs_window)
+      return fs;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+fab_ra_covers(buffered_file_t *bf, int64_t pos)
+{
+  if(!bf->bf_ra_ring)
+    return 0;
+  hts_mutex_lock(&bf->bf_ra_mutex);
+  int r = fab_ra_find(bf, pos) != NULL;
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+  return r;
+}
+
+
+/**
+ * Try to satisfy a read from the read-ahead streams
+ *
+ * Returns number of bytes copied, 0 if the caller should read from
+ * the source itself or -1 if the stream hit end of file
+ */
+static int
+fab_ra_read(buffered_file_t *bf, void *buf, size_t size)
+{
+  const int64_t pos = bf->bf_fpos;
+  const int ring = bf->bf_ra_ring;
+  int64_t stall_start = 0;
+
+  hts_mutex_lock(&bf->bf_ra_mutex);
+  bf->bf_ra_paused = 0;
+
+  fab_stream_t *fs = fab_ra_find(bf, pos);
+  if(fs == NULL) {
+    if(pos - bf->bf_run->fr_start < BF_RA_TRIGGER ||
+       (fs = fab_ra_start(bf, pos)) == NULL) {
+      hts_mutex_unlock(&bf->bf_ra_mutex);
+      return 0;
+    }
+  }
+
+  fs->fs_last_use = ++bf->bf_use_counter;
+  fs->fs_cpos = pos;
+  const int gen = fs->fs_gen;
+
+  while(pos >= fs->fs_start + fs->fs_len) {
+    if(fs->fs_eof || fs->fs_error || fs->fs_gen != gen ||
+       pos < fs->fs_start) {
+      const int eof = fs->fs_eof && fs->fs_gen == gen;
+      hts_mutex_unlock(&bf->bf_ra_mutex);
+      if(stall_start)
+        bf->bf_ra_stall += arch_get_ts() - stall_start;
+      return eof ? -1 : 0;
+    }
+    if(!stall_start) {
+      stall_start = arch_get_ts();
+      // Reader had to wait, we are not far enough ahead
+      fs->fs_window = MIN(fs->fs_window * 2, ring - ring / 8);
+      hts_cond_broadcast(&bf->bf_ra_cond);
+    }
+    hts_cond_wait(&bf->bf_ra_cond, &bf->bf_ra_mutex);
+  }
+
+  if(stall_start)
+    bf->bf_ra_stall += arch_get_ts() - stall_start;
+
+  const int avail = fs->fs_start + fs->fs_len - pos;
+  const int n = MIN(size, avail);
+  const int offset = pos % ring;
+  const int n1 = MIN(n, ring - offset);
+  memcpy(buf, fs->fs_buf + offset, n1);
+  memcpy(buf + n1, fs->fs_buf, n - n1);
+
+  const int64_t end = pos + n;
+  if(end > fs->fs_used) {
+    bf->bf_ra_used += end - MAX(pos, fs->fs_used);
+    fs->fs_used = end;
+  }
+
+  fs->fs_cpos = end;
+  if(end - fs->fs_grow_mark >= fs->fs_window) {
+    fs->fs_grow_mark = end;
+    fs->fs_window = MIN(fs->fs_window * 2, ring - ring / 8);
+  }
+
+  hts_cond_broadcast(&bf->bf_ra_cond);
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+  return n;
+}
+
+
 /**
  *
  */
@@ -334,7 +694,9 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence, int lazy)
     break;
 
   case SEEK_END:
+    hts_mutex_lock(&bf->bf_src_mutex);
     np = src->fh_proto->fap_seek(src, pos, whence, lazy);
+    hts_mutex_unlock(&bf->bf_src_mutex);
     break;
 
   default:
@@ -347,11 +709,14 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence, int lazy)
   int mpos;
   int cs = resolve_zone(bf, np, 1, &mpos);
 
-  if(cs == -1) {
+  if(cs == -1 && !fab_ra_covers(bf, np)) {
     // If seeked to position is not mapped in our buffers, seek in
     // source to check if it's possible to reach position at all.
 
-    if(src->fh_proto->fap_seek(src, np, SEEK_SET, lazy) != np)
+    hts_mutex_lock(&bf->bf_src_mutex);
+    int64_t r = src->fh_proto->fap_seek(src, np, SEEK_SET, lazy);
+    hts_mutex_unlock(&bf->bf_src_mutex);
+    if(r != np)
       return -1;
   }
 
@@ -371,7 +736,9 @@ fab_fsize(fa_handle_t *handle)
     return bf->bf_size;
 
   fa_handle_t *src = bf->bf_src;
+  hts_mutex_lock(&bf->bf_src_mutex);
   bf->bf_size = src->fh_proto->fap_fsize(src);
+  hts_mutex_unlock(&bf->bf_src_mutex);
   return bf->bf_size;
 }
 
@@ -417,6 +784,8 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
 
 
 
+static int fab_read0(buffered_file_t *bf, void *buf, size_t size);
+
 /**
  *
  */
@@ -424,7 +793,6 @@ static int
 fab_read(fa_handle_t *handle, void *buf, size_t size)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
-  fa_handle_t *src = bf->bf_src;
 
   if(bf->bf_mem == NULL) {
     bf->bf_mem = halloc(bf->bf_mem_size);
@@ -435,6 +803,35 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
   if(bf->bf_size != -1 && bf->bf_fpos + size > bf->bf_size)
     size = bf->bf_size - bf->bf_fpos;
 
+  fab_run_t *fr = NULL;
+  for(int i = 0; i < BF_RA_RUNS; i++) {
+    fab_run_t *c = &bf->bf_runs[i];
+    if(c->fr_end == bf->bf_fpos && c->fr_last_use) {
+      fr = c;
+      break;
+    }
+    if(fr == NULL || c->fr_last_use < fr->fr_last_use)
+      fr = c;
+  }
+
+  if(fr->fr_end != bf->bf_fpos || !fr->fr_last_use)
+    fr->fr_start = bf->bf_fpos;
+  fr->fr_last_use = ++bf->bf_use_counter;
+  bf->bf_run = fr;
+
+  int r = fab_read0(bf, buf, size);
+  fr->fr_end = bf->bf_fpos;
+  return r;
+}
+
+
+/**
+ *
+ */
+static int
+fab_read0(buffered_file_t *bf, void *buf, size_t size)
+{
+  fa_handle_t *src = bf->bf_src;
   size_t rval = 0;
   while(size > 0) {
     int mpos = -1;
@@ -449,13 +846,32 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       continue;
     }
 
+    if(bf->bf_ra_ring) {
+      cs = fab_ra_read(bf, buf, size);
+      if(cs > 0) {
+        rval += cs;
+        buf += cs;
+        bf->bf_fpos += cs;
+        size -= cs;
+        continue;
+      }
+      if(cs < 0) {
+        bf->bf_size = bf->bf_fpos;
+        return rval;
+      }
+    }
+
     int rreq = need_to_fill(bf, bf->bf_fpos, size);
     if(rreq >= bf->bf_min_request) {
 
-      if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos)
+      hts_mutex_lock(&bf->bf_src_mutex);
+      if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos) {
+        hts_mutex_unlock(&bf->bf_src_mutex);
 	return -1;
+      }
 
       int r = src->fh_proto->fap_read(src, buf, rreq);
+      hts_mutex_unlock(&bf->bf_src_mutex);
       if(r > 0) {
 	store_in_cache(bf, buf, r);
 	rval += r;
@@ -475,11 +891,15 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
     
     erase_zone(bf, bf->bf_mem_ptr, bf->bf_min_request);
 
-    if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos)
+    hts_mutex_lock(&bf->bf_src_mutex);
+    if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET, 0) != bf->bf_fpos) {
+      hts_mutex_unlock(&bf->bf_src_mutex);
       return -1;
+    }
 
     int r = src->fh_proto->fap_read(src, bf->bf_mem + bf->bf_mem_ptr,
 				    bf->bf_min_request);
+    hts_mutex_unlock(&bf->bf_src_mutex);
     if(r < 1) {
       bf->bf_size = bf->bf_fpos;
       return r < 0 ? r : rval;
@@ -582,6 +1002,33 @@ static fa_protocol_t fa_protocol_buffered = {
 };
 
 
+/**
+ * Returns -1 if 'fh' is not a buffered file
+ */
+int
+fa_buffered_get_stats(fa_handle_t *fh, fa_buffered_stats_t *fbs)
+{
+  buffered_file_t *bf = (buffered_file_t *)fh;
+  int64_t pending = 0;
+
+  if(fh->fh_proto != &fa_protocol_buffered)
+    return -1;
+
+  hts_mutex_lock(&bf->bf_ra_mutex);
+  for(int i = 0; i < BF_RA_STREAMS; i++) {
+    const fab_stream_t *fs = &bf->bf_streams[i];
+    const int64_t end = fs->fs_start + fs->fs_len;
+    if(fs->fs_buf != NULL)
+      pending += MAX(0, end - MAX(fs->fs_used, fs->fs_start));
+  }
+  fbs->fbs_prefetched = bf->bf_ra_prefetched;
+  fbs->fbs_wasted     = bf->bf_ra_prefetched - bf->bf_ra_used - pending;
+  fbs->fbs_stall_time = bf->bf_ra_stall;
+  hts_mutex_unlock(&bf->bf_ra_mutex);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -592,6 +1039,47 @@ fab_cancel(void *aux)
   cancellable_cancel_locked(bf->bf_outbound_cancellable);
 }
 
+/**
+ *
+ */
+static buffered_file_t *
+fab_alloc(void)
+{
+  buffered_file_t *bf = calloc(1, sizeof(buffered_file_t));
+
+  bf->bf_outbound_cancellable = cancellable_create();
+  hts_mutex_init(&bf->bf_ra_mutex);
+  hts_mutex_init(&bf->bf_src_mutex);
+  hts_cond_init(&bf->bf_ra_cond, &bf->bf_ra_mutex);
+  return bf;
+}
+
+
+/**
+ *
+ */
+static fa_handle_t *
+fab_attach(buffered_file_t *bf, fa_handle_t *src, const char *url, int mflags)
+{
+  bf->bf_url = strdup(url);
+  if(!(mflags & FA_BUFFERED_NO_PREFETCH)) {
+    bf->bf_min_request = mflags & FA_BUFFERED_BIG ? 256 * 1024 : 64 * 1024;
+    bf->bf_ra_ring = mflags & FA_BUFFERED_BIG ? 2 * 1024 * 1024 : 512 * 1024;
+  }
+  bf->bf_mem_size = 1024 * 1024;
+  bf->bf_flags =
+    mflags & ~(FA_BUFFERED_SMALL | FA_BUFFERED_BIG | FA_BUFFERED_NO_PREFETCH);
+
+  bf->bf_src = src;
+  bf->bf_size = -1;
+  bf->h.fh_proto = &fa_protocol_buffered;
+#if BF_CHK
+  bf->bf_chk = fa_open_ex(url, NULL, 0, 0, NULL);
+#endif
+  return &bf->h;
+}
+
+
 /**
  *
  */
@@ -642,9 +1130,7 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
 
   fa_open_extra_t new_foe;
 
-  buffered_file_t *bf = calloc(1, sizeof(buffered_file_t));
-
-  bf->bf_outbound_cancellable = cancellable_create();
+  buffered_file_t *bf = fab_alloc();
 
   if(foe != NULL) {
     if(foe->foe_cancellable != NULL) {
@@ -664,21 +1150,200 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
   free(filename);
   if(fh == NULL) {
     cancellable_unbind(bf->bf_inbound_cancellable, bf);
+    hts_cond_destroy(&bf->bf_ra_cond);
+    hts_mutex_destroy(&bf->bf_ra_mutex);
+    hts_mutex_destroy(&bf->bf_src_mutex);
     free(bf);
     return NULL;
   }
 
-  bf->bf_url = strdup(url);
-  if(!(mflags & FA_BUFFERED_NO_PREFETCH))
-    bf->bf_min_request = mflags & FA_BUFFERED_BIG ? 256 * 1024 : 64 * 1024;
-  bf->bf_mem_size = 1024 * 1024;
-  bf->bf_flags = flags;
+  return fab_attach(bf, fh, url, mflags);
+}
 
-  bf->bf_src = fh;
-  bf->bf_size = -1;
-  bf->h.fh_proto = &fa_protocol_buffered;
-#if BF_CHK
-  bf->bf_chk = fa_open_ex(url, NULL, 0, 0, NULL);
-#endif
-  return &bf->h;
+
+#ifdef FA_BUFFER_BENCHMARK
+
+#include <unistd.h>
+
+#define FAB_BENCH_SIZE    (64 * 1024 * 1024)
+#define FAB_BENCH_READ    32768
+#define FAB_BENCH_LATENCY 2000  // µs per source read, plus 100MB/s
+
+static uint8_t *fab_bench_data;
+static int fab_bench_bad;
+
+typedef struct fab_bench_src {
+  fa_handle_t h;
+  int64_t fbs_pos;
+} fab_bench_src_t;
+
+
+static void
+fab_bench_src_close(fa_handle_t *h)
+{
+  free(h);
 }
+
+
+static int
+fab_bench_src_read(fa_handle_t *h, void *buf, size_t size)
+{
+  fab_bench_src_t *src = (fab_bench_src_t *)h;
+  usleep(FAB_BENCH_LATENCY + size / 100);
+  size = MIN(size, FAB_BENCH_SIZE - src->fbs_pos);
+  memcpy(buf, fab_bench_data + src->fbs_pos, size);
+  src->fbs_pos += size;
+  return size;
+}
+
+
+static int64_t
+fab_bench_src_seek(fa_handle_t *h, int64_t pos, int whence, int lazy)
+{
+  fab_bench_src_t *src = (fab_bench_src_t *)h;
+  if(whence == SEEK_END)
+    pos += FAB_BENCH_SIZE;
+  if(pos < 0 || pos > FAB_BENCH_SIZE)
+    return -1;
+  src->fbs_pos = pos;
+  return pos;
+}
+
+
+static int64_t
+fab_bench_src_fsize(fa_handle_t *h)
+{
+  return FAB_BENCH_SIZE;
+}
+
+
+static const fa_protocol_t fab_bench_src_protocol = {
+  .fap_close = fab_bench_src_close,
+  .fap_read  = fab_bench_src_read,
+  .fap_seek  = fab_bench_src_seek,
+  .fap_fsize = fab_bench_src_fsize,
+};
+
+
+static void
+fab_bench_read(fa_handle_t *fh, int64_t pos, int len)
+{
+  uint8_t *buf = malloc(len);
+  const int expect = MIN(len, FAB_BENCH_SIZE - pos);
+
+  if(fab_seek(fh, pos, SEEK_SET, 0) != pos ||
+     fab_read(fh, buf, len) != expect ||
+     memcmp(buf, fab_bench_data + pos, expect))
+    fab_bench_bad++;
+  free(buf);
+}
+
+
+/**
+ * Time one access pattern. Sequential parts pause for 'decode' µs
+ * per chunk like a demuxer would
+ */
+static void
+fab_bench_run(const char *name, int readahead, int pattern)
+{
+  fab_bench_src_t *src = calloc(1, sizeof(fab_bench_src_t));
+  src->h.fh_proto = &fab_bench_src_protocol;
+
+  fa_handle_t *fh = fab_attach(fab_alloc(), &src->h, "bench://",
+                               FA_BUFFERED_BIG);
+  buffered_file_t *bf = (buffered_file_t *)fh;
+  const int decode = 50;
+  int64_t p;
+
+  if(!readahead)
+    bf->bf_ra_ring = 0;
+
+  int64_t ts = arch_get_ts();
+
+  switch(pattern) {
+  case 0: // Sequential
+    for(p = 0; p < FAB_BENCH_SIZE; p += FAB_BENCH_READ) {
+      fab_bench_read(fh, p, FAB_BENCH_READ);
+      usleep(decode);
+    }
+    break;
+
+  case 1: // Header, index at the end, back to the start
+    for(p = 0; p < 256 * 1024; p += FAB_BENCH_READ)
+      fab_bench_read(fh, p, FAB_BENCH_READ);
+    for(p = FAB_BENCH_SIZE - 1024 * 1024; p < FAB_BENCH_SIZE;
+        p += FAB_BENCH_READ)
+      fab_bench_read(fh, p, FAB_BENCH_READ);
+    for(p = 256 * 1024; p < 16 * 1024 * 1024; p += FAB_BENCH_READ) {
+      fab_bench_read(fh, p, FAB_BENCH_READ);
+      usleep(decode);
+    }
+    break;
+
+  case 2: // Two interleaved positions
+    for(p = 0; p < 8 * 1024 * 1024; p += FAB_BENCH_READ) {
+      fab_bench_read(fh, p, FAB_BENCH_READ);
+      fab_bench_read(fh, p + FAB_BENCH_SIZE / 2, FAB_BENCH_READ);
+      usleep(decode);
+    }
+    break;
+
+  case 3: { // Random
+    uint32_t x = 1;
+    for(int i = 0; i < 500; i++) {
+      x = x * 1103515245 + 12345;
+      fab_bench_read(fh, x % FAB_BENCH_SIZE, 1 + (x >> 8) % 100000);
+    }
+    break;
+  }
+  }
+
+  ts = arch_get_ts() - ts;
+
+  fa_buffered_stats_t fbs;
+  fa_buffered_get_stats(fh, &fbs);
+  printf("%-12s %-3s %8.1f ms  prefetched %6d kB  wasted %6d kB  "
+         "stalled %5d ms\n",
+         name, readahead ? "RA" : "-", ts / 1000.0,
+         (int)(fbs.fbs_prefetched >> 10), (int)(fbs.fbs_wasted >> 10),
+         (int)(fbs.fbs_stall_time / 1000));
+  fab_close(fh);
+}
+
+
+/**
+ * Read a synthetic 64MB file with a few access patterns through a
+ * source with 2ms latency and 100MB/s, with and without read-ahead.
+ * Build with -DFA_BUFFER_BENCHMARK. The process exits when done
+ */
+static void *
+fab_benchmark(void *aux)
+{
+  static const char *patterns[] = {
+    "sequential", "header/index", "interleaved", "random"
+  };
+
+  fab_bench_data = malloc(FAB_BENCH_SIZE);
+  for(int i = 0; i < FAB_BENCH_SIZE; i++)
+    fab_bench_data[i] = (i * 2654435761U) >> 13;
+
+  for(int i = 0; i < 4; i++) {
+    fab_bench_run(patterns[i], 0, i);
+    fab_bench_run(patterns[i], 1, i);
+  }
+  printf("%d bad reads\n", fab_bench_bad);
+  free(fab_bench_data);
+  exit(0);
+}
+
+
+static void
+fab_benchmark_init(void)
+{
+  hts_thread_create_detached("fabbench", fab_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, fab_benchmark_init, NULL, 0);
+
+#endif
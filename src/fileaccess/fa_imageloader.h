@@ -22,6 +22,7 @@
 
 struct image_meta;
 struct backend;
+struct buf;
 
 void fa_imageloader_init(void);
 
@@ -30,5 +31,7 @@ struct image *fa_imageloader(const char *url, const struct image_meta *im,
                              int *cache_control, cancellable_t *c,
                              struct backend *be);
 
+struct image *fa_imageloader_buf(struct buf *buf, char *errbuf, size_t errlen);
+
 
 #endif /* FA_IMAGELOADER_H */
@@ -36,9 +36,54 @@
 
 extern int media_buffer_hungry;
 
+#define INDEXER_WRITE_BATCH 64
+
+/**
+ * Items waiting to be written to metadb in one transaction
+ */
+typedef struct index_batch {
+  void *ib_db;
+  const char *ib_parent;
+  time_t ib_parent_mtime;
+  int ib_num;
+  rstr_t *ib_urls[INDEXER_WRITE_BATCH];
+  metadata_t *ib_mds[INDEXER_WRITE_BATCH];
+  metadb_write_item_t ib_items[INDEXER_WRITE_BATCH];
+} index_batch_t;
+
+
+/**
+ *
+ */
 static void
-update_item(void *db, const fa_dir_entry_t *fsentry, const char *parent,
-            time_t parent_mtime)
+index_batch_flush(index_batch_t *ib)
+{
+  if(ib->ib_num == 0)
+    return;
+
+  if(metadb_metadata_write_batch(ib->ib_db, ib->ib_items, ib->ib_num,
+                                 ib->ib_parent, ib->ib_parent_mtime)) {
+    for(int i = 0; i < ib->ib_num; i++) {
+      const metadb_write_item_t *mwi = &ib->ib_items[i];
+      metadb_metadata_write(ib->ib_db, mwi->mwi_url, mwi->mwi_mtime,
+                            mwi->mwi_md, ib->ib_parent, ib->ib_parent_mtime,
+                            mwi->mwi_indexstatus);
+    }
+  }
+
+  for(int i = 0; i < ib->ib_num; i++) {
+    rstr_release(ib->ib_urls[i]);
+    metadata_destroy(ib->ib_mds[i]);
+  }
+  ib->ib_num = 0;
+}
+
+
+/**
+ *
+ */
+static void
+update_item(index_batch_t *ib, const fa_dir_entry_t *fsentry)
 {
   metadata_t *md;
   metadata_index_status_t index_status = INDEX_STATUS_ANALYZED;
@@ -58,11 +103,16 @@ update_item(void *db, const fa_dir_entry_t *fsentry, const char *parent,
   if(md == NULL)
     return;
 
-  metadb_metadata_write(db, rstr_get(fsentry->fde_url),
-                        fsentry->fde_stat.fs_mtime,
-                        md, parent, parent_mtime,
-                        index_status);
-  metadata_destroy(md);
+  const int i = ib->ib_num++;
+  ib->ib_urls[i] = rstr_dup(fsentry->fde_url);
+  ib->ib_mds[i] = md;
+  ib->ib_items[i].mwi_url = rstr_get(ib->ib_urls[i]);
+  ib->ib_items[i].mwi_mtime = fsentry->fde_stat.fs_mtime;
+  ib->ib_items[i].mwi_md = md;
+  ib->ib_items[i].mwi_indexstatus = index_status;
+
+  if(ib->ib_num == INDEXER_WRITE_BATCH)
+    index_batch_flush(ib);
 }
 
 
@@ -77,6 +127,11 @@ rescan_directory(const char *url, char *errbuf, size_t errlen, void *db,
   if(fsdir == NULL)
     return -1;
 
+  index_batch_t *ib = calloc(1, sizeof(index_batch_t));
+  ib->ib_db = db;
+  ib->ib_parent = url;
+  ib->ib_parent_mtime = fs_mtime;
+
   RB_FOREACH(fsentry, &fsdir->fd_entries, fde_link) {
     fa_dir_entry_stat(fsentry);
     if(fsentry->fde_type == CONTENT_FILE) {
@@ -106,7 +161,7 @@ rescan_directory(const char *url, char *errbuf, size_t errlen, void *db,
         // Ok, don't do anything
       } else {
         INDEXER_TRACE("Updating item %s", rstr_get(fsentry->fde_url));
-        update_item(db, fsentry, url, fs_mtime);
+        update_item(ib, fsentry);
       }
       fa_dir_entry_free(fsdir, fsentry);
     } else {
@@ -120,9 +175,12 @@ rescan_directory(const char *url, char *errbuf, size_t errlen, void *db,
     if(fsentry->fde_type == CONTENT_UNKNOWN)
       continue;
     INDEXER_TRACE("New item %s", rstr_get(fsentry->fde_url));
-    update_item(db, fsentry, url, fs_mtime);
+    update_item(ib, fsentry);
   }
 
+  index_batch_flush(ib);
+  free(ib);
+
   fa_dir_free(fsdir);
   fa_dir_free(dbdir);
   return 0;
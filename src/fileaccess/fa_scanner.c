@@ -40,6 +40,7 @@
 #include "notifications.h"
 #include "metadata/playinfo.h"
 #include "metadata/metadata_str.h"
+#include "misc/minmax.h"
 
 #define SCAN_TRACE(s, x, ...) do {                                   \
     if(s->s_dbg)                                                     \
@@ -49,6 +50,31 @@
 
 extern int media_buffer_hungry;
 
+#define PROBE_MAX_WORKERS 16
+#define PROBE_WRITE_BATCH 32
+
+/**
+ * A file being deep probed by a probe worker
+ */
+typedef struct probe_job {
+  TAILQ_ENTRY(probe_job) pj_link;
+  struct scanner *pj_scanner;
+  fa_dir_entry_t *pj_fde;  // NULL if entry was removed during probe
+  rstr_t *pj_url;
+  rstr_t *pj_filename;
+  int pj_type;
+  metadata_t *pj_md;
+  prop_sub_t *pj_visible_sub;
+  enum {
+    PJ_QUEUED,
+    PJ_WANTED,
+    PJ_ACTIVE,
+    PJ_DONE,
+  } pj_state;
+} probe_job_t;
+
+TAILQ_HEAD(probe_job_queue, probe_job);
+
 
 
 typedef struct scanner {
@@ -81,9 +107,46 @@ typedef struct scanner {
 
   int s_dbg;
 
+  /**
+   * Deep probe pipeline. s_probe_mutex protects the queues
+   * and s_probe_pending (all jobs not yet collected by the scanner)
+   */
+  hts_mutex_t s_probe_mutex;
+  hts_cond_t s_probe_cond;
+  struct probe_job_queue s_probe_queued;
+  struct probe_job_queue s_probe_wanted; // Items visible in the UI
+  struct probe_job_queue s_probe_active;
+  struct probe_job_queue s_probe_done;
+  int s_probe_pending;
+
+  metadb_write_item_t s_write_batch[PROBE_WRITE_BATCH];
+  int s_write_batch_len;
+
 } scanner_t;
 
 
+/**
+ * Per-protocol limits on number of concurrent probes so we don't
+ * hammer file servers with requests. Shared between all scanners
+ */
+static const struct {
+  const char *proto;
+  int max;
+} probe_proto_caps[] = {
+  { "smb",     2 },
+  { "ftp",     1 },
+  { "ftps",    1 },
+  { "webdav",  2 },
+  { "webdavs", 2 },
+  { "http",    2 },
+  { "https",   2 },
+};
+
+static int probe_proto_active[ARRAYSIZE(probe_proto_caps)];
+static HTS_MUTEX_DECL(probe_proto_mutex);
+static hts_cond_t probe_proto_cond;
+
+
 static int rescan(scanner_t *s);
 static void browse_as_dir(scanner_t *s);
 
@@ -178,102 +241,454 @@ make_prop(fa_dir_entry_t *fde)
  *
  */
 static void
-deep_probe(fa_dir_entry_t *fde, scanner_t *s)
+probe_batch_flush(scanner_t *s)
 {
-  if(fde->fde_type == CONTENT_SHARE)
+  if(s->s_write_batch_len == 0)
     return;
 
-  fde->fde_probestatus = FDE_PROBED_CONTENTS;
+  SCAN_TRACE(s, "%s: Storing %d items in DB", s->s_url, s->s_write_batch_len);
+  if(metadb_metadata_write_batch(getdb(s), s->s_write_batch,
+                                 s->s_write_batch_len, s->s_url,
+                                 s->s_mtime)) {
+    SCAN_TRACE(s, "%s: Batch write failed, storing items one by one",
+               s->s_url);
+    for(int i = 0; i < s->s_write_batch_len; i++) {
+      const metadb_write_item_t *mwi = &s->s_write_batch[i];
+      metadb_metadata_write(getdb(s), mwi->mwi_url, mwi->mwi_mtime,
+                            mwi->mwi_md, s->s_url, s->s_mtime,
+                            mwi->mwi_indexstatus);
+    }
+  }
+  s->s_write_batch_len = 0;
+}
 
-  SCAN_TRACE(s, "Deep probing %s -- content_type:%s prop=%p",
-             rstr_get(fde->fde_url), content2type(fde->fde_type),
-             fde->fde_prop);
 
-  if(fde->fde_type != CONTENT_UNKNOWN) {
+/**
+ * Queue metadata for writing to metadb. The batch refers to data owned
+ * by the entry so it must be flushed before entries are destroyed
+ */
+static void
+probe_batch_add(scanner_t *s, fa_dir_entry_t *fde)
+{
+  metadb_write_item_t *mwi = &s->s_write_batch[s->s_write_batch_len++];
 
-    prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
+  mwi->mwi_url = rstr_get(fde->fde_url);
+  mwi->mwi_mtime = fde->fde_stat.fs_mtime;
+  mwi->mwi_md = fde->fde_md;
+  mwi->mwi_indexstatus = INDEX_STATUS_NOCHANGE;
 
-    if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
-       (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
+  if(s->s_write_batch_len == PROBE_WRITE_BATCH)
+    probe_batch_flush(s);
+}
 
-      if(fde->fde_md != NULL)
-	metadata_destroy(fde->fde_md);
 
-      fde->fde_md = metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
-					fde->fde_stat.fs_mtime);
-      SCAN_TRACE(s, "%s: Metadata %sfound", rstr_get(fde->fde_url),
-                 fde->fde_md ? "" : "not ");
-    }
+/**
+ * Second half of deep probe, publish the metadata we got from either
+ * the DB or from probing
+ */
+static void
+deep_probe_finish(fa_dir_entry_t *fde, scanner_t *s)
+{
+  prop_t *meta = prop_create_r(fde->fde_prop, "metadata");
 
-    if(fde->fde_statdone && meta != NULL)
-      prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
+  if(fde->fde_statdone && meta != NULL)
+    prop_set(meta, "timestamp", PROP_SET_INT, fde->fde_stat.fs_mtime);
 
-    metadata_index_status_t is = INDEX_STATUS_NOCHANGE;
+  if(fde->fde_md != NULL) {
+    fde->fde_type = fde->fde_md->md_contenttype;
+    fde->fde_ignore_cache = 0;
 
-    if(fde->fde_md == NULL) {
+    if(meta != NULL) {
+      switch(fde->fde_type) {
+#if ENABLE_PLUGINS
+      case CONTENT_PLUGIN:
+        plugin_props_from_file(fde->fde_prop, rstr_get(fde->fde_url));
+        break;
+#endif
+      case CONTENT_FONT:
+        fontstash_props_from_title(fde->fde_prop, rstr_get(fde->fde_url),
+                                   rstr_get(fde->fde_filename));
+        break;
 
-      if(fde->fde_type == CONTENT_DIR) {
-        fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
-      } else {
-	fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
-					rstr_get(fde->fde_filename), NULL);
-        //        is = INDEX_STATUS_FILE_ANALYZED;
+      default:
+        metadata_to_proptree(fde->fde_md, meta, 1);
+        break;
       }
     }
-    
-    if(fde->fde_md != NULL) {
-      fde->fde_type = fde->fde_md->md_contenttype;
-      fde->fde_ignore_cache = 0;
+    SCAN_TRACE(s, "%s: Cache status: %d",
+               rstr_get(fde->fde_url), fde->fde_md->md_cache_status);
+
+    switch(fde->fde_md->md_cache_status) {
+    case METADATA_CACHE_STATUS_NO:
+      SCAN_TRACE(s, "Storing item %s in DB parent:%s mtime:%d",
+                 rstr_get(fde->fde_url), s->s_url,
+                 (int)fde->fde_stat.fs_mtime);
+      probe_batch_add(s, fde);
+      break;
+    case METADATA_CACHE_STATUS_FULL:
+      // All set
+      break;
+    case METADATA_CACHE_STATUS_UNPARENTED:
+      // Reparent item
+      metadb_parent_item(getdb(s), rstr_get(fde->fde_url), s->s_url);
+      break;
+    }
+  }
+  prop_ref_dec(meta);
 
-      if(meta != NULL) {
-        switch(fde->fde_type) {
-#if ENABLE_PLUGINS
-        case CONTENT_PLUGIN:
-          plugin_props_from_file(fde->fde_prop, rstr_get(fde->fde_url));
-          break;
-#endif
-        case CONTENT_FONT:
-          fontstash_props_from_title(fde->fde_prop, rstr_get(fde->fde_url),
-                                     rstr_get(fde->fde_filename));
-          break;
-          
-        default:
-          metadata_to_proptree(fde->fde_md, meta, 1);
-          break;
-        }
-      }
-      SCAN_TRACE(s, "%s: Cache status: %d",
-                 rstr_get(fde->fde_url), fde->fde_md->md_cache_status);
-
-      switch(fde->fde_md->md_cache_status) {
-      case METADATA_CACHE_STATUS_NO:
-        SCAN_TRACE(s, "Storing item %s in DB parent:%s mtime:%d",
-                   rstr_get(fde->fde_url), s->s_url,
-                   (int)fde->fde_stat.fs_mtime);
-	metadb_metadata_write(getdb(s), rstr_get(fde->fde_url),
-			      fde->fde_stat.fs_mtime,
-			      fde->fde_md, s->s_url, s->s_mtime,
-                              is);
-	break;
-      case METADATA_CACHE_STATUS_FULL:
-	// All set
-	break;
-      case METADATA_CACHE_STATUS_UNPARENTED:
-	// Reparent item
-	metadb_parent_item(getdb(s), rstr_get(fde->fde_url), s->s_url);
-	break;
+  if(fde->fde_prop != NULL && !fde->fde_bound_to_metadb) {
+    fde->fde_bound_to_metadb = 1;
+    playinfo_bind_url_to_prop(rstr_get(fde->fde_url), fde->fde_prop);
+  }
+
+  if(fde->fde_prop != NULL)
+    set_type(fde->fde_prop, fde->fde_type);
+}
+
+
+/**
+ * Move a job to the front of the line once the UI starts to look at it
+ */
+static void
+probe_job_visible(void *opaque, prop_event_t event, ...)
+{
+  probe_job_t *pj = opaque;
+  scanner_t *s = pj->pj_scanner;
+
+  if(event != PROP_SUBSCRIPTION_MONITOR_ACTIVE)
+    return;
+
+  hts_mutex_lock(&s->s_probe_mutex);
+  if(pj->pj_state == PJ_QUEUED) {
+    TAILQ_REMOVE(&s->s_probe_queued, pj, pj_link);
+    TAILQ_INSERT_TAIL(&s->s_probe_wanted, pj, pj_link);
+    pj->pj_state = PJ_WANTED;
+  }
+  hts_mutex_unlock(&s->s_probe_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+probe_job_free(probe_job_t *pj)
+{
+  prop_unsubscribe(pj->pj_visible_sub);
+  rstr_release(pj->pj_url);
+  rstr_release(pj->pj_filename);
+  if(pj->pj_md != NULL)
+    metadata_destroy(pj->pj_md);
+  free(pj);
+}
+
+
+/**
+ *
+ */
+static void
+probe_job_enqueue(fa_dir_entry_t *fde, scanner_t *s)
+{
+  probe_job_t *pj = calloc(1, sizeof(probe_job_t));
+
+  pj->pj_scanner = s;
+  pj->pj_fde = fde;
+  pj->pj_url = rstr_dup(fde->fde_url);
+  pj->pj_filename = rstr_dup(fde->fde_filename);
+  pj->pj_type = fde->fde_type;
+
+  if(fde->fde_prop != NULL)
+    pj->pj_visible_sub =
+      prop_subscribe(PROP_SUB_SUBSCRIPTION_MONITOR,
+                     PROP_TAG_CALLBACK, probe_job_visible, pj,
+                     PROP_TAG_NAMED_ROOT, fde->fde_prop, "node",
+                     PROP_TAG_NAMESTR, "node.metadata.title",
+                     PROP_TAG_COURIER, s->s_pc,
+                     NULL);
+
+  hts_mutex_lock(&s->s_probe_mutex);
+  TAILQ_INSERT_TAIL(&s->s_probe_queued, pj, pj_link);
+  pj->pj_state = PJ_QUEUED;
+  s->s_probe_pending++;
+  hts_mutex_unlock(&s->s_probe_mutex);
+}
+
+
+/**
+ * Forget about any probe job for an entry that is going away
+ */
+static void
+probe_job_cancel(scanner_t *s, fa_dir_entry_t *fde)
+{
+  probe_job_t *pj;
+
+  hts_mutex_lock(&s->s_probe_mutex);
+
+  TAILQ_FOREACH(pj, &s->s_probe_queued, pj_link)
+    if(pj->pj_fde == fde)
+      goto found;
+  TAILQ_FOREACH(pj, &s->s_probe_wanted, pj_link)
+    if(pj->pj_fde == fde)
+      goto found;
+  TAILQ_FOREACH(pj, &s->s_probe_active, pj_link)
+    if(pj->pj_fde == fde)
+      goto found;
+  TAILQ_FOREACH(pj, &s->s_probe_done, pj_link)
+    if(pj->pj_fde == fde)
+      goto found;
+
+  hts_mutex_unlock(&s->s_probe_mutex);
+  return;
+
+ found:
+  pj->pj_fde = NULL;
+  hts_mutex_unlock(&s->s_probe_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+probe_proto_slot(const char *url)
+{
+  const char *x = strstr(url, "://");
+  int len;
+
+  if(x == NULL)
+    return -1;
+
+  len = x - url;
+  for(int i = 0; i < ARRAYSIZE(probe_proto_caps); i++)
+    if(strlen(probe_proto_caps[i].proto) == len &&
+       !strncmp(probe_proto_caps[i].proto, url, len))
+      return i;
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+probe_proto_acquire(int slot)
+{
+  if(slot == -1)
+    return;
+
+  hts_mutex_lock(&probe_proto_mutex);
+  while(probe_proto_active[slot] >= probe_proto_caps[slot].max)
+    hts_cond_wait(&probe_proto_cond, &probe_proto_mutex);
+  probe_proto_active[slot]++;
+  hts_mutex_unlock(&probe_proto_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+probe_proto_release(int slot)
+{
+  if(slot == -1)
+    return;
+
+  hts_mutex_lock(&probe_proto_mutex);
+  probe_proto_active[slot]--;
+  hts_cond_broadcast(&probe_proto_cond);
+  hts_mutex_unlock(&probe_proto_mutex);
+}
+
+
+/**
+ * Probe worker, picks jobs off the scanner queues until they are empty
+ */
+static void *
+probe_worker(void *aux)
+{
+  scanner_t *s = aux;
+  probe_job_t *pj;
+
+  hts_mutex_lock(&s->s_probe_mutex);
+
+  while(s->s_running) {
+
+    if((pj = TAILQ_FIRST(&s->s_probe_wanted)) != NULL) {
+      TAILQ_REMOVE(&s->s_probe_wanted, pj, pj_link);
+    } else if((pj = TAILQ_FIRST(&s->s_probe_queued)) != NULL) {
+      TAILQ_REMOVE(&s->s_probe_queued, pj, pj_link);
+    } else {
+      break;
+    }
+
+    if(pj->pj_fde == NULL) {
+      // Entry went away while queued, don't waste a probe on it
+      TAILQ_INSERT_TAIL(&s->s_probe_done, pj, pj_link);
+      pj->pj_state = PJ_DONE;
+      hts_cond_signal(&s->s_probe_cond);
+      continue;
+    }
+
+    TAILQ_INSERT_TAIL(&s->s_probe_active, pj, pj_link);
+    pj->pj_state = PJ_ACTIVE;
+    hts_mutex_unlock(&s->s_probe_mutex);
+
+    while(media_buffer_hungry && s->s_running)
+      sleep(1);
+
+    const char *url = rstr_get(pj->pj_url);
+    const int slot = probe_proto_slot(url);
+
+    probe_proto_acquire(slot);
+
+    // Might have been cancelled while we waited for a slot
+    hts_mutex_lock(&s->s_probe_mutex);
+    const int cancelled = pj->pj_fde == NULL;
+    hts_mutex_unlock(&s->s_probe_mutex);
+
+    if(cancelled) {
+      // Nothing to do
+    } else if(pj->pj_type == CONTENT_DIR) {
+      pj->pj_md = fa_probe_dir(url);
+    } else {
+      pj->pj_md = fa_probe_metadata(url, NULL, 0,
+                                    rstr_get(pj->pj_filename), NULL);
+    }
+
+    probe_proto_release(slot);
+
+    hts_mutex_lock(&s->s_probe_mutex);
+    TAILQ_REMOVE(&s->s_probe_active, pj, pj_link);
+    TAILQ_INSERT_TAIL(&s->s_probe_done, pj, pj_link);
+    pj->pj_state = PJ_DONE;
+    hts_cond_signal(&s->s_probe_cond);
+  }
+
+  hts_mutex_unlock(&s->s_probe_mutex);
+  return NULL;
+}
+
+
+/**
+ * Probe everything that was queued by deep_probe() using a bounded
+ * number of workers. Results are published and written to DB from
+ * the scanner thread as they arrive
+ */
+static void
+probe_run(scanner_t *s)
+{
+  hts_thread_t tids[PROBE_MAX_WORKERS];
+  probe_job_t *pj;
+  int i, workers;
+
+  workers = MIN(MAX(gconf.fa_probe_workers, 1), PROBE_MAX_WORKERS);
+  workers = MIN(workers, s->s_probe_pending);
+
+  SCAN_TRACE(s, "%s: Probing %d items using %d workers",
+             s->s_url, s->s_probe_pending, workers);
+
+  for(i = 0; i < workers; i++)
+    hts_thread_create_joinable("fa probe", &tids[i], probe_worker, s,
+                               THREAD_PRIO_METADATA_BG);
+
+  hts_mutex_lock(&s->s_probe_mutex);
+
+  while(s->s_probe_pending > 0 && s->s_running) {
+
+    if((pj = TAILQ_FIRST(&s->s_probe_done)) == NULL) {
+      if(hts_cond_wait_timeout(&s->s_probe_cond, &s->s_probe_mutex, 250)) {
+        // Nothing happened for a while, write what we have and
+        // check with the UI
+        hts_mutex_unlock(&s->s_probe_mutex);
+        probe_batch_flush(s);
+        prop_courier_poll(s->s_pc);
+        hts_mutex_lock(&s->s_probe_mutex);
       }
+      continue;
     }
-    prop_ref_dec(meta);
 
-    if(fde->fde_prop != NULL && !fde->fde_bound_to_metadb) {
-      fde->fde_bound_to_metadb = 1;
-      playinfo_bind_url_to_prop(rstr_get(fde->fde_url), fde->fde_prop);
+    TAILQ_REMOVE(&s->s_probe_done, pj, pj_link);
+    s->s_probe_pending--;
+    hts_mutex_unlock(&s->s_probe_mutex);
+
+    fa_dir_entry_t *fde = pj->pj_fde;
+    if(fde != NULL) {
+      fde->fde_md = pj->pj_md;
+      pj->pj_md = NULL;
+      deep_probe_finish(fde, s);
     }
+    probe_job_free(pj);
+
+    if(s->s_write_batch_len == 0) {
+      // Batch was just flushed, good time to let the UI talk to us
+      prop_courier_poll(s->s_pc);
+    }
+    hts_mutex_lock(&s->s_probe_mutex);
   }
 
-  if(fde->fde_prop != NULL)
-    set_type(fde->fde_prop, fde->fde_type);
+  hts_mutex_unlock(&s->s_probe_mutex);
+
+  for(i = 0; i < workers; i++)
+    hts_thread_join(&tids[i]);
+
+  probe_batch_flush(s);
+
+  // If we were stopped there might be jobs left
+
+  while((pj = TAILQ_FIRST(&s->s_probe_queued)) != NULL) {
+    TAILQ_REMOVE(&s->s_probe_queued, pj, pj_link);
+    probe_job_free(pj);
+  }
+  while((pj = TAILQ_FIRST(&s->s_probe_wanted)) != NULL) {
+    TAILQ_REMOVE(&s->s_probe_wanted, pj, pj_link);
+    probe_job_free(pj);
+  }
+  while((pj = TAILQ_FIRST(&s->s_probe_done)) != NULL) {
+    TAILQ_REMOVE(&s->s_probe_done, pj, pj_link);
+    probe_job_free(pj);
+  }
+  s->s_probe_pending = 0;
+}
+
+
+/**
+ * First half of deep probe. Entries with metadata already in the DB
+ * are finished right away, everything else is queued for probe_run()
+ */
+static void
+deep_probe(fa_dir_entry_t *fde, scanner_t *s)
+{
+  if(fde->fde_type == CONTENT_SHARE)
+    return;
+
+  fde->fde_probestatus = FDE_PROBED_CONTENTS;
+
+  SCAN_TRACE(s, "Deep probing %s -- content_type:%s prop=%p",
+             rstr_get(fde->fde_url), content2type(fde->fde_type),
+             fde->fde_prop);
+
+  if(fde->fde_type == CONTENT_UNKNOWN) {
+    if(fde->fde_prop != NULL)
+      set_type(fde->fde_prop, fde->fde_type);
+    return;
+  }
+
+  if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
+     (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
+
+    if(fde->fde_md != NULL)
+      metadata_destroy(fde->fde_md);
+
+    fde->fde_md = metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
+                                      fde->fde_stat.fs_mtime);
+    SCAN_TRACE(s, "%s: Metadata %sfound", rstr_get(fde->fde_url),
+               fde->fde_md ? "" : "not ");
+  }
+
+  if(fde->fde_md == NULL)
+    probe_job_enqueue(fde, s);
+  else
+    deep_probe_finish(fde, s);
 }
 
 
@@ -329,6 +744,11 @@ analyzer(scanner_t *s, int probe)
     if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe)
       deep_probe(fde, s);
   }
+
+  if(s->s_probe_pending)
+    probe_run(s);
+  else
+    probe_batch_flush(s);
 }
 
 
@@ -345,6 +765,13 @@ scanner_create(const char *url, time_t mtime, int dbg)
   s->s_running = 1;
   s->s_mtime = mtime;
   s->s_dbg = dbg;
+
+  hts_mutex_init(&s->s_probe_mutex);
+  hts_cond_init(&s->s_probe_cond, &s->s_probe_mutex);
+  TAILQ_INIT(&s->s_probe_queued);
+  TAILQ_INIT(&s->s_probe_wanted);
+  TAILQ_INIT(&s->s_probe_active);
+  TAILQ_INIT(&s->s_probe_done);
   return s;
 }
 
@@ -358,6 +785,8 @@ scanner_destroy(scanner_t *s)
   closedb(s);
   free(s->s_url);
   prop_courier_destroy(s->s_pc);
+  hts_cond_destroy(&s->s_probe_cond);
+  hts_mutex_destroy(&s->s_probe_mutex);
   free(s);
 }
 
@@ -411,6 +840,7 @@ scanner_entry_destroy(scanner_t *s, fa_dir_entry_t *fde, const char *src)
 {
   SCAN_TRACE(s, "%s: File %s removed by %s",
              s->s_url, rstr_get(fde->fde_url), src);
+  probe_job_cancel(s, fde);
   metadb_unparent_item(getdb(s), rstr_get(fde->fde_url));
   if(fde->fde_prop != NULL)
     prop_destroy(fde->fde_prop);
@@ -1019,6 +1449,16 @@ browse_as_dir(scanner_t *s)
                             s->s_url, "Directory");
 }
 
+/**
+ *
+ */
+void
+fa_scanner_init(void)
+{
+  hts_cond_init(&probe_proto_cond, &probe_proto_mutex);
+}
+
+
 /**
  *
  */
@@ -26,6 +26,7 @@
 #include "media/media.h"
 #include "fileaccess.h"
 #include "fa_libav.h"
+#include "fa_videothumb.h"
 #include "backend/dvd/dvd.h"
 #include "notifications.h"
 #include "htsmsg/htsmsg_xml.h"
@@ -442,6 +443,8 @@ build_index(media_pipe_t *mp, AVFormatContext *fctx, const char *url)
     if(prop_set_parent(p, parent))
       abort();
   }
+
+  videothumb_strip_register(url, 60, items);
   return si;
 }
 
@@ -892,6 +895,9 @@ be_file_playvideo_fh(const char *url, media_pipe_t *mp,
   video_playback_info_invoke(VPI_STOP, vpi, mp->mp_prop_root, va.origin);
   htsmsg_release(vpi);
 
+  if(si != NULL)
+    videothumb_strip_unregister(url);
+
   seek_index_destroy(si);
   seek_index_destroy(ci);
 
@@ -0,0 +1,1069 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <assert.h>
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libswscale/swscale.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+
+#include "main.h"
+#include "fileaccess.h"
+#include "fa_libav.h"
+#include "fa_imageloader.h"
+#include "fa_videothumb.h"
+#include "misc/callout.h"
+#include "misc/minmax.h"
+#include "image/image.h"
+#include "image/pixmap.h"
+#include "blobcache.h"
+#include "task.h"
+
+#define VT_POOL_SIZE       3   // Max number of open demux/decode contexts
+#define VT_IDLE_TIMEOUT    5   // Seconds until an idle context is closed
+#define VT_MAX_PACKETS     100 // Give up if no picture after this many
+#define VT_STRIP_INFLIGHT  4   // Decoded frames waiting to be scaled
+#define VT_STRIP_NEAR      2   // Wait for the strip if it's this close
+
+/**
+ * An open file with its video decoder
+ */
+typedef struct vt_ctx {
+  LIST_ENTRY(vt_ctx) vc_link;
+  char *vc_url;
+  AVFormatContext *vc_fctx;
+  AVCodecContext *vc_ctx;
+  int vc_stream;
+  int vc_busy;
+  time_t vc_last_used;
+} vt_ctx_t;
+
+LIST_HEAD(vt_ctx_list, vt_ctx);
+
+
+/**
+ * Seek index strip, see videothumb_strip_register()
+ */
+typedef struct vt_strip {
+  LIST_ENTRY(vt_strip) vs_link;
+  char *vs_url;
+  int vs_refcount;
+  int vs_users;        // Number of registrations
+  int vs_zombie;       // Unregistered, batch job should stop
+  int vs_interval;
+  int vs_items;
+
+  int vs_running;      // Batch thread + scale tasks still running
+  int vs_inflight;     // Scale tasks queued or running
+
+  // Parameters for the current (or last) batch job
+
+  int vs_cursor;       // Batch job continues from here
+  int vs_current;      // Item being decoded, -1 if none
+  char vs_siz[4];
+  int vs_req_width;
+  int vs_req_height;
+  time_t vs_mtime;
+  uint8_t *vs_done;    // VS_* state of items at vs_siz
+} vt_strip_t;
+
+#define VS_PENDING 0
+#define VS_DONE    1   // Generated or failed
+#define VS_SCALING 2   // Decoded, scale task queued
+
+LIST_HEAD(vt_strip_list, vt_strip);
+
+
+/**
+ * A decoded frame to be scaled and stored
+ */
+typedef struct vt_scale_job {
+  vt_strip_t *vsj_strip;
+  int vsj_item;
+  AVFrame *vsj_frame;
+  int vsj_width;
+  int vsj_height;
+  time_t vsj_mtime;
+  char vsj_cacheid[0];
+} vt_scale_job_t;
+
+
+static hts_mutex_t vt_mutex;
+static hts_cond_t vt_cond;
+static struct vt_ctx_list vt_ctxs;
+static int vt_num_ctxs;
+static struct vt_strip_list vt_strips;
+static callout_t vt_autoclose_callout;
+static AVCodec *thumbcodec;
+
+static hts_mutex_t vt_stat_mutex;
+static char *stated_url;
+static fa_stat_t stated_fs;
+
+
+/**
+ *
+ */
+void
+videothumb_init(void)
+{
+  hts_mutex_init(&vt_mutex);
+  hts_cond_init(&vt_cond, &vt_mutex);
+  hts_mutex_init(&vt_stat_mutex);
+  thumbcodec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+}
+
+
+/**
+ *
+ */
+static void
+vt_ctx_close(vt_ctx_t *vc)
+{
+  free(vc->vc_url);
+  avcodec_close(vc->vc_ctx);
+  fa_libav_close_format(vc->vc_fctx, 0);
+  free(vc);
+}
+
+
+/**
+ *
+ */
+static void
+vt_autoclose(callout_t *c, void *aux)
+{
+  struct vt_ctx_list expired;
+  vt_ctx_t *vc, *next;
+  const time_t now = time(NULL);
+
+  LIST_INIT(&expired);
+
+  hts_mutex_lock(&vt_mutex);
+  for(vc = LIST_FIRST(&vt_ctxs); vc != NULL; vc = next) {
+    next = LIST_NEXT(vc, vc_link);
+    if(vc->vc_busy || now - vc->vc_last_used < VT_IDLE_TIMEOUT)
+      continue;
+    LIST_REMOVE(vc, vc_link);
+    LIST_INSERT_HEAD(&expired, vc, vc_link);
+    vt_num_ctxs--;
+  }
+
+  if(LIST_FIRST(&vt_ctxs) != NULL)
+    callout_arm(&vt_autoclose_callout, vt_autoclose, NULL, VT_IDLE_TIMEOUT);
+
+  hts_cond_broadcast(&vt_cond);
+  hts_mutex_unlock(&vt_mutex);
+
+  while((vc = LIST_FIRST(&expired)) != NULL) {
+    TRACE(TRACE_DEBUG, "Thumb", "Closing %s", vc->vc_url);
+    LIST_REMOVE(vc, vc_link);
+    vt_ctx_close(vc);
+  }
+}
+
+
+/**
+ *
+ */
+static image_t *
+thumb_from_buf(buf_t *buf, char *errbuf, size_t errlen,
+               const char *cacheid, time_t mtime)
+{
+  image_t *img = fa_imageloader_buf(buf, errbuf, errlen);
+
+  if(img != NULL)
+    blobcache_put(cacheid, "videothumb", buf, INT32_MAX, NULL, mtime, 0);
+
+  buf_release(buf);
+  return img;
+}
+
+
+/**
+ *
+ */
+attribute_unused static image_t *
+thumb_from_attachment(const char *url, int64_t offset, int size,
+                      char *errbuf, size_t errlen, const char *cacheid,
+                      time_t mtime)
+{
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errlen, FA_NON_INTERACTIVE, NULL);
+  if(fh == NULL)
+    return NULL;
+
+  fh = fa_slice_open(fh, offset, size);
+  buf_t *buf = fa_load_and_close(fh);
+  if(buf == NULL) {
+    snprintf(errbuf, errlen, "Load error");
+    return NULL;
+  }
+  return thumb_from_buf(buf, errbuf, errlen, cacheid, mtime);
+}
+
+
+/**
+ * Open file and video decoder. If 'cover' is set and the file has an
+ * attached cover picture, that is returned in *cover instead
+ */
+static vt_ctx_t *
+vt_ctx_open(const char *url, char *errbuf, size_t errlen,
+            image_t **cover, const char *cacheid, time_t mtime)
+{
+  int i;
+  AVFormatContext *fctx;
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errlen,
+                               FA_BUFFERED_BIG | FA_NON_INTERACTIVE,
+                               NULL);
+
+  if(fh == NULL)
+    return NULL;
+
+  int strategy = fa_libav_get_strategy_for_file(fh);
+
+  AVIOContext *avio = fa_libav_reopen(fh, 0);
+
+  if((fctx = fa_libav_open_format(avio, url, NULL, 0, NULL,
+                                  strategy)) == NULL) {
+    fa_libav_close(avio);
+    snprintf(errbuf, errlen, "Unable to open format");
+    return NULL;
+  }
+
+  if(!strcmp(fctx->iformat->name, "avi"))
+    fctx->flags |= AVFMT_FLAG_GENPTS;
+
+  AVCodecContext *ctx = NULL;
+  int vstream = 0;
+  for(i = 0; i < fctx->nb_streams; i++) {
+    AVStream *st = fctx->streams[i];
+    AVCodecContext *c = st->codec;
+    AVDictionaryEntry *mt;
+
+    if(c == NULL)
+      continue;
+
+    switch(c->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+      if(ctx == NULL) {
+        vstream = i;
+        ctx = fctx->streams[i]->codec;
+      }
+      break;
+
+    case AVMEDIA_TYPE_ATTACHMENT:
+      mt = av_dict_get(st->metadata, "mimetype", NULL, AV_DICT_IGNORE_SUFFIX);
+      if(cover != NULL && mt != NULL &&
+         (!strcmp(mt->value, "image/jpeg") ||
+          !strcmp(mt->value, "image/png"))) {
+#if ENABLE_LIBAV_ATTACHMENT_POINTER
+        int64_t offset = st->attached_offset;
+        int size = st->attached_size;
+        fa_libav_close_format(fctx, 0);/* Close here because it will be parked
+                                        * by fa_buffer (and thus reused)
+                                        */
+        *cover = thumb_from_attachment(url, offset, size, errbuf, errlen,
+                                       cacheid, mtime);
+#else
+        buf_t *b = buf_create_and_adopt(st->codec->extradata_size,
+                                        st->codec->extradata,
+                                        (void *)&av_free);
+        st->codec->extradata = NULL;
+        st->codec->extradata_size = 0;
+        fa_libav_close_format(fctx, 0);
+        *cover = thumb_from_buf(b, errbuf, errlen, cacheid, mtime);
+#endif
+        return NULL;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  if(ctx == NULL) {
+    fa_libav_close_format(fctx, 0);
+    snprintf(errbuf, errlen, "No video stream");
+    return NULL;
+  }
+
+  AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
+  if(codec == NULL) {
+    fa_libav_close_format(fctx, 0);
+    snprintf(errbuf, errlen, "Unable to find codec");
+    return NULL;
+  }
+
+  // Decoded frames are handed to other threads for scaling
+  ctx->refcounted_frames = 1;
+
+  if(avcodec_open2(ctx, codec, NULL) < 0) {
+    fa_libav_close_format(fctx, 0);
+    snprintf(errbuf, errlen, "Unable to open codec");
+    return NULL;
+  }
+
+  vt_ctx_t *vc = calloc(1, sizeof(vt_ctx_t));
+  vc->vc_url = strdup(url);
+  vc->vc_fctx = fctx;
+  vc->vc_ctx = ctx;
+  vc->vc_stream = vstream;
+  return vc;
+}
+
+
+/**
+ * Get an idle context for 'url' or open a new one. If the pool is full
+ * the least recently used idle context is closed. Waits if all contexts
+ * are busy
+ */
+static vt_ctx_t *
+vt_ctx_acquire(const char *url, char *errbuf, size_t errlen,
+               image_t **cover, const char *cacheid, time_t mtime)
+{
+  vt_ctx_t *vc, *victim;
+
+  hts_mutex_lock(&vt_mutex);
+
+  while(1) {
+    victim = NULL;
+    LIST_FOREACH(vc, &vt_ctxs, vc_link) {
+      if(vc->vc_busy)
+        continue;
+      if(!strcmp(vc->vc_url, url))
+        break;
+      if(victim == NULL || vc->vc_last_used < victim->vc_last_used)
+        victim = vc;
+    }
+
+    if(vc != NULL) {
+      vc->vc_busy = 1;
+      hts_mutex_unlock(&vt_mutex);
+      return vc;
+    }
+
+    if(vt_num_ctxs < VT_POOL_SIZE)
+      break;
+
+    if(victim != NULL) {
+      LIST_REMOVE(victim, vc_link);
+      vt_num_ctxs--;
+      hts_mutex_unlock(&vt_mutex);
+      vt_ctx_close(victim);
+      hts_mutex_lock(&vt_mutex);
+      continue;
+    }
+    hts_cond_wait(&vt_cond, &vt_mutex);
+  }
+
+  vt_num_ctxs++; // Reserve our slot while opening
+  hts_mutex_unlock(&vt_mutex);
+
+  vc = vt_ctx_open(url, errbuf, errlen, cover, cacheid, mtime);
+
+  hts_mutex_lock(&vt_mutex);
+  if(vc != NULL) {
+    vc->vc_busy = 1;
+    LIST_INSERT_HEAD(&vt_ctxs, vc, vc_link);
+  } else {
+    vt_num_ctxs--;
+    hts_cond_broadcast(&vt_cond);
+  }
+  hts_mutex_unlock(&vt_mutex);
+  return vc;
+}
+
+
+/**
+ * Return context to the pool. Contexts that failed are closed
+ */
+static void
+vt_ctx_release(vt_ctx_t *vc, int failed)
+{
+  hts_mutex_lock(&vt_mutex);
+  if(failed) {
+    LIST_REMOVE(vc, vc_link);
+    vt_num_ctxs--;
+  } else {
+    vc->vc_busy = 0;
+    vc->vc_last_used = time(NULL);
+    callout_arm(&vt_autoclose_callout, vt_autoclose, NULL, VT_IDLE_TIMEOUT);
+  }
+  hts_cond_broadcast(&vt_cond);
+  hts_mutex_unlock(&vt_mutex);
+
+  if(failed)
+    vt_ctx_close(vc);
+}
+
+
+/**
+ * Seek to the keyframe at or before 'sec' and decode just that. No
+ * frames after it are decoded, so the picture can be up to a GOP away
+ * from the requested position. Returns a refcounted frame that stays
+ * valid after the context is used for something else
+ */
+static AVFrame *
+vt_decode_keyframe(vt_ctx_t *vc, int sec, cancellable_t *c,
+                   char *errbuf, size_t errlen, int *failed)
+{
+  AVFormatContext *fctx = vc->vc_fctx;
+  AVCodecContext *ctx = vc->vc_ctx;
+  AVStream *st = fctx->streams[vc->vc_stream];
+  AVPacket pkt;
+  int got_pic = 0;
+  int error = 0;
+
+  if(sec == -1) {
+    // Automatically try to find a good frame
+
+    int duration_in_seconds = fctx->duration / 1000000;
+
+    sec = MAX(1, duration_in_seconds * 0.05); // 5% of duration
+    sec = MIN(sec, 150); // , buy no longer than 2:30 in
+
+    sec = MAX(0, MIN(sec, duration_in_seconds - 1));
+  }
+
+  int64_t ts = av_rescale(sec, st->time_base.den, st->time_base.num);
+  int delayed_seek = 0;
+
+  if(ctx->codec_id == AV_CODEC_ID_RV40 ||
+     ctx->codec_id == AV_CODEC_ID_RV30) {
+    // Must decode one frame
+    delayed_seek = 1;
+  } else {
+    if(av_seek_frame(fctx, vc->vc_stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+      snprintf(errbuf, errlen, "Unable to seek to %"PRId64, ts);
+      *failed = 1;
+      return NULL;
+    }
+  }
+
+  avcodec_flush_buffers(ctx);
+
+  AVFrame *frame = av_frame_alloc();
+
+  for(int i = 0; i < VT_MAX_PACKETS; i++) {
+    int r = av_read_frame(fctx, &pkt);
+
+    if(r == AVERROR(EAGAIN))
+      continue;
+
+    if(r == AVERROR_EOF) {
+      // Drain the decoder, the keyframe might still be in there
+      av_init_packet(&pkt);
+      pkt.data = NULL;
+      pkt.size = 0;
+      avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
+      break;
+    }
+
+    if(cancellable_is_cancelled(c)) {
+      snprintf(errbuf, errlen, "Cancelled");
+      av_free_packet(&pkt);
+      error = 1;
+      break;
+    }
+
+    if(r != 0) {
+      snprintf(errbuf, errlen, "Read error");
+      *failed = 1;
+      break;
+    }
+
+    if(pkt.stream_index != vc->vc_stream) {
+      av_free_packet(&pkt);
+      continue;
+    }
+
+    const int key = pkt.flags & AV_PKT_FLAG_KEY;
+
+    ctx->skip_frame = delayed_seek ? AVDISCARD_NONREF : AVDISCARD_NONKEY;
+    avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
+    av_free_packet(&pkt);
+
+    if(delayed_seek) {
+      delayed_seek = 0;
+      av_frame_unref(frame);
+      got_pic = 0;
+      if(av_seek_frame(fctx, vc->vc_stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        snprintf(errbuf, errlen, "Unable to seek to %"PRId64, ts);
+        *failed = 1;
+        break;
+      }
+      avcodec_flush_buffers(ctx);
+      continue;
+    }
+
+    if(!got_pic && key) {
+      /*
+       * Decoders with reordering delay hold on to the keyframe. Rather
+       * than feeding them more frames just drain it out
+       */
+      av_init_packet(&pkt);
+      pkt.data = NULL;
+      pkt.size = 0;
+      avcodec_decode_video2(ctx, frame, &got_pic, &pkt);
+      avcodec_flush_buffers(ctx);
+    }
+
+    if(got_pic)
+      break;
+  }
+
+  ctx->skip_frame = AVDISCARD_DEFAULT;
+  avcodec_flush_buffers(ctx);
+
+  if(!got_pic) {
+    if(!error && !*failed)
+      snprintf(errbuf, errlen, "Frame not found");
+    av_frame_free(&frame);
+    return NULL;
+  }
+  return frame;
+}
+
+
+/**
+ *
+ */
+static void
+thumb_size(const AVFrame *frame, int req_width, int req_height,
+           int *w, int *h)
+{
+  if(req_width != -1 && req_height != -1) {
+    *w = req_width;
+    *h = req_height;
+  } else if(req_width != -1) {
+    *w = req_width;
+    *h = req_width * frame->height / frame->width;
+  } else if(req_height != -1) {
+    *w = req_height * frame->width / frame->height;
+    *h = req_height;
+  } else {
+    *w = req_width;
+    *h = req_height;
+  }
+}
+
+
+/**
+ * Encode as JPEG and store in blobcache. Each call use its own encoder
+ * so this can run on several threads at once
+ */
+static void
+write_thumb(const AVFrame *sframe, int width, int height,
+            const char *cacheid, time_t mtime)
+{
+  if(thumbcodec == NULL)
+    return;
+
+  AVCodecContext *ctx = avcodec_alloc_context3(thumbcodec);
+  ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+  ctx->time_base.den = 1;
+  ctx->time_base.num = 1;
+  ctx->sample_aspect_ratio.num = 1;
+  ctx->sample_aspect_ratio.den = 1;
+  ctx->width  = width;
+  ctx->height = height;
+
+  if(avcodec_open2(ctx, thumbcodec, NULL) < 0) {
+    TRACE(TRACE_ERROR, "THUMB", "Unable to open thumb encoder");
+    av_free(ctx);
+    return;
+  }
+
+  AVFrame *oframe = av_frame_alloc();
+
+  avpicture_alloc((AVPicture *)oframe, ctx->pix_fmt, width, height);
+
+  struct SwsContext *sws;
+  sws = sws_getContext(sframe->width, sframe->height, sframe->format,
+                       width, height, ctx->pix_fmt, SWS_BILINEAR,
+                       NULL, NULL, NULL);
+
+  if(sws != NULL) {
+    sws_scale(sws, (const uint8_t **)sframe->data, sframe->linesize,
+              0, sframe->height, &oframe->data[0], &oframe->linesize[0]);
+    sws_freeContext(sws);
+
+    oframe->pts = AV_NOPTS_VALUE;
+    AVPacket out;
+    memset(&out, 0, sizeof(AVPacket));
+    int got_packet;
+    int r = avcodec_encode_video2(ctx, &out, oframe, &got_packet);
+    if(r >= 0 && got_packet) {
+      buf_t *b = buf_create_and_adopt(out.size, out.data, &av_free);
+      blobcache_put(cacheid, "videothumb", b, INT32_MAX, NULL, mtime, 0);
+      buf_release(b);
+    } else {
+      assert(out.data == NULL);
+    }
+  }
+  avpicture_free((AVPicture *)oframe);
+  av_frame_free(&oframe);
+  avcodec_close(ctx);
+  av_free(ctx);
+}
+
+
+/**
+ *
+ */
+static image_t *
+frame_to_image(const AVFrame *frame, int w, int h,
+               char *errbuf, size_t errlen)
+{
+  pixmap_t *pm = pixmap_create(w, h, PIXMAP_BGR32, 0);
+
+  if(pm == NULL) {
+    snprintf(errbuf, errlen, "Out of memory");
+    return NULL;
+  }
+
+  struct SwsContext *sws;
+  sws = sws_getContext(frame->width, frame->height, frame->format,
+                       w, h, AV_PIX_FMT_BGR32, SWS_BILINEAR,
+                       NULL, NULL, NULL);
+  if(sws == NULL) {
+    snprintf(errbuf, errlen, "Scaling failed");
+    pixmap_release(pm);
+    return NULL;
+  }
+
+  uint8_t *ptr[4] = {0,0,0,0};
+  int strides[4] = {0,0,0,0};
+
+  ptr[0] = pm->pm_data;
+  strides[0] = pm->pm_linesize;
+
+  sws_scale(sws, (const uint8_t **)frame->data, frame->linesize,
+            0, frame->height, ptr, strides);
+
+  sws_freeContext(sws);
+
+  image_t *img = image_create_from_pixmap(pm);
+  pixmap_release(pm);
+  return img;
+}
+
+
+/**
+ *
+ */
+static void
+vt_strip_release(vt_strip_t *vs)
+{
+  if(--vs->vs_refcount)
+    return;
+  free(vs->vs_url);
+  free(vs->vs_done);
+  free(vs);
+}
+
+
+/**
+ *
+ */
+static vt_strip_t *
+vt_strip_find(const char *url)
+{
+  vt_strip_t *vs;
+  LIST_FOREACH(vs, &vt_strips, vs_link)
+    if(!strcmp(vs->vs_url, url))
+      break;
+  return vs;
+}
+
+
+/**
+ * Runs on the task pool, several strip images are scaled concurrently
+ * while the strip thread keeps decoding
+ */
+static void
+vt_scale_task(void *aux)
+{
+  vt_scale_job_t *vsj = aux;
+  vt_strip_t *vs = vsj->vsj_strip;
+
+  write_thumb(vsj->vsj_frame, vsj->vsj_width, vsj->vsj_height,
+              vsj->vsj_cacheid, vsj->vsj_mtime);
+  av_frame_free(&vsj->vsj_frame);
+
+  hts_mutex_lock(&vt_mutex);
+  vs->vs_done[vsj->vsj_item] = VS_DONE;
+  vs->vs_inflight--;
+  vs->vs_running--;
+  hts_cond_broadcast(&vt_cond);
+  vt_strip_release(vs);
+  hts_mutex_unlock(&vt_mutex);
+  free(vsj);
+}
+
+
+/**
+ * Next item for the batch job, first pending one at or after the
+ * cursor. Returns -1 when all are done
+ */
+static int
+vt_strip_next(vt_strip_t *vs)
+{
+  for(int i = 0; i < vs->vs_items; i++) {
+    const int item = (vs->vs_cursor + i) % vs->vs_items;
+    if(vs->vs_done[item] == VS_PENDING)
+      return item;
+  }
+  return -1;
+}
+
+
+/**
+ * Generate all images in a strip, starting with the first one requested.
+ * Positions are visited in increasing order so the file is read front
+ * to back (apart from wrap-arounds) with one decoder. vt_strip_wait()
+ * moves the cursor when something further away is requested
+ */
+static void *
+vt_strip_thread(void *aux)
+{
+  vt_strip_t *vs = aux;
+  char errbuf[256];
+  char cacheid[512];
+  int failed = 0;
+
+  vt_ctx_t *vc = vt_ctx_acquire(vs->vs_url, errbuf, sizeof(errbuf),
+                                NULL, NULL, 0);
+  if(vc == NULL)
+    TRACE(TRACE_DEBUG, "Thumb", "Unable to open %s -- %s",
+          vs->vs_url, errbuf);
+
+  while(vc != NULL && !failed) {
+
+    hts_mutex_lock(&vt_mutex);
+    while(vs->vs_inflight >= VT_STRIP_INFLIGHT && !vs->vs_zombie)
+      hts_cond_wait(&vt_cond, &vt_mutex);
+    const int item = vs->vs_zombie ? -1 : vt_strip_next(vs);
+    if(item != -1) {
+      vs->vs_cursor = (item + 1) % vs->vs_items;
+      vs->vs_current = item;
+    }
+    hts_mutex_unlock(&vt_mutex);
+
+    if(item == -1)
+      break;
+
+    const int sec = item * vs->vs_interval;
+
+    AVFrame *frame = vt_decode_keyframe(vc, sec, NULL, errbuf, sizeof(errbuf),
+                                        &failed);
+    int w = 0, h = 0;
+    if(frame != NULL)
+      thumb_size(frame, vs->vs_req_width, vs->vs_req_height, &w, &h);
+
+    if(frame == NULL || w <= 0 || h <= 0) {
+      av_frame_free(&frame);
+      hts_mutex_lock(&vt_mutex);
+      vs->vs_done[item] = VS_DONE;
+      vs->vs_current = -1;
+      hts_cond_broadcast(&vt_cond);
+      hts_mutex_unlock(&vt_mutex);
+      continue;
+    }
+
+    snprintf(cacheid, sizeof(cacheid), "%s#%d-%s", vs->vs_url, sec, vs->vs_siz);
+
+    vt_scale_job_t *vsj = malloc(sizeof(vt_scale_job_t) + strlen(cacheid) + 1);
+    strcpy(vsj->vsj_cacheid, cacheid);
+    vsj->vsj_strip = vs;
+    vsj->vsj_item = item;
+    vsj->vsj_frame = frame;
+    vsj->vsj_width = w;
+    vsj->vsj_height = h;
+    vsj->vsj_mtime = vs->vs_mtime;
+
+    hts_mutex_lock(&vt_mutex);
+    vs->vs_done[item] = VS_SCALING;
+    vs->vs_current = -1;
+    vs->vs_refcount++;
+    vs->vs_running++;
+    vs->vs_inflight++;
+    hts_mutex_unlock(&vt_mutex);
+
+    task_run_prio(vt_scale_task, vsj, TASK_PRIO_NORMAL);
+  }
+
+  if(vc != NULL)
+    vt_ctx_release(vc, failed);
+
+  hts_mutex_lock(&vt_mutex);
+  vs->vs_current = -1;
+  vs->vs_running--;
+  hts_cond_broadcast(&vt_cond);
+  vt_strip_release(vs);
+  hts_mutex_unlock(&vt_mutex);
+  return NULL;
+}
+
+
+/**
+ * True if the batch job will have 'item' done shortly
+ */
+static int
+vt_strip_near(const vt_strip_t *vs, int item)
+{
+  if(vs->vs_done[item] == VS_SCALING || vs->vs_current == item)
+    return 1;
+
+  // Pending items the job will get to before this one
+  int ahead = 0;
+  for(int i = vs->vs_cursor; i != item; i = (i + 1) % vs->vs_items)
+    if(vs->vs_done[i] == VS_PENDING && ++ahead > VT_STRIP_NEAR)
+      return 0;
+  return 1;
+}
+
+
+/**
+ * If 'url#sec' is part of a registered strip, make sure the strip is
+ * being generated and wait until this position is done. The batch job
+ * is moved to this position unless it's about to get there anyway.
+ * If some other request moves it away we stop waiting and the caller
+ * generates the image on its own
+ */
+static void
+vt_strip_wait(const char *url, int sec, const char *siz,
+              const image_meta_t *im, time_t mtime, cancellable_t *c)
+{
+  hts_mutex_lock(&vt_mutex);
+
+  vt_strip_t *vs = vt_strip_find(url);
+
+  if(vs == NULL || sec < 0 || sec % vs->vs_interval ||
+     sec / vs->vs_interval >= vs->vs_items) {
+    hts_mutex_unlock(&vt_mutex);
+    return;
+  }
+
+  const int item = sec / vs->vs_interval;
+
+  if(!vs->vs_running) {
+
+    if(strcmp(vs->vs_siz, siz) || vs->vs_mtime != mtime) {
+      // Different size class, start over
+      memset(vs->vs_done, 0, vs->vs_items);
+      snprintf(vs->vs_siz, sizeof(vs->vs_siz), "%s", siz);
+      vs->vs_mtime = mtime;
+    }
+
+    if(vs->vs_done[item]) {
+      // Already tried, it failed
+      hts_mutex_unlock(&vt_mutex);
+      return;
+    }
+
+    vs->vs_cursor = item;
+    vs->vs_current = -1;
+    vs->vs_req_width  = im->im_req_width;
+    vs->vs_req_height = im->im_req_height;
+    vs->vs_running = 1;
+    vs->vs_refcount++;
+    hts_thread_create_detached("videothumb", vt_strip_thread, vs,
+                               THREAD_PRIO_BGTASK);
+
+  } else if(strcmp(vs->vs_siz, siz)) {
+    hts_mutex_unlock(&vt_mutex);
+    return;
+  } else if(!vt_strip_near(vs, item)) {
+    vs->vs_cursor = item;
+  }
+
+  vs->vs_refcount++;
+  while(vs->vs_running && vs->vs_done[item] != VS_DONE &&
+        vt_strip_near(vs, item) && !cancellable_is_cancelled(c))
+    hts_cond_wait_timeout(&vt_cond, &vt_mutex, 100);
+  vt_strip_release(vs);
+  hts_mutex_unlock(&vt_mutex);
+}
+
+
+/**
+ *
+ */
+void
+videothumb_strip_register(const char *url, int interval, int items)
+{
+  if(items <= 0)
+    return;
+
+  hts_mutex_lock(&vt_mutex);
+  vt_strip_t *vs = vt_strip_find(url);
+  if(vs == NULL) {
+    vs = calloc(1, sizeof(vt_strip_t));
+    vs->vs_url = strdup(url);
+    vs->vs_interval = interval;
+    vs->vs_items = items;
+    vs->vs_done = calloc(1, items);
+    vs->vs_refcount = 1;
+    LIST_INSERT_HEAD(&vt_strips, vs, vs_link);
+  }
+  vs->vs_users++;
+  hts_mutex_unlock(&vt_mutex);
+}
+
+
+/**
+ *
+ */
+void
+videothumb_strip_unregister(const char *url)
+{
+  hts_mutex_lock(&vt_mutex);
+  vt_strip_t *vs = vt_strip_find(url);
+  if(vs != NULL && --vs->vs_users == 0) {
+    LIST_REMOVE(vs, vs_link);
+    vs->vs_zombie = 1;
+    hts_cond_broadcast(&vt_cond);
+    vt_strip_release(vs);
+  }
+  hts_mutex_unlock(&vt_mutex);
+}
+
+
+/**
+ *
+ */
+static image_t *
+videothumb_generate(const char *url, const image_meta_t *im,
+                    const char *cacheid, char *errbuf, size_t errlen,
+                    int sec, time_t mtime, cancellable_t *c)
+{
+  image_t *img = NULL;
+  int failed = 0;
+
+  vt_ctx_t *vc = vt_ctx_acquire(url, errbuf, errlen,
+                                sec == -1 ? &img : NULL, cacheid, mtime);
+  if(vc == NULL)
+    return img;
+
+  AVFrame *frame = vt_decode_keyframe(vc, sec, c, errbuf, errlen, &failed);
+  vt_ctx_release(vc, failed);
+
+  if(frame == NULL)
+    return NULL;
+
+  // Scale outside of the context so others can use it meanwhile
+
+  int w, h;
+  thumb_size(frame, im->im_req_width, im->im_req_height, &w, &h);
+
+  img = frame_to_image(frame, w, h, errbuf, errlen);
+  if(img != NULL)
+    write_thumb(frame, w, h, cacheid, mtime);
+
+  av_frame_free(&frame);
+  return img;
+}
+
+
+/**
+ *
+ */
+static image_t *
+videothumb_from_cache(const char *cacheid, time_t stattime)
+{
+  time_t mtime = 0;
+  image_t *img = NULL;
+  buf_t *b = blobcache_get(cacheid, "videothumb", 0, 0, NULL, &mtime);
+  if(b != NULL && mtime == stattime)
+    img = image_coded_create_from_buf(b, IMAGE_JPEG);
+  buf_release(b);
+  return img;
+}
+
+
+/**
+ *
+ */
+image_t *
+videothumb_load(const char *url0, const image_meta_t *im,
+                char *errbuf, size_t errlen, int *cache_control,
+                cancellable_t *c)
+{
+  time_t stattime = 0;
+  image_t *img = NULL;
+  char cacheid[512];
+  char *url = mystrdupa(url0);
+  char *tim = strchr(url, '#');
+  const char *siz;
+  *tim++ = 0;
+  int secs;
+
+  if(!strcmp(tim, "cover"))
+    secs = -1;
+  else
+    secs = atoi(tim);
+
+  hts_mutex_lock(&vt_stat_mutex);
+
+  if(strcmp(url, stated_url ?: "")) {
+    free(stated_url);
+    stated_url = NULL;
+    if(fa_stat_ex(url, &stated_fs, errbuf, errlen, FA_NON_INTERACTIVE)) {
+      hts_mutex_unlock(&vt_stat_mutex);
+      return NULL;
+    }
+    stated_url = strdup(url);
+  }
+  stattime = stated_fs.fs_mtime;
+  hts_mutex_unlock(&vt_stat_mutex);
+
+  if(im->im_req_width < 100 && im->im_req_height < 100) {
+    siz = "min";
+  } else if(im->im_req_width < 200 && im->im_req_height < 200) {
+    siz = "mid";
+  } else {
+    siz = "max";
+  }
+
+  snprintf(cacheid, sizeof(cacheid), "%s-%s", url0, siz);
+  if((img = videothumb_from_cache(cacheid, stattime)) != NULL)
+    return img;
+
+  if(ONLY_CACHED(cache_control)) {
+    snprintf(errbuf, errlen, "Not cached");
+    return NULL;
+  }
+
+  vt_strip_wait(url, secs, siz, im, stattime, c);
+
+  if((img = videothumb_from_cache(cacheid, stattime)) != NULL)
+    return img;
+
+  img = videothumb_generate(url, im, cacheid, errbuf, errlen,
+                            secs, stattime, c);
+  if(img != NULL)
+    img->im_flags |= IMAGE_ADAPTED;
+  return img;
+}
@@ -0,0 +1,48 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+struct image;
+struct image_meta;
+
+/**
+ * Video thumbnail service
+ *
+ * Thumbnails are requested as images with an URL of the form
+ * 'url#seconds' or 'url#cover'. Demux/decode contexts are kept in a
+ * small pool keyed by URL and thumbnails are taken from the keyframe
+ * closest before the requested position. Results end up in the
+ * "videothumb" blobcache stash.
+ */
+
+void videothumb_init(void);
+
+struct image *videothumb_load(const char *url, const struct image_meta *im,
+                              char *errbuf, size_t errlen,
+                              int *cache_control, cancellable_t *c);
+
+/**
+ * Declare that 'url#0', 'url#interval', ... 'url#(items-1)*interval' is
+ * a seek index strip. The first request for any of them generates the
+ * entire strip in one pass over the file
+ */
+void videothumb_strip_register(const char *url, int interval, int items);
+
+void videothumb_strip_unregister(const char *url);
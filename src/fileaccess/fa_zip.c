@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <inttypes.h>
 #include "main.h"
 #include "fileaccess.h"
 #include "fa_zlib.h"
@@ -724,6 +725,7 @@ zip_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
   zip_fh_t *zfh;
   zip_archive_t *za;
   zip_local_file_header_t h;
+  char cacheid[1024];
  
   if((zf = zip_file_find(url)) == NULL) {
     snprintf(errbuf, errlen, "Entry not found in archive");
@@ -774,8 +776,11 @@ zip_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   case 8:
     /* Inflate (zlib) */
+    snprintf(cacheid, sizeof(cacheid), "%s#%"PRId64, za->za_url,
+             zf->zf_lhpos);
     zfh->zfh_reader_handle = fa_inflate_init(&zip_file_protocol, &zfh->h,
-					     zf->zf_uncompressed_size);
+					     zf->zf_uncompressed_size,
+                                             cacheid, za->za_mtime);
     if(zfh->zfh_reader_handle == NULL) {
       snprintf(errbuf, errlen, "Unable to initialize inflator");
       goto bad;
@@ -25,8 +25,46 @@
 #include "fileaccess.h"
 #include "fa_zlib.h"
 #include "main.h"
+#include "blobcache.h"
 #include "misc/minmax.h"
 
+#define INFLATE_WINSIZE 32768
+
+/**
+ * Random access checkpoint (Same idea as zran.c in the zlib examples)
+ *
+ * Records the state at a deflate block boundary so we can restart
+ * decompression from there instead of from the start of the stream
+ */
+typedef struct inflate_point {
+  int64_t ip_in;    // Offset in compressed stream
+  int64_t ip_out;   // Offset in uncompressed stream
+  int ip_bits;      // Bits of the byte before ip_in that belongs to us
+  uint8_t ip_window[INFLATE_WINSIZE];
+} inflate_point_t;
+
+/**
+ * Serialized form of the index in blobcache
+ */
+typedef struct inflate_index_hdr {
+  uint32_t iih_magic;
+  uint32_t iih_count;
+  int64_t iih_unc_size;
+  int64_t iih_spacing;
+} inflate_index_hdr_t;
+
+#define INFLATE_INDEX_MAGIC 0x5a494458  // ZIDX
+#define INFLATE_INDEX_STASH "inflateindex"
+
+/**
+ * Checkpoints are spaced at least 1MB apart but we never keep more
+ * than 128 of them (4MB of windows) per file. The array grows as
+ * checkpoints are added so a file that is only partly read never
+ * pays for the full index
+ */
+#define INFLATE_MIN_SPACING (1024 * 1024)
+#define INFLATE_MAX_POINTS  128
+
 
 typedef struct fa_inflator {
   fa_handle_t h;
@@ -44,9 +82,23 @@ typedef struct fa_inflator {
   uint8_t *fi_buf;
 
   uint8_t *fi_load_buf;
+  int64_t fi_load_pos;  // fi_load_buf starts at this compressed offset
+  int fi_load_len;
 
   int fi_load_size;
 
+  // Random access index, only used for large files
+
+  inflate_point_t *fi_points;
+  int fi_num_points;
+  int fi_max_points;    // 0 if file is not indexed
+  int fi_points_alloc;
+  int fi_points_saved;  // Number of points in the cached copy
+  int64_t fi_spacing;
+  uint8_t *fi_prev;     // Previous output chunk, used to build windows
+  char *fi_cache_id;
+  time_t fi_mtime;
+
 } fa_inflator_t;
 
 #define DECODESIZE 32768
@@ -55,9 +107,69 @@ typedef struct fa_inflator {
 /**
  *
  */
+static void
+inflate_index_load(fa_inflator_t *fi)
+{
+  time_t mtime;
+  buf_t *b = blobcache_get(fi->fi_cache_id, INFLATE_INDEX_STASH, 0, NULL,
+                           NULL, &mtime);
+  if(b == NULL)
+    return;
+
+  const inflate_index_hdr_t *iih = buf_data(b);
+
+  if(mtime == fi->fi_mtime &&
+     buf_len(b) >= sizeof(inflate_index_hdr_t) &&
+     iih->iih_magic == INFLATE_INDEX_MAGIC &&
+     iih->iih_unc_size == fi->fi_unc_size &&
+     iih->iih_spacing == fi->fi_spacing &&
+     iih->iih_count <= fi->fi_max_points &&
+     buf_len(b) == sizeof(inflate_index_hdr_t) +
+     iih->iih_count * sizeof(inflate_point_t) &&
+     (fi->fi_points = malloc(iih->iih_count *
+                             sizeof(inflate_point_t))) != NULL) {
+
+    fi->fi_points_alloc = iih->iih_count;
+    memcpy(fi->fi_points, iih + 1, iih->iih_count * sizeof(inflate_point_t));
+    fi->fi_num_points = iih->iih_count;
+    fi->fi_points_saved = iih->iih_count;
+  }
+  buf_release(b);
+}
+
+
+/**
+ *
+ */
+static void
+inflate_index_save(fa_inflator_t *fi)
+{
+  if(fi->fi_cache_id == NULL || fi->fi_num_points <= fi->fi_points_saved)
+    return;
+
+  const size_t len = sizeof(inflate_index_hdr_t) +
+    fi->fi_num_points * sizeof(inflate_point_t);
+  buf_t *b = buf_create(len);
+  inflate_index_hdr_t *iih = (void *)b->b_ptr;
+  iih->iih_magic = INFLATE_INDEX_MAGIC;
+  iih->iih_count = fi->fi_num_points;
+  iih->iih_unc_size = fi->fi_unc_size;
+  iih->iih_spacing = fi->fi_spacing;
+  memcpy(iih + 1, fi->fi_points, fi->fi_num_points * sizeof(inflate_point_t));
+  blobcache_put(fi->fi_cache_id, INFLATE_INDEX_STASH, b, 86400 * 30,
+                NULL, fi->fi_mtime, 0);
+  buf_release(b);
+}
+
+
+/**
+ * 'cache_id' and 'mtime' identifies the compressed stream. If given,
+ * the random access index is stored in blobcache so we don't need
+ * to rebuild it next time the file is opened
+ */
 fa_handle_t *
 fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
-		int64_t unc_size)
+		int64_t unc_size, const char *cache_id, time_t mtime)
 {
   fa_inflator_t *fi = calloc(1, sizeof(fa_inflator_t));
 
@@ -72,6 +184,18 @@ fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
   
   fi->fi_load_size = 32768;
   fi->fi_buf       = malloc(DECODESIZE);
+
+  fi->fi_spacing = MAX(INFLATE_MIN_SPACING, unc_size / INFLATE_MAX_POINTS);
+
+  if(unc_size >= fi->fi_spacing * 2) {
+    fi->fi_max_points = MIN(INFLATE_MAX_POINTS, unc_size / fi->fi_spacing);
+    fi->fi_prev = malloc(DECODESIZE);
+    fi->fi_mtime = mtime;
+    if(cache_id != NULL) {
+      fi->fi_cache_id = strdup(cache_id);
+      inflate_index_load(fi);
+    }
+  }
   return &fi->h;
 }
 
@@ -83,14 +207,122 @@ inflate_close(fa_handle_t *handle)
 {
   fa_inflator_t *fi = (fa_inflator_t *)handle;
 
+  inflate_index_save(fi);
   fi->fi_src_fap->fap_close(fi->fi_src_handle);
   inflateEnd(&fi->fi_zstream);
   free(fi->fi_buf);
   free(fi->fi_load_buf);
+  free(fi->fi_points);
+  free(fi->fi_prev);
+  free(fi->fi_cache_id);
   free(fi);
 }
 
 
+/**
+ * Find the last checkpoint at or before 'pos'
+ */
+static const inflate_point_t *
+inflate_find_point(const fa_inflator_t *fi, int64_t pos)
+{
+  int lo = 0, hi = fi->fi_num_points;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(fi->fi_points[mid].ip_out <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? &fi->fi_points[lo - 1] : NULL;
+}
+
+
+/**
+ * Restart decompression, either from the start of the stream or
+ * from a checkpoint
+ */
+static int
+inflate_restart(fa_inflator_t *fi, const inflate_point_t *ip)
+{
+  inflateEnd(&fi->fi_zstream);
+  memset(&fi->fi_zstream, 0, sizeof(z_stream));
+  if(inflateInit2(&fi->fi_zstream, -MAX_WBITS) != Z_OK)
+    return -1;
+
+  fi->fi_bufsize = 0;
+  fi->fi_load_len = 0;
+
+  if(ip == NULL) {
+    fi->fi_bufstart = 0;
+    fi->fi_load_pos = 0;
+    fi->fi_src_fap->fap_seek(fi->fi_src_handle, 0, SEEK_SET, 0);
+    return 0;
+  }
+
+  fi->fi_bufstart = ip->ip_out;
+  fi->fi_load_pos = ip->ip_in;
+
+  if(ip->ip_bits) {
+    uint8_t c;
+    if(fi->fi_src_fap->fap_seek(fi->fi_src_handle, ip->ip_in - 1,
+                                SEEK_SET, 0) < 0 ||
+       fi->fi_src_fap->fap_read(fi->fi_src_handle, &c, 1) != 1)
+      return -1;
+    inflatePrime(&fi->fi_zstream, ip->ip_bits, c >> (8 - ip->ip_bits));
+  } else {
+    if(fi->fi_src_fap->fap_seek(fi->fi_src_handle, ip->ip_in,
+                                SEEK_SET, 0) < 0)
+      return -1;
+  }
+
+  inflateSetDictionary(&fi->fi_zstream, ip->ip_window, INFLATE_WINSIZE);
+  // The window is also what preceded the next chunk of output
+  memcpy(fi->fi_prev, ip->ip_window, INFLATE_WINSIZE);
+  return 0;
+}
+
+
+/**
+ * Called when inflate() stopped at a block boundary
+ */
+static void
+inflate_add_point(fa_inflator_t *fi)
+{
+  const int produced = DECODESIZE - fi->fi_zstream.avail_out;
+  const int64_t out = fi->fi_bufstart + produced;
+
+  if(fi->fi_num_points == fi->fi_max_points)
+    return;
+
+  const int64_t last =
+    fi->fi_num_points ? fi->fi_points[fi->fi_num_points - 1].ip_out : 0;
+
+  if(out < last + fi->fi_spacing)
+    return;
+
+  if(fi->fi_num_points == fi->fi_points_alloc) {
+    const int n = MIN(fi->fi_max_points, MAX(8, fi->fi_points_alloc * 2));
+    inflate_point_t *p = realloc(fi->fi_points, n * sizeof(inflate_point_t));
+    if(p == NULL)
+      return;
+    fi->fi_points = p;
+    fi->fi_points_alloc = n;
+  }
+
+  inflate_point_t *ip = &fi->fi_points[fi->fi_num_points++];
+  ip->ip_in = fi->fi_load_pos + (fi->fi_zstream.next_in - fi->fi_load_buf);
+  ip->ip_out = out;
+  ip->ip_bits = fi->fi_zstream.data_type & 7;
+
+  // Window is the last 32k of output, partly from the previous chunk
+  const int from_prev = INFLATE_WINSIZE - MIN(produced, INFLATE_WINSIZE);
+  memcpy(ip->ip_window, fi->fi_prev + DECODESIZE - from_prev, from_prev);
+  memcpy(ip->ip_window + from_prev, fi->fi_buf + produced -
+         (INFLATE_WINSIZE - from_prev), INFLATE_WINSIZE - from_prev);
+}
+
+
 
 /**
  *
@@ -104,19 +336,24 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
 
   while(size > 0) {
 
+    if(fi->fi_num_points > 0 &&
+       (fi->fi_pos < fi->fi_bufstart ||
+        fi->fi_pos >= fi->fi_bufstart + fi->fi_bufsize)) {
+      /* Jump to closest checkpoint if it's closer than where we are */
+      const inflate_point_t *ip = inflate_find_point(fi, fi->fi_pos);
+      if(ip != NULL && (fi->fi_pos < fi->fi_bufstart ||
+                        ip->ip_out > fi->fi_bufstart + fi->fi_bufsize)) {
+        if(inflate_restart(fi, ip))
+          return -1;
+        stream_end = 0;
+      }
+    }
+
     if(fi->fi_pos < fi->fi_bufstart) {
       /* Rewind stream from start */
-
-      inflateEnd(&fi->fi_zstream);
-
-      fi->fi_bufstart = 0;
-      fi->fi_bufsize  = 0;
-
-      memset(&fi->fi_zstream, 0, sizeof(z_stream));
-
-      inflateInit2(&fi->fi_zstream, -MAX_WBITS);
-
-      fi->fi_src_fap->fap_seek(fi->fi_src_handle, 0, SEEK_SET, 0);
+      if(inflate_restart(fi, NULL))
+        return -1;
+      stream_end = 0;
     }
 
     n = fi->fi_pos - fi->fi_bufstart;  // Offset in decompressed buffer
@@ -136,7 +373,17 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
     if(stream_end)
       break;
 
+    // Only stop at block boundaries while there are points to add
+    const int indexing = fi->fi_num_points < fi->fi_max_points &&
+      fi->fi_bufstart + fi->fi_bufsize + DECODESIZE >=
+      (fi->fi_num_points ?
+       fi->fi_points[fi->fi_num_points - 1].ip_out : 0) + fi->fi_spacing;
+
+    if(fi->fi_prev != NULL && fi->fi_bufsize == DECODESIZE)
+      memcpy(fi->fi_prev, fi->fi_buf, DECODESIZE);
+
     fi->fi_bufstart += fi->fi_bufsize;
+    fi->fi_bufsize = 0;
     fi->fi_zstream.next_out  = fi->fi_buf;
     fi->fi_zstream.avail_out = DECODESIZE;
     
@@ -149,15 +396,22 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
 
 	fi->fi_load_buf = realloc(fi->fi_load_buf, fi->fi_load_size);
 
+        fi->fi_load_pos += fi->fi_load_len;
+
 	r = fi->fi_src_fap->fap_read(fi->fi_src_handle, 
 				     fi->fi_load_buf, fi->fi_load_size);
 	if(r < 0)
 	  r = 0;
+        fi->fi_load_len = r;
 	fi->fi_zstream.avail_in = r;
 	fi->fi_zstream.next_in  = fi->fi_load_buf;
       }
 
-      r = inflate(&fi->fi_zstream, 0);
+      r = inflate(&fi->fi_zstream, indexing ? Z_BLOCK : 0);
+
+      if(indexing && r == Z_OK && (fi->fi_zstream.data_type & 128) &&
+         !(fi->fi_zstream.data_type & 64))
+        inflate_add_point(fi);
 
       if(r == Z_STREAM_END) {
 	stream_end = 1;
@@ -225,3 +479,195 @@ fa_protocol_t fa_protocol_inflate = {
   .fap_seek  = inflate_seek,
   .fap_fsize = inflate_fsize,
 };
+
+
+#ifdef FA_ZLIB_BENCHMARK
+
+#define INFLATE_BENCH_SIZE  (1024LL * 1024 * 1024)
+#define INFLATE_BENCH_BLOCK 4096
+#define INFLATE_BENCH_READ  65536
+
+#include "arch/arch.h"
+
+typedef struct inflate_bench_src {
+  fa_handle_t h;
+  const uint8_t *ibs_data;
+  int64_t ibs_size;
+  int64_t ibs_pos;
+} inflate_bench_src_t;
+
+
+static void
+inflate_bench_src_close(fa_handle_t *h)
+{
+  free(h);
+}
+
+
+static int
+inflate_bench_src_read(fa_handle_t *h, void *buf, size_t size)
+{
+  inflate_bench_src_t *ibs = (inflate_bench_src_t *)h;
+  size = MIN(size, ibs->ibs_size - ibs->ibs_pos);
+  memcpy(buf, ibs->ibs_data + ibs->ibs_pos, size);
+  ibs->ibs_pos += size;
+  return size;
+}
+
+
+static int64_t
+inflate_bench_src_seek(fa_handle_t *h, int64_t pos, int whence, int lazy)
+{
+  inflate_bench_src_t *ibs = (inflate_bench_src_t *)h;
+  if(whence != SEEK_SET || pos < 0 || pos > ibs->ibs_size)
+    return -1;
+  ibs->ibs_pos = pos;
+  return pos;
+}
+
+
+static const fa_protocol_t inflate_bench_src_protocol = {
+  .fap_close = inflate_bench_src_close,
+  .fap_read  = inflate_bench_src_read,
+  .fap_seek  = inflate_bench_src_seek,
+};
+
+
+/**
+ * Somewhat compressible text, can be regenerated for any offset
+ */
+static void
+inflate_bench_fill(uint8_t *buf, int64_t block)
+{
+  static const char *words[] = {
+    "movian ", "media ", "center ", "stream ", "video ", "audio ",
+    "subtitle ", "skin ", "zip ", "comic ", "page ", "frame\n",
+  };
+  uint32_t x = block * 2654435761U + 1;
+  int i = 0;
+  while(i < INFLATE_BENCH_BLOCK) {
+    x = x * 1664525 + 1013904223;
+    const char *w = words[(x >> 16) % 12];
+    while(*w && i < INFLATE_BENCH_BLOCK)
+      buf[i++] = *w++;
+    if(i < INFLATE_BENCH_BLOCK && (x & 0xf) == 0)
+      buf[i++] = 'a' + (x >> 8) % 26;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+inflate_bench_run(const uint8_t *data, int64_t size, int indexed, int reads)
+{
+  inflate_bench_src_t *ibs = calloc(1, sizeof(inflate_bench_src_t));
+  ibs->ibs_data = data;
+  ibs->ibs_size = size;
+
+  fa_handle_t *fh = fa_inflate_init(&inflate_bench_src_protocol, &ibs->h,
+                                    INFLATE_BENCH_SIZE, NULL, 0);
+  fa_inflator_t *fi = (fa_inflator_t *)fh;
+  uint8_t *buf = malloc(INFLATE_BENCH_READ);
+  uint8_t *ref = malloc(INFLATE_BENCH_READ + INFLATE_BENCH_BLOCK);
+  int64_t ts;
+
+  if(indexed) {
+    // First pass builds the index
+    ts = arch_get_ts();
+    while(inflate_read(fh, buf, INFLATE_BENCH_READ) > 0) {}
+    ts = arch_get_ts() - ts;
+    printf("Sequential pass: %.2fs, %d checkpoints\n",
+           ts / 1000000.0, fi->fi_num_points);
+  } else {
+    free(fi->fi_prev);
+    fi->fi_prev = NULL;
+    fi->fi_max_points = 0;
+  }
+
+  uint32_t x = 1;
+  int bad = 0;
+  ts = arch_get_ts();
+  for(int i = 0; i < reads; i++) {
+    x = x * 1664525 + 1013904223;
+    const int64_t pos =
+      ((int64_t)x << 8) % (INFLATE_BENCH_SIZE - INFLATE_BENCH_READ);
+    inflate_seek(fh, pos, SEEK_SET, 0);
+    if(inflate_read(fh, buf, INFLATE_BENCH_READ) != INFLATE_BENCH_READ) {
+      bad++;
+      continue;
+    }
+
+    const int64_t block = pos / INFLATE_BENCH_BLOCK;
+    for(int j = 0; j <= INFLATE_BENCH_READ / INFLATE_BENCH_BLOCK; j++)
+      inflate_bench_fill(ref + j * INFLATE_BENCH_BLOCK, block + j);
+    if(memcmp(buf, ref + pos % INFLATE_BENCH_BLOCK, INFLATE_BENCH_READ))
+      bad++;
+  }
+  ts = arch_get_ts() - ts;
+
+  printf("%s: %d random reads of %d bytes, %.2f ms/read, %d bad\n",
+         indexed ? "Indexed" : "No index", reads, INFLATE_BENCH_READ,
+         ts / 1000.0 / reads, bad);
+
+  free(buf);
+  free(ref);
+  inflate_close(fh);
+}
+
+
+/**
+ * Deflate 1GB of synthetic text into memory and do random reads in
+ * it with and without the checkpoint index. Build with
+ * -DFA_ZLIB_BENCHMARK. The process exits when done
+ */
+static void *
+inflate_benchmark(void *aux)
+{
+  z_stream z = {0};
+  size_t cap = 64 * 1024 * 1024;
+  uint8_t *out = malloc(cap);
+  uint8_t block[INFLATE_BENCH_BLOCK];
+
+  deflateInit2(&z, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+  for(int64_t b = 0; b <= INFLATE_BENCH_SIZE / INFLATE_BENCH_BLOCK; b++) {
+    const int last = b == INFLATE_BENCH_SIZE / INFLATE_BENCH_BLOCK;
+    if(!last)
+      inflate_bench_fill(block, b);
+    z.next_in = block;
+    z.avail_in = last ? 0 : INFLATE_BENCH_BLOCK;
+    do {
+      if(cap - z.total_out < 65536) {
+        cap *= 2;
+        out = realloc(out, cap);
+      }
+      z.next_out = out + z.total_out;
+      z.avail_out = cap - z.total_out;
+      deflate(&z, last ? Z_FINISH : Z_NO_FLUSH);
+    } while(z.avail_in > 0 || (last && z.avail_out == 0));
+  }
+  const int64_t size = z.total_out;
+  deflateEnd(&z);
+
+  printf("Deflated %lld MB into %lld MB\n",
+         INFLATE_BENCH_SIZE >> 20, (long long)size >> 20);
+
+  inflate_bench_run(out, size, 0, 8);
+  inflate_bench_run(out, size, 1, 1000);
+  free(out);
+  exit(0);
+}
+
+
+static void
+inflate_benchmark_init(void)
+{
+  hts_thread_create_detached("inflatebench", inflate_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, inflate_benchmark_init, NULL, 0);
+
+#endif
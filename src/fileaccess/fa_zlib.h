@@ -20,10 +20,12 @@
 #ifndef FA_ZLIB_H__
 #define FA_ZLIB_H__
 
+#include <time.h>
 #include "fa_proto.h"
 
 fa_handle_t *fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
-			     int64_t unc_size);
+			     int64_t unc_size, const char *cache_id,
+                             time_t mtime);
 extern fa_protocol_t fa_protocol_inflate;
 
 #endif /* FA_ZLIB_H__ */
@@ -1439,6 +1439,7 @@ fileaccess_init(void)
 
 #if ENABLE_METADATA
   fa_indexer_init();
+  fa_scanner_init();
 #endif
 
   prop_t *dir = setting_get_dir("general:filebrowse");
@@ -1468,6 +1469,14 @@ fileaccess_init(void)
                  SETTING_VALUE(1),
                  SETTING_STORE("faconf", "browsearchives"),
                  NULL);
+
+  setting_create(SETTING_INT, dir, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Number of files to analyze in parallel")),
+                 SETTING_WRITE_INT(&gconf.fa_probe_workers),
+                 SETTING_VALUE(4),
+                 SETTING_RANGE(1, 16),
+                 SETTING_STORE("faconf", "probeworkers"),
+                 NULL);
   return 0;
 }
 
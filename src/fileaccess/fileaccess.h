@@ -266,6 +266,8 @@ void fa_notify_stop(fa_handle_t *fh);
 
 void fa_libav_error_to_txt(int err, char *buf, size_t buflen);
 
+void fa_scanner_init(void);
+
 void fa_scanner_page(const char *url, time_t mtime, 
                      prop_t *model, const char *playme,
                      prop_t *direct_close, rstr_t *title);
@@ -356,6 +358,14 @@ void fa_url_get_last_component(char *dst, size_t dstlen, const char *url);
 fa_handle_t *fa_buffered_open(const char *url, char *errbuf, size_t errsize,
 			      int flags, struct fa_open_extra *foe);
 
+typedef struct fa_buffered_stats {
+  int64_t fbs_prefetched;   // Bytes read ahead
+  int64_t fbs_wasted;       // Bytes read ahead but thrown away unused
+  int64_t fbs_stall_time;   // Time (µs) spent waiting for read-ahead
+} fa_buffered_stats_t;
+
+int fa_buffered_get_stats(fa_handle_t *fh, fa_buffered_stats_t *fbs);
+
 // Memory backed files
 
 int memfile_register(const void *data, size_t len);
@@ -18,11 +18,13 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #include <stdio.h>
+#include <stddef.h>
 #include <assert.h>
 
 
 #include "config.h"
 #include "misc/md4.h"
+#include "misc/md5.h"
 
 
 // We don't have wrappers for DES
@@ -47,6 +49,7 @@
 #include "misc/minmax.h"
 #include "misc/bytestream.h"
 #include "misc/endian.h"
+#include "arch/arch.h"
 
 // http://msdn.microsoft.com/en-us/library/ee442092.aspx
 
@@ -61,26 +64,42 @@
 
 LIST_HEAD(cifs_connection_list, cifs_connection);
 LIST_HEAD(nbt_req_list, nbt_req);
+TAILQ_HEAD(nbt_req_queue, nbt_req);
 LIST_HEAD(cifs_tree_list, cifs_tree);
 
+/**
+ * smb_global_mutex protects cifs_connections. Everything else that
+ * belongs to a connection (its trees, refcounts, pending requests and
+ * writes to the socket) is protected by the connection's cc_mutex.
+ *
+ * If both are needed smb_global_mutex must be locked first
+ */
 static struct cifs_connection_list cifs_connections;
 static hts_mutex_t smb_global_mutex;
 
 #define NBT_TIMEOUT 30000
 
+#define SMB_READ_SIZE 57344 // 14 * 4096 is max according to spec
+#define SMB_MAX_WINDOW 16
+
+#define SMB2_MAX_READ_SIZE (1024 * 1024)
+#define SMB2_READ_AHEAD    (4 * 1024 * 1024) // Bytes in flight per file
+#define SMB2_CREDITS_WANTED 128
+#define SMB2_CREDITS_GROW   8
+
 /**
  *
  */
 typedef struct nbt_req {
   LIST_ENTRY(nbt_req) nr_link;
-  uint16_t nr_mid;
+  uint64_t nr_mid;      // SMB1 MID or SMB2 MessageId
   void *nr_response;
   int nr_response_len;
   int nr_result;
-  LIST_ENTRY(nbt_req) nr_multi_link;
-  int nr_offset;
-  int nr_cnt;
-  int nr_last;
+  TAILQ_ENTRY(nbt_req) nr_read_link;
+  int64_t nr_fpos;      // File offset of READ_ANDX
+  int nr_cnt;           // Bytes requested
+  int nr_consumed;      // Bytes handed to the caller so far
   int nr_is_trans2;
   int nr_data_count;
 } nbt_req_t;
@@ -102,6 +121,7 @@ typedef struct cifs_connection {
 #define CC_F_AS_GUEST        0x1
 #define CC_F_NON_INTERACTIVE 0x2
 #define CC_F_ANONYMOUS       0x4
+#define CC_F_SMB1            0x8
 
   uint16_t cc_mid_generator;
 
@@ -114,6 +134,7 @@ typedef struct cifs_connection {
 
   hts_thread_t cc_thread;
 
+  hts_mutex_t cc_mutex;
   hts_cond_t cc_cond;
 
   struct nbt_req_list cc_pending_nbt_requests;
@@ -131,6 +152,21 @@ typedef struct cifs_connection {
   uint8_t cc_ntsmb;
   uint8_t cc_security_mode;
 
+  /*
+   * SMB2. cc_dialect is 0 for SMB1. A request costs credits and takes
+   * as many MessageIds as it costs, responses hand back new credits
+   */
+  uint16_t cc_dialect;
+  uint8_t cc_large_mtu;
+  uint8_t cc_signing_required;
+  uint64_t cc_session_id;
+  uint64_t cc_msgid;       // Next MessageId
+  uint64_t cc_echo_msgid;
+  int cc_credits;          // Credits we can spend
+
+  int cc_read_size;        // Size of each read in the read pipeline
+  int cc_read_ahead;       // Max bytes to keep in flight ahead of reader
+
   uint8_t cc_challenge_key[8];
   uint8_t cc_domain[64];
 
@@ -175,6 +211,7 @@ typedef struct cifs_tree {
 
 #include "nbt.h"
 #include "smbv1.h"
+#include "smbv2.h"
 
 /**
  *
@@ -348,6 +385,66 @@ lmresponse(uint8_t *out, const uint8_t *hash, const uint8_t *challenge)
 }
 
 
+/**
+ * HMAC-MD5 over the concatenation of d1 and d2, key must be <= 64 bytes
+ */
+static void
+hmac_md5(const uint8_t *key, int keylen, const uint8_t *d1, int l1,
+         const uint8_t *d2, int l2, uint8_t *out)
+{
+  uint8_t pad[64];
+  uint8_t inner[16];
+  int i;
+  md5_decl(ctx);
+
+  memset(pad, 0x36, sizeof(pad));
+  for(i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  md5_init(ctx);
+  md5_update(ctx, pad, sizeof(pad));
+  md5_update(ctx, d1, l1);
+  if(l2)
+    md5_update(ctx, d2, l2);
+  md5_final(ctx, inner);
+
+  memset(pad, 0x5c, sizeof(pad));
+  for(i = 0; i < keylen; i++)
+    pad[i] ^= key[i];
+
+  md5_init(ctx);
+  md5_update(ctx, pad, sizeof(pad));
+  md5_update(ctx, inner, sizeof(inner));
+  md5_final(ctx, out);
+}
+
+
+/**
+ * NTOWFv2, HMAC_MD5(NT hash, UNICODE(UPPER(user) + domain))
+ */
+static void
+ntlmv2_hash(const char *username, const char *domain, const char *password,
+            uint8_t *digest)
+{
+  uint8_t nthash[16];
+  char *ud = alloca(strlen(username) + strlen(domain) + 1);
+  char *s;
+
+  NTLM_hash(password, nthash);
+
+  strcpy(ud, username);
+  for(s = ud; *s; s++)
+    if(*s >= 'a' && *s <= 'z')
+      *s -= 32;
+  strcat(ud, domain);
+
+  size_t len = utf8_to_ucs2(NULL, ud, 1);
+  uint8_t *ucs = alloca(len);
+  utf8_to_ucs2(ucs, ud, 1);
+  hmac_md5(nthash, sizeof(nthash), ucs, len - 2, NULL, 0, digest);
+}
+
+
 /**
  *
  */
@@ -400,6 +497,52 @@ smbv1_init_t2_header(cifs_connection_t *cc, TRANS2_req_t *t2, int cmd,
 }
 
 
+/**
+ * MessageId and credits are filled in when the request is sent
+ */
+static void
+smbv2_init_header(const cifs_connection_t *cc, SMB2_t *h, int cmd,
+                  uint32_t tid)
+{
+  h->proto = htole_32(SMB2_PROTO);
+  h->header_length = htole_16(sizeof(SMB2_t));
+  h->cmd = htole_16(cmd);
+  h->process_id = htole_32(0xfeff);
+  h->tree_id = htole_32(tid);
+  h->session_id = htole_64(cc->cc_session_id);
+}
+
+
+/**
+ * NT status of a response
+ */
+static uint32_t
+smb_errorcode(const cifs_connection_t *cc, const void *rbuf)
+{
+  if(cc->cc_dialect)
+    return letoh_32(((const SMB2_t *)rbuf)->status);
+  return letoh_32(((const SMB_t *)rbuf)->errorcode);
+}
+
+
+/**
+ * Offset of 'field' in an SMB2 request, counted from the SMB2 header
+ */
+#define smb2_offset(type, field) (offsetof(type, field) - sizeof(NBT_t))
+
+
+/**
+ * Size of a string in SMB2 (UTF-16) encoding without the terminator.
+ * Note that utf8_to_ucs2() still writes a terminator so destination
+ * buffers need two bytes extra
+ */
+static int
+smb2_strlen(const char *str)
+{
+  return utf8_to_ucs2(NULL, str, 1) - 2;
+}
+
+
 /**
  *
  */
@@ -466,13 +609,98 @@ utf8_to_smb(const cifs_connection_t *cc, uint8_t *dst, const char *src)
 }
 
 /**
- *
+ * Give an SMB2 request its MessageId. 'charge' credits are spent and
+ * we ask for more as long as we're below SMB2_CREDITS_WANTED
+ */
+static void
+smb2_stamp(cifs_connection_t *cc, SMB2_t *h, int charge)
+{
+  int request = charge;
+
+  if(cc->cc_credits - charge < SMB2_CREDITS_WANTED)
+    request += SMB2_CREDITS_GROW;
+
+  // 2.0.2 has no multi-credit requests and CreditCharge must be 0
+  h->credit_charge = htole_16(cc->cc_dialect >= SMB2_DIALECT_210 ?
+                              charge : 0);
+  h->credits = htole_16(request);
+  h->message_id = htole_64(cc->cc_msgid);
+  cc->cc_msgid += charge;
+  cc->cc_credits -= charge;
+}
+
+
+/**
+ * Wait until we have the credits needed and stamp the request.
+ * Called with cc_mutex locked
+ */
+static int
+smb2_prepare(cifs_connection_t *cc, SMB2_t *h, int charge)
+{
+  while(cc->cc_credits < charge) {
+    if(cc->cc_broken)
+      return -1;
+
+    if(hts_cond_wait_timeout(&cc->cc_cond, &cc->cc_mutex, NBT_TIMEOUT)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d no credits granted by server",
+            cc->cc_hostname, cc->cc_port);
+      cc->cc_broken = 1;
+      return -1;
+    }
+  }
+  smb2_stamp(cc, h, charge);
+  return 0;
+}
+
+
+/**
+ * Send an SMB2 request and wait for the response. Only used during
+ * connection setup, before smb_dispatch() is running
+ */
+static int
+smb2_sync_req(cifs_connection_t *cc, void *request, int request_len,
+              void **rbufp, int *rlenp)
+{
+  SMB2_t *h = request + 4;
+
+  if(cc->cc_credits < 1)
+    return -1;
+
+  smb2_stamp(cc, h, 1);
+  nbt_write(cc, request, request_len);
+
+  while(1) {
+    if(nbt_read(cc, rbufp, rlenp))
+      return -1;
+
+    const SMB2_t *r = *rbufp;
+    if(*rlenp < sizeof(SMB2_t) || r->proto != htole_32(SMB2_PROTO) ||
+       r->message_id != h->message_id) {
+      free(*rbufp);
+      return -1;
+    }
+
+    cc->cc_credits += letoh_16(r->credits);
+
+    if(letoh_32(r->status) != STATUS_PENDING ||
+       !(letoh_32(r->flags) & SMB2_FLAGS_ASYNC_COMMAND))
+      return 0;
+
+    free(*rbufp); // Interim response, final one follows
+  }
+}
+
+
+/**
+ * Called with both smb_global_mutex and cc_mutex locked, returns
+ * with both unlocked
  */
 static void
 cifs_maybe_destroy(cifs_connection_t *cc)
 {
 
   if(cc->cc_refcount > 0) {
+    hts_mutex_unlock(&cc->cc_mutex);
     hts_mutex_unlock(&smb_global_mutex);
     return;
   }
@@ -480,6 +708,7 @@ cifs_maybe_destroy(cifs_connection_t *cc)
   LIST_REMOVE(cc, cc_link);
 
   // As we are unlinked noone can find us anymore, so it's safe to unlock now
+  hts_mutex_unlock(&cc->cc_mutex);
   hts_mutex_unlock(&smb_global_mutex);
 
   if(cc->cc_tc != NULL) {
@@ -496,6 +725,7 @@ cifs_maybe_destroy(cifs_connection_t *cc)
   callout_disarm(&cc->cc_timer);
 
   hts_cond_destroy(&cc->cc_cond);
+  hts_mutex_destroy(&cc->cc_mutex);
   free(cc->cc_hostname);
   free(cc->cc_native_os);
   free(cc->cc_native_lanman);
@@ -505,30 +735,137 @@ cifs_maybe_destroy(cifs_connection_t *cc)
 
 
 /**
- *
+ * Called with cc_mutex locked, returns with it unlocked
  */
 static void
 cifs_release_connection(cifs_connection_t *cc)
 {
+  if(cc->cc_refcount > 1) {
+    cc->cc_refcount--;
+    hts_mutex_unlock(&cc->cc_mutex);
+    return;
+  }
+
+  /*
+   * Might be the last reference. We need smb_global_mutex to unlink
+   * the connection so relock in the right order. Our reference is
+   * kept until then so noone else can destroy it under our feet
+   */
+  hts_mutex_unlock(&cc->cc_mutex);
+  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
   cc->cc_refcount--;
   cifs_maybe_destroy(cc);
 }
 
 
 
+/**
+ * The server picked SMB2 when answering our SMB1 NEGOTIATE. If it
+ * answered with the wildcard dialect we follow up with an SMB2
+ * NEGOTIATE to find the best dialect we both support
+ */
+static int
+smb2_negotiate(cifs_connection_t *cc, void *rbuf, int len,
+               char *errbuf, size_t errlen)
+{
+  static const uint16_t dialects[] = {
+    SMB2_DIALECT_202, SMB2_DIALECT_210, SMB2_DIALECT_300, SMB2_DIALECT_302
+  };
+  const SMB2_NEGOTIATE_resp_t *resp = rbuf;
+  int i;
+
+  // The SMB1 NEGOTIATE counts as MessageId 0
+  cc->cc_msgid = 1;
+  cc->cc_credits = letoh_16(resp->hdr.credits);
+
+  if(len >= sizeof(SMB2_NEGOTIATE_resp_t) && resp->hdr.status == 0 &&
+     letoh_16(resp->dialect) == SMB2_DIALECT_WILDCARD) {
+    free(rbuf);
+
+    int tlen = sizeof(SMB2_NEGOTIATE_req_t) + sizeof(dialects);
+    SMB2_NEGOTIATE_req_t *req = alloca(tlen);
+    memset(req, 0, tlen);
+
+    smbv2_init_header(cc, &req->hdr, SMB2_NEGOTIATE, 0);
+    req->structure_size = htole_16(36);
+    req->dialect_count = htole_16(4);
+    req->security_mode = htole_16(SMB2_NEGOTIATE_SIGNING_ENABLED);
+    arch_get_random_bytes(req->client_guid, sizeof(req->client_guid));
+    for(i = 0; i < 4; i++)
+      req->dialects[i] = htole_16(dialects[i]);
+
+    if(smb2_sync_req(cc, req, tlen, &rbuf, &len)) {
+      snprintf(errbuf, errlen, "Socket read error during negotiation");
+      return -1;
+    }
+    resp = rbuf;
+  }
+
+  if(len < sizeof(SMB2_NEGOTIATE_resp_t)) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
+	     len);
+    free(rbuf);
+    return -1;
+  }
+
+  if(resp->hdr.status) {
+    snprintf(errbuf, errlen, "Negotiation error 0x%08x",
+	     (int)letoh_32(resp->hdr.status));
+    free(rbuf);
+    return -1;
+  }
+
+  const int dialect = letoh_16(resp->dialect);
+  if(dialect < SMB2_DIALECT_202 || dialect > SMB2_DIALECT_302 ||
+     dialect == SMB2_DIALECT_WILDCARD) {
+    snprintf(errbuf, errlen, "Unsupported SMB2 dialect 0x%04x", dialect);
+    free(rbuf);
+    return -1;
+  }
+
+  cc->cc_dialect = dialect;
+  cc->cc_signing_required =
+    !!(letoh_16(resp->security_mode) & SMB2_NEGOTIATE_SIGNING_REQUIRED);
+  cc->cc_large_mtu = dialect >= SMB2_DIALECT_210 &&
+    letoh_32(resp->capabilities) & SMB2_GLOBAL_CAP_LARGE_MTU;
+
+  // SMB2 is always unicode and has no share level security
+  cc->cc_unicode = 1;
+  cc->cc_bpc = 2;
+  cc->cc_ntsmb = 1;
+  cc->cc_security_mode = SECURITY_USER_LEVEL;
+
+  cc->cc_read_size = MIN(letoh_32(resp->max_read_size),
+                         cc->cc_large_mtu ? SMB2_MAX_READ_SIZE : 65536);
+  cc->cc_read_size = MAX(cc->cc_read_size, 4096);
+  cc->cc_read_ahead = MAX(SMB2_READ_AHEAD, cc->cc_read_size);
+
+  SMBTRACE("%s:%d SMB2 dialect 0x%04x read size %d signing %s",
+           cc->cc_hostname, cc->cc_port, dialect, cc->cc_read_size,
+           cc->cc_signing_required ? "required" : "optional");
+  free(rbuf);
+  return 0;
+}
+
+
 /**
  *
  */
 static int
 smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
 {
-  const char *dialect = "NT LM 0.12";
+  static const char *dialects[] = {"NT LM 0.12", "SMB 2.002", "SMB 2.???"};
+  const int num_dialects = cc->cc_flags & CC_F_SMB1 ? 1 : 3;
   SMB_NEG_PROTOCOL_req_t *req;
   SMB_NEG_PROTOCOL_reply_t *reply;
   void *rbuf;
+  int i, len = 0;
 
-  int len = strlen(dialect) + 1;
-  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + 1 + len;
+  for(i = 0; i < num_dialects; i++)
+    len += strlen(dialects[i]) + 2;
+
+  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + len;
 
   req = alloca(tlen);
   memset(req, 0, tlen);
@@ -538,9 +875,14 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
                     0, 1);
 
   req->wordcount = 0;
-  req->bytecount = htole_16(len + 1);
-  req->protos[0] = 2;
-  memcpy(req->protos + 1, dialect, len);
+  req->bytecount = htole_16(len);
+
+  char *p = req->protos;
+  for(i = 0; i < num_dialects; i++) {
+    *p++ = 2;
+    strcpy(p, dialects[i]);
+    p += strlen(dialects[i]) + 1;
+  }
 
   nbt_write(cc, req, tlen);
 
@@ -548,6 +890,10 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
     snprintf(errbuf, errlen, "Socket read error during negotiation");
     return -1;
   }
+
+  if(len >= sizeof(SMB2_t) && rd32_le(rbuf) == SMB2_PROTO)
+    return smb2_negotiate(cc, rbuf, len, errbuf, errlen);
+
   reply = rbuf;
 
   if(len < sizeof(SMB_NEG_PROTOCOL_reply_t) || reply->wordcount != 17) {
@@ -585,6 +931,10 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
   cc->cc_max_buffer_size = MIN(65000, letoh_32(reply->max_buffer_size));
   cc->cc_max_mpx_count   = letoh_16(reply->max_mpx_count);
 
+  cc->cc_read_size = SMB_READ_SIZE;
+  cc->cc_read_ahead = SMB_READ_SIZE * MIN(SMB_MAX_WINDOW,
+                                          MAX(cc->cc_max_mpx_count / 2, 1));
+
   len -= sizeof(SMB_NEG_PROTOCOL_reply_t);
 
   memcpy(cc->cc_challenge_key, reply->data, 8);
@@ -828,107 +1178,632 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
 
 
 /**
- *
+ * ASN.1 DER tag + length
  */
-static void
-dump_request_list(cifs_connection_t *cc)
+static int
+der_hdrlen(int len)
 {
-  nbt_req_t *nr;
-  SMBTRACE("List of pending reuqests");
-  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
-    SMBTRACE("  Pending request %d", nr->nr_mid);
+  return len < 0x80 ? 2 : len < 0x100 ? 3 : 4;
+}
+
+static uint8_t *
+der_hdr(uint8_t *p, int tag, int len)
+{
+  *p++ = tag;
+  if(len >= 0x100) {
+    *p++ = 0x82;
+    *p++ = len >> 8;
+  } else if(len >= 0x80) {
+    *p++ = 0x81;
   }
+  *p++ = len;
+  return p;
 }
 
 
+static const uint8_t spnego_oid[] = {
+  0x06, 0x06, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02};
+
+static const uint8_t ntlmssp_oid[] = {
+  0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a};
+
 /**
- *
+ * Wrap an NTLMSSP token in SPNEGO. The first token goes in a
+ * NegTokenInit, the following ones in NegTokenResp
  */
-static void *
-smb_dispatch(void *aux)
+static int
+spnego_wrap(uint8_t *dst, const uint8_t *token, int len, int first)
 {
-  cifs_connection_t *cc = aux;
-  void *buf;
-  int len;
-  uint16_t mid;
-  SMB_t *h;
-  nbt_req_t *nr;
+  const int octets = der_hdrlen(len) + len;
+  const int resp_token = der_hdrlen(octets) + octets;
+  uint8_t *p = dst;
+
+  if(first) {
+    const int mechs = der_hdrlen(sizeof(ntlmssp_oid)) + sizeof(ntlmssp_oid);
+    const int mech_types = der_hdrlen(mechs) + mechs;
+    const int seq = mech_types + resp_token;
+    const int init = der_hdrlen(seq) + seq;
+    const int app = sizeof(spnego_oid) + der_hdrlen(init) + init;
+
+    if(dst == NULL)
+      return der_hdrlen(app) + app;
+
+    p = der_hdr(p, 0x60, app);
+    memcpy(p, spnego_oid, sizeof(spnego_oid));
+    p += sizeof(spnego_oid);
+    p = der_hdr(p, 0xa0, init);
+    p = der_hdr(p, 0x30, seq);
+    p = der_hdr(p, 0xa0, mechs);
+    p = der_hdr(p, 0x30, sizeof(ntlmssp_oid));
+    memcpy(p, ntlmssp_oid, sizeof(ntlmssp_oid));
+    p += sizeof(ntlmssp_oid);
+  } else {
+    const int seq = resp_token;
+    const int resp = der_hdrlen(seq) + seq;
 
-  SMBTRACE("%s:%d Read thread running %lx",
-	   cc->cc_hostname, cc->cc_port, (long)hts_thread_current());
+    if(dst == NULL)
+      return der_hdrlen(resp) + resp;
 
-  while(1) {
-    if(nbt_read(cc, &buf, &len))
-      break;
+    p = der_hdr(p, 0xa1, resp);
+    p = der_hdr(p, 0x30, seq);
+  }
+  p = der_hdr(p, 0xa2, octets);
+  p = der_hdr(p, 0x04, len);
+  memcpy(p, token, len);
+  return p + len - dst;
+}
 
-    if(len < sizeof(SMB_t)) {
-      TRACE(TRACE_ERROR, "SMB", "%s:%d malformed packet smbhdrlen %d",
-	    cc->cc_hostname, cc->cc_port, len);
-      free(buf);
-      break;
+
+/**
+ * Find the NTLMSSP message in a security blob. The server might
+ * send it raw or wrapped in SPNEGO, either way the message runs to
+ * the end of the blob except for an optional mechListMIC that we
+ * don't care about
+ */
+static const uint8_t *
+ntlmssp_find(const uint8_t *blob, int len, int *msglen)
+{
+  int i;
+  for(i = 0; i + 12 <= len; i++) {
+    if(!memcmp(blob + i, "NTLMSSP", 8)) {
+      *msglen = len - i;
+      return blob + i;
     }
+  }
+  return NULL;
+}
 
-    h = buf;
-    mid = letoh_16(h->mid);
 
-    if(h->pid == htole_16(3)) {
-      SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
-      // SMB_ECHO is always transfered on PID 3
-      cc->cc_wait_for_ping = 0;
-    }
+#define NTLMSSP_NEGOTIATE_UNICODE                  0x00000001
+#define NTLMSSP_REQUEST_TARGET                     0x00000004
+#define NTLMSSP_NEGOTIATE_NTLM                     0x00000200
+#define NTLMSSP_NEGOTIATE_ANONYMOUS                0x00000800
+#define NTLMSSP_NEGOTIATE_ALWAYS_SIGN              0x00008000
+#define NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY 0x00080000
+#define NTLMSSP_NEGOTIATE_TARGET_INFO              0x00800000
+#define NTLMSSP_NEGOTIATE_128                      0x20000000
+#define NTLMSSP_NEGOTIATE_56                       0x80000000
+
+#define NTLMSSP_FLAGS (NTLMSSP_NEGOTIATE_UNICODE |                  \
+                       NTLMSSP_REQUEST_TARGET |                     \
+                       NTLMSSP_NEGOTIATE_NTLM |                     \
+                       NTLMSSP_NEGOTIATE_ALWAYS_SIGN |              \
+                       NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY | \
+                       NTLMSSP_NEGOTIATE_TARGET_INFO |              \
+                       NTLMSSP_NEGOTIATE_128 |                      \
+                       NTLMSSP_NEGOTIATE_56)
 
-    // We run all requests on PID 2, so if it's not 2, free data
-    if(h->pid != htole_16(2)) {
-      free(buf);
-      continue;
+/**
+ * Write one of the (length, maxlength, offset) fields of an NTLMSSP
+ * message and put the data in the payload
+ */
+static uint8_t *
+ntlmssp_field(uint8_t *msg, int field, uint8_t *payload,
+              const void *data, int len)
+{
+  wr16_le(msg + field, len);
+  wr16_le(msg + field + 2, len);
+  wr32_le(msg + field + 4, payload - msg);
+  memcpy(payload, data, len);
+  return payload + len;
+}
+
+
+/**
+ * Build an NTLMSSP AUTHENTICATE_MESSAGE with an NTLMv2 response.
+ * Anonymous if username is NULL. Returns a malloced message
+ */
+static uint8_t *
+ntlmssp_authenticate(const char *username, const char *domain,
+                     const char *password, const uint8_t *challenge,
+                     const uint8_t *target_info, int target_info_len,
+                     int *lenp)
+{
+  uint8_t lm[24];
+  uint8_t *nt = NULL;
+  int lm_len, nt_len;
+  uint32_t flags = NTLMSSP_FLAGS;
+
+  if(username == NULL) {
+    username = "";
+    domain = "";
+    memset(lm, 0, sizeof(lm));
+    lm_len = 1;
+    nt_len = 0;
+    flags |= NTLMSSP_NEGOTIATE_ANONYMOUS;
+  } else {
+    uint8_t hash[16];
+    uint8_t client_challenge[8];
+    int64_t timestamp = ((int64_t)time(NULL) + 11644473600LL) * 10000000LL;
+    int i;
+
+    // Use the server's timestamp if it sent one (MsvAvTimestamp)
+    for(i = 0; i + 4 <= target_info_len;) {
+      const int id = rd16_le(target_info + i);
+      const int avlen = rd16_le(target_info + i + 2);
+      if(id == 0 || i + 4 + avlen > target_info_len)
+        break;
+      if(id == 7 && avlen == 8)
+        timestamp = rd64_le(target_info + i + 4);
+      i += 4 + avlen;
     }
 
-    hts_mutex_lock(&smb_global_mutex);
+    arch_get_random_bytes(client_challenge, sizeof(client_challenge));
+    ntlmv2_hash(username, domain, password, hash);
+
+    // NTProofStr followed by the blob it was computed over
+    nt_len = 16 + 28 + target_info_len + 4;
+    nt = calloc(1, nt_len);
+    uint8_t *blob = nt + 16;
+    blob[0] = 1;
+    blob[1] = 1;
+    wr64_le(blob + 8, timestamp);
+    memcpy(blob + 16, client_challenge, 8);
+    memcpy(blob + 28, target_info, target_info_len);
+    hmac_md5(hash, 16, challenge, 8, blob, nt_len - 16, nt);
+
+    // LMv2
+    hmac_md5(hash, 16, challenge, 8, client_challenge, 8, lm);
+    memcpy(lm + 16, client_challenge, 8);
+    lm_len = 24;
+  }
 
-    LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
-      if(nr->nr_mid == mid)
-	break;
+  const int dlen = smb2_strlen(domain);
+  const int ulen = smb2_strlen(username);
+  const int len = 64 + dlen + ulen + lm_len + nt_len;
+  uint8_t *msg = calloc(1, len + 2);
+  uint8_t *p = msg + 64;
+
+  memcpy(msg, "NTLMSSP", 8);
+  wr32_le(msg + 8, 3);
+
+  utf8_to_ucs2(p, domain, 1);
+  p = ntlmssp_field(msg, 28, p, p, dlen);
+  utf8_to_ucs2(p, username, 1);
+  p = ntlmssp_field(msg, 36, p, p, ulen);
+  p = ntlmssp_field(msg, 44, p, NULL, 0);    // Workstation
+  p = ntlmssp_field(msg, 12, p, lm, lm_len);
+  p = ntlmssp_field(msg, 20, p, nt, nt_len);
+  p = ntlmssp_field(msg, 52, p, NULL, 0);    // Session key
+  wr32_le(msg + 60, flags);
+  assert(p - msg == len);
+  free(nt);
+  *lenp = len;
+  return msg;
+}
 
-    if(nr != NULL) {
-      SMBTRACE("%s:%d Got response for mid=%d (err:0x%08x len:%d%s)",
-               cc->cc_hostname, cc->cc_port, mid,
-               (int)letoh_32(h->errorcode), len,
-               nr->nr_is_trans2 ? ", TRANS2" : "");
 
-      if(nr->nr_is_trans2 && h->errorcode == 0 &&
-         len >= sizeof(TRANS2_reply_t)) {
+/**
+ * One round of SMB2 SESSION_SETUP
+ */
+static int
+smb2_session_setup_req(cifs_connection_t *cc, const uint8_t *token, int len,
+                       int first, void **rbufp, int *rlenp)
+{
+  const int blen = spnego_wrap(NULL, token, len, first);
+  const int tlen = sizeof(SMB2_SESSION_SETUP_req_t) + blen;
+  SMB2_SESSION_SETUP_req_t *req = alloca(tlen);
 
-        // We do reassembly of TRANS2 here
-        const TRANS2_reply_t *tr = (const TRANS2_reply_t *)buf;
+  memset(req, 0, tlen);
+  smbv2_init_header(cc, &req->hdr, SMB2_SESSION_SETUP, 0);
+  req->structure_size = htole_16(25);
+  req->security_mode = SMB2_NEGOTIATE_SIGNING_ENABLED;
+  req->security_buffer_offset =
+    htole_16(smb2_offset(SMB2_SESSION_SETUP_req_t, data));
+  req->security_buffer_length = htole_16(blen);
+  spnego_wrap(req->data, token, len, first);
+
+  return smb2_sync_req(cc, req, tlen, rbufp, rlenp);
+}
 
-        int total_count = letoh_16(tr->total_data_count);
-        int seg_count = letoh_16(tr->param_count) + letoh_16(tr->data_count);
-        SMBTRACE("trans2 segment: "
-                 "total=%d param_count=%d data_count=%d poff=%d",
-                 total_count,
-                 letoh_16(tr->param_count),
-                 letoh_16(tr->data_count),
-                 letoh_16(tr->param_offset));
 
-        if(seg_count > len - sizeof(TRANS2_reply_t)) {
-          TRACE(TRACE_ERROR, "SMB",
-                "%s:%d malformed trans2, %d > %zd",
-                cc->cc_hostname, cc->cc_port,
-                seg_count, (size_t)len - sizeof(TRANS2_reply_t));
-          goto bad_trans2;
-        }
+/**
+ * SMB2 session setup using NTLMSSP. Follows what smb_setup_andX()
+ * does when it comes to guest logins and asking for credentials
+ */
+static int
+smb2_session_setup(cifs_connection_t *cc, char *errbuf, size_t errlen,
+                   int flags)
+{
+  char *username = NULL;
+  char *domain = NULL;
+  char *password_cleartext = NULL;
+  const char *retry_reason = NULL;
+  char reason[256];
+  uint8_t challenge[8];
+  uint8_t *target_info = NULL;
+  int target_info_len = 0;
+  void *rbuf;
+  int rlen;
+  uint32_t status;
 
-        nr->nr_data_count += letoh_16(tr->data_count);
+ again:
+  cc->cc_session_id = 0;
+  free(target_info);
+  target_info = NULL;
 
-        if(nr->nr_response == NULL) {
+  uint8_t negotiate[32] = {'N', 'T', 'L', 'M', 'S', 'S', 'P', 0, 1};
+  wr32_le(negotiate + 12, NTLMSSP_FLAGS);
 
-          // We can't deal with any parameters that's not sent in
-          // first packet
-          if(tr->total_param_count != tr->param_count) {
-            TRACE(TRACE_ERROR, "SMB",
-                  "%s:%d Unable to reassemble trans2, param count err:%d,%d",
-                  cc->cc_hostname, cc->cc_port,
-                  letoh_16(tr->total_param_count),
+  if(smb2_session_setup_req(cc, negotiate, sizeof(negotiate), 1,
+                            &rbuf, &rlen)) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    return -1;
+  }
+
+  const SMB2_SESSION_SETUP_resp_t *resp = rbuf;
+  status = letoh_32(resp->hdr.status);
+
+  if(status != STATUS_MORE_PROCESSING_REQUIRED ||
+     rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    snprintf(errbuf, errlen, "Session setup error 0x%08x", status);
+    free(rbuf);
+    return -1;
+  }
+
+  cc->cc_session_id = letoh_64(resp->hdr.session_id);
+
+  int off = letoh_16(resp->security_buffer_offset);
+  int blen = letoh_16(resp->security_buffer_length);
+  int msglen = 0;
+  const uint8_t *msg = NULL;
+
+  if(off + blen <= rlen)
+    msg = ntlmssp_find(rbuf + off, blen, &msglen);
+
+  if(msg == NULL || msglen < 48 || rd32_le(msg + 8) != 2) {
+    snprintf(errbuf, errlen, "Malformed NTLMSSP challenge");
+    free(rbuf);
+    return -1;
+  }
+
+  memcpy(challenge, msg + 24, 8);
+
+  // Target name is the server's domain
+  off = rd32_le(msg + 16);
+  blen = rd16_le(msg + 12);
+  if(off >= 0 && off + blen <= msglen)
+    ucs2_to_utf8(cc->cc_domain, sizeof(cc->cc_domain), msg + off, blen, 1);
+
+  off = rd32_le(msg + 44);
+  blen = rd16_le(msg + 40);
+  if(off >= 0 && off + blen <= msglen) {
+    target_info = malloc(blen);
+    memcpy(target_info, msg + off, blen);
+    target_info_len = blen;
+  }
+  free(rbuf);
+
+  free(domain);
+  domain = strdup(cc->cc_domain[0] ? (char *)cc->cc_domain : "WORKGROUP");
+
+  if(!(flags & CC_F_AS_GUEST)) {
+    char id[256];
+    char name[256];
+
+    if(retry_reason && flags & CC_F_NON_INTERACTIVE) {
+      free(domain);
+      free(target_info);
+      return -2;
+    }
+
+    snprintf(id, sizeof(id), "smb:connection:%s:%d",
+	     cc->cc_hostname, cc->cc_port);
+
+    snprintf(name, sizeof(name), "Samba server '%s'", cc->cc_hostname);
+
+    int r = keyring_lookup(id, &username, &password_cleartext, &domain, NULL,
+			   name, retry_reason,
+			   (retry_reason ? KEYRING_QUERY_USER : 0) |
+			   KEYRING_SHOW_REMEMBER_ME | KEYRING_REMEMBER_ME_SET);
+
+    if(r == 1) {
+      retry_reason = "Login required";
+      goto again;
+    }
+
+    if(r == -1) {
+      /* Rejected */
+      snprintf(errbuf, errlen, "Authentication rejected by user");
+      free(domain);
+      free(target_info);
+      return -1;
+    }
+
+    // Reset domain if it was cleared by the keyring handler
+    if(domain == NULL)
+      domain = strdup(cc->cc_domain[0] ? (char *)cc->cc_domain : "WORKGROUP");
+
+    assert(r == 0);
+
+  } else if(flags & CC_F_ANONYMOUS) {
+    username = NULL;
+    password_cleartext = NULL;
+
+  } else {
+    username = strdup("guest");
+    password_cleartext = strdup("");
+  }
+
+  SMBTRACE("SETUP %s:%s:%s", username ?: "<anonymous>",
+           password_cleartext && *password_cleartext ? "<hidden>" : "<unset>",
+           domain);
+
+  int authlen;
+  uint8_t *auth = ntlmssp_authenticate(username, domain,
+                                       password_cleartext ?: "", challenge,
+                                       target_info, target_info_len,
+                                       &authlen);
+  free(username);
+  free(password_cleartext);
+  username = NULL;
+  password_cleartext = NULL;
+
+  int r = smb2_session_setup_req(cc, auth, authlen, 0, &rbuf, &rlen);
+  free(auth);
+
+  if(r) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    free(domain);
+    free(target_info);
+    return -1;
+  }
+
+  resp = rbuf;
+  status = letoh_32(resp->hdr.status);
+
+  SMBTRACE("SETUP errorcode=0x%08x", status);
+
+  if(status) {
+    smberr_write(reason, sizeof(reason), status);
+    retry_reason = reason;
+    free(rbuf);
+    if(flags & CC_F_AS_GUEST) {
+      snprintf(errbuf, errlen, "Guest login failed");
+      free(domain);
+      free(target_info);
+      return -1;
+    }
+    goto again;
+  }
+
+  if(rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during setup",
+	     rlen);
+    free(rbuf);
+    free(domain);
+    free(target_info);
+    return -1;
+  }
+
+  const int session_flags = letoh_16(resp->session_flags);
+  free(rbuf);
+
+  const int guest = !!(session_flags & SMB2_SESSION_FLAG_IS_GUEST);
+
+  SMBTRACE("Logged in as session 0x%llx guest=%s",
+           (unsigned long long)cc->cc_session_id, guest ? "yes" : "no");
+
+  if(guest && !(flags & CC_F_AS_GUEST)) {
+    retry_reason = "Login attempt failed";
+    goto again;
+  }
+
+  free(domain);
+  free(target_info);
+
+  // Guest and anonymous sessions are never signed
+  if(cc->cc_signing_required &&
+     !(session_flags & (SMB2_SESSION_FLAG_IS_GUEST |
+                        SMB2_SESSION_FLAG_IS_NULL))) {
+    snprintf(errbuf, errlen, "Server requires SMB signing (not supported)");
+    return -1;
+  }
+
+  if(session_flags & SMB2_SESSION_FLAG_ENCRYPT_DATA) {
+    snprintf(errbuf, errlen, "Server requires SMB3 encryption "
+             "(not supported)");
+    return -1;
+  }
+
+  if(!(flags & CC_F_ANONYMOUS))
+    usage_event("SMB connect", 1, NULL);
+
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+dump_request_list(cifs_connection_t *cc)
+{
+  nbt_req_t *nr;
+  SMBTRACE("List of pending reuqests");
+  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
+    SMBTRACE("  Pending request %d", (int)nr->nr_mid);
+  }
+}
+
+
+/**
+ * Handle a response on an SMB2 connection
+ */
+static int
+smb2_dispatch_response(cifs_connection_t *cc, void *buf, int len)
+{
+  const SMB2_t *h = buf;
+  nbt_req_t *nr;
+
+  if(len < sizeof(SMB2_t) || h->proto != htole_32(SMB2_PROTO)) {
+    TRACE(TRACE_ERROR, "SMB", "%s:%d malformed SMB2 packet len %d",
+          cc->cc_hostname, cc->cc_port, len);
+    free(buf);
+    return -1;
+  }
+
+  const uint64_t msgid = letoh_64(h->message_id);
+  const uint32_t status = letoh_32(h->status);
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  // Every response grants credits, also the ones nobody waits for anymore
+  if(h->credits) {
+    cc->cc_credits += letoh_16(h->credits);
+    hts_cond_broadcast(&cc->cc_cond);
+  }
+
+  if(status == STATUS_PENDING &&
+     letoh_32(h->flags) & SMB2_FLAGS_ASYNC_COMMAND) {
+    // Interim response, the final one will follow with the same MessageId
+    free(buf);
+
+  } else if(msgid == cc->cc_echo_msgid) {
+    SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
+    cc->cc_wait_for_ping = 0;
+    free(buf);
+
+  } else {
+
+    LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
+      if(nr->nr_mid == msgid)
+        break;
+
+    if(nr != NULL) {
+      SMBTRACE("%s:%d Got response for msgid=%d (status:0x%08x len:%d)",
+               cc->cc_hostname, cc->cc_port, (int)msgid, status, len);
+      nr->nr_response = buf;
+      nr->nr_response_len = len;
+      nr->nr_result = 0;
+      hts_cond_broadcast(&cc->cc_cond);
+    } else {
+      SMBTRACE("%s:%d unexpected response msgid=%d on %p",
+               cc->cc_hostname, cc->cc_port, (int)msgid, cc);
+      free(buf);
+    }
+  }
+  hts_mutex_unlock(&cc->cc_mutex);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void *
+smb_dispatch(void *aux)
+{
+  cifs_connection_t *cc = aux;
+  void *buf;
+  int len;
+  uint16_t mid;
+  SMB_t *h;
+  nbt_req_t *nr;
+
+  SMBTRACE("%s:%d Read thread running %lx",
+	   cc->cc_hostname, cc->cc_port, (long)hts_thread_current());
+
+  while(1) {
+    if(nbt_read(cc, &buf, &len))
+      break;
+
+    if(cc->cc_dialect) {
+      if(smb2_dispatch_response(cc, buf, len))
+        break;
+      continue;
+    }
+
+    if(len < sizeof(SMB_t)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d malformed packet smbhdrlen %d",
+	    cc->cc_hostname, cc->cc_port, len);
+      free(buf);
+      break;
+    }
+
+    h = buf;
+    mid = letoh_16(h->mid);
+
+    if(h->pid == htole_16(3)) {
+      SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
+      // SMB_ECHO is always transfered on PID 3
+      hts_mutex_lock(&cc->cc_mutex);
+      cc->cc_wait_for_ping = 0;
+      hts_mutex_unlock(&cc->cc_mutex);
+    }
+
+    // We run all requests on PID 2, so if it's not 2, free data
+    if(h->pid != htole_16(2)) {
+      free(buf);
+      continue;
+    }
+
+    hts_mutex_lock(&cc->cc_mutex);
+
+    LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
+      if(nr->nr_mid == mid)
+	break;
+
+    if(nr != NULL) {
+      SMBTRACE("%s:%d Got response for mid=%d (err:0x%08x len:%d%s)",
+               cc->cc_hostname, cc->cc_port, mid,
+               (int)letoh_32(h->errorcode), len,
+               nr->nr_is_trans2 ? ", TRANS2" : "");
+
+      if(nr->nr_is_trans2 && h->errorcode == 0 &&
+         len >= sizeof(TRANS2_reply_t)) {
+
+        // We do reassembly of TRANS2 here
+        const TRANS2_reply_t *tr = (const TRANS2_reply_t *)buf;
+
+        int total_count = letoh_16(tr->total_data_count);
+        int seg_count = letoh_16(tr->param_count) + letoh_16(tr->data_count);
+        SMBTRACE("trans2 segment: "
+                 "total=%d param_count=%d data_count=%d poff=%d",
+                 total_count,
+                 letoh_16(tr->param_count),
+                 letoh_16(tr->data_count),
+                 letoh_16(tr->param_offset));
+
+        if(seg_count > len - sizeof(TRANS2_reply_t)) {
+          TRACE(TRACE_ERROR, "SMB",
+                "%s:%d malformed trans2, %d > %zd",
+                cc->cc_hostname, cc->cc_port,
+                seg_count, (size_t)len - sizeof(TRANS2_reply_t));
+          goto bad_trans2;
+        }
+
+        nr->nr_data_count += letoh_16(tr->data_count);
+
+        if(nr->nr_response == NULL) {
+
+          // We can't deal with any parameters that's not sent in
+          // first packet
+          if(tr->total_param_count != tr->param_count) {
+            TRACE(TRACE_ERROR, "SMB",
+                  "%s:%d Unable to reassemble trans2, param count err:%d,%d",
+                  cc->cc_hostname, cc->cc_port,
+                  letoh_16(tr->total_param_count),
                   letoh_16(tr->param_count));
 
           bad_trans2:
@@ -938,7 +1813,7 @@ smb_dispatch(void *aux)
             nr->nr_response = NULL;
             nr->nr_response_len = 0;
             hts_cond_broadcast(&cc->cc_cond);
-            hts_mutex_unlock(&smb_global_mutex);
+            hts_mutex_unlock(&cc->cc_mutex);
             continue;
           }
 
@@ -964,7 +1839,7 @@ smb_dispatch(void *aux)
         }
 
         if(nr->nr_data_count < total_count) {
-          hts_mutex_unlock(&smb_global_mutex);
+          hts_mutex_unlock(&cc->cc_mutex);
           continue; // Not complete yet
         }
 
@@ -983,18 +1858,22 @@ smb_dispatch(void *aux)
 
       free(buf);
     }
-    hts_mutex_unlock(&smb_global_mutex);
+    hts_mutex_unlock(&cc->cc_mutex);
   }
 
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
+
+  // Nothing more will be answered, so fail anyone waiting for credits too
+  cc->cc_broken = 1;
 
   LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
     nr->nr_result = 1;
     free(nr->nr_response);
+    nr->nr_response = NULL;
   }
 
   hts_cond_broadcast(&cc->cc_cond);
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&cc->cc_mutex);
   return NULL;
 }
 
@@ -1002,6 +1881,21 @@ smb_dispatch(void *aux)
 static void cifs_periodic(struct callout *c, void *opaque);
 
 
+/**
+ * Called with smb_global_mutex locked. Returns 1 with cc_mutex locked
+ * if the connection can be used for new requests
+ */
+static int
+cifs_lock_usable(cifs_connection_t *cc)
+{
+  hts_mutex_lock(&cc->cc_mutex);
+  if(!cc->cc_broken && cc->cc_status < CC_ERROR)
+    return 1;
+  hts_mutex_unlock(&cc->cc_mutex);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -1015,13 +1909,13 @@ get_tree_no_create(const char *hostname, int port, const char *share)
 
   LIST_FOREACH(cc, &cifs_connections, cc_link)
     if(!strcmp(cc->cc_hostname, hostname) && cc->cc_port == port &&
-       !cc->cc_broken && cc->cc_status < CC_ERROR)
+       cifs_lock_usable(cc))
       break;
 
-  if(cc == NULL) {
-    hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&smb_global_mutex);
+
+  if(cc == NULL)
     return NULL;
-  }
 
   LIST_FOREACH(ct, &cc->cc_trees, ct_link)
     if(!strcmp(ct->ct_share, share))
@@ -1031,7 +1925,7 @@ get_tree_no_create(const char *hostname, int port, const char *share)
     assert(ct->ct_cc == cc);
     ct->ct_refcount++;
   } else {
-    hts_mutex_unlock(&smb_global_mutex);
+    hts_mutex_unlock(&cc->cc_mutex);
   }
   return ct;
 }
@@ -1061,7 +1955,7 @@ cifs_get_connection(const char *hostname, int port,
     if(!strcmp(cc->cc_hostname, hostname) &&
        cc->cc_port == port &&
        cc->cc_flags == flags &&
-       !cc->cc_broken && cc->cc_status < CC_ERROR) {
+       cifs_lock_usable(cc)) {
       break;
     }
   }
@@ -1075,57 +1969,77 @@ cifs_get_connection(const char *hostname, int port,
     cc->cc_hostname = strdup(hostname);
     cc->cc_flags = flags;
 
-    hts_cond_init(&cc->cc_cond, &smb_global_mutex);
+    hts_mutex_init(&cc->cc_mutex);
+    hts_cond_init(&cc->cc_cond, &cc->cc_mutex);
 
     LIST_INSERT_HEAD(&cifs_connections, cc, cc_link);
     hts_mutex_unlock(&smb_global_mutex);
 
+    /*
+     * Nobody else touches the connection until it leaves CC_CONNECTING
+     * so we can talk to the server (and ask the user for credentials)
+     * without holding any locks
+     */
+
+    int status = CC_ERROR;
+
     cc->cc_tc = tcp_connect(hostname, port, cc->cc_errbuf,
                             sizeof(cc->cc_errbuf), 3000, 0, NULL);
 
-    hts_mutex_lock(&smb_global_mutex);
-
     if(cc->cc_tc == NULL) {
       SMBTRACE("Unable to connect to %s:%d - %s",
 	    hostname, port, cc->cc_errbuf);
-      cc->cc_status = CC_ERROR;
     } else {
       SMBTRACE("Connected to %s:%d", hostname, port);
 
-      if(smb_neg_proto(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf))) {
-	cc->cc_status = CC_ERROR;
-      } else {
+      if(!smb_neg_proto(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf))) {
 	SMBTRACE("%s:%d Protocol negotiated", hostname, port);
 
 	int r;
-	r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf), flags);
-
-	if(r) {
-	  if(r == -2) {
-	    cifs_release_connection(cc);
-	    return SAMBA_NEED_AUTH;
-	  }
+	if(cc->cc_dialect)
+	  r = smb2_session_setup(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf),
+				 flags);
+	else
+	  r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf), flags);
+
+	if(r == -2) {
+	  hts_mutex_lock(&cc->cc_mutex);
 	  cc->cc_status = CC_ERROR;
-	} else {
-	  SMBTRACE("%s:%d Session setup", hostname, port);
-	  cc->cc_status = CC_RUNNING;
-	  hts_thread_create_joinable("SMB", &cc->cc_thread, smb_dispatch,
-				     cc, THREAD_PRIO_FILESYSTEM);
+	  snprintf(cc->cc_errbuf, sizeof(cc->cc_errbuf),
+		   "Authentication required");
+	  hts_cond_broadcast(&cc->cc_cond);
+	  cifs_release_connection(cc);
+	  return SAMBA_NEED_AUTH;
+	}
 
-	  callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
+	if(!r) {
+	  SMBTRACE("%s:%d Session setup", hostname, port);
+	  status = CC_RUNNING;
 	}
       }
     }
 
-    hts_cond_broadcast(&cc->cc_cond);
+    hts_mutex_lock(&cc->cc_mutex);
+
+    cc->cc_status = status;
+
+    if(status == CC_RUNNING) {
+      hts_thread_create_joinable("SMB", &cc->cc_thread, smb_dispatch,
+                                 cc, THREAD_PRIO_FILESYSTEM);
 
+      callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
+    }
+
+    hts_cond_broadcast(&cc->cc_cond);
 
   } else {
 
+    hts_mutex_unlock(&smb_global_mutex);
+
     cc->cc_refcount++;
 
     while(cc->cc_status == CC_CONNECTING)
-      hts_cond_wait(&cc->cc_cond, &smb_global_mutex);
+      hts_cond_wait(&cc->cc_cond, &cc->cc_mutex);
   }
 
 
@@ -1146,18 +2060,30 @@ static nbt_req_t *
 nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
               int is_trans2, const char *info)
 {
-  SMB_t *h = request + 4;
   nbt_req_t *nr = calloc(1, sizeof(nbt_req_t));
   nr->nr_result = -1;
-  nr->nr_mid = cc->cc_mid_generator++;
   nr->nr_is_trans2 = is_trans2;
-  h->pid = htole_16(2);
-  h->mid = htole_16(nr->nr_mid);
+
+  if(cc->cc_dialect) {
+    SMB2_t *h = request + 4;
+    // Callers set credit_charge for requests that cost more than one credit
+    if(smb2_prepare(cc, h, MAX(letoh_16(h->credit_charge), 1))) {
+      nr->nr_result = 1;
+      LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
+      return nr;
+    }
+    nr->nr_mid = letoh_64(h->message_id);
+  } else {
+    SMB_t *h = request + 4;
+    nr->nr_mid = cc->cc_mid_generator++;
+    h->pid = htole_16(2);
+    h->mid = htole_16(nr->nr_mid);
+  }
   nbt_write(cc, request, request_len);
 
   LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
   SMBTRACE("%s:%d %s sent mid=%d on thread %lx", cc->cc_hostname, cc->cc_port,
-           info, nr->nr_mid, (long)hts_thread_current());
+           info, (int)nr->nr_mid, (long)hts_thread_current());
   return nr;
 }
 
@@ -1174,9 +2100,9 @@ nbt_async_req_reply_ex(cifs_connection_t *cc,
   nbt_req_t *nr = nbt_async_req(cc, request, request_len, is_trans2, info);
 
   while(nr->nr_result == -1) {
-    if(hts_cond_wait_timeout(&cc->cc_cond, &smb_global_mutex, NBT_TIMEOUT)) {
+    if(hts_cond_wait_timeout(&cc->cc_cond, &cc->cc_mutex, NBT_TIMEOUT)) {
       TRACE(TRACE_ERROR, "SMB", "%s:%d request timeout (%d) on %p",
-	    cc->cc_hostname, cc->cc_port, nr->nr_mid, cc);
+	    cc->cc_hostname, cc->cc_port, (int)nr->nr_mid, cc);
 
 
       dump_request_list(cc);
@@ -1205,24 +2131,27 @@ nbt_async_req_reply_ex(cifs_connection_t *cc,
 static void
 cifs_release_tree(cifs_tree_t *ct, int full)
 {
-  if(ct->ct_cc->cc_flags & CC_F_NON_INTERACTIVE)
+  cifs_connection_t *cc = ct->ct_cc;
+
+  if(cc->cc_flags & CC_F_NON_INTERACTIVE)
     full = 1;
 
-  ct->ct_cc->cc_auto_close = 0;
+  cc->cc_auto_close = 0;
   assert(ct->ct_refcount > 0);
   ct->ct_refcount--;
   if(ct->ct_refcount > 0 || !full) {
-    hts_mutex_unlock(&smb_global_mutex);
+    hts_mutex_unlock(&cc->cc_mutex);
     return;
   }
   LIST_REMOVE(ct, ct_link);
-  cifs_release_connection(ct->ct_cc);
+  cifs_release_connection(cc);
   free(ct->ct_share);
   free(ct);
 }
 
 /**
- *
+ * Drop idle trees. Caller holds a reference to the connection which
+ * is released here, so this is where an idle connection goes away
  */
 static void
 cifs_disconnect(cifs_connection_t *cc)
@@ -1230,17 +2159,15 @@ cifs_disconnect(cifs_connection_t *cc)
   cifs_tree_t *ct;
 
   while((ct = LIST_FIRST(&cc->cc_trees)) != NULL) {
-    if(ct->ct_refcount != 0) {
-      hts_mutex_unlock(&smb_global_mutex);
-      return;
-    }
+    if(ct->ct_refcount != 0)
+      break;
     LIST_REMOVE(ct, ct_link);
     free(ct->ct_share);
     hts_cond_destroy(&ct->ct_cond);
     free(ct);
     cc->cc_refcount--;
   }
-  cifs_maybe_destroy(cc);
+  cifs_release_connection(cc);
 }
 
 
@@ -1327,36 +2254,56 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
       }
     }
 
-    int password_pad = cc->cc_unicode && (password_len & 1) == 0;
+    void *reqbuf;
+    int tlen;
 
-    int resource_len =  utf8_to_smb(cc, NULL, resource);
-    int service_len = strlen(service) + 1;
-    int bytecount = password_len + password_pad + resource_len + service_len;
+    if(cc->cc_dialect) {
+      snprintf(resource, sizeof(resource), "\\\\%s\\%s",
+               cc->cc_hostname, share);
+      const int plen = smb2_strlen(resource);
+      tlen = sizeof(SMB2_TREE_CONNECT_req_t) + plen;
 
-    int tlen = sizeof(SMB_TREE_CONNECT_ANDX_req_t) + bytecount;
+      SMB2_TREE_CONNECT_req_t *req2 = reqbuf = alloca(tlen + 2);
+      memset(req2, 0, tlen + 2);
+      smbv2_init_header(cc, &req2->hdr, SMB2_TREE_CONNECT, 0);
+      req2->structure_size = htole_16(9);
+      req2->path_offset =
+        htole_16(smb2_offset(SMB2_TREE_CONNECT_req_t, data));
+      req2->path_length = htole_16(plen);
+      utf8_to_ucs2(req2->data, resource, 1);
 
-    req = alloca(tlen);
-    memset(req, 0, tlen);
+    } else {
+      int password_pad = cc->cc_unicode && (password_len & 1) == 0;
+
+      int resource_len =  utf8_to_smb(cc, NULL, resource);
+      int service_len = strlen(service) + 1;
+      int bytecount = password_len + password_pad + resource_len + service_len;
 
-    smbv1_init_header(cc, &req->hdr, SMB_TREEC_ANDX,
-                      SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
-                      0, 1);
+      tlen = sizeof(SMB_TREE_CONNECT_ANDX_req_t) + bytecount;
 
-    req->wordcount = 4;
-    req->andx_command = 0xff;
-    req->password_length = htole_16(password_len);
+      req = reqbuf = alloca(tlen);
+      memset(req, 0, tlen);
 
-    req->bytecount = htole_16(bytecount);
+      smbv1_init_header(cc, &req->hdr, SMB_TREEC_ANDX,
+                        SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
+                        0, 1);
 
-    void *ptr = req->data;
-    memcpy(ptr, password, password_len);
-    ptr += password_len + password_pad;
+      req->wordcount = 4;
+      req->andx_command = 0xff;
+      req->password_length = htole_16(password_len);
 
-    ptr += utf8_to_smb(cc, ptr, resource);
-    memcpy(ptr, service, service_len);
-    ptr += service_len;
+      req->bytecount = htole_16(bytecount);
 
-    assert((ptr - (void *)req) == tlen);
+      void *ptr = req->data;
+      memcpy(ptr, password, password_len);
+      ptr += password_len + password_pad;
+
+      ptr += utf8_to_smb(cc, ptr, resource);
+      memcpy(ptr, service, service_len);
+      ptr += service_len;
+
+      assert((ptr - (void *)req) == tlen);
+    }
 
 
     ct = calloc(1, sizeof(cifs_tree_t));
@@ -1364,16 +2311,16 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
     LIST_INSERT_HEAD(&cc->cc_trees, ct, ct_link);
     ct->ct_share = strdup(share);
     ct->ct_refcount = 1;
-    hts_cond_init(&ct->ct_cond, &smb_global_mutex);
+    hts_cond_init(&ct->ct_cond, &cc->cc_mutex);
     ct->ct_status = CT_CONNECTING;
 
-    if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    if(nbt_async_req_reply(cc, reqbuf, tlen, &rbuf, &rlen, 0)) {
       ct->ct_status = CT_ERROR;
       snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Connection lost");
     } else {
       reply = rbuf;
 
-      uint32_t err = letoh_32(reply->hdr.errorcode);
+      uint32_t err = smb_errorcode(cc, rbuf);
       SMBTRACE("Tree connect errorcode:0x%08x (%s)", err, share);
       if(err != 0) {
 
@@ -1387,6 +2334,21 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
 	ct->ct_status = CT_ERROR;
 	smberr_write(ct->ct_errbuf, sizeof(ct->ct_errbuf), err);
 
+      } else if(cc->cc_dialect) {
+	const SMB2_TREE_CONNECT_resp_t *resp2 = rbuf;
+
+	if(rlen < sizeof(SMB2_TREE_CONNECT_resp_t)) {
+	  ct->ct_status = CT_ERROR;
+	  snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Short packet");
+	} else if(letoh_32(resp2->share_flags) &
+		  SMB2_SHAREFLAG_ENCRYPT_DATA) {
+	  ct->ct_status = CT_ERROR;
+	  snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf),
+		   "Share requires SMB3 encryption (not supported)");
+	} else {
+	  ct->ct_tid = letoh_32(resp2->hdr.tree_id);
+	  ct->ct_status = CT_RUNNING;
+	}
       } else {
 	ct->ct_tid = htole_16(reply->hdr.tid);
 	ct->ct_status = CT_RUNNING;
@@ -1397,7 +2359,7 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
   }
 
   while(ct->ct_status == CT_CONNECTING)
-    hts_cond_wait(&ct->ct_cond, &smb_global_mutex);
+    hts_cond_wait(&ct->ct_cond, &cc->cc_mutex);
  out:
   if(ct->ct_status == CT_ERROR) {
     snprintf(errbuf, errlen, "%s", ct->ct_errbuf);
@@ -1486,7 +2448,7 @@ cifs_resolve(const char *url, char *filename, size_t filenamesize,
   if(ct != NULL) {
 
     while(ct->ct_status == CT_CONNECTING)
-      hts_cond_wait(&ct->ct_cond, &smb_global_mutex);
+      hts_cond_wait(&ct->ct_cond, &ct->ct_cc->cc_mutex);
 
     if(ct->ct_status == CT_RUNNING) {
       *p_ct = ct;
@@ -1564,8 +2526,7 @@ static int
 check_smb_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
 		char *errbuf, size_t errlen)
 {
-  const SMB_t *smb = rbuf;
-  uint32_t errcode = letoh_32(smb->errorcode);
+  uint32_t errcode = smb_errorcode(ct->ct_cc, rbuf);
 
   if(errcode) {
     snprintf(errbuf, errlen, "SMB Error 0x%08x", errcode);
@@ -1600,6 +2561,151 @@ backslashify(char *str)
 }
 
 
+/**
+ * SMB2 CREATE (open) of an existing file or directory. The name must
+ * already be backslashified. On failure the tree is released like
+ * check_smb_error() does and the NT status (0 on I/O error) is
+ * returned in *statusp
+ */
+static SMB2_CREATE_resp_t *
+smb2_create(cifs_tree_t *ct, const char *filename, uint32_t access,
+            uint32_t share_access, uint32_t options, uint32_t *statusp,
+            char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const int plen = smb2_strlen(filename);
+  // Buffer must be at least one byte, even for empty names
+  const int tlen = sizeof(SMB2_CREATE_req_t) + MAX(plen, 1);
+  SMB2_CREATE_req_t *req = alloca(tlen + 2);
+  void *rbuf;
+  int rlen;
+
+  memset(req, 0, tlen + 2);
+  smbv2_init_header(cc, &req->hdr, SMB2_CREATE, ct->ct_tid);
+
+  req->structure_size = htole_16(57);
+  req->impersonation_level = htole_32(2);
+  req->desired_access = htole_32(access);
+  req->share_access = htole_32(share_access);
+  req->create_disposition = htole_32(1); // FILE_OPEN
+  req->create_options = htole_32(options);
+  req->name_offset = htole_16(smb2_offset(SMB2_CREATE_req_t, data));
+  req->name_length = htole_16(plen);
+  utf8_to_ucs2(req->data, filename, 1);
+
+  if(statusp != NULL)
+    *statusp = 0;
+
+  if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    release_tree_io_error(ct, errbuf, errlen);
+    return NULL;
+  }
+
+  if(statusp != NULL)
+    *statusp = smb_errorcode(cc, rbuf);
+
+  if(check_smb_error(ct, rbuf, rlen, sizeof(SMB2_CREATE_resp_t),
+                     errbuf, errlen))
+    return NULL;
+
+  return rbuf;
+}
+
+
+/**
+ * SMB2 CLOSE. Unless 'wait' is set we don't care about the response,
+ * smb_dispatch() will still pick up the credits from it
+ */
+static int
+smb2_close(cifs_connection_t *cc, int tid, const uint8_t *file_id, int wait,
+           char *errbuf, size_t errlen)
+{
+  SMB2_CLOSE_req_t req;
+  void *rbuf;
+  int rlen;
+
+  memset(&req, 0, sizeof(req));
+  smbv2_init_header(cc, &req.hdr, SMB2_CLOSE, tid);
+  req.structure_size = htole_16(24);
+  memcpy(req.file_id, file_id, sizeof(req.file_id));
+
+  if(!wait) {
+    if(!smb2_prepare(cc, &req.hdr, 1))
+      nbt_write(cc, &req, sizeof(req));
+    return 0;
+  }
+
+  if(nbt_async_req_reply(cc, &req, sizeof(req), &rbuf, &rlen, 0)) {
+    snprintf(errbuf, errlen, "I/O error");
+    return -1;
+  }
+
+  const uint32_t errcode = smb_errorcode(cc, rbuf);
+  free(rbuf);
+  if(errcode) {
+    snprintf(errbuf, errlen, "SMB Error 0x%08x", errcode);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Write 'data' to a named pipe and read the answer (FSCTL_PIPE_TRANSCEIVE)
+ * Returns the response, output is at *outp
+ */
+static void *
+smb2_transceive(cifs_tree_t *ct, const uint8_t *file_id,
+                const void *data, int len, const uint8_t **outp, int *outlenp,
+                char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const int tlen = sizeof(SMB2_IOCTL_req_t) + len;
+  SMB2_IOCTL_req_t *req = alloca(tlen);
+  void *rbuf;
+  int rlen;
+
+  memset(req, 0, tlen);
+  smbv2_init_header(cc, &req->hdr, SMB2_IOCTL, ct->ct_tid);
+  req->structure_size = htole_16(57);
+  req->ctl_code = htole_32(FSCTL_PIPE_TRANSCEIVE);
+  memcpy(req->file_id, file_id, sizeof(req->file_id));
+  req->input_offset = htole_32(smb2_offset(SMB2_IOCTL_req_t, data));
+  req->input_count = htole_32(len);
+  req->max_output_response = htole_32(65536);
+  req->flags = htole_32(SMB2_0_IOCTL_IS_FSCTL);
+  memcpy(req->data, data, len);
+
+  if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    snprintf(errbuf, errlen, "I/O error");
+    return NULL;
+  }
+
+  const SMB2_IOCTL_resp_t *resp = rbuf;
+  const uint32_t errcode = smb_errorcode(cc, rbuf);
+
+  if(errcode) {
+    snprintf(errbuf, errlen, "SMB Error 0x%08x", errcode);
+    free(rbuf);
+    return NULL;
+  }
+
+  const int offset = rlen >= sizeof(SMB2_IOCTL_resp_t) ?
+    letoh_32(resp->output_offset) : rlen;
+  const int count = rlen >= sizeof(SMB2_IOCTL_resp_t) ?
+    letoh_32(resp->output_count) : 0;
+
+  if(offset < sizeof(SMB2_IOCTL_resp_t) || count > rlen - offset) {
+    snprintf(errbuf, errlen, "Short packet");
+    free(rbuf);
+    return NULL;
+  }
+  *outp = rbuf + offset;
+  *outlenp = count;
+  return rbuf;
+}
+
+
 static void
 close_srvsvc(cifs_tree_t *ct, int fid)
 {
@@ -1929,6 +3035,104 @@ dcerpc_enum_shares(cifs_tree_t *ct, int fid, char *errbuf, size_t errlen,
 }
 
 
+/**
+ * Same as the SMB1 path but the DCERPC PDUs travel over IOCTLs
+ */
+static int
+smb2_enum_shares(cifs_tree_t *ct, fa_dir_t *fd, char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const uint8_t *out;
+  int outlen;
+  uint8_t file_id[16];
+  void *rbuf;
+
+  SMB2_CREATE_resp_t *cresp = smb2_create(ct, "srvsvc", 0x2019f, 3, 0, NULL,
+                                          errbuf, errlen);
+  if(cresp == NULL)
+    return -1;
+  memcpy(file_id, cresp->file_id, sizeof(file_id));
+  free(cresp);
+
+  uint8_t bind[72];
+  DCERPC_hdr_t *rpc = (DCERPC_hdr_t *)bind;
+  memset(bind, 0, sizeof(bind));
+  rpc->major_version = 5;
+  rpc->type = 0xb; // Bind
+  rpc->flags = 0x3;
+  rpc->data_representation = htole_32(0x10);
+  rpc->frag_length = htole_16(sizeof(bind));
+  rpc->callid = htole_32(1);
+  wr16_le(bind + 16, 4280); // max_xmit_frag
+  wr16_le(bind + 18, 4280); // max_recv_frag
+  bind[24] = 1; // num_ctx_items
+  memcpy(bind + 28, bind_args, sizeof(bind_args));
+
+  rbuf = smb2_transceive(ct, file_id, bind, sizeof(bind), &out, &outlen,
+                         errbuf, errlen);
+  if(rbuf == NULL)
+    goto bad;
+  free(rbuf);
+
+  const char *servername = cc->cc_hostname;
+  int servernamechars = strlen(servername) + 1;
+  int snlen = (servernamechars * 2 + 3) & ~3;
+  int arglen = 16 + snlen + 32;
+  int frag_len = arglen + 24;
+  uint8_t *pdu = alloca(frag_len + 2);
+
+  memset(pdu, 0, frag_len + 2);
+  rpc = (DCERPC_hdr_t *)pdu;
+  rpc->major_version = 5;
+  rpc->type = 0x0; // Request
+  rpc->flags = 0x3;
+  rpc->data_representation = htole_32(0x10);
+  rpc->frag_length = htole_16(frag_len);
+  rpc->callid = htole_32(2);
+  wr32_le(pdu + 16, 68);  // alloc_hint
+  wr16_le(pdu + 22, 15);  // NetShareEnumAll
+
+  uint8_t *p = pdu + 24;
+  wr32_le(p + 0, 0x20000);
+  wr32_le(p + 4, servernamechars);
+  wr32_le(p + 12, servernamechars);
+  p += 16;
+  utf8_to_ucs2(p, servername, 1);
+  p += snlen;
+  memcpy(p, enumargs, 32);
+
+  rbuf = smb2_transceive(ct, file_id, pdu, frag_len, &out, &outlen,
+                         errbuf, errlen);
+  if(rbuf == NULL)
+    goto bad;
+
+  if(outlen < sizeof(DCERPC_enum_shares_reply_t)) {
+    snprintf(errbuf, errlen, "Short enumshare reply");
+    free(rbuf);
+    goto bad;
+  }
+
+  const DCERPC_enum_shares_reply_t *reply = (const void *)out;
+
+  if(reply->hdr.flags != 3) {
+    snprintf(errbuf, errlen, "Fragmented enumshare replies not supported");
+    free(rbuf);
+    goto bad;
+  }
+
+  parse_enum_shares(reply->payload,
+                    outlen - sizeof(DCERPC_enum_shares_reply_t), cc, fd);
+  free(rbuf);
+  smb2_close(cc, ct->ct_tid, file_id, 0, NULL, 0);
+  cifs_release_tree(ct, 0);
+  return 0;
+
+ bad:
+  smb2_close(cc, ct->ct_tid, file_id, 0, NULL, 0);
+  cifs_release_tree(ct, 0);
+  return -1;
+}
+
 
 /**
  *
@@ -1943,6 +3147,9 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
   if(ct == NULL)
     return -1;
 
+  if(cc->cc_dialect)
+    return smb2_enum_shares(ct, fd, errbuf, errlen);
+
   int fid = open_srvsvc(ct, errbuf, errlen);
   if(fid < 0)
     return -1;
@@ -1974,6 +3181,22 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
   backslashify(filename);
   cc = ct->ct_cc;
 
+  if(cc->cc_dialect) {
+    SMB2_CREATE_resp_t *resp =
+      smb2_create(ct, filename, DELETE_ACCESS, 7,
+                  FILE_DELETE_ON_CLOSE |
+                  (dir ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE),
+                  NULL, errbuf, errlen);
+    if(resp == NULL)
+      return -1;
+
+    // The file is removed when we close it
+    r = smb2_close(cc, ct->ct_tid, resp->file_id, 1, errbuf, errlen);
+    free(resp);
+    cifs_release_tree(ct, r ? 1 : 0);
+    return r;
+  }
+
   int plen = utf8_to_smb(cc, NULL, filename);
   int tlen;
   void *reqbuf;
@@ -2027,6 +3250,26 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 {
   char *fname = mystrdupa(filename);
   backslashify(fname);
+
+  if(ct->ct_cc->cc_dialect) {
+    SMB2_CREATE_resp_t *resp = smb2_create(ct, fname, FILE_READ_ATTRIBUTES,
+                                           7, 0, NULL, errbuf, errlen);
+    if(resp == NULL)
+      return -1;
+
+    fs->fs_mtime = parsetime(resp->change);
+    if(letoh_32(resp->file_attributes) & 0x10) {
+      fs->fs_type = CONTENT_DIR;
+      fs->fs_size = 0;
+    } else {
+      fs->fs_type = CONTENT_FILE;
+      fs->fs_size = letoh_64(resp->end_of_file);
+    }
+    smb2_close(ct->ct_cc, ct->ct_tid, resp->file_id, 0, NULL, 0);
+    free(resp);
+    return 0;
+  }
+
   int plen = utf8_to_smb(ct->ct_cc, NULL, fname);
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen;
   void *rbuf;
@@ -2040,36 +3283,134 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
     smbv1_init_t2_header(ct->ct_cc, &req->t2, TRANS2_QUERY_PATH_INFORMATION,
                          6 + plen, 0, ct->ct_tid);
 
-    req->level_of_interest = htole_16(0x101+i);
-    utf8_to_smb(ct->ct_cc, req->data, fname);
+    req->level_of_interest = htole_16(0x101+i);
+    utf8_to_smb(ct->ct_cc, req->data, fname);
+
+    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1))
+      return release_tree_io_error(ct, errbuf, errlen);
+
+    if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS2_reply_t), errbuf, errlen))
+      return -1;
+
+    t2resp = rbuf;
+
+    if(i == 0) {
+      const BasicFileInfo_t *bfi = rbuf + letoh_16(t2resp->data_offset);
+      uint32_t fa = letoh_32(bfi->file_attributes);
+
+      fs->fs_mtime = parsetime(bfi->change);
+      if(fa & 0x10) {
+	fs->fs_type = CONTENT_DIR;
+	fs->fs_size = 0;
+	i = 1; // Skip StandardFileInfo Query
+      } else {
+	fs->fs_type = CONTENT_FILE;
+      }
+    } else {
+      const StandardFileInfo_t *sfi = rbuf + letoh_16(t2resp->data_offset);
+      fs->fs_size = letoh_64(sfi->file_size);
+    }
+
+    free(rbuf);
+  }
+  return 0;
+}
+
+
+/**
+ * Directory listing using SMB2 QUERY_DIRECTORY on an opened directory
+ */
+static int
+smb2_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
+             const char *url, char *urlbase, size_t urlspace,
+             char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  fa_dir_entry_t *fde;
+  uint8_t fname[512];
+  uint8_t file_id[16];
+  void *rbuf;
+  int rlen;
+  const int tlen = sizeof(SMB2_QUERY_DIRECTORY_req_t) + 2;
+  SMB2_QUERY_DIRECTORY_req_t *req = alloca(tlen + 2);
+  char *dname = mystrdupa(path);
+
+  backslashify(dname);
+
+  SMB2_CREATE_resp_t *cresp =
+    smb2_create(ct, dname, FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES, 7,
+                FILE_DIRECTORY_FILE, NULL, errbuf, errlen);
+  if(cresp == NULL)
+    return -1;
+  memcpy(file_id, cresp->file_id, sizeof(file_id));
+  free(cresp);
+
+  while(1) {
+    memset(req, 0, tlen + 2);
+    smbv2_init_header(cc, &req->hdr, SMB2_QUERY_DIRECTORY, ct->ct_tid);
+    req->structure_size = htole_16(33);
+    req->file_information_class = FILE_DIRECTORY_INFORMATION;
+    memcpy(req->file_id, file_id, sizeof(file_id));
+    req->file_name_offset =
+      htole_16(smb2_offset(SMB2_QUERY_DIRECTORY_req_t, data));
+    req->file_name_length = htole_16(2);
+    req->output_buffer_length = htole_32(65536);
+    utf8_to_ucs2(req->data, "*", 1);
+
+    if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+      smb2_close(cc, ct->ct_tid, file_id, 0, NULL, 0);
+      return release_tree_io_error(ct, errbuf, errlen);
+    }
+
+    if(smb_errorcode(cc, rbuf) == STATUS_NO_MORE_FILES) {
+      free(rbuf);
+      break;
+    }
+
+    if(check_smb_error(ct, rbuf, rlen, sizeof(SMB2_QUERY_resp_t),
+                       errbuf, errlen)) {
+      smb2_close(cc, ct->ct_tid, file_id, 0, NULL, 0);
+      return -1;
+    }
+
+    const SMB2_QUERY_resp_t *resp = rbuf;
+    unsigned int off = letoh_16(resp->output_buffer_offset);
+    unsigned int end = off + letoh_32(resp->output_buffer_length);
+
+    if(off < sizeof(SMB2_QUERY_resp_t) || end > rlen)
+      end = 0;
+
+    while(off + sizeof(SMB2_FILE_DIRECTORY_INFO_t) <= end) {
+      const SMB2_FILE_DIRECTORY_INFO_t *data = rbuf + off;
+      unsigned int namelen = letoh_32(data->file_name_len);
 
-    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1))
-      return release_tree_io_error(ct, errbuf, errlen);
+      if(namelen > end - off - sizeof(SMB2_FILE_DIRECTORY_INFO_t))
+        break;
 
-    if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS2_reply_t), errbuf, errlen))
-      return -1;
+      ucs2_to_utf8(fname, sizeof(fname), data->filename, namelen, 1);
 
-    t2resp = rbuf;
+      snprintf(urlbase, urlspace, "%s", fname);
 
-    if(i == 0) {
-      const BasicFileInfo_t *bfi = rbuf + letoh_16(t2resp->data_offset);
-      uint32_t fa = letoh_32(bfi->file_attributes);
+      int isdir = letoh_32(data->file_attributes) & 0x10;
 
-      fs->fs_mtime = parsetime(bfi->change);
-      if(fa & 0x10) {
-	fs->fs_type = CONTENT_DIR;
-	fs->fs_size = 0;
-	i = 1; // Skip StandardFileInfo Query
-      } else {
-	fs->fs_type = CONTENT_FILE;
+      fde = fa_dir_add(fd, url, (char *)fname,
+                       isdir ? CONTENT_DIR : CONTENT_FILE);
+      if(fde != NULL) {
+        fde->fde_stat.fs_size = letoh_64(data->file_size);
+        fde->fde_stat.fs_mtime = parsetime(data->change);
+        fde->fde_statdone = 1;
       }
-    } else {
-      const StandardFileInfo_t *sfi = rbuf + letoh_16(t2resp->data_offset);
-      fs->fs_size = letoh_64(sfi->file_size);
+
+      int neo = letoh_32(data->next_entry_offset);
+      if(neo == 0)
+        break;
+      off += neo;
     }
 
     free(rbuf);
   }
+
+  smb2_close(cc, ct->ct_tid, file_id, 0, NULL, 0);
   return 0;
 }
 
@@ -2114,6 +3455,9 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
   urlbase = url + strlen(url);
   urlspace = sizeof(url) - strlen(url);
 
+  if(ct->ct_cc->cc_dialect)
+    return smb2_scandir(ct, path, fd, url, urlbase, urlspace, errbuf, errlen);
+
   while(1) {
 
     memset(req, 0, tlen);
@@ -2234,11 +3578,105 @@ typedef struct smb_file {
   fa_handle_t h;
   cifs_tree_t *sf_ct;
   uint16_t sf_fid;
+  uint8_t sf_file_id[16]; // SMB2
   uint64_t sf_pos;
   uint64_t sf_file_size;
+
+  /*
+   * Read pipeline. READ_ANDX requests in file order, the ones at the
+   * end are read-ahead for the next smb_read() call. Protected by
+   * the connection's cc_mutex
+   */
+  struct nbt_req_queue sf_reads;
+  uint64_t sf_read_next;  // Offset of next READ_ANDX to send
+  uint64_t sf_last_end;   // Where the previous smb_read() ended
+  int sf_ahead;           // Bytes to keep ahead
 } smb_file_t;
 
 
+/**
+ * Remove a request from the read pipeline. If it's still in flight
+ * the reply will be dropped by smb_dispatch() as it no longer finds
+ * the mid on the pending list
+ */
+static void
+smb_read_release(smb_file_t *sf, nbt_req_t *nr)
+{
+  TAILQ_REMOVE(&sf->sf_reads, nr, nr_read_link);
+  LIST_REMOVE(nr, nr_link);
+  free(nr->nr_response);
+  free(nr);
+}
+
+
+/**
+ *
+ */
+static void
+smb_read_flush(smb_file_t *sf)
+{
+  nbt_req_t *nr;
+  while((nr = TAILQ_FIRST(&sf->sf_reads)) != NULL)
+    smb_read_release(sf, nr);
+}
+
+
+/**
+ * Send a READ_ANDX (or SMB2 READ) for 'cnt' bytes at sf_read_next. SMB2
+ * may trim 'cnt' to what the granted credits allow
+ */
+static void
+smb_read_send(smb_file_t *sf, int cnt)
+{
+  cifs_tree_t *ct = sf->sf_ct;
+  cifs_connection_t *cc = ct->ct_cc;
+  const uint64_t pos = sf->sf_read_next;
+  nbt_req_t *nr;
+
+  if(cc->cc_dialect) {
+    SMB2_READ_req_t req;
+
+    memset(&req, 0, sizeof(SMB2_READ_req_t));
+    smbv2_init_header(cc, &req.hdr, SMB2_READ, ct->ct_tid);
+
+    if(cc->cc_large_mtu) {
+      // Each credit pays for 64k, don't ask for more than we can afford
+      cnt = MIN(cnt, MAX(cc->cc_credits, 1) * 65536);
+      req.hdr.credit_charge = htole_16((cnt - 1) / 65536 + 1);
+    }
+
+    req.structure_size = htole_16(49);
+    req.padding = sizeof(SMB2_READ_resp_t);
+    req.length = htole_32(cnt);
+    req.offset = htole_64(pos);
+    memcpy(req.file_id, sf->sf_file_id, sizeof(req.file_id));
+
+    nr = nbt_async_req(cc, &req, sizeof(req), 0, "read");
+
+  } else {
+    SMB_READ_ANDX_req_t req;
+
+    memset(&req, 0, sizeof(SMB_READ_ANDX_req_t));
+    smbv1_init_header(cc, &req.hdr, SMB_READ_ANDX,
+                      SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+
+    req.fid = sf->sf_fid;
+    req.offset_low = htole_32((uint32_t)pos);
+    req.offset_high = htole_32((uint32_t)(pos >> 32));
+    req.max_count_low = htole_16(cnt & 0xffff);
+    req.max_count_high = htole_32(cnt >> 16);
+    req.wordcount = 12;
+    req.andx_command = 0xff;
+
+    nr = nbt_async_req(cc, &req, sizeof(req), 0, "read");
+  }
+
+  nr->nr_fpos = pos;
+  nr->nr_cnt = cnt;
+  TAILQ_INSERT_TAIL(&sf->sf_reads, nr, nr_read_link);
+  sf->sf_read_next += cnt;
+}
+
 
 /**
  *
@@ -2262,6 +3700,25 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   backslashify(filename);
 
+  if(cc->cc_dialect) {
+    SMB2_CREATE_resp_t *resp2 =
+      smb2_create(ct, filename, 0x20089, 1, FILE_NON_DIRECTORY_FILE, NULL,
+                  errbuf, errlen);
+    if(resp2 == NULL)
+      return NULL;
+
+    hts_mutex_unlock(&cc->cc_mutex);
+
+    sf = calloc(1, sizeof(smb_file_t));
+    sf->sf_ct = ct;  // transfer reference of 'sf' to smb_file_t
+    TAILQ_INIT(&sf->sf_reads);
+    memcpy(sf->sf_file_id, resp2->file_id, sizeof(sf->sf_file_id));
+    sf->sf_file_size = letoh_64(resp2->end_of_file);
+    sf->h.fh_proto = fap;
+    free(resp2);
+    return &sf->h;
+  }
+
   int plen = utf8_to_smb(cc, NULL, filename);
   int tlen = sizeof(SMB_NTCREATE_ANDX_req_t) + plen + cc->cc_unicode;
 
@@ -2297,10 +3754,11 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 		     errbuf, errlen))
     return NULL;
 
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_unlock(&cc->cc_mutex);
 
   sf = calloc(1, sizeof(smb_file_t));
   sf->sf_ct = ct;  // transfer reference of 'sf' to smb_file_t
+  TAILQ_INIT(&sf->sf_reads);
 
   resp = rbuf;
   sf->sf_fid = resp->fid;
@@ -2321,17 +3779,23 @@ smb_close(fa_handle_t *fh)
   SMB_CLOSE_req_t *req;
   cifs_tree_t *ct = sf->sf_ct;
 
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&ct->ct_cc->cc_mutex);
 
-  req = alloca(sizeof(SMB_CLOSE_req_t));
-  memset(req, 0, sizeof(SMB_CLOSE_req_t));
+  smb_read_flush(sf);
 
-  smbv1_init_header(ct->ct_cc, &req->hdr, SMB_CLOSE,
-                    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+  if(ct->ct_cc->cc_dialect) {
+    smb2_close(ct->ct_cc, ct->ct_tid, sf->sf_file_id, 0, NULL, 0);
+  } else {
+    req = alloca(sizeof(SMB_CLOSE_req_t));
+    memset(req, 0, sizeof(SMB_CLOSE_req_t));
 
-  req->fid = sf->sf_fid;
-  req->wordcount = 3;
-  nbt_write(ct->ct_cc, req, sizeof(SMB_CLOSE_req_t));
+    smbv1_init_header(ct->ct_cc, &req->hdr, SMB_CLOSE,
+                      SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+
+    req->fid = sf->sf_fid;
+    req->wordcount = 3;
+    nbt_write(ct->ct_cc, req, sizeof(SMB_CLOSE_req_t));
+  }
   cifs_release_tree(sf->sf_ct, 0);
   free(sf);
 }
@@ -2344,13 +3808,11 @@ static int
 smb_read(fa_handle_t *fh, void *buf, size_t size)
 {
   smb_file_t *sf = (smb_file_t *)fh;
-  SMB_READ_ANDX_req_t *req;
-  const SMB_READ_ANDX_resp_t *resp;
-  size_t cnt, rcnt;
-  size_t total = 0;
   cifs_tree_t *ct = sf->sf_ct;
-  nbt_req_t *nr = NULL;
-  struct nbt_req_list reqs;
+  cifs_connection_t *cc = ct->ct_cc;
+  nbt_req_t *nr;
+  size_t total = 0;
+  int rcnt, offset;
 
   if(sf->sf_pos >= sf->sf_file_size)
     return 0;
@@ -2361,96 +3823,107 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
   if(size == 0)
     return 0;
 
-  LIST_INIT(&reqs);
-
-  req = alloca(sizeof(SMB_READ_ANDX_req_t));
-  memset(req, 0, sizeof(SMB_READ_ANDX_req_t));
-
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
 
-  while(size > 0) {
-    cnt = MIN(size, 57344); // 14 * 4096 is max according to spec
-    smbv1_init_header(ct->ct_cc, &req->hdr, SMB_READ_ANDX,
-                      SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+  nr = TAILQ_FIRST(&sf->sf_reads);
+  if(nr == NULL || nr->nr_fpos + nr->nr_consumed != sf->sf_pos) {
+    // Not where the pipeline is, start over
+    smb_read_flush(sf);
+    sf->sf_read_next = sf->sf_pos;
+  }
 
-    req->fid = sf->sf_fid;
-    int64_t pos = sf->sf_pos + total;
-    req->offset_low = htole_32((uint32_t)pos);
-    req->offset_high = htole_32((uint32_t)(pos >> 32));
-    req->max_count_low = htole_16(cnt & 0xffff);
-    req->max_count_high = htole_32(cnt >> 16);
-    req->wordcount = 12;
-    req->andx_command = 0xff;
-
-    nr = nbt_async_req(ct->ct_cc, req, sizeof(SMB_READ_ANDX_req_t), 0,
-                       "read");
-    LIST_INSERT_HEAD(&reqs, nr, nr_multi_link);
-
-    nr->nr_offset = total;
-    nr->nr_cnt = cnt;
-    total += cnt;
-    size -= cnt;
-    nr->nr_last = 0;
-  }
-  nr->nr_last = 1;
+  // Open up the window as long as reads are sequential
+  if(sf->sf_pos == sf->sf_last_end)
+    sf->sf_ahead = MIN(MAX(sf->sf_ahead * 2, SMB_READ_SIZE),
+                       cc->cc_read_ahead);
+  else
+    sf->sf_ahead = 0;
+
+  /*
+   * Requests grow with the window so random access doesn't pull in
+   * full (up to 1MB for SMB2) blocks that are thrown away on next seek
+   */
+  const int chunk = MIN(cc->cc_read_size, MAX(sf->sf_ahead, SMB_READ_SIZE));
+  const uint64_t need_end = sf->sf_pos + size;
+  const uint64_t ahead_end = MIN(need_end + sf->sf_ahead, sf->sf_file_size);
+
+  while(sf->sf_read_next < need_end ||
+        (sf->sf_read_next < ahead_end &&
+         (ahead_end - sf->sf_read_next >= chunk ||
+          ahead_end == sf->sf_file_size))) {
+    smb_read_send(sf, MIN(chunk, sf->sf_file_size - sf->sf_read_next));
+  }
 
-  while(1) {
-    LIST_FOREACH(nr, &reqs, nr_multi_link)
-      if(nr->nr_result == -1)
-	break;
+  while(size > 0 && (nr = TAILQ_FIRST(&sf->sf_reads)) != NULL) {
 
-    if(nr != NULL) {
-      if(hts_cond_wait_timeout(&ct->ct_cc->cc_cond, &smb_global_mutex,
+    while(nr->nr_result == -1) {
+      if(hts_cond_wait_timeout(&cc->cc_cond, &cc->cc_mutex,
                                NBT_TIMEOUT)) {
-	break;
+        // Only fail this read, a dead connection is detected by ping
+        TRACE(TRACE_ERROR, "SMB", "%s:%d read timeout (%d) on %p",
+              cc->cc_hostname, cc->cc_port, (int)nr->nr_mid, cc);
+        goto fail;
       }
-    } else {
-      break;
     }
-  }
 
-  total = 0;
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
     if(nr->nr_result)
       goto fail;
 
-    resp = nr->nr_response;
-    uint32_t errcode = letoh_32(resp->hdr.errorcode);
-    if(errcode)
+    if(cc->cc_dialect) {
+      const SMB2_READ_resp_t *resp = nr->nr_response;
+      const uint32_t status = smb_errorcode(cc, resp);
+
+      if(status == STATUS_END_OF_FILE) {
+        rcnt = offset = 0;
+      } else {
+        if(nr->nr_response_len < sizeof(SMB2_READ_resp_t) || status)
+          goto fail;
+        rcnt = letoh_32(resp->data_length);
+        offset = resp->data_offset;
+      }
+    } else {
+      const SMB_READ_ANDX_resp_t *resp = nr->nr_response;
+      if(nr->nr_response_len < sizeof(SMB_READ_ANDX_resp_t) ||
+         letoh_32(resp->hdr.errorcode))
+        goto fail;
+
+      rcnt = letoh_16(resp->data_length_low);
+      rcnt += letoh_32(resp->data_length_high) << 16;
+      offset = letoh_16(resp->data_offset);
+    }
+
+    if(rcnt < 0 || rcnt > nr->nr_cnt ||
+       offset + rcnt > nr->nr_response_len)
       goto fail;
 
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
+    const int n = MIN(rcnt - nr->nr_consumed, size);
+    memcpy(buf + total, nr->nr_response + offset + nr->nr_consumed, n);
+    nr->nr_consumed += n;
+    sf->sf_pos += n;
+    total += n;
+    size -= n;
 
-    rcnt = letoh_16(resp->data_length_low);
-    rcnt += letoh_32(resp->data_length_high) << 16;
-    memcpy(buf + nr->nr_offset,
-	   nr->nr_response + letoh_16(resp->data_offset), rcnt);
-    free(nr->nr_response);
+    if(nr->nr_consumed < rcnt)
+      break; // Caller is satisfied, rest of this response is kept
 
-    sf->sf_pos += rcnt;
-    total += rcnt;
+    const int requested = nr->nr_cnt;
+    smb_read_release(sf, nr);
 
-    if(nr->nr_last && rcnt < nr->nr_cnt) {
-      free(nr);
+    if(rcnt < requested) {
+      // Short read, file is shorter than we thought
+      smb_read_flush(sf);
       break;
     }
-    free(nr);
   }
-  hts_mutex_unlock(&smb_global_mutex);
+
+  sf->sf_last_end = sf->sf_pos;
+  hts_mutex_unlock(&cc->cc_mutex);
   return total;
 
  fail:
-
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
-    free(nr->nr_response);
-    free(nr);
-  }
-  hts_mutex_unlock(&smb_global_mutex);
+  smb_read_flush(sf);
+  hts_mutex_unlock(&cc->cc_mutex);
   return -1;
-
 }
 
 
@@ -2527,7 +4000,7 @@ smb_stat(fa_protocol_t *fap, const char *url, struct fa_stat *fs,
     fs->fs_mtime = 0;
     fs->fs_type = CONTENT_SHARE;
     cc->cc_refcount--;
-    hts_mutex_unlock(&smb_global_mutex);
+    hts_mutex_unlock(&cc->cc_mutex);
     return FAP_OK;
   }
 }
@@ -2565,6 +4038,81 @@ typedef struct eahdr {
 
 } __attribute__((packed)) eahdr_t;
 
+
+/**
+ *
+ */
+static fa_err_code_t
+smb_xattr_err(uint32_t errcode)
+{
+  switch(errcode) {
+  case 0:
+    return FAP_OK;
+  case 0xC0000022:
+    return FAP_PERMISSION_DENIED;
+  case 0xC000004F:
+  case 0x03E20001:
+    return FAP_NOT_SUPPORTED;
+
+  default:
+    return FAP_ERROR;
+  }
+}
+
+
+/**
+ * SMB2 has no path based EA calls so open the file and use SET_INFO
+ */
+static fa_err_code_t
+smb2_set_xattr(cifs_tree_t *ct, const char *filename, const char *name,
+               const void *data, size_t data_len)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const int name_len = strlen(name);
+  uint32_t errcode;
+  void *rbuf;
+  int rlen;
+
+  SMB2_CREATE_resp_t *cresp = smb2_create(ct, filename, FILE_WRITE_EA, 7, 0,
+                                          &errcode, NULL, 0);
+  if(cresp == NULL)
+    return errcode ? smb_xattr_err(errcode) : FAP_ERROR;
+
+  int dlen = sizeof(eahdr_t) + name_len + 1 + data_len;
+  int tlen = sizeof(SMB2_SET_INFO_req_t) + dlen;
+  SMB2_SET_INFO_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  smbv2_init_header(cc, &req->hdr, SMB2_SET_INFO, ct->ct_tid);
+  req->structure_size = htole_16(33);
+  req->info_type = SMB2_0_INFO_FILE;
+  req->file_info_class = FILE_FULL_EA_INFORMATION;
+  req->buffer_length = htole_32(dlen);
+  req->buffer_offset = htole_16(smb2_offset(SMB2_SET_INFO_req_t, data));
+  memcpy(req->file_id, cresp->file_id, sizeof(req->file_id));
+
+  eahdr_t *ea = (void *)req->data;
+  ea->list_len = 0; // NextEntryOffset, this is the only entry
+  ea->name_len = name_len;
+  ea->data_len = htole_16(data_len);
+  memcpy(ea->data, name, name_len + 1);
+  if(data != NULL)
+    memcpy(ea->data + name_len + 1, data, data_len);
+
+  if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    free(cresp);
+    return release_tree_io_error(ct, NULL, 0);
+  }
+
+  errcode = smb_errorcode(cc, rbuf);
+  free(rbuf);
+  smb2_close(cc, ct->ct_tid, cresp->file_id, 0, NULL, 0);
+  free(cresp);
+  cifs_release_tree(ct, 0);
+  return smb_xattr_err(errcode);
+}
+
+
 /**
  * Set extended attribute
  */
@@ -2589,6 +4137,9 @@ smb_set_xattr(struct fa_protocol *fap, const char *url,
 
   backslashify(filename);
 
+  if(ct->ct_cc->cc_dialect)
+    return smb2_set_xattr(ct, filename, name, data, data_len);
+
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
   int dlen = sizeof(eahdr_t) + name_len + 1 + data_len;
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen + dlen;
@@ -2617,20 +4168,7 @@ smb_set_xattr(struct fa_protocol *fap, const char *url,
   uint32_t errcode = letoh_32(reply->errorcode);
   free(rbuf);
   cifs_release_tree(ct, 0);
-  switch(errcode) {
-  case 0:
-    return FAP_OK;
-  case 0xC0000022:
-    return FAP_PERMISSION_DENIED;
-  case 0xC000004F:
-  case 0x03E20001:
-    return FAP_NOT_SUPPORTED;
-
-  default:
-    return FAP_ERROR;
-  }
-
-  return FAP_OK;
+  return smb_xattr_err(errcode);
 }
 
 /**
@@ -2642,6 +4180,96 @@ typedef struct get_eahdr {
   char data[0];
 } __attribute__((packed)) get_eahdr_t;
 
+
+/**
+ * Copy the value out of a FILE_FULL_EA_INFORMATION list
+ */
+static fa_err_code_t
+smb_xattr_value(const uint8_t *buf, int len, void **datap, size_t *lenp)
+{
+  if(len < sizeof(eahdr_t))
+    return FAP_ERROR;
+
+  const eahdr_t *ea = (const void *)buf;
+  const int dlen = letoh_16(ea->data_len);
+  if(sizeof(eahdr_t) + ea->name_len + 1 + dlen > len)
+    return FAP_ERROR;
+
+  if(dlen > 0) {
+    *datap = malloc(dlen);
+    memcpy(*datap, ea->data + ea->name_len + 1, dlen);
+    *lenp = dlen;
+  } else {
+    *datap = NULL;
+    *lenp = 0;
+  }
+  return FAP_OK;
+}
+
+
+/**
+ *
+ */
+static fa_err_code_t
+smb2_get_xattr(cifs_tree_t *ct, const char *filename, const char *name,
+               void **datap, size_t *lenp)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const int name_len = strlen(name);
+  void *rbuf;
+  int rlen;
+  int retcode;
+
+  SMB2_CREATE_resp_t *cresp = smb2_create(ct, filename, FILE_READ_EA, 7, 0,
+                                          NULL, NULL, 0);
+  if(cresp == NULL)
+    return FAP_ERROR;
+
+  int dlen = sizeof(get_eahdr_t) + name_len + 1;
+  int tlen = sizeof(SMB2_QUERY_INFO_req_t) + dlen;
+  SMB2_QUERY_INFO_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  smbv2_init_header(cc, &req->hdr, SMB2_QUERY_INFO, ct->ct_tid);
+  req->structure_size = htole_16(41);
+  req->info_type = SMB2_0_INFO_FILE;
+  req->file_info_class = FILE_FULL_EA_INFORMATION;
+  req->output_buffer_length = htole_32(65536);
+  req->input_buffer_offset = htole_16(smb2_offset(SMB2_QUERY_INFO_req_t, data));
+  req->input_buffer_length = htole_32(dlen);
+  memcpy(req->file_id, cresp->file_id, sizeof(req->file_id));
+
+  get_eahdr_t *ea = (void *)req->data;
+  ea->list_len = 0; // NextEntryOffset, this is the only entry
+  ea->name_len = name_len;
+  memcpy(ea->data, name, name_len + 1);
+
+  if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    free(cresp);
+    return release_tree_io_error(ct, NULL, 0);
+  }
+
+  const SMB2_QUERY_resp_t *resp = rbuf;
+
+  if(rlen < sizeof(SMB2_QUERY_resp_t) || smb_errorcode(cc, rbuf)) {
+    retcode = FAP_ERROR;
+  } else {
+    int offset = letoh_16(resp->output_buffer_offset);
+    int len    = letoh_32(resp->output_buffer_length);
+
+    if(offset < sizeof(SMB2_QUERY_resp_t) || len > rlen - offset)
+      retcode = FAP_ERROR;
+    else
+      retcode = smb_xattr_value(rbuf + offset, len, datap, lenp);
+  }
+  free(rbuf);
+  smb2_close(cc, ct->ct_tid, cresp->file_id, 0, NULL, 0);
+  free(cresp);
+  cifs_release_tree(ct, 0);
+  return retcode;
+}
+
+
 /**
  * Get extended attribute
  */
@@ -2662,6 +4290,10 @@ smb_get_xattr(struct fa_protocol *fap, const char *url,
     return -1;
 
   backslashify(filename);
+
+  if(ct->ct_cc->cc_dialect)
+    return smb2_get_xattr(ct, filename, name, datap, lenp);
+
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
   int dlen = sizeof(get_eahdr_t) + name_len + 1;
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen + dlen;
@@ -2696,22 +4328,10 @@ smb_get_xattr(struct fa_protocol *fap, const char *url,
     int offset = letoh_16(t2resp->data_offset);
     int len    = letoh_16(t2resp->data_count);
 
-
-    if(len < sizeof(eahdr_t)) {
+    if(offset + len > rlen)
       retcode = FAP_ERROR;
-    } else {
-      retcode = FAP_OK;
-      const eahdr_t *ea = (void *)(rbuf + offset);
-      const int dlen = letoh_16(ea->data_len);
-      if(dlen > 0) {
-        *datap = malloc(dlen);
-        memcpy(*datap, ea->data + ea->name_len + 1, dlen);
-        *lenp = dlen;
-      } else {
-        *datap = NULL;
-        *lenp = 0;
-      }
-    }
+    else
+      retcode = smb_xattr_value(rbuf + offset, len, datap, lenp);
   }
   free(rbuf);
   cifs_release_tree(ct, 0);
@@ -2726,22 +4346,54 @@ smb_get_xattr(struct fa_protocol *fap, const char *url,
 static void
 cifs_periodic(struct callout *c, void *opaque)
 {
-  cifs_connection_t *cc = opaque;
+  cifs_connection_t *cc;
 
   EchoRequest_t *req = alloca(sizeof(EchoRequest_t) + 2);
   memset(req, 0, sizeof(EchoRequest_t) + 2);
 
+  /*
+   * The connection might have been destroyed while we were about to
+   * fire, so make sure it's still around and hold on to it
+   */
   hts_mutex_lock(&smb_global_mutex);
 
-  smbv1_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
-  req->wordcount = 1;
-  req->echo_count = htole_16(1);
-  req->byte_count = htole_16(2);
-  req->data[0] = 0x13;
-  req->data[1] = 0x37;
+  LIST_FOREACH(cc, &cifs_connections, cc_link)
+    if(cc == opaque)
+      break;
+
+  if(cc == NULL) {
+    hts_mutex_unlock(&smb_global_mutex);
+    return;
+  }
+
+  hts_mutex_lock(&cc->cc_mutex);
+  hts_mutex_unlock(&smb_global_mutex);
+  cc->cc_refcount++;
+
+  if(cc->cc_dialect) {
+    SMB2_ECHO_req_t req2;
 
-  req->hdr.pid = htole_16(3); // PING
-  nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+    memset(&req2, 0, sizeof(req2));
+    smbv2_init_header(cc, &req2.hdr, SMB2_ECHO, 0);
+    req2.structure_size = htole_16(4);
+
+    // Never block the callout thread waiting for credits
+    if(cc->cc_credits > 0) {
+      smb2_stamp(cc, &req2.hdr, 1);
+      cc->cc_echo_msgid = letoh_64(req2.hdr.message_id);
+      nbt_write(cc, &req2, sizeof(req2));
+    }
+  } else {
+    smbv1_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
+    req->wordcount = 1;
+    req->echo_count = htole_16(1);
+    req->byte_count = htole_16(2);
+    req->data[0] = 0x13;
+    req->data[1] = 0x37;
+
+    req->hdr.pid = htole_16(3); // PING
+    nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+  }
 
   if(cc->cc_wait_for_ping) {
     cc->cc_broken = 1;
@@ -2755,7 +4407,8 @@ cifs_periodic(struct callout *c, void *opaque)
   if(cc->cc_auto_close > 5) {
     cifs_disconnect(cc);
   } else {
-    hts_mutex_unlock(&smb_global_mutex);
+    cc->cc_refcount--;
+    hts_mutex_unlock(&cc->cc_mutex);
   }
 }
 
@@ -2871,7 +4524,8 @@ smb_enum_servers(const char *hostname)
   cc = cifs_get_connection(hostname, port, errbuf, sizeof(errbuf),
                            CC_F_AS_GUEST |
                            CC_F_NON_INTERACTIVE |
-                           CC_F_ANONYMOUS);
+                           CC_F_ANONYMOUS |
+                           CC_F_SMB1); // NetServerEnum2 is SMB1 only
   if(cc == SAMBA_NEED_AUTH)
     return NULL;
   if(cc == NULL) {
@@ -18,22 +18,380 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
 #include "image.h"
 #include "pixmap.h"
+#include "misc/minmax.h"
 
 
 #define LOW_THRESHOLD  60
 #define HIGH_THRESHOLD 220
 
+/**
+ * Colors are counted in a histogram with HIST_BITS per channel. Each bin
+ * keeps the sum of its pixels so clusters end up at the true mean color
+ * and not at bin centers. K-means then runs over the occupied bins.
+ *
+ * Large images are sampled on a regular grid of at most MAX_SAMPLES
+ * pixels, so together with the bounded number of bins and iterations
+ * the cost does not depend on the resolution.
+ */
+#define HIST_BITS      4
+#define HIST_BINS      (1 << (HIST_BITS * 3))
+#define MAX_SAMPLES    (512 * 512)
+#define MAX_ITERATIONS 32
+#define NUM_CLUSTERS   8
+#define MERGE_DISTANCE 40
+
+typedef struct color_bin {
+  uint32_t r, g, b;
+  uint32_t num;
+} color_bin_t;
+
+
+typedef struct point {
+  int r, g, b;   // Mean color of the bin
+  int w;         // Number of pixels
+  int c;         // Cluster
+  const color_bin_t *bin;
+} point_t;
+
+
 typedef struct centroid {
   int r, g, b;
   int num_pixels;
-  int or, og, ob;
+  uint64_t sr, sg, sb;
 } centroid_t;
 
 
+/**
+ *
+ */
+static inline void
+bin_add(color_bin_t *h, int r, int g, int b)
+{
+  const int s = 8 - HIST_BITS;
+  color_bin_t *cb = h + ((r >> s) << (HIST_BITS * 2) |
+                         (g >> s) << HIST_BITS |
+                         (b >> s));
+  cb->r += r;
+  cb->g += g;
+  cb->b += b;
+  cb->num++;
+}
+
+
+/**
+ *
+ */
+static inline int
+pixel_is_colorful(int r, int g, int b)
+{
+  if(r > HIGH_THRESHOLD && g > HIGH_THRESHOLD && b > HIGH_THRESHOLD)
+    return 0;
+
+  if(r < LOW_THRESHOLD && g < LOW_THRESHOLD && b < LOW_THRESHOLD)
+    return 0;
+
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+histogram_bgr32(color_bin_t *h, const pixmap_t *pm, int step)
+{
+  for(int y = 0; y < pm->pm_height; y += step) {
+    const uint32_t *src =
+      (const uint32_t *)(pm->pm_data + y * pm->pm_linesize);
+
+    for(int x = 0; x < pm->pm_width; x += step) {
+      const uint32_t u32 = src[x];
+      const int pR =  u32        & 0xff;
+      const int pG = (u32 >> 8)  & 0xff;
+      const int pB = (u32 >> 16) & 0xff;
+      const int pA = (u32 >> 24) & 0xff;
+
+      if(pA >= 128 && pixel_is_colorful(pR, pG, pB))
+        bin_add(h, pR, pG, pB);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static void
+histogram_rgb24(color_bin_t *h, const pixmap_t *pm, int step)
+{
+  for(int y = 0; y < pm->pm_height; y += step) {
+    const uint8_t *src = pm->pm_data + y * pm->pm_linesize;
+
+    for(int x = 0; x < pm->pm_width; x += step) {
+      const int pR = src[x * 3];
+      const int pG = src[x * 3 + 1];
+      const int pB = src[x * 3 + 2];
+
+      if(pixel_is_colorful(pR, pG, pB))
+        bin_add(h, pR, pG, pB);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static inline int
+color_dist(int r0, int g0, int b0, int r1, int g1, int b1)
+{
+  return (r0 - r1) * (r0 - r1) + (g0 - g1) * (g0 - g1) + (b0 - b1) * (b0 - b1);
+}
+
+
+/**
+ * Deterministic k-means++ style seeding. Start in the most populated
+ * bin, then pick the bin with most weight far away from the centroids
+ * chosen so far
+ */
+static int
+seed_centroids(centroid_t *c, const point_t *p, int num_points)
+{
+  int *nearest = malloc(num_points * sizeof(int));
+  int k;
+
+  for(k = 0; k < NUM_CLUSTERS; k++) {
+    int64_t best = 0;
+    int pick = -1;
+
+    for(int i = 0; i < num_points; i++) {
+      int64_t score;
+      if(k == 0) {
+        score = p[i].w;
+      } else {
+        int d = color_dist(p[i].r, p[i].g, p[i].b,
+                           c[k - 1].r, c[k - 1].g, c[k - 1].b);
+        if(k == 1 || d < nearest[i])
+          nearest[i] = d;
+        score = (int64_t)nearest[i] * p[i].w;
+      }
+      if(score > best) {
+        best = score;
+        pick = i;
+      }
+    }
+
+    if(pick == -1)
+      break; // Fewer distinct colors than clusters
+
+    c[k].r = p[pick].r;
+    c[k].g = p[pick].g;
+    c[k].b = p[pick].b;
+  }
+  free(nearest);
+  return k;
+}
+
+
+/**
+ * A large area of one color tends to be split over several clusters.
+ * Join clusters that are closer than MERGE_DISTANCE so it is not beaten
+ * by a smaller area that got fewer clusters
+ */
+static int
+merge_centroids(centroid_t *c, int K)
+{
+  while(K > 1) {
+    int best = MERGE_DISTANCE * MERGE_DISTANCE;
+    int a = -1, b = -1;
+
+    for(int i = 0; i < K; i++) {
+      for(int j = i + 1; j < K; j++) {
+        const int d = color_dist(c[i].r, c[i].g, c[i].b,
+                                 c[j].r, c[j].g, c[j].b);
+        if(d < best) {
+          best = d;
+          a = i;
+          b = j;
+        }
+      }
+    }
+
+    if(a == -1)
+      break;
+
+    c[a].sr += c[b].sr;
+    c[a].sg += c[b].sg;
+    c[a].sb += c[b].sb;
+    c[a].num_pixels += c[b].num_pixels;
+    if(c[a].num_pixels) {
+      c[a].r = c[a].sr / c[a].num_pixels;
+      c[a].g = c[a].sg / c[a].num_pixels;
+      c[a].b = c[a].sb / c[a].num_pixels;
+    }
+    c[b] = c[--K];
+  }
+  return K;
+}
+
+
+/**
+ *
+ */
+void
+dominant_color(pixmap_t *pm)
+{
+  centroid_t centroids[NUM_CLUSTERS];
+  color_bin_t *hist;
+  point_t *points;
+  int num_points = 0;
+  const int pixels = pm->pm_width * pm->pm_height;
+  int step = 1;
+
+  while(pixels / (step * step) > MAX_SAMPLES)
+    step++;
+
+  switch(pm->pm_type) {
+  case PIXMAP_RGB24:
+  case PIXMAP_BGR32:
+    break;
+  default:
+    return;
+  }
+
+  hist = calloc(HIST_BINS, sizeof(color_bin_t));
+  if(hist == NULL)
+    return;
+
+  if(pm->pm_type == PIXMAP_RGB24)
+    histogram_rgb24(hist, pm, step);
+  else
+    histogram_bgr32(hist, pm, step);
+
+  for(int i = 0; i < HIST_BINS; i++)
+    num_points += !!hist[i].num;
+
+  points = malloc(MAX(num_points, 1) * sizeof(point_t));
+  num_points = 0;
+  for(int i = 0; i < HIST_BINS; i++) {
+    const color_bin_t *cb = hist + i;
+    if(cb->num == 0)
+      continue;
+    point_t *p = points + num_points++;
+    p->r = cb->r / cb->num;
+    p->g = cb->g / cb->num;
+    p->b = cb->b / cb->num;
+    p->w = cb->num;
+    p->bin = cb;
+  }
+
+  const int K = seed_centroids(centroids, points, num_points);
+
+  for(int iter = 0; iter < MAX_ITERATIONS; iter++) {
+
+    for(int i = 0; i < num_points; i++) {
+      point_t *p = points + i;
+      int s = INT32_MAX;
+      for(int j = 0; j < K; j++) {
+        const centroid_t *c = centroids + j;
+        const int d = color_dist(c->r, c->g, c->b, p->r, p->g, p->b);
+        if(d < s) {
+          s = d;
+          p->c = j;
+        }
+      }
+    }
+
+    for(int j = 0; j < K; j++) {
+      centroid_t *c = centroids + j;
+      c->sr = c->sg = c->sb = 0;
+      c->num_pixels = 0;
+    }
+
+    for(int i = 0; i < num_points; i++) {
+      const point_t *p = points + i;
+      centroid_t *c = centroids + p->c;
+      c->sr += p->bin->r;
+      c->sg += p->bin->g;
+      c->sb += p->bin->b;
+      c->num_pixels += p->w;
+    }
+
+    int move = 0;
+
+    for(int j = 0; j < K; j++) {
+      centroid_t *c = centroids + j;
+      if(c->num_pixels == 0)
+        continue;
+
+      const int r = c->sr / c->num_pixels;
+      const int g = c->sg / c->num_pixels;
+      const int b = c->sb / c->num_pixels;
+
+      if(r != c->r || g != c->g || b != c->b)
+        move = 1;
+      c->r = r;
+      c->g = g;
+      c->b = b;
+    }
+    if(!move)
+      break;
+  }
+
+  const int num_clusters = merge_centroids(centroids, K);
+
+  const centroid_t *best = NULL;
+  for(int j = 0; j < num_clusters; j++) {
+    const centroid_t *c = centroids + j;
+    if(best == NULL || c->num_pixels > best->num_pixels)
+      best = c;
+  }
+
+  if(best) {
+    pm->pm_primary_color[0] = best->r / 255.0f;
+    pm->pm_primary_color[1] = best->g / 255.0f;
+    pm->pm_primary_color[2] = best->b / 255.0f;
+  } else {
+    pm->pm_primary_color[0] = 0;
+    pm->pm_primary_color[1] = 0;
+    pm->pm_primary_color[2] = 0;
+  }
+  free(points);
+  free(hist);
+}
+
+
+
+#ifdef DOMINANTCOLOR_BENCHMARK
+
+/**
+ * Compares the histogram version with the previous full resolution
+ * k-means on synthetic images where the dominant color is known.
+ *
+ * Build with -DDOMINANTCOLOR_BENCHMARK.
+ * The process exits when done
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "arch/arch.h"
+#include "main.h"
+
+typedef struct ref_centroid {
+  int r, g, b;
+  int num_pixels;
+  int or, og, ob;
+} ref_centroid_t;
+
+
 static void
-randomize_centroids(centroid_t *c, int K)
+ref_randomize_centroids(ref_centroid_t *c, int K)
 {
   for(int i = 0; i < K; i++) {
     c->r = rand() & 0xff;
@@ -48,16 +406,16 @@ randomize_centroids(centroid_t *c, int K)
 }
 
 
-typedef struct pixel {
+typedef struct ref_pixel {
   uint8_t r,g,b,c;
-} pixel_t;
+} ref_pixel_t;
 
 
 /**
  *
  */
 static int
-extract_pixels_bgr32(pixel_t *out, const pixmap_t *pm)
+ref_extract_pixels_bgr32(ref_pixel_t *out, const pixmap_t *pm)
 {
   int num = 0;
 
@@ -99,7 +457,7 @@ extract_pixels_bgr32(pixel_t *out, const pixmap_t *pm)
 
 
 static int
-extract_pixels_rgb24(pixel_t *out, const pixmap_t *pm)
+ref_extract_pixels_rgb24(ref_pixel_t *out, const pixmap_t *pm)
 {
   int num = 0;
 
@@ -134,41 +492,41 @@ extract_pixels_rgb24(pixel_t *out, const pixmap_t *pm)
 
 
 /**
- *
+ * The previous implementation, k-means over every pixel
  */
-void
-dominant_color(pixmap_t *pm)
+static void
+dominant_color_reference(pixmap_t *pm)
 {
   int K = 8;
   int num_pixels;
-  pixel_t *pixels;
-  centroid_t centroids[K];
+  ref_pixel_t *pixels;
+  ref_centroid_t centroids[K];
 
 
   switch(pm->pm_type) {
   case PIXMAP_RGB24:
-    num_pixels = extract_pixels_rgb24(NULL, pm);
-    pixels = malloc(num_pixels * sizeof(pixel_t));
-    extract_pixels_rgb24(pixels, pm);
+    num_pixels = ref_extract_pixels_rgb24(NULL, pm);
+    pixels = malloc(num_pixels * sizeof(ref_pixel_t));
+    ref_extract_pixels_rgb24(pixels, pm);
     break;
 
   case PIXMAP_BGR32:
-    num_pixels = extract_pixels_bgr32(NULL, pm);
-    pixels = malloc(num_pixels * sizeof(pixel_t));
-    extract_pixels_bgr32(pixels, pm);
+    num_pixels = ref_extract_pixels_bgr32(NULL, pm);
+    pixels = malloc(num_pixels * sizeof(ref_pixel_t));
+    ref_extract_pixels_bgr32(pixels, pm);
     break;
   default:
     return;
   }
-  randomize_centroids(centroids, K);
+  ref_randomize_centroids(centroids, K);
 
   while(1) {
-    pixel_t *p = pixels;
+    ref_pixel_t *p = pixels;
     for(int i = 0; i < num_pixels; i++) {
       int s = INT32_MAX;
 
       for(int j = 0; j < K; j++) {
-        const centroid_t *c = centroids + j;
+        const ref_centroid_t *c = centroids + j;
 
         int d =
           ((c->r - (int)p->r) * (c->r - (int)p->r)) +
@@ -184,7 +542,7 @@ dominant_color(pixmap_t *pm)
     }
 
     for(int j = 0; j < K; j++) {
-      centroid_t *c = centroids + j;
+      ref_centroid_t *c = centroids + j;
       c->or = c->r;
       c->og = c->g;
       c->ob = c->b;
@@ -195,7 +553,7 @@ dominant_color(pixmap_t *pm)
     }
 
     for(int i = 0; i < num_pixels; i++) {
-      centroid_t *c = centroids + pixels[i].c;
+      ref_centroid_t *c = centroids + pixels[i].c;
       c->r += pixels[i].r;
       c->g += pixels[i].g;
       c->b += pixels[i].b;
@@ -205,7 +563,7 @@ dominant_color(pixmap_t *pm)
     int move = 0;
 
     for(int j = 0; j < K; j++) {
-      centroid_t *c = centroids + j;
+      ref_centroid_t *c = centroids + j;
       if(c->num_pixels) {
         c->r /= c->num_pixels;
         c->g /= c->num_pixels;
@@ -222,9 +580,9 @@ dominant_color(pixmap_t *pm)
       break;
   }
 
-  const centroid_t *best = NULL;
+  const ref_centroid_t *best = NULL;
   for(int j = 0; j < K; j++) {
-    const centroid_t *c = centroids + j;
+    const ref_centroid_t *c = centroids + j;
     if(best == NULL || c->num_pixels > best->num_pixels)
       best = c;
   }
@@ -235,3 +593,198 @@ dominant_color(pixmap_t *pm)
   }
   free(pixels);
 }
+
+
+static uint32_t dcb_seed = 1;
+
+static int
+dcb_rand(void)
+{
+  dcb_seed = dcb_seed * 1103515245 + 12345;
+  return (dcb_seed >> 16) & 0x7fff;
+}
+
+
+typedef struct dcb_scene {
+  const char *name;
+  int rgb[3];   // Expected dominant color, -1 if there is none
+  void (*pixel)(uint8_t *rgb, int x, int y, int w, int h);
+} dcb_scene_t;
+
+
+static int
+dcb_noise(int v, int amount)
+{
+  return MAX(0, MIN(255, v + dcb_rand() % (amount * 2 + 1) - amount));
+}
+
+
+/**
+ * Blue sky over a darker red field, sky covers 60%
+ */
+static void
+dcb_two_tone(uint8_t *rgb, int x, int y, int w, int h)
+{
+  const int sky = y < h * 6 / 10;
+  rgb[0] = dcb_noise(sky ? 70  : 170, 12);
+  rgb[1] = dcb_noise(sky ? 130 : 50,  12);
+  rgb[2] = dcb_noise(sky ? 200 : 40,  12);
+}
+
+
+/**
+ * Green backdrop with a few smaller patches and some white and black
+ * that should be ignored
+ */
+static void
+dcb_patches(uint8_t *rgb, int x, int y, int w, int h)
+{
+  const int u = x * 8 / w, v = y * 8 / h;
+  int c[3] = {60, 160, 80};
+
+  if(u < 2 && v < 3) {
+    c[0] = 230; c[1] = 230; c[2] = 230;
+  } else if(u > 5 && v > 5) {
+    c[0] = 10; c[1] = 10; c[2] = 10;
+  } else if(u == 4 && v < 4) {
+    c[0] = 220; c[1] = 120; c[2] = 30;
+  } else if(v == 7) {
+    c[0] = 120; c[1] = 60; c[2] = 160;
+  }
+  rgb[0] = dcb_noise(c[0], 6);
+  rgb[1] = dcb_noise(c[1], 6);
+  rgb[2] = dcb_noise(c[2], 6);
+}
+
+
+/**
+ * Smooth gradient, no single dominant color
+ */
+static void
+dcb_gradient(uint8_t *rgb, int x, int y, int w, int h)
+{
+  rgb[0] = 64 + x * 160 / w;
+  rgb[1] = 64 + y * 160 / h;
+  rgb[2] = dcb_noise(128, 20);
+}
+
+
+/**
+ * Uniform noise, the worst case for the number of occupied bins
+ */
+static void
+dcb_noise_scene(uint8_t *rgb, int x, int y, int w, int h)
+{
+  rgb[0] = dcb_rand();
+  rgb[1] = dcb_rand();
+  rgb[2] = dcb_rand();
+}
+
+
+static const dcb_scene_t dcb_scenes[] = {
+  { "two tone", {70, 130, 200}, dcb_two_tone },
+  { "patches",  {60, 160, 80},  dcb_patches },
+  { "gradient", {-1},           dcb_gradient },
+  { "noise",    {-1},           dcb_noise_scene },
+};
+
+
+static pixmap_t *
+dcb_render(const dcb_scene_t *s, int w, int h, pixmap_type_t type)
+{
+  pixmap_t *pm = pixmap_create(w, h, type, 0);
+  dcb_seed = 1;
+  for(int y = 0; y < h; y++) {
+    uint8_t *row = pm->pm_data + y * pm->pm_linesize;
+    for(int x = 0; x < w; x++) {
+      uint8_t rgb[3];
+      s->pixel(rgb, x, y, w, h);
+      if(type == PIXMAP_RGB24) {
+        memcpy(row + x * 3, rgb, 3);
+      } else {
+        uint32_t *d = (uint32_t *)row + x;
+        *d = 0xff000000 | rgb[2] << 16 | rgb[1] << 8 | rgb[0];
+      }
+    }
+  }
+  return pm;
+}
+
+
+static float
+dcb_dist(const float *a, const float *b)
+{
+  return 255.0f * sqrtf((a[0] - b[0]) * (a[0] - b[0]) +
+                        (a[1] - b[1]) * (a[1] - b[1]) +
+                        (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+
+/**
+ *
+ */
+static void *
+dominant_color_benchmark(void *aux)
+{
+  static const struct {
+    int width, height;
+  } sizes[] = {
+    { 320, 180 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+  };
+
+  printf("%-9s %-6s %9s  %12s %12s  %8s %8s %8s\n",
+         "scene", "type", "size", "reference", "histogram",
+         "ref err", "hist err", "ref diff");
+
+  for(int i = 0; i < ARRAYSIZE(dcb_scenes); i++) {
+    const dcb_scene_t *s = dcb_scenes + i;
+    for(int j = 0; j < ARRAYSIZE(sizes); j++) {
+      for(int t = 0; t < 2; t++) {
+        const pixmap_type_t type = t ? PIXMAP_RGB24 : PIXMAP_BGR32;
+        pixmap_t *pm = dcb_render(s, sizes[j].width, sizes[j].height, type);
+        float ref[3], hist[3];
+
+        srand(1);
+        int64_t ts = arch_get_ts();
+        dominant_color_reference(pm);
+        const int64_t t_ref = arch_get_ts() - ts;
+        memcpy(ref, pm->pm_primary_color, sizeof(ref));
+
+        ts = arch_get_ts();
+        dominant_color(pm);
+        const int64_t t_hist = arch_get_ts() - ts;
+        memcpy(hist, pm->pm_primary_color, sizeof(hist));
+
+        char ref_err[16] = "-", hist_err[16] = "-";
+        if(s->rgb[0] >= 0) {
+          const float want[3] = {s->rgb[0] / 255.0f, s->rgb[1] / 255.0f,
+                                 s->rgb[2] / 255.0f};
+          snprintf(ref_err, sizeof(ref_err), "%.1f", dcb_dist(ref, want));
+          snprintf(hist_err, sizeof(hist_err), "%.1f", dcb_dist(hist, want));
+        }
+
+        printf("%-9s %-6s %4dx%-4d  %10.2fms %10.2fms  %8s %8s %8.1f\n",
+               s->name, t ? "RGB24" : "BGR32",
+               sizes[j].width, sizes[j].height,
+               t_ref / 1000.0, t_hist / 1000.0,
+               ref_err, hist_err, dcb_dist(ref, hist));
+        pixmap_release(pm);
+      }
+    }
+  }
+  exit(0);
+}
+
+
+static void
+dominant_color_benchmark_init(void)
+{
+  hts_thread_create_detached("dcbench", dominant_color_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, dominant_color_benchmark_init, NULL, 0);
+
+#endif
@@ -17,12 +17,14 @@
  *  This program is also available under a commercial proprietary license.
  *  For more information, contact andreas@lonelycoder.com
  */
+#include "config.h"
 #include "image.h"
 
 #include "main.h"
 #include "arch/atomic.h"
 #include "misc/buf.h"
 #include "pixmap.h"
+#include "jpeg.h"
 
 struct pixmap *(*accel_image_decode)(image_coded_type_t type,
 				     struct buf *buf,
@@ -82,6 +84,10 @@ image_clear_component(image_component_t *ic)
   case IMAGE_TEXT_INFO:
     free(ic->text_info.ti_charpos);
     break;
+
+  case IMAGE_GLYPH_RUNS:
+    free(ic->glyph_runs.igr_glyphs);
+    break;
   }
   ic->type = IMAGE_component_none;
 }
@@ -155,6 +161,12 @@ image_dump(const image_t *im, const char *prefix)
             ti->ti_flags & IMAGE_TEXT_WRAPPED   ? "Wrapped" : "",
             ti->ti_flags & IMAGE_TEXT_TRUNCATED ? "Truncated" : "");
       break;
+
+    case IMAGE_GLYPH_RUNS:
+      tracelog(TRACE_NO_PROP, TRACE_DEBUG, prefix,
+            "[%d]: Glyph runs, %d glyphs, atlas epoch %d",
+            i, ic->glyph_runs.igr_num, ic->glyph_runs.igr_atlas_epoch);
+      break;
     }
   }
 }
@@ -233,6 +245,42 @@ image_create_from_pixmap(pixmap_t *pm)
 }
 
 
+static image_t *image_decode_coded(const image_t *src,
+                                   const image_meta_t *meta,
+                                   char *errbuf, size_t errlen);
+
+/**
+ * Decode the EXIF thumbnail instead of the main image if it's large
+ * enough for what we're asked for
+ */
+static image_t *
+image_decode_exif_thumbnail(const image_t *src, const image_meta_t *meta,
+                            char *errbuf, size_t errlen)
+{
+  const image_component_coded_t *icc = &src->im_components[0].coded;
+  jpeg_meminfo_t mi;
+  jpeginfo_t ji;
+
+  mi.data = buf_data(icc->icc_buf);
+  mi.size = buf_size(icc->icc_buf);
+
+  if(jpeg_info(&ji, jpeginfo_mem_reader, &mi,
+               JPEG_INFO_DIMENSIONS | JPEG_INFO_THUMBNAIL,
+               mi.data, mi.size, errbuf, errlen))
+    return NULL;
+
+  image_t *thumb = jpeg_thumbnail_for(&ji, meta);
+  jpeg_info_clear(&ji);
+  if(thumb == NULL)
+    return NULL;
+
+  thumb->im_orientation = src->im_orientation;
+  image_t *r = image_decode_coded(thumb, meta, errbuf, errlen);
+  image_release(thumb);
+  return r;
+}
+
+
 /**
  *
  */
@@ -246,12 +294,31 @@ image_decode_coded(const image_t *src, const image_meta_t *meta,
   if(icc->icc_type == IMAGE_SVG)
     return nanosvg_decode(icc->icc_buf, meta,  errbuf, errlen);
 
+  if(icc->icc_type == IMAGE_JPEG && !(src->im_flags & IMAGE_THUMBNAIL)) {
+    image_t *r = image_decode_exif_thumbnail(src, meta, errbuf, errlen);
+    if(r != NULL)
+      return r;
+  }
+
   pixmap_t *pm = NULL;
 
   if(accel_image_decode != NULL)
     pm = accel_image_decode(icc->icc_type, icc->icc_buf, meta, errbuf, errlen,
                             src);
 
+#if ENABLE_LIBJPEG
+  /*
+   * libjpeg can downscale in the IDCT. We can't do drop shadows on
+   * its RGB24 output though. The IDCT only scales by 1/2, 1/4 and 1/8
+   * so the remainder is rescaled like the libav path does
+   */
+  if(pm == NULL && icc->icc_type == IMAGE_JPEG && !meta->im_shadow) {
+    pm = libjpeg_decode_buf(icc->icc_buf, meta, errbuf, errlen);
+    if(pm != NULL)
+      pm = image_rescale_libav(pm, meta);
+  }
+#endif
+
   if(pm == NULL)
     pm = image_decode_libav(icc->icc_type, icc->icc_buf, meta, errbuf, errlen);
 
@@ -66,6 +66,7 @@ typedef enum image_component_type {
   IMAGE_CODED,
   IMAGE_VECTOR,
   IMAGE_TEXT_INFO,
+  IMAGE_GLYPH_RUNS,
 } image_component_type_t;
 
 
@@ -120,6 +121,27 @@ typedef struct image_component_text_info {
 } image_component_text_info_t;
 
 
+/**
+ * Positioned glyphs referring to the shared glyph atlas
+ * (see text/glyph_atlas.h), drawn in order
+ */
+typedef struct image_glyph {
+  int16_t ig_x;        // Top left corner in image (including margin)
+  int16_t ig_y;
+  uint16_t ig_u;       // Top left corner in atlas
+  uint16_t ig_v;
+  uint16_t ig_width;
+  uint16_t ig_height;
+  uint32_t ig_color;   // Alpha + BGR in host order
+} image_glyph_t;
+
+typedef struct image_component_glyph_runs {
+  image_glyph_t *igr_glyphs;
+  int igr_num;
+  int igr_atlas_epoch;
+} image_component_glyph_runs_t;
+
+
 /**
  *
  */
@@ -131,6 +153,7 @@ typedef struct image_component {
     image_component_coded_t coded;
     image_component_vector_t vector;
     image_component_text_info_t text_info;
+    image_component_glyph_runs_t glyph_runs;
   };
 
 } image_component_t;
@@ -204,6 +227,8 @@ struct pixmap *image_decode_libav(image_coded_type_t type,
                                   struct buf *buf, const image_meta_t *im,
                                   char *errbuf, size_t errlen);
 
+struct pixmap *image_rescale_libav(struct pixmap *pm, const image_meta_t *im);
+
 extern struct pixmap *(*accel_image_decode)(image_coded_type_t type,
 					    struct buf *buf,
 					    const image_meta_t *im,
@@ -214,6 +239,10 @@ extern struct pixmap *(*accel_image_decode)(image_coded_type_t type,
 struct pixmap *libjpeg_decode(struct fa_handle *fh,
                               const image_meta_t *meta,
                               char *errbuf, size_t errlen);
+
+struct pixmap *libjpeg_decode_buf(struct buf *buf,
+                                  const image_meta_t *meta,
+                                  char *errbuf, size_t errlen);
 #endif
 
 /***************************************************************************
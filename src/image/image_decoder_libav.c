@@ -387,6 +387,47 @@ pixmap_compute_rescale_dim(const image_meta_t *im,
 }
 
 
+/**
+ * Rescale a decoded RGB24 or I pixmap to the dimensions 'im' asks for,
+ * the same way pixmap_from_avpic() does. Used for decoders that can
+ * only scale by fixed factors. 'pm' is consumed
+ */
+pixmap_t *
+image_rescale_libav(pixmap_t *pm, const image_meta_t *im)
+{
+  AVPicture pict = {};
+  int pix_fmt, w, h;
+
+  pixmap_compute_rescale_dim(im, pm->pm_width, pm->pm_height, &w, &h);
+  if(w == pm->pm_width && h == pm->pm_height)
+    return pm;
+
+  switch(pm->pm_type) {
+  case PIXMAP_RGB24:
+    pix_fmt = AV_PIX_FMT_RGB24;
+    break;
+  case PIXMAP_I:
+    pix_fmt = AV_PIX_FMT_GRAY8;
+    break;
+  default:
+    return pm;
+  }
+
+  pict.data[0] = pm_pixel(pm, 0, 0);
+  pict.linesize[0] = pm->pm_linesize;
+
+  pixmap_t *pm2 = pixmap_rescale_swscale(&pict, pix_fmt,
+                                         pm->pm_width, pm->pm_height, w, h,
+                                         im->im_corner_radius, im->im_margin);
+  if(pm2 == NULL)
+    return pm;
+
+  pm2->pm_aspect = pm->pm_aspect;
+  pixmap_release(pm);
+  return pm2;
+}
+
+
 /**
  *
  */
@@ -28,6 +28,7 @@
 
 #include "jpeg.h"
 #include "image.h"
+#include "pixmap.h"
 #include "misc/rstr.h"
 
 /**
@@ -240,6 +241,19 @@ parse_app1(jpeginfo_t *ji, const uint8_t *buf, size_t len, int flags)
                                                     IMAGE_JPEG);
     ji->ji_thumbnail->im_flags |= IMAGE_THUMBNAIL;
     ji->ji_thumbnail->im_orientation = ji->ji_orientation;
+
+    jpeginfo_t tji;
+    jpeg_meminfo_t mi;
+    mi.data = buf + thumbnail_jpeg_offset;
+    mi.size = thumbnail_jpeg_size;
+
+    if(!jpeg_info(&tji, jpeginfo_mem_reader, &mi, JPEG_INFO_DIMENSIONS,
+                  mi.data, mi.size, NULL, 0) &&
+       tji.ji_width > 0 && tji.ji_height > 0) {
+      ji->ji_thumbnail->im_width  = tji.ji_width;
+      ji->ji_thumbnail->im_height = tji.ji_height;
+    }
+    jpeg_info_clear(&tji);
   }
   return 0;
 }
@@ -395,6 +409,33 @@ jpeg_info_clear(jpeginfo_t *ji)
 }
 
 
+/**
+ * Cameras letterbox the thumbnail when the sensor aspect differs from
+ * it, such thumbnails are never used
+ */
+image_t *
+jpeg_thumbnail_for(const jpeginfo_t *ji, const image_meta_t *im)
+{
+  const image_t *t = ji->ji_thumbnail;
+  int w, h;
+
+  if(t == NULL || t->im_width == 0 || t->im_height == 0 ||
+     ji->ji_width <= 0 || ji->ji_height <= 0)
+    return NULL;
+
+  const int64_t a = (int64_t)t->im_width  * ji->ji_height;
+  const int64_t b = (int64_t)t->im_height * ji->ji_width;
+  if((a > b ? a - b : b - a) * 50 > b)
+    return NULL;
+
+  pixmap_compute_rescale_dim(im, ji->ji_width, ji->ji_height, &w, &h);
+  if(w <= 0 || h <= 0 || t->im_width < w || t->im_height < h)
+    return NULL;
+
+  return image_retain(ji->ji_thumbnail);
+}
+
+
 
 
 /**
@@ -405,6 +446,9 @@ jpeginfo_mem_reader(void *handle, void *buf, int64_t offset, size_t size)
 {
   jpeg_meminfo_t *mi = handle;
 
+  if(offset >= mi->size)
+    return -1;
+
   if(size + offset > mi->size)
     size = mi->size - offset;
 
@@ -50,6 +50,15 @@ int jpeg_info(jpeginfo_t *ji, jpegreader_t *reader, void *handle, int flags,
 
 void jpeg_info_clear(jpeginfo_t *ji);
 
+struct image_meta;
+
+/**
+ * Returns (retained) the EXIF thumbnail if it's large enough to stand in
+ * for the main image at the size asked for in 'im'
+ */
+struct image *jpeg_thumbnail_for(const jpeginfo_t *ji,
+                                 const struct image_meta *im);
+
 /**
  *
  */
@@ -28,11 +28,14 @@
 #include "image.h"
 #include "pixmap.h"
 #include "misc/buf.h"
+#include "misc/minmax.h"
 
 
 struct my_error_mgr {
   struct jpeg_error_mgr pub;
   jmp_buf setjmp_buffer;
+  pixmap_t *pm;               // Partially decoded image, released on error
+  char msg[JMSG_LENGTH_MAX];
 };
 
 typedef struct my_error_mgr *my_error_ptr;
@@ -42,74 +45,545 @@ static void
 my_error_exit(j_common_ptr cinfo)
 {
   my_error_ptr myerr = (my_error_ptr) cinfo->err;
-  (*cinfo->err->output_message) (cinfo);
+  (*cinfo->err->format_message) (cinfo, myerr->msg);
 
   longjmp(myerr->setjmp_buffer, 1);
 }
 
 
+/**
+ * Largest of the 1/1, 1/2, 1/4 and 1/8 downscales that libjpeg can do
+ * in the IDCT that still covers what the caller asked for
+ */
+static int
+libjpeg_scale_denom(const image_meta_t *im, int width, int height)
+{
+  int w, h, denom;
+
+  pixmap_compute_rescale_dim(im, width, height, &w, &h);
+  if(w <= 0 || h <= 0)
+    return 1;
+
+  for(denom = 8; denom > 1; denom >>= 1)
+    if((width + denom - 1) / denom >= w && (height + denom - 1) / denom >= h)
+      break;
+  return denom;
+}
+
+
+/**
+ *
+ */
+static void
+libjpeg_read_pass(j_decompress_ptr cinfo, pixmap_t *pm)
+{
+  JSAMPROW rows[16];
+  int i, n;
+
+  while(cinfo->output_scanline < cinfo->output_height) {
+    n = MIN(cinfo->output_height - cinfo->output_scanline,
+            MIN(cinfo->rec_outbuf_height, 16));
+    for(i = 0; i < n; i++)
+      rows[i] = pm_pixel(pm, 0, cinfo->output_scanline + i);
+    jpeg_read_scanlines(cinfo, rows, n);
+  }
+}
+
+
+/**
+ * Output is 1/scale of the image. Keep the aspect of the original rather
+ * than what the rounded up dimensions give
+ */
+static pixmap_t *
+libjpeg_pixmap_create(j_decompress_ptr cinfo, pixmap_type_t type,
+                      const image_meta_t *im)
+{
+  pixmap_t *pm = pixmap_create(cinfo->output_width, cinfo->output_height,
+                               type, im->im_margin);
+  if(pm != NULL)
+    pm->pm_aspect = (float)cinfo->image_width / (float)cinfo->image_height;
+  return pm;
+}
+
+
+/**
+ * Decode from an already configured source. Errors longjmp() back to
+ * the caller
+ */
+static int
+libjpeg_decompress(j_decompress_ptr cinfo, const image_meta_t *im)
+{
+  my_error_ptr myerr = (my_error_ptr) cinfo->err;
+  pixmap_type_t type = PIXMAP_RGB24;
+
+  jpeg_read_header(cinfo, TRUE);
+
+  if(im->im_can_mono && cinfo->jpeg_color_space == JCS_GRAYSCALE) {
+    cinfo->out_color_space = JCS_GRAYSCALE;
+    type = PIXMAP_I;
+  } else {
+    cinfo->out_color_space = JCS_RGB;
+  }
+
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = libjpeg_scale_denom(im, cinfo->image_width,
+                                           cinfo->image_height);
+
+  // Intermediate scans are only worth decoding if someone displays them
+  cinfo->buffered_image =
+    im->im_incremental != NULL && jpeg_has_multiple_scans(cinfo);
+
+  jpeg_start_decompress(cinfo);
+
+  if(!cinfo->buffered_image) {
+    myerr->pm = libjpeg_pixmap_create(cinfo, type, im);
+    if(myerr->pm == NULL)
+      return -1;
+    libjpeg_read_pass(cinfo, myerr->pm);
+
+  } else {
+
+    do {
+      if(myerr->pm != NULL) {
+        im->im_incremental(im->im_opaque, myerr->pm);
+        pixmap_release(myerr->pm);
+      }
+
+      myerr->pm = libjpeg_pixmap_create(cinfo, type, im);
+      if(myerr->pm == NULL)
+        return -1;
+
+      jpeg_start_output(cinfo, cinfo->input_scan_number);
+      libjpeg_read_pass(cinfo, myerr->pm);
+      jpeg_finish_output(cinfo);
+    } while(!jpeg_input_complete(cinfo));
+  }
+
+  jpeg_finish_decompress(cinfo);
+  return 0;
+}
+
+
+/**
+ *
+ */
 pixmap_t *
 libjpeg_decode(fa_handle_t *fh, const image_meta_t *im,
                char *errbuf, size_t errlen)
 {
   struct jpeg_decompress_struct cinfo;
   struct my_error_mgr jerr;
-  JSAMPARRAY buffer = NULL;
   fa_seek(fh, 0, SEEK_SET);
   FILE *f = fa_fopen(fh, 1);
-  pixmap_t *pm = NULL;
 
+  jerr.pm = NULL;
   cinfo.err = jpeg_std_error(&jerr.pub);
   jerr.pub.error_exit = my_error_exit;
   if(setjmp(jerr.setjmp_buffer)) {
+    snprintf(errbuf, errlen, "%s", jerr.msg);
     jpeg_destroy_decompress(&cinfo);
     fclose(f);
-    if(pm != NULL)
-      pixmap_release(pm);
+    if(jerr.pm != NULL)
+      pixmap_release(jerr.pm);
     return NULL;
   }
 
-
   jpeg_create_decompress(&cinfo);
   jpeg_stdio_src(&cinfo, f);
 
-  jpeg_read_header(&cinfo, TRUE);
+  if(libjpeg_decompress(&cinfo, im)) {
+    snprintf(errbuf, errlen, "Out of memory");
+    if(jerr.pm != NULL)
+      pixmap_release(jerr.pm);
+    jerr.pm = NULL;
+  }
+  jpeg_destroy_decompress(&cinfo);
+  fclose(f);
+  return jerr.pm;
+}
+
+
+/**
+ *
+ */
+pixmap_t *
+libjpeg_decode_buf(buf_t *buf, const image_meta_t *im,
+                   char *errbuf, size_t errlen)
+{
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+
+  jerr.pm = NULL;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  if(setjmp(jerr.setjmp_buffer)) {
+    snprintf(errbuf, errlen, "%s", jerr.msg);
+    jpeg_destroy_decompress(&cinfo);
+    if(jerr.pm != NULL)
+      pixmap_release(jerr.pm);
+    return NULL;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (void *)buf_data(buf), buf_size(buf));
+
+  if(libjpeg_decompress(&cinfo, im)) {
+    snprintf(errbuf, errlen, "Out of memory");
+    if(jerr.pm != NULL)
+      pixmap_release(jerr.pm);
+    jerr.pm = NULL;
+  }
+  jpeg_destroy_decompress(&cinfo);
+  return jerr.pm;
+#else
+  snprintf(errbuf, errlen, "No memory source in libjpeg");
+  return NULL;
+#endif
+}
+
+
+#ifdef LIBJPEG_BENCHMARK
+
+#include <dirent.h>
+
+#include "arch/arch.h"
+#include "main.h"
+#include "jpeg.h"
+
+#define JPEG_BENCH_MAX_FILES 64
+#define JPEG_BENCH_ROUNDS    3
+
+static buf_t *jpeg_bench_corpus[JPEG_BENCH_MAX_FILES];
+static const char *jpeg_bench_names[JPEG_BENCH_MAX_FILES];
+static int jpeg_bench_files;
 
-  cinfo.buffered_image = 1;
-  cinfo.out_color_space = JCS_RGB;
-  cinfo.output_components = 3;
-  jpeg_start_decompress(&cinfo);
 
-  while(!jpeg_input_complete(&cinfo)) {
+/**
+ * Smooth gradients with some texture so the entropy coder has real
+ * work to do
+ */
+static void
+jpeg_bench_pixel(uint8_t *rgb, int x, int y, int width, int height)
+{
+  const int u = x * 256 / width;
+  const int v = y * 256 / height;
+  const int t = ((x * 7 + y * 3) ^ (x * y >> 6)) & 0x1f;
+  rgb[0] = u ^ t;
+  rgb[1] = (u + v) / 2 + t;
+  rgb[2] = v ^ (t << 2);
+}
+
+
+static void
+jpeg_bench_le16(uint8_t *p, int v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+
+static void
+jpeg_bench_le32(uint8_t *p, int v)
+{
+  jpeg_bench_le16(p, v);
+  jpeg_bench_le16(p + 2, v >> 16);
+}
+
+
+/**
+ * Encode a synthetic photo, optionally with an EXIF thumbnail
+ */
+static buf_t *
+jpeg_bench_encode(int width, int height, int progressive,
+                  int thumb_width, int thumb_height)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  unsigned char *out = NULL;
+  unsigned long outsize = 0;
+  uint8_t *row = malloc(width * 3);
+  buf_t *thumb = NULL;
+
+  if(thumb_width)
+    thumb = jpeg_bench_encode(thumb_width, thumb_height, 0, 0, 0);
 
-    if(pm != NULL) {
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &out, &outsize);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 90, TRUE);
+  if(progressive)
+    jpeg_simple_progression(&cinfo);
+  jpeg_start_compress(&cinfo, TRUE);
 
-      if(im->im_incremental != NULL)
-        im->im_incremental(im->im_opaque, pm);
-      pixmap_release(pm);
+  if(thumb != NULL) {
+    // Exif header, TIFF header, IFD0 with orientation, IFD1 with thumbnail
+    const int len = 6 + 56 + buf_size(thumb);
+    uint8_t *app1 = calloc(1, len);
+    uint8_t *t = app1 + 6;
+    memcpy(app1, "Exif\0\0", 6);
+    memcpy(t, "II", 2);
+    jpeg_bench_le16(t + 2, 0x2a);
+    jpeg_bench_le32(t + 4, 8);
+    jpeg_bench_le16(t + 8, 1);
+    jpeg_bench_le16(t + 10, 0x112);
+    jpeg_bench_le16(t + 12, 3);
+    jpeg_bench_le32(t + 14, 1);
+    jpeg_bench_le32(t + 18, 1);
+    jpeg_bench_le32(t + 22, 26);
+    jpeg_bench_le16(t + 26, 2);
+    jpeg_bench_le16(t + 28, 0x201);
+    jpeg_bench_le16(t + 30, 4);
+    jpeg_bench_le32(t + 32, 1);
+    jpeg_bench_le32(t + 36, 56);
+    jpeg_bench_le16(t + 40, 0x202);
+    jpeg_bench_le16(t + 42, 4);
+    jpeg_bench_le32(t + 44, 1);
+    jpeg_bench_le32(t + 48, buf_size(thumb));
+    jpeg_bench_le32(t + 52, 0);
+    memcpy(t + 56, buf_data(thumb), buf_size(thumb));
+    jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1, len);
+    free(app1);
+    buf_release(thumb);
+  }
+
+  while(cinfo.next_scanline < cinfo.image_height) {
+    for(int x = 0; x < width; x++)
+      jpeg_bench_pixel(row + x * 3, x, cinfo.next_scanline, width, height);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(row);
+  return buf_create_from_malloced(outsize, out);
+}
+
+
+/**
+ * Photos from $LIBJPEG_BENCHMARK_DIR, or a synthetic set
+ */
+static void
+jpeg_bench_load_corpus(void)
+{
+  const char *path = getenv("LIBJPEG_BENCHMARK_DIR");
+  DIR *d = path != NULL ? opendir(path) : NULL;
+
+  if(d != NULL) {
+    struct dirent *de;
+    char fname[1024];
+
+    while((de = readdir(d)) != NULL &&
+          jpeg_bench_files < JPEG_BENCH_MAX_FILES) {
+      const char *ext = strrchr(de->d_name, '.');
+      if(ext == NULL || (strcasecmp(ext, ".jpg") && strcasecmp(ext, ".jpeg")))
+        continue;
+      snprintf(fname, sizeof(fname), "%s/%s", path, de->d_name);
+      FILE *f = fopen(fname, "rb");
+      if(f == NULL)
+        continue;
+      fseek(f, 0, SEEK_END);
+      long size = ftell(f);
+      fseek(f, 0, SEEK_SET);
+      void *data = malloc(size);
+      if(fread(data, 1, size, f) == size) {
+        jpeg_bench_corpus[jpeg_bench_files] =
+          buf_create_from_malloced(size, data);
+        jpeg_bench_names[jpeg_bench_files++] = strdup(de->d_name);
+      } else {
+        free(data);
+      }
+      fclose(f);
     }
+    closedir(d);
+  }
+
+  if(jpeg_bench_files > 0)
+    return;
 
-    pm = pixmap_create(cinfo.output_width,
-                       cinfo.output_height,
-                       PIXMAP_RGB24, 0);
+  static const struct {
+    const char *name;
+    int width, height, progressive, thumb_width, thumb_height;
+  } synth[] = {
+    { "24MP 3:2 baseline, exif 160x107",    6000, 4000, 0, 160, 107 },
+    { "12MP 4:3 progressive, exif 160x120", 4032, 3024, 1, 160, 120 },
+    { "12MP 4:3 baseline, letterboxed exif",4032, 3024, 0, 160, 107 },
+    { "2MP 16:9 baseline, no exif",         1920, 1080, 0, 0, 0 },
+  };
+
+  for(int i = 0; i < ARRAYSIZE(synth); i++) {
+    jpeg_bench_corpus[i] = jpeg_bench_encode(synth[i].width, synth[i].height,
+                                             synth[i].progressive,
+                                             synth[i].thumb_width,
+                                             synth[i].thumb_height);
+    jpeg_bench_names[i] = synth[i].name;
+  }
+  jpeg_bench_files = ARRAYSIZE(synth);
+}
+
+
+/**
+ * What image_decode_coded() does: EXIF thumbnail if large enough,
+ * otherwise a scaled decode, then a rescale to the exact size
+ */
+static pixmap_t *
+jpeg_bench_decode(buf_t *buf, const image_meta_t *im, int use_exif,
+                  int *from_exif)
+{
+  char errbuf[256];
+  pixmap_t *pm = NULL;
 
-    if(buffer == NULL) {
-      buffer = (*cinfo.mem->alloc_sarray)
-        ((j_common_ptr) &cinfo, JPOOL_IMAGE,
-         pm->pm_linesize, 1);
+  *from_exif = 0;
+  if(use_exif) {
+    jpeg_meminfo_t mi;
+    jpeginfo_t ji;
+    mi.data = buf_data(buf);
+    mi.size = buf_size(buf);
+    if(!jpeg_info(&ji, jpeginfo_mem_reader, &mi,
+                  JPEG_INFO_DIMENSIONS | JPEG_INFO_THUMBNAIL,
+                  mi.data, mi.size, errbuf, sizeof(errbuf))) {
+      image_t *thumb = jpeg_thumbnail_for(&ji, im);
+      if(thumb != NULL) {
+        pm = libjpeg_decode_buf(thumb->im_components[0].coded.icc_buf,
+                                im, errbuf, sizeof(errbuf));
+        image_release(thumb);
+        *from_exif = pm != NULL;
+      }
     }
+    jpeg_info_clear(&ji);
+  }
+
+  if(pm == NULL)
+    pm = libjpeg_decode_buf(buf, im, errbuf, sizeof(errbuf));
+  if(pm == NULL) {
+    printf("  Decode failed: %s\n", errbuf);
+    return NULL;
+  }
+  return image_rescale_libav(pm, im);
+}
+
+
+/**
+ * The IDCT scale only covers the request, the output must still come
+ * back at exactly the requested size
+ */
+static void
+jpeg_bench_check_size(void)
+{
+  image_meta_t im = {0};
+  int from_exif;
+
+  im.im_req_width = 1280;
+  im.im_req_height = -1;
+
+  buf_t *buf = jpeg_bench_encode(4000, 3000, 0, 0, 0);
+  pixmap_t *pm = jpeg_bench_decode(buf, &im, 0, &from_exif);
+  buf_release(buf);
+
+  if(pm == NULL || pm->pm_width != 1280 || pm->pm_height != 960) {
+    printf("4000x3000 requested at 1280 wide came back %dx%d\n",
+           pm ? pm->pm_width : 0, pm ? pm->pm_height : 0);
+    exit(1);
+  }
+  pixmap_release(pm);
+}
+
+
+/**
+ * Decode time and output size for a few typical requests, with
+ * full resolution decoding (what we did before) as the baseline.
+ * Build with -DLIBJPEG_BENCHMARK and a libjpeg with a memory source.
+ * The process exits when done
+ */
+static void *
+libjpeg_benchmark(void *aux)
+{
+  static const struct {
+    const char *name;
+    int req_width, req_height, want_thumb;
+  } targets[] = {
+    { "full size",   -1,   -1,  0 },
+    { "1920 wide",   1920, -1,  0 },
+    { "1280 wide",   1280, -1,  0 },
+    { "640 wide",    640,  -1,  0 },
+    { "200x200",     200,  200, 0 },
+    { "thumb",       -1,   -1,  1 },
+  };
+
+  jpeg_bench_check_size();
+  jpeg_bench_load_corpus();
+
+  for(int i = 0; i < jpeg_bench_files; i++) {
+    printf("%s (%d kB)\n", jpeg_bench_names[i],
+           (int)buf_size(jpeg_bench_corpus[i]) / 1024);
+
+    for(int j = 0; j < ARRAYSIZE(targets); j++) {
+      image_meta_t im = {0};
+      image_meta_t full = {0};
+      int64_t t_full = 0, t_scaled = 0, t_exif = 0;
+      int from_exif = 0, w = 0, h = 0, fw = 0, fh = 0;
 
-    jpeg_start_output(&cinfo, cinfo.input_scan_number);
+      im.im_req_width = targets[j].req_width;
+      im.im_req_height = targets[j].req_height;
+      im.im_want_thumb = targets[j].want_thumb;
+      full.im_req_width = -1;
+      full.im_req_height = -1;
 
-    while(cinfo.output_scanline < cinfo.output_height) {
-      jpeg_read_scanlines(&cinfo, buffer, 1);
-      memcpy(pm->pm_data + (cinfo.output_scanline - 1) * pm->pm_linesize,
-             buffer[0], pm->pm_linesize);
+      for(int r = 0; r < JPEG_BENCH_ROUNDS; r++) {
+        int64_t ts = arch_get_ts();
+        pixmap_t *pm = jpeg_bench_decode(jpeg_bench_corpus[i], &full, 0,
+                                         &from_exif);
+        t_full += arch_get_ts() - ts;
+        if(pm != NULL) {
+          fw = pm->pm_width;
+          fh = pm->pm_height;
+          pixmap_release(pm);
+        }
+
+        ts = arch_get_ts();
+        pm = jpeg_bench_decode(jpeg_bench_corpus[i], &im, 0, &from_exif);
+        t_scaled += arch_get_ts() - ts;
+        if(pm != NULL) {
+          w = pm->pm_width;
+          h = pm->pm_height;
+          pixmap_release(pm);
+        }
+
+        ts = arch_get_ts();
+        pm = jpeg_bench_decode(jpeg_bench_corpus[i], &im, 1, &from_exif);
+        t_exif += arch_get_ts() - ts;
+        if(pm != NULL)
+          pixmap_release(pm);
+      }
+
+      int rw, rh;
+      pixmap_compute_rescale_dim(&im, fw, fh, &rw, &rh);
+
+      printf("  %-10s full %5dx%-5d %8.2fms  scaled %5dx%-5d %8.2fms  "
+             "exif %8.2fms%s%s\n",
+             targets[j].name,
+             fw, fh, t_full / 1000.0 / JPEG_BENCH_ROUNDS,
+             w, h, t_scaled / 1000.0 / JPEG_BENCH_ROUNDS,
+             t_exif / 1000.0 / JPEG_BENCH_ROUNDS,
+             from_exif ? " (thumbnail)" : "",
+             w != rw || h != rh ? " WRONG SIZE" : "");
     }
-    jpeg_finish_output(&cinfo);
   }
-  jpeg_finish_decompress(&cinfo);
-  jpeg_destroy_decompress(&cinfo);
-  fclose(f);
-  return pm;
+  exit(0);
 }
+
+
+static void
+libjpeg_benchmark_init(void)
+{
+  hts_thread_create_detached("jpegbench", libjpeg_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, libjpeg_benchmark_init, NULL, 0);
+
+#endif
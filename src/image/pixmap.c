@@ -27,12 +27,12 @@
 #include "main.h"
 #include "arch/atomic.h"
 #include "pixmap.h"
+#include "pixmap_kernels.h"
 #include "misc/minmax.h"
 #include "image/jpeg.h"
 #include "backend/backend.h"
 
-
-#define DIV255(x) (((((x)+255)>>8)+(x))>>8)
+static pixmap_kernels_t pixmap_kernels;
 
 /**
  *
@@ -204,6 +204,20 @@ pixmap_horizontal_gradient(pixmap_t *pm, const int *top, const int *bottom)
 }
 
 
+/**
+ *
+ */
+static void
+rgb24_to_bgr32_c(uint32_t *d, const uint8_t *s, int width)
+{
+  int x;
+  for(x = 0; x < width; x++) {
+    *d++ = 0xff000000 | s[2] << 16 | s[1] << 8 | s[0];
+    s+= 3;
+  }
+}
+
+
 /**
  *
  */
@@ -217,11 +231,7 @@ rgb24_to_bgr32(pixmap_t *src)
   for(y = 0; y < src->pm_height; y++) {
     const uint8_t *s = src->pm_data + y * src->pm_linesize;
     uint32_t *d = (uint32_t *)(dst->pm_data + y * dst->pm_linesize);
-    int x;
-    for(x = 0; x < src->pm_width; x++) {
-      *d++ = 0xff000000 | s[2] << 16 | s[1] << 8 | s[0]; 
-      s+= 3;
-    }
+    pixmap_kernels.pk_rgb24_to_bgr32(d, s, src->pm_width);
   }
   return dst;
 }
@@ -293,11 +303,6 @@ pixmap_rounded_corners(pixmap_t *pm, int r, int which)
 }
 
 
-#define FIXMUL(a, b) (((a) * (b) + 255) >> 8)
-#define FIX3MUL(a, b, c) (((a) * (b) * (c) + 65535) >> 16)
-
-
-
 static void
 composite_GRAY8_on_IA(uint8_t *dst, const uint8_t *src,
 			 int i0, int foo_, int bar_, int a0,
@@ -481,11 +486,11 @@ pixmap_composite(pixmap_t *dst, const pixmap_t *src,
 
   if(src->pm_type == PIXMAP_I && dst->pm_type == PIXMAP_IA && 
      a == 255)
-    fn = composite_GRAY8_on_IA_full_alpha;
+    fn = pixmap_kernels.pk_composite_i_on_ia_full_alpha;
   else if(src->pm_type == PIXMAP_I && dst->pm_type == PIXMAP_IA)
-    fn = composite_GRAY8_on_IA;
+    fn = pixmap_kernels.pk_composite_i_on_ia;
   else if(src->pm_type == PIXMAP_I && dst->pm_type == PIXMAP_BGR32)
-    fn = composite_GRAY8_on_BGR32;
+    fn = pixmap_kernels.pk_composite_i_on_bgr32;
   else
     return;
   
@@ -521,91 +526,84 @@ pixmap_composite(pixmap_t *dst, const pixmap_t *src,
 
 
 
+/**
+ *
+ */
+static void
+box_sum_c(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+          const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  int i;
+  unsigned int v;
+  for(i = 0; i < n; i++) {
+    v = b1[i] + a2[i] - b2[i] - a1[i];
+    d[i] = (v * m) >> 16;
+  }
+}
+
+
+/**
+ *
+ */
 static void
-box_blur_line_2chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
-		    int width, int boxw, int m)
+box_blur_line(uint8_t *d, const uint32_t *a, const uint32_t *b,
+              int width, int boxw, int m, int z)
 {
-  int x;
+  int x, c;
   unsigned int v;
   for(x = 0; x < boxw; x++) {
-    const int x1 = 2 * MIN(x + boxw, width - 1);
+    const int x1 = z * MIN(x + boxw, width - 1);
     const int x2 = 0;
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
+    for(c = 0; c < z; c++) {
+      v = b[x1 + c] + a[x2 + c] - b[x2 + c] - a[x1 + c];
+      *d++ = (v * m) >> 16;
+    }
   }
 
-  for(; x < width - boxw; x++) {
-    const int x1 = 2 * (x + boxw);
-    const int x2 = 2 * (x - boxw);
+  if(x < width - boxw) {
+    const int x1 = z * (x + boxw);
+    const int x2 = z * (x - boxw);
+    const int n = z * (width - boxw - x);
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
+    pixmap_kernels.pk_box_sum(d, a + x1, a + x2, b + x1, b + x2, n, m);
+    d += n;
+    x = width - boxw;
   }
 
   for(; x < width; x++) {
-    const int x1 = 2 * (width - 1);
-    const int x2 = 2 * (x - boxw);
+    const int x1 = z * (width - 1);
+    const int x2 = z * (x - boxw);
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
+    for(c = 0; c < z; c++) {
+      v = b[x1 + c] + a[x2 + c] - b[x2 + c] - a[x1 + c];
+      *d++ = (v * m) >> 16;
+    }
   }
 }
 
 
-
+/**
+ *
+ */
 static void
-box_blur_line_4chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
-		    int width, int boxw, int m)
+integral_row_c(uint32_t *t, const uint32_t *prev, const uint8_t *s,
+               int n, int z)
 {
-  int x;
-  unsigned int v;
-  for(x = 0; x < boxw; x++) {
-    const int x1 = 4 * MIN(x + boxw, width - 1);
-    const int x2 = 0;
-
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 2] + a[x2 + 2] - b[x2 + 2] - a[x1 + 2];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 3] + a[x2 + 3] - b[x2 + 3] - a[x1 + 3];
-    *d++ = (v * m) >> 16;
-  }
-
-  for(; x < width - boxw; x++) {
-    const int x1 = 4 * (x + boxw);
-    const int x2 = 4 * (x - boxw);
+  int i;
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 2] + a[x2 + 2] - b[x2 + 2] - a[x1 + 2];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 3] + a[x2 + 3] - b[x2 + 3] - a[x1 + 3];
-    *d++ = (v * m) >> 16;
-  }
+  if(prev == NULL) {
+    for(i = 0; i < z; i++)
+      t[i] = s[i];
 
-  for(; x < width; x++) {
-    const int x1 = 4 * (width - 1);
-    const int x2 = 4 * (x - boxw);
+    for(; i < n; i++)
+      t[i] = s[i] + t[i - z];
+  } else {
+    for(i = 0; i < z; i++)
+      t[i] = s[i] + prev[i];
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 1] + a[x2 + 1] - b[x2 + 1] - a[x1 + 1];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 2] + a[x2 + 2] - b[x2 + 2] - a[x1 + 2];
-    *d++ = (v * m) >> 16;
-    v = b[x1 + 3] + a[x2 + 3] - b[x2 + 3] - a[x1 + 3];
-    *d++ = (v * m) >> 16;
+    for(; i < n; i++)
+      t[i] = s[i] + t[i - z] + prev[i] - prev[i - z];
   }
 }
 
@@ -616,9 +614,8 @@ box_blur_line_4chan(uint8_t *d, const uint32_t *a, const uint32_t *b,
 void
 pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
 {
-  unsigned int *tmp, *t;
-  int x, y, i;
-  const uint8_t *s;
+  unsigned int *tmp;
+  int y;
   const int w = pm->pm_width;
   const int h = pm->pm_height;
   const int ls = pm->pm_linesize;
@@ -626,65 +623,25 @@ pixmap_box_blur(pixmap_t *pm, int boxw, int boxh)
 
   boxw = MIN(boxw, w);
 
-  void (*fn)(uint8_t *dst, const uint32_t *a, const uint32_t *b, int width,
-	     int boxw, int m);
-
-  switch(z) {
-  case 2:
-    fn = box_blur_line_2chan;
-    break;
-  case 4:
-    fn = box_blur_line_4chan;
-    break;
-
-
-  default:
+  if(z != 2 && z != 4)
     return;
-  }
-
-
 
   tmp = mymalloc(ls * h * sizeof(unsigned int));
   if(tmp == NULL)
     return;
 
-  s = pm->pm_data;
-  t = tmp;
-
-  for(i = 0; i < z; i++)
-    *t++ = *s++;
-
-  for(x = 0; x < (w-1)*z; x++) {
-    t[0] = *s++ + t[-z];
-    t++;
-  }
-
-  for(y = 1; y < h; y++) {
-
-    s = pm->pm_data + y * ls;
-    t = tmp + y * ls;
-
-    for(i = 0; i < z; i++) {
-      t[0] = *s++ + t[-ls];
-      t++;
-    }
-
-    for(x = 0; x < (w-1)*z; x++) {
-      t[0] = *s++ + t[-z] + t[-ls] - t[-ls - z];
-      t++;
-    }
-  }
+  for(y = 0; y < h; y++)
+    pixmap_kernels.pk_integral_row(tmp + y * ls, y ? tmp + (y - 1) * ls : NULL,
+                                   pm->pm_data + y * ls, w * z, z);
 
   int m = 65536 / ((boxw * 2 + 1) * (boxh * 2 + 1));
 
-
-
   for(y = 0; y < h; y++) {
     uint8_t *d = pm->pm_data + y * ls;
 
     const unsigned int *a = tmp + ls * MAX(0, y - boxh);
     const unsigned int *b = tmp + ls * MIN(h - 1, y + boxh);
-    fn(d, a, b, w, boxw, m);
+    box_blur_line(d, a, b, w, boxw, m, z);
   }
 
   free(tmp);
@@ -752,14 +709,14 @@ drop_shadow_rgba(uint8_t *D, const uint32_t *a, const uint32_t *b,
     d++;
   }
 
-  for(; x < width - boxw; x++) {
+  if(x < width - boxw) {
     const int x1 = (x + boxw);
     const int x2 = (x - boxw);
+    const int n = width - boxw - x;
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    s = (v * m) >> 16;
-    *d = mix_bgr32(*d, s << 24);
-    d++;
+    pixmap_kernels.pk_shadow_bgr32(d, a + x1, a + x2, b + x1, b + x2, n, m);
+    d += n;
+    x = width - boxw;
   }
 
   for(; x < width; x++) {
@@ -803,6 +760,41 @@ mix_ia(uint8_t *src, uint8_t *dst, int DR, int DA)
   }
 }
 
+/**
+ *
+ */
+static void
+shadow_bgr32_c(uint32_t *d, const uint32_t *a1, const uint32_t *a2,
+               const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  int i, s;
+  unsigned int v;
+  for(i = 0; i < n; i++) {
+    v = b1[i] + a2[i] - b2[i] - a1[i];
+    s = (v * m) >> 16;
+    d[i] = mix_bgr32(d[i], s << 24);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+shadow_ia_c(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+            const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  int i, s;
+  unsigned int v;
+  for(i = 0; i < n; i++) {
+    v = b1[i] + a2[i] - b2[i] - a1[i];
+    s = (v * m) >> 16;
+    mix_ia(d, d, 0, s);
+    d += 2;
+  }
+}
+
+
 /**
  *
  */
@@ -815,7 +807,7 @@ drop_shadow_ia(uint8_t *d, const uint32_t *a, const uint32_t *b,
   unsigned int v;
   int s;
   for(x = 0; x < boxw; x++) {
-    const int x1 = 2 * MIN(x + boxw, width - 1);
+    const int x1 = MIN(x + boxw, width - 1);
     const int x2 = 0;
 
     v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
@@ -825,19 +817,19 @@ drop_shadow_ia(uint8_t *d, const uint32_t *a, const uint32_t *b,
     d+=2;
   }
 
-  for(; x < width - boxw; x++) {
-    const int x1 = 2 * (x + boxw);
-    const int x2 = 2 * (x - boxw);
+  if(x < width - boxw) {
+    const int x1 = x + boxw;
+    const int x2 = x - boxw;
+    const int n = width - boxw - x;
 
-    v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
-    s = (v * m) >> 16;
-    mix_ia(d, d, 0, s);
-    d+=2;
+    pixmap_kernels.pk_shadow_ia(d, a + x1, a + x2, b + x1, b + x2, n, m);
+    d += 2 * n;
+    x = width - boxw;
   }
 
   for(; x < width; x++) {
-    const int x1 = 2 * (width - 1);
-    const int x2 = 2 * (x - boxw);
+    const int x1 = width - 1;
+    const int x2 = x - boxw;
 
     v = b[x1 + 0] + a[x2 + 0] - b[x2 + 0] - a[x1 + 0];
     s = (v * m) >> 16;
@@ -971,6 +963,37 @@ pixmap_intensity_analysis(pixmap_t *pm)
 #endif
 
 
+/**
+ *
+ */
+static void
+intensity_rgb24_c(int *bin, const uint8_t *src, int width)
+{
+  for(int x = 0; x < width; x++) {
+    unsigned int v = (src[0] + src[1] + src[2]);
+    bin[v / 3]++;
+    src += 3;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+intensity_bgr32_c(int *bin, const uint32_t *src, int width)
+{
+  for(int x = 0; x < width; x++) {
+    unsigned int u32 = *src++;
+    unsigned int r = u32 & 0xff;
+    unsigned int g = (u32 >> 8) & 0xff;
+    unsigned int b = (u32 >> 16) & 0xff;
+    unsigned int v = r + g + b;
+    bin[v / 3]++;
+  }
+}
+
+
 /**
  *
  */
@@ -978,37 +1001,25 @@ void
 pixmap_intensity_analysis(pixmap_t *pm)
 {
   int bin[256] = {0};
+  const int w = pm->pm_width  - pm->pm_margin * 2;
+  const int h = pm->pm_height - pm->pm_margin * 2;
 
   switch(pm->pm_type) {
   case PIXMAP_RGB24:
-    for(int y = 0; y < pm->pm_height; y++) {
-      const uint8_t *src = pm_pixel(pm, 0, y);
-      for(int x = 0; x < pm->pm_width; x++) {
-        unsigned int v = (src[0] + src[1] + src[2]);
-        bin[v / 3]++;
-      }
-    }
+    for(int y = 0; y < h; y++)
+      pixmap_kernels.pk_intensity_rgb24(bin, pm_pixel(pm, 0, y), w);
     break;
 
   case PIXMAP_BGR32:
-    for(int y = 0; y < pm->pm_height; y++) {
-      const uint32_t *src = pm_pixel(pm, 0, y);
-      for(int x = 0; x < pm->pm_width; x++) {
-        unsigned int u32 = *src++;
-        unsigned int r = u32 & 0xff;
-        unsigned int g = (u32 >> 8) & 0xff;
-        unsigned int b = (u32 >> 16) & 0xff;
-        unsigned int v = r + g + b;
-        bin[v / 3]++;
-      }
-    }
+    for(int y = 0; y < h; y++)
+      pixmap_kernels.pk_intensity_bgr32(bin, pm_pixel(pm, 0, y), w);
     break;
 
   default:
     printf("Cant do intensity analysis for pixfmt %d\n", pm->pm_type);
   }
 
-  int pixels = pm->pm_width * pm->pm_height;
+  int pixels = w * h;
   int limit = pixels * 0.95;
   int i;
   for(i = 255; i >= 0; i--) {
@@ -1024,33 +1035,535 @@ pixmap_intensity_analysis(pixmap_t *pm)
 
 
 
-// gcc -O3 src/misc/pixmap.c -o /tmp/pixmap -Isrc -DLOCAL_MAIN
+/**
+ *
+ */
+const pixmap_kernels_t pixmap_kernels_c = {
+  .pk_name                         = "c",
+  .pk_composite_i_on_bgr32         = composite_GRAY8_on_BGR32,
+  .pk_composite_i_on_ia            = composite_GRAY8_on_IA,
+  .pk_composite_i_on_ia_full_alpha = composite_GRAY8_on_IA_full_alpha,
+  .pk_box_sum                      = box_sum_c,
+  .pk_integral_row                 = integral_row_c,
+  .pk_shadow_bgr32                 = shadow_bgr32_c,
+  .pk_shadow_ia                    = shadow_ia_c,
+  .pk_rgb24_to_bgr32               = rgb24_to_bgr32_c,
+  .pk_intensity_rgb24              = intensity_rgb24_c,
+  .pk_intensity_bgr32              = intensity_bgr32_c,
+};
 
-#ifdef LOCAL_MAIN
 
-static int64_t
-get_ts(void)
+/**
+ *
+ */
+static void
+pixmap_kernels_merge(pixmap_kernels_t *dst, const pixmap_kernels_t *src)
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+#define PK_MERGE(f) if(src->f != NULL) dst->f = src->f
+  dst->pk_name = src->pk_name;
+  PK_MERGE(pk_composite_i_on_bgr32);
+  PK_MERGE(pk_composite_i_on_ia);
+  PK_MERGE(pk_composite_i_on_ia_full_alpha);
+  PK_MERGE(pk_box_sum);
+  PK_MERGE(pk_integral_row);
+  PK_MERGE(pk_shadow_bgr32);
+  PK_MERGE(pk_shadow_ia);
+  PK_MERGE(pk_rgb24_to_bgr32);
+  PK_MERGE(pk_intensity_rgb24);
+  PK_MERGE(pk_intensity_bgr32);
+#undef PK_MERGE
 }
 
-int
-main(int argc, char **argv)
+
+/**
+ * Pick the best kernel available for each operation
+ */
+INITIALIZER(pixmap_kernels_init)
 {
-  pixmap_t *dst = pixmap_create(2048, 2048, PIXMAP_BGR32);
-  pixmap_t *src = pixmap_create(2048, 2048, PIXMAP_GRAY8);
+  const pixmap_kernels_t *v[4];
+  const int n = pixmap_kernels_simd(v, 4);
 
-  memset(src->pm_pixels, 0xff, src->pm_linesize * src->pm_height);
+  pixmap_kernels = pixmap_kernels_c;
+  for(int i = 0; i < n; i++)
+    pixmap_kernels_merge(&pixmap_kernels, v[i]);
+}
 
-  int64_t a = get_ts();
-  pixmap_composite(dst, src, 0, 0, 0xffffffff);
-  printf("Compositing in %dµs\n",(int)( get_ts() - a));
-  printf("dst pixel(0,0) = 0x%x\n", dst->pm_pixels[0]);
-  return 0;
+
+
+#ifdef PIXMAP_BENCHMARK
+
+/**
+ * Checks that each SIMD kernel set is bit exact against the C set, both
+ * per kernel over odd widths and through the public pixmap operations,
+ * then times the operations with each set.
+ *
+ * Build with -DPIXMAP_BENCHMARK.
+ * The process exits when done, with status 1 if anything differed
+ */
+
+#include "arch/arch.h"
+
+#define PMB_ROUNDS 20
+
+static uint32_t pmb_seed = 0x12345678;
+static int pmb_errors;
+
+
+static uint32_t
+pmb_rand(void)
+{
+  pmb_seed ^= pmb_seed << 13;
+  pmb_seed ^= pmb_seed >> 17;
+  pmb_seed ^= pmb_seed << 5;
+  return pmb_seed;
+}
+
+
+/**
+ * Mostly fully transparent or opaque with some noise, like glyphs and
+ * alpha masks
+ */
+static void
+pmb_fill(uint8_t *p, int len)
+{
+  for(int i = 0; i < len; i++) {
+    const uint32_t r = pmb_rand();
+    switch(r & 3) {
+    case 0:
+      p[i] = 0;
+      break;
+    case 1:
+      p[i] = 255;
+      break;
+    default:
+      p[i] = r >> 8;
+      break;
+    }
+  }
+}
+
+
+/**
+ * Same as pixmap_kernels_init() but only with the first 'n' sets
+ */
+static void
+pmb_use(const pixmap_kernels_t **sets, int n)
+{
+  pixmap_kernels = pixmap_kernels_c;
+  for(int i = 0; i < n; i++)
+    pixmap_kernels_merge(&pixmap_kernels, sets[i]);
+}
+
+
+static void
+pmb_check(const pixmap_kernels_t *pk, const char *what, int width,
+          const void *a, const void *b, size_t len)
+{
+  if(!memcmp(a, b, len))
+    return;
+  printf("  %s: %s differs at width %d\n", pk->pk_name, what, width);
+  pmb_errors++;
+}
+
+
+/**
+ * Single channel summed area table of random content
+ */
+static uint32_t *
+pmb_table(int w, int h)
+{
+  uint8_t *s = malloc(w);
+  uint32_t *t = malloc(w * h * sizeof(uint32_t));
+  for(int y = 0; y < h; y++) {
+    pmb_fill(s, w);
+    integral_row_c(t + y * w, y ? t + (y - 1) * w : NULL, s, w, 1);
+  }
+  free(s);
+  return t;
+}
+
+
+/**
+ *
+ */
+static void
+pmb_test_kernels(const pixmap_kernels_t *pk)
+{
+  const int maxw = 2000;
+  uint8_t *s8   = malloc(maxw * 4 + 64);
+  uint8_t *ref  = malloc(maxw * 4 + 64);
+  uint8_t *out  = malloc(maxw * 4 + 64);
+  uint32_t *prev = malloc(maxw * 4 * sizeof(uint32_t));
+  uint32_t *tref = malloc(maxw * 4 * sizeof(uint32_t));
+  uint32_t *tout = malloc(maxw * 4 * sizeof(uint32_t));
+  const int tw = maxw + 64, th = 16;
+  uint32_t *tab = pmb_table(tw, th);
+
+  for(int iter = 0; iter < 400; iter++) {
+    const int w = iter < 300 ? iter % 68 : 100 + pmb_rand() % (maxw - 100);
+    const int off = pmb_rand() & 3;
+    const int c = pmb_rand() & 0xff;
+    const int a = pmb_rand() & 1 ? 255 : pmb_rand() & 0xff;
+
+    pmb_fill(s8, w + off);
+
+    if(pk->pk_composite_i_on_bgr32 != NULL) {
+      pmb_fill(ref, (w + off) * 4);
+      memcpy(out, ref, (w + off) * 4);
+      pixmap_kernels_c.pk_composite_i_on_bgr32(ref + off * 4, s8 + off,
+                                               c, c ^ 0x5a, 255 - c, a, w);
+      pk->pk_composite_i_on_bgr32(out + off * 4, s8 + off,
+                                  c, c ^ 0x5a, 255 - c, a, w);
+      pmb_check(pk, "composite_i_on_bgr32", w, ref, out, (w + off) * 4);
+    }
+
+    if(pk->pk_composite_i_on_ia != NULL) {
+      pmb_fill(ref, (w + off) * 2);
+      memcpy(out, ref, (w + off) * 2);
+      pixmap_kernels_c.pk_composite_i_on_ia(ref + off * 2, s8 + off,
+                                            c, 0, 0, a, w);
+      pk->pk_composite_i_on_ia(out + off * 2, s8 + off, c, 0, 0, a, w);
+      pmb_check(pk, "composite_i_on_ia", w, ref, out, (w + off) * 2);
+    }
+
+    if(pk->pk_composite_i_on_ia_full_alpha != NULL) {
+      pmb_fill(ref, (w + off) * 2);
+      memcpy(out, ref, (w + off) * 2);
+      pixmap_kernels_c.pk_composite_i_on_ia_full_alpha(ref + off * 2,
+                                                       s8 + off,
+                                                       c, 0, 0, 255, w);
+      pk->pk_composite_i_on_ia_full_alpha(out + off * 2, s8 + off,
+                                          c, 0, 0, 255, w);
+      pmb_check(pk, "composite_i_on_ia_full_alpha", w,
+                ref, out, (w + off) * 2);
+    }
+
+    if(pk->pk_rgb24_to_bgr32 != NULL) {
+      pmb_fill(s8, (w + off) * 3);
+      memset(ref, 0xcc, (w + off) * 4);
+      memset(out, 0xcc, (w + off) * 4);
+      pixmap_kernels_c.pk_rgb24_to_bgr32((uint32_t *)ref, s8 + off * 3, w);
+      pk->pk_rgb24_to_bgr32((uint32_t *)out, s8 + off * 3, w);
+      pmb_check(pk, "rgb24_to_bgr32", w, ref, out, (w + off) * 4);
+    }
+
+    if(pk->pk_intensity_rgb24 != NULL) {
+      int b0[256] = {0}, b1[256] = {0};
+      pmb_fill(s8, (w + off) * 3);
+      pixmap_kernels_c.pk_intensity_rgb24(b0, s8 + off * 3, w);
+      pk->pk_intensity_rgb24(b1, s8 + off * 3, w);
+      pmb_check(pk, "intensity_rgb24", w, b0, b1, sizeof(b0));
+    }
+
+    if(pk->pk_intensity_bgr32 != NULL) {
+      int b0[256] = {0}, b1[256] = {0};
+      pmb_fill(s8, w * 4);
+      pixmap_kernels_c.pk_intensity_bgr32(b0, (const uint32_t *)s8, w);
+      pk->pk_intensity_bgr32(b1, (const uint32_t *)s8, w);
+      pmb_check(pk, "intensity_bgr32", w, b0, b1, sizeof(b0));
+    }
+
+    if(pk->pk_integral_row != NULL) {
+      for(int z = 2; z <= 4; z += 2) {
+        const int n = w * z;
+        pmb_fill(s8, n);
+        for(int i = 0; i < n; i++)
+          prev[i] = pmb_rand();
+        for(int p = 0; p < 2; p++) {
+          pixmap_kernels_c.pk_integral_row(tref, p ? prev : NULL, s8, n, z);
+          pk->pk_integral_row(tout, p ? prev : NULL, s8, n, z);
+          pmb_check(pk, "integral_row", w, tref, tout, n * sizeof(uint32_t));
+        }
+      }
+    }
+
+    // Box over rows (y0, y1] and columns (x, x + bw]
+    const int bw = 1 + pmb_rand() % 31;
+    const int y0 = pmb_rand() % (th - 1);
+    const int y1 = y0 + 1 + pmb_rand() % (th - 1 - y0);
+    const int m = 65536 / (bw * (y1 - y0));
+    const uint32_t *a1 = tab + y0 * tw + bw + off;
+    const uint32_t *a2 = tab + y0 * tw + off;
+    const uint32_t *b1 = tab + y1 * tw + bw + off;
+    const uint32_t *b2 = tab + y1 * tw + off;
+
+    if(pk->pk_box_sum != NULL) {
+      memset(ref, 0xcc, w + 16);
+      memset(out, 0xcc, w + 16);
+      pixmap_kernels_c.pk_box_sum(ref, a1, a2, b1, b2, w, m);
+      pk->pk_box_sum(out, a1, a2, b1, b2, w, m);
+      pmb_check(pk, "box_sum", w, ref, out, w + 16);
+    }
+
+    if(pk->pk_shadow_bgr32 != NULL) {
+      pmb_fill(ref, w * 4);
+      memcpy(out, ref, w * 4);
+      pixmap_kernels_c.pk_shadow_bgr32((uint32_t *)ref, a1, a2, b1, b2, w, m);
+      pk->pk_shadow_bgr32((uint32_t *)out, a1, a2, b1, b2, w, m);
+      pmb_check(pk, "shadow_bgr32", w, ref, out, w * 4);
+    }
+
+    if(pk->pk_shadow_ia != NULL) {
+      pmb_fill(ref, w * 2);
+      memcpy(out, ref, w * 2);
+      pixmap_kernels_c.pk_shadow_ia(ref, a1, a2, b1, b2, w, m);
+      pk->pk_shadow_ia(out, a1, a2, b1, b2, w, m);
+      pmb_check(pk, "shadow_ia", w, ref, out, w * 2);
+    }
+  }
+
+  free(tab);
+  free(tout);
+  free(tref);
+  free(prev);
+  free(out);
+  free(ref);
+  free(s8);
 }
 
+
+/**
+ *
+ */
+static pixmap_t *
+pmb_pixmap(int w, int h, pixmap_type_t type, int margin)
+{
+  pixmap_t *pm = pixmap_create(w, h, type, margin);
+  pmb_fill(pm->pm_data, pm->pm_linesize * pm->pm_height);
+  return pm;
+}
+
+
+/**
+ * Smooth gradients with a little noise, like decoded photos
+ */
+static void
+pmb_photo(pixmap_t *pm)
+{
+  for(int y = 0; y < pm->pm_height; y++) {
+    uint8_t *p = pm->pm_data + y * pm->pm_linesize;
+    for(int x = 0; x < pm->pm_linesize; x++)
+      p[x] = x / 16 + y / 4 + (pmb_rand() & 3);
+  }
+}
+
+
+static pixmap_t *
+pmb_copy(const pixmap_t *src)
+{
+  pixmap_t *pm = pixmap_create(src->pm_width - src->pm_margin * 2,
+                               src->pm_height - src->pm_margin * 2,
+                               src->pm_type, src->pm_margin);
+  memcpy(pm->pm_data, src->pm_data, src->pm_linesize * src->pm_height);
+  return pm;
+}
+
+
+typedef enum {
+  PMB_COMPOSITE_IA,
+  PMB_COMPOSITE_IA_OPAQUE,
+  PMB_COMPOSITE_BGR32,
+  PMB_BLUR_IA,
+  PMB_BLUR_BGR32,
+  PMB_SHADOW_IA,
+  PMB_SHADOW_BGR32,
+  PMB_CORNERS_RGB24,
+  PMB_CORNERS_BGR32,
+  PMB_INTENSITY_RGB24,
+  PMB_INTENSITY_BGR32,
+  PMB_num,
+} pmb_op_t;
+
+static const char *pmb_op_names[PMB_num] = {
+  [PMB_COMPOSITE_IA]        = "composite I on IA",
+  [PMB_COMPOSITE_IA_OPAQUE] = "composite I on IA opaque",
+  [PMB_COMPOSITE_BGR32]     = "composite I on BGR32",
+  [PMB_BLUR_IA]             = "box blur IA",
+  [PMB_BLUR_BGR32]          = "box blur BGR32",
+  [PMB_SHADOW_IA]           = "drop shadow IA",
+  [PMB_SHADOW_BGR32]        = "drop shadow BGR32",
+  [PMB_CORNERS_RGB24]       = "rounded corners RGB24",
+  [PMB_CORNERS_BGR32]       = "rounded corners BGR32",
+  [PMB_INTENSITY_RGB24]     = "intensity RGB24",
+  [PMB_INTENSITY_BGR32]     = "intensity BGR32",
+};
+
+
+/**
+ * Run one operation on a copy of 'src'. Returns the result and the time
+ * it took in 'tsp'
+ */
+static pixmap_t *
+pmb_run(pmb_op_t op, const pixmap_t *src, const pixmap_t *glyph,
+        int64_t *tsp)
+{
+  pixmap_t *pm = pmb_copy(src);
+  int64_t ts = arch_get_ts();
+
+  switch(op) {
+  case PMB_COMPOSITE_IA:
+    pixmap_composite(pm, glyph, 0, 0, 0x80c0c0c0);
+    break;
+  case PMB_COMPOSITE_IA_OPAQUE:
+    pixmap_composite(pm, glyph, 0, 0, 0xffc0c0c0);
+    break;
+  case PMB_COMPOSITE_BGR32:
+    pixmap_composite(pm, glyph, 0, 0, 0xc0204080);
+    break;
+  case PMB_BLUR_IA:
+  case PMB_BLUR_BGR32:
+    pixmap_box_blur(pm, 5, 5);
+    break;
+  case PMB_SHADOW_IA:
+  case PMB_SHADOW_BGR32:
+    pixmap_drop_shadow(pm, 6, 6);
+    break;
+  case PMB_CORNERS_RGB24:
+  case PMB_CORNERS_BGR32:
+    pm = pixmap_rounded_corners(pm, 16, 0xf);
+    break;
+  case PMB_INTENSITY_RGB24:
+  case PMB_INTENSITY_BGR32:
+    pixmap_intensity_analysis(pm);
+    break;
+  default:
+    break;
+  }
+  *tsp = arch_get_ts() - ts;
+  return pm;
+}
+
+
+static pixmap_type_t
+pmb_op_type(pmb_op_t op)
+{
+  switch(op) {
+  case PMB_COMPOSITE_IA:
+  case PMB_COMPOSITE_IA_OPAQUE:
+  case PMB_BLUR_IA:
+  case PMB_SHADOW_IA:
+    return PIXMAP_IA;
+  case PMB_CORNERS_RGB24:
+  case PMB_INTENSITY_RGB24:
+    return PIXMAP_RGB24;
+  default:
+    return PIXMAP_BGR32;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+pmb_same(const pixmap_t *a, const pixmap_t *b)
+{
+  return a->pm_type == b->pm_type &&
+    a->pm_linesize == b->pm_linesize &&
+    a->pm_height == b->pm_height &&
+    a->pm_intensity == b->pm_intensity &&
+    !memcmp(a->pm_data, b->pm_data, a->pm_linesize * a->pm_height);
+}
+
+
+/**
+ *
+ */
+static void *
+pixmap_benchmark(void *aux)
+{
+  static const struct {
+    int width, height, margin;
+  } sizes[] = {
+    { 1, 1, 0 },
+    { 37, 19, 0 },
+    { 61, 33, 3 },
+    { 333, 47, 8 },
+    { 1920, 1080, 0 },
+  };
+
+  const pixmap_kernels_t *sets[5];
+  int nsets = pixmap_kernels_simd(sets + 1, 4) + 1;
+  sets[0] = &pixmap_kernels_c;
+
+  printf("Kernel sets:");
+  for(int i = 0; i < nsets; i++)
+    printf(" %s", sets[i]->pk_name);
+  printf("\n");
+
+  for(int i = 1; i < nsets; i++)
+    pmb_test_kernels(sets[i]);
+
+  for(int s = 0; s < ARRAYSIZE(sizes); s++) {
+    const int w = sizes[s].width;
+    const int h = sizes[s].height;
+    const int rounds = w * h > 100000 ? PMB_ROUNDS : 1;
+
+    printf("%dx%d margin %d\n", w, h, sizes[s].margin);
+
+    pixmap_t *glyph = pmb_pixmap(w + sizes[s].margin * 2,
+                                 h + sizes[s].margin * 2, PIXMAP_I, 0);
+
+    for(pmb_op_t op = 0; op < PMB_num; op++) {
+      pixmap_t *src = pmb_pixmap(w, h, pmb_op_type(op), sizes[s].margin);
+      pixmap_t *ref = NULL;
+
+      if(op >= PMB_CORNERS_RGB24)
+        pmb_photo(src);
+
+      if(op == PMB_COMPOSITE_IA_OPAQUE) {
+        // Let everything end up on top of partly transparent pixels
+        for(int i = 1; i < src->pm_linesize * src->pm_height; i += 2)
+          src->pm_data[i] = MIN(src->pm_data[i], 254);
+      }
+
+      printf("  %-26s", pmb_op_names[op]);
+
+      for(int i = 0; i < nsets; i++) {
+        int64_t total = 0, ts;
+        pmb_use(sets + 1, i);
+
+        for(int r = 0; r < rounds; r++) {
+          pixmap_t *pm = pmb_run(op, src, glyph, &ts);
+          total += ts;
+
+          if(r)
+            pixmap_release(pm);
+          else if(ref == NULL)
+            ref = pm;
+          else {
+            if(!pmb_same(ref, pm)) {
+              printf(" [%s MISMATCH]", sets[i]->pk_name);
+              pmb_errors++;
+            }
+            pixmap_release(pm);
+          }
+        }
+        printf(" %6s %9.1fµs", sets[i]->pk_name, (double)total / rounds);
+      }
+      printf("\n");
+      pixmap_release(ref);
+      pixmap_release(src);
+    }
+    pixmap_release(glyph);
+  }
+
+  pmb_use(sets + 1, nsets - 1);
+
+  printf("%s\n", pmb_errors ? "FAILED" : "All kernel sets are bit exact");
+  exit(pmb_errors ? 1 : 0);
+}
+
+
+static void
+pixmap_benchmark_init(void)
+{
+  hts_thread_create_detached("pixmapbench", pixmap_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, pixmap_benchmark_init, NULL, 0);
+
 #endif
 
 
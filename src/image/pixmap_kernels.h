@@ -0,0 +1,89 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+#include <stdint.h>
+
+#define DIV255(x) (((((x)+255)>>8)+(x))>>8)
+#define FIXMUL(a, b) (((a) * (b) + 255) >> 8)
+#define FIX3MUL(a, b, c) (((a) * (b) * (c) + 65535) >> 16)
+
+/**
+ * Inner loops of the pixmap operations
+ *
+ * The plain C set in pixmap.c is the reference. The SIMD sets must
+ * produce bit exact results, entries they leave NULL use the C version.
+ */
+typedef struct pixmap_kernels {
+  const char *pk_name;
+
+  void (*pk_composite_i_on_bgr32)(uint8_t *dst, const uint8_t *src,
+                                  int r, int g, int b, int a, int width);
+
+  void (*pk_composite_i_on_ia)(uint8_t *dst, const uint8_t *src,
+                               int i, int unused1, int unused2, int a,
+                               int width);
+
+  void (*pk_composite_i_on_ia_full_alpha)(uint8_t *dst, const uint8_t *src,
+                                          int i, int unused1, int unused2,
+                                          int unused3, int width);
+
+  /**
+   * Box filter from a summed area table.
+   * d[i] = ((b1[i] + a2[i] - b2[i] - a1[i]) * m) >> 16
+   */
+  void (*pk_box_sum)(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+                     const uint32_t *b1, const uint32_t *b2, int n, int m);
+
+  /**
+   * One row of a summed area table with 'z' interleaved channels.
+   * 'prev' is the row above or NULL for the first row
+   */
+  void (*pk_integral_row)(uint32_t *t, const uint32_t *prev,
+                          const uint8_t *s, int n, int z);
+
+  /**
+   * Put pixels on top of a black shadow whose alpha is box filtered
+   * from a summed area table as in pk_box_sum
+   */
+  void (*pk_shadow_bgr32)(uint32_t *d, const uint32_t *a1,
+                          const uint32_t *a2, const uint32_t *b1,
+                          const uint32_t *b2, int n, int m);
+
+  void (*pk_shadow_ia)(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+                       const uint32_t *b1, const uint32_t *b2, int n, int m);
+
+  void (*pk_rgb24_to_bgr32)(uint32_t *d, const uint8_t *s, int width);
+
+  /**
+   * Histogram of (r + g + b) / 3
+   */
+  void (*pk_intensity_rgb24)(int *bin, const uint8_t *s, int width);
+
+  void (*pk_intensity_bgr32)(int *bin, const uint32_t *s, int width);
+
+} pixmap_kernels_t;
+
+
+extern const pixmap_kernels_t pixmap_kernels_c;
+
+/**
+ * SIMD sets usable on this CPU, best last. Returns how many
+ */
+int pixmap_kernels_simd(const pixmap_kernels_t **v, int max);
@@ -0,0 +1,1232 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "pixmap_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PIXMAP_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define PIXMAP_SIMD_X86 0
+#endif
+
+/*
+ * All divisions are of integers below 2^24 so they are done in single
+ * precision float. The truncated quotient is corrected by one step in
+ * either direction using exact float products, which makes the result
+ * identical to integer division.
+ *
+ * Partial blocks at the end of a row are copied to a zero padded buffer
+ * and run through the same code as full blocks.
+ */
+
+#if PIXMAP_SIMD_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+
+/**
+ *
+ */
+static inline SSE2 __m128i
+div255_sse2(__m128i x)
+{
+  const __m128i c255 = _mm_set1_epi16(255);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(x, c255),
+                                                     8), x), 8);
+}
+
+
+/**
+ *
+ */
+static inline SSE2 __m128i
+div_exact_sse2(__m128 n, __m128 d)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128 q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_div_ps(n, d)));
+  q = _mm_sub_ps(q, _mm_and_ps(_mm_cmpgt_ps(_mm_mul_ps(q, d), n), one));
+  q = _mm_add_ps(q, _mm_and_ps(_mm_cmple_ps(_mm_mul_ps(_mm_add_ps(q, one),
+                                                       d), n), one));
+  return _mm_cvttps_epi32(q);
+}
+
+
+/**
+ * (n * k / d) & 0xff for eight 16 bit lanes
+ */
+static inline SSE2 __m128i
+muldiv_epu16_sse2(__m128i n, float k, __m128i d)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128 kf = _mm_set1_ps(k);
+
+  __m128i lo = div_exact_sse2(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(n, zero)), kf),
+                              _mm_cvtepi32_ps(_mm_unpacklo_epi16(d, zero)));
+  __m128i hi = div_exact_sse2(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(n, zero)), kf),
+                              _mm_cvtepi32_ps(_mm_unpackhi_epi16(d, zero)));
+  return _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+}
+
+
+/**
+ *
+ */
+static inline SSE2 __m128i
+mullo_epi32_sse2(__m128i a, __m128i b)
+{
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+/**
+ * Box filter of four 32 bit lanes, (v * m) >> 16
+ */
+static inline SSE2 __m128i
+box_sum4_sse2(const uint32_t *a1, const uint32_t *a2,
+              const uint32_t *b1, const uint32_t *b2, __m128i m)
+{
+  __m128i v =
+    _mm_sub_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)b1),
+                                _mm_loadu_si128((const __m128i *)a2)),
+                  _mm_add_epi32(_mm_loadu_si128((const __m128i *)b2),
+                                _mm_loadu_si128((const __m128i *)a1)));
+  return _mm_srli_epi32(mullo_epi32_sse2(v, m), 16);
+}
+
+
+/**
+ * Eight BGR32 pixels to one 16 bit vector per channel
+ */
+static inline SSE2 void
+bgr32_split_sse2(__m128i p0, __m128i p1,
+                 __m128i *r, __m128i *g, __m128i *b, __m128i *a)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  *r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+  *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+                       _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+  *b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+                       _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+  *a = _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24));
+}
+
+
+/**
+ * Inverse of bgr32_split_sse2(), pixels where 'a' is zero are cleared
+ */
+static inline SSE2 void
+bgr32_join_sse2(__m128i r, __m128i g, __m128i b, __m128i a,
+                __m128i *p0, __m128i *p1)
+{
+  const __m128i z = _mm_cmpeq_epi16(a, _mm_setzero_si128());
+  const __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+  const __m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+  *p0 = _mm_andnot_si128(_mm_unpacklo_epi16(z, z), _mm_unpacklo_epi16(rg, ba));
+  *p1 = _mm_andnot_si128(_mm_unpackhi_epi16(z, z), _mm_unpackhi_epi16(rg, ba));
+}
+
+
+/**
+ * Put source with alpha 'sa' over 'd' (with alpha 'da'), see mix_bgr32()
+ * Returns the final alpha, updates 'sa' to the weight of the source
+ */
+static inline SSE2 __m128i
+over_alpha_sse2(__m128i *sa, __m128i da)
+{
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i one = _mm_set1_epi16(1);
+  __m128i fa = _mm_add_epi16(*sa,
+                             div255_sse2(_mm_mullo_epi16(_mm_sub_epi16(c255,
+                                                                       *sa),
+                                                         da)));
+  *sa = muldiv_epu16_sse2(*sa, 255.0f, _mm_max_epi16(fa, one));
+  return fa;
+}
+
+
+/**
+ *
+ */
+static inline SSE2 __m128i
+over_channel_sse2(__m128i s, __m128i d, __m128i sa)
+{
+  const __m128i c255 = _mm_set1_epi16(255);
+  return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(s, sa),
+                                   _mm_mullo_epi16(d, _mm_sub_epi16(c255,
+                                                                    sa))));
+}
+
+
+/**
+ *
+ */
+static inline SSE2 void
+composite_i_on_bgr32_8_sse2(uint32_t *dst, const uint8_t *src,
+                            __m128i CR, __m128i CG, __m128i CB, __m128i CA)
+{
+  __m128i DR, DG, DB, DA, p0, p1;
+  __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src),
+                                _mm_setzero_si128());
+
+  bgr32_split_sse2(_mm_loadu_si128((const __m128i *)dst),
+                   _mm_loadu_si128((const __m128i *)(dst + 4)),
+                   &DR, &DG, &DB, &DA);
+
+  __m128i SA = div255_sse2(_mm_mullo_epi16(s, CA));
+  __m128i FA = over_alpha_sse2(&SA, DA);
+
+  bgr32_join_sse2(over_channel_sse2(CR, DR, SA),
+                  over_channel_sse2(CG, DG, SA),
+                  over_channel_sse2(CB, DB, SA),
+                  FA, &p0, &p1);
+  _mm_storeu_si128((__m128i *)dst, p0);
+  _mm_storeu_si128((__m128i *)(dst + 4), p1);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+composite_i_on_bgr32_sse2(uint8_t *dst_, const uint8_t *src,
+                          int r, int g, int b, int a, int width)
+{
+  uint32_t *dst = (uint32_t *)dst_;
+  const __m128i CR = _mm_set1_epi16(r);
+  const __m128i CG = _mm_set1_epi16(g);
+  const __m128i CB = _mm_set1_epi16(b);
+  const __m128i CA = _mm_set1_epi16(a);
+  int x;
+
+  for(x = 0; x + 8 <= width; x += 8)
+    composite_i_on_bgr32_8_sse2(dst + x, src + x, CR, CG, CB, CA);
+
+  if(x < width) {
+    uint32_t d[8] = {0};
+    uint8_t s[8] = {0};
+    memcpy(d, dst + x, (width - x) * 4);
+    memcpy(s, src + x, width - x);
+    composite_i_on_bgr32_8_sse2(d, s, CR, CG, CB, CA);
+    memcpy(dst + x, d, (width - x) * 4);
+  }
+}
+
+
+/**
+ * Eight IA pixels, see composite_GRAY8_on_IA()
+ */
+static inline SSE2 void
+composite_i_on_ia_8_sse2(uint8_t *dst, const uint8_t *src,
+                         __m128i I0, __m128i A0)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i lo8 = _mm_set1_epi16(0xff);
+  const __m128i one = _mm_set1_epi16(1);
+
+  __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src), zero);
+  __m128i p = _mm_loadu_si128((const __m128i *)dst);
+  __m128i i = _mm_and_si128(p, lo8);
+  __m128i pa = _mm_srli_epi16(p, 8);
+
+  // y = FIXMUL(a0, src), a = y + FIXMUL(pa, 255 - y)
+  __m128i y = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(A0, s), c255), 8);
+  __m128i iy = _mm_sub_epi16(c255, y);
+  __m128i a = _mm_add_epi16(y, _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(pa, iy), c255), 8));
+
+  // FIX3MUL(i, pa, 255 - y) needs 32 bits
+  __m128i ipa = _mm_mullo_epi16(i, pa);
+  __m128i plo = _mm_mullo_epi16(ipa, iy);
+  __m128i phi = _mm_mulhi_epu16(ipa, iy);
+  const __m128i r16 = _mm_set1_epi32(65535);
+  __m128i f3 = _mm_packs_epi32(_mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(plo, phi), r16), 16),
+                               _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(plo, phi), r16), 16));
+
+  __m128i f1 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(I0, y), c255), 8);
+
+  i = muldiv_epu16_sse2(_mm_add_epi16(f1, f3), 255.0f, _mm_max_epi16(a, one));
+  i = _mm_andnot_si128(_mm_cmpeq_epi16(a, zero), i);
+
+  __m128i r = _mm_or_si128(i, _mm_slli_epi16(a, 8));
+  __m128i keep = _mm_cmpeq_epi16(s, zero);
+  r = _mm_or_si128(_mm_and_si128(keep, p), _mm_andnot_si128(keep, r));
+  _mm_storeu_si128((__m128i *)dst, r);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+composite_i_on_ia_sse2(uint8_t *dst, const uint8_t *src,
+                       int i0, int unused1, int unused2, int a0, int width)
+{
+  const __m128i I0 = _mm_set1_epi16(i0);
+  const __m128i A0 = _mm_set1_epi16(a0);
+  int x;
+
+  for(x = 0; x + 8 <= width; x += 8)
+    composite_i_on_ia_8_sse2(dst + x * 2, src + x, I0, A0);
+
+  if(x < width) {
+    uint8_t d[16] = {0};
+    uint8_t s[8] = {0};
+    memcpy(d, dst + x * 2, (width - x) * 2);
+    memcpy(s, src + x, width - x);
+    composite_i_on_ia_8_sse2(d, s, I0, A0);
+    memcpy(dst + x * 2, d, (width - x) * 2);
+  }
+}
+
+
+/**
+ * With full alpha FIXMUL(a0, src) is src so this is the same operation
+ */
+static void SSE2
+composite_i_on_ia_full_alpha_sse2(uint8_t *dst, const uint8_t *src,
+                                  int i0, int unused1, int unused2,
+                                  int unused3, int width)
+{
+  composite_i_on_ia_sse2(dst, src, i0, 0, 0, 255, width);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+box_sum_sse2(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+             const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m128i M = _mm_set1_epi32(m);
+  const __m128i mask = _mm_set1_epi32(0xff);
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m128i v0 = _mm_and_si128(box_sum4_sse2(a1 + i,      a2 + i,
+                                             b1 + i,      b2 + i,      M), mask);
+    __m128i v1 = _mm_and_si128(box_sum4_sse2(a1 + i + 4,  a2 + i + 4,
+                                             b1 + i + 4,  b2 + i + 4,  M), mask);
+    __m128i v2 = _mm_and_si128(box_sum4_sse2(a1 + i + 8,  a2 + i + 8,
+                                             b1 + i + 8,  b2 + i + 8,  M), mask);
+    __m128i v3 = _mm_and_si128(box_sum4_sse2(a1 + i + 12, a2 + i + 12,
+                                             b1 + i + 12, b2 + i + 12, M), mask);
+    _mm_storeu_si128((__m128i *)(d + i),
+                     _mm_packus_epi16(_mm_packs_epi32(v0, v1),
+                                      _mm_packs_epi32(v2, v3)));
+  }
+
+  for(; i < n; i++) {
+    unsigned int v = b1[i] + a2[i] - b2[i] - a1[i];
+    d[i] = (v * m) >> 16;
+  }
+}
+
+
+/**
+ * Store one vector of row prefix sums on top of the row above
+ */
+static inline SSE2 void
+integral_store_sse2(uint32_t *t, const uint32_t *prev, int i, __m128i r)
+{
+  if(prev != NULL)
+    r = _mm_add_epi32(r, _mm_loadu_si128((const __m128i *)(prev + i)));
+  _mm_storeu_si128((__m128i *)(t + i), r);
+}
+
+
+/**
+ * Prefix sum of two pixels with two channels each, 'acc' holds the sums
+ * of the previous pixel in both halves
+ */
+static inline SSE2 __m128i
+integral_step2_sse2(__m128i *acc, __m128i q)
+{
+  __m128i r = _mm_add_epi32(_mm_add_epi32(q, _mm_slli_si128(q, 8)), *acc);
+  *acc = _mm_shuffle_epi32(r, _MM_SHUFFLE(3, 2, 3, 2));
+  return r;
+}
+
+
+/**
+ *
+ */
+static void SSE2
+integral_row_sse2(uint32_t *t, const uint32_t *prev, const uint8_t *s,
+                  int n, int z)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  int i = 0;
+
+  if(z == 4) {
+    for(; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+      integral_store_sse2(t, prev, i, acc);
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+      integral_store_sse2(t, prev, i + 4, acc);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+      integral_store_sse2(t, prev, i + 8, acc);
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+      integral_store_sse2(t, prev, i + 12, acc);
+    }
+  } else if(z == 2) {
+    for(; i + 8 <= n; i += 8) {
+      __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + i)),
+                                    zero);
+      integral_store_sse2(t, prev, i,
+                          integral_step2_sse2(&acc, _mm_unpacklo_epi16(v, zero)));
+      integral_store_sse2(t, prev, i + 4,
+                          integral_step2_sse2(&acc, _mm_unpackhi_epi16(v, zero)));
+    }
+  }
+
+  for(; i < n; i++) {
+    if(prev == NULL)
+      t[i] = s[i] + (i >= z ? t[i - z] : 0);
+    else if(i < z)
+      t[i] = s[i] + prev[i];
+    else
+      t[i] = s[i] + t[i - z] + prev[i] - prev[i - z];
+  }
+}
+
+
+/**
+ * Eight BGR32 pixels on top of shadow with alpha 's'
+ */
+static inline SSE2 void
+shadow_bgr32_8_sse2(uint32_t *d, __m128i s)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i SR, SG, SB, SA, p0, p1;
+
+  bgr32_split_sse2(_mm_loadu_si128((const __m128i *)d),
+                   _mm_loadu_si128((const __m128i *)(d + 4)),
+                   &SR, &SG, &SB, &SA);
+
+  __m128i FA = over_alpha_sse2(&SA, s);
+  bgr32_join_sse2(over_channel_sse2(SR, zero, SA),
+                  over_channel_sse2(SG, zero, SA),
+                  over_channel_sse2(SB, zero, SA),
+                  FA, &p0, &p1);
+  _mm_storeu_si128((__m128i *)d, p0);
+  _mm_storeu_si128((__m128i *)(d + 4), p1);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+shadow_bgr32_sse2(uint32_t *d, const uint32_t *a1, const uint32_t *a2,
+                  const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m128i M = _mm_set1_epi32(m);
+  const __m128i mask = _mm_set1_epi32(0xff);
+  int i;
+
+  for(i = 0; i + 8 <= n; i += 8) {
+    __m128i s0 = box_sum4_sse2(a1 + i,     a2 + i,     b1 + i,     b2 + i,     M);
+    __m128i s1 = box_sum4_sse2(a1 + i + 4, a2 + i + 4, b1 + i + 4, b2 + i + 4, M);
+    shadow_bgr32_8_sse2(d + i, _mm_packs_epi32(_mm_and_si128(s0, mask),
+                                               _mm_and_si128(s1, mask)));
+  }
+
+  if(i < n) {
+    uint32_t p[8] = {0};
+    uint32_t s[8] = {0};
+    for(int j = 0; j < n - i; j++) {
+      unsigned int v = b1[i + j] + a2[i + j] - b2[i + j] - a1[i + j];
+      s[j] = ((v * m) >> 16) & 0xff;
+    }
+    memcpy(p, d + i, (n - i) * 4);
+    shadow_bgr32_8_sse2(p, _mm_packs_epi32(_mm_loadu_si128((const __m128i *)s),
+                                           _mm_loadu_si128((const __m128i *)(s + 4))));
+    memcpy(d + i, p, (n - i) * 4);
+  }
+}
+
+
+/**
+ * Eight IA pixels on top of shadow with alpha 's', see mix_ia()
+ */
+static inline SSE2 void
+shadow_ia_8_sse2(uint8_t *d, __m128i s)
+{
+  const __m128i lo8 = _mm_set1_epi16(0xff);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i p = _mm_loadu_si128((const __m128i *)d);
+  __m128i SR = _mm_and_si128(p, lo8);
+  __m128i SA = _mm_srli_epi16(p, 8);
+
+  __m128i FA = over_alpha_sse2(&SA, s);
+  __m128i DR = over_channel_sse2(SR, zero, SA);
+  __m128i r = _mm_or_si128(DR, _mm_slli_epi16(FA, 8));
+  r = _mm_andnot_si128(_mm_cmpeq_epi16(FA, zero), r);
+  _mm_storeu_si128((__m128i *)d, r);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+shadow_ia_sse2(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+               const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m128i M = _mm_set1_epi32(m);
+  int i;
+
+  for(i = 0; i + 8 <= n; i += 8) {
+    __m128i s0 = box_sum4_sse2(a1 + i,     a2 + i,     b1 + i,     b2 + i,     M);
+    __m128i s1 = box_sum4_sse2(a1 + i + 4, a2 + i + 4, b1 + i + 4, b2 + i + 4, M);
+    shadow_ia_8_sse2(d + i * 2, _mm_packs_epi32(s0, s1));
+  }
+
+  if(i < n) {
+    uint8_t p[16] = {0};
+    uint32_t s[8] = {0};
+    for(int j = 0; j < n - i; j++) {
+      unsigned int v = b1[i + j] + a2[i + j] - b2[i + j] - a1[i + j];
+      s[j] = (v * m) >> 16;
+    }
+    memcpy(p, d + i * 2, (n - i) * 2);
+    shadow_ia_8_sse2(p, _mm_packs_epi32(_mm_loadu_si128((const __m128i *)s),
+                                        _mm_loadu_si128((const __m128i *)(s + 4))));
+    memcpy(d + i * 2, p, (n - i) * 2);
+  }
+}
+
+
+/**
+ * Four packed RGB24 pixels from the low 12 bytes of 'v'. Pixel k moves
+ * up k bytes
+ */
+static inline SSE2 __m128i
+rgb24_expand4_sse2(__m128i v)
+{
+  const __m128i m0 = _mm_set_epi32(0, 0, 0, 0x00ffffff);
+  const __m128i m1 = _mm_set_epi32(0, 0, 0x00ffffff, 0);
+  const __m128i m2 = _mm_set_epi32(0, 0x00ffffff, 0, 0);
+  const __m128i m3 = _mm_set_epi32(0x00ffffff, 0, 0, 0);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+  __m128i r = _mm_or_si128(_mm_and_si128(v, m0),
+                           _mm_and_si128(_mm_slli_si128(v, 1), m1));
+  r = _mm_or_si128(r, _mm_and_si128(_mm_slli_si128(v, 2), m2));
+  r = _mm_or_si128(r, _mm_and_si128(_mm_slli_si128(v, 3), m3));
+  return _mm_or_si128(r, alpha);
+}
+
+
+/**
+ *
+ */
+static void SSE2
+rgb24_to_bgr32_sse2(uint32_t *d, const uint8_t *s, int width)
+{
+  int x;
+
+  // Loads are 16 bytes for 12 bytes of pixels, stay inside the row
+  for(x = 0; x + 10 <= width; x += 8) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(s + x * 3));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s + x * 3 + 12));
+    _mm_storeu_si128((__m128i *)(d + x),     rgb24_expand4_sse2(v0));
+    _mm_storeu_si128((__m128i *)(d + x + 4), rgb24_expand4_sse2(v1));
+  }
+
+  for(; x < width; x++)
+    d[x] = 0xff000000 | s[x * 3 + 2] << 16 | s[x * 3 + 1] << 8 | s[x * 3];
+}
+
+
+/**
+ * floor(v / 3) for v <= 765
+ */
+static inline SSE2 __m128i
+div3_epu16_sse2(__m128i v)
+{
+  return _mm_srli_epi16(_mm_mulhi_epu16(v, _mm_set1_epi16(0xaaab)), 1);
+}
+
+
+/**
+ * Neighbouring pixels tend to land in the same bin and the increments
+ * then serialize on memory. Wide rows are spread over four histograms
+ * that are summed at the end
+ */
+#define INTENSITY_SPLIT_WIDTH 256
+
+typedef struct intensity_bins {
+  int *ib_h[4];
+  int ib_local[3][256];
+} intensity_bins_t;
+
+
+static void
+intensity_bins_init(intensity_bins_t *ib, int *bin, int width)
+{
+  ib->ib_h[0] = bin;
+  for(int i = 0; i < 3; i++) {
+    if(width >= INTENSITY_SPLIT_WIDTH) {
+      memset(ib->ib_local[i], 0, sizeof(ib->ib_local[i]));
+      ib->ib_h[i + 1] = ib->ib_local[i];
+    } else {
+      ib->ib_h[i + 1] = bin;
+    }
+  }
+}
+
+
+static void
+intensity_bins_finish(intensity_bins_t *ib)
+{
+  int *bin = ib->ib_h[0];
+  if(ib->ib_h[1] == bin)
+    return;
+  for(int i = 0; i < 256; i++)
+    bin[i] += ib->ib_local[0][i] + ib->ib_local[1][i] + ib->ib_local[2][i];
+}
+
+
+/**
+ * Count eight 16 bit bin indices. Extracting them one by one avoids a
+ * stall on reading back a vector store with narrow loads
+ */
+static inline SSE2 void
+intensity_add8_sse2(intensity_bins_t *ib, __m128i idx)
+{
+  ib->ib_h[0][_mm_extract_epi16(idx, 0)]++;
+  ib->ib_h[1][_mm_extract_epi16(idx, 1)]++;
+  ib->ib_h[2][_mm_extract_epi16(idx, 2)]++;
+  ib->ib_h[3][_mm_extract_epi16(idx, 3)]++;
+  ib->ib_h[0][_mm_extract_epi16(idx, 4)]++;
+  ib->ib_h[1][_mm_extract_epi16(idx, 5)]++;
+  ib->ib_h[2][_mm_extract_epi16(idx, 6)]++;
+  ib->ib_h[3][_mm_extract_epi16(idx, 7)]++;
+}
+
+
+/**
+ * r + g + b of four pixels in the low bytes of 32 bit lanes
+ */
+static inline SSE2 __m128i
+intensity_sum4_sse2(__m128i p)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  return _mm_add_epi32(_mm_add_epi32(_mm_and_si128(p, mask),
+                                     _mm_and_si128(_mm_srli_epi32(p, 8), mask)),
+                       _mm_and_si128(_mm_srli_epi32(p, 16), mask));
+}
+
+
+/**
+ *
+ */
+static void SSE2
+intensity_bgr32_sse2(int *bin, const uint32_t *src, int width)
+{
+  intensity_bins_t ib;
+  int x;
+
+  intensity_bins_init(&ib, bin, width);
+
+  for(x = 0; x + 8 <= width; x += 8) {
+    __m128i v0 = intensity_sum4_sse2(_mm_loadu_si128((const __m128i *)(src + x)));
+    __m128i v1 = intensity_sum4_sse2(_mm_loadu_si128((const __m128i *)(src + x + 4)));
+    intensity_add8_sse2(&ib, div3_epu16_sse2(_mm_packs_epi32(v0, v1)));
+  }
+
+  for(; x < width; x++) {
+    unsigned int u32 = src[x];
+    bin[((u32 & 0xff) + ((u32 >> 8) & 0xff) + ((u32 >> 16) & 0xff)) / 3]++;
+  }
+
+  intensity_bins_finish(&ib);
+}
+
+
+static const pixmap_kernels_t pixmap_kernels_sse2 = {
+  .pk_name                         = "sse2",
+  .pk_composite_i_on_bgr32         = composite_i_on_bgr32_sse2,
+  .pk_composite_i_on_ia            = composite_i_on_ia_sse2,
+  .pk_composite_i_on_ia_full_alpha = composite_i_on_ia_full_alpha_sse2,
+  .pk_box_sum                      = box_sum_sse2,
+  .pk_integral_row                 = integral_row_sse2,
+  .pk_shadow_bgr32                 = shadow_bgr32_sse2,
+  .pk_shadow_ia                    = shadow_ia_sse2,
+  .pk_rgb24_to_bgr32               = rgb24_to_bgr32_sse2,
+  .pk_intensity_bgr32              = intensity_bgr32_sse2,
+};
+
+
+
+/*
+ * AVX2
+ *
+ * Packing and unpacking work within 128 bit lanes. Sixteen pixels
+ * split into 16 bit vectors end up in the order 0-3, 8-11 | 4-7, 12-15
+ * and anything loaded in linear order is permuted to match.
+ */
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+div255_avx2(__m256i x)
+{
+  const __m256i c255 = _mm256_set1_epi16(255);
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(x, c255),
+                                                              8), x), 8);
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+div_exact_avx2(__m256 n, __m256 d)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  __m256 q = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_div_ps(n, d)));
+  q = _mm256_sub_ps(q, _mm256_and_ps(_mm256_cmp_ps(_mm256_mul_ps(q, d), n,
+                                                   _CMP_GT_OQ), one));
+  q = _mm256_add_ps(q, _mm256_and_ps(_mm256_cmp_ps(_mm256_mul_ps(_mm256_add_ps(q, one), d),
+                                                   n, _CMP_LE_OQ), one));
+  return _mm256_cvttps_epi32(q);
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+muldiv_epu16_avx2(__m256i n, float k, __m256i d)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  const __m256 kf = _mm256_set1_ps(k);
+
+  __m256i lo = div_exact_avx2(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(n, zero)), kf),
+                              _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(d, zero)));
+  __m256i hi = div_exact_avx2(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(n, zero)), kf),
+                              _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(d, zero)));
+  return _mm256_packs_epi32(_mm256_and_si256(lo, mask),
+                            _mm256_and_si256(hi, mask));
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+box_sum8_avx2(const uint32_t *a1, const uint32_t *a2,
+              const uint32_t *b1, const uint32_t *b2, __m256i m)
+{
+  __m256i v =
+    _mm256_sub_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)b1),
+                                      _mm256_loadu_si256((const __m256i *)a2)),
+                     _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)b2),
+                                      _mm256_loadu_si256((const __m256i *)a1)));
+  return _mm256_srli_epi32(_mm256_mullo_epi32(v, m), 16);
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+bgr32_split_avx2(__m256i p0, __m256i p1,
+                 __m256i *r, __m256i *g, __m256i *b, __m256i *a)
+{
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  *r = _mm256_packs_epi32(_mm256_and_si256(p0, mask),
+                          _mm256_and_si256(p1, mask));
+  *g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+                          _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask));
+  *b = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+                          _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask));
+  *a = _mm256_packs_epi32(_mm256_srli_epi32(p0, 24),
+                          _mm256_srli_epi32(p1, 24));
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+bgr32_join_avx2(__m256i r, __m256i g, __m256i b, __m256i a,
+                __m256i *p0, __m256i *p1)
+{
+  const __m256i z = _mm256_cmpeq_epi16(a, _mm256_setzero_si256());
+  const __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+  const __m256i ba = _mm256_or_si256(b, _mm256_slli_epi16(a, 8));
+  *p0 = _mm256_andnot_si256(_mm256_unpacklo_epi16(z, z),
+                            _mm256_unpacklo_epi16(rg, ba));
+  *p1 = _mm256_andnot_si256(_mm256_unpackhi_epi16(z, z),
+                            _mm256_unpackhi_epi16(rg, ba));
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+over_alpha_avx2(__m256i *sa, __m256i da)
+{
+  const __m256i c255 = _mm256_set1_epi16(255);
+  const __m256i one = _mm256_set1_epi16(1);
+  __m256i fa = _mm256_add_epi16(*sa,
+                                div255_avx2(_mm256_mullo_epi16(_mm256_sub_epi16(c255, *sa),
+                                                               da)));
+  *sa = muldiv_epu16_avx2(*sa, 255.0f, _mm256_max_epi16(fa, one));
+  return fa;
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+over_channel_avx2(__m256i s, __m256i d, __m256i sa)
+{
+  const __m256i c255 = _mm256_set1_epi16(255);
+  return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(s, sa),
+                                      _mm256_mullo_epi16(d, _mm256_sub_epi16(c255, sa))));
+}
+
+
+/**
+ * Sixteen 8 bit values to 16 bit lanes in split order
+ */
+static inline AVX2 __m256i
+load16_split_avx2(const uint8_t *src)
+{
+  __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+  return _mm256_permute4x64_epi64(s, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+composite_i_on_bgr32_16_avx2(uint32_t *dst, const uint8_t *src,
+                             __m256i CR, __m256i CG, __m256i CB, __m256i CA)
+{
+  __m256i DR, DG, DB, DA, p0, p1;
+  __m256i s = load16_split_avx2(src);
+
+  bgr32_split_avx2(_mm256_loadu_si256((const __m256i *)dst),
+                   _mm256_loadu_si256((const __m256i *)(dst + 8)),
+                   &DR, &DG, &DB, &DA);
+
+  __m256i SA = div255_avx2(_mm256_mullo_epi16(s, CA));
+  __m256i FA = over_alpha_avx2(&SA, DA);
+
+  bgr32_join_avx2(over_channel_avx2(CR, DR, SA),
+                  over_channel_avx2(CG, DG, SA),
+                  over_channel_avx2(CB, DB, SA),
+                  FA, &p0, &p1);
+  _mm256_storeu_si256((__m256i *)dst, p0);
+  _mm256_storeu_si256((__m256i *)(dst + 8), p1);
+}
+
+
+/**
+ *
+ */
+static void AVX2
+composite_i_on_bgr32_avx2(uint8_t *dst_, const uint8_t *src,
+                          int r, int g, int b, int a, int width)
+{
+  uint32_t *dst = (uint32_t *)dst_;
+  const __m256i CR = _mm256_set1_epi16(r);
+  const __m256i CG = _mm256_set1_epi16(g);
+  const __m256i CB = _mm256_set1_epi16(b);
+  const __m256i CA = _mm256_set1_epi16(a);
+  int x;
+
+  for(x = 0; x + 16 <= width; x += 16)
+    composite_i_on_bgr32_16_avx2(dst + x, src + x, CR, CG, CB, CA);
+
+  if(x < width) {
+    uint32_t d[16] = {0};
+    uint8_t s[16] = {0};
+    memcpy(d, dst + x, (width - x) * 4);
+    memcpy(s, src + x, width - x);
+    composite_i_on_bgr32_16_avx2(d, s, CR, CG, CB, CA);
+    memcpy(dst + x, d, (width - x) * 4);
+  }
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+composite_i_on_ia_16_avx2(uint8_t *dst, const uint8_t *src,
+                          __m256i I0, __m256i A0)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i c255 = _mm256_set1_epi16(255);
+  const __m256i lo8 = _mm256_set1_epi16(0xff);
+  const __m256i one = _mm256_set1_epi16(1);
+
+  __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)src));
+  __m256i p = _mm256_loadu_si256((const __m256i *)dst);
+  __m256i i = _mm256_and_si256(p, lo8);
+  __m256i pa = _mm256_srli_epi16(p, 8);
+
+  __m256i y = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(A0, s), c255), 8);
+  __m256i iy = _mm256_sub_epi16(c255, y);
+  __m256i a = _mm256_add_epi16(y, _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(pa, iy), c255), 8));
+
+  __m256i ipa = _mm256_mullo_epi16(i, pa);
+  __m256i plo = _mm256_mullo_epi16(ipa, iy);
+  __m256i phi = _mm256_mulhi_epu16(ipa, iy);
+  const __m256i r16 = _mm256_set1_epi32(65535);
+  __m256i f3 = _mm256_packs_epi32(_mm256_srli_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(plo, phi), r16), 16),
+                                  _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(plo, phi), r16), 16));
+
+  __m256i f1 = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(I0, y), c255), 8);
+
+  i = muldiv_epu16_avx2(_mm256_add_epi16(f1, f3), 255.0f, _mm256_max_epi16(a, one));
+  i = _mm256_andnot_si256(_mm256_cmpeq_epi16(a, zero), i);
+
+  __m256i r = _mm256_or_si256(i, _mm256_slli_epi16(a, 8));
+  __m256i keep = _mm256_cmpeq_epi16(s, zero);
+  r = _mm256_or_si256(_mm256_and_si256(keep, p), _mm256_andnot_si256(keep, r));
+  _mm256_storeu_si256((__m256i *)dst, r);
+}
+
+
+/**
+ *
+ */
+static void AVX2
+composite_i_on_ia_avx2(uint8_t *dst, const uint8_t *src,
+                       int i0, int unused1, int unused2, int a0, int width)
+{
+  const __m256i I0 = _mm256_set1_epi16(i0);
+  const __m256i A0 = _mm256_set1_epi16(a0);
+  int x;
+
+  for(x = 0; x + 16 <= width; x += 16)
+    composite_i_on_ia_16_avx2(dst + x * 2, src + x, I0, A0);
+
+  if(x < width) {
+    uint8_t d[32] = {0};
+    uint8_t s[16] = {0};
+    memcpy(d, dst + x * 2, (width - x) * 2);
+    memcpy(s, src + x, width - x);
+    composite_i_on_ia_16_avx2(d, s, I0, A0);
+    memcpy(dst + x * 2, d, (width - x) * 2);
+  }
+}
+
+
+/**
+ *
+ */
+static void AVX2
+composite_i_on_ia_full_alpha_avx2(uint8_t *dst, const uint8_t *src,
+                                  int i0, int unused1, int unused2,
+                                  int unused3, int width)
+{
+  composite_i_on_ia_avx2(dst, src, i0, 0, 0, 255, width);
+}
+
+
+/**
+ *
+ */
+static void AVX2
+box_sum_avx2(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+             const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m256i M = _mm256_set1_epi32(m);
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int i;
+
+  for(i = 0; i + 32 <= n; i += 32) {
+    __m256i v0 = _mm256_and_si256(box_sum8_avx2(a1 + i,      a2 + i,
+                                                b1 + i,      b2 + i,      M), mask);
+    __m256i v1 = _mm256_and_si256(box_sum8_avx2(a1 + i + 8,  a2 + i + 8,
+                                                b1 + i + 8,  b2 + i + 8,  M), mask);
+    __m256i v2 = _mm256_and_si256(box_sum8_avx2(a1 + i + 16, a2 + i + 16,
+                                                b1 + i + 16, b2 + i + 16, M), mask);
+    __m256i v3 = _mm256_and_si256(box_sum8_avx2(a1 + i + 24, a2 + i + 24,
+                                                b1 + i + 24, b2 + i + 24, M), mask);
+    __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1),
+                                    _mm256_packs_epi32(v2, v3));
+    _mm256_storeu_si256((__m256i *)(d + i),
+                        _mm256_permutevar8x32_epi32(r, order));
+  }
+
+  for(; i < n; i++) {
+    unsigned int v = b1[i] + a2[i] - b2[i] - a1[i];
+    d[i] = (v * m) >> 16;
+  }
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+shadow_bgr32_16_avx2(uint32_t *d, __m256i s)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i SR, SG, SB, SA, p0, p1;
+
+  bgr32_split_avx2(_mm256_loadu_si256((const __m256i *)d),
+                   _mm256_loadu_si256((const __m256i *)(d + 8)),
+                   &SR, &SG, &SB, &SA);
+
+  __m256i FA = over_alpha_avx2(&SA, s);
+  bgr32_join_avx2(over_channel_avx2(SR, zero, SA),
+                  over_channel_avx2(SG, zero, SA),
+                  over_channel_avx2(SB, zero, SA),
+                  FA, &p0, &p1);
+  _mm256_storeu_si256((__m256i *)d, p0);
+  _mm256_storeu_si256((__m256i *)(d + 8), p1);
+}
+
+
+/**
+ *
+ */
+static void AVX2
+shadow_bgr32_avx2(uint32_t *d, const uint32_t *a1, const uint32_t *a2,
+                  const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m256i M = _mm256_set1_epi32(m);
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  int i;
+
+  // Pack order of the sums matches that of the split pixels
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m256i s0 = box_sum8_avx2(a1 + i,     a2 + i,     b1 + i,     b2 + i,     M);
+    __m256i s1 = box_sum8_avx2(a1 + i + 8, a2 + i + 8, b1 + i + 8, b2 + i + 8, M);
+    shadow_bgr32_16_avx2(d + i,
+                         _mm256_packs_epi32(_mm256_and_si256(s0, mask),
+                                            _mm256_and_si256(s1, mask)));
+  }
+
+  if(i < n) {
+    uint32_t p[16] = {0};
+    uint32_t s[16] = {0};
+    for(int j = 0; j < n - i; j++) {
+      unsigned int v = b1[i + j] + a2[i + j] - b2[i + j] - a1[i + j];
+      s[j] = ((v * m) >> 16) & 0xff;
+    }
+    memcpy(p, d + i, (n - i) * 4);
+    shadow_bgr32_16_avx2(p, _mm256_packs_epi32(_mm256_loadu_si256((const __m256i *)s),
+                                               _mm256_loadu_si256((const __m256i *)(s + 8))));
+    memcpy(d + i, p, (n - i) * 4);
+  }
+}
+
+
+/**
+ *
+ */
+static inline AVX2 void
+shadow_ia_16_avx2(uint8_t *d, __m256i s)
+{
+  const __m256i lo8 = _mm256_set1_epi16(0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i p = _mm256_loadu_si256((const __m256i *)d);
+  __m256i SR = _mm256_and_si256(p, lo8);
+  __m256i SA = _mm256_srli_epi16(p, 8);
+
+  __m256i FA = over_alpha_avx2(&SA, s);
+  __m256i DR = over_channel_avx2(SR, zero, SA);
+  __m256i r = _mm256_or_si256(DR, _mm256_slli_epi16(FA, 8));
+  r = _mm256_andnot_si256(_mm256_cmpeq_epi16(FA, zero), r);
+  _mm256_storeu_si256((__m256i *)d, r);
+}
+
+
+/**
+ *
+ */
+static inline AVX2 __m256i
+pack_linear_avx2(__m256i s0, __m256i s1)
+{
+  return _mm256_permute4x64_epi64(_mm256_packs_epi32(s0, s1),
+                                  _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+
+/**
+ *
+ */
+static void AVX2
+shadow_ia_avx2(uint8_t *d, const uint32_t *a1, const uint32_t *a2,
+               const uint32_t *b1, const uint32_t *b2, int n, int m)
+{
+  const __m256i M = _mm256_set1_epi32(m);
+  int i;
+
+  for(i = 0; i + 16 <= n; i += 16) {
+    __m256i s0 = box_sum8_avx2(a1 + i,     a2 + i,     b1 + i,     b2 + i,     M);
+    __m256i s1 = box_sum8_avx2(a1 + i + 8, a2 + i + 8, b1 + i + 8, b2 + i + 8, M);
+    shadow_ia_16_avx2(d + i * 2, pack_linear_avx2(s0, s1));
+  }
+
+  if(i < n) {
+    uint8_t p[32] = {0};
+    uint32_t s[16] = {0};
+    for(int j = 0; j < n - i; j++) {
+      unsigned int v = b1[i + j] + a2[i + j] - b2[i + j] - a1[i + j];
+      s[j] = (v * m) >> 16;
+    }
+    memcpy(p, d + i * 2, (n - i) * 2);
+    shadow_ia_16_avx2(p, pack_linear_avx2(_mm256_loadu_si256((const __m256i *)s),
+                                          _mm256_loadu_si256((const __m256i *)(s + 8))));
+    memcpy(d + i * 2, p, (n - i) * 2);
+  }
+}
+
+
+/**
+ *
+ */
+static void AVX2
+rgb24_to_bgr32_avx2(uint32_t *d, const uint8_t *s, int width)
+{
+  const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                        6, 7, 8, -1, 9, 10, 11, -1,
+                                        0, 1, 2, -1, 3, 4, 5, -1,
+                                        6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i alpha = _mm256_set1_epi32(0xff000000);
+  int x;
+
+  for(x = 0; x + 10 <= width; x += 8) {
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(s + x * 3))),
+                                        _mm_loadu_si128((const __m128i *)(s + x * 3 + 12)), 1);
+    _mm256_storeu_si256((__m256i *)(d + x),
+                        _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha));
+  }
+
+  for(; x < width; x++)
+    d[x] = 0xff000000 | s[x * 3 + 2] << 16 | s[x * 3 + 1] << 8 | s[x * 3];
+}
+
+
+/**
+ * r + g + b of eight RGB24 pixels as 32 bit lanes
+ */
+static inline AVX2 __m256i
+intensity_sum8_avx2(const uint8_t *s)
+{
+  const __m256i rg = _mm256_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1,
+                                      6, -1, 7, -1, 9, -1, 10, -1,
+                                      0, -1, 1, -1, 3, -1, 4, -1,
+                                      6, -1, 7, -1, 9, -1, 10, -1);
+  const __m256i b = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1,
+                                     8, -1, -1, -1, 11, -1, -1, -1,
+                                     2, -1, -1, -1, 5, -1, -1, -1,
+                                     8, -1, -1, -1, 11, -1, -1, -1);
+  const __m256i one = _mm256_set1_epi16(1);
+  __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+                                      _mm_loadu_si128((const __m128i *)(s + 12)), 1);
+  return _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(v, rg), one),
+                          _mm256_shuffle_epi8(v, b));
+}
+
+
+/**
+ * The order of pixels does not matter for the histogram so the lane
+ * interleaving of the pack is left as is
+ */
+static void AVX2
+intensity_rgb24_avx2(int *bin, const uint8_t *src, int width)
+{
+  const __m256i m3 = _mm256_set1_epi16(0xaaab);
+  intensity_bins_t ib;
+  int x;
+
+  intensity_bins_init(&ib, bin, width);
+
+  for(x = 0; x + 18 <= width; x += 16) {
+    const uint8_t *s = src + x * 3;
+    __m256i v = _mm256_packs_epi32(intensity_sum8_avx2(s),
+                                   intensity_sum8_avx2(s + 24));
+    v = _mm256_srli_epi16(_mm256_mulhi_epu16(v, m3), 1);
+    intensity_add8_sse2(&ib, _mm256_castsi256_si128(v));
+    intensity_add8_sse2(&ib, _mm256_extracti128_si256(v, 1));
+  }
+
+  for(; x < width; x++)
+    bin[(src[x * 3] + src[x * 3 + 1] + src[x * 3 + 2]) / 3]++;
+
+  intensity_bins_finish(&ib);
+}
+
+
+static const pixmap_kernels_t pixmap_kernels_avx2 = {
+  .pk_name                         = "avx2",
+  .pk_composite_i_on_bgr32         = composite_i_on_bgr32_avx2,
+  .pk_composite_i_on_ia            = composite_i_on_ia_avx2,
+  .pk_composite_i_on_ia_full_alpha = composite_i_on_ia_full_alpha_avx2,
+  .pk_box_sum                      = box_sum_avx2,
+  .pk_shadow_bgr32                 = shadow_bgr32_avx2,
+  .pk_shadow_ia                    = shadow_ia_avx2,
+  .pk_rgb24_to_bgr32               = rgb24_to_bgr32_avx2,
+  .pk_intensity_rgb24              = intensity_rgb24_avx2,
+};
+
+#endif // PIXMAP_SIMD_X86
+
+
+/**
+ *
+ */
+int
+pixmap_kernels_simd(const pixmap_kernels_t **v, int max)
+{
+  int n = 0;
+
+#if PIXMAP_SIMD_X86
+  __builtin_cpu_init();
+  if(n < max && __builtin_cpu_supports("sse2"))
+    v[n++] = &pixmap_kernels_sse2;
+  if(n < max && __builtin_cpu_supports("avx2"))
+    v[n++] = &pixmap_kernels_avx2;
+#endif
+
+  return n;
+}
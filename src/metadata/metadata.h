@@ -332,6 +332,17 @@ void metadb_metadata_write(void *db, const char *url, time_t mtime,
 			   time_t parent_mtime,
                            metadata_index_status_t indexstatus);
 
+typedef struct metadb_write_item {
+  const char *mwi_url;
+  time_t mwi_mtime;
+  const metadata_t *mwi_md;
+  metadata_index_status_t mwi_indexstatus;
+} metadb_write_item_t;
+
+int metadb_metadata_write_batch(void *db, const metadb_write_item_t *items,
+                                int num, const char *parent,
+                                time_t parent_mtime);
+
 metadata_t *metadb_metadata_get(void *db, const char *url, time_t mtime);
 
 struct fa_dir;
@@ -75,11 +75,11 @@ items_clear(void *opaque, prop_event_t event, ...)
 
   int rc;
   sqlite3_stmt *stmt;
-  rc = db_prepare(db, &stmt, "DELETE FROM item");
+  rc = db_prepare_cached(db, &stmt, "DELETE FROM item");
 
   if(rc == SQLITE_OK) {
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_release(stmt);
   }
 
   if(rc == SQLITE_LOCKED) {
@@ -96,6 +96,111 @@ items_clear(void *opaque, prop_event_t event, ...)
 }
 
 
+#ifdef METADB_BENCHMARK
+
+#define METADB_BENCH_DIRS  1000
+#define METADB_BENCH_FILES 100
+#define METADB_BENCH_BATCH 64
+
+/**
+ * Index a synthetic tree of 100k audio files into a scratch database,
+ * first one item per transaction and then in batches. Build with
+ * -DMETADB_BENCHMARK, put the cache path on a tmpfs to take the disk
+ * out of the equation. The process exits when done
+ */
+static void
+metadb_benchmark_run(const char *schemadir, int batch)
+{
+  char path[256], url[256], parent[256], str[64];
+  metadb_write_item_t items[METADB_BENCH_BATCH];
+  metadata_t *mds[METADB_BENCH_BATCH];
+  char *urls[METADB_BENCH_BATCH];
+  int hits0, misses0, hits, misses;
+  int n = 0;
+
+  snprintf(path, sizeof(path), "%s/metadb-bench.db", gconf.cache_path);
+  unlink(path);
+
+  db_pool_t *dp = db_pool_create(path, 1);
+  sqlite3 *db = db_pool_get(dp);
+  if(db == NULL || db_upgrade_schema(db, schemadir, "metadb", NULL, NULL)) {
+    printf("Unable to create benchmark database %s\n", path);
+    exit(1);
+  }
+
+  db_stmt_cache_stats(&hits0, &misses0);
+  int64_t ts = arch_get_ts();
+
+  for(int d = 0; d < METADB_BENCH_DIRS; d++) {
+    snprintf(parent, sizeof(parent), "file:///bench/dir%04d", d);
+
+    for(int f = 0; f < METADB_BENCH_FILES; f++) {
+      metadata_t *md = metadata_create();
+      md->md_contenttype = CONTENT_AUDIO;
+      md->md_duration = 180 + f;
+      md->md_track = f + 1;
+      snprintf(str, sizeof(str), "Track %d", f);
+      md->md_title = rstr_alloc(str);
+      snprintf(str, sizeof(str), "Album %d", d);
+      md->md_album = rstr_alloc(str);
+      snprintf(str, sizeof(str), "Artist %d", d % 50);
+      md->md_artist = rstr_alloc(str);
+
+      snprintf(url, sizeof(url), "%s/file%03d.mp3", parent, f);
+
+      if(!batch) {
+        metadb_metadata_write(db, url, 1000000 + f, md, parent, 1000000,
+                              INDEX_STATUS_ANALYZED);
+        metadata_destroy(md);
+        continue;
+      }
+
+      urls[n] = strdup(url);
+      mds[n] = md;
+      items[n].mwi_url = urls[n];
+      items[n].mwi_mtime = 1000000 + f;
+      items[n].mwi_md = md;
+      items[n].mwi_indexstatus = INDEX_STATUS_ANALYZED;
+      n++;
+
+      if(n == METADB_BENCH_BATCH || f == METADB_BENCH_FILES - 1) {
+        metadb_metadata_write_batch(db, items, n, parent, 1000000);
+        for(int i = 0; i < n; i++) {
+          free(urls[i]);
+          metadata_destroy(mds[i]);
+        }
+        n = 0;
+      }
+    }
+  }
+
+  ts = arch_get_ts() - ts;
+  db_stmt_cache_stats(&hits, &misses);
+
+  const int total = METADB_BENCH_DIRS * METADB_BENCH_FILES;
+  printf("%-8s %d items in %.2fs  %8.0f items/s  "
+         "stmt cache hits:%d misses:%d\n",
+         batch ? "batched" : "single", total, ts / 1000000.0,
+         total * 1000000.0 / ts, hits - hits0, misses - misses0);
+
+  db_pool_put(dp, db);
+  db_pool_close(dp);
+  unlink(path);
+}
+
+
+static void
+metadb_benchmark(void)
+{
+  char schemadir[256];
+  snprintf(schemadir, sizeof(schemadir), "%s/res/metadb", app_dataroot());
+  metadb_benchmark_run(schemadir, 0);
+  metadb_benchmark_run(schemadir, 1);
+  exit(0);
+}
+#endif
+
+
 /**
  *
  */
@@ -131,6 +236,9 @@ metadb_init(void)
     settings_create_action(dir, _p("Clear all metadata"),
 			   items_clear, NULL, 0, NULL);
   }
+#ifdef METADB_BENCHMARK
+  metadb_benchmark();
+#endif
 }
 
 
@@ -174,7 +282,7 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "SELECT id,mtime from item where url=?1 ");
   if(rc)
     return METADATA_PERMANENT_ERROR;
@@ -189,7 +297,7 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   return rval;
 }
 
@@ -204,7 +312,7 @@ db_item_create(sqlite3 *db, const char *url, int contenttype, time_t mtime,
   int rc;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "INSERT INTO item "
 		  "(url, contenttype, mtime, parent, indexstatus) "
 		  "VALUES "
@@ -223,7 +331,7 @@ db_item_create(sqlite3 *db, const char *url, int contenttype, time_t mtime,
   sqlite3_bind_int(stmt, 5, indexstatus);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
 
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
@@ -246,7 +354,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id "
 		  "FROM artist "
 		  "WHERE title=?1 "
@@ -270,7 +378,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
 
     sqlite3_stmt *ins;
 
-    rc = db_prepare(db, &ins, 
+    rc = db_prepare_cached(db, &ins, 
 		    "INSERT INTO artist "
 		    "(title, ds_id, ext_id) "
 		    "VALUES "
@@ -282,7 +390,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
       if(ext_id)
 	sqlite3_bind_text(ins, 3, ext_id, -1, SQLITE_STATIC);
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_release(ins);
       if(rc == SQLITE_LOCKED)
 	rval = METADATA_DEADLOCK;
       if(rc == SQLITE_DONE)
@@ -292,7 +400,7 @@ metadb_artist_get_by_title(void *db, const char *title, int ds_id,
     rval = METADATA_DEADLOCK;
   }
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   return rval;
 }
 
@@ -309,7 +417,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
   sqlite3_stmt *sel;
 
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id "
 		  "FROM album "
 		  "WHERE title=?1 "
@@ -335,7 +443,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
     // No entry found, INSERT it
     sqlite3_stmt *ins;
 
-    rc = db_prepare(db, &ins,
+    rc = db_prepare_cached(db, &ins,
 		    "INSERT INTO album "
 		    "(title, ds_id, artist_id, ext_id) "
 		    "VALUES "
@@ -350,7 +458,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
 	sqlite3_bind_text(ins, 4, ext_id, -1, SQLITE_STATIC);
 
       rc = db_step(ins);
-      sqlite3_finalize(ins);
+      db_release(ins);
       if(rc == SQLITE_DONE)
 	rval = sqlite3_last_insert_rowid(db);
       if(rc == SQLITE_LOCKED)
@@ -359,7 +467,7 @@ metadb_album_get_by_title(void *db, const char *album, int64_t artist_id,
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   return rval;
 }
 
@@ -375,7 +483,7 @@ metadb_insert_albumart(void *db, int64_t album_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "INSERT INTO albumart "
 		  "(album_id, url, width, height) "
 		  "VALUES "
@@ -389,7 +497,7 @@ metadb_insert_albumart(void *db, int64_t album_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -403,7 +511,7 @@ metadb_insert_artistpic(void *db, int64_t artist_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "INSERT INTO artistpic "
 		  "(artist_id, url, width, height) "
 		  "VALUES "
@@ -417,7 +525,7 @@ metadb_insert_artistpic(void *db, int64_t artist_id, const char *url,
   if(width) sqlite3_bind_int64(ins, 3, width);
   if(height) sqlite3_bind_int64(ins, 4, height);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 /**
@@ -431,7 +539,7 @@ metadb_insert_videoart(void *db, int64_t videoitem_id, const char *url,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "INSERT OR REPLACE INTO videoart "
 		  "(videoitem_id, url, width, height, "
 		  "type, weight, grp, titled) "
@@ -451,7 +559,7 @@ metadb_insert_videoart(void *db, int64_t videoitem_id, const char *url,
   sqlite3_bind_int(ins, 8, titled);
 
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -464,7 +572,7 @@ metadb_delete_videoart(void *db, int64_t videoitem_id)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "DELETE FROM videoart WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
@@ -472,7 +580,7 @@ metadb_delete_videoart(void *db, int64_t videoitem_id)
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -495,7 +603,7 @@ metadb_insert_videocast(void *db, int64_t videoitem_id,
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "INSERT OR REPLACE INTO videocast "
 		  "(videoitem_id, name, character, department, job, "
 		  "\"order\", image, width, height, ext_id) "
@@ -516,7 +624,7 @@ metadb_insert_videocast(void *db, int64_t videoitem_id,
   if(height) sqlite3_bind_int(ins, 9, height);
   sqlite3_bind_text(ins, 10, ext_id, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -529,7 +637,7 @@ metadb_delete_videocast(void *db, int64_t videoitem_id)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "DELETE FROM videocast WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
@@ -537,7 +645,7 @@ metadb_delete_videocast(void *db, int64_t videoitem_id)
   
   sqlite3_bind_int64(ins, 1, videoitem_id);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -550,7 +658,7 @@ metadb_insert_videogenre(void *db, int64_t videoitem_id, const char *title)
   sqlite3_stmt *ins;
   int rc;
 
-  rc = db_prepare(db, &ins,
+  rc = db_prepare_cached(db, &ins,
 		  "INSERT OR REPLACE INTO videogenre "
 		  "(videoitem_id, title) "
 		  "VALUES "
@@ -562,7 +670,7 @@ metadb_insert_videogenre(void *db, int64_t videoitem_id, const char *title)
   sqlite3_bind_int64(ins, 1, videoitem_id);
   sqlite3_bind_text(ins, 2, title, -1, SQLITE_STATIC);
   db_step(ins);
-  sqlite3_finalize(ins);
+  db_release(ins);
 }
 
 
@@ -597,7 +705,7 @@ metadb_insert_audioitem(sqlite3 *db, int64_t item_id, const metadata_t *md,
   for(i = 0; i < 2; i++) {
     sqlite3_stmt *stmt;
 
-    rc = db_prepare(db, &stmt,
+    rc = db_prepare_cached(db, &stmt,
 		    i == 0 ? 
 		    "INSERT OR FAIL INTO audioitem "
 		    "(item_id, title, album_id, artist_id, duration, ds_id, track) "
@@ -631,7 +739,7 @@ metadb_insert_audioitem(sqlite3 *db, int64_t item_id, const metadata_t *md,
     sqlite3_bind_int(stmt, 6, md->md_track);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -680,7 +788,7 @@ metadb_get_album_art(void *db, const char *album, const char *artist)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT aa.url, aa.width, aa.height "
 		  "FROM artist,album,albumart AS aa "
 		  "WHERE artist.title=?1 "
@@ -694,7 +802,7 @@ metadb_get_album_art(void *db, const char *album, const char *artist)
   sqlite3_bind_text(sel, 1, artist, -1, SQLITE_STATIC);
   sqlite3_bind_text(sel, 2, album, -1, SQLITE_STATIC);
   rstr_t *r = metadb_construct_imageset(sel, 0, 1, 2);
-  sqlite3_finalize(sel);
+  db_release(sel);
   return r;
 }
 
@@ -708,7 +816,7 @@ metadb_get_video_art(void *db, int64_t videoitem_id, int type)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT url "
 		  "FROM videoart "
 		  "WHERE videoitem_id=?1 "
@@ -728,7 +836,7 @@ metadb_get_video_art(void *db, int64_t videoitem_id, int type)
     rstr_release(r);
   }
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   return rv;
 }
 
@@ -763,7 +871,7 @@ metadb_get_video_genre(sqlite3 *db, int64_t videoitem_id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT title "
 		  "FROM videogenre "
 		  "WHERE videoitem_id = ?1");
@@ -773,7 +881,7 @@ metadb_get_video_genre(sqlite3 *db, int64_t videoitem_id)
 
   sqlite3_bind_int64(sel, 1, videoitem_id);
   rstr_t *r = metadb_construct_list(sel, 0);
-  sqlite3_finalize(sel);
+  db_release(sel);
   return r;
 }
 
@@ -787,7 +895,7 @@ metadb_get_video_cast(sqlite3 *db, int64_t videoitem_id, metadata_t *md)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT name,character,department,job,image "
 		  "FROM videocast "
 		  "WHERE videoitem_id = ?1 "
@@ -811,7 +919,7 @@ metadb_get_video_cast(sqlite3 *db, int64_t videoitem_id, metadata_t *md)
     else
       TAILQ_INSERT_TAIL(&md->md_crew, mp, mp_link);
   }
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -830,7 +938,7 @@ metadb_get_artist_pics(void *db, const char *artist,
   int rc;
   sqlite3_stmt *sel;
   int rval = METADATA_PERMANENT_ERROR;
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT ap.url, ap.width, ap.height "
 		  "FROM artist,artistpic AS ap "
 		  "WHERE artist.title=?1 "
@@ -847,7 +955,7 @@ metadb_get_artist_pics(void *db, const char *artist,
        sqlite3_column_int(sel, 2));
     rval = 0;
   }
-  sqlite3_finalize(sel);
+  db_release(sel);
   return rval;
 }
 
@@ -874,7 +982,7 @@ metadb_insert_stream(sqlite3 *db, int64_t videoitem_id,
     return 0;
   }
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "INSERT INTO videostream "
 		  "(videoitem_id, streamindex, info, isolang, "
 		  "codec, mediatype, disposition, title) "
@@ -898,7 +1006,7 @@ metadb_insert_stream(sqlite3 *db, int64_t videoitem_id,
     sqlite3_bind_text(stmt, 8, rstr_get(ms->ms_title), -1, SQLITE_STATIC);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   return rc2metadatacode(rc);
 }
 
@@ -913,7 +1021,7 @@ metadb_set_streams(sqlite3 *db, int64_t videoitem_id, const metadata_t *md)
   sqlite3_stmt *stmt;
   int rc, r;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "DELETE FROM videostream WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
@@ -922,7 +1030,7 @@ metadb_set_streams(sqlite3 *db, int64_t videoitem_id, const metadata_t *md)
   sqlite3_bind_int64(stmt, 1, videoitem_id);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   if(rc != SQLITE_DONE)
@@ -954,7 +1062,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
     sqlite3_stmt *stmt;
 
     if(i == 1) {
-      rc = db_prepare(db, &stmt,
+      rc = db_prepare_cached(db, &stmt,
 		      "SELECT id "
 		      "FROM videoitem "
 		      "WHERE (?5 OR item_id = ?1) "
@@ -973,7 +1081,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 
       rc = db_step(stmt);
       if(rc != SQLITE_ROW) {
-	sqlite3_finalize(stmt);
+	db_release(stmt);
 	if(rc == SQLITE_LOCKED)
 	  return METADATA_DEADLOCK;
 	TRACE(TRACE_ERROR, "SQLITE", "SQL Error 0x%x at %s:%d",
@@ -981,11 +1089,11 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
 	return METADATA_PERMANENT_ERROR;
       }
       id = sqlite3_column_int64(stmt, 0);
-      sqlite3_finalize(stmt);
+      db_release(stmt);
     }
 
 
-    rc = db_prepare(db, &stmt,
+    rc = db_prepare_cached(db, &stmt,
 		    i == 0 ? 
 		    "INSERT OR FAIL INTO videoitem "
 		    "(item_id, ds_id, ext_id, "
@@ -1063,7 +1171,7 @@ metadb_insert_videoitem0(sqlite3 *db, int64_t item_id, int ds_id,
     sqlite3_bind_int64(stmt, 18, cfgid);
 
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     if(i == 0)
@@ -1124,7 +1232,7 @@ metadb_insert_imageitem(sqlite3 *db, int64_t item_id, const metadata_t *md)
   for(i = 0; i < 2; i++) {
     sqlite3_stmt *stmt;
 
-    rc = db_prepare(db, &stmt,
+    rc = db_prepare_cached(db, &stmt,
 		    i == 0 ? 
 		    "INSERT OR FAIL INTO imageitem "
 		    "(item_id, original_time, manufacturer, equipment) "
@@ -1153,7 +1261,7 @@ metadb_insert_imageitem(sqlite3 *db, int64_t item_id, const metadata_t *md)
 		      -1, SQLITE_STATIC);
     
     rc = db_step(stmt);
-    sqlite3_finalize(stmt);
+    db_release(stmt);
     if(rc == SQLITE_CONSTRAINT && i == 0)
       continue;
     break;
@@ -1222,7 +1330,7 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
     char *x = strrchr(sql, ',');
     if(x != NULL) {
       *x = ' ';
-      rc = db_prepare(db, &stmt, sql);
+      rc = db_prepare_cached(db, &stmt, sql);
 
       if(rc != SQLITE_OK)
         return METADATA_PERMANENT_ERROR;
@@ -1235,7 +1343,7 @@ metadb_metadata_writex(void *db, const char *url, time_t mtime,
       sqlite3_bind_int(stmt,   5, indexstatus);
 
       rc = db_step(stmt);
-      sqlite3_finalize(stmt);
+      db_release(stmt);
       if(rc == METADATA_DEADLOCK)
         return METADATA_DEADLOCK;
     }
@@ -1306,6 +1414,67 @@ metadb_metadata_write(void *db, const char *url, time_t mtime,
 }
 
 
+/**
+ * Write a number of items in a single transaction. Each item is
+ * protected by a savepoint so a failing item does not take the
+ * rest of the batch down with it.
+ *
+ * Returns -1 if the transaction itself failed. Nothing has been
+ * written then and the caller should fall back to writing the items
+ * one by one
+ */
+int
+metadb_metadata_write_batch(void *db, const metadb_write_item_t *items,
+                            int num, const char *parent, time_t parent_mtime)
+{
+  int i;
+
+ again:
+  if(db_begin(db))
+    return -1;
+
+  for(i = 0; i < num; i++) {
+    const metadb_write_item_t *mwi = &items[i];
+
+    switch(mwi->mwi_md->md_contenttype) {
+    case CONTENT_AUDIO:
+    case CONTENT_VIDEO:
+    case CONTENT_IMAGE:
+    case CONTENT_DIR:
+    case CONTENT_DVD:
+    case CONTENT_SHARE:
+      break;
+    default:
+      continue;
+    }
+
+    if(db_one_statement(db, "SAVEPOINT item;", __FUNCTION__))
+      goto bad;
+
+    int r = metadb_metadata_writex(db, mwi->mwi_url, mwi->mwi_mtime,
+                                   mwi->mwi_md, parent, parent_mtime,
+                                   mwi->mwi_indexstatus);
+
+    if(r == METADATA_DEADLOCK) {
+      db_rollback_deadlock(db);
+      goto again;
+    }
+
+    if(r && db_one_statement(db, "ROLLBACK TO item;", __FUNCTION__))
+      goto bad;
+    if(db_one_statement(db, "RELEASE item;", __FUNCTION__))
+      goto bad;
+  }
+  if(db_commit(db))
+    goto bad;
+  return 0;
+
+ bad:
+  db_rollback(db);
+  return -1;
+}
+
+
 typedef struct get_cache {
   int64_t gc_album_id;
   rstr_t *gc_album_title;
@@ -1342,7 +1511,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT title "
 		  "FROM artist "
 		  "WHERE id = ?1 AND ds_id=1"
@@ -1356,7 +1525,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1364,7 +1533,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
 
   rstr_release(gc->gc_artist_title);
   gc->gc_artist_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -1384,7 +1553,7 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT title "
 		  "FROM album "
 		  "WHERE id = ?1 AND ds_id=1");
@@ -1397,14 +1566,14 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   gc->gc_album_id = id;
   rstr_release(gc->gc_album_title);
   gc->gc_album_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -1419,7 +1588,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT title, album_id, artist_id, duration, track "
 		  "FROM audioitem "
 		  "WHERE item_id = ?1 AND ds_id = 1"
@@ -1433,7 +1602,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1448,7 +1617,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_duration = sqlite3_column_int(sel, 3) / 1000.0f;
   md->md_track = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -1463,7 +1632,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id, title, duration, format, year "
 		  "FROM videoitem "
 		  "WHERE item_id = ?1 "
@@ -1479,7 +1648,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1490,7 +1659,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_format = rstr_alloc((void *)sqlite3_column_text(sel, 3));
   md->md_year = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   return id;
 }
 
@@ -1505,7 +1674,7 @@ metadb_videoitem_set_preferred(void *db, const char *url, int64_t vid)
   sqlite3_stmt *stmt;
   int rc;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "UPDATE videoitem "
 		  "SET preferred = (CASE WHEN id=?2 THEN 1 ELSE 0 END) "
 		  "WHERE item_id = (SELECT id FROM item WHERE url = ?1)"
@@ -1518,7 +1687,7 @@ metadb_videoitem_set_preferred(void *db, const char *url, int64_t vid)
   sqlite3_bind_int64(stmt, 2, vid);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1534,7 +1703,7 @@ metadb_videoitem_delete_from_ds(void *db, const char *url, int ds)
   sqlite3_stmt *stmt;
   int rc;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "DELETE FROM videoitem "
 		  "WHERE item_id = (SELECT id FROM item WHERE url = ?1) AND "
 		  "ds_id = ?2"
@@ -1547,7 +1716,7 @@ metadb_videoitem_delete_from_ds(void *db, const char *url, int ds)
   sqlite3_bind_int(stmt, 2, ds);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1566,7 +1735,7 @@ metadb_videoitem_alternatives0(void *db, prop_t *p, const char *url, int dsid,
   sqlite3_stmt *sel;
   prop_vec_t *pv = prop_vec_create(10);
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT v.id, v.title, v.year, v.preferred, v.status "
 		  "FROM videoitem as v, item "
 		  "WHERE item.url = ?1 "
@@ -1619,7 +1788,7 @@ metadb_videoitem_alternatives0(void *db, prop_t *p, const char *url, int dsid,
   prop_ref_dec(active);
 
   prop_vec_release(pv);
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -1657,7 +1826,7 @@ metadb_item_set_preferred_ds(void *db, const char *url, int ds_id)
 {
   int rc;
   sqlite3_stmt *stmt;
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "UPDATE item "
 		  "SET ds_id = ?2 "
 		  "WHERE url=?1"
@@ -1673,7 +1842,7 @@ metadb_item_set_preferred_ds(void *db, const char *url, int ds_id)
     sqlite3_bind_null(stmt, 2);
 
   rc = db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   if(rc == SQLITE_LOCKED)
     return METADATA_DEADLOCK;
   return 0;
@@ -1693,7 +1862,7 @@ metadb_item_get_preferred_ds(const char *url)
   if((db = metadb_get()) == NULL)
     return METADATA_PERMANENT_ERROR;
 
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "SELECT ds_id "
 		  "FROM item "
 		  "WHERE url=?1"
@@ -1709,7 +1878,7 @@ metadb_item_get_preferred_ds(const char *url)
   rc = db_step(stmt);
   if(rc == SQLITE_ROW)
     id = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   metadb_close(db);
   return id;
 }
@@ -1729,7 +1898,7 @@ metadb_item_get_user_title(const char *url)
   if((db = metadb_get()) == NULL)
     return NULL;
 
-  rc = db_prepare(db, &stmt, 
+  rc = db_prepare_cached(db, &stmt, 
 		  "SELECT usertitle "
 		  "FROM item "
 		  "WHERE url=?1"
@@ -1746,7 +1915,7 @@ metadb_item_get_user_title(const char *url)
   if(rc == SQLITE_ROW)
     ret = db_rstr(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   metadb_close(db);
   return ret;
 }
@@ -1766,7 +1935,7 @@ metadb_item_set_user_title(const char *url, const char *str)
   if((db = metadb_get()) == NULL)
     return;
 
-  rc = db_prepare(db, &stmt, 
+  rc = db_prepare_cached(db, &stmt, 
 		  "UPDATE item "
 		  "SET usertitle=?2 "
 		  "WHERE url=?1"
@@ -1783,7 +1952,7 @@ metadb_item_set_user_title(const char *url, const char *str)
   sqlite3_bind_text(stmt, 2, str, -1, SQLITE_STATIC);
 
   db_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   metadb_close(db);
 }
 
@@ -1797,7 +1966,7 @@ metadb_get_videoinfo2(void *db, int64_t id, metadata_t **mdp)
   sqlite3_stmt *sel;
   int rc;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT v.parent_id, v.title, v.tagline, v.description, "
 		  "v.year, v.rating, v.rate_count, v.imdb_id, v.idx, v.type, "
 		  "v.id "
@@ -1813,7 +1982,7 @@ metadb_get_videoinfo2(void *db, int64_t id, metadata_t **mdp)
   rc = db_step(sel);
 
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_DEADLOCK;
   }
 
@@ -1849,7 +2018,7 @@ metadb_get_videoinfo2(void *db, int64_t id, metadata_t **mdp)
       metadb_get_videoinfo2(db, md->md_parent_id, &md->md_parent);
     *mdp = md;
   }
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -1864,7 +2033,7 @@ metadb_get_videoitem(void *db, const char *url)
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt, 
+  rc = db_prepare_cached(db, &stmt, 
 		  "SELECT videoitem.id "
 		  "FROM videoitem,item "
 		  "WHERE videoitem.item_id = item.id "
@@ -1880,7 +2049,7 @@ metadb_get_videoitem(void *db, const char *url)
     rval = sqlite3_column_int64(stmt, 0);
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   return rval;
 }
 
@@ -1901,7 +2070,7 @@ metadb_get_videoinfo(void *db, const char *url,
     *fixed_ds = 0;
   *mdp = NULL;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id, ds_id FROM item WHERE url = ?1"
 		  );
 
@@ -1912,19 +2081,19 @@ metadb_get_videoinfo(void *db, const char *url,
 
   rc = db_step(sel);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_DEADLOCK;
   }
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return 0;
   }
 
   int64_t item_id = sqlite3_column_int64(sel, 0);
   int ds_id = sqlite3_column_int(sel, 1);
 
-  sqlite3_finalize(sel);
+  db_release(sel);
 
   if(fixed_ds)
     *fixed_ds = ds_id;
@@ -1934,7 +2103,7 @@ metadb_get_videoinfo(void *db, const char *url,
     return 0;
   }
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT v.id, v.title, v.tagline, v.description, v.year, "
 		  "v.rating, v.rate_count, v.imdb_id, v.ds_id, v.status, "
 		  "v.preferred, v.ext_id, ds.id, ds.enabled, v.querytype, "
@@ -2031,7 +2200,7 @@ metadb_get_videoinfo(void *db, const char *url,
       metadb_get_videoinfo2(db, md->md_parent_id, &md->md_parent);
   }
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   *mdp = md;
   return 0;
 }
@@ -2049,7 +2218,7 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
   int strack = 0;
   int vtrack = 0;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT streamindex, info, isolang, codec, "
 		  "mediatype, disposition, title "
 		  "FROM videostream "
@@ -2088,7 +2257,7 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
 			sqlite3_column_int(sel, 5),
 			tn, -1);
   }
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -2102,7 +2271,7 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT original_time, manufacturer, equipment "
 		  "FROM imageitem "
 		  "WHERE item_id = ?1"
@@ -2116,14 +2285,14 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   md->md_time = sqlite3_column_int(sel, 0);
   md->md_manufacturer = rstr_alloc((void *)sqlite3_column_text(sel, 1));
   md->md_equipment = rstr_alloc((void *)sqlite3_column_text(sel, 2));
-  sqlite3_finalize(sel);
+  db_release(sel);
   return 0;
 }
 
@@ -2188,7 +2357,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   if(db_begin(db))
     return NULL;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id,contenttype,parent from item "
 		  "where url=?1 AND "
 		  "mtime=?2");
@@ -2204,7 +2373,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_release(sel);
     db_rollback(db);
     return NULL;
   }
@@ -2223,7 +2392,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
       METADATA_CACHE_STATUS_FULL :
       METADATA_CACHE_STATUS_UNPARENTED;
 
-  sqlite3_finalize(sel);
+  db_release(sel);
   db_rollback(db);
   return md;
 }
@@ -2253,7 +2422,7 @@ metadb_metadata_scandir(void *db, const char *url, time_t *mtime)
   sqlite3_stmt *sel;
   int rc;
 
-  rc = db_prepare(db, &sel,
+  rc = db_prepare_cached(db, &sel,
 		  "SELECT id, url, contenttype, mtime, indexstatus "
 		  "FROM item "
 		  "WHERE parent = ?1"
@@ -2297,7 +2466,7 @@ metadb_metadata_scandir(void *db, const char *url, time_t *mtime)
     }
   }
 
-  sqlite3_finalize(sel);
+  db_release(sel);
 
   get_cache_release(&gc);
 
@@ -2328,7 +2497,7 @@ metadb_unparent_item(void *db, const char *url)
 
   sqlite3_stmt *stmt;
     
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "UPDATE item SET parent = NULL WHERE url=?1"
 		  );
   
@@ -2344,7 +2513,7 @@ metadb_unparent_item(void *db, const char *url)
     goto again;
   }
 
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   db_commit(db);
 }
 
@@ -2368,7 +2537,7 @@ metadb_parent_item(void *db, const char *url, const char *parent_url)
   }
   sqlite3_stmt *stmt;
     
-  rc = db_prepare(db, &stmt,
+  rc = db_prepare_cached(db, &stmt,
 		  "UPDATE item SET parent = ?2 WHERE url=?1");
   
   if(rc != SQLITE_OK) {
@@ -2384,7 +2553,7 @@ metadb_parent_item(void *db, const char *url, const char *parent_url)
     goto again;
   }
 
-  sqlite3_finalize(stmt);
+  db_release(stmt);
   db_commit(db);
 }
 
@@ -24,24 +24,11 @@
 #include "callout.h"
 #include "arch/arch.h"
 
-static LIST_HEAD(, callout) callouts;
+static timerheap_t callouts;
 
 static hts_mutex_t callout_mutex;
 static hts_cond_t callout_cond;
 
-/**
- *htsmsg_t *props
- */
-static int
-calloutcmp(callout_t *a, callout_t *b)
-{
-  if(a->c_deadline < b->c_deadline)
-    return -1;
-  else if(a->c_deadline > b->c_deadline)
-    return 1;
- return 0;
-}
-
 
 /**
  *
@@ -52,28 +39,30 @@ callout_arm0(callout_t *d, callout_callback_t *callback, void *opaque,
              const char *file, int line)
 {
   lockmgr_fn_t *retain = NULL;
+  const int64_t deadline = arch_get_ts() + delta;
   hts_mutex_lock(&callout_mutex);
 
   if(d == NULL) {
-    d = malloc(sizeof(callout_t));
-  } else {
+    d = calloc(1, sizeof(callout_t));
+  }
 
-    if(d->c_callback != NULL) {
-      LIST_REMOVE(d, c_link);
-    } else {
-      retain = lockmgr;
-    }
+  if(d->c_callback != NULL) {
+    timerheap_update(&callouts, &d->c_entry, deadline);
+  } else {
+    retain = lockmgr;
+    timerheap_insert(&callouts, &d->c_entry, deadline);
   }
 
   d->c_callback = callback;
   d->c_opaque = opaque;
   d->c_delta = delta;
-  d->c_deadline = arch_get_ts() + delta;
   d->c_armed_by_file = file;
   d->c_armed_by_line = line;
   d->c_lockmgr = lockmgr;
-  LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp, callout_t);
-  hts_cond_signal(&callout_cond);
+
+  // Only need to wake up the callout thread if we're first in line
+  if(timerheap_first(&callouts) == &d->c_entry)
+    hts_cond_signal(&callout_cond);
   hts_mutex_unlock(&callout_mutex);
   if(retain)
     retain(opaque, LOCKMGR_RETAIN);
@@ -124,10 +113,11 @@ callout_rearm(callout_t *d, int64_t delta)
   hts_mutex_lock(&callout_mutex);
 
   if(d->c_callback != NULL) {
-    d->c_deadline += delta - d->c_delta;
+    timerheap_update(&callouts, &d->c_entry,
+                     d->c_entry.the_expire + delta - d->c_delta);
     d->c_delta = delta;
-    LIST_REMOVE(d, c_link);
-    LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp, callout_t);
+    if(timerheap_first(&callouts) == &d->c_entry)
+      hts_cond_signal(&callout_cond);
   }
 
   hts_mutex_unlock(&callout_mutex);
@@ -144,7 +134,7 @@ callout_disarm(callout_t *c)
   lockmgr_fn_t *lm;
   if(c->c_callback) {
     lm = c->c_lockmgr;
-    LIST_REMOVE(c, c_link);
+    timerheap_remove(&callouts, &c->c_entry);
     c->c_callback = NULL;
   } else {
     lm = NULL;
@@ -161,7 +151,8 @@ callout_disarm(callout_t *c)
 static void *
 callout_loop(void *aux)
 {
-  uint64_t now;
+  int64_t now;
+  timerheap_entry_t *the;
   callout_t *c;
   callout_callback_t *cc;
 
@@ -171,9 +162,11 @@ callout_loop(void *aux)
 
     now = arch_get_ts();
 
-    while((c = LIST_FIRST(&callouts)) != NULL && c->c_deadline <= now) {
+    while((the = timerheap_first(&callouts)) != NULL &&
+          the->the_expire <= now) {
+      c = (callout_t *)the;
       cc = c->c_callback;
-      LIST_REMOVE(c, c_link);
+      timerheap_remove(&callouts, the);
       c->c_callback = NULL;
       lockmgr_fn_t *lm = c->c_lockmgr;
       const char *file = c->c_armed_by_file;
@@ -199,9 +192,9 @@ callout_loop(void *aux)
       now = ts;
     }
 
-    if((c = LIST_FIRST(&callouts)) != NULL) {
+    if((the = timerheap_first(&callouts)) != NULL) {
 
-      int timeout = (c->c_deadline - now + 999) / 1000;
+      int timeout = (the->the_expire - now + 999) / 1000;
       hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
     } else {
       hts_cond_wait(&callout_cond, &callout_mutex);
@@ -22,16 +22,16 @@
 #include <stdint.h>
 #include "queue.h"
 #include "lockmgr.h"
+#include "timerheap.h"
 
 struct callout;
 typedef void (callout_callback_t)(struct callout *c, void *opaque);
 
 typedef struct callout {
-  LIST_ENTRY(callout) c_link;
+  timerheap_entry_t c_entry; // Must be first, valid when armed
   callout_callback_t *c_callback;
   lockmgr_fn_t *c_lockmgr;
   void *c_opaque;
-  uint64_t c_deadline;
   int64_t c_delta;
   const char *c_armed_by_file;
   int c_armed_by_line;
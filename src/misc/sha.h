@@ -64,3 +64,9 @@
 #else
 #error no sha1
 #endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+void sha1_digest(const void *data, size_t len, uint8_t *digest);
+
@@ -0,0 +1,193 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "sha.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA1_SHANI 1
+#include <immintrin.h>
+#include <cpuid.h>
+#else
+#define SHA1_SHANI 0
+#endif
+
+
+#if SHA1_SHANI
+
+/**
+ * Check for the SHA extensions (and SSSE3 + SSE4.1 which we also use)
+ */
+static int
+sha1_have_shani(void)
+{
+  static int cached = -1;
+  unsigned int eax, ebx, ecx, edx;
+
+  if(cached != -1)
+    return cached;
+
+  cached = 0;
+
+  if(__get_cpuid_max(0, NULL) < 7)
+    return 0;
+
+  __cpuid(1, eax, ebx, ecx, edx);
+  if(!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+    return 0;
+
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  cached = !!(ebx & (1 << 29));
+  return cached;
+}
+
+
+/**
+ * Process four rounds. 'g' is the round group (0 - 19) and must be a
+ * constant so the compiler can drop the message schedule steps not
+ * needed for a given group
+ */
+#define SHA1_ROUNDS4(g, E, Enext, M0, M1, M2, M3)                 \
+  do {                                                          \
+    if(g == 0)                                                  \
+      E = _mm_add_epi32(E, M0);                                 \
+    else                                                        \
+      E = _mm_sha1nexte_epu32(E, M0);                           \
+    Enext = ABCD;                                               \
+    if(g >= 3 && g <= 18)                                       \
+      M1 = _mm_sha1msg2_epu32(M1, M0);                          \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E, (g) / 5);               \
+    if(g >= 1 && g <= 16)                                       \
+      M3 = _mm_sha1msg1_epu32(M3, M0);                          \
+    if(g >= 2 && g <= 17)                                       \
+      M2 = _mm_xor_si128(M2, M0);                               \
+  } while(0)
+
+#define SHA1_LOAD(M, off)                                               \
+  M = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + off)), MASK)
+
+/**
+ *
+ */
+static void __attribute__((target("sha,sse4.1,ssse3")))
+sha1_blocks_shani(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+  __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+  __m128i MSG0, MSG1, MSG2, MSG3;
+  const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL,
+                                      0x08090a0b0c0d0e0fULL);
+
+  ABCD = _mm_loadu_si128((const __m128i *)state);
+  E0 = _mm_set_epi32(state[4], 0, 0, 0);
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1b);
+
+  while(blocks--) {
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    SHA1_LOAD(MSG0, 0);
+    SHA1_ROUNDS4(0,  E0, E1, MSG0, MSG1, MSG2, MSG3);
+    SHA1_LOAD(MSG1, 16);
+    SHA1_ROUNDS4(1,  E1, E0, MSG1, MSG2, MSG3, MSG0);
+    SHA1_LOAD(MSG2, 32);
+    SHA1_ROUNDS4(2,  E0, E1, MSG2, MSG3, MSG0, MSG1);
+    SHA1_LOAD(MSG3, 48);
+    SHA1_ROUNDS4(3,  E1, E0, MSG3, MSG0, MSG1, MSG2);
+    SHA1_ROUNDS4(4,  E0, E1, MSG0, MSG1, MSG2, MSG3);
+    SHA1_ROUNDS4(5,  E1, E0, MSG1, MSG2, MSG3, MSG0);
+    SHA1_ROUNDS4(6,  E0, E1, MSG2, MSG3, MSG0, MSG1);
+    SHA1_ROUNDS4(7,  E1, E0, MSG3, MSG0, MSG1, MSG2);
+    SHA1_ROUNDS4(8,  E0, E1, MSG0, MSG1, MSG2, MSG3);
+    SHA1_ROUNDS4(9,  E1, E0, MSG1, MSG2, MSG3, MSG0);
+    SHA1_ROUNDS4(10, E0, E1, MSG2, MSG3, MSG0, MSG1);
+    SHA1_ROUNDS4(11, E1, E0, MSG3, MSG0, MSG1, MSG2);
+    SHA1_ROUNDS4(12, E0, E1, MSG0, MSG1, MSG2, MSG3);
+    SHA1_ROUNDS4(13, E1, E0, MSG1, MSG2, MSG3, MSG0);
+    SHA1_ROUNDS4(14, E0, E1, MSG2, MSG3, MSG0, MSG1);
+    SHA1_ROUNDS4(15, E1, E0, MSG3, MSG0, MSG1, MSG2);
+    SHA1_ROUNDS4(16, E0, E1, MSG0, MSG1, MSG2, MSG3);
+    SHA1_ROUNDS4(17, E1, E0, MSG1, MSG2, MSG3, MSG0);
+    SHA1_ROUNDS4(18, E0, E1, MSG2, MSG3, MSG0, MSG1);
+    SHA1_ROUNDS4(19, E1, E0, MSG3, MSG0, MSG1, MSG2);
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    data += 64;
+  }
+
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1b);
+  _mm_storeu_si128((__m128i *)state, ABCD);
+  state[4] = _mm_extract_epi32(E0, 3);
+}
+
+
+/**
+ *
+ */
+static void
+sha1_shani(const uint8_t *data, size_t len, uint8_t *digest)
+{
+  uint32_t state[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+  };
+  uint8_t tail[128] = {0};
+  const uint64_t bits = (uint64_t)len * 8;
+
+  sha1_blocks_shani(state, data, len / 64);
+
+  const size_t rem = len & 63;
+  memcpy(tail, data + len - rem, rem);
+  tail[rem] = 0x80;
+
+  const size_t tlen = rem < 56 ? 64 : 128;
+  for(int i = 0; i < 8; i++)
+    tail[tlen - 1 - i] = bits >> (i * 8);
+
+  sha1_blocks_shani(state, tail, tlen / 64);
+
+  for(int i = 0; i < 5; i++) {
+    digest[i * 4 + 0] = state[i] >> 24;
+    digest[i * 4 + 1] = state[i] >> 16;
+    digest[i * 4 + 2] = state[i] >> 8;
+    digest[i * 4 + 3] = state[i];
+  }
+}
+
+#endif
+
+
+/**
+ * One-shot SHA-1, uses the CPU's SHA instructions if available
+ */
+void
+sha1_digest(const void *data, size_t len, uint8_t *digest)
+{
+#if SHA1_SHANI
+  if(sha1_have_shani()) {
+    sha1_shani(data, len, digest);
+    return;
+  }
+#endif
+  sha1_decl(shactx);
+  sha1_init(shactx);
+  sha1_update(shactx, data, len);
+  sha1_final(shactx, digest);
+}
@@ -0,0 +1,229 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include "timerheap.h"
+
+#define TIMERHEAP_ARITY 4
+
+#define PARENT(i)     (((i) - 1) / TIMERHEAP_ARITY)
+#define FIRSTCHILD(i) ((i) * TIMERHEAP_ARITY + 1)
+
+
+/**
+ *
+ */
+static void
+timerheap_set(timerheap_t *th, unsigned int idx, timerheap_entry_t *the)
+{
+  th->th_vec[idx] = the;
+  the->the_index = idx;
+}
+
+
+/**
+ *
+ */
+static void
+timerheap_sift_up(timerheap_t *th, unsigned int idx)
+{
+  timerheap_entry_t *the = th->th_vec[idx];
+
+  while(idx > 0) {
+    const unsigned int p = PARENT(idx);
+    if(th->th_vec[p]->the_expire <= the->the_expire)
+      break;
+    timerheap_set(th, idx, th->th_vec[p]);
+    idx = p;
+  }
+  timerheap_set(th, idx, the);
+}
+
+
+/**
+ *
+ */
+static void
+timerheap_sift_down(timerheap_t *th, unsigned int idx)
+{
+  timerheap_entry_t *the = th->th_vec[idx];
+
+  while(1) {
+    const unsigned int first = FIRSTCHILD(idx);
+    if(first >= th->th_size)
+      break;
+
+    unsigned int last = first + TIMERHEAP_ARITY;
+    if(last > th->th_size)
+      last = th->th_size;
+
+    unsigned int best = first;
+    for(unsigned int c = first + 1; c < last; c++)
+      if(th->th_vec[c]->the_expire < th->th_vec[best]->the_expire)
+        best = c;
+
+    if(the->the_expire <= th->th_vec[best]->the_expire)
+      break;
+
+    timerheap_set(th, idx, th->th_vec[best]);
+    idx = best;
+  }
+  timerheap_set(th, idx, the);
+}
+
+
+/**
+ *
+ */
+void
+timerheap_insert(timerheap_t *th, timerheap_entry_t *the, int64_t expire)
+{
+  if(th->th_size == th->th_capacity) {
+    th->th_capacity = th->th_capacity * 2 + 16;
+    th->th_vec = realloc(th->th_vec,
+                         th->th_capacity * sizeof(timerheap_entry_t *));
+  }
+
+  the->the_expire = expire;
+  timerheap_set(th, th->th_size, the);
+  th->th_size++;
+  timerheap_sift_up(th, the->the_index);
+}
+
+
+/**
+ *
+ */
+void
+timerheap_remove(timerheap_t *th, timerheap_entry_t *the)
+{
+  const unsigned int idx = the->the_index;
+
+  assert(idx < th->th_size && th->th_vec[idx] == the);
+
+  th->th_size--;
+  if(idx == th->th_size)
+    return;
+
+  timerheap_entry_t *last = th->th_vec[th->th_size];
+  timerheap_set(th, idx, last);
+
+  if(idx > 0 && last->the_expire < th->th_vec[PARENT(idx)]->the_expire)
+    timerheap_sift_up(th, idx);
+  else
+    timerheap_sift_down(th, idx);
+}
+
+
+/**
+ *
+ */
+void
+timerheap_update(timerheap_t *th, timerheap_entry_t *the, int64_t expire)
+{
+  const int64_t prev = the->the_expire;
+
+  assert(the->the_index < th->th_size && th->th_vec[the->the_index] == the);
+
+  the->the_expire = expire;
+  if(expire < prev)
+    timerheap_sift_up(th, the->the_index);
+  else if(expire > prev)
+    timerheap_sift_down(th, the->the_index);
+}
+
+
+
+// gcc -O2 src/misc/timerheap.c -o /tmp/timerheap -Isrc -DLOCAL_MAIN
+
+#ifdef LOCAL_MAIN
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#define NUM_TIMERS 100000
+#define NUM_CHURN  10000000
+
+static int64_t
+get_ts(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int
+main(int argc, char **argv)
+{
+  timerheap_t th = {0};
+  timerheap_entry_t *t = calloc(NUM_TIMERS, sizeof(timerheap_entry_t));
+  char *armed = calloc(NUM_TIMERS, 1);
+  int64_t ts;
+
+  srand(1);
+
+  ts = get_ts();
+  for(int i = 0; i < NUM_TIMERS; i++) {
+    timerheap_insert(&th, &t[i], rand());
+    armed[i] = 1;
+  }
+  printf("Armed %d timers in %dµs\n", NUM_TIMERS, (int)(get_ts() - ts));
+
+  // Mimic connection timeouts: timers are constantly rearmed or
+  // disarmed and armed again
+  ts = get_ts();
+  for(int i = 0; i < NUM_CHURN; i++) {
+    const int n = rand() % NUM_TIMERS;
+    if(!armed[n]) {
+      timerheap_insert(&th, &t[n], rand());
+      armed[n] = 1;
+    } else if(i & 1) {
+      timerheap_update(&th, &t[n], rand());
+    } else {
+      timerheap_remove(&th, &t[n]);
+      armed[n] = 0;
+    }
+  }
+  ts = get_ts() - ts;
+  printf("%d arm/rearm/disarm ops in %dµs (%.1f ns/op)\n",
+         NUM_CHURN, (int)ts, ts * 1000.0 / NUM_CHURN);
+
+  // Drain and verify ordering
+  timerheap_entry_t *the;
+  int64_t prev = INT64_MIN;
+  int n = 0;
+  ts = get_ts();
+  while((the = timerheap_first(&th)) != NULL) {
+    if(the->the_expire < prev) {
+      printf("Heap order violated at %d\n", n);
+      return 1;
+    }
+    prev = the->the_expire;
+    timerheap_remove(&th, the);
+    n++;
+  }
+  printf("Expired %d timers in order in %dµs\n", n, (int)(get_ts() - ts));
+  free(th.th_vec);
+  free(t);
+  free(armed);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Intrusive 4-ary min-heap of timers keyed on expire time
+ *
+ * Insert, remove and update are O(log n), finding the first timer to
+ * expire is O(1). The entry is embedded in the user's timer struct,
+ * put it first in the struct so the entry can be cast back.
+ *
+ * A zeroed timerheap_t is an empty heap.
+ */
+typedef struct timerheap_entry {
+  int64_t the_expire;
+  unsigned int the_index;
+} timerheap_entry_t;
+
+typedef struct timerheap {
+  timerheap_entry_t **th_vec;
+  unsigned int th_size;
+  unsigned int th_capacity;
+} timerheap_t;
+
+void timerheap_insert(timerheap_t *th, timerheap_entry_t *the, int64_t expire);
+
+void timerheap_remove(timerheap_t *th, timerheap_entry_t *the);
+
+void timerheap_update(timerheap_t *th, timerheap_entry_t *the, int64_t expire);
+
+static __inline timerheap_entry_t *
+timerheap_first(const timerheap_t *th)
+{
+  return th->th_size ? th->th_vec[0] : NULL;
+}
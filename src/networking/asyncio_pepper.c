@@ -96,8 +96,7 @@ static PP_Resource asyncio_msgloop;
 static void (*workers[MAX_WORKERS])(void);
 static int workers_cnt;
 
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
-static struct asyncio_timer_list asyncio_timers;
+static timerheap_t asyncio_timers;
 
 static void tcp_do_write(asyncio_fd_t *af);
 static void tcp_do_recv(asyncio_fd_t *af);
@@ -159,19 +158,7 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 {
   at->at_fn = fn;
   at->at_opaque = opaque;
-  at->at_expire = 0;
-}
-
-
-/**
- *
- */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
-{
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  at->at_entry.the_expire = 0;
 }
 
 
@@ -181,12 +168,13 @@ at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
 static void
 process_timers(int64_t now)
 {
-  asyncio_timer_t *at;
+  timerheap_entry_t *the;
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= now) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  while((the = timerheap_first(&asyncio_timers)) != NULL &&
+        the->the_expire <= now) {
+    asyncio_timer_t *at = (asyncio_timer_t *)the;
+    timerheap_remove(&asyncio_timers, the);
+    at->at_entry.the_expire = 0;
     at->at_fn(at->at_opaque);
   }
 }
@@ -198,11 +186,10 @@ process_timers(int64_t now)
 void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
-
-  at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  if(at->at_entry.the_expire)
+    timerheap_update(&asyncio_timers, &at->at_entry, expire);
+  else
+    timerheap_insert(&asyncio_timers, &at->at_entry, expire);
 }
 
 
@@ -222,9 +209,9 @@ asyncio_timer_arm_delta_sec(asyncio_timer_t *at, int delta)
 void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  if(at->at_entry.the_expire) {
+    timerheap_remove(&asyncio_timers, &at->at_entry);
+    at->at_entry.the_expire = 0;
   }
 }
 
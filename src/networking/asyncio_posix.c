@@ -34,6 +34,14 @@
 #include "prop/prop.h"
 #include "misc/minmax.h"
 
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef ASYNCIO_BENCHMARK
+#include <sys/resource.h>
+#endif
+
 
 /**
  *
@@ -56,19 +64,22 @@ static void asyncio_ssl_handshake(asyncio_fd_t *af);
 
 LIST_HEAD(asyncio_fd_list, asyncio_fd);
 LIST_HEAD(asyncio_worker_list, asyncio_worker);
-LIST_HEAD(asyncio_timer_list, asyncio_timer);
 TAILQ_HEAD(asyncio_dns_req_queue, asyncio_dns_req);
 TAILQ_HEAD(asyncio_task_queue, asyncio_task);
 
 static hts_thread_t asyncio_thread_id;
 
-static struct asyncio_timer_list asyncio_timers;
+static timerheap_t asyncio_timers;
 
 static hts_mutex_t asyncio_worker_mutex;
 static struct asyncio_worker_list asyncio_workers;
 
 static int asyncio_pipe[2];
 static struct asyncio_fd_list asyncio_fds;
+static struct asyncio_fd_list asyncio_errored_fds;
+#if ENABLE_EPOLL && ENABLE_OPENSSL
+static struct asyncio_fd_list asyncio_ssl_fds;
+#endif
 static int asyncio_num_fds;
 
 struct prop_courier *asyncio_courier;
@@ -85,6 +96,11 @@ static void adr_deliver_cb(void);
 
 static int64_t async_now;
 
+#if ENABLE_EPOLL
+#define ASYNCIO_EPOLL_MAX_EVENTS 64
+static int asyncio_epfd = -1;
+#endif
+
 static __inline void asyncio_verify_thread(void) {
   assert(hts_thread_current() == asyncio_thread_id);
 }
@@ -120,13 +136,20 @@ struct asyncio_fd {
   htsbuf_queue_t af_sendq;
   htsbuf_queue_t af_recvq;
 
-  int64_t af_timeout;
+  asyncio_timer_t af_timeout;
+
+  LIST_ENTRY(asyncio_fd) af_errored_link; // Linked if af_pending_errno != 0
 
   int af_refcount;
   int af_fd;
   int af_poll_events;
   int af_pending_errno;
 
+#if ENABLE_EPOLL
+  int af_epoll_fd;     // fd as registered with epoll, -1 if not registered
+  int af_epoll_events; // Events (in poll(2) flags) registered with epoll
+#endif
+
   uint16_t af_ext_events;
   uint8_t af_connected;
 
@@ -145,6 +168,9 @@ struct asyncio_fd {
   int af_ssl_write_status;
   int af_ssl_established;
   SSL *af_ssl;
+#if ENABLE_EPOLL
+  LIST_ENTRY(asyncio_fd) af_ssl_link;
+#endif
 #endif
 
 };
@@ -273,19 +299,7 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 {
   at->at_fn = fn;
   at->at_opaque = opaque;
-  at->at_expire = 0;
-}
-
-
-/**
- *
- */
-static int
-at_compar(const asyncio_timer_t *a, const asyncio_timer_t *b)
-{
-  if(a->at_expire < b->at_expire)
-    return -1;
-  return 1;
+  at->at_entry.the_expire = 0;
 }
 
 
@@ -296,11 +310,10 @@ void
 asyncio_timer_arm(asyncio_timer_t *at, int64_t expire)
 {
   asyncio_verify_thread();
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
-
-  at->at_expire = expire;
-  LIST_INSERT_SORTED(&asyncio_timers, at, at_link, at_compar, asyncio_timer_t);
+  if(at->at_entry.the_expire)
+    timerheap_update(&asyncio_timers, &at->at_entry, expire);
+  else
+    timerheap_insert(&asyncio_timers, &at->at_entry, expire);
 }
 
 
@@ -321,13 +334,38 @@ void
 asyncio_timer_disarm(asyncio_timer_t *at)
 {
   asyncio_verify_thread();
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  if(at->at_entry.the_expire) {
+    timerheap_remove(&asyncio_timers, &at->at_entry);
+    at->at_entry.the_expire = 0;
   }
 }
 
 
+/**
+ * Return poll timeout (in ms) until next timer expires, -1 if none
+ */
+static int
+asyncio_timers_timeout(void)
+{
+  const timerheap_entry_t *the = timerheap_first(&asyncio_timers);
+  if(the == NULL)
+    return -1;
+  return MIN(INT32_MAX, MAX(0, (the->the_expire - async_now + 999) / 1000));
+}
+
+
+/**
+ * Error will be delivered to the fd's callback from the poll loop
+ */
+static void
+af_set_pending_errno(asyncio_fd_t *af, int err)
+{
+  if(!af->af_pending_errno)
+    LIST_INSERT_HEAD(&asyncio_errored_fds, af, af_errored_link);
+  af->af_pending_errno = err;
+}
+
+
 /**
  *
  */
@@ -364,43 +402,209 @@ events_to_poll(int events)
     (events & ASYNCIO_ERROR ? (POLLHUP|POLLERR) : 0);
 }
 
+#if ENABLE_EPOLL
+
 /**
  *
  */
+static int
+poll_to_epoll(int events)
+{
+  return
+    (events & POLLIN  ? EPOLLIN  : 0) |
+    (events & POLLOUT ? EPOLLOUT : 0) |
+    (events & POLLERR ? EPOLLERR : 0) |
+    (events & POLLHUP ? EPOLLHUP : 0);
+}
+
+
+/**
+ *
+ */
+static int
+epoll_to_poll(int events)
+{
+  return
+    (events & EPOLLIN  ? POLLIN  : 0) |
+    (events & EPOLLOUT ? POLLOUT : 0) |
+    (events & EPOLLERR ? POLLERR : 0) |
+    (events & EPOLLHUP ? POLLHUP : 0);
+}
+
+
+/**
+ * Make the epoll interest set for the fd match 'events'.
+ *
+ * A syscall is only issued if the registered fd or events differ from
+ * what we want, so calling this repeatedly with the same events is cheap
+ */
 static void
-asyncio_dopoll(void)
+asyncio_epoll_update(asyncio_fd_t *af, int events)
 {
-  asyncio_timer_t *at;
+  struct epoll_event ev = {0};
 
-  while((at = LIST_FIRST(&asyncio_timers)) != NULL &&
-        at->at_expire <= async_now) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
-    at->at_fn(at->at_opaque);
-  }
+  if(asyncio_epfd == -1)
+    return;
 
-  asyncio_fd_t *af;
-  struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
-  asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
-  int n = 0;
+  if(af->af_epoll_fd != af->af_fd) {
 
-  int timeout = INT32_MAX;
+    if(af->af_epoll_fd != -1)
+      epoll_ctl(asyncio_epfd, EPOLL_CTL_DEL, af->af_epoll_fd, &ev);
+    af->af_epoll_fd = -1;
 
-  LIST_FOREACH(af, &asyncio_fds, af_link) {
-    if(af->af_pending_errno) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
-      goto release;
+    if(af->af_fd == -1)
+      return;
+
+    ev.events = poll_to_epoll(events);
+    ev.data.ptr = af;
+    if(epoll_ctl(asyncio_epfd, EPOLL_CTL_ADD, af->af_fd, &ev)) {
+      TRACE(TRACE_ERROR, "ASYNCIO", "Unable to add %s to epoll -- %s",
+            af->af_name, strerror(errno));
+      af_set_pending_errno(af, errno);
+      return;
     }
+    af->af_epoll_fd = af->af_fd;
+    af->af_epoll_events = events;
+    return;
+  }
+
+  if(af->af_fd == -1 || af->af_epoll_events == events)
+    return;
+
+  ev.events = poll_to_epoll(events);
+  ev.data.ptr = af;
+  if(epoll_ctl(asyncio_epfd, EPOLL_CTL_MOD, af->af_fd, &ev)) {
+    TRACE(TRACE_ERROR, "ASYNCIO", "Unable to modify %s in epoll -- %s",
+          af->af_name, strerror(errno));
+    af_set_pending_errno(af, errno);
+    return;
+  }
+  af->af_epoll_events = events;
+}
+
+#endif
+
+
+/**
+ * Close the fd. Must be used instead of plain close() so the epoll
+ * registration is dropped before the fd number can be reused
+ */
+static void
+asyncio_close_fd(asyncio_fd_t *af)
+{
+  if(af->af_fd == -1)
+    return;
+
+#if ENABLE_EPOLL
+  if(af->af_epoll_fd != -1) {
+    struct epoll_event ev = {0};
+    epoll_ctl(asyncio_epfd, EPOLL_CTL_DEL, af->af_epoll_fd, &ev);
+    af->af_epoll_fd = -1;
+  }
+#endif
+
+  close(af->af_fd);
+  af->af_fd = -1;
+}
+
+
+/**
+ * Deliver events (in poll(2) flags) to an fd
+ */
+static void
+asyncio_dispatch(asyncio_fd_t *af, int revents)
+{
+  if(af->af_callback == NULL)
+    return;
 
-    if(af->af_timeout) {
-      if(af->af_timeout <= async_now) {
-        af->af_timeout = 0;
-        af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
-        goto release;
+  if(revents & POLLHUP) {
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
+    return;
+  }
+
+  if(revents & POLLERR) {
+    int err;
+    socklen_t errlen = sizeof(int);
+
+    if(getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen)) {
+      TRACE(TRACE_ERROR, "ASYNCIO", "getsockopt failed for %s 0x%x -- %s",
+            af->af_name, af->af_fd, strerror(errno));
+      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ENOBUFS);
+    } else {
+      if(err) {
+        af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
+        return;
       }
-      timeout = MIN(timeout, (af->af_timeout - async_now + 999) / 1000);
     }
+  }
+
+  const int events =
+    (revents & POLLIN  ? ASYNCIO_READ  : 0) |
+    (revents & POLLOUT ? ASYNCIO_WRITE : 0);
+
+  if(events)
+    af->af_callback(af, af->af_opaque, events, 0);
+}
+
+
+#if ENABLE_EPOLL
+/**
+ * epoll(7) based polling. Interest is registered when events change
+ * (see asyncio_epoll_update()) so we only need to care about the fds
+ * that are actually ready
+ */
+static void
+asyncio_dopoll_epoll(void)
+{
+  struct epoll_event evs[ASYNCIO_EPOLL_MAX_EVENTS];
+  asyncio_fd_t *afds[ASYNCIO_EPOLL_MAX_EVENTS];
+
+#if ENABLE_OPENSSL
+  asyncio_fd_t *af;
+
+  // SSL wants a different set of events depending on the state of
+  // the SSL engine so they need to be recomputed every round
+  LIST_FOREACH(af, &asyncio_ssl_fds, af_ssl_link)
+    if(af->af_fd != -1)
+      asyncio_epoll_update(af, asyncio_ssl_events(af));
+#endif
+
+  int n = epoll_wait(asyncio_epfd, evs, ASYNCIO_EPOLL_MAX_EVENTS,
+                     asyncio_timers_timeout());
+
+  async_now = arch_get_ts();
+
+  if(n <= 0)
+    return;
+
+  // Hold a reference on all fds while dispatching as a callback
+  // may delete any other fd in this batch
+  for(int i = 0; i < n; i++) {
+    afds[i] = evs[i].data.ptr;
+    afds[i]->af_refcount++;
+  }
 
+  for(int i = 0; i < n; i++)
+    asyncio_dispatch(afds[i], epoll_to_poll(evs[i].events));
+
+  for(int i = 0; i < n; i++)
+    af_release(afds[i]);
+}
+#endif
+
+
+/**
+ * poll(2) based polling
+ */
+static void
+asyncio_dopoll_poll(void)
+{
+  asyncio_fd_t *af;
+  struct pollfd *fds = alloca(asyncio_num_fds * sizeof(struct pollfd));
+  asyncio_fd_t **afds  = alloca(asyncio_num_fds * sizeof(asyncio_fd_t *));
+  int n = 0;
+
+  LIST_FOREACH(af, &asyncio_fds, af_link) {
     if(af->af_fd == -1) {
       continue;
     }
@@ -421,66 +625,49 @@ asyncio_dopoll(void)
     n++;
   }
 
-  if((at = LIST_FIRST(&asyncio_timers)) != NULL)
-    timeout = MIN(timeout, (at->at_expire - async_now + 999) / 1000);
-
-  if(timeout == INT32_MAX)
-    timeout = -1;
-
-  int err = poll(fds, n, timeout);
+  int err = poll(fds, n, asyncio_timers_timeout());
 
   async_now = arch_get_ts();
 
-  for(int i = 0; i < n; i++) {
-    af = afds[i];
-
-    if(af->af_callback == NULL)
-      continue;
-
-    if(fds[i].revents & POLLHUP) {
-      af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ECONNRESET);
-      continue;
-    }
-
-    if(fds[i].revents & POLLERR || err < 0) {
-      int err;
-      socklen_t errlen = sizeof(int);
-
-      if(getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, (void *)&err, &errlen)) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "getsockopt failed for %s 0x%x -- %s",
-              af->af_name, af->af_fd, strerror(errno));
-        af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, ENOBUFS);
-      } else {
-        if(err) {
-          af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, err);
-          continue;
-        }
-      }
-    }
+  for(int i = 0; i < n; i++)
+    asyncio_dispatch(afds[i], fds[i].revents | (err < 0 ? POLLERR : 0));
 
-    const int events =
-      (fds[i].revents & POLLIN  ? ASYNCIO_READ  : 0) |
-      (fds[i].revents & POLLOUT ? ASYNCIO_WRITE : 0);
+  for(int i = 0; i < n; i++)
+    af_release(afds[i]);
+}
 
-    if(events)
-      af->af_callback(af, af->af_opaque, events, 0);
 
-    if(0) {
-      int64_t now = arch_get_ts();
+/**
+ *
+ */
+static void
+asyncio_dopoll(void)
+{
+  timerheap_entry_t *the;
+  asyncio_fd_t *af;
 
-      if(now - async_now > 10000) {
-        TRACE(TRACE_ERROR, "ASYNCIO", "Long callback on socktet %s (%d µs)",
-              af->af_name, (int) (now - async_now));
-      }
-      async_now = now;
-    }
+  while((the = timerheap_first(&asyncio_timers)) != NULL &&
+        the->the_expire <= async_now) {
+    asyncio_timer_t *at = (asyncio_timer_t *)the;
+    timerheap_remove(&asyncio_timers, the);
+    at->at_entry.the_expire = 0;
+    at->at_fn(at->at_opaque);
   }
 
+  if((af = LIST_FIRST(&asyncio_errored_fds)) != NULL) {
+    // Error stays pending (and is delivered every round) until the
+    // fd is deleted. Callback may delete any fd so just do one per round
+    af->af_callback(af, af->af_opaque, ASYNCIO_ERROR, af->af_pending_errno);
+    return;
+  }
 
- release:
-
-  for(int i = 0; i < n; i++)
-    af_release(afds[i]);
+#if ENABLE_EPOLL
+  if(asyncio_epfd != -1) {
+    asyncio_dopoll_epoll();
+    return;
+  }
+#endif
+  asyncio_dopoll_poll();
 }
 
 
@@ -494,6 +681,14 @@ asyncio_set_events(asyncio_fd_t *af, int events)
   af->af_ext_events = events;
 
   af->af_poll_events = events_to_poll(events);
+
+#if ENABLE_EPOLL
+#if ENABLE_OPENSSL
+  if(af->af_ssl != NULL)
+    return; // Updated from asyncio_dopoll_epoll()
+#endif
+  asyncio_epoll_update(af, af->af_poll_events);
+#endif
 }
 
 
@@ -517,6 +712,32 @@ asyncio_rem_events(asyncio_fd_t *af, int events)
 }
 
 
+#if ENABLE_OPENSSL
+/**
+ *
+ */
+static void
+af_attach_ssl(asyncio_fd_t *af, SSL *ssl)
+{
+  af->af_ssl = ssl;
+#if ENABLE_EPOLL
+  LIST_INSERT_HEAD(&asyncio_ssl_fds, af, af_ssl_link);
+#endif
+}
+#endif
+
+
+/**
+ *
+ */
+static void
+asyncio_fd_timeout(void *opaque)
+{
+  asyncio_fd_t *af = opaque;
+  af->af_callback(af, af->af_opaque, ASYNCIO_TIMEOUT, 0);
+}
+
+
 /**
  *
  */
@@ -531,6 +752,10 @@ asyncio_add_fd(int fd, int events, asyncio_fd_callback_t *cb, void *opaque,
   af->af_refcount = 1;
   af->af_fd = fd;
   af->af_name = strdup(name);
+#if ENABLE_EPOLL
+  af->af_epoll_fd = -1;
+#endif
+  asyncio_timer_init(&af->af_timeout, asyncio_fd_timeout, af);
   asyncio_set_events(af, events);
   af->af_callback = cb;
   af->af_opaque = opaque;
@@ -553,15 +778,22 @@ asyncio_del_fd(asyncio_fd_t *af)
 
 #if ENABLE_OPENSSL
   if(af->af_ssl != NULL) {
+#if ENABLE_EPOLL
+    LIST_REMOVE(af, af_ssl_link);
+#endif
     SSL_shutdown(af->af_ssl);
     SSL_free(af->af_ssl);
     af->af_ssl = NULL;
   }
 #endif
 
-  if(af->af_fd != -1)
-    close(af->af_fd);
-  af->af_fd = -1;
+  if(af->af_pending_errno) {
+    LIST_REMOVE(af, af_errored_link);
+    af->af_pending_errno = 0;
+  }
+
+  asyncio_timer_disarm(&af->af_timeout);
+  asyncio_close_fd(af);
   LIST_REMOVE(af, af_link);
   asyncio_num_fds--;
   af->af_callback = NULL;
@@ -575,7 +807,7 @@ asyncio_del_fd(asyncio_fd_t *af)
 void
 asyncio_set_timeout_delta_sec(asyncio_fd_t *af, int delta)
 {
-  af->af_timeout = delta * 1000000LL + async_now;
+  asyncio_timer_arm(&af->af_timeout, delta * 1000000LL + async_now);
 }
 
 /**
@@ -647,6 +879,107 @@ asyncio_add_worker(void (*fn)(void))
 
 
 
+#ifdef ASYNCIO_BENCHMARK
+
+/**
+ * Measure wakeup latency for one active socket while a number of idle
+ * sockets are registered. Build with -DASYNCIO_BENCHMARK, the process
+ * will run the benchmark from the asyncio thread and then exit
+ */
+static int asyncio_bench_hits;
+
+static int
+asyncio_bench_cb(asyncio_fd_t *af, void *opaque, int events, int error)
+{
+  char buf[64];
+  if(events & ASYNCIO_READ && read(af->af_fd, buf, sizeof(buf)) > 0)
+    asyncio_bench_hits++;
+  return 0;
+}
+
+
+static void
+asyncio_bench_run(const char *backend, int num_idle, int rounds)
+{
+  asyncio_fd_t **idle = malloc(num_idle * sizeof(asyncio_fd_t *));
+  int *peers = malloc(num_idle * sizeof(int));
+  int sv[2];
+  int n = 0;
+
+  for(; n < num_idle; n++) {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+      printf("  socketpair failed after %d fds -- %s\n", n, strerror(errno));
+      break;
+    }
+    idle[n] = asyncio_add_fd(sv[0], ASYNCIO_READ, asyncio_bench_cb, NULL,
+                             "bench-idle");
+    peers[n] = sv[1];
+  }
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    goto out;
+
+  asyncio_fd_t *active = asyncio_add_fd(sv[0], ASYNCIO_READ,
+                                        asyncio_bench_cb, NULL,
+                                        "bench-active");
+  int64_t total = 0, worst = 0;
+
+  for(int i = 0; i < rounds; i++) {
+    const int hits = asyncio_bench_hits;
+    const int64_t ts = arch_get_ts();
+    if(write(sv[1], "x", 1) != 1)
+      break;
+    while(asyncio_bench_hits == hits)
+      asyncio_dopoll();
+    const int64_t d = arch_get_ts() - ts;
+    total += d;
+    worst = MAX(worst, d);
+  }
+
+  printf("%-6s %6d idle fds: avg wakeup %6.2f µs, worst %6d µs\n",
+         backend, n, (double)total / rounds, (int)worst);
+
+  asyncio_del_fd(active);
+  close(sv[1]);
+ out:
+  for(int i = 0; i < n; i++) {
+    asyncio_del_fd(idle[i]);
+    close(peers[i]);
+  }
+  free(idle);
+  free(peers);
+}
+
+
+static void
+asyncio_benchmark(void)
+{
+  static const int sizes[] = {10, 100, 1000, 5000, 20000};
+  struct rlimit rl;
+
+  if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  for(int i = 0; i < ARRAYSIZE(sizes); i++) {
+#if ENABLE_EPOLL
+    asyncio_bench_run("epoll", sizes[i], 10000);
+
+    // Temporarily detach from epoll to measure the poll() fallback
+    const int epfd = asyncio_epfd;
+    asyncio_epfd = -1;
+    asyncio_bench_run("poll", sizes[i], 10000);
+    asyncio_epfd = epfd;
+#else
+    asyncio_bench_run("poll", sizes[i], 10000);
+#endif
+  }
+}
+
+#endif
+
+
 /**
  *
  */
@@ -657,11 +990,24 @@ asyncio_thread(void *aux)
 
   asyncio_courier = prop_courier_create_notify(asyncio_courier_notify, NULL);
 
+#if ENABLE_EPOLL
+  asyncio_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(asyncio_epfd == -1)
+    TRACE(TRACE_ERROR, "ASYNCIO",
+          "Unable to create epoll fd -- %s, falling back to poll()",
+          strerror(errno));
+#endif
+
   asyncio_add_fd(asyncio_pipe[0], ASYNCIO_READ, asyncio_handle_pipe,
                  asyncio_courier, "Pipe");
 
   async_now = arch_get_ts();
 
+#ifdef ASYNCIO_BENCHMARK
+  asyncio_benchmark();
+  exit(0);
+#endif
+
   init_group(INIT_GROUP_ASYNCIO);
 
   asyncio_trig_network_change();
@@ -922,7 +1268,7 @@ do_write(asyncio_fd_t *af)
 
     if(r == -1) {
       asyncio_rem_events(af, ASYNCIO_WRITE);
-      af->af_pending_errno = errno;
+      af_set_pending_errno(af, errno);
       return;
     }
 
@@ -980,13 +1326,13 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
   if(events & ASYNCIO_ERROR) {
     char buf[256];
     snprintf(buf, sizeof(buf), "%s", strerror(error));
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
     af->af_error_callback(af->af_opaque, buf);
     return 0;
   }
 
   if(events & ASYNCIO_READ) {
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
 #if ENABLE_OPENSSL
     if(af->af_ssl != NULL) {
       asyncio_ssl_read(af);
@@ -1010,7 +1356,7 @@ asyncio_tcp_connected(asyncio_fd_t *af, void *opaque, int events, int error)
       return 0;
     }
 
-    af->af_timeout = 0;
+    asyncio_timer_disarm(&af->af_timeout);
 
     asyncio_rem_events(af, ASYNCIO_WRITE);
     int err;
@@ -1111,12 +1457,12 @@ asyncio_connect(const char *name, const net_addr_t *addr,
 
   af->af_error_callback = error_cb;
   af->af_read_callback  = read_cb;
-  af->af_timeout = arch_get_ts() + timeout * 1000;
+  asyncio_timer_arm(&af->af_timeout, arch_get_ts() + timeout * 1000);
   af->af_hostname = hostname ? strdup(hostname) : NULL;
 
 #if ENABLE_OPENSSL
   if(tlsctx != NULL) {
-    af->af_ssl = SSL_new(tlsctx);
+    af_attach_ssl(af, SSL_new(tlsctx));
     if(hostname != NULL)
       SSL_set_tlsext_host_name(af->af_ssl, hostname);
   }
@@ -1130,7 +1476,7 @@ asyncio_connect(const char *name, const net_addr_t *addr,
     } else {
       // Got fail directly, but we still want to notify the user about
       // the error asynchronously. Just to make things easier
-      af->af_pending_errno = errno;
+      af_set_pending_errno(af, errno);
     }
   } else {
     asyncio_add_events(af, ASYNCIO_WRITE);
@@ -1158,7 +1504,7 @@ asyncio_attach(const char *name, int fd,
                                     name);
 #if ENABLE_OPENSSL
   if(tlsctx != NULL) {
-    af->af_ssl = SSL_new(tlsctx);
+    af_attach_ssl(af, SSL_new(tlsctx));
     if(SSL_set_fd(af->af_ssl, fd) == 0) {
       TRACE(TRACE_ERROR, "ASYNCIO", "SSL: Unable to set FD");
     }
@@ -1403,8 +1749,7 @@ asyncio_udp_event(asyncio_fd_t *af, void *opaque, int events, int error)
   static uint8_t udp_recv_buf[8192];
 
   if(events & ASYNCIO_ERROR) {
-    close(af->af_fd);
-    af->af_fd = -1;
+    asyncio_close_fd(af);
     af->af_suspended = 1;
     return 0;
   }
@@ -1568,8 +1913,7 @@ asyncio_do_suspend(void *aux)
     if(af->af_fd == -1)
       continue;
     af->af_suspended = 1;
-    close(af->af_fd);
-    af->af_fd = -1;
+    asyncio_close_fd(af);
   }
 }
 
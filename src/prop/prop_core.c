@@ -33,6 +33,7 @@
 #include "event.h"
 
 #include "prop_proxy.h"
+#include "misc/callout.h"
 
 #ifdef PROP_DEBUG
 int prop_trace;
@@ -63,6 +64,10 @@ static struct prop_sub_dispatch_queue prop_global_dispatch_dispatching_queue;
 static int prop_global_dispatch_running;
 static int prop_global_dispatch_avail;
 
+// Number of value notifications queued / collapsed into an already queued one
+atomic_t prop_notify_queued;
+atomic_t prop_notify_coalesced;
+
 
 // Some forward decl.
 static void prop_unlink0(prop_t *p, prop_sub_t *skipme, const char *origin,
@@ -948,12 +953,12 @@ prop_dispatch_one(prop_notify_t *n, int lockmode)
 }
 
 /**
- *
+ * Invoke callbacks for all notifications in queue but don't free them
  */
-void
-prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
+static void
+prop_notify_dispatch0(struct prop_notify_queue *q, const char *trace_name)
 {
-  prop_notify_t *n, *next;
+  prop_notify_t *n;
 
   if(trace_name) {
     TAILQ_FOREACH(n, q, hpn_link) {
@@ -978,6 +983,19 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
     TAILQ_FOREACH(n, q, hpn_link)
       prop_dispatch_one(n, LOCKMGR_LOCK);
   }
+}
+
+
+/**
+ * Release a queue of dispatched notifications
+ */
+static void
+prop_notify_release(struct prop_notify_queue *q)
+{
+  prop_notify_t *n, *next;
+
+  if(TAILQ_FIRST(q) == NULL)
+    return;
 
   hts_mutex_lock(&prop_mutex);
 
@@ -988,6 +1006,48 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
     pool_put(notify_pool, n);
   }
   hts_mutex_unlock(&prop_mutex);
+  TAILQ_INIT(q);
+}
+
+
+/**
+ *
+ */
+void
+prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
+{
+  prop_notify_dispatch0(q, trace_name);
+  prop_notify_release(q);
+}
+
+
+/**
+ * Once a notification leaves the dispatch queue it can no longer
+ * be updated in place. pc_mutex (or prop_mutex for global dispatch)
+ * must be held
+ */
+static void
+courier_unmark(prop_notify_t *n)
+{
+  if(n->hpn_sub->hps_pending_value == n)
+    n->hpn_sub->hps_pending_value = NULL;
+}
+
+
+/**
+ * Move all queued notifications to 'q'. pc_mutex must be held
+ */
+static void
+courier_take_all(prop_courier_t *pc, struct prop_notify_queue *q)
+{
+  prop_notify_t *n;
+
+  TAILQ_FOREACH(n, &pc->pc_queue_exp, hpn_link)
+    courier_unmark(n);
+  TAILQ_FOREACH(n, &pc->pc_queue_nor, hpn_link)
+    courier_unmark(n);
+  TAILQ_MERGE(q, &pc->pc_queue_exp, hpn_link);
+  TAILQ_MERGE(q, &pc->pc_queue_nor, hpn_link);
 }
 
 
@@ -999,56 +1059,90 @@ static void *
 prop_courier(void *aux)
 {
   prop_courier_t *pc = aux;
-  struct prop_notify_queue q_exp, q_nor;
+  struct prop_notify_queue q_exp, q_nor, q_done;
   prop_notify_t *n;
+  int num_done = 0;
 
   if(pc->pc_prologue)
     pc->pc_prologue();
-  
-  hts_mutex_lock(&prop_mutex);
+
+  TAILQ_INIT(&q_done);
+  hts_mutex_lock(&pc->pc_mutex);
 
   while(pc->pc_run) {
 
     if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
        TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+
+      if(num_done) {
+        // Release everything we've dispatched before going to sleep
+        hts_mutex_unlock(&pc->pc_mutex);
+        prop_notify_release(&q_done);
+        num_done = 0;
+        hts_mutex_lock(&pc->pc_mutex);
+        continue;
+      }
+
+      hts_cond_wait(&pc->pc_cond, &pc->pc_mutex);
       continue;
     }
 
-    TAILQ_MOVE(&q_exp, &pc->pc_queue_exp, hpn_link);
-    TAILQ_INIT(&pc->pc_queue_exp);
-
+    TAILQ_INIT(&q_exp);
     TAILQ_INIT(&q_nor);
+
+    TAILQ_FOREACH(n, &pc->pc_queue_exp, hpn_link)
+      courier_unmark(n);
+    TAILQ_MERGE(&q_exp, &pc->pc_queue_exp, hpn_link);
+
     if((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
       TAILQ_REMOVE(&pc->pc_queue_nor, n, hpn_link);
+      courier_unmark(n);
       TAILQ_INSERT_TAIL(&q_nor, n, hpn_link);
+      num_done++;
     }
 
     const char *tt = pc->pc_flags & PROP_COURIER_TRACE_TIMES ?
       pc->pc_name : NULL;
-    hts_mutex_unlock(&prop_mutex);
-    prop_notify_dispatch(&q_exp, tt);
-    prop_notify_dispatch(&q_nor, tt);
-    hts_mutex_lock(&prop_mutex);
+    hts_mutex_unlock(&pc->pc_mutex);
+    prop_notify_dispatch0(&q_exp, tt);
+    prop_notify_dispatch0(&q_nor, tt);
+
+    TAILQ_FOREACH(n, &q_exp, hpn_link)
+      num_done++;
+    TAILQ_MERGE(&q_done, &q_exp, hpn_link);
+    TAILQ_MERGE(&q_done, &q_nor, hpn_link);
+
+    // Release in batches so we don't bounce on prop_mutex for every
+    // single notification
+    if(num_done >= 64) {
+      prop_notify_release(&q_done);
+      num_done = 0;
+    }
+    hts_mutex_lock(&pc->pc_mutex);
   }
 
-  while((n = TAILQ_FIRST(&pc->pc_queue_exp)) != NULL) {
-    TAILQ_REMOVE(&pc->pc_queue_exp, n, hpn_link);
-    prop_notify_free(n);
-  }
+  TAILQ_INIT(&q_exp);
+  courier_take_all(pc, &q_exp);
+  hts_mutex_unlock(&pc->pc_mutex);
 
-  while((n = TAILQ_FIRST(&pc->pc_queue_nor)) != NULL) {
-    TAILQ_REMOVE(&pc->pc_queue_nor, n, hpn_link);
+  prop_notify_release(&q_done);
+
+  hts_mutex_lock(&prop_mutex);
+  while((n = TAILQ_FIRST(&q_exp)) != NULL) {
+    TAILQ_REMOVE(&q_exp, n, hpn_link);
     prop_notify_free(n);
   }
+  hts_mutex_unlock(&prop_mutex);
 
-  if(pc->pc_detached)
-    free(pc);
+  void (*epilogue)(void) = pc->pc_epilogue;
 
-  hts_mutex_unlock(&prop_mutex);
+  if(pc->pc_detached) {
+    hts_mutex_destroy(&pc->pc_mutex);
+    free(pc);
+  }
 
-  if(pc->pc_epilogue)
-    pc->pc_epilogue();
+  if(epilogue)
+    epilogue();
 
   return NULL;
 }
@@ -1081,6 +1175,7 @@ prop_global_dispatch_thread(void *aux)
 
     n = TAILQ_FIRST(&psd->psd_notifications);
     assert(n != NULL);
+    courier_unmark(n);
 
     hts_mutex_unlock(&prop_mutex);
     int r = prop_dispatch_one(n, LOCKMGR_TRY);
@@ -1188,6 +1283,48 @@ courier_notify(prop_courier_t *pc)
 }
 
 
+/**
+ *
+ */
+static int
+prop_notify_is_value(const prop_notify_t *n)
+{
+  switch(n->hpn_event) {
+  case PROP_SET_DIR:
+  case PROP_SET_VOID:
+  case PROP_SET_RSTRING:
+  case PROP_SET_CSTRING:
+  case PROP_SET_URI:
+  case PROP_SET_INT:
+  case PROP_SET_FLOAT:
+  case PROP_SET_PROP:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+prop_sub_coalesce(const prop_sub_t *s)
+{
+  if(s->hps_flags & PROP_SUB_SEND_VALUE_PROP)
+    return 0;
+
+  if(s->hps_flags & PROP_SUB_COALESCE)
+    return 1;
+
+  if(s->hps_dispatch_mode == PROP_SUB_DISPATCH_MODE_COURIER) {
+    const prop_courier_t *pc = s->hps_dispatch;
+    return pc->pc_flags & PROP_COURIER_COALESCE;
+  }
+  return 0;
+}
+
+
 /**
  *
  */
@@ -1196,17 +1333,25 @@ courier_enqueue0(prop_sub_t *s, prop_notify_t *n, int expedite)
 {
   prop_courier_t *pc;
   prop_sub_dispatch_t *psd;
+  prop_notify_t *pending =
+    prop_sub_coalesce(s) && prop_notify_is_value(n) ? n : NULL;
+
+  atomic_inc(&prop_notify_queued);
 
   switch(s->hps_dispatch_mode) {
   case PROP_SUB_DISPATCH_MODE_COURIER:
     pc = s->hps_dispatch;
 
+    hts_mutex_lock(&pc->pc_mutex);
     if(expedite)
       TAILQ_INSERT_TAIL(&pc->pc_queue_exp, n, hpn_link);
     else
       TAILQ_INSERT_TAIL(&pc->pc_queue_nor, n, hpn_link);
 
+    s->hps_pending_value = pending;
+
     courier_notify(pc);
+    hts_mutex_unlock(&pc->pc_mutex);
     break;
 
 
@@ -1221,6 +1366,7 @@ courier_enqueue0(prop_sub_t *s, prop_notify_t *n, int expedite)
     }
 
     TAILQ_INSERT_TAIL(&psd->psd_notifications, n, hpn_link);
+    s->hps_pending_value = pending;
     break;
 
   case PROP_SUB_DISPATCH_MODE_GROUP:
@@ -1230,6 +1376,7 @@ courier_enqueue0(prop_sub_t *s, prop_notify_t *n, int expedite)
       prop_global_dispatch_wakeup();
     }
     TAILQ_INSERT_TAIL(&psd->psd_notifications, n, hpn_link);
+    s->hps_pending_value = pending;
     break;
   }
 }
@@ -1258,6 +1405,116 @@ prop_get_notify(prop_sub_t *s)
 }
 
 
+/**
+ *
+ */
+static void
+prop_notify_set_value(prop_notify_t *n, prop_t *p)
+{
+  switch(p->hp_type) {
+  case PROP_RSTRING:
+    assert(p->hp_rstring != NULL);
+    n->hpn_rstring = rstr_dup(p->hp_rstring);
+    n->hpn_rstrtype = p->hp_rstrtype;
+    n->hpn_event = PROP_SET_RSTRING;
+    break;
+
+  case PROP_CSTRING:
+    n->hpn_cstring = p->hp_cstring;
+    n->hpn_event = PROP_SET_CSTRING;
+    break;
+
+  case PROP_URI:
+    n->hpn_uri_title = rstr_dup(p->hp_uri_title);
+    n->hpn_uri       = rstr_dup(p->hp_uri);
+    n->hpn_event = PROP_SET_URI;
+    break;
+
+  case PROP_FLOAT:
+    n->hpn_float = p->hp_float;
+    n->hpn_event = PROP_SET_FLOAT;
+    break;
+
+  case PROP_INT:
+    n->hpn_float = p->hp_float;
+    n->hpn_event = PROP_SET_INT;
+    break;
+
+  case PROP_DIR:
+    n->hpn_event = PROP_SET_DIR;
+    break;
+
+  case PROP_VOID:
+    n->hpn_event = PROP_SET_VOID;
+    break;
+
+  case PROP_PROP:
+    n->hpn_prop = prop_ref_inc(p->hp_prop);
+    n->hpn_event = PROP_SET_PROP;
+    break;
+
+  case PROP_ZOMBIE:
+  case PROP_PROXY:
+    abort();
+  }
+}
+
+
+/**
+ * Try to update a value notification already queued for 's' instead
+ * of queuing a new one.
+ *
+ * The pending notification is always the last one queued for 's'. It
+ * gets the new value and is moved to the tail of its queue, so the
+ * result is the same as if the old value had been dropped and the new
+ * one queued now: it is delivered after everything queued before it,
+ * for every subscription sharing the queue, and the replaced values
+ * are never delivered at all
+ */
+static int
+prop_notify_coalesce(prop_sub_t *s, prop_t *p)
+{
+  prop_courier_t *pc = NULL;
+  prop_sub_dispatch_t *psd;
+  struct prop_notify_queue *q;
+  prop_notify_t *n;
+
+  if(!prop_sub_coalesce(s))
+    return 0;
+
+  // Global and group dispatch queues are protected by prop_mutex
+  // which we already hold
+  if(s->hps_dispatch_mode == PROP_SUB_DISPATCH_MODE_COURIER) {
+    pc = s->hps_dispatch;
+    hts_mutex_lock(&pc->pc_mutex);
+    q = s->hps_flags & PROP_SUB_EXPEDITE ?
+      &pc->pc_queue_exp : &pc->pc_queue_nor;
+  } else {
+    psd = s->hps_dispatch;
+    q = psd != NULL ? &psd->psd_notifications : NULL;
+  }
+
+  n = s->hps_pending_value;
+
+  if(n != NULL) {
+    prop_notify_free_payload(n);
+    prop_notify_set_value(n, p);
+
+    // A notification being dispatched has already been unmarked, so
+    // this never touches the head of a queue that is in flight
+    if(TAILQ_NEXT(n, hpn_link) != NULL) {
+      TAILQ_REMOVE(q, n, hpn_link);
+      TAILQ_INSERT_TAIL(q, n, hpn_link);
+    }
+    atomic_inc(&prop_notify_coalesced);
+  }
+
+  if(pc != NULL)
+    hts_mutex_unlock(&pc->pc_mutex);
+  return n != NULL;
+}
+
+
 /**
  *
  */
@@ -1392,6 +1649,9 @@ prop_build_notify_value(prop_sub_t *s, int direct, const char *origin,
     return;
   }
 
+  if(pnq == NULL && prop_notify_coalesce(s, p))
+    return;
+
   if(s->hps_flags & PROP_SUB_SEND_VALUE_PROP) {
     n = prop_get_notify(s);
     n->hpn_prop = prop_ref_inc(p);
@@ -1404,53 +1664,7 @@ prop_build_notify_value(prop_sub_t *s, int direct, const char *origin,
   }
 
   n = prop_get_notify(s);
-
-  switch(p->hp_type) {
-  case PROP_RSTRING:
-    assert(p->hp_rstring != NULL);
-    n->hpn_rstring = rstr_dup(p->hp_rstring);
-    n->hpn_rstrtype = p->hp_rstrtype;
-    n->hpn_event = PROP_SET_RSTRING;
-    break;
-
-  case PROP_CSTRING:
-    n->hpn_cstring = p->hp_cstring;
-    n->hpn_event = PROP_SET_CSTRING;
-    break;
-
-  case PROP_URI:
-    n->hpn_uri_title = rstr_dup(p->hp_uri_title);
-    n->hpn_uri       = rstr_dup(p->hp_uri);
-    n->hpn_event = PROP_SET_URI;
-    break;
-
-  case PROP_FLOAT:
-    n->hpn_float = p->hp_float;
-    n->hpn_event = PROP_SET_FLOAT;
-    break;
-
-  case PROP_INT:
-    n->hpn_float = p->hp_float;
-    n->hpn_event = PROP_SET_INT;
-    break;
-
-  case PROP_DIR:
-    n->hpn_event = PROP_SET_DIR;
-    break;
-
-  case PROP_VOID:
-    n->hpn_event = PROP_SET_VOID;
-    break;
-
-  case PROP_PROP:
-    n->hpn_prop = prop_ref_inc(p->hp_prop);
-    n->hpn_event = PROP_SET_PROP;
-    break;
-
-  case PROP_ZOMBIE:
-  case PROP_PROXY:
-    abort();
-  }
+  prop_notify_set_value(n, p);
 
   if(pnq) {
     TAILQ_INSERT_TAIL(pnq, n, hpn_link);
@@ -1866,6 +2080,85 @@ prop_clean(prop_t *p)
 }
 
 
+/**
+ * Link 'p' into list of children of 'parent' before 'before'
+ * (or last if NULL)
+ */
+static void
+prop_child_link(prop_t *parent, prop_t *p, prop_t *before)
+{
+  if(before != NULL) {
+    TAILQ_INSERT_BEFORE(before, p, hp_parent_link);
+  } else {
+    TAILQ_INSERT_TAIL(&parent->hp_childs, p, hp_parent_link);
+  }
+  if(parent->hp_child_index != NULL)
+    prop_index_insert(parent, p);
+}
+
+
+/**
+ *
+ */
+static void
+prop_child_unlink(prop_t *parent, prop_t *p)
+{
+  if(parent->hp_child_index != NULL &&
+     prop_index_remove(parent, p) < PROP_INDEX_THRESHOLD / 2)
+    prop_index_destroy(parent);
+
+  TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
+}
+
+
+/**
+ * Find child by name. If the scan passes PROP_INDEX_THRESHOLD children
+ * an index is created and used for this and all subsequent lookups
+ */
+static prop_t *
+prop_find_child(prop_t *parent, const char *name)
+{
+  prop_t *c;
+  int cnt = 0;
+
+  if(parent->hp_child_index != NULL)
+    return prop_index_find(parent, name);
+
+  TAILQ_FOREACH(c, &parent->hp_childs, hp_parent_link) {
+    if(c->hp_name != NULL && !strcmp(c->hp_name, name))
+      return c;
+    if(++cnt == PROP_INDEX_THRESHOLD) {
+      prop_index_create(parent);
+      return prop_index_find(parent, name);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static prop_t *
+prop_get_nth_child(prop_t *parent, unsigned int idx)
+{
+  prop_t *c;
+
+  if(parent->hp_child_index == NULL && idx >= PROP_INDEX_THRESHOLD)
+    prop_index_create(parent);
+
+  if(parent->hp_child_index != NULL)
+    return prop_index_get_nth(parent, idx);
+
+  TAILQ_FOREACH(c, &parent->hp_childs, hp_parent_link) {
+    if(idx == 0)
+      break;
+    idx--;
+  }
+  return c;
+}
+
+
 /**
  *
  */
@@ -1880,6 +2173,7 @@ prop_make_dir(prop_t *p, prop_sub_t *skipme, const char *origin)
   
   TAILQ_INIT(&p->hp_childs);
   p->hp_selected = NULL;
+  p->hp_child_index = NULL;
   p->hp_type = PROP_DIR;
   
   prop_notify_value(p, skipme, origin);
@@ -1894,10 +2188,10 @@ prop_insert(prop_t *p, prop_t *parent, prop_t *before, prop_sub_t *skipme)
 {
   if(before != NULL) {
     assert(before->hp_parent == parent);
-    TAILQ_INSERT_BEFORE(before, p, hp_parent_link);
+    prop_child_link(parent, p, before);
     prop_notify_child2(p, parent, before, PROP_ADD_CHILD_BEFORE, skipme, 0);
   } else {
-    TAILQ_INSERT_TAIL(&parent->hp_childs, p, hp_parent_link);
+    prop_child_link(parent, p, NULL);
     prop_notify_child(p, parent, PROP_ADD_CHILD, skipme, 0);
   }
 }
@@ -1948,21 +2242,17 @@ prop_create0(prop_t *parent, const char *name, prop_sub_t *skipme, int noalloc)
 
   prop_make_dir(parent, skipme, "prop_create()");
 
-  if(name != NULL) {
-    TAILQ_FOREACH(hp, &parent->hp_childs, hp_parent_link) {
-      if(hp->hp_name != NULL && !strcmp(hp->hp_name, name)) {
-
-	if(!(hp->hp_flags & PROP_NAME_NOT_ALLOCATED) && noalloc) {
-	  // Trick: We have a pointer to a compile time constant string
-	  // and the current prop does not have that, we could switch to
-	  // it and thus save some memory allocation
-	  free((void *)hp->hp_name);
-	  hp->hp_name = name;
-	  hp->hp_flags |= PROP_NAME_NOT_ALLOCATED;
-	}
-	return hp;
-      }
+  if(name != NULL && (hp = prop_find_child(parent, name)) != NULL) {
+
+    if(!(hp->hp_flags & PROP_NAME_NOT_ALLOCATED) && noalloc) {
+      // Trick: We have a pointer to a compile time constant string
+      // and the current prop does not have that, we could switch to
+      // it and thus save some memory allocation
+      free((void *)hp->hp_name);
+      hp->hp_name = name;
+      hp->hp_flags |= PROP_NAME_NOT_ALLOCATED;
     }
+    return hp;
   }
 
   hp = prop_make(name, noalloc, parent);
@@ -2054,19 +2344,15 @@ prop_create_after(prop_t *parent, const char *name, prop_t *after,
 
     prop_make_dir(parent, skipme, "prop_create_after()");
 
-    TAILQ_FOREACH(p, &parent->hp_childs, hp_parent_link)
-      if(p->hp_name != NULL && !strcmp(p->hp_name, name))
-	break;
+    p = prop_find_child(parent, name);
 
     if(p == NULL) {
 
       p = prop_make(name, 0, parent);
-  
-      if(after == NULL) {
-	TAILQ_INSERT_HEAD(&parent->hp_childs, p, hp_parent_link);
-      } else {
-	TAILQ_INSERT_AFTER(&parent->hp_childs, after, p, hp_parent_link);
-      }
+
+      prop_child_link(parent, p, after == NULL ?
+                      TAILQ_FIRST(&parent->hp_childs) :
+                      TAILQ_NEXT(after, hp_parent_link));
 
       prop_t *next = TAILQ_NEXT(p, hp_parent_link);
       if(next == NULL) {
@@ -2080,14 +2366,11 @@ prop_create_after(prop_t *parent, const char *name, prop_t *after,
       prop_t *prev = TAILQ_PREV(p, prop_queue, hp_parent_link);
 
       if(prev != after) {
-	
-	TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
 
-	if(after == NULL) {
-	  TAILQ_INSERT_HEAD(&parent->hp_childs, p, hp_parent_link);
-	} else {
-	  TAILQ_INSERT_AFTER(&parent->hp_childs, after, p, hp_parent_link);
-	}
+	prop_child_unlink(parent, p);
+	prop_child_link(parent, p, after == NULL ?
+	                TAILQ_FIRST(&parent->hp_childs) :
+	                TAILQ_NEXT(after, hp_parent_link));
 	
 	prop_t *next = TAILQ_NEXT(p, hp_parent_link);
 	prop_notify_child2(p, parent, next, PROP_MOVE_CHILD, skipme, 0);
@@ -2176,11 +2459,7 @@ prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
       if(parent->hp_flags & (PROP_MULTI_SUB | PROP_MULTI_NOTIFY))
 	prop_flood_flag(p, PROP_MULTI_NOTIFY, 0);
     
-      if(before) {
-	TAILQ_INSERT_BEFORE(before, p, hp_parent_link);
-      } else {
-	TAILQ_INSERT_TAIL(&parent->hp_childs, p, hp_parent_link);
-      }
+      prop_child_link(parent, p, before);
     }
     prop_notify_childv(pv, parent, before ? PROP_ADD_CHILD_VECTOR_BEFORE : 
 		       PROP_ADD_CHILD_VECTOR, skipme, before);
@@ -2203,7 +2482,7 @@ prop_unparent0(prop_t *p, prop_sub_t *skipme)
 
   prop_notify_child(p, parent, PROP_DEL_CHILD, NULL, 0);
   
-  TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
+  prop_child_unlink(parent, p);
   p->hp_parent = NULL;
   
   if(parent->hp_selected == p)
@@ -2247,7 +2526,7 @@ prop_destroy_child(prop_t *p, prop_t *c)
 {
   if(!prop_destroy0(c)) {
     prop_notify_child(c, p, PROP_DEL_CHILD, NULL, 0);
-    TAILQ_REMOVE(&p->hp_childs, c, hp_parent_link);
+    prop_child_unlink(p, c);
     c->hp_parent = NULL;
   }
 }
@@ -2311,6 +2590,8 @@ prop_destroy0(prop_t *p)
     abort();
 
   case PROP_DIR:
+    if(p->hp_child_index != NULL)
+      prop_index_destroy(p);
     for(c = TAILQ_FIRST(&p->hp_childs); c != NULL; c = next) {
       next = TAILQ_NEXT(c, hp_parent_link);
       prop_destroy_child(p, c);
@@ -2385,7 +2666,7 @@ prop_destroy0(prop_t *p)
       if(!(s->hps_flags & PROP_SUB_EARLY_DEL_CHILD))
         prop_build_notify_child(s, p, PROP_DEL_CHILD, 0, 0);
 
-    TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
+    prop_child_unlink(parent, p);
     p->hp_parent = NULL;
 
     if(parent->hp_selected == p)
@@ -2423,6 +2704,8 @@ prop_destroy_childs0(prop_t *p)
   prop_sub_t *s;
 
   struct prop_queue childs;
+  if(p->hp_child_index != NULL)
+    prop_index_destroy(p);
   TAILQ_MOVE(&childs, &p->hp_childs, hp_parent_link);
   TAILQ_INIT(&p->hp_childs);
 
@@ -2510,12 +2793,8 @@ prop_destroy_by_name(prop_t *p, const char *name)
 	  prop_destroy_child(p, c);
       }
     } else {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-	if(c->hp_name != NULL && !strcmp(c->hp_name, name)) {
-	  prop_destroy_child(p, c);
-	  break;
-	}
-      }
+      if((c = prop_find_child(p, name)) != NULL)
+	prop_destroy_child(p, c);
     }
   }
   hts_mutex_unlock(&prop_mutex);
@@ -2615,13 +2894,8 @@ prop_move0(prop_t *p, prop_t *before, prop_sub_t *skipme)
     if(parent == NULL)
       return;
 
-    TAILQ_REMOVE(&parent->hp_childs, p, hp_parent_link);
-  
-    if(before != NULL) {
-      TAILQ_INSERT_BEFORE(before, p, hp_parent_link);
-    } else {
-      TAILQ_INSERT_TAIL(&parent->hp_childs, p, hp_parent_link);
-    }  
+    prop_child_unlink(parent, p);
+    prop_child_link(parent, p, before);
     prop_notify_child2(p, parent, before, PROP_MOVE_CHILD, skipme, 0);
   }
 }
@@ -2703,29 +2977,21 @@ prop_subfind(prop_t *p, const char **name, int follow_symlinks,
 
       TAILQ_INIT(&p->hp_childs);
       p->hp_selected = NULL;
+      p->hp_child_index = NULL;
       p->hp_type = PROP_DIR;
 
       prop_notify_value(p, NULL, "prop_subfind()");
     }
 
     if(allow_indexing && name[0][0] == '*') {
-      unsigned int i = atoi(name[0]+1);
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-	if(i == 0)
-	  break;
-	i--;
-      }
+      c = prop_get_nth_child(p, atoi(name[0]+1));
       if(c == NULL) {
         if(origin_chain)
           origin_chain[0] = NULL;
 	return NULL;
       }
     } else {
-
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link) {
-	if(c->hp_name != NULL && !strcmp(c->hp_name, name[0]))
-	  break;
-      }
+      c = prop_find_child(p, name[0]);
     }
     p = c ?: prop_create0(p, name[0], NULL, 0);    
     name++;
@@ -3207,6 +3473,7 @@ prop_subscribe_ex(const char *file, int line, int flags, ...)
   s->hps_callback = cb;
   s->hps_opaque = opaque;
   atomic_set(&s->hps_refcount, 1);
+  s->hps_pending_value = NULL;
   s->hps_user_int = user_int;
 
   if(origin_chain[0] != NULL) {
@@ -3513,6 +3780,7 @@ prop_init(void)
 
 
   prop_pool   = pool_create("prop", sizeof(prop_t), 0);
+  prop_index_init();
   notify_pool = pool_create("notify", sizeof(prop_notify_t), 0);
   sub_pool    = pool_create("subs", sizeof(prop_sub_t), 0);
   pot_pool    = pool_create("pots", sizeof(prop_originator_tracking_t), 0);
@@ -4999,9 +5267,7 @@ prop_select_by_value_ex(prop_t *p, const char *name, prop_sub_t *skipme)
 
   if(p->hp_type == PROP_DIR) {
     prop_t *c;
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, name))
-        break;
+    c = prop_find_child(p, name);
 
     prop_notify_child2(c, p, NULL, PROP_SELECT_CHILD, skipme, 0);
     p->hp_selected = c;
@@ -5063,9 +5329,7 @@ prop_findv(prop_t *p, char **names)
       break;
     }
 
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	break;
+    c = prop_find_child(p, n);
     if(c == NULL)
       break;
 
@@ -5095,9 +5359,7 @@ prop_find0(prop_t *p, va_list ap)
       break;
     }
 
-    TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	break;
+    c = prop_find_child(p, n);
     if(c == NULL)
 	return NULL;
     p = c;
@@ -5202,6 +5464,7 @@ static prop_courier_t *
 prop_courier_create(void)
 {
   prop_courier_t *pc = calloc(1, sizeof(prop_courier_t));
+  hts_mutex_init(&pc->pc_mutex);
   TAILQ_INIT(&pc->pc_queue_nor);
   TAILQ_INIT(&pc->pc_queue_exp);
   TAILQ_INIT(&pc->pc_dispatch_queue);
@@ -5223,7 +5486,7 @@ prop_courier_create_thread(hts_mutex_t *entrymutex, const char *name,
   snprintf(buf, sizeof(buf), "PC:%s", name);
   pc->pc_flags = flags;
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &pc->pc_mutex);
 
   pc->pc_name = strdup(name);
   pc->pc_run = 1;
@@ -5243,6 +5506,16 @@ prop_courier_create_passive(void)
 }
 
 
+/**
+ *
+ */
+void
+prop_courier_set_flags(prop_courier_t *pc, int flags)
+{
+  pc->pc_flags = flags;
+}
+
+
 /**
  *
  */
@@ -5268,7 +5541,7 @@ prop_courier_create_waitable(void)
   prop_courier_t *pc = prop_courier_create();
   
   pc->pc_has_cond = 1;
-  hts_cond_init(&pc->pc_cond, &prop_mutex);
+  hts_cond_init(&pc->pc_cond, &pc->pc_mutex);
 
   return pc;
 }
@@ -5281,18 +5554,18 @@ int
 prop_courier_wait(prop_courier_t *pc, struct prop_notify_queue *q, int timeout)
 {
   int r = 0;
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
   if(TAILQ_FIRST(&pc->pc_queue_exp) == NULL &&
      TAILQ_FIRST(&pc->pc_queue_nor) == NULL) {
     if(timeout)
-      r = hts_cond_wait_timeout(&pc->pc_cond, &prop_mutex, timeout);
+      r = hts_cond_wait_timeout(&pc->pc_cond, &pc->pc_mutex, timeout);
     else
-      hts_cond_wait(&pc->pc_cond, &prop_mutex);
+      hts_cond_wait(&pc->pc_cond, &pc->pc_mutex);
   }
 
-  TAILQ_MOVE(q, &pc->pc_queue_exp, hpn_link);
-  TAILQ_MERGE(q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
+  TAILQ_INIT(q);
+  courier_take_all(pc, q);
+  hts_mutex_unlock(&pc->pc_mutex);
   return r;
 }
 
@@ -5347,10 +5620,10 @@ prop_courier_destroy(prop_courier_t *pc)
   }
 
   if(pc->pc_run) {
-    hts_mutex_lock(&prop_mutex);
+    hts_mutex_lock(&pc->pc_mutex);
     pc->pc_run = 0;
     hts_cond_signal(&pc->pc_cond);
-    hts_mutex_unlock(&prop_mutex);
+    hts_mutex_unlock(&pc->pc_mutex);
 
     hts_thread_join(&pc->pc_thread);
   }
@@ -5358,6 +5631,8 @@ prop_courier_destroy(prop_courier_t *pc)
   if(pc->pc_has_cond)
     hts_cond_destroy(&pc->pc_cond);
 
+  hts_mutex_destroy(&pc->pc_mutex);
+
   free(pc->pc_name);
 
   free(pc);
@@ -5371,8 +5646,11 @@ void
 prop_courier_stop(prop_courier_t *pc)
 {
   hts_thread_detach(&pc->pc_thread);
+  hts_mutex_lock(&pc->pc_mutex);
   pc->pc_run = 0;
   pc->pc_detached = 1;
+  hts_cond_signal(&pc->pc_cond);
+  hts_mutex_unlock(&pc->pc_mutex);
 }
 
 
@@ -5383,39 +5661,57 @@ void
 prop_courier_poll(prop_courier_t *pc)
 {
   struct prop_notify_queue q;
-  hts_mutex_lock(&prop_mutex);
-  TAILQ_MOVE(&q, &pc->pc_queue_exp, hpn_link);
-  TAILQ_MERGE(&q, &pc->pc_queue_nor, hpn_link);
-  hts_mutex_unlock(&prop_mutex);
+  TAILQ_INIT(&q);
+  hts_mutex_lock(&pc->pc_mutex);
+  courier_take_all(pc, &q);
+  hts_mutex_unlock(&pc->pc_mutex);
   prop_notify_dispatch(&q, 0);
 }
 
 
 /**
- *
+ * Used by the polled couriers. Pick up new notifications and release
+ * the ones dispatched on last poll. We don't want to block the caller
+ * (typically the UI thread) on prop_mutex so if it's contended the
+ * release is postponed until next round.
  */
 void
-prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
+prop_notify_courier_take(prop_courier_t *pc)
 {
-  if(maxtime == -1)
-    return prop_courier_poll(pc);
-
   prop_notify_t *n, *next;
 
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
+  hts_mutex_lock(&pc->pc_mutex);
+  courier_take_all(pc, &pc->pc_dispatch_queue);
+  hts_mutex_unlock(&pc->pc_mutex);
 
-    for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
-      next = TAILQ_NEXT(n, hpn_link);
+  if(TAILQ_FIRST(&pc->pc_free_queue) == NULL ||
+     hts_mutex_trylock(&prop_mutex))
+    return;
 
-      prop_sub_ref_dec_locked(n->hpn_sub);
-      pool_put(notify_pool, n);
-    }
-    TAILQ_INIT(&pc->pc_free_queue);
+  for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
+    next = TAILQ_NEXT(n, hpn_link);
 
-    hts_mutex_unlock(&prop_mutex);
+    prop_sub_ref_dec_locked(n->hpn_sub);
+    pool_put(notify_pool, n);
   }
+  TAILQ_INIT(&pc->pc_free_queue);
+
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ *
+ */
+void
+prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
+{
+  if(maxtime == -1)
+    return prop_courier_poll(pc);
+
+  prop_notify_t *n;
+
+  prop_notify_courier_take(pc);
 
   int64_t ts = arch_get_ts();
 
@@ -5435,9 +5731,9 @@ prop_courier_poll_timed(prop_courier_t *pc, int maxtime)
 int
 prop_courier_check(prop_courier_t *pc)
 {
-  hts_mutex_lock(&prop_mutex);
+  hts_mutex_lock(&pc->pc_mutex);
   int r = TAILQ_FIRST(&pc->pc_queue_exp) || TAILQ_FIRST(&pc->pc_queue_nor);
-  hts_mutex_unlock(&prop_mutex);
+  hts_mutex_unlock(&pc->pc_mutex);
   return r;
 
 }
@@ -5604,11 +5900,9 @@ prop_setv_ex(prop_sub_t *skipme, prop_t *p, ...)
   while((n = va_arg(ap, const char *)) != NULL) {
     if(p->hp_type == PROP_ZOMBIE)
       goto bad;
-    if(p->hp_type == PROP_DIR) {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-	if(c->hp_name != NULL && !strcmp(c->hp_name, n))
-	  break;
-    } else 
+    if(p->hp_type == PROP_DIR)
+      c = prop_find_child(p, n);
+    else
       c = NULL;
     if(c == NULL)
       c = prop_create0(p, n, skipme, 0);
@@ -5656,11 +5950,9 @@ prop_setdn(prop_sub_t *skipme, prop_t *p, const char *str, ...)
     }
 
 
-    if(p->hp_type == PROP_DIR) {
-      TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-	if(c->hp_name != NULL && !strcmp(c->hp_name, str))
-	  break;
-    } else 
+    if(p->hp_type == PROP_DIR)
+      c = prop_find_child(p, str);
+    else
       c = NULL;
     if(c == NULL)
       c = prop_create0(p, str, skipme, 0);
@@ -6009,8 +6301,31 @@ prop_print_tree(prop_t *p, int followlinks)
 
 
 
+/**
+ * Notification stats, per second
+ */
+static callout_t prop_notify_stats_callout;
+static prop_t *prop_notify_stats_root;
+
+static void
+prop_notify_stats_update(callout_t *c, void *aux)
+{
+  static int last_queued, last_coalesced;
+  const int queued    = atomic_get(&prop_notify_queued);
+  const int coalesced = atomic_get(&prop_notify_coalesced);
+
+  callout_arm(&prop_notify_stats_callout, prop_notify_stats_update, NULL, 1);
+
+  prop_set(prop_notify_stats_root, "queued", PROP_SET_INT,
+           queued - last_queued);
+  prop_set(prop_notify_stats_root, "coalesced", PROP_SET_INT,
+           coalesced - last_coalesced);
+  last_queued = queued;
+  last_coalesced = coalesced;
+}
+
+
 #ifdef PROP_SUB_STATS
-#include "misc/callout.h"
 
 static callout_t prop_stats_callout;
 
@@ -6060,6 +6375,11 @@ extern void prop_test(void);
 void
 prop_init_late(void)
 {
+  prop_notify_stats_root =
+    prop_create(prop_create(prop_create(prop_get_global(), "system"),
+                            "prop"), "notifications");
+  prop_notify_stats_update(NULL, NULL);
+
 #ifdef PROP_SUB_STATS
   callout_arm(&prop_stats_callout, prop_report_stats, NULL, 1);
 #endif
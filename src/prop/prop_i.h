@@ -40,6 +40,8 @@ RB_HEAD_NFL(prop_tree, prop);
 LIST_HEAD(prop_sub_list, prop_sub);
 TAILQ_HEAD(prop_sub_dispatch_queue, prop_sub_dispatch);
 
+typedef struct prop_index prop_index_t;
+
 
 
 /**
@@ -47,6 +49,12 @@ TAILQ_HEAD(prop_sub_dispatch_queue, prop_sub_dispatch);
  */
 struct prop_courier {
 
+  /**
+   * Protects pc_queue_nor, pc_queue_exp and pc_run. Also used for
+   * pc_cond. Lock order is prop_mutex -> pc_mutex
+   */
+  hts_mutex_t pc_mutex;
+
   struct prop_notify_queue pc_queue_nor;
   struct prop_notify_queue pc_queue_exp;
 
@@ -338,6 +346,7 @@ struct prop {
     struct {
       struct prop_queue childs;
       struct prop *selected;
+      prop_index_t *index;
     } c;
     struct pixmap *pixmap;
     struct {
@@ -359,6 +368,7 @@ struct prop {
 #define hp_int      u.i.val
 #define hp_childs   u.c.childs
 #define hp_selected u.c.selected
+#define hp_child_index u.c.index
 #define hp_pixmap   u.pixmap
 #define hp_uri_title u.uri.title
 #define hp_uri       u.uri.uri
@@ -507,6 +517,14 @@ struct prop_sub {
    */
   atomic_t hps_refcount;
 
+  /**
+   * Value notification still sitting in courier queue. As long as this
+   * is set and nothing else has been queued for this subscription it
+   * can be overwritten with a newer value instead of queuing another
+   * notification. Protected by courier's pc_mutex
+   */
+  struct prop_notify *hps_pending_value;
+
 
   /**
    * Set when a subscription is destroyed. Protected by hps_lock.
@@ -603,6 +621,30 @@ int prop_dispatch_one(prop_notify_t *n, int lockmode);
 
 void prop_courier_enqueue(prop_sub_t *s, prop_notify_t *n);
 
+void prop_notify_courier_take(prop_courier_t *pc);
+
+extern atomic_t prop_notify_queued;
+extern atomic_t prop_notify_coalesced;
+
 const char *prop_get_DN(prop_t *p, int compact);
 
+/**
+ * Child index for large directories, see prop_index.c
+ */
+#define PROP_INDEX_THRESHOLD 64
+
+void prop_index_init(void);
+
+void prop_index_create(prop_t *dir);
+
+void prop_index_destroy(prop_t *dir);
+
+void prop_index_insert(prop_t *dir, prop_t *c);
+
+unsigned int prop_index_remove(prop_t *dir, prop_t *c);
+
+prop_t *prop_index_find(prop_t *dir, const char *name);
+
+prop_t *prop_index_get_nth(prop_t *dir, unsigned int idx);
+
 #endif // PROP_I_H__
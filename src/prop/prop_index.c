@@ -0,0 +1,462 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "main.h"
+#include "prop_i.h"
+#include "misc/murmur3.h"
+
+/**
+ * Child index for large PROP_DIR nodes
+ *
+ * Once a directory grows big we attach an index to it. It consists
+ * of two parts:
+ *
+ *  - An open addressing hash table (linear probing) mapping children
+ *    to their index node. Named children are hashed on their name,
+ *    anonymous children are hashed on their address so they still can
+ *    be found quickly when unlinked.
+ *
+ *  - A treap kept in the same order as hp_childs and augmented with
+ *    subtree sizes. This gives us O(log n) positional lookup ("*N"
+ *    paths) and O(log n) rank of a child.
+ *
+ * Everything in here is protected by prop_mutex
+ */
+
+typedef struct prop_index_node {
+  prop_t *pin_prop;
+  struct prop_index_node *pin_parent;
+  struct prop_index_node *pin_left;
+  struct prop_index_node *pin_right;
+  unsigned int pin_size;
+  uint32_t pin_hash;
+  uint32_t pin_prio;
+} prop_index_node_t;
+
+
+struct prop_index {
+  prop_index_node_t *pi_root;
+  prop_index_node_t **pi_table;
+  unsigned int pi_mask;
+  unsigned int pi_count;
+};
+
+static pool_t *prop_index_pool;
+static uint32_t prop_index_prio_state = 2463534242;
+
+
+/**
+ *
+ */
+static uint32_t
+prop_index_hash(const prop_t *p)
+{
+  if(p->hp_name != NULL)
+    return MurHash3_32(p->hp_name, strlen(p->hp_name), 0);
+  return MurHash3_32(&p, sizeof(p), 1);
+}
+
+
+/**
+ *
+ */
+static uint32_t
+prop_index_prio(void)
+{
+  uint32_t x = prop_index_prio_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  prop_index_prio_state = x;
+  return x;
+}
+
+
+/**
+ *
+ */
+static inline unsigned int
+pin_size(const prop_index_node_t *n)
+{
+  return n != NULL ? n->pin_size : 0;
+}
+
+
+/**
+ *
+ */
+static void
+prop_index_table_insert(prop_index_t *pi, prop_index_node_t *n)
+{
+  unsigned int i = n->pin_hash & pi->pi_mask;
+  while(pi->pi_table[i] != NULL)
+    i = (i + 1) & pi->pi_mask;
+  pi->pi_table[i] = n;
+}
+
+
+/**
+ *
+ */
+static void
+prop_index_table_resize(prop_index_t *pi, unsigned int size)
+{
+  prop_index_node_t **old = pi->pi_table;
+  const unsigned int oldsize = pi->pi_mask + 1;
+
+  pi->pi_table = calloc(size, sizeof(prop_index_node_t *));
+  pi->pi_mask = size - 1;
+
+  if(old == NULL)
+    return;
+
+  for(unsigned int i = 0; i < oldsize; i++)
+    if(old[i] != NULL)
+      prop_index_table_insert(pi, old[i]);
+  free(old);
+}
+
+
+/**
+ * Return slot in hash table where node for child 'c' lives
+ */
+static unsigned int
+prop_index_table_slot(const prop_index_t *pi, const prop_t *c)
+{
+  unsigned int i = prop_index_hash(c) & pi->pi_mask;
+  while(1) {
+    const prop_index_node_t *n = pi->pi_table[i];
+    assert(n != NULL);
+    if(n->pin_prop == c)
+      return i;
+    i = (i + 1) & pi->pi_mask;
+  }
+}
+
+
+/**
+ * Backward shift deletion, no tombstones needed
+ */
+static void
+prop_index_table_remove(prop_index_t *pi, unsigned int i)
+{
+  unsigned int j = i;
+  pi->pi_table[i] = NULL;
+
+  while(1) {
+    j = (j + 1) & pi->pi_mask;
+    prop_index_node_t *n = pi->pi_table[j];
+    if(n == NULL)
+      return;
+    const unsigned int k = n->pin_hash & pi->pi_mask;
+
+    // Entry may stay if its home slot is cyclically within (i, j]
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+
+    pi->pi_table[i] = n;
+    pi->pi_table[j] = NULL;
+    i = j;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+pin_update_size(prop_index_node_t *n)
+{
+  n->pin_size = pin_size(n->pin_left) + pin_size(n->pin_right) + 1;
+}
+
+
+/**
+ * Rotate 'n' up one level, replacing its parent
+ */
+static void
+prop_index_rotate_up(prop_index_t *pi, prop_index_node_t *n)
+{
+  prop_index_node_t *p = n->pin_parent;
+  prop_index_node_t *g = p->pin_parent;
+
+  if(n == p->pin_left) {
+    p->pin_left = n->pin_right;
+    if(p->pin_left != NULL)
+      p->pin_left->pin_parent = p;
+    n->pin_right = p;
+  } else {
+    p->pin_right = n->pin_left;
+    if(p->pin_right != NULL)
+      p->pin_right->pin_parent = p;
+    n->pin_left = p;
+  }
+  p->pin_parent = n;
+  n->pin_parent = g;
+
+  if(g == NULL)
+    pi->pi_root = n;
+  else if(g->pin_left == p)
+    g->pin_left = n;
+  else
+    g->pin_right = n;
+
+  pin_update_size(p);
+  pin_update_size(n);
+}
+
+
+/**
+ * Insert 'n' in tree order just before 'before' (or last if NULL)
+ */
+static void
+prop_index_tree_insert(prop_index_t *pi, prop_index_node_t *n,
+                       prop_index_node_t *before)
+{
+  prop_index_node_t *x;
+
+  n->pin_left = n->pin_right = NULL;
+  n->pin_size = 1;
+
+  if(pi->pi_root == NULL) {
+    n->pin_parent = NULL;
+    pi->pi_root = n;
+    return;
+  }
+
+  if(before == NULL) {
+    for(x = pi->pi_root; x->pin_right != NULL; x = x->pin_right) {}
+    x->pin_right = n;
+  } else if(before->pin_left == NULL) {
+    x = before;
+    x->pin_left = n;
+  } else {
+    for(x = before->pin_left; x->pin_right != NULL; x = x->pin_right) {}
+    x->pin_right = n;
+  }
+  n->pin_parent = x;
+
+  for(; x != NULL; x = x->pin_parent)
+    x->pin_size++;
+
+  while(n->pin_parent != NULL && n->pin_parent->pin_prio < n->pin_prio)
+    prop_index_rotate_up(pi, n);
+}
+
+
+/**
+ *
+ */
+static void
+prop_index_tree_remove(prop_index_t *pi, prop_index_node_t *n)
+{
+  // Rotate down until we're a leaf
+  while(n->pin_left != NULL || n->pin_right != NULL) {
+    prop_index_node_t *c;
+    if(n->pin_right == NULL ||
+       (n->pin_left != NULL && n->pin_left->pin_prio > n->pin_right->pin_prio))
+      c = n->pin_left;
+    else
+      c = n->pin_right;
+    prop_index_rotate_up(pi, c);
+  }
+
+  prop_index_node_t *p = n->pin_parent;
+  if(p == NULL) {
+    pi->pi_root = NULL;
+    return;
+  }
+
+  if(p->pin_left == n)
+    p->pin_left = NULL;
+  else
+    p->pin_right = NULL;
+
+  for(; p != NULL; p = p->pin_parent)
+    p->pin_size--;
+}
+
+
+/**
+ * Position of node in the list of children
+ */
+static unsigned int
+prop_index_rank(const prop_index_node_t *n)
+{
+  unsigned int r = pin_size(n->pin_left);
+  for(; n->pin_parent != NULL; n = n->pin_parent)
+    if(n == n->pin_parent->pin_right)
+      r += pin_size(n->pin_parent->pin_left) + 1;
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+prop_index_add(prop_index_t *pi, prop_t *c, prop_index_node_t *before)
+{
+  prop_index_node_t *n = pool_get(prop_index_pool);
+
+  n->pin_prop = c;
+  n->pin_hash = prop_index_hash(c);
+  n->pin_prio = prop_index_prio();
+
+  pi->pi_count++;
+  if(pi->pi_count * 2 > pi->pi_mask + 1)
+    prop_index_table_resize(pi, (pi->pi_mask + 1) * 2);
+
+  prop_index_table_insert(pi, n);
+  prop_index_tree_insert(pi, n, before);
+}
+
+
+/**
+ * Build index for all current children of 'dir'
+ */
+void
+prop_index_create(prop_t *dir)
+{
+  prop_t *c;
+  assert(dir->hp_type == PROP_DIR);
+  assert(dir->hp_child_index == NULL);
+
+  prop_index_t *pi = calloc(1, sizeof(prop_index_t));
+  prop_index_table_resize(pi, 256);
+
+  TAILQ_FOREACH(c, &dir->hp_childs, hp_parent_link)
+    prop_index_add(pi, c, NULL);
+
+  dir->hp_child_index = pi;
+}
+
+
+/**
+ *
+ */
+void
+prop_index_destroy(prop_t *dir)
+{
+  prop_index_t *pi = dir->hp_child_index;
+
+  for(unsigned int i = 0; i <= pi->pi_mask; i++)
+    if(pi->pi_table[i] != NULL)
+      pool_put(prop_index_pool, pi->pi_table[i]);
+
+  free(pi->pi_table);
+  free(pi);
+  dir->hp_child_index = NULL;
+}
+
+
+/**
+ * Must be called after 'c' has been linked into dir->hp_childs
+ */
+void
+prop_index_insert(prop_t *dir, prop_t *c)
+{
+  prop_index_t *pi = dir->hp_child_index;
+  prop_t *next = TAILQ_NEXT(c, hp_parent_link);
+  prop_index_node_t *before = NULL;
+
+  if(next != NULL)
+    before = pi->pi_table[prop_index_table_slot(pi, next)];
+
+  prop_index_add(pi, c, before);
+}
+
+
+/**
+ * Returns number of children left in index
+ */
+unsigned int
+prop_index_remove(prop_t *dir, prop_t *c)
+{
+  prop_index_t *pi = dir->hp_child_index;
+  const unsigned int slot = prop_index_table_slot(pi, c);
+  prop_index_node_t *n = pi->pi_table[slot];
+
+  prop_index_table_remove(pi, slot);
+  prop_index_tree_remove(pi, n);
+  pool_put(prop_index_pool, n);
+  return --pi->pi_count;
+}
+
+
+/**
+ * Find first child (in list order) named 'name'
+ */
+prop_t *
+prop_index_find(prop_t *dir, const char *name)
+{
+  const prop_index_t *pi = dir->hp_child_index;
+  const uint32_t hash = MurHash3_32(name, strlen(name), 0);
+  prop_index_node_t *best = NULL;
+  unsigned int i = hash & pi->pi_mask;
+  prop_index_node_t *n;
+
+  while((n = pi->pi_table[i]) != NULL) {
+    const prop_t *c = n->pin_prop;
+    if(n->pin_hash == hash && c->hp_name != NULL && !strcmp(c->hp_name, name)) {
+      // Duplicate names are rare but possible, pick the first one
+      if(best == NULL || prop_index_rank(n) < prop_index_rank(best))
+        best = n;
+    }
+    i = (i + 1) & pi->pi_mask;
+  }
+  return best ? best->pin_prop : NULL;
+}
+
+
+/**
+ *
+ */
+prop_t *
+prop_index_get_nth(prop_t *dir, unsigned int idx)
+{
+  const prop_index_node_t *n = dir->hp_child_index->pi_root;
+
+  while(n != NULL) {
+    const unsigned int ls = pin_size(n->pin_left);
+    if(idx < ls) {
+      n = n->pin_left;
+    } else if(idx == ls) {
+      return n->pin_prop;
+    } else {
+      idx -= ls + 1;
+      n = n->pin_right;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+prop_index_init(void)
+{
+  prop_index_pool = pool_create("propindex", sizeof(prop_index_node_t), 0);
+}
@@ -44,22 +44,9 @@ int alarm_fired = 0;
 void
 prop_courier_poll_with_alarm(prop_courier_t *pc, int maxtime)
 {
-  prop_notify_t *n, *next;
+  prop_notify_t *n;
 
-  if(!hts_mutex_trylock(&prop_mutex)) {
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_exp, hpn_link);
-    TAILQ_MERGE(&pc->pc_dispatch_queue, &pc->pc_queue_nor, hpn_link);
-
-    for(n = TAILQ_FIRST(&pc->pc_free_queue); n != NULL; n = next) {
-      next = TAILQ_NEXT(n, hpn_link);
-
-      prop_sub_ref_dec_locked(n->hpn_sub);
-      pool_put(notify_pool, n);
-    }
-    TAILQ_INIT(&pc->pc_free_queue);
-
-    hts_mutex_unlock(&prop_mutex);
-  }
+  prop_notify_courier_take(pc);
 
   if(TAILQ_FIRST(&pc->pc_dispatch_queue) == NULL)
     return;
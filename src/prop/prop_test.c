@@ -318,6 +318,295 @@ prop_test2(void)
 
 
 
+/**
+ * Scaling of create, find and destroy in a single big directory
+ */
+static void
+prop_test_scaling(int num)
+{
+  char name[32];
+  int i;
+  prop_t *r = prop_create_root(NULL);
+  prop_t **v = malloc(num * sizeof(prop_t *));
+  const int lookups = 10000;
+
+  int64_t ts0 = arch_get_ts();
+
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    v[i] = prop_create(r, name);
+  }
+
+  int64_t ts1 = arch_get_ts();
+
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    if(prop_create(r, name) != v[i]) {
+      printf("Lookup of %s failed\n", name);
+      exit(1);
+    }
+  }
+
+  int64_t ts2 = arch_get_ts();
+
+  for(i = 0; i < lookups; i++) {
+    const int idx = (i * 7919) % num;
+    snprintf(name, sizeof(name), "*%d", idx);
+    const char *path[] = {"root", name, NULL};
+    prop_t *p = prop_get_by_name(path, 0, PROP_TAG_NAMED_ROOT, r, "root",
+                                 NULL);
+    if(p != v[idx]) {
+      printf("Positional lookup of %s failed\n", name);
+      exit(1);
+    }
+    prop_ref_dec(p);
+  }
+
+  int64_t ts3 = arch_get_ts();
+
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    prop_destroy_by_name(r, name);
+  }
+
+  int64_t ts4 = arch_get_ts();
+
+  printf("%8d childs: create %6.0f ns  find %6.0f ns  "
+         "index %6.0f ns  destroy %6.0f ns\n", num,
+         (ts1 - ts0) * 1000.0 / num,
+         (ts2 - ts1) * 1000.0 / num,
+         (ts3 - ts2) * 1000.0 / lookups,
+         (ts4 - ts3) * 1000.0 / num);
+
+  free(v);
+  prop_destroy(r);
+}
+
+
+/**
+ * Lookups that hit must build the index too. Children linked with
+ * prop_set_parent() never go through a failing prop_find_child()
+ */
+static void
+prop_test_find_index(void)
+{
+  char name[32];
+  prop_t *r = prop_create_root(NULL);
+  const int num = PROP_INDEX_THRESHOLD * 4;
+  int i;
+
+  for(i = 0; i < num; i++) {
+    snprintf(name, sizeof(name), "child%d", i);
+    prop_set_parent(prop_create_root(name), r);
+  }
+
+  if(r->hp_child_index != NULL) {
+    printf("Index created before any lookup\n");
+    exit(1);
+  }
+
+  snprintf(name, sizeof(name), "child%d", num - 1);
+  prop_t *c = prop_create(r, name);
+
+  if(r->hp_child_index == NULL || prop_create(r, name) != c ||
+     TAILQ_LAST(&r->hp_childs, prop_queue) != c) {
+    printf("Index not created by a hit past the threshold\n");
+    exit(1);
+  }
+  prop_destroy(r);
+}
+
+
+/**
+ * A coalesced value is delivered after everything queued before it,
+ * also for other subscriptions on the same courier
+ */
+static int order_log[8];
+static int order_len;
+
+static void
+order_cb(void *opaque, int value)
+{
+  order_log[order_len++] = (intptr_t)opaque * 100 + value;
+}
+
+static void
+prop_test_coalesce_order(void)
+{
+  prop_t *r = prop_create_root(NULL);
+  prop_t *a = prop_create(r, "a");
+  prop_t *b = prop_create(r, "b");
+  prop_courier_t *pc = prop_courier_create_passive();
+  prop_courier_set_flags(pc, PROP_COURIER_COALESCE);
+
+  prop_set_int(a, 0);
+  prop_set_int(b, 0);
+
+  prop_sub_t *sa = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                                  PROP_TAG_CALLBACK_INT, order_cb,
+                                  (void *)(intptr_t)1,
+                                  PROP_TAG_ROOT, a,
+                                  PROP_TAG_COURIER, pc,
+                                  NULL);
+  prop_sub_t *sb = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                                  PROP_TAG_CALLBACK_INT, order_cb,
+                                  (void *)(intptr_t)2,
+                                  PROP_TAG_ROOT, b,
+                                  PROP_TAG_COURIER, pc,
+                                  NULL);
+  order_len = 0;
+  prop_set_int(a, 1);
+  prop_set_int(a, 2);  // Coalesced into the one above
+  prop_set_int(b, 1);
+  prop_set_int(a, 3);  // Coalesced too, and moved after b=1
+  prop_courier_poll(pc);
+
+  const int expect[] = {201, 103};
+  if(order_len != 2 || memcmp(order_log, expect, sizeof(expect))) {
+    printf("Coalesced notifications delivered out of order:");
+    for(int i = 0; i < order_len; i++)
+      printf(" %d", order_log[i]);
+    printf("\n");
+    exit(1);
+  }
+
+  prop_unsubscribe(sa);
+  prop_unsubscribe(sb);
+  prop_courier_destroy(pc);
+  prop_destroy(r);
+}
+
+
+/**
+ * Only the subscription asking for it is coalesced, even when its
+ * updates are interleaved with another one's on the same courier
+ */
+static void
+prop_test_coalesce_sub(void)
+{
+  prop_t *r = prop_create_root(NULL);
+  prop_t *a = prop_create(r, "a");
+  prop_t *b = prop_create(r, "b");
+  prop_courier_t *pc = prop_courier_create_passive();
+  int i;
+
+  prop_set_int(a, 0);
+  prop_set_int(b, 0);
+
+  prop_sub_t *sa = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE |
+                                  PROP_SUB_COALESCE,
+                                  PROP_TAG_CALLBACK_INT, order_cb,
+                                  (void *)(intptr_t)1,
+                                  PROP_TAG_ROOT, a,
+                                  PROP_TAG_COURIER, pc,
+                                  NULL);
+  prop_sub_t *sb = prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE,
+                                  PROP_TAG_CALLBACK_INT, order_cb,
+                                  (void *)(intptr_t)2,
+                                  PROP_TAG_ROOT, b,
+                                  PROP_TAG_COURIER, pc,
+                                  NULL);
+  order_len = 0;
+  for(i = 1; i <= 3; i++) {
+    prop_set_int(a, i);
+    prop_set_int(b, i);
+  }
+  prop_courier_poll(pc);
+
+  const int expect[] = {201, 202, 103, 203};
+  if(order_len != 4 || memcmp(order_log, expect, sizeof(expect))) {
+    printf("Expected a single delivery for the coalescing subscription:");
+    for(i = 0; i < order_len; i++)
+      printf(" %d", order_log[i]);
+    printf("\n");
+    exit(1);
+  }
+
+  prop_unsubscribe(sa);
+  prop_unsubscribe(sb);
+  prop_courier_destroy(pc);
+  prop_destroy(r);
+}
+
+
+/**
+ * Contention benchmark. N writer threads hammer int props that are
+ * observed by M subscriptions dispatched via a courier thread
+ */
+#define BENCH_WRITES 100000
+
+static atomic_t bench_delivered;
+
+static void
+bench_cb(void *opaque, int value)
+{
+  atomic_inc(&bench_delivered);
+}
+
+static void *
+bench_writer(void *aux)
+{
+  prop_t *p = aux;
+  for(int i = 0; i < BENCH_WRITES; i++)
+    prop_set_int(p, i);
+  return NULL;
+}
+
+static void
+prop_test_contention(int writers, int subscribers, int flags, int subflags)
+{
+  prop_t *r = prop_create_root(NULL);
+  prop_t *w[writers];
+  hts_thread_t tid[writers];
+  prop_sub_t *s[subscribers];
+  int i;
+  prop_courier_t *pc = prop_courier_create_thread(NULL, "propbench", flags);
+
+  for(i = 0; i < writers; i++)
+    w[i] = prop_create(r, NULL);
+
+  for(i = 0; i < subscribers; i++)
+    s[i] = prop_subscribe(subflags,
+                          PROP_TAG_CALLBACK_INT, bench_cb, NULL,
+                          PROP_TAG_ROOT, w[i % writers],
+                          PROP_TAG_COURIER, pc,
+                          NULL);
+
+  while(prop_courier_check(pc))
+    usleep(1000);
+
+  atomic_set(&bench_delivered, 0);
+  const int coalesced = atomic_get(&prop_notify_coalesced);
+  int64_t ts = arch_get_ts();
+
+  for(i = 0; i < writers; i++)
+    hts_thread_create_joinable("propbench", &tid[i], bench_writer, w[i],
+                               THREAD_PRIO_BGTASK);
+  for(i = 0; i < writers; i++)
+    hts_thread_join(&tid[i]);
+
+  ts = arch_get_ts() - ts;
+
+  while(prop_courier_check(pc))
+    usleep(1000);
+  usleep(100000);
+
+  printf("%2d writers %3d subs%s: %6.0f ns/set  "
+         "%8d delivered  %8d coalesced\n",
+         writers, subscribers,
+         flags & PROP_COURIER_COALESCE ? " (coalesce)" :
+         subflags & PROP_SUB_COALESCE  ? " (sub)     " : "           ",
+         ts * 1000.0 / (BENCH_WRITES * writers),
+         atomic_get(&bench_delivered),
+         atomic_get(&prop_notify_coalesced) - coalesced);
+
+  for(i = 0; i < subscribers; i++)
+    prop_unsubscribe(s[i]);
+  prop_courier_destroy(pc);
+  prop_destroy(r);
+}
+
+
 /**
  *
  */
@@ -326,5 +615,17 @@ prop_test(void)
 {
   prop_test1();
   prop_test2();
+  prop_test_scaling(100);
+  prop_test_scaling(10000);
+  prop_test_scaling(1000000);
+  prop_test_find_index();
+  prop_test_coalesce_order();
+  prop_test_coalesce_sub();
+  prop_test_contention(1, 1, 0, 0);
+  prop_test_contention(4, 16, 0, 0);
+  prop_test_contention(4, 16, PROP_COURIER_COALESCE, 0);
+  prop_test_contention(4, 16, 0, PROP_SUB_COALESCE);
+  prop_test_contention(8, 64, 0, 0);
+  prop_test_contention(8, 64, PROP_COURIER_COALESCE, 0);
 }
 #endif
@@ -749,7 +749,159 @@ es_sort(ext_subtitles_t *es, int trim_stop)
   TAILQ_INIT(&es->es_entries);
   for(i = 0; i < cnt; i++)
     TAILQ_INSERT_TAIL(&es->es_entries, vec[i], vo_link);
-  free(vec);
+
+  es->es_vec = vec;
+  es->es_num_entries = cnt;
+}
+
+
+/**
+ *
+ */
+static int
+i64cmp(const void *A, const void *B)
+{
+  const int64_t a = *(const int64_t *)A;
+  const int64_t b = *(const int64_t *)B;
+  return a < b ? -1 : a > b;
+}
+
+
+#define ES_SNAP_INTERVAL 32
+
+/**
+ * Split the timeline at every start and stop time and record how many
+ * entries have started in each segment plus which entries are active
+ * at every ES_SNAP_INTERVAL:th segment. The first segment covers
+ * everything before the first entry and the last one everything after
+ * the last entry. Both are empty
+ */
+static void
+es_build_index(ext_subtitles_t *es)
+{
+  video_overlay_t **vec = es->es_vec;
+  const int cnt = es->es_num_entries;
+  int64_t *bounds = malloc(sizeof(int64_t) * (cnt * 2 + 1));
+  int nb = 0, i, j;
+
+  bounds[nb++] = INT64_MIN;
+  for(i = 0; i < cnt; i++) {
+    if(vec[i]->vo_start >= vec[i]->vo_stop)
+      continue; // Never visible
+    bounds[nb++] = vec[i]->vo_start;
+    bounds[nb++] = vec[i]->vo_stop;
+  }
+
+  qsort(bounds, nb, sizeof(int64_t), i64cmp);
+  for(i = j = 1; i < nb; i++)
+    if(bounds[i] != bounds[j - 1])
+      bounds[j++] = bounds[i];
+  nb = j;
+
+  const int nsnaps = (nb + ES_SNAP_INTERVAL - 1) / ES_SNAP_INTERVAL;
+  int *seg_next = malloc(sizeof(int) * nb);
+  int *offset = malloc(sizeof(int) * (nsnaps + 1));
+  int *cur = malloc(sizeof(int) * (cnt + 1));
+  int ncur = 0, next = 0, max_active = 0;
+  int *active = NULL;
+  int nactive = 0, active_size = 0;
+
+  for(i = 0; i < nb; i++) {
+    const int64_t t = bounds[i];
+
+    // Drop entries that have ended, keep the rest in index order
+    for(j = 0; j < ncur; j++)
+      if(vec[cur[j]]->vo_stop <= t)
+        break;
+    for(int k = j; k < ncur; k++)
+      if(vec[cur[k]]->vo_stop > t)
+        cur[j++] = cur[k];
+    ncur = j;
+
+    for(; next < cnt && vec[next]->vo_start <= t; next++)
+      if(vec[next]->vo_stop > t)
+        cur[ncur++] = next;
+
+    seg_next[i] = next;
+    max_active = MAX(max_active, ncur);
+
+    if(i % ES_SNAP_INTERVAL)
+      continue;
+
+    if(nactive + ncur > active_size) {
+      active_size = MAX(active_size * 2, nactive + ncur + 256);
+      active = realloc(active, sizeof(int) * active_size);
+    }
+    offset[i / ES_SNAP_INTERVAL] = nactive;
+    memcpy(active + nactive, cur, sizeof(int) * ncur);
+    nactive += ncur;
+  }
+  offset[nsnaps] = nactive;
+  free(cur);
+
+  es->es_seg_start = bounds;
+  es->es_seg_next = seg_next;
+  es->es_snap_offset = offset;
+  es->es_snap_active = active;
+  es->es_scratch = malloc(sizeof(int) * (max_active + 1));
+  es->es_num_segs = nb;
+  es->es_cur_seg = -1;
+}
+
+
+/**
+ * Store entries active in segment 'seg' in 'out' in es_vec order and
+ * return how many. Entries active at the snapshot that are still
+ * active plus those that have started since and not yet stopped
+ */
+static int
+es_get_active(const ext_subtitles_t *es, int seg, int *out)
+{
+  const int64_t t = es->es_seg_start[seg];
+  const int snap = seg / ES_SNAP_INTERVAL;
+  const int *a  = es->es_snap_active + es->es_snap_offset[snap];
+  const int *ae = es->es_snap_active + es->es_snap_offset[snap + 1];
+  int n = 0;
+
+  for(; a != ae; a++)
+    if(es->es_vec[*a]->vo_stop > t)
+      out[n++] = *a;
+
+  for(int i = es->es_seg_next[snap * ES_SNAP_INTERVAL];
+      i < es->es_seg_next[seg]; i++)
+    if(es->es_vec[i]->vo_stop > t)
+      out[n++] = i;
+  return n;
+}
+
+
+/**
+ * Return segment that covers time 't'
+ */
+static int
+es_find_segment(const ext_subtitles_t *es, int64_t t)
+{
+  int lo = 0, hi = es->es_num_segs - 1;
+
+  // Playback moves forward, check where we were and the one after first
+
+  const int c = es->es_cur_seg;
+  if(c >= 0 && es->es_seg_start[c] <= t) {
+    if(c + 1 == es->es_num_segs || es->es_seg_start[c + 1] > t)
+      return c;
+    if(c + 2 == es->es_num_segs || es->es_seg_start[c + 2] > t)
+      return c + 1;
+    lo = c + 2;
+  }
+
+  while(lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if(es->es_seg_start[mid] <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
 }
 
 
@@ -820,8 +972,10 @@ subtitles_create(const char *path, buf_t *buf, AVRational *fr)
     buf_release(buf);
   }
 
-  if(s)
+  if(s) {
     es_sort(s, trim_stop);
+    es_build_index(s);
+  }
   return s;
 }
 
@@ -838,6 +992,12 @@ subtitles_destroy(ext_subtitles_t *es)
     TAILQ_REMOVE(&es->es_entries, vo, vo_link);
     video_overlay_destroy(vo);
   }
+  free(es->es_vec);
+  free(es->es_seg_start);
+  free(es->es_seg_next);
+  free(es->es_snap_offset);
+  free(es->es_snap_active);
+  free(es->es_scratch);
   if(es->es_dtor)
     es->es_dtor(es);
   free(es);
@@ -848,63 +1008,62 @@ subtitles_destroy(ext_subtitles_t *es)
  *
  */
 static void
-vo_deliver(ext_subtitles_t *es, video_overlay_t *vo, media_pipe_t *mp,
-	   int64_t user_time, int64_t user_time_to_pts)
+vo_deliver(video_overlay_t *vo, media_pipe_t *mp, int64_t user_time_to_pts)
 {
-  int64_t s = vo->vo_start;
-  do {
-        es->es_cur = vo;
+  video_overlay_t *dup = video_overlay_dup(vo);
 
-        video_overlay_t *dup = video_overlay_dup(vo);
+  dup->vo_start += user_time_to_pts;
+  dup->vo_stop  += user_time_to_pts;
 
-        dup->vo_start += user_time_to_pts;
-        dup->vo_stop  += user_time_to_pts;
-
-        video_overlay_enqueue(mp, dup);
-        //printf("delivery %" PRId64 " %" PRId64 " - %" PRId64 ": %ls\n",user_time,vo->vo_start,vo->vo_stop,(wchar_t*)vo->vo_text);
-        vo = TAILQ_NEXT(vo, vo_link);
-  } while(vo != NULL && vo->vo_start == s && vo->vo_stop > user_time);
+  video_overlay_enqueue(mp, dup);
 }
 
 
 /**
- *
+ * Deliver entries that became active since the last pick. Entries that
+ * are still active have already been sent
  */
 void
 subtitles_pick(ext_subtitles_t *es, int64_t user_time, int64_t pts,
                media_pipe_t *mp)
 {
-  video_overlay_t *vo = es->es_cur;
-
   if(es->es_picker)
     return es->es_picker(es, pts);
 
-  int64_t user_time_to_pts = pts - user_time;
-  while(vo != NULL) {
-    vo = TAILQ_NEXT(vo, vo_link);
-    if(vo != NULL && vo->vo_start <= user_time && vo->vo_stop > user_time) {
-      vo_deliver(es, vo, mp, user_time, user_time_to_pts);
-      return;
-    }
-    if(vo != NULL && vo->vo_start > user_time)
-      break;
-  }
+  if(es->es_num_segs == 0)
+    return;
 
-  vo = es->es_cur;
+  const int seg = es_find_segment(es, user_time);
+  const int prev = es->es_cur_seg;
 
-  if(vo != NULL && vo->vo_start <= user_time && vo->vo_stop > user_time) {
-    return; // Already sent
-  }
+  if(seg == prev)
+    return;
 
-  TAILQ_FOREACH(vo, &es->es_entries, vo_link) {
-    if(vo->vo_start <= user_time && vo->vo_stop > user_time && vo->vo_start>user_time-1000000) {//don't re-delivery long standing item
-      vo_deliver(es, vo, mp, user_time, user_time_to_pts);
-      return;
-    }
-    if(vo->vo_start>user_time)
-      break;
+  es->es_cur_seg = seg;
+
+  const int64_t user_time_to_pts = pts - user_time;
+  const int64_t pt = prev == -1 ? 0 : es->es_seg_start[prev];
+  const int n = es_get_active(es, seg, es->es_scratch);
+
+  for(int i = 0; i < n; i++) {
+    video_overlay_t *vo = es->es_vec[es->es_scratch[i]];
+
+    // Skip what was active in the previous segment, it's already sent
+    if(prev != -1 && vo->vo_start <= pt && vo->vo_stop > pt)
+      continue;
+    vo_deliver(vo, mp, user_time_to_pts);
   }
-  es->es_cur = NULL;
+}
+
+
+/**
+ * The overlay queue has been flushed, deliver whatever is active on
+ * next pick
+ */
+void
+subtitles_flush(ext_subtitles_t *es)
+{
+  es->es_cur_seg = -1;
 }
 
 
@@ -1026,3 +1185,243 @@ subtitles_probe(const char *url)
   buf_release(b);
   return ret;
 }
+
+
+#ifdef SUBTITLES_BENCHMARK
+
+/**
+ *
+ */
+static void
+bench_srt_time(htsbuf_queue_t *q, int64_t ms)
+{
+  htsbuf_qprintf(q, "%02d:%02d:%02d,%03d", (int)(ms / 3600000),
+                 (int)(ms / 60000 % 60), (int)(ms / 1000 % 60),
+                 (int)(ms % 1000));
+}
+
+
+/**
+ *
+ */
+static void
+bench_ass_time(htsbuf_queue_t *q, int64_t ms)
+{
+  htsbuf_qprintf(q, "%d:%02d:%02d.%02d", (int)(ms / 3600000),
+                 (int)(ms / 60000 % 60), (int)(ms / 1000 % 60),
+                 (int)(ms / 10 % 100));
+}
+
+
+/**
+ * Cues every 2s lasting 1.5 - 4.5s, so some of them overlap
+ */
+static buf_t *
+bench_make_srt(int cues)
+{
+  htsbuf_queue_t q;
+  htsbuf_queue_init(&q, 0);
+  for(int i = 0; i < cues; i++) {
+    const int64_t start = i * 2000LL;
+    htsbuf_qprintf(&q, "%d\n", i + 1);
+    bench_srt_time(&q, start);
+    htsbuf_qprintf(&q, " --> ");
+    bench_srt_time(&q, start + 1500 + (i * 7919) % 3000);
+    htsbuf_qprintf(&q, "\nThis is line number %d\nand a second line\n\n", i);
+  }
+  char *str = htsbuf_to_string(&q);
+  htsbuf_queue_flush(&q);
+  return buf_create_and_adopt(strlen(str), str, &free);
+}
+
+
+/**
+ * Karaoke style: an event every 250ms lasting 4s, ~16 active at once
+ */
+static buf_t *
+bench_make_ass(int events)
+{
+  htsbuf_queue_t q;
+  htsbuf_queue_init(&q, 0);
+  htsbuf_qprintf(&q,
+                 "[Script Info]\nScriptType: v4.00+\n"
+                 "PlayResX: 1280\nPlayResY: 720\n\n"
+                 "[V4+ Styles]\n"
+                 "Format: Name, Fontname, Fontsize, PrimaryColour, "
+                 "SecondaryColour, OutlineColour, BackColour, Bold, Italic, "
+                 "Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, "
+                 "BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, "
+                 "MarginV, Encoding\n"
+                 "Style: Default,Arial,40,&H00FFFFFF,&H000000FF,&H00000000,"
+                 "&H00000000,0,0,0,0,100,100,0,0,1,2,0,2,10,10,10,1\n\n"
+                 "[Events]\n"
+                 "Format: Layer, Start, End, Style, Name, MarginL, MarginR, "
+                 "MarginV, Effect, Text\n");
+
+  for(int i = 0; i < events; i++) {
+    const int64_t start = i * 250LL;
+    htsbuf_qprintf(&q, "Dialogue: %d,", i % 4);
+    bench_ass_time(&q, start);
+    htsbuf_qprintf(&q, ",");
+    bench_ass_time(&q, start + 4000);
+    htsbuf_qprintf(&q, ",Default,,0,0,0,,"
+                   "{\\k20}La {\\k25}la {\\k30}line {\\k15}%d\n", i);
+  }
+  char *str = htsbuf_to_string(&q);
+  htsbuf_queue_flush(&q);
+  return buf_create_and_adopt(strlen(str), str, &free);
+}
+
+
+/**
+ *
+ */
+static int
+bench_drain(media_pipe_t *mp)
+{
+  video_overlay_t *vo;
+  int cnt = 0;
+  hts_mutex_lock(&mp->mp_overlay_mutex);
+  TAILQ_FOREACH(vo, &mp->mp_overlay_queue, vo_link)
+    cnt += vo->vo_type != VO_FLUSH;
+  video_overlay_flush_locked(mp, 0);
+  hts_mutex_unlock(&mp->mp_overlay_mutex);
+  return cnt;
+}
+
+
+/**
+ *
+ */
+static void
+subtitles_bench_one(const char *name, buf_t *b, media_pipe_t *mp)
+{
+  const int64_t frame = 40000; // 25 fps
+  int64_t ts = arch_get_ts();
+  ext_subtitles_t *es = subtitles_create(name, b, NULL);
+  const int64_t parse_time = arch_get_ts() - ts;
+  int i, j, n;
+
+  if(es == NULL) {
+    printf("%s: Failed to parse\n", name);
+    return;
+  }
+
+  const int cnt = es->es_num_entries;
+  int64_t end = 0, expected = 0;
+  for(i = 0; i < cnt; i++) {
+    const video_overlay_t *vo = es->es_vec[i];
+    end = MAX(end, vo->vo_stop);
+    // Visible at some frame time?
+    if((vo->vo_start + frame - 1) / frame * frame < vo->vo_stop)
+      expected++;
+  }
+
+  // Play through at frame rate
+
+  int delivered = 0;
+  ts = arch_get_ts();
+  for(int64_t t = 0, f = 0; t < end + frame; t += frame, f++) {
+    subtitles_pick(es, t, t, mp);
+    if((f & 255) == 0)
+      delivered += bench_drain(mp);
+  }
+  const int64_t play_time = arch_get_ts() - ts;
+  delivered += bench_drain(mp);
+
+  // Random seeks
+
+  const int seeks = 100000;
+  uint32_t x = 1;
+  ts = arch_get_ts();
+  for(i = 0; i < seeks; i++) {
+    x = x * 1664525 + 1013904223;
+    subtitles_flush(es);
+    subtitles_pick(es, (int64_t)x % (end + 1), 0, mp);
+    if((i & 255) == 0)
+      bench_drain(mp);
+  }
+  const int64_t seek_time = arch_get_ts() - ts;
+  bench_drain(mp);
+
+  // Compare with a linear scan of all entries
+
+  int bad = 0;
+  int64_t scan_time = 0;
+  const int checks = 2000;
+  for(i = 0; i < checks; i++) {
+    x = x * 1664525 + 1013904223;
+    const int64_t t = (int64_t)x % (end + 1);
+    const int seg = es_find_segment(es, t);
+    const int *a = es->es_scratch;
+    const int na = es_get_active(es, seg, es->es_scratch);
+
+    ts = arch_get_ts();
+    n = 0;
+    for(j = 0; j < cnt; j++) {
+      const video_overlay_t *vo = es->es_vec[j];
+      if(vo->vo_start <= t && vo->vo_stop > t) {
+        if(n >= na || a[n] != j)
+          bad++;
+        n++;
+      }
+    }
+    scan_time += arch_get_ts() - ts;
+    if(n != na)
+      bad++;
+  }
+
+  int64_t active = 0;
+  for(i = 0; i < es->es_num_segs; i++)
+    active += es_get_active(es, i, es->es_scratch);
+
+  printf("%s: %d entries, %d segments, %.1f active on average\n"
+         "  Index: %d kB\n"
+         "  Parse: %"PRId64" ms\n"
+         "  Playback: %.0f ns per frame, %d of %"PRId64" delivered\n"
+         "  Seek: %.0f ns per pick (linear scan: %.0f ns)\n"
+         "  Mismatches: %d\n",
+         name, cnt, es->es_num_segs,
+         (float)active / es->es_num_segs,
+         (int)((es->es_num_segs * (sizeof(int64_t) + sizeof(int)) +
+                es->es_snap_offset[(es->es_num_segs + ES_SNAP_INTERVAL - 1) /
+                                   ES_SNAP_INTERVAL] * sizeof(int)) / 1024),
+         parse_time / 1000,
+         play_time * 1000.0 / ((end + frame) / frame),
+         delivered, expected,
+         seek_time * 1000.0 / seeks,
+         scan_time * 1000.0 / checks, bad);
+
+  subtitles_destroy(es);
+}
+
+
+/**
+ * Parse large generated SRT and ASS files and pick from them at frame
+ * rate and at random positions. Build with -DSUBTITLES_BENCHMARK.
+ * The process exits when done
+ */
+static void *
+subtitles_benchmark(void *aux)
+{
+  media_pipe_t *mp = mp_create("subbench", 0);
+
+  subtitles_bench_one("bench.srt", bench_make_srt(50000), mp);
+  subtitles_bench_one("bench.ass", bench_make_ass(50000), mp);
+  exit(0);
+}
+
+
+/**
+ *
+ */
+static void
+subtitles_benchmark_init(void)
+{
+  hts_thread_create_detached("subbench", subtitles_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, subtitles_benchmark_init, NULL, 0);
+
+#endif
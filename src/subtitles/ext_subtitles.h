@@ -27,7 +27,24 @@ struct video_decoder;
 
 typedef struct ext_subtitles {
   struct video_overlay_queue es_entries;
-  video_overlay_t *es_cur;
+
+  /**
+   * Lookup index built once loading is done. Segment 'i' starts at
+   * es_seg_start[i] and lasts until the next one. es_vec is sorted on
+   * start time and es_vec[0] ... es_vec[es_seg_next[i]-1] are the
+   * entries that have started by then. The set of active entries is
+   * stored for every ES_SNAP_INTERVAL:th segment, segment 'i' is
+   * rebuilt from the snapshot before it, see es_get_active()
+   */
+  video_overlay_t **es_vec;
+  int es_num_entries;
+  int64_t *es_seg_start;
+  int *es_seg_next;
+  int *es_snap_offset;
+  int *es_snap_active;
+  int *es_scratch;    // Room for the largest active set
+  int es_num_segs;
+  int es_cur_seg;     // Segment delivered by last pick, -1 if none
 
   void (*es_dtor)(struct ext_subtitles *es);
   void (*es_picker)(struct ext_subtitles *es, int64_t pts);
@@ -44,3 +61,5 @@ ext_subtitles_t *load_ssa(const char *url, char *buf, size_t len);
 
 void subtitles_pick(ext_subtitles_t *es, int64_t user_time, int64_t pts,
                     media_pipe_t *mp);
+
+void subtitles_flush(ext_subtitles_t *es);
@@ -18,38 +18,82 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 #include <assert.h>
+#include <string.h>
 
 #include "main.h"
+#include "arch/arch.h"
+#include "arch/atomic.h"
 #include "arch/threads.h"
 
 #include "task.h"
 #include "misc/queue.h"
+#include "misc/callout.h"
+#include "misc/minmax.h"
+#include "prop/prop.h"
 
 #define MAX_TASK_THREADS 16
 #define MAX_IDLE_TASK_THREADS 2
 
+// Tasks are spread over a number of queues (shards), each with its
+// own lock. Submitters pick a shard round robin and workers steal
+// from all shards, starting with their own.
+#define TASK_SHARDS 8
+
+// Max number of task_t kept for reuse per shard
+#define TASK_FREELIST_SIZE 32
+
+// Minimum share of dequeues that start at a lower priority, so a
+// steady stream of high priority work can't starve the rest. Every
+// 4th dequeue looks at NORMAL first and every 16th at LOW first
+#define TASK_SHARE_NORMAL 4
+#define TASK_SHARE_LOW    16
+
 TAILQ_HEAD(task_queue, task);
-TAILQ_HEAD(task_group_queue, task_group);
 
 struct task_group {
   atomic_t tg_refcount;
+  hts_mutex_t tg_mutex;
   struct task_queue tg_tasks;
-  TAILQ_ENTRY(task_group) tg_link;
 };
 
 
 typedef struct task {
-  TAILQ_ENTRY(task) t_link;
+  TAILQ_ENTRY(task) t_link;        // In shard queue or freelist
+  TAILQ_ENTRY(task) t_group_link;  // In tg_tasks
   task_fn_t *t_fn;
   void *t_opaque;
   task_group_t *t_group;
+  int64_t t_enqueued;
+  int t_prio;
 } task_t;
 
 
-static struct task_queue tasks = TAILQ_HEAD_INITIALIZER(tasks);
-static struct task_group_queue task_groups =TAILQ_HEAD_INITIALIZER(task_groups);
-static unsigned int num_task_threads;
-static unsigned int num_task_threads_avail;
+typedef struct task_shard {
+  hts_mutex_t ts_mutex;
+  struct task_queue ts_queues[TASK_PRIO_num];
+  atomic_t ts_queued[TASK_PRIO_num]; // Can be peeked at without lock
+
+  struct task_queue ts_free;
+  int ts_num_free;
+
+  // Stats since last report
+  int64_t ts_latency_sum[TASK_PRIO_num];
+  int ts_latency_max[TASK_PRIO_num];
+  int ts_executed[TASK_PRIO_num];
+} task_shard_t;
+
+
+static task_shard_t task_shards[TASK_SHARDS];
+
+static atomic_t task_pending;
+static atomic_t task_pending_prio[TASK_PRIO_num];
+static atomic_t task_shard_rr;
+static atomic_t task_dequeue_tally;
+
+// task_mutex only protects thread creation and sleeping
+static atomic_t num_task_threads;
+static atomic_t num_task_threads_avail;
+static int task_thread_tally;
 static hts_mutex_t task_mutex;
 static hts_cond_t task_cond;
 
@@ -63,6 +107,7 @@ task_group_release(task_group_t *tg)
   if(atomic_dec(&tg->tg_refcount))
     return;
   assert(TAILQ_FIRST(&tg->tg_tasks) == NULL);
+  hts_mutex_destroy(&tg->tg_mutex);
   free(tg);
 }
 
@@ -70,66 +115,179 @@ task_group_release(task_group_t *tg)
 /**
  *
  */
-static void *
-task_thread(void *aux)
+static task_shard_t *
+task_shard_select(void)
 {
-  task_t *t;
-  task_group_t *tg;
+  unsigned int i = atomic_add_and_fetch(&task_shard_rr, 1);
+  return &task_shards[i % TASK_SHARDS];
+}
 
-  hts_mutex_lock(&task_mutex);
-  while(1) {
-    t = TAILQ_FIRST(&tasks);
-    tg = TAILQ_FIRST(&task_groups);
 
-    if(t == NULL && tg == NULL) {
-      if(num_task_threads_avail == MAX_IDLE_TASK_THREADS)
-        break;
+/**
+ * Shard must be locked
+ */
+static task_t *
+task_alloc(task_shard_t *ts)
+{
+  task_t *t = TAILQ_FIRST(&ts->ts_free);
+  if(t == NULL)
+    return malloc(sizeof(task_t));
 
-      num_task_threads_avail++;
-      hts_cond_wait(&task_cond, &task_mutex);
-      num_task_threads_avail--;
+  TAILQ_REMOVE(&ts->ts_free, t, t_link);
+  ts->ts_num_free--;
+  return t;
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+task_free(task_shard_t *ts, task_t *t)
+{
+  if(ts->ts_num_free == TASK_FREELIST_SIZE) {
+    free(t);
+    return;
+  }
+  TAILQ_INSERT_HEAD(&ts->ts_free, t, t_link);
+  ts->ts_num_free++;
+}
+
+
+/**
+ * Shard must be locked
+ */
+static void
+task_enqueue(task_shard_t *ts, task_t *t)
+{
+  t->t_enqueued = arch_get_ts();
+  TAILQ_INSERT_TAIL(&ts->ts_queues[t->t_prio], t, t_link);
+  atomic_inc(&ts->ts_queued[t->t_prio]);
+  atomic_inc(&task_pending_prio[t->t_prio]);
+  atomic_inc(&task_pending);
+}
+
+
+/**
+ * Pick the oldest task of the highest priority available, looking in
+ * our own shard first and then stealing from the others
+ */
+static task_t *
+task_dequeue(int home)
+{
+  const unsigned int tally = atomic_add_and_fetch(&task_dequeue_tally, 1);
+  int first = TASK_PRIO_HIGH;
+
+  if(tally % TASK_SHARE_LOW == 0)
+    first = TASK_PRIO_LOW;
+  else if(tally % TASK_SHARE_NORMAL == 0)
+    first = TASK_PRIO_NORMAL;
+
+  for(int j = 0; j < TASK_PRIO_num; j++) {
+    const int prio = (first + j) % TASK_PRIO_num;
+
+    if(atomic_get(&task_pending_prio[prio]) == 0)
       continue;
-    }
 
-    if(t != NULL) {
-      TAILQ_REMOVE(&tasks, t, t_link);
-      hts_mutex_unlock(&task_mutex);
-      t->t_fn(t->t_opaque);
-      free(t);
-      hts_mutex_lock(&task_mutex);
-      // Released lock, must recheck for task groups
-      tg = TAILQ_FIRST(&task_groups);
-    }
+    for(int i = 0; i < TASK_SHARDS; i++) {
+      task_shard_t *ts = &task_shards[(home + i) % TASK_SHARDS];
+
+      if(atomic_get(&ts->ts_queued[prio]) == 0)
+        continue;
 
-    if(tg != NULL) {
-      // Remove task group while processing as we don't want anyone
-      // else to dispatch from this group
-      TAILQ_REMOVE(&task_groups, tg, tg_link);
-
-      t = TAILQ_FIRST(&tg->tg_tasks);
-      hts_mutex_unlock(&task_mutex);
-      t->t_fn(t->t_opaque);
-      hts_mutex_lock(&task_mutex);
-
-      // Note that we remove _after_ execution because we don't want
-      // any newly inserted task in this group to cause the group
-      // to activate (ie, get inserted in task_groups)
-      TAILQ_REMOVE(&tg->tg_tasks, t, t_link);
-      free(t);
-
-      if(TAILQ_FIRST(&tg->tg_tasks) != NULL) {
-        // Still more tasks to work on in this group
-        // Reinsert group at tail to maintain fairness between groups
-        TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
+      hts_mutex_lock(&ts->ts_mutex);
+      task_t *t = TAILQ_FIRST(&ts->ts_queues[prio]);
+      if(t != NULL) {
+        TAILQ_REMOVE(&ts->ts_queues[prio], t, t_link);
+        atomic_dec(&ts->ts_queued[prio]);
+        atomic_dec(&task_pending_prio[prio]);
+        atomic_dec(&task_pending);
+
+        const int latency = arch_get_ts() - t->t_enqueued;
+        ts->ts_latency_sum[prio] += latency;
+        ts->ts_latency_max[prio] = MAX(ts->ts_latency_max[prio], latency);
+        ts->ts_executed[prio]++;
       }
+      hts_mutex_unlock(&ts->ts_mutex);
+      if(t != NULL)
+        return t;
+    }
+  }
+  return NULL;
+}
+
 
-      // Decrease refcount owned by task
-      task_group_release(tg);
+/**
+ *
+ */
+static void
+task_execute(task_shard_t *home, task_t *t)
+{
+  t->t_fn(t->t_opaque);
+
+  task_group_t *tg = t->t_group;
+  if(tg != NULL) {
+    // Note that we remove _after_ execution because we don't want
+    // any newly inserted task in this group to cause the group
+    // to activate (ie, get enqueued)
+    hts_mutex_lock(&tg->tg_mutex);
+    TAILQ_REMOVE(&tg->tg_tasks, t, t_group_link);
+    task_t *next = TAILQ_FIRST(&tg->tg_tasks);
+    hts_mutex_unlock(&tg->tg_mutex);
+
+    hts_mutex_lock(&home->ts_mutex);
+    if(next != NULL) {
+      // Still more tasks to work on in this group. Enqueue at tail
+      // to maintain fairness between groups
+      task_enqueue(home, next);
     }
+    task_free(home, t);
+    hts_mutex_unlock(&home->ts_mutex);
+
+    // Decrease refcount owned by task
+    task_group_release(tg);
+    return;
   }
 
-  num_task_threads--;
-  hts_mutex_unlock(&task_mutex);
+  hts_mutex_lock(&home->ts_mutex);
+  task_free(home, t);
+  hts_mutex_unlock(&home->ts_mutex);
+}
+
+
+/**
+ *
+ */
+static void *
+task_thread(void *aux)
+{
+  const int home = (intptr_t)aux;
+  task_t *t;
+
+  while(1) {
+    if((t = task_dequeue(home)) != NULL) {
+      task_execute(&task_shards[home], t);
+      continue;
+    }
+
+    hts_mutex_lock(&task_mutex);
+    atomic_inc(&num_task_threads_avail);
+
+    // task_schedule() reads num_task_threads_avail after bumping
+    // task_pending so either it sees us as available or we see
+    // the new task here
+    if(atomic_get(&task_pending) == 0) {
+      if(atomic_get(&num_task_threads_avail) > MAX_IDLE_TASK_THREADS) {
+        atomic_dec(&num_task_threads_avail);
+        atomic_dec(&num_task_threads);
+        hts_mutex_unlock(&task_mutex);
+        break;
+      }
+      hts_cond_wait(&task_cond, &task_mutex);
+    }
+    atomic_dec(&num_task_threads_avail);
+    hts_mutex_unlock(&task_mutex);
+  }
   return NULL;
 }
 
@@ -138,17 +296,22 @@ task_thread(void *aux)
  *
  */
 static void
-task_schedule()
+task_schedule(void)
 {
-  if(num_task_threads_avail > 0) {
+  if(atomic_get(&num_task_threads_avail) == 0 &&
+     atomic_get(&num_task_threads) >= MAX_TASK_THREADS)
+    return; // Everyone is busy, someone will pick it up when done
+
+  hts_mutex_lock(&task_mutex);
+  if(atomic_get(&num_task_threads_avail) > 0) {
     hts_cond_signal(&task_cond);
-  } else {
-    if(num_task_threads < MAX_TASK_THREADS) {
-      num_task_threads++;
-      hts_thread_create_detached("tasks", task_thread, NULL,
-                                 THREAD_PRIO_BGTASK);
-    }
+  } else if(atomic_get(&num_task_threads) < MAX_TASK_THREADS) {
+    atomic_inc(&num_task_threads);
+    intptr_t home = task_thread_tally++ % TASK_SHARDS;
+    hts_thread_create_detached("tasks", task_thread, (void *)home,
+                               THREAD_PRIO_BGTASK);
   }
+  hts_mutex_unlock(&task_mutex);
 }
 
 
@@ -156,15 +319,29 @@ task_schedule()
  *
  */
 void
-task_run(task_fn_t *fn, void *opaque)
+task_run_prio(task_fn_t *fn, void *opaque, int prio)
 {
-  task_t *t = calloc(1, sizeof(task_t));
+  task_shard_t *ts = task_shard_select();
+
+  hts_mutex_lock(&ts->ts_mutex);
+  task_t *t = task_alloc(ts);
   t->t_fn = fn;
   t->t_opaque = opaque;
-  hts_mutex_lock(&task_mutex);
-  TAILQ_INSERT_TAIL(&tasks, t, t_link);
+  t->t_group = NULL;
+  t->t_prio = prio;
+  task_enqueue(ts, t);
+  hts_mutex_unlock(&ts->ts_mutex);
   task_schedule();
-  hts_mutex_unlock(&task_mutex);
+}
+
+
+/**
+ *
+ */
+void
+task_run(task_fn_t *fn, void *opaque)
+{
+  task_run_prio(fn, opaque, TASK_PRIO_NORMAL);
 }
 
 
@@ -177,6 +354,7 @@ task_group_create(void)
 {
   task_group_t *tg = calloc(1, sizeof(task_group_t));
   atomic_set(&tg->tg_refcount, 1);
+  hts_mutex_init(&tg->tg_mutex);
   TAILQ_INIT(&tg->tg_tasks);
   return tg;
 }
@@ -193,26 +371,134 @@ task_group_destroy(task_group_t *tg)
 
 
 /**
- *
+ * Tasks in a group are executed one at a time in the order they
+ * were added. Only the first task of a group is ever enqueued,
+ * the next one is enqueued when it has finished.
  */
 void
 task_run_in_group(task_fn_t *fn, void *opaque, task_group_t *tg)
 {
-  task_t *t = calloc(1, sizeof(task_t));
+  task_shard_t *ts = task_shard_select();
+
+  hts_mutex_lock(&ts->ts_mutex);
+  task_t *t = task_alloc(ts);
+  hts_mutex_unlock(&ts->ts_mutex);
+
   t->t_fn = fn;
   t->t_opaque = opaque;
   t->t_group = tg;
+  t->t_prio = TASK_PRIO_NORMAL;
   atomic_inc(&tg->tg_refcount);
-  hts_mutex_lock(&task_mutex);
-  if(TAILQ_FIRST(&tg->tg_tasks) == NULL)
-    TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
 
-  TAILQ_INSERT_TAIL(&tg->tg_tasks, t, t_link);
+  hts_mutex_lock(&tg->tg_mutex);
+  const int activate = TAILQ_FIRST(&tg->tg_tasks) == NULL;
+  TAILQ_INSERT_TAIL(&tg->tg_tasks, t, t_group_link);
+  hts_mutex_unlock(&tg->tg_mutex);
+
+  if(!activate)
+    return;
+
+  hts_mutex_lock(&ts->ts_mutex);
+  task_enqueue(ts, t);
+  hts_mutex_unlock(&ts->ts_mutex);
   task_schedule();
-  hts_mutex_unlock(&task_mutex);
+}
+
+
+/**
+ * Stats
+ */
+static callout_t task_stats_callout;
+static prop_t *task_stats_prio[TASK_PRIO_num];
+static prop_t *task_stats_root;
+
+typedef struct task_stats {
+  int queued;
+  int executed;
+  int avglatency;
+  int maxlatency;
+} task_stats_t;
+
+static task_stats_t task_stats_published[TASK_PRIO_num];
+static int task_stats_threads = -1;
+static int task_stats_idle = -1;
+
+static void
+task_stats_update(callout_t *c, void *aux)
+{
+  callout_arm(&task_stats_callout, task_stats_update, NULL, 1);
+
+  for(int prio = 0; prio < TASK_PRIO_num; prio++) {
+    int64_t latency_sum = 0;
+    int latency_max = 0;
+    int executed = 0;
+
+    for(int i = 0; i < TASK_SHARDS; i++) {
+      task_shard_t *ts = &task_shards[i];
+      hts_mutex_lock(&ts->ts_mutex);
+      latency_sum += ts->ts_latency_sum[prio];
+      latency_max = MAX(latency_max, ts->ts_latency_max[prio]);
+      executed += ts->ts_executed[prio];
+      ts->ts_latency_sum[prio] = 0;
+      ts->ts_latency_max[prio] = 0;
+      ts->ts_executed[prio] = 0;
+      hts_mutex_unlock(&ts->ts_mutex);
+    }
+
+    const task_stats_t st = {
+      .queued     = atomic_get(&task_pending_prio[prio]),
+      .executed   = executed,
+      .avglatency = executed ? (int)(latency_sum / executed) : 0,
+      .maxlatency = latency_max,
+    };
+
+    // Idle most of the time, don't bother the prop tree then
+    if(!memcmp(&st, &task_stats_published[prio], sizeof(st)))
+      continue;
+    task_stats_published[prio] = st;
+
+    prop_t *p = task_stats_prio[prio];
+    prop_set(p, "queued",     PROP_SET_INT, st.queued);
+    prop_set(p, "executed",   PROP_SET_INT, st.executed);
+    prop_set(p, "avglatency", PROP_SET_INT, st.avglatency);
+    prop_set(p, "maxlatency", PROP_SET_INT, st.maxlatency);
+  }
+
+  const int threads = atomic_get(&num_task_threads);
+  const int idle    = atomic_get(&num_task_threads_avail);
+
+  if(threads != task_stats_threads) {
+    task_stats_threads = threads;
+    prop_set(task_stats_root, "threads", PROP_SET_INT, threads);
+  }
+  if(idle != task_stats_idle) {
+    task_stats_idle = idle;
+    prop_set(task_stats_root, "idle", PROP_SET_INT, idle);
+  }
 }
 
 
+/**
+ *
+ */
+static void
+task_stats_init(void)
+{
+  static const char *prionames[TASK_PRIO_num] = {"high", "normal", "low"};
+
+  task_stats_root = prop_create(prop_create(prop_get_global(), "system"),
+                                "tasks");
+  for(int i = 0; i < TASK_PRIO_num; i++) {
+    task_stats_prio[i] = prop_create(task_stats_root, prionames[i]);
+    task_stats_published[i].queued = -1;
+  }
+
+  task_stats_update(NULL, NULL);
+}
+
+INITME(INIT_GROUP_API, task_stats_init, NULL, 0);
+
+
 /**
  *
  */
@@ -220,4 +506,12 @@ INITIALIZER(taskinit)
 {
   hts_mutex_init(&task_mutex);
   hts_cond_init(&task_cond, &task_mutex);
+
+  for(int i = 0; i < TASK_SHARDS; i++) {
+    task_shard_t *ts = &task_shards[i];
+    hts_mutex_init(&ts->ts_mutex);
+    TAILQ_INIT(&ts->ts_free);
+    for(int j = 0; j < TASK_PRIO_num; j++)
+      TAILQ_INIT(&ts->ts_queues[j]);
+  }
 }
@@ -23,8 +23,20 @@ typedef struct task_group task_group_t;
 
 typedef void (task_fn_t)(void *opaque);
 
+/**
+ * Task priorities. Tasks with higher priority (lower value) are
+ * dequeued before tasks of lower priority, except for a small share
+ * of dequeues reserved for the lower classes so they can't starve
+ */
+#define TASK_PRIO_HIGH   0 // UI visible work
+#define TASK_PRIO_NORMAL 1
+#define TASK_PRIO_LOW    2 // Bulk background work
+#define TASK_PRIO_num    3
+
 void task_run(task_fn_t *fn, void *opaque);
 
+void task_run_prio(task_fn_t *fn, void *opaque, int prio);
+
 task_group_t *task_group_create(void);
 
 void task_group_destroy(task_group_t *tg);
@@ -26,9 +26,11 @@
 #include "image/pixmap.h"
 #include "image/image.h"
 #include "text.h"
+#include "glyph_atlas.h"
 #include "arch/arch.h"
 
 #include "fileaccess/fileaccess.h"
+#include "arch/atomic.h"
 
 #define HORIZONTAL_ELLIPSIS_UNICODE 0x2026
 
@@ -46,13 +48,25 @@
 
 #define ftver ver(FREETYPE_MAJOR, FREETYPE_MINOR, FREETYPE_PATCH)
 
+/**
+ * Before 2.6 the autohinter and the rasterizer keep their scratch state
+ * in the library object so all glyph loading and rendering must be
+ * serialized. Newer versions only need a lock per FT_Face
+ */
+#define FT_SHARED_STATE (ftver < ver(2, 6, 0))
+
 static FT_Library text_library;
-static FT_Stroker text_stroker;
 static hts_mutex_t text_mutex;
 static int font_domain_tally = 10;
 
-#define GLYPH_HASH_SIZE 128
-#define GLYPH_HASH_MASK (GLYPH_HASH_SIZE-1)
+#if FT_SHARED_STATE
+static hts_mutex_t text_ft_mutex;
+#endif
+
+#define GLYPH_SHARDS       16
+#define GLYPH_SHARD_HASH   64
+#define GLYPH_CACHE_BUDGET (8 * 1024 * 1024)
+
 TAILQ_HEAD(glyph_queue, glyph);
 LIST_HEAD(glyph_list, glyph);
 LIST_HEAD(face_list, face);
@@ -76,40 +90,47 @@ typedef struct face {
   LIST_ENTRY(face) link;
 
   FT_Face face;
+  hts_mutex_t mutex;  // Protects size and glyph slot of 'face'
   char *url;
   int current_size;
   char *family;
   char *fullname;
   uint8_t style;
   int font_domain;
-  struct glyph_list glyphs;
   int prio;
   int refcount;
+  atomic_t users;  // Number of glyphs loaded from this face
   buf_t *buf;  // Used when faces are loaded from memory
-  // For glyph caching
-
-  char *lookup_name;
-  int lookup_font_domain;
-
 } face_t;
 
 static struct face_list static_faces;
 static struct face_list dynamic_faces;
+static struct face_list dead_faces;  // Unloaded but still used by glyphs
 
 //------------------------- Glyph cache -----------------------
 
+/**
+ * Glyphs are refcounted so text_render0() can use them without holding
+ * any cache lock. The bitmaps are rendered on first use and are never
+ * changed once set.
+ */
 typedef struct glyph {
   int uc;
   int16_t size;
   uint8_t style;
+  uint8_t shard;
+  char *font;
+  int font_domain;
 
+  atomic_t refcount;
   face_t *face;
-  LIST_ENTRY(glyph) face_link;
 
   FT_UInt gi;
 
   LIST_ENTRY(glyph) hash_link;
   TAILQ_ENTRY(glyph) lru_link;
+  int cached;
+  int bytes;
   FT_Glyph orig_glyph;
   FT_Glyph bmp;
   FT_Glyph outline;
@@ -118,11 +139,27 @@ typedef struct glyph {
 
   FT_BBox bbox;
 
+  // Position in glyph atlas of 'bmp' [0] and 'outline' [1]
+  int atlas_epoch[2];
+  uint16_t atlas_x[2];
+  uint16_t atlas_y[2];
+
 } glyph_t;
 
-static struct glyph_list glyph_hash[GLYPH_HASH_SIZE];
-static struct glyph_queue allglyphs;
-static int num_glyphs;
+
+/**
+ * The glyph cache is split in shards, each with its own lock, LRU and
+ * share of the memory budget so font workers rarely contend
+ */
+typedef struct glyph_shard {
+  hts_mutex_t gs_mutex;
+  struct glyph_list gs_hash[GLYPH_SHARD_HASH];
+  struct glyph_queue gs_lru;
+  int gs_bytes;
+} glyph_shard_t;
+
+static glyph_shard_t glyph_shards[GLYPH_SHARDS];
+static atomic_t glyph_generation;
 
 /**
  *
@@ -163,31 +200,112 @@ idmap_find(int id)
  *
  */
 static void
-glyph_destroy(glyph_t *g)
+face_lock(face_t *f)
 {
-  LIST_REMOVE(g, face_link);
-  TAILQ_REMOVE(&allglyphs, g, lru_link);
-  LIST_REMOVE(g, hash_link);
+#if FT_SHARED_STATE
+  hts_mutex_lock(&text_ft_mutex);
+#else
+  hts_mutex_lock(&f->mutex);
+#endif
+}
+
+
+/**
+ *
+ */
+static void
+face_unlock(face_t *f)
+{
+#if FT_SHARED_STATE
+  hts_mutex_unlock(&text_ft_mutex);
+#else
+  hts_mutex_unlock(&f->mutex);
+#endif
+}
+
+
+/**
+ *
+ */
+static int
+face_has_char(face_t *f, int uc)
+{
+  face_lock(f);
+  int r = FT_Get_Char_Index(f->face, uc);
+  face_unlock(f);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+glyph_release(glyph_t *g)
+{
+  if(atomic_dec(&g->refcount))
+    return;
+
   FT_Done_Glyph(g->orig_glyph);
   if(g->bmp)
     FT_Done_Glyph(g->bmp);
   if(g->outline)
     FT_Done_Glyph(g->outline);
+  atomic_dec(&g->face->users);
+  free(g->font);
   free(g);
-  num_glyphs--;
 }
 
 
 /**
+ * Must be called with shard locked
+ */
+static void
+glyph_unlink(glyph_shard_t *gs, glyph_t *g)
+{
+  assert(g->cached);
+  LIST_REMOVE(g, hash_link);
+  TAILQ_REMOVE(&gs->gs_lru, g, lru_link);
+  gs->gs_bytes -= g->bytes;
+  g->cached = 0;
+  glyph_release(g);
+}
+
+
+/**
+ * Drop all cached glyphs (or only those from face 'f')
  *
+ * Glyphs that are being loaded while we flush are not inserted
+ * into the cache since the generation will not match
+ *
+ * Must be called with text_mutex locked
  */
 static void
-face_destroy(face_t *f)
+glyph_cache_flush(const face_t *f)
 {
-  glyph_t *g;
-  while((g = LIST_FIRST(&f->glyphs)) != NULL)
-    glyph_destroy(g);
+  glyph_t *g, *n;
+
+  atomic_inc(&glyph_generation);
+
+  for(int i = 0; i < GLYPH_SHARDS; i++) {
+    glyph_shard_t *gs = &glyph_shards[i];
+    hts_mutex_lock(&gs->gs_mutex);
+    for(g = TAILQ_FIRST(&gs->gs_lru); g != NULL; g = n) {
+      n = TAILQ_NEXT(g, lru_link);
+      if(f == NULL || g->face == f)
+        glyph_unlink(gs, g);
+    }
+    hts_mutex_unlock(&gs->gs_mutex);
+  }
+}
 
+
+/**
+ *
+ */
+static void
+face_destroy(face_t *f)
+{
   TRACE(TRACE_DEBUG, "Freetype", "Unloading '%s' [%s] originally from %s",
 	f->face->family_name, f->face->style_name, f->url);
   LIST_REMOVE(f, link);
@@ -195,14 +313,14 @@ face_destroy(face_t *f)
   free(f->url);
   free(f->family);
   free(f->fullname);
-  free(f->lookup_name);
   FT_Done_Face(f->face);
+  hts_mutex_destroy(&f->mutex);
   free(f);
 }
 
 
 /**
- *
+ * Must be called with text_mutex locked
  */
 static void
 faces_purge(void)
@@ -211,26 +329,15 @@ faces_purge(void)
   for(f = LIST_FIRST(&dynamic_faces); f != NULL; f = n) {
     n = LIST_NEXT(f, link);
 
-    if(f->refcount == 0 && LIST_FIRST(&f->glyphs) == NULL)
+    if(f->refcount == 0 && atomic_get(&f->users) == 0)
       face_destroy(f);
   }
-}
 
+  for(f = LIST_FIRST(&dead_faces); f != NULL; f = n) {
+    n = LIST_NEXT(f, link);
 
-/**
- *
- */
-static void
-faces_flush_lookup(void)
-{
-  face_t *f;
-  LIST_FOREACH(f, &dynamic_faces, link) {
-    mystrset(&f->lookup_name, NULL);
-    f->lookup_font_domain = -1;
-  }
-  LIST_FOREACH(f, &static_faces, link) {
-    mystrset(&f->lookup_name, NULL);
-    f->lookup_font_domain = -1;
+    if(atomic_get(&f->users) == 0)
+      face_destroy(f);
   }
 }
 
@@ -305,9 +412,10 @@ face_create_epilogue(face_t *face, const char *url,
 
 
   FT_Select_Charmap(face->face, FT_ENCODING_UNICODE);
+  hts_mutex_init(&face->mutex);
 
-  // Flush any lookup caches
-  faces_flush_lookup();
+  // A new face may change how glyphs resolve, flush the cache
+  glyph_cache_flush(NULL);
 
   face->font_domain = font_domain;
   face->prio = prio;
@@ -316,8 +424,6 @@ face_create_epilogue(face_t *face, const char *url,
   else
     LIST_INSERT_SORTED(faces, face, link, face_cmp, face_t);
 
-  face->lookup_font_domain = -1;
-
   return face;
 }
 
@@ -437,7 +543,7 @@ face_resolve(int uc, uint8_t style, const char *name, int font_domain)
 
     if(fa_can_handle(name, NULL, 0)) {
       f = face_create_from_uri(name, &dynamic_faces, 0, font_domain);
-      if(f != NULL && FT_Get_Char_Index(f->face, uc))
+      if(f != NULL && face_has_char(f, uc))
 	return f;
     }
 
@@ -453,7 +559,7 @@ face_resolve(int uc, uint8_t style, const char *name, int font_domain)
       /*
        * Faces that can't render our glyph is bad
        */
-      if(!FT_Get_Char_Index(f->face, uc))
+      if(!face_has_char(f, uc))
 	continue;
       /*
        * Always want to match font domain here
@@ -504,12 +610,12 @@ face_resolve(int uc, uint8_t style, const char *name, int font_domain)
 
 
   LIST_FOREACH(f, &static_faces, link) {
-    if(f->style == style && FT_Get_Char_Index(f->face, uc))
+    if(f->style == style && face_has_char(f, uc))
       return f;
   }
 
   LIST_FOREACH(f, &static_faces, link) {
-    if(f->style == 0 && FT_Get_Char_Index(f->face, uc))
+    if(f->style == 0 && face_has_char(f, uc))
       return f;
   }
 
@@ -524,14 +630,14 @@ face_resolve(int uc, uint8_t style, const char *name, int font_domain)
 
   // Last resort, anything that has the glyph
   LIST_FOREACH(f, &dynamic_faces, link)
-    if(FT_Get_Char_Index(f->face, uc))
+    if(face_has_char(f, uc))
       return f;
   return NULL;
 }
 
 
 /**
- *
+ * Must be called with text_mutex locked
  */
 static face_t *
 face_find(int uc, uint8_t style, const char *name, int font_domain)
@@ -542,19 +648,12 @@ face_find(int uc, uint8_t style, const char *name, int font_domain)
 	 uc, uc, style, name ?: "<unset>",
 	 f ? f->url : "<none>");
 #endif
-  if(f == NULL)
-    return NULL;
-
-  f->lookup_font_domain = font_domain;
-  if(strcmp(name ?: "", f->lookup_name ?: ""))
-    mystrset(&f->lookup_name, name);
-
   return f;
 }
 
 
 /**
- *
+ * Must be called with face locked
  */
 static void
 face_set_size(face_t *f, int size)
@@ -573,81 +672,209 @@ face_set_size(face_t *f, int size)
 }
 
 
+/**
+ * Approximate memory used by a FT_Glyph
+ */
+static int
+ft_glyph_bytes(FT_Glyph g)
+{
+  if(g->format == FT_GLYPH_FORMAT_BITMAP) {
+    const FT_Bitmap *b = &((FT_BitmapGlyph)g)->bitmap;
+    return sizeof(FT_BitmapGlyphRec) + abs(b->pitch) * b->rows;
+  }
+
+  if(g->format == FT_GLYPH_FORMAT_OUTLINE) {
+    const FT_Outline *o = &((FT_OutlineGlyph)g)->outline;
+    return sizeof(FT_OutlineGlyphRec) +
+      o->n_points * (sizeof(FT_Vector) + 1) + o->n_contours * sizeof(short);
+  }
+  return sizeof(FT_GlyphRec);
+}
+
+
 /**
  *
  */
+static unsigned int
+glyph_hash(int uc, int size, uint8_t style, const char *font, int font_domain)
+{
+  unsigned int h = uc * 2654435761U ^ size * 40503 ^ style << 24;
+
+  h ^= font_domain * 97;
+  if(font != NULL)
+    while(*font)
+      h = h * 33 ^ (uint8_t)*font++;
+  return h;
+}
+
+
+/**
+ * Must be called with shard locked
+ */
 static glyph_t *
-glyph_get(int uc, int size, uint8_t style, const char *font,
-	  int font_domain)
+glyph_lookup(struct glyph_list *bucket, int uc, int size, uint8_t style,
+             const char *font, int font_domain)
 {
-  int err, hash = (uc ^ size ^ style) & GLYPH_HASH_MASK;
   glyph_t *g;
+  LIST_FOREACH(g, bucket, hash_link) {
+    if(g->uc != uc || g->size != size || g->style != style ||
+       g->font_domain != font_domain)
+      continue;
+
+    if(!strcmp(g->font ?: "", font ?: ""))
+      return g;
+  }
+  return NULL;
+}
+
+
+/**
+ * Add memory held by a glyph to its shard and trim the shard to budget
+ *
+ * Must be called with shard locked
+ */
+static void
+glyph_account(glyph_shard_t *gs, glyph_t *g, int bytes)
+{
+  glyph_t *victim;
+
+  g->bytes += bytes;
+  if(!g->cached)
+    return;
+
+  gs->gs_bytes += bytes;
+
+  while(gs->gs_bytes > GLYPH_CACHE_BUDGET / GLYPH_SHARDS &&
+        (victim = TAILQ_FIRST(&gs->gs_lru)) != g)
+    glyph_unlink(gs, victim);
+}
+
+
+/**
+ * Load a glyph from the face. The returned glyph is not cached and
+ * has a single reference
+ */
+static glyph_t *
+glyph_load(face_t *f, int uc, int size, uint8_t style)
+{
   FT_GlyphSlot gs;
+  glyph_t *g;
+  FT_UInt gi;
 
-  LIST_FOREACH(g, &glyph_hash[hash], hash_link) {
-    if(g->uc != uc || g->size != size || g->style != style)
-      continue;
+  face_lock(f);
 
-    if(!strcmp(g->face->lookup_name ?: "", font ?: "") &&
-       g->face->lookup_font_domain == font_domain)
-      break;
+  gi = FT_Get_Char_Index(f->face, uc);
+
+  face_set_size(f, size);
+
+  if(FT_Load_Glyph(f->face, gi, FT_LOAD_FORCE_AUTOHINT)) {
+    face_unlock(f);
+    return NULL;
   }
 
-  if(g == NULL) {
-    face_t *f;
-    FT_UInt gi = 0;
+  gs = f->face->glyph;
 
-    f = face_find(uc, style, font, font_domain);
+  if(style & TR_STYLE_ITALIC && !(f->style & TR_STYLE_ITALIC))
+    FT_GlyphSlot_Oblique(gs);
 
-    if(f == NULL) {
-      f = face_find(uc, 0, font, font_domain);
-      if(f == NULL)
-	return NULL;
-    }
+  if(style & TR_STYLE_BOLD && !(f->style & TR_STYLE_BOLD) &&
+     gs->format == FT_GLYPH_FORMAT_OUTLINE) {
+    int v = FT_MulFix(gs->face->units_per_EM,
+                      gs->face->size->metrics.y_scale) / 64;
+    FT_Outline_Embolden(&gs->outline, v);
+  }
 
-    gi = FT_Get_Char_Index(f->face, uc);
+  g = calloc(1, sizeof(glyph_t));
 
-    face_set_size(f, size);
+  if(FT_Get_Glyph(gs, &g->orig_glyph)) {
+    face_unlock(f);
+    free(g);
+    return NULL;
+  }
 
-    if((err = FT_Load_Glyph(f->face, gi, FT_LOAD_FORCE_AUTOHINT)) != 0)
-      return NULL;
+  g->adv_x = gs->advance.x;
+  face_unlock(f);
 
-    gs = f->face->glyph;
+  FT_Glyph_Get_CBox(g->orig_glyph, FT_GLYPH_BBOX_GRIDFIT, &g->bbox);
 
-    if(style & TR_STYLE_ITALIC && !(f->style & TR_STYLE_ITALIC))
-      FT_GlyphSlot_Oblique(gs);
+  g->gi = gi;
+  g->face = f;
+  g->uc = uc;
+  g->style = style;
+  g->size = size;
+  atomic_set(&g->refcount, 1);
+  return g;
+}
 
-    if(style & TR_STYLE_BOLD && !(f->style & TR_STYLE_BOLD) &&
-       gs->format == FT_GLYPH_FORMAT_OUTLINE) {
-      int v = FT_MulFix(gs->face->units_per_EM,
-			gs->face->size->metrics.y_scale) / 64;
-      FT_Outline_Embolden(&gs->outline, v);
-    }
 
-    g = calloc(1, sizeof(glyph_t));
+/**
+ * Return a referenced glyph, release with glyph_release()
+ */
+static glyph_t *
+glyph_get(int uc, int size, uint8_t style, const char *font,
+	  int font_domain)
+{
+  const unsigned int hash = glyph_hash(uc, size, style, font, font_domain);
+  const int shard = hash % GLYPH_SHARDS;
+  glyph_shard_t *gs = &glyph_shards[shard];
+  struct glyph_list *bucket =
+    &gs->gs_hash[(hash / GLYPH_SHARDS) % GLYPH_SHARD_HASH];
+  glyph_t *g, *g2;
+  face_t *f;
 
-    if((err = FT_Get_Glyph(gs, &g->orig_glyph)) != 0) {
-      free(g);
-      return NULL;
-    }
+  hts_mutex_lock(&gs->gs_mutex);
+  g = glyph_lookup(bucket, uc, size, style, font, font_domain);
+  if(g != NULL) {
+    TAILQ_REMOVE(&gs->gs_lru, g, lru_link);
+    TAILQ_INSERT_TAIL(&gs->gs_lru, g, lru_link);
+    atomic_inc(&g->refcount);
+    hts_mutex_unlock(&gs->gs_mutex);
+    return g;
+  }
+  hts_mutex_unlock(&gs->gs_mutex);
 
-    FT_Glyph_Get_CBox(g->orig_glyph, FT_GLYPH_BBOX_GRIDFIT, &g->bbox);
+  hts_mutex_lock(&text_mutex);
+  const int generation = atomic_get(&glyph_generation);
+  f = face_find(uc, style, font, font_domain);
+  if(f == NULL)
+    f = face_find(uc, 0, font, font_domain);
+  if(f != NULL)
+    atomic_inc(&f->users); // Keep face alive while we load
+  hts_mutex_unlock(&text_mutex);
 
-    g->gi = gi;
-    LIST_INSERT_HEAD(&f->glyphs, g, face_link);
-    g->face = f;
-    g->uc = uc;
-    g->style = style;
-    g->size = size;
+  if(f == NULL)
+    return NULL;
 
-    g->adv_x = gs->advance.x;
-    LIST_INSERT_HEAD(&glyph_hash[hash], g, hash_link);
-    num_glyphs++;
-  } else {
-    TAILQ_REMOVE(&allglyphs, g, lru_link);
+  g = glyph_load(f, uc, size, style);
+  if(g == NULL) {
+    atomic_dec(&f->users);
+    return NULL;
   }
-  TAILQ_INSERT_TAIL(&allglyphs, g, lru_link);
 
+  g->shard = shard;
+  g->font = font ? strdup(font) : NULL;
+  g->font_domain = font_domain;
+
+  hts_mutex_lock(&gs->gs_mutex);
+
+  // Someone else might have loaded the same glyph while we were busy
+  g2 = glyph_lookup(bucket, uc, size, style, font, font_domain);
+  if(g2 != NULL) {
+    atomic_inc(&g2->refcount);
+    hts_mutex_unlock(&gs->gs_mutex);
+    glyph_release(g);
+    return g2;
+  }
+
+  if(generation == atomic_get(&glyph_generation)) {
+    atomic_inc(&g->refcount);
+    g->cached = 1;
+    LIST_INSERT_HEAD(bucket, g, hash_link);
+    TAILQ_INSERT_TAIL(&gs->gs_lru, g, lru_link);
+    glyph_account(gs, g, sizeof(glyph_t) + ft_glyph_bytes(g->orig_glyph) +
+                  (font ? strlen(font) : 0));
+  }
+  hts_mutex_unlock(&gs->gs_mutex);
   return g;
 }
 
@@ -655,12 +882,106 @@ glyph_get(int uc, int size, uint8_t style, const char *font,
 /**
  *
  */
-static void
-glyph_flush_one(void)
+static int
+ft_glyph_to_bitmap(FT_Glyph *glyph)
+{
+#if FT_SHARED_STATE
+  hts_mutex_lock(&text_ft_mutex);
+#endif
+  int r = FT_Glyph_To_Bitmap(glyph, FT_RENDER_MODE_NORMAL, NULL, 1);
+#if FT_SHARED_STATE
+  hts_mutex_unlock(&text_ft_mutex);
+#endif
+  return r;
+}
+
+
+/**
+ * Rendered bitmap of a glyph, created on first use
+ */
+static FT_BitmapGlyph
+glyph_bitmap(glyph_t *g)
+{
+  glyph_shard_t *gs = &glyph_shards[g->shard];
+  FT_Glyph bmp;
+
+  hts_mutex_lock(&gs->gs_mutex);
+  bmp = g->bmp;
+  hts_mutex_unlock(&gs->gs_mutex);
+
+  if(bmp != NULL)
+    return (FT_BitmapGlyph)bmp;
+
+  /*
+   * FreeType translates the outline in place while rendering so
+   * we can't render directly from the shared orig_glyph
+   */
+  if(FT_Glyph_Copy(g->orig_glyph, &bmp))
+    return NULL;
+
+  if(ft_glyph_to_bitmap(&bmp)) {
+    FT_Done_Glyph(bmp);
+    return NULL;
+  }
+
+  hts_mutex_lock(&gs->gs_mutex);
+  if(g->bmp == NULL) {
+    g->bmp = bmp;
+    glyph_account(gs, g, ft_glyph_bytes(bmp));
+  } else {
+    FT_Done_Glyph(bmp);
+    bmp = g->bmp;
+  }
+  hts_mutex_unlock(&gs->gs_mutex);
+  return (FT_BitmapGlyph)bmp;
+}
+
+
+/**
+ * Rendered outline of a glyph. The glyph caches the first outline
+ * width asked for. Other widths are returned in 'private' and must be
+ * freed by the caller
+ */
+static FT_BitmapGlyph
+glyph_outline(glyph_t *g, int amt, FT_Stroker *stroker, FT_Glyph *private)
 {
-  glyph_t *g = TAILQ_FIRST(&allglyphs);
-  assert(g != NULL);
-  glyph_destroy(g);
+  glyph_shard_t *gs = &glyph_shards[g->shard];
+  FT_Glyph o;
+
+  hts_mutex_lock(&gs->gs_mutex);
+  o = g->outline != NULL && g->outline_amt == amt ? g->outline : NULL;
+  hts_mutex_unlock(&gs->gs_mutex);
+
+  if(o != NULL)
+    return (FT_BitmapGlyph)o;
+
+  if(*stroker == NULL && FT_Stroker_New(text_library, stroker))
+    return NULL;
+
+  FT_Stroker_Set(*stroker, amt,
+                 FT_STROKER_LINECAP_ROUND,
+                 FT_STROKER_LINEJOIN_ROUND,
+                 0);
+
+  o = g->orig_glyph;
+  if(FT_Glyph_StrokeBorder(&o, *stroker, 0, 0))
+    return NULL;
+
+  if(ft_glyph_to_bitmap(&o)) {
+    FT_Done_Glyph(o);
+    return NULL;
+  }
+
+  hts_mutex_lock(&gs->gs_mutex);
+  if(g->outline == NULL) {
+    g->outline = o;
+    g->outline_amt = amt;
+    glyph_account(gs, g, ft_glyph_bytes(o));
+  } else {
+    *private = o;
+  }
+  hts_mutex_unlock(&gs->gs_mutex);
+  return (FT_BitmapGlyph)o;
 }
 
 
@@ -709,6 +1030,10 @@ typedef struct line {
 
 typedef struct item {
   glyph_t *g;
+  glyph_t *ref;  // Reference held by us, 'g' may be replaced by ellipsis
+  FT_BitmapGlyph bmp;
+  FT_BitmapGlyph outline_bmp;
+  FT_Glyph outline_private;
   int code;
   uint32_t color;
   uint32_t shadow_color;
@@ -734,25 +1059,99 @@ static const float legacy_size_mult[16] = {
 
 
 /**
- *
+ * Collects positioned glyphs when rendering to the glyph atlas
+ */
+typedef struct glyph_emitter {
+  image_glyph_t *ge_glyphs;
+  int ge_num;
+  int ge_capacity;
+  int ge_epoch;
+  int ge_added;   // Glyphs we had to add to the atlas
+  int ge_failed;  // Atlas full or reset while we were emitting
+} glyph_emitter_t;
+
+
+/**
+ * 'slot' is the atlas position cache in the glyph to use, or -1 for
+ * bitmaps that are not cached in the glyph
+ */
+static void
+emit_glyph(glyph_emitter_t *ge, glyph_t *g, int slot, FT_BitmapGlyph bmp,
+           int left, int top, uint32_t color)
+{
+  const FT_Bitmap *b = &bmp->bitmap;
+  glyph_shard_t *gs = &glyph_shards[g->shard];
+  int x = 0, y = 0, epoch = -1;
+
+  if(b->width == 0 || b->rows == 0 || ge->ge_failed)
+    return;
+
+  if(slot >= 0) {
+    hts_mutex_lock(&gs->gs_mutex);
+    if(g->atlas_epoch[slot] == ge->ge_epoch) {
+      x = g->atlas_x[slot];
+      y = g->atlas_y[slot];
+      epoch = ge->ge_epoch;
+    }
+    hts_mutex_unlock(&gs->gs_mutex);
+  }
+
+  if(epoch == -1) {
+    epoch = glyph_atlas_add(b->buffer, b->pitch, b->width, b->rows, &x, &y);
+    if(epoch != ge->ge_epoch) {
+      ge->ge_failed = 1;
+      return;
+    }
+    ge->ge_added++;
+
+    if(slot >= 0) {
+      hts_mutex_lock(&gs->gs_mutex);
+      g->atlas_epoch[slot] = epoch;
+      g->atlas_x[slot] = x;
+      g->atlas_y[slot] = y;
+      hts_mutex_unlock(&gs->gs_mutex);
+    }
+  }
+
+  if(ge->ge_num == ge->ge_capacity) {
+    ge->ge_capacity = MAX(ge->ge_capacity * 2, 64);
+    ge->ge_glyphs = realloc(ge->ge_glyphs,
+                            ge->ge_capacity * sizeof(image_glyph_t));
+  }
+
+  image_glyph_t *ig = &ge->ge_glyphs[ge->ge_num++];
+  ig->ig_x = left;
+  ig->ig_y = top;
+  ig->ig_u = x;
+  ig->ig_v = y;
+  ig->ig_width = b->width;
+  ig->ig_height = b->rows;
+  ig->ig_color = color;
+}
+
+
+/**
+ * Glyphs are composited into 'pm', or collected in 'ge' if it's set
  */
 static void
 draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 	    int siz_x, item_t *items, int start_x, int start_y,
 	    int origin_y, int margin, int pass,
-            image_component_text_info_t *ti)
+            image_component_text_info_t *ti, glyph_emitter_t *ge)
 {
   FT_Vector pen;
   line_t *li;
   int i;
   int pen_y = 0;
   int pen_x = 0;
-  glyph_t *g;
 
   TAILQ_FOREACH(li, lq, link) {
 
     pen_y -= li->height * 64;
 
+    if(li->type == LINE_TYPE_HR && pm == NULL)
+      continue;
+
     if(li->type == LINE_TYPE_HR) {
       int ypos = 0;
       ypos = target_height - (pen_y + li->height * 64);
@@ -831,8 +1230,7 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 
     for(i = li->start; i < li->start + li->count; i++) {
 
-      g = items[i].g;
-      if(g == NULL)
+      if(items[i].g == NULL)
 	continue;
 
       pen_x += items[i].kerning;
@@ -846,33 +1244,9 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
       pen.x >>= 6;
       pen.y >>= 6;
 
-
-
-      if(items[i].outline > 0 && (g->outline == NULL ||
-				  g->outline_amt != items[i].outline)) {
-	if(g->outline)
-	  FT_Done_Glyph(g->outline);
-
-	g->outline = g->orig_glyph;
-	FT_Stroker_Set(text_stroker,
-		       items[i].outline,
-		       FT_STROKER_LINECAP_ROUND,
-		       FT_STROKER_LINEJOIN_ROUND,
-		       0);
-	g->outline_amt = items[i].outline;
-	if(FT_Glyph_StrokeBorder(&g->outline, text_stroker, 0, 0))
-	  g->outline = NULL;
-	else if(FT_Glyph_To_Bitmap(&g->outline, FT_RENDER_MODE_NORMAL, NULL, 1))
-	  g->outline = NULL;
-      }
-
-      if(g->bmp == NULL) {
-	g->bmp = g->orig_glyph;
-	if(FT_Glyph_To_Bitmap(&g->bmp, FT_RENDER_MODE_NORMAL, NULL, 0))
-	  g->bmp = NULL;
-      }
-      if(pass == 0 && items[i].shadow && (g->outline != NULL || g->bmp != NULL)) {
-	FT_BitmapGlyph bmp = (FT_BitmapGlyph)(g->outline ?: g->bmp);
+      if(pass == 0 && items[i].shadow &&
+         (items[i].outline_bmp != NULL || items[i].bmp != NULL)) {
+	FT_BitmapGlyph bmp = items[i].outline_bmp ?: items[i].bmp;
 	draw_glyph(pm,
 		   bmp->left + items[i].shadow + margin + pen.x,
 		   target_height - bmp->top + items[i].shadow + margin - pen.y,
@@ -880,22 +1254,34 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 		   items[i].shadow_color);
       }
 
-      if(pass == 1 && items[i].outline > 0 && g->outline != NULL) {
-	FT_BitmapGlyph bmp = (FT_BitmapGlyph)g->outline;
-	draw_glyph(pm,
-		   bmp->left + margin + pen.x,
-		   target_height - bmp->top + margin - pen.y,
-		   &bmp->bitmap,
-		   items[i].outline_color);
+      if(pass == 1 && items[i].outline > 0 && items[i].outline_bmp != NULL) {
+	FT_BitmapGlyph bmp = items[i].outline_bmp;
+	if(ge != NULL)
+	  emit_glyph(ge, items[i].g, items[i].outline_private ? -1 : 1, bmp,
+		     bmp->left + margin + pen.x,
+		     target_height - bmp->top + margin - pen.y,
+		     items[i].outline_color);
+	else
+	  draw_glyph(pm,
+		     bmp->left + margin + pen.x,
+		     target_height - bmp->top + margin - pen.y,
+		     &bmp->bitmap,
+		     items[i].outline_color);
       }
 
-      if(pass == 2 && g->bmp != NULL) {
-	FT_BitmapGlyph bmp = (FT_BitmapGlyph)g->bmp;
-	draw_glyph(pm,
-		   bmp->left + margin + pen.x,
-		   target_height - bmp->top + margin - pen.y,
-		   &bmp->bitmap,
-		   items[i].color);
+      if(pass == 2 && items[i].bmp != NULL) {
+	FT_BitmapGlyph bmp = items[i].bmp;
+	if(ge != NULL)
+	  emit_glyph(ge, items[i].g, 0, bmp,
+		     bmp->left + margin + pen.x,
+		     target_height - bmp->top + margin - pen.y,
+		     items[i].color);
+	else
+	  draw_glyph(pm,
+		     bmp->left + margin + pen.x,
+		     target_height - bmp->top + margin - pen.y,
+		     &bmp->bitmap,
+		     items[i].color);
 
 	if(ti != NULL && ti->ti_charpos != NULL) {
 	  ti->ti_charpos[i * 2 + 0] = bmp->left + pen.x;
@@ -916,6 +1302,49 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
   }
 }
 
+/**
+ * Render the bitmaps needed by draw_glyphs()
+ */
+static void
+prepare_glyphs(struct line_queue *lq, item_t *items, FT_Stroker *stroker)
+{
+  line_t *li;
+  int i;
+
+  TAILQ_FOREACH(li, lq, link) {
+    if(li->type != LINE_TYPE_TEXT)
+      continue;
+
+    for(i = li->start; i < li->start + li->count; i++) {
+      glyph_t *g = items[i].g;
+      if(g == NULL)
+        continue;
+
+      items[i].bmp = glyph_bitmap(g);
+      if(items[i].outline > 0)
+        items[i].outline_bmp = glyph_outline(g, items[i].outline, stroker,
+                                             &items[i].outline_private);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static void
+release_glyphs(item_t *items, int num, glyph_t *ellipsis)
+{
+  for(int i = 0; i < num; i++) {
+    if(items[i].outline_private != NULL)
+      FT_Done_Glyph(items[i].outline_private);
+    glyph_release(items[i].ref);
+  }
+  if(ellipsis != NULL)
+    glyph_release(ellipsis);
+}
+
+
 /**
  *
  */
@@ -932,7 +1361,7 @@ text_render0(const uint32_t *uc, const int len,
   FT_Stroker stroker = NULL;
 
   int i, j;
-  glyph_t *g = NULL;
+  glyph_t *g = NULL, *eg = NULL;
   int siz_x, start_x, start_y;
   int lines = 0;
   line_t *li, *lix;
@@ -1101,7 +1530,9 @@ text_render0(const uint32_t *uc, const int len,
       break;
 
     case  TR_CODE_FONT_FAMILY ...  TR_CODE_FONT_FAMILY + 0xffffff:
+      hts_mutex_lock(&text_mutex);
       im = idmap_find(uc[i] & 0xffffff);
+      hts_mutex_unlock(&text_mutex);
       if(im != NULL) {
 	current_font   = im->name;
 	current_domain = im->domain;
@@ -1160,14 +1591,20 @@ text_render0(const uint32_t *uc, const int len,
       continue;
 
     if(FT_HAS_KERNING(g->face->face) && g->gi && prev) {
+      face_lock(g->face);
       face_set_size(g->face, current_size);
       FT_Get_Kerning(g->face->face, prev, g->gi, FT_KERNING_DEFAULT, &delta);
+      face_unlock(g->face);
       items[out].kerning = delta.x;
     } else {
       items[out].kerning = 0;
     }
     items[out].adv_x = g->adv_x;
     items[out].g = g;
+    items[out].ref = g;
+    items[out].bmp = NULL;
+    items[out].outline_bmp = NULL;
+    items[out].outline_private = NULL;
     items[out].code = uc[i];
     items[out].color = current_color | current_alpha;
 
@@ -1262,9 +1699,10 @@ text_render0(const uint32_t *uc, const int len,
       if(lines == max_lines - 1 && g != NULL && max_width) {
 
 	if(flags & TR_RENDER_ELLIPSIZE) {
-	  glyph_t *eg = glyph_get(HORIZONTAL_ELLIPSIS_UNICODE, g->size, 0,
-				  g->face->url, g->face->font_domain);
-	  if(w > max_width - eg->adv_x) {
+	  if(eg == NULL)
+	    eg = glyph_get(HORIZONTAL_ELLIPSIS_UNICODE, g->size, 0,
+			   g->face->url, g->face->font_domain);
+	  if(eg != NULL && w > max_width - eg->adv_x) {
 
 	    while(j > 0 && items[li->start + j - 1].code == ' ') {
 	      j--;
@@ -1298,6 +1736,7 @@ text_render0(const uint32_t *uc, const int len,
   }
 
   if(siz_x < 5) {
+    release_glyphs(items, out, eg);
     free(items);
     return NULL;
   }
@@ -1402,14 +1841,6 @@ text_render0(const uint32_t *uc, const int len,
   img->im_margin = margin;
 
   pixmap_t *pm = NULL;
-
-  if(!(flags & TR_RENDER_NO_OUTPUT)) {
-    pm = pixmap_create(target_width, target_height,
-                       color_output ? PIXMAP_BGR32 : PIXMAP_IA, margin);
-
-    img->im_components[1].type = IMAGE_PIXMAP;
-    img->im_components[1].pm = pm;
-  }
   image_component_text_info_t *ti = &img->im_components[0].text_info;
   img->im_components[0].type = IMAGE_TEXT_INFO;
 
@@ -1422,6 +1853,66 @@ text_render0(const uint32_t *uc, const int len,
     ti->ti_charpos = malloc(2 * len * sizeof(int));
   }
 
+  /*
+   * Glyph runs can't do blurred shadows or horizontal rulers, those
+   * needs a real bitmap
+   */
+  int glyph_runs = !(flags & (TR_RENDER_NO_OUTPUT | TR_RENDER_DEBUG)) &&
+    flags & TR_RENDER_GLYPH_RUNS && !need_shadow_pass &&
+    out * 2 * 4 < UINT16_MAX;
+
+  TAILQ_FOREACH(li, &lq, link)
+    if(li->type == LINE_TYPE_HR)
+      glyph_runs = 0;
+
+  if(!(flags & TR_RENDER_NO_OUTPUT))
+    prepare_glyphs(&lq, items, &stroker);
+
+  if(glyph_runs) {
+    glyph_emitter_t ge = {0};
+
+    // If the atlas fills up we clear it and try once more
+    for(i = 0; i < 2; i++) {
+      ge.ge_num = 0;
+      ge.ge_added = 0;
+      ge.ge_failed = 0;
+      ge.ge_epoch = glyph_atlas_epoch();
+
+      if(need_outline_pass)
+        draw_glyphs(NULL, &lq, target_height, siz_x, items, start_x, start_y,
+                    origin_y, margin, 1, NULL, &ge);
+
+      draw_glyphs(NULL, &lq, target_height, siz_x, items, start_x, start_y,
+                  origin_y, margin, 2, ti, &ge);
+
+      if(!ge.ge_failed)
+        break;
+      glyph_atlas_reset(ge.ge_epoch);
+    }
+
+    if(ge.ge_failed) {
+      free(ge.ge_glyphs);
+      glyph_runs = 0;
+    } else {
+      image_component_glyph_runs_t *igr = &img->im_components[1].glyph_runs;
+      img->im_components[1].type = IMAGE_GLYPH_RUNS;
+      igr->igr_glyphs = ge.ge_glyphs;
+      igr->igr_num = ge.ge_num;
+      igr->igr_atlas_epoch = ge.ge_epoch;
+
+      glyph_atlas_account_run(ge.ge_added, (int64_t)img->im_width *
+                              img->im_height * (color_output ? 4 : 2));
+    }
+  }
+
+  if(!glyph_runs && !(flags & TR_RENDER_NO_OUTPUT)) {
+    pm = pixmap_create(target_width, target_height,
+                       color_output ? PIXMAP_BGR32 : PIXMAP_IA, margin);
+
+    img->im_components[1].type = IMAGE_PIXMAP;
+    img->im_components[1].pm = pm;
+  }
+
   if(pm != NULL) {
 
     if(flags & TR_RENDER_DEBUG) {
@@ -1438,18 +1929,19 @@ text_render0(const uint32_t *uc, const int len,
 
     if(need_shadow_pass) {
       draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                  origin_y, margin, 0, NULL);
+                  origin_y, margin, 0, NULL, NULL);
       pixmap_box_blur(pm, 4, 4);
     }
 
     if(need_outline_pass)
       draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                  origin_y, margin, 1, NULL);
+                  origin_y, margin, 1, NULL, NULL);
 
 
     draw_glyphs(pm, &lq, target_height, siz_x, items, start_x, start_y,
-                origin_y, margin, 2, ti);
+                origin_y, margin, 2, ti, NULL);
   }
+  release_glyphs(items, out, eg);
   free(items);
 
   if(stroker != NULL)
@@ -1469,15 +1961,11 @@ text_render(const uint32_t *uc, const int len, int flags, int default_size,
 {
   struct image *im;
 
-  hts_mutex_lock(&text_mutex);
-
   im = text_render0(uc, len, flags, default_size, scale, alignment,
 		    max_width, max_lines, family, context, min_size);
-  while(num_glyphs > 512)
-    glyph_flush_one();
 
+  hts_mutex_lock(&text_mutex);
   faces_purge();
-
   hts_mutex_unlock(&text_mutex);
 
   return im;
@@ -1510,9 +1998,15 @@ freetype_init(void)
     TRACE(TRACE_ERROR, "Freetype", "Freetype init error %d", error);
     exit(1);
   }
-  FT_Stroker_New(text_library, &text_stroker);
-  TAILQ_INIT(&allglyphs);
   hts_mutex_init(&text_mutex);
+#if FT_SHARED_STATE
+  hts_mutex_init(&text_ft_mutex);
+#endif
+
+  for(int i = 0; i < GLYPH_SHARDS; i++) {
+    hts_mutex_init(&glyph_shards[i].gs_mutex);
+    TAILQ_INIT(&glyph_shards[i].gs_lru);
+  }
 
   snprintf(url, sizeof(url),
 	   "%s/res/fonts/liberation/LiberationSans-Regular.ttf",
@@ -1528,6 +2022,121 @@ freetype_init(void)
 INITME(INIT_GROUP_GRAPHICS, freetype_init, NULL, 0);
 
 
+#ifdef TEXT_BENCHMARK
+
+#define TEXT_BENCH_CAPTIONS 10000
+#define TEXT_BENCH_LEN      64
+
+typedef struct text_bench {
+  uint32_t tb_uc[TEXT_BENCH_CAPTIONS][TEXT_BENCH_LEN];
+  int tb_len[TEXT_BENCH_CAPTIONS];
+  atomic_t tb_next;
+} text_bench_t;
+
+
+/**
+ *
+ */
+static void *
+text_bench_worker(void *aux)
+{
+  text_bench_t *tb = aux;
+  int i;
+
+  while((i = atomic_add_and_fetch(&tb->tb_next, 1) - 1) <
+        TEXT_BENCH_CAPTIONS) {
+    int flags = TR_RENDER_ELLIPSIZE;
+    if(i % 3 == 0)
+      flags |= TR_RENDER_SHADOW;
+    if(i % 4 == 0)
+      flags |= TR_RENDER_OUTLINE;
+    if(i % 5 == 0)
+      flags |= TR_RENDER_BOLD;
+
+    image_t *im = text_render(tb->tb_uc[i], tb->tb_len[i], flags,
+                              16 + i % 5 * 6, 1.0f, TR_ALIGN_LEFT,
+                              1000, 2, NULL, 0, 0);
+    image_release(im);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+text_bench_run(text_bench_t *tb, int threads)
+{
+  hts_thread_t tids[threads];
+  int64_t ts = arch_get_ts();
+
+  atomic_set(&tb->tb_next, 0);
+  for(int i = 0; i < threads; i++)
+    hts_thread_create_joinable("textbench", &tids[i], text_bench_worker,
+                               tb, THREAD_PRIO_BGTASK);
+  for(int i = 0; i < threads; i++)
+    hts_thread_join(&tids[i]);
+  return (arch_get_ts() - ts) / 1000;
+}
+
+
+/**
+ * Render 10k captions with an increasing number of threads, starting
+ * with a cold and a warm glyph cache. Build with -DTEXT_BENCHMARK.
+ * The process exits when done
+ */
+static void *
+text_benchmark(void *aux)
+{
+  static const char *words[] = {
+    "The ", "quick ", "brown ", "fox ", "jumps ", "over ", "the ",
+    "lazy ", "dog ", "Movian ", "Überraschung ", "çà ", "42 ", "ÅÄÖ ",
+  };
+  text_bench_t *tb = calloc(1, sizeof(text_bench_t));
+  uint32_t x = 1;
+
+  for(int i = 0; i < TEXT_BENCH_CAPTIONS; i++) {
+    int len = 0;
+    while(len < TEXT_BENCH_LEN - 16) {
+      x = x * 1664525 + 1013904223;
+      const char *w = words[(x >> 16) % 14];
+      while(*w)
+        tb->tb_uc[i][len++] = utf8_get(&w);
+    }
+    tb->tb_len[i] = len;
+  }
+
+  const int max_threads = MAX(gconf.concurrency, 1);
+  for(int t = 1; ; t = MIN(t * 2, max_threads)) {
+    hts_mutex_lock(&text_mutex);
+    glyph_cache_flush(NULL);
+    hts_mutex_unlock(&text_mutex);
+
+    const int cold = text_bench_run(tb, t);
+    const int warm = text_bench_run(tb, t);
+    printf("%d captions, %d threads: cold %d ms, warm %d ms\n",
+           TEXT_BENCH_CAPTIONS, t, cold, warm);
+    if(t == max_threads)
+      break;
+  }
+  free(tb);
+  exit(0);
+}
+
+
+static void
+text_benchmark_init(void)
+{
+  hts_thread_create_detached("textbench", text_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, text_benchmark_init, NULL, 0);
+
+#endif
+
+
 /**
  *
  */
@@ -1574,8 +2183,13 @@ freetype_unload_font(void *ref)
 {
   face_t *f = ref;
   hts_mutex_lock(&text_mutex);
-  if(--f->refcount == 0)
-    face_destroy(f);
+  if(--f->refcount == 0) {
+    // Make sure it can't be found anymore, it's destroyed once unused
+    LIST_REMOVE(f, link);
+    LIST_INSERT_HEAD(&dead_faces, f, link);
+    glyph_cache_flush(f);
+    faces_purge();
+  }
   hts_mutex_unlock(&text_mutex);
 }
 
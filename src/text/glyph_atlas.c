@@ -0,0 +1,516 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <limits.h>
+#include <string.h>
+
+#include "main.h"
+#include "misc/minmax.h"
+#include "image/pixmap.h"
+#include "glyph_atlas.h"
+
+#define GLYPH_ATLAS_PAD 1  // Keep glyphs apart so filtering doesn't bleed
+
+/**
+ * Skyline bottom-left packer. The skyline is a list of horizontal
+ * segments covering the full width of the atlas, each at the height
+ * where free space starts
+ */
+typedef struct skyline {
+  uint16_t x, y, w;
+} skyline_t;
+
+static hts_mutex_t ga_mutex;
+static pixmap_t *ga_pm;
+static skyline_t ga_sky[GLYPH_ATLAS_SIZE];
+static int ga_sky_num;
+static int ga_epoch = 1;
+static int ga_generation = 1;
+static int ga_synced_generation = -1;  // Generation at last sync
+static int ga_dirty_x1, ga_dirty_y1, ga_dirty_x2, ga_dirty_y2;
+static int64_t ga_used_area;
+static glyph_atlas_stats_t ga_stats;
+
+
+/**
+ *
+ */
+static void
+skyline_clear(void)
+{
+  ga_sky[0].x = 0;
+  ga_sky[0].y = 0;
+  ga_sky[0].w = GLYPH_ATLAS_SIZE;
+  ga_sky_num = 1;
+}
+
+
+/**
+ * Lowest y where a w*h rectangle fits with its left edge at node 'i'
+ */
+static int
+skyline_fit(int i, int w, int h)
+{
+  int y = 0, left = w;
+
+  if(ga_sky[i].x + w > GLYPH_ATLAS_SIZE)
+    return -1;
+
+  while(left > 0) {
+    y = MAX(y, ga_sky[i].y);
+    if(y + h > GLYPH_ATLAS_SIZE)
+      return -1;
+    left -= ga_sky[i].w;
+    i++;
+  }
+  return y;
+}
+
+
+/**
+ *
+ */
+static void
+skyline_remove(int i)
+{
+  ga_sky_num--;
+  memmove(&ga_sky[i], &ga_sky[i + 1], (ga_sky_num - i) * sizeof(skyline_t));
+}
+
+
+/**
+ *
+ */
+static int
+skyline_alloc(int w, int h, int *px, int *py)
+{
+  int best = -1, best_top = INT_MAX, best_w = INT_MAX, best_y = 0;
+  int i;
+
+  for(i = 0; i < ga_sky_num; i++) {
+    int y = skyline_fit(i, w, h);
+    if(y < 0)
+      continue;
+
+    if(y + h < best_top || (y + h == best_top && ga_sky[i].w < best_w)) {
+      best = i;
+      best_top = y + h;
+      best_w = ga_sky[i].w;
+      best_y = y;
+    }
+  }
+
+  if(best == -1 || ga_sky_num == GLYPH_ATLAS_SIZE)
+    return -1;
+
+  *px = ga_sky[best].x;
+  *py = best_y;
+
+  memmove(&ga_sky[best + 1], &ga_sky[best],
+          (ga_sky_num - best) * sizeof(skyline_t));
+  ga_sky_num++;
+  ga_sky[best].y = best_y + h;
+  ga_sky[best].w = w;
+
+  // Shrink or remove segments now covered by the new one
+
+  for(i = best + 1; i < ga_sky_num; i++) {
+    const int end = ga_sky[i - 1].x + ga_sky[i - 1].w;
+    if(ga_sky[i].x >= end)
+      break;
+
+    const int shrink = end - ga_sky[i].x;
+    if(ga_sky[i].w <= shrink) {
+      skyline_remove(i);
+      i--;
+    } else {
+      ga_sky[i].x += shrink;
+      ga_sky[i].w -= shrink;
+      break;
+    }
+  }
+
+  for(i = 0; i < ga_sky_num - 1; i++) {
+    if(ga_sky[i].y == ga_sky[i + 1].y) {
+      ga_sky[i].w += ga_sky[i + 1].w;
+      skyline_remove(i + 1);
+      i--;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+dirty_clear(void)
+{
+  ga_dirty_x1 = ga_dirty_y1 = GLYPH_ATLAS_SIZE;
+  ga_dirty_x2 = ga_dirty_y2 = 0;
+}
+
+
+/**
+ *
+ */
+static void
+dirty_add(int x1, int y1, int x2, int y2)
+{
+  ga_dirty_x1 = MIN(ga_dirty_x1, x1);
+  ga_dirty_y1 = MIN(ga_dirty_y1, y1);
+  ga_dirty_x2 = MAX(ga_dirty_x2, x2);
+  ga_dirty_y2 = MAX(ga_dirty_y2, y2);
+}
+
+
+/**
+ * Intensity is always full so filtering at glyph edges only affects alpha
+ */
+static void
+atlas_clear(void)
+{
+  uint8_t *d = ga_pm->pm_data;
+  for(int y = 0; y < ga_pm->pm_height; y++) {
+    for(int x = 0; x < ga_pm->pm_width; x++) {
+      d[x * 2 + 0] = 0xff;
+      d[x * 2 + 1] = 0;
+    }
+    d += ga_pm->pm_linesize;
+  }
+  skyline_clear();
+  dirty_add(0, 0, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+  ga_used_area = 0;
+  ga_stats.gas_glyphs = 0;
+}
+
+
+/**
+ *
+ */
+int
+glyph_atlas_add(const uint8_t *bitmap, int stride, int width, int height,
+                int *x, int *y)
+{
+  int r;
+
+  if(width == 0 || height == 0) {
+    *x = *y = 0;
+    return glyph_atlas_epoch();
+  }
+
+  hts_mutex_lock(&ga_mutex);
+
+  if(ga_pm == NULL) {
+    ga_pm = pixmap_create(GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, PIXMAP_IA, 0);
+    atlas_clear();
+  }
+
+  if(skyline_alloc(width + GLYPH_ATLAS_PAD, height + GLYPH_ATLAS_PAD,
+                   x, y)) {
+    r = -1;
+  } else {
+    uint8_t *d = ga_pm->pm_data + *y * ga_pm->pm_linesize + *x * 2;
+    for(int j = 0; j < height; j++) {
+      for(int i = 0; i < width; i++)
+        d[i * 2 + 1] = bitmap[i];
+      d += ga_pm->pm_linesize;
+      bitmap += stride;
+    }
+    dirty_add(*x, *y, *x + width, *y + height);
+    ga_used_area += width * height;
+    ga_stats.gas_glyphs++;
+    ga_generation++;
+    r = ga_epoch;
+  }
+  hts_mutex_unlock(&ga_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+glyph_atlas_epoch(void)
+{
+  hts_mutex_lock(&ga_mutex);
+  int r = ga_epoch;
+  hts_mutex_unlock(&ga_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+glyph_atlas_reset(int epoch)
+{
+  hts_mutex_lock(&ga_mutex);
+  if(ga_epoch == epoch && ga_pm != NULL) {
+    atlas_clear();
+    ga_epoch++;
+    ga_generation++;
+    ga_stats.gas_resets++;
+  }
+  hts_mutex_unlock(&ga_mutex);
+}
+
+
+/**
+ *
+ */
+int
+glyph_atlas_sync(int generation,
+                 void (*upload)(void *opaque, const struct pixmap *pm,
+                                int x, int y, int w, int h),
+                 void *opaque)
+{
+  hts_mutex_lock(&ga_mutex);
+  if(ga_pm != NULL && generation != ga_generation) {
+    if(generation != ga_synced_generation)
+      dirty_add(0, 0, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+
+    if(ga_dirty_x2 > ga_dirty_x1 && ga_dirty_y2 > ga_dirty_y1) {
+      const int w = ga_dirty_x2 - ga_dirty_x1;
+      const int h = ga_dirty_y2 - ga_dirty_y1;
+      upload(opaque, ga_pm, ga_dirty_x1, ga_dirty_y1, w, h);
+      ga_stats.gas_uploads++;
+      ga_stats.gas_upload_bytes += w * h * 2;
+      ga_stats.gas_bytes_avoided -= w * h * 2;
+    }
+    dirty_clear();
+    ga_synced_generation = ga_generation;
+  }
+  generation = ga_generation;
+  hts_mutex_unlock(&ga_mutex);
+  return generation;
+}
+
+
+/**
+ *
+ */
+void
+glyph_atlas_account_run(int new_glyphs, int64_t bitmap_bytes)
+{
+  hts_mutex_lock(&ga_mutex);
+  ga_stats.gas_runs++;
+  if(new_glyphs == 0)
+    ga_stats.gas_runs_cached++;
+  ga_stats.gas_bytes_avoided += bitmap_bytes;
+  hts_mutex_unlock(&ga_mutex);
+}
+
+
+/**
+ *
+ */
+void
+glyph_atlas_get_stats(glyph_atlas_stats_t *gas)
+{
+  hts_mutex_lock(&ga_mutex);
+  *gas = ga_stats;
+  gas->gas_epoch = ga_epoch;
+  gas->gas_occupancy =
+    ga_used_area * 100 / (GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE);
+  gas->gas_height = 0;
+  for(int i = 0; i < ga_sky_num; i++)
+    gas->gas_height = MAX(gas->gas_height, ga_sky[i].y);
+  hts_mutex_unlock(&ga_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+glyph_atlas_init(void)
+{
+  hts_mutex_init(&ga_mutex);
+  skyline_clear();
+  dirty_clear();
+}
+
+INITME(INIT_GROUP_GRAPHICS, glyph_atlas_init, NULL, 0);
+
+
+#ifdef GLYPH_ATLAS_BENCHMARK
+
+#include "text.h"
+#include "image/image.h"
+#include "misc/str.h"
+
+/**
+ * Composite a glyph run the same way freetype.c composites bitmaps
+ */
+static pixmap_t *
+glyph_bench_draw_runs(const image_t *im)
+{
+  const image_component_t *ic =
+    image_find_component((image_t *)im, IMAGE_GLYPH_RUNS);
+  const image_component_glyph_runs_t *igr = &ic->glyph_runs;
+  pixmap_t *pm = pixmap_create(im->im_width  - im->im_margin * 2,
+                               im->im_height - im->im_margin * 2,
+                               PIXMAP_IA, im->im_margin);
+
+  hts_mutex_lock(&ga_mutex);
+  for(int i = 0; i < igr->igr_num; i++) {
+    const image_glyph_t *ig = &igr->igr_glyphs[i];
+    uint8_t *tmp = malloc(ig->ig_width * ig->ig_height);
+    for(int y = 0; y < ig->ig_height; y++)
+      for(int x = 0; x < ig->ig_width; x++)
+        tmp[y * ig->ig_width + x] =
+          ga_pm->pm_data[(ig->ig_v + y) * ga_pm->pm_linesize +
+                         (ig->ig_u + x) * 2 + 1];
+
+    pixmap_t src = {0};
+    src.pm_type = PIXMAP_I;
+    src.pm_data = tmp;
+    src.pm_width = ig->ig_width;
+    src.pm_height = ig->ig_height;
+    src.pm_linesize = ig->ig_width;
+    pixmap_composite(pm, &src, ig->ig_x, ig->ig_y, ig->ig_color);
+    free(tmp);
+  }
+  hts_mutex_unlock(&ga_mutex);
+  return pm;
+}
+
+
+static int glyph_bench_generation;
+
+static void
+glyph_bench_upload(void *opaque, const pixmap_t *pm, int x, int y, int w, int h)
+{
+}
+
+
+/**
+ * Render a caption as glyph runs and as a bitmap and compare.
+ * The atlas is synced as a renderer would do every frame
+ */
+static int
+glyph_bench_render(const char *str, int size, int flags)
+{
+  uint32_t uc[256];
+  int len = 0;
+
+  while(*str && len < 256)
+    uc[len++] = utf8_get(&str);
+
+  image_t *a = text_render(uc, len, flags | TR_RENDER_GLYPH_RUNS, size, 1.0f,
+                           TR_ALIGN_LEFT, 1000, 1, NULL, 0, 0);
+  image_t *b = text_render(uc, len, flags, size, 1.0f,
+                           TR_ALIGN_LEFT, 1000, 1, NULL, 0, 0);
+  int bad = 0;
+
+  if(a == NULL || b == NULL) {
+    bad = a != b;
+  } else if(image_find_component(a, IMAGE_GLYPH_RUNS) == NULL) {
+    bad = 1;
+  } else {
+    const pixmap_t *ref = image_find_component(b, IMAGE_PIXMAP)->pm;
+    pixmap_t *pm = glyph_bench_draw_runs(a);
+    bad = pm->pm_width != ref->pm_width || pm->pm_height != ref->pm_height ||
+      memcmp(pm->pm_data, ref->pm_data, pm->pm_linesize * pm->pm_height);
+    pixmap_release(pm);
+  }
+  image_release(a);
+  image_release(b);
+  glyph_bench_generation = glyph_atlas_sync(glyph_bench_generation,
+                                            glyph_bench_upload, NULL);
+  return bad;
+}
+
+
+/**
+ * Render captions the way a UI would (a clock, a progress timer and
+ * a scrolling list) as glyph runs and check that they are identical to
+ * the bitmap path. Then fill the atlas with random sized glyphs to see
+ * how well it packs. Build with -DGLYPH_ATLAS_BENCHMARK.
+ * The process exits when done
+ */
+static void *
+glyph_atlas_benchmark(void *aux)
+{
+  glyph_atlas_stats_t gas;
+  char buf[128];
+  int bad = 0;
+
+  for(int t = 0; t < 3600; t++) {
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d", 12 + t / 3600,
+             t / 60 % 60, t % 60);
+    bad += glyph_bench_render(buf, 30, 0);
+
+    snprintf(buf, sizeof(buf), "%02d:%02d / 45:00", t / 60, t % 60);
+    bad += glyph_bench_render(buf, 20, TR_RENDER_OUTLINE);
+  }
+
+  for(int pass = 0; pass < 2; pass++) {
+    for(int i = 0; i < 500; i++) {
+      snprintf(buf, sizeof(buf), "Episode %d - The one with the %s",
+               i + 1, i & 1 ? "Ümlauts" : "quick brown fox");
+      bad += glyph_bench_render(buf, 24, i % 3 ? 0 : TR_RENDER_BOLD);
+    }
+  }
+
+  glyph_atlas_get_stats(&gas);
+  printf("Glyph runs: %d, %d without new glyphs (%d%% uploads avoided), "
+         "%"PRId64" kB of text bitmaps not uploaded, %d mismatches\n",
+         gas.gas_runs, gas.gas_runs_cached,
+         gas.gas_runs ? gas.gas_runs_cached * 100 / gas.gas_runs : 0,
+         gas.gas_bytes_avoided / 1024, bad);
+  printf("Atlas uploads: %d, %"PRId64" kB\n",
+         gas.gas_uploads, gas.gas_upload_bytes / 1024);
+  printf("Atlas: %d glyphs, %d%% of area used, packed height %d, "
+         "%d resets\n",
+         gas.gas_glyphs, gas.gas_occupancy, gas.gas_height, gas.gas_resets);
+
+  glyph_atlas_reset(gas.gas_epoch);
+  uint8_t blank[64 * 64] = {0};
+  uint32_t x = 1;
+  int px, py, n = 0;
+  while(1) {
+    x = x * 1664525 + 1013904223;
+    const int w = 6 + (x >> 8) % 40;
+    const int h = 12 + (x >> 16) % 40;
+    if(glyph_atlas_add(blank, w, w, h, &px, &py) == -1)
+      break;
+    n++;
+  }
+  glyph_atlas_get_stats(&gas);
+  printf("Random glyphs: %d fit before atlas was full, %d%% of area used\n",
+         n, gas.gas_occupancy);
+  exit(0);
+}
+
+
+static void
+glyph_atlas_benchmark_init(void)
+{
+  hts_thread_create_detached("atlasbench", glyph_atlas_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, glyph_atlas_benchmark_init, NULL, 0);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+#include <stdint.h>
+
+struct pixmap;
+
+/**
+ * Shared glyph atlas
+ *
+ * Glyph bitmaps are packed once into a single PIXMAP_IA pixmap that
+ * renderers upload as one texture. When the atlas is full it's cleared
+ * and the epoch is bumped. Positions from older epochs are invalid.
+ */
+
+#define GLYPH_ATLAS_SIZE 1024
+
+typedef struct glyph_atlas_stats {
+  int gas_epoch;
+  int gas_glyphs;
+  int gas_occupancy;          // Percent of atlas area covered by glyphs
+  int gas_height;             // Highest point of the packed area
+  int gas_resets;
+  int gas_uploads;            // Atlas uploads done by renderers
+  int gas_runs;               // Texts rendered as glyph runs
+  int gas_runs_cached;        // ... with all glyphs already in the atlas
+  int64_t gas_upload_bytes;   // Bytes of atlas uploaded
+  int64_t gas_bytes_avoided;  // Per-text bitmap bytes minus atlas uploads
+} glyph_atlas_stats_t;
+
+/**
+ * Copy an 8 bit coverage bitmap into the atlas. Returns the epoch the
+ * position is valid for or -1 if there is no room
+ */
+int glyph_atlas_add(const uint8_t *bitmap, int stride, int width, int height,
+                    int *x, int *y);
+
+int glyph_atlas_epoch(void);
+
+/**
+ * Clear the atlas unless someone already did it since 'epoch'
+ */
+void glyph_atlas_reset(int epoch);
+
+/**
+ * Call 'upload' (with the atlas locked) if the atlas changed since
+ * 'generation'. Only the area that changed is passed if 'generation'
+ * was returned by the previous sync, otherwise the full atlas.
+ * Pass 0 to force a full upload. Returns the current generation
+ */
+int glyph_atlas_sync(int generation,
+                     void (*upload)(void *opaque, const struct pixmap *pm,
+                                    int x, int y, int w, int h),
+                     void *opaque);
+
+void glyph_atlas_account_run(int new_glyphs, int64_t bitmap_bytes);
+
+void glyph_atlas_get_stats(glyph_atlas_stats_t *gas);
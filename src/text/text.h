@@ -74,6 +74,7 @@ struct prop;
 #define TR_RENDER_OUTLINE       0x40
 #define TR_RENDER_NO_OUTPUT     0x80
 #define TR_RENDER_SUBS          0x100  // Render for subtitles
+#define TR_RENDER_GLYPH_RUNS    0x200  // Output glyph runs if possible
 
 #define TR_ALIGN_AUTO      0
 #define TR_ALIGN_LEFT      1
@@ -221,6 +221,9 @@ glw_init4(glw_root_t *gr,
 
   gr->gr_prop_dispatcher = dispatcher;
   gr->gr_courier = courier;
+  // We only ever render the latest value so there is no point
+  // delivering values that got overwritten before we got to them
+  prop_courier_set_flags(courier, PROP_COURIER_COALESCE);
   gr->gr_init_flags = flags;
   gr->gr_prop_maxtime = -1;
 
@@ -70,6 +70,8 @@ LIST_HEAD(glw_event_map_list, glw_event_map);
 SLIST_HEAD(glw_prop_sub_slist, glw_prop_sub);
 LIST_HEAD(glw_loadable_texture_list, glw_loadable_texture);
 TAILQ_HEAD(glw_loadable_texture_queue, glw_loadable_texture);
+LIST_HEAD(glw_tex_cache_entry_list, glw_tex_cache_entry);
+TAILQ_HEAD(glw_tex_cache_entry_queue, glw_tex_cache_entry);
 LIST_HEAD(glw_video_list, glw_video);
 LIST_HEAD(glw_style_list, glw_style);
 TAILQ_HEAD(glw_view_load_request_queue, glw_view_load_request);
@@ -757,6 +759,12 @@ typedef struct glw_class {
    */
   struct glw *(*gc_find_visible_child)(struct glw *w);
 
+  /**
+   * Return the window state if the widget wants a cloner to only
+   * instantiate the items it's about to show. See glw_virtual.h
+   */
+  struct glw_virtual *(*gc_get_virtual)(struct glw *w);
+
   /**
    * Registration link
    */
@@ -879,12 +887,18 @@ typedef struct glw_root {
   TAILQ_HEAD(, glw_text_bitmap) gr_gtb_render_queue;
   TAILQ_HEAD(, glw_text_bitmap) gr_gtb_dim_queue;
   hts_cond_t gr_gtb_work_cond;
-  hts_thread_t gr_font_thread;
+#define GLW_MAX_FONT_THREADS 4
+  hts_thread_t gr_font_threads[GLW_MAX_FONT_THREADS];
+  int gr_num_font_threads;
   int gr_font_thread_running;
 
   rstr_t *gr_default_font;
   int gr_font_domain;
 
+  glw_backend_texture_t gr_glyph_atlas;
+  int gr_glyph_atlas_generation;
+  int gr_glyph_atlas_frame;
+
   /**
    * Image/Texture loader
    */
@@ -914,6 +928,38 @@ typedef struct glw_root {
     int limit;
   } gr_tex_stash[2];
 
+  /**
+   * Decoded images, so textures purged from the stash can be
+   * recreated without going thru the loader threads
+   */
+  struct {
+#define GLW_TEX_CACHE_HASH_SIZE 64
+    struct glw_tex_cache_entry_list hash[GLW_TEX_CACHE_HASH_SIZE];
+    struct glw_tex_cache_entry_queue lru;
+    int size;
+    int limit;
+    int hits;
+    int misses;
+    int pressure;        // Low on memory, drop everything on next purge
+    int64_t stats_published;
+    prop_t *stats;
+    prop_sub_t *lowmem_sub;
+  } gr_tex_cache;
+
+  /**
+   * Decode-ahead for slideshows. Containers lay out neighbours of
+   * the current item invisibly so their images are loaded before
+   * they are shown. See glw_prefetch_limit()
+   */
+  struct {
+    int budget;          // Bytes of full screen images we may load ahead
+    int transitions;
+    int stalls;
+    int64_t stall_total;
+    int64_t stall_max;
+    prop_t *stats;
+  } gr_prefetch;
+
   struct glw_loadable_texture_list gr_tex_list;
 
   /**
@@ -1263,6 +1309,8 @@ typedef struct glw {
 #define GLW2_FHP_SPILL              0x4000000
 #define GLW2_SELECT_ON_FOCUS        0x8000000
 #define GLW2_SELECT_ON_HOVER        0x10000000
+#define GLW2_VIRTUALIZED            0x20000000 /* Only keep widgets for
+                                                  visible cloned items */
 
   float glw_alpha;                   /* Alpha set by user */
   float glw_sharpness;               /* 1-Blur set by user */
@@ -1631,6 +1679,36 @@ glw_t *glw_first_widget(glw_t *w);
 
 glw_t *glw_last_widget(glw_t *w);
 
+
+/**
+ * Decode-ahead
+ */
+int glw_prefetch_limit(glw_root_t *gr, int count);
+
+void glw_prefetch_layout(glw_t *c, int first, int count,
+                         const glw_rctx_t *rc, glw_t *skip);
+
+int glw_is_loading(glw_t *w);
+
+/**
+ * Measures how long a container had to wait for the item it wanted
+ * to show to finish loading
+ */
+typedef struct glw_stall_meter {
+  glw_t *gsm_widget;
+  int64_t gsm_start;
+  int gsm_stalled;
+} glw_stall_meter_t;
+
+void glw_stall_meter_start(glw_stall_meter_t *gsm, glw_t *w);
+
+int glw_stall_meter_check(glw_root_t *gr, glw_stall_meter_t *gsm);
+
+#define glw_stall_meter_forget(gsm, w) do {            \
+    if((gsm)->gsm_widget == (w))                        \
+      (gsm)->gsm_widget = NULL;                         \
+  } while(0)
+
 void glw_set_fullscreen(glw_root_t *gr, int fullscreen);
 
 int glw_kill_screensaver(glw_root_t *gr);
@@ -20,6 +20,7 @@
 #include "glw.h"
 #include "glw_scroll.h"
 #include "glw_navigation.h"
+#include "glw_virtual.h"
 
 
 typedef struct glw_array {
@@ -47,6 +48,9 @@ typedef struct glw_array {
 
   glw_scroll_control_t gsc;
 
+  glw_virtual_t gv;
+  int virtual_row_height;
+
 } glw_array_t;
 
 typedef struct glw_array_item {
@@ -66,6 +70,29 @@ typedef struct glw_array_item {
 } glw_array_item_t;
 
 
+/**
+ *
+ */
+static void
+glw_array_scroll_into_view(glw_array_t *a, int ypos, int rh, int height)
+{
+  const int screen_pos = ypos - a->gsc.rounded_pos;
+  const int bottom_scroll_pos = height - a->gsc.scroll_threshold_post;
+
+  if(screen_pos < a->gsc.scroll_threshold_pre) {
+    a->gsc.target_pos = ypos - a->gsc.scroll_threshold_pre;
+    if(glw_is_focused(&a->w))
+      a->w.glw_flags |= GLW_UPDATE_METRICS;
+    glw_schedule_refresh(a->w.glw_root, 0);
+  } else if(screen_pos + rh > bottom_scroll_pos) {
+    a->gsc.target_pos = ypos + rh - bottom_scroll_pos;
+    if(glw_is_focused(&a->w))
+      a->w.glw_flags |= GLW_UPDATE_METRICS;
+    glw_schedule_refresh(a->w.glw_root, 0);
+  }
+}
+
+
 /**
  *
  */
@@ -92,23 +119,8 @@ grid_layout_row(glw_array_t *a, glw_rctx_t *rc,
     cd->height = rh;
 
     if(c == a->gsc.scroll_to_me) {
-      const int ypos = cd->pos_y;
-      const int screen_pos = ypos - a->gsc.rounded_pos;
-      const int bottom_scroll_pos = height - a->gsc.scroll_threshold_post;
-
-
       a->gsc.scroll_to_me = NULL;
-      if(screen_pos < a->gsc.scroll_threshold_pre) {
-        a->gsc.target_pos = ypos - a->gsc.scroll_threshold_pre;
-        if(glw_is_focused(&a->w))
-          a->w.glw_flags |= GLW_UPDATE_METRICS;
-        glw_schedule_refresh(a->w.glw_root, 0);
-      } else if(screen_pos + rh > bottom_scroll_pos) {
-        a->gsc.target_pos = ypos + rh - bottom_scroll_pos;
-        if(glw_is_focused(&a->w))
-          a->w.glw_flags |= GLW_UPDATE_METRICS;
-        glw_schedule_refresh(a->w.glw_root, 0);
-      }
+      glw_array_scroll_into_view(a, cd->pos_y, rh, height);
     }
 
     if(cd->pos_fy - a->gsc.rounded_pos > -height &&
@@ -124,6 +136,107 @@ grid_layout_row(glw_array_t *a, glw_rctx_t *rc,
 }
 
 
+/**
+ * Only rows around the visible part have widgets. All rows have the
+ * same pitch so positions follow directly from the item index. Items
+ * spanning the full width (GLW_CONSTRAINT_D) are laid out as any other
+ * item and hidden items leave their cell empty
+ */
+static void
+glw_array_layout_virtual(glw_array_t *a, const glw_rctx_t *rc,
+                         glw_rctx_t *rc0, int xspacing, int ypos0)
+{
+  glw_t *w = &a->w;
+  glw_t *c;
+  glw_virtual_t *gv = &a->gv;
+  const int height = rc->rc_height;
+  const int cols = MAX(a->xentries, 1);
+  const int row_height = MAX(a->virtual_row_height ?: a->child_height_px, 1);
+  const int pitch = row_height + a->yspacing;
+  const int rows = (gv->gv_index.gei_num + cols - 1) / cols;
+  int req_row_height = 0;
+  int i;
+
+  if(gv->gv_scroll_to >= 0) {
+    i = gv->gv_scroll_to;
+    gv->gv_scroll_to = -1;
+    glw_array_scroll_into_view(a, ypos0 + i / cols * pitch, row_height,
+                               height);
+  }
+
+  if(a->gsc.scroll_to_me != NULL) {
+    i = glw_virtual_index(gv, a->gsc.scroll_to_me);
+    if(i >= 0)
+      glw_array_scroll_into_view(a, ypos0 + i / cols * pitch, row_height,
+                                 height);
+    a->gsc.scroll_to_me = NULL;
+  }
+
+  glw_scroll_layout(&a->gsc, w, height);
+
+  const int top = a->gsc.rounded_pos - ypos0;
+  const int first_row = MAX(0, (top - height) / pitch);
+  const int last_row = MAX(0, (top + height * 2) / pitch + 1);
+  glw_virtual_set_window(gv, first_row * cols, last_row * cols);
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link) {
+    if(c->glw_flags & GLW_HIDDEN || (i = glw_virtual_index(gv, c)) < 0)
+      continue;
+
+    glw_array_item_t *cd = glw_parent_data(c, glw_array_item_t);
+
+    int req_item_height = 0;
+
+    if(c->glw_flags & GLW_CONSTRAINT_Y)
+      req_item_height += glw_req_height(c);
+
+    if(c->glw_flags & GLW_CONSTRAINT_W && c->glw_req_weight < 0)
+      req_item_height += a->child_width_px / -c->glw_req_weight;
+
+    req_row_height = MAX(req_row_height,
+                         req_item_height ?: a->child_height_px);
+
+    cd->col = i % cols;
+    cd->pos_y = ypos0 + i / cols * pitch;
+    cd->pos_x = cd->col * (xspacing + a->child_width_px);
+    cd->width = a->child_width_px;
+    cd->height = row_height;
+
+    if(cd->just_inserted) {
+      cd->pos_fy = cd->pos_y;
+      cd->pos_fx = cd->pos_x;
+      cd->just_inserted = 0;
+    } else {
+      glw_lp(&cd->pos_fy, w->glw_root, cd->pos_y, 0.25);
+      glw_lp(&cd->pos_fx, w->glw_root, cd->pos_x, 0.25);
+    }
+
+    if(cd->pos_fy - a->gsc.rounded_pos > -height &&
+       cd->pos_fy - a->gsc.rounded_pos <  height * 2) {
+      rc0->rc_width = cd->width;
+      rc0->rc_height = cd->height;
+      glw_layout0(c, rc0);
+    }
+  }
+
+  // Row height is taken from what the current window asks for
+
+  if(req_row_height && req_row_height != a->virtual_row_height) {
+    a->virtual_row_height = req_row_height;
+    glw_need_refresh(w->glw_root, 0);
+  }
+
+  const int total = ypos0 + MAX(0, rows * pitch - a->yspacing);
+  if(a->gsc.total_size != total) {
+    a->gsc.total_size = total;
+    a->w.glw_flags |= GLW_UPDATE_METRICS;
+  }
+
+  if(a->w.glw_flags & GLW_UPDATE_METRICS)
+    glw_scroll_update_metrics(&a->gsc, w);
+}
+
+
 /**
  *
  */
@@ -204,6 +317,10 @@ glw_array_layout(glw_t *w, const glw_rctx_t *rc)
       a->gsc.scroll_to_me = w->glw_focused;
   }
 
+  if(glw_virtual_is_attached(&a->gv)) {
+    glw_array_layout_virtual(a, rc, &rc0, xspacing, ypos);
+    return;
+  }
 
   glw_scroll_layout(&a->gsc, w, rc->rc_height);
 
@@ -513,6 +630,29 @@ glw_array_ctor(glw_t *w)
   glw_array_t *a = (glw_array_t *)w;
   w->glw_flags |= GLW_FLOATING_FOCUS;
   a->gsc.suggest_cnt = 1;
+  glw_virtual_init(&a->gv);
+}
+
+
+/**
+ *
+ */
+static void
+glw_array_dtor(glw_t *w)
+{
+  glw_array_t *a = (glw_array_t *)w;
+  glw_virtual_free(&a->gv);
+}
+
+
+/**
+ *
+ */
+static glw_virtual_t *
+glw_array_get_virtual(glw_t *w)
+{
+  glw_array_t *a = (glw_array_t *)w;
+  return w->glw_flags2 & GLW2_VIRTUALIZED ? &a->gv : NULL;
 }
 
 /**
@@ -753,6 +893,7 @@ static glw_class_t glw_array = {
   .gc_flags = GLW_NAVIGATION_SEARCH_BOUNDARY | GLW_CAN_HIDE_CHILDS | GLW_DRIVE_PAGINATION,
   .gc_render = glw_array_render,
   .gc_ctor = glw_array_ctor,
+  .gc_dtor = glw_array_dtor,
   .gc_set_int = glw_array_set_int,
   .gc_signal_handler = glw_array_callback,
   .gc_layout = glw_array_layout,
@@ -763,6 +904,7 @@ static glw_class_t glw_array = {
   .gc_set_float_unresolved = glw_array_set_float_unresolved,
   .gc_suggest_focus = glw_array_suggest_focus,
   .gc_find_visible_child = glw_array_find_visible_child,
+  .gc_get_virtual = glw_array_get_virtual,
 };
 
 GLW_REGISTER_CLASS(glw_array);
@@ -36,6 +36,10 @@ typedef struct {
 
   float v;
 
+  int prefetch;
+
+  glw_stall_meter_t stall;
+
   char rev : 1;
   char keep_next_hot : 1;
   char keep_prev_hot : 1;
@@ -124,6 +128,9 @@ deck_select_child(glw_t *w, glw_t *c, prop_t *origin)
      (gd->last != NULL || !(w->glw_flags2 & GLW2_NO_INITIAL_TRANS)))
     gd->v = 0;
 
+  if(gd->prefetch && c != NULL)
+    glw_stall_meter_start(&gd->stall, c);
+
   glw_signal0(w, GLW_SIGNAL_RESELECT_CHANGED, NULL);
   gd->allow_transition = 1;
   return GLW_SET_RERENDER_REQUIRED;
@@ -169,9 +176,13 @@ glw_deck_layout(glw_t *w, const glw_rctx_t *rc)
   if(w->glw_selected != gd->last)
     glw_layout0(w->glw_selected, rc);
 
+  if(gd->stall.gsm_widget == w->glw_selected &&
+     !glw_stall_meter_check(w->glw_root, &gd->stall))
+    glw_schedule_refresh(w->glw_root, w->glw_root->gr_frame_start + 50000);
+
   glw_t *p;
 
-  if(gd->keep_prev_hot) {
+  if(gd->keep_prev_hot || gd->prefetch) {
     p = glw_prev_widget(w->glw_selected);
     if(p == NULL)
       p = glw_last_widget(w);
@@ -182,7 +193,7 @@ glw_deck_layout(glw_t *w, const glw_rctx_t *rc)
     p = NULL;
   }
 
-  if(gd->keep_next_hot) {
+  if(gd->keep_next_hot || gd->prefetch) {
 
     glw_t *n = glw_next_widget(w->glw_selected);
     if(n == NULL)
@@ -191,6 +202,11 @@ glw_deck_layout(glw_t *w, const glw_rctx_t *rc)
     if(n != NULL && n != w->glw_selected && n != gd->last && n != p)
       glw_layout0(n, &rc0);
   }
+
+  if(gd->prefetch > 1)
+    glw_prefetch_layout(w->glw_selected, 2,
+                        glw_prefetch_limit(w->glw_root, gd->prefetch),
+                        &rc0, gd->last);
 }
 
 
@@ -215,6 +231,8 @@ glw_deck_callback(glw_t *w, void *opaque, glw_signal_t signal, void *extra)
     if(w->glw_selected == extra)
       clear_constraints(w);
 
+    glw_stall_meter_forget(&gd->stall, extra);
+
     if(gd->last == extra)
       gd->last = NULL;
 
@@ -431,6 +449,10 @@ glw_deck_set_int_unresolved(glw_t *w, const char *a, int value,
     gd->keep_last_hot = value;
     return GLW_SET_LAYOUT_ONLY;
   }
+  if(!strcmp(a, "prefetch")) {
+    gd->prefetch = value;
+    return GLW_SET_LAYOUT_ONLY;
+  }
   if(!strcmp(a, "preloadedAreVisible")) {
     gd->preloaded_are_visible = value;
     return GLW_SET_LAYOUT_ONLY;
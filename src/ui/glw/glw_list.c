@@ -20,6 +20,7 @@
 #include "glw.h"
 #include "glw_scroll.h"
 #include "glw_navigation.h"
+#include "glw_virtual.h"
 
 typedef struct glw_list {
   glw_t w;
@@ -32,6 +33,8 @@ typedef struct glw_list {
 
   glw_scroll_control_t gsc;
 
+  glw_virtual_t gv;
+
 } glw_list_t;
 
 
@@ -43,6 +46,128 @@ typedef struct glw_list_item {
 } glw_list_item_t;
 
 
+/**
+ * Adjust scroll target so an item at 'ypos' is within the thresholds
+ */
+static void
+glw_list_scroll_into_view(glw_list_t *l, int ypos, int height,
+                          int bottom_scroll_pos)
+{
+  int screen_pos = ypos - l->gsc.rounded_pos;
+  if(screen_pos < l->gsc.scroll_threshold_pre) {
+    l->gsc.target_pos = ypos - l->gsc.scroll_threshold_pre;
+    if(glw_is_focused(&l->w))
+      l->w.glw_flags |= GLW_UPDATE_METRICS;
+    glw_schedule_refresh(l->w.glw_root, 0);
+  } else if(screen_pos + height > bottom_scroll_pos) {
+    l->gsc.target_pos = ypos + height - bottom_scroll_pos;
+    if(glw_is_focused(&l->w))
+      l->w.glw_flags |= GLW_UPDATE_METRICS;
+    glw_schedule_refresh(l->w.glw_root, 0);
+  }
+}
+
+
+/**
+ * Only items around the visible part have widgets. Their positions
+ * come from the extent index so nothing here depends on the total
+ * number of items
+ */
+static void
+glw_list_layout_y_virtual(glw_list_t *l, const glw_rctx_t *rc,
+                          glw_rctx_t *rc0, int bottom_scroll_pos)
+{
+  glw_t *w = &l->w;
+  glw_t *c;
+  glw_virtual_t *gv = &l->gv;
+  glw_extent_index_t *gei = &gv->gv_index;
+  const int pre = l->gsc.scroll_threshold_pre;
+  int i;
+
+  // Don't let a new estimate move what's on screen
+
+  const int first = MIN(gv->gv_first, gei->gei_num);
+  const int prev = glw_extent_index_offset(gei, first);
+  glw_extent_index_set_estimate(gei, rc0->rc_width / 10 + l->spacing);
+  const int delta = glw_extent_index_offset(gei, first) - prev;
+  if(delta) {
+    l->gsc.target_pos += delta;
+    l->gsc.filtered_pos += delta;
+  }
+
+  if(gv->gv_scroll_to >= 0) {
+    i = gv->gv_scroll_to;
+    gv->gv_scroll_to = -1;
+    if(i < gei->gei_num)
+      glw_list_scroll_into_view(l, pre + glw_extent_index_offset(gei, i),
+                                glw_extent_index_get(gei, i) - l->spacing,
+                                bottom_scroll_pos);
+  }
+
+  if(l->gsc.scroll_to_me != NULL) {
+    i = glw_virtual_index(gv, l->gsc.scroll_to_me);
+    if(i >= 0)
+      glw_list_scroll_into_view(l, pre + glw_extent_index_offset(gei, i),
+                                glw_extent_index_get(gei, i) - l->spacing,
+                                bottom_scroll_pos);
+    l->gsc.scroll_to_me = NULL;
+  }
+
+  glw_scroll_layout(&l->gsc, w, rc->rc_height);
+
+  const int top = l->gsc.rounded_pos - pre;
+  glw_virtual_set_window(gv,
+                         glw_extent_index_find(gei, top - rc->rc_height),
+                         glw_extent_index_find(gei, top + rc->rc_height * 2)
+                         + 1);
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link) {
+    if((i = glw_virtual_index(gv, c)) < 0)
+      continue;
+
+    if(c->glw_flags & GLW_HIDDEN) {
+      glw_extent_index_set(gei, i, 0);
+      continue;
+    }
+
+    int f = glw_filter_constraints(c);
+
+    if(f & GLW_CONSTRAINT_Y) {
+      rc0->rc_height = glw_req_height(c);
+    } else {
+      rc0->rc_height = rc0->rc_width / 10;
+    }
+
+    glw_extent_index_set(gei, i, rc0->rc_height + l->spacing);
+
+    const int ypos = pre + glw_extent_index_offset(gei, i);
+    glw_list_item_t *cd = glw_parent_data(c, glw_list_item_t);
+
+    if(cd->inst) {
+      cd->pos = ypos;
+      cd->inst = 0;
+    } else {
+      glw_lp(&cd->pos, w->glw_root, ypos, 0.25);
+    }
+
+    cd->height = rc0->rc_height;
+
+    if(ypos - l->gsc.rounded_pos > -rc->rc_height &&
+       ypos - l->gsc.rounded_pos <  rc->rc_height * 2)
+      glw_layout0(c, rc0);
+  }
+
+  const int total = pre + glw_extent_index_total(gei);
+  if(l->gsc.total_size != total) {
+    l->gsc.total_size = total;
+    l->w.glw_flags |= GLW_UPDATE_METRICS;
+  }
+
+  if(l->w.glw_flags & GLW_UPDATE_METRICS)
+    glw_scroll_update_metrics(&l->gsc, w);
+}
+
+
 /**
  *
  */
@@ -69,6 +194,11 @@ glw_list_layout_y(glw_t *w, const glw_rctx_t *rc)
       l->gsc.scroll_to_me = w->glw_focused;
   }
 
+  if(glw_virtual_is_attached(&l->gv)) {
+    glw_list_layout_y_virtual(l, rc, &rc0, bottom_scroll_pos);
+    return;
+  }
+
   if(l->gsc.scroll_to_me != NULL) {
 
     ypos = l->gsc.scroll_threshold_pre;
@@ -85,21 +215,8 @@ glw_list_layout_y(glw_t *w, const glw_rctx_t *rc)
         height = rc0.rc_width / 10;
       }
 
-      if(c == l->gsc.scroll_to_me) {
-
-        int screen_pos = ypos - l->gsc.rounded_pos;
-        if(screen_pos < l->gsc.scroll_threshold_pre) {
-          l->gsc.target_pos = ypos - l->gsc.scroll_threshold_pre;
-          if(glw_is_focused(w))
-            l->w.glw_flags |= GLW_UPDATE_METRICS;
-          glw_schedule_refresh(w->glw_root, 0);
-        } else if(screen_pos + height > bottom_scroll_pos) {
-          l->gsc.target_pos = ypos + height - bottom_scroll_pos;
-          if(glw_is_focused(w))
-            l->w.glw_flags |= GLW_UPDATE_METRICS;
-          glw_schedule_refresh(w->glw_root, 0);
-        }
-      }
+      if(c == l->gsc.scroll_to_me)
+        glw_list_scroll_into_view(l, ypos, height, bottom_scroll_pos);
 
       ypos += height;
       ypos += l->spacing;
@@ -573,6 +690,29 @@ glw_list_ctor(glw_t *w)
   glw_list_t *l = (void *)w;
   l->gsc.suggest_cnt = 1;
   w->glw_flags |= GLW_FLOATING_FOCUS;
+  glw_virtual_init(&l->gv);
+}
+
+
+/**
+ *
+ */
+static void
+glw_list_dtor(glw_t *w)
+{
+  glw_list_t *l = (void *)w;
+  glw_virtual_free(&l->gv);
+}
+
+
+/**
+ *
+ */
+static glw_virtual_t *
+glw_list_get_virtual(glw_t *w)
+{
+  glw_list_t *l = (void *)w;
+  return w->glw_flags2 & GLW2_VIRTUALIZED ? &l->gv : NULL;
 }
 
 
@@ -656,6 +796,7 @@ static glw_class_t glw_list_y = {
   .gc_render = glw_list_render_y,
   .gc_set_int = glw_list_set_int,
   .gc_ctor = glw_list_ctor,
+  .gc_dtor = glw_list_dtor,
   .gc_signal_handler = glw_list_callback,
   .gc_suggest_focus = glw_list_suggest_focus,
   .gc_set_int16_4 = glw_list_set_int16_4,
@@ -665,6 +806,7 @@ static glw_class_t glw_list_y = {
   .gc_set_int_unresolved = glw_list_set_int_unresolved,
   .gc_set_float_unresolved = glw_list_set_float_unresolved,
   .gc_find_visible_child = glw_list_find_visible_child,
+  .gc_get_virtual = glw_list_get_virtual,
 };
 
 GLW_REGISTER_CLASS(glw_list_y);
@@ -681,6 +823,7 @@ static glw_class_t glw_list_x = {
   .gc_render = glw_list_render_x,
   .gc_set_int = glw_list_set_int,
   .gc_ctor = glw_list_ctor,
+  .gc_dtor = glw_list_dtor,
   .gc_signal_handler = glw_list_callback,
   .gc_suggest_focus = glw_list_suggest_focus,
   .gc_set_int16_4 = glw_list_set_int16_4,
@@ -32,6 +32,10 @@ typedef struct glw_slideshow {
 
   int visible_childs;
 
+  int prefetch;
+
+  glw_stall_meter_t stall;
+
 } glw_slideshow_t;
 
 
@@ -122,21 +126,33 @@ glw_slideshow_layout(glw_t *w, const glw_rctx_t *rc)
     return;
 
   if(s->visible_childs > 1) {
-    glw_schedule_refresh(gr, s->deadline);
     if(s->deadline <= gr->gr_frame_start) {
-      s->deadline = gr->gr_frame_start + s->display_time;
-      c = glw_next_widget(c);
-      if(c == NULL)
-        c = glw_first_widget(&s->w);
-      if(c != NULL) {
+      n = glw_next_widget(c);
+      if(n == NULL)
+        n = glw_first_widget(&s->w);
+
+      /**
+       * Don't fade over to an image that is not loaded yet, keep
+       * showing the current one until it is
+       */
+      if(s->stall.gsm_widget != n)
+        glw_stall_meter_start(&s->stall, n);
+
+      if(glw_stall_meter_check(gr, &s->stall)) {
+        s->deadline = gr->gr_frame_start + s->display_time;
+        c = n;
         s->w.glw_focused = c;
         glw_focus_open_path_close_all_other(c);
         glw_copy_constraints(&s->w, c);
       }
     }
+    glw_schedule_refresh(gr, MAX(s->deadline, gr->gr_frame_start + 50000));
   }
 
   glw_layout0(c, rc);
+  if(s->stall.gsm_widget == c)
+    glw_stall_meter_check(gr, &s->stall);
+
   a = itemdata(c)->alpha;
   r |= update_parent_alpha(c, GLW_MIN(a + delta, 1.0f));
 
@@ -166,6 +182,16 @@ glw_slideshow_layout(glw_t *w, const glw_rctx_t *rc)
     glw_layout0(n, &rc0);
   }
 
+  /**
+   * Decode further ahead so skipping thru images on a slow source
+   * doesn't have to wait for each one of them
+   */
+  rc0.rc_invisible = 1;
+  glw_prefetch_layout(c, 2, glw_prefetch_limit(gr, s->prefetch), &rc0, NULL);
+
+  if(s->stall.gsm_widget != NULL)
+    glw_schedule_refresh(gr, gr->gr_frame_start + 50000);
+
   if(r)
     glw_need_refresh(w->glw_root, 0);
 }
@@ -184,13 +210,31 @@ glw_slideshow_update_playstatus(glw_slideshow_t *s)
 }
 
 
+/**
+ *
+ */
+static void
+glw_slideshow_select(glw_slideshow_t *s, glw_t *c)
+{
+  glw_root_t *gr = s->w.glw_root;
+
+  s->w.glw_focused = c;
+  if(c != NULL) {
+    glw_focus_open_path_close_all_other(c);
+    glw_copy_constraints(&s->w, c);
+    glw_stall_meter_start(&s->stall, c);
+  }
+  s->deadline = s->hold ? INT64_MAX : gr->gr_frame_start + s->display_time;
+  glw_need_refresh(gr, 0);
+}
+
+
 /**
  *
  */
 static int
 glw_slideshow_event(glw_t *w, event_t *e)
 {
-  glw_root_t *gr = w->glw_root;
   glw_slideshow_t *s = (glw_slideshow_t *)w;
   glw_t *c;
   event_int_t *eu = (event_int_t *)e;
@@ -200,9 +244,7 @@ glw_slideshow_event(glw_t *w, event_t *e)
     c = w->glw_focused ? glw_next_widget(w->glw_focused) : NULL;
     if(c == NULL)
       c = glw_first_widget(w);
-    w->glw_focused = c;
-    s->deadline = 0;
-    glw_need_refresh(gr, 0);
+    glw_slideshow_select(s, c);
 
   } else if(event_is_action(e, ACTION_SKIP_BACKWARD) ||
 	    event_is_action(e, ACTION_LEFT)) {
@@ -210,9 +252,7 @@ glw_slideshow_event(glw_t *w, event_t *e)
     c = w->glw_focused ? glw_prev_widget(w->glw_focused) : NULL;
     if(c == NULL)
       c = glw_last_widget(w);
-    w->glw_focused = c;
-    s->deadline = 0;
-    glw_need_refresh(gr, 0);
+    glw_slideshow_select(s, c);
 
   } else if(event_is_type(e, EVENT_UNICODE) && eu->val == 32) {
 
@@ -255,6 +295,7 @@ glw_slideshow_callback(glw_t *w, void *opaque, glw_signal_t signal,
     break;
 
   case GLW_SIGNAL_CHILD_DESTROYED:
+    glw_stall_meter_forget(&s->stall, extra);
     if(w->glw_flags & GLW_HIDDEN)
       return 0;
   case GLW_SIGNAL_CHILD_HIDDEN:
@@ -282,6 +323,7 @@ glw_slideshow_ctor(glw_t *w)
   glw_slideshow_t *s = (glw_slideshow_t *)w;
   s->display_time = 5000000;
   s->transition_time = 500000;
+  s->prefetch = 3;
 }
 
 
@@ -318,6 +360,23 @@ glw_slideshow_set_float(glw_t *w, glw_attribute_t attrib, float value,
 }
 
 
+/**
+ *
+ */
+static int
+glw_slideshow_set_int_unresolved(glw_t *w, const char *a, int value,
+                                 glw_style_t *gs)
+{
+  glw_slideshow_t *s = (glw_slideshow_t *)w;
+
+  if(!strcmp(a, "prefetch")) {
+    s->prefetch = value;
+    return GLW_SET_LAYOUT_ONLY;
+  }
+  return GLW_SET_NOT_RESPONDING;
+}
+
+
 /**
  *
  */
@@ -328,6 +387,7 @@ static glw_class_t glw_slideshow = {
   .gc_flags = GLW_CAN_HIDE_CHILDS,
   .gc_ctor = glw_slideshow_ctor,
   .gc_set_float = glw_slideshow_set_float,
+  .gc_set_int_unresolved = glw_slideshow_set_int_unresolved,
   .gc_layout = glw_slideshow_layout,
   .gc_render = glw_slideshow_render,
   .gc_signal_handler = glw_slideshow_callback,
@@ -35,6 +35,7 @@
 #include "glw_text_bitmap.h"
 #include "misc/str.h"
 #include "text/text.h"
+#include "text/glyph_atlas.h"
 #include "event.h"
 #include "image/image.h"
 #include "fileaccess/fa_filepicker.h"
@@ -64,6 +65,7 @@ typedef struct glw_text_bitmap {
   glw_backend_texture_t gtb_texture;
 
   glw_renderer_t gtb_text_renderer;
+  glw_renderer_t gtb_glyph_renderer;
   glw_renderer_t gtb_cursor_renderer;
   glw_renderer_t gtb_background_renderer;
 
@@ -112,6 +114,8 @@ typedef struct glw_text_bitmap {
   uint8_t gtb_need_layout : 1;
   uint8_t gtb_deferred_realize : 1;
   uint8_t gtb_caption_dirty : 1;
+  uint8_t gtb_draw_glyphs : 1;
+  uint8_t gtb_no_glyph_runs : 1;  // Lost glyphs to an atlas reset
 
 } glw_text_bitmap_t;
 
@@ -122,6 +126,124 @@ static void gtb_caption_refresh(glw_text_bitmap_t *gtb);
 static glw_class_t glw_text, glw_label;
 
 
+/**
+ *
+ */
+static void
+glyph_atlas_upload(void *opaque, const pixmap_t *pm, int x, int y, int w, int h)
+{
+  glw_root_t *gr = opaque;
+
+  if(glw_is_tex_inited(&gr->gr_glyph_atlas) &&
+     (w != pm->pm_width || h != pm->pm_height))
+    glw_tex_upload_rect(gr, &gr->gr_glyph_atlas, pm, x, y, w, h);
+  else
+    glw_tex_upload(gr, &gr->gr_glyph_atlas, pm, 0);
+}
+
+
+/**
+ * Upload the glyph atlas if it has changed, at most once per frame
+ */
+static void
+glyph_atlas_update(glw_root_t *gr)
+{
+  if(gr->gr_glyph_atlas_frame == gr->gr_frames &&
+     glw_is_tex_inited(&gr->gr_glyph_atlas))
+    return;
+
+  gr->gr_glyph_atlas_frame = gr->gr_frames;
+
+  // Texture is gone, we need all of it
+  if(!glw_is_tex_inited(&gr->gr_glyph_atlas))
+    gr->gr_glyph_atlas_generation = 0;
+
+  gr->gr_glyph_atlas_generation =
+    glyph_atlas_sync(gr->gr_glyph_atlas_generation, glyph_atlas_upload, gr);
+}
+
+
+/**
+ * Build one quad per glyph. x1,y1 - x2,y2 is where the visible
+ * width x height pixels of the text should go
+ */
+static void
+gtb_layout_glyphs(glw_text_bitmap_t *gtb,
+                  const image_component_glyph_runs_t *igr,
+                  float x1, float y1, float x2, float y2,
+                  int width, int height)
+{
+  glw_renderer_t *r = &gtb->gtb_glyph_renderer;
+  const float sx = (x2 - x1) / width;
+  const float sy = (y2 - y1) / height;
+  const float a = 1.0f / GLYPH_ATLAS_SIZE;
+  int i, n = 0;
+
+  glw_renderer_free(r);
+
+  if(width <= 0 || height <= 0)
+    return;
+
+  for(i = 0; i < igr->igr_num; i++) {
+    const image_glyph_t *ig = &igr->igr_glyphs[i];
+    if(ig->ig_x < width && ig->ig_y < height)
+      n++;
+  }
+
+  glw_renderer_init(r, n * 4, n * 2, NULL);
+
+  n = 0;
+  for(i = 0; i < igr->igr_num; i++) {
+    const image_glyph_t *ig = &igr->igr_glyphs[i];
+    if(ig->ig_x >= width || ig->ig_y >= height)
+      continue;
+
+    // Clip to the visible part of the text
+    const int gx1 = MAX(ig->ig_x, 0);
+    const int gy1 = MAX(ig->ig_y, 0);
+    const int gx2 = MIN(ig->ig_x + ig->ig_width,  width);
+    const int gy2 = MIN(ig->ig_y + ig->ig_height, height);
+
+    const float u1 = (ig->ig_u + gx1 - ig->ig_x) * a;
+    const float v1 = (ig->ig_v + gy1 - ig->ig_y) * a;
+    const float u2 = (ig->ig_u + gx2 - ig->ig_x) * a;
+    const float v2 = (ig->ig_v + gy2 - ig->ig_y) * a;
+
+    const float left   = x1 + gx1 * sx;
+    const float right  = x1 + gx2 * sx;
+    const float top    = y2 - gy1 * sy;
+    const float bottom = y2 - gy2 * sy;
+
+    const uint32_t c = ig->ig_color;
+    const float cr = (c         & 0xff) / 255.0f;
+    const float cg = ((c >> 8)  & 0xff) / 255.0f;
+    const float cb = ((c >> 16) & 0xff) / 255.0f;
+    const float ca = ((c >> 24) & 0xff) / 255.0f;
+
+    const int v = n * 4;
+
+    glw_renderer_vtx_pos(r, v + 0, left,  bottom, 0.0);
+    glw_renderer_vtx_st (r, v + 0, u1, v2);
+
+    glw_renderer_vtx_pos(r, v + 1, right, bottom, 0.0);
+    glw_renderer_vtx_st (r, v + 1, u2, v2);
+
+    glw_renderer_vtx_pos(r, v + 2, right, top, 0.0);
+    glw_renderer_vtx_st (r, v + 2, u2, v1);
+
+    glw_renderer_vtx_pos(r, v + 3, left,  top, 0.0);
+    glw_renderer_vtx_st (r, v + 3, u1, v1);
+
+    for(int j = 0; j < 4; j++)
+      glw_renderer_vtx_col(r, v + j, cr, cg, cb, ca);
+
+    glw_renderer_triangle(r, n * 2 + 0, v, v + 1, v + 2);
+    glw_renderer_triangle(r, n * 2 + 1, v, v + 2, v + 3);
+    n++;
+  }
+}
+
+
 /**
  *
  */
@@ -161,8 +283,33 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
     gtb->gtb_need_layout = 1;
   }
 
-  const int tex_width  = glw_tex_width(&gtb->gtb_texture);
-  const int tex_height = glw_tex_height(&gtb->gtb_texture);
+  ic = image_find_component(gtb->gtb_image, IMAGE_GLYPH_RUNS);
+  const image_component_glyph_runs_t *igr = ic ? &ic->glyph_runs : NULL;
+
+  gtb->gtb_draw_glyphs = 0;
+
+  if(igr != NULL) {
+    glw_tex_destroy(gr, &gtb->gtb_texture);
+    gtb->gtb_margin = gtb->gtb_image->im_margin;
+
+    if(igr->igr_atlas_epoch == glyph_atlas_epoch()) {
+      glyph_atlas_update(gr);
+      gtb->gtb_draw_glyphs = 1;
+    } else if(gtb->gtb_state == GTB_VALID) {
+      /*
+       * Atlas has been cleared so our glyphs are gone. If what's on
+       * screen doesn't fit in the atlas, texts would keep clearing it
+       * for each other so render this one as a bitmap from now on
+       */
+      gtb->gtb_state = GTB_NEED_RENDER;
+      gtb->gtb_no_glyph_runs = 1;
+    }
+  }
+
+  const int tex_width  = igr ? gtb->gtb_image->im_width :
+    glw_tex_width(&gtb->gtb_texture);
+  const int tex_height = igr ? gtb->gtb_image->im_height :
+    glw_tex_height(&gtb->gtb_texture);
 
   ic = image_find_component(gtb->gtb_image, IMAGE_TEXT_INFO);
   image_component_text_info_t *ti = ic ? &ic->text_info : NULL;
@@ -316,17 +463,21 @@ glw_text_bitmap_layout(glw_t *w, const glw_rctx_t *rc)
     if(gtb->w.glw_flags2 & GLW2_DEBUG)
       printf("  s=%f t=%f\n", s, t);
 
-    glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 0, x1, y1, 0.0);
-    glw_renderer_vtx_st (&gtb->gtb_text_renderer, 0, 0, t);
+    if(igr != NULL) {
+      gtb_layout_glyphs(gtb, igr, x1, y1, x2, y2, text_width, text_height);
+    } else {
+      glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 0, x1, y1, 0.0);
+      glw_renderer_vtx_st (&gtb->gtb_text_renderer, 0, 0, t);
 
-    glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 1, x2, y1, 0.0);
-    glw_renderer_vtx_st (&gtb->gtb_text_renderer, 1, s, t);
+      glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 1, x2, y1, 0.0);
+      glw_renderer_vtx_st (&gtb->gtb_text_renderer, 1, s, t);
 
-    glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 2, x2, y2, 0.0);
-    glw_renderer_vtx_st (&gtb->gtb_text_renderer, 2, s, 0);
+      glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 2, x2, y2, 0.0);
+      glw_renderer_vtx_st (&gtb->gtb_text_renderer, 2, s, 0);
 
-    glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 3, x1, y2, 0.0);
-    glw_renderer_vtx_st (&gtb->gtb_text_renderer, 3, 0, 0);
+      glw_renderer_vtx_pos(&gtb->gtb_text_renderer, 3, x1, y2, 0.0);
+      glw_renderer_vtx_st (&gtb->gtb_text_renderer, 3, 0, 0);
+    }
   }
 
   if(w->glw_class == &glw_text && gtb->gtb_update_cursor) {
@@ -419,7 +570,15 @@ glw_text_bitmap_render(glw_t *w, const glw_rctx_t *rc)
     glw_zinc(&rc0);
   }
 
-  if(glw_is_tex_inited(&gtb->gtb_texture) && gtb->gtb_image != NULL) {
+  if(gtb->gtb_draw_glyphs) {
+    glw_root_t *gr = w->glw_root;
+    if(glw_is_tex_inited(&gr->gr_glyph_atlas) &&
+       glw_renderer_initialized(&gtb->gtb_glyph_renderer))
+      glw_renderer_draw(&gtb->gtb_glyph_renderer, gr, &rc0,
+                        &gr->gr_glyph_atlas, NULL,
+                        &gtb->gtb_color, NULL, alpha, blur, NULL);
+
+  } else if(glw_is_tex_inited(&gtb->gtb_texture) && gtb->gtb_image != NULL) {
     glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, &rc0,
 		      &gtb->gtb_texture, NULL,
 		      &gtb->gtb_color, NULL, alpha, blur, NULL);
@@ -458,6 +617,7 @@ glw_text_bitmap_dtor(glw_t *w)
   glw_tex_destroy(w->glw_root, &gtb->gtb_texture);
 
   glw_renderer_free(&gtb->gtb_text_renderer);
+  glw_renderer_free(&gtb->gtb_glyph_renderer);
   glw_renderer_free(&gtb->gtb_cursor_renderer);
   glw_renderer_free(&gtb->gtb_background_renderer);
 
@@ -541,6 +701,10 @@ gtb_inactive(glw_text_bitmap_t *gtb)
 {
   glw_tex_destroy(gtb->w.glw_root, &gtb->gtb_texture);
 
+  // Glyph runs live in the shared atlas and survive this
+  if(image_find_component(gtb->gtb_image, IMAGE_GLYPH_RUNS) != NULL)
+    return;
+
   // Make sure it is rerendered once we get back to life
   if(gtb->gtb_state == GTB_VALID)
     gtb->gtb_state = GTB_NEED_RENDER;
@@ -1217,6 +1381,9 @@ do_render(glw_text_bitmap_t *gtb, glw_root_t *gr, int no_output)
   if(gtb->gtb_flags & GTB_OUTLINE)
     flags |= TR_RENDER_OUTLINE;
 
+  if(!no_output && !gtb->gtb_no_glyph_runs)
+    flags |= TR_RENDER_GLYPH_RUNS;
+
   if(gtb->w.glw_class == &glw_text)
     flags |= TR_RENDER_CHARACTER_POS;
 
@@ -1293,6 +1460,7 @@ do_render(glw_text_bitmap_t *gtb, glw_root_t *gr, int no_output)
     image_release(gtb->gtb_image);
     gtb->gtb_image = im;
     gtb->gtb_update_cursor = 1;
+    gtb->gtb_need_layout = 1;
     if(im != NULL && gtb->gtb_maxlines > 1) {
       gtb_set_constraints(gr, gtb, im);
     }
@@ -1424,9 +1592,18 @@ glw_text_bitmap_init(glw_root_t *gr)
   hts_cond_init(&gr->gr_gtb_work_cond, &gr->gr_mutex);
 
   gr->gr_font_thread_running = 1;
-  hts_thread_create_joinable("GLW font renderer", &gr->gr_font_thread,
-			     font_render_thread, gr,
-			     THREAD_PRIO_UI_WORKER_HIGH);
+
+  /*
+   * text_render() is reentrant so we can have a few workers. Leave one
+   * CPU for the UI thread on smaller systems
+   */
+  gr->gr_num_font_threads =
+    MAX(1, MIN(gconf.concurrency - 1, GLW_MAX_FONT_THREADS));
+
+  for(int i = 0; i < gr->gr_num_font_threads; i++)
+    hts_thread_create_joinable("GLW font renderer", &gr->gr_font_threads[i],
+                               font_render_thread, gr,
+                               THREAD_PRIO_UI_WORKER_HIGH);
 }
 
 
@@ -1438,10 +1615,12 @@ glw_text_bitmap_fini(glw_root_t *gr)
 {
   hts_mutex_lock(&gr->gr_mutex);
   gr->gr_font_thread_running = 0;
-  hts_cond_signal(&gr->gr_gtb_work_cond);
+  hts_cond_broadcast(&gr->gr_gtb_work_cond);
   hts_mutex_unlock(&gr->gr_mutex);
-  hts_thread_join(&gr->gr_font_thread);
+  for(int i = 0; i < gr->gr_num_font_threads; i++)
+    hts_thread_join(&gr->gr_font_threads[i]);
   hts_cond_destroy(&gr->gr_gtb_work_cond);
+  glw_tex_destroy(gr, &gr->gr_glyph_atlas);
 }
 
 
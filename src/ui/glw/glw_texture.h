@@ -119,6 +119,8 @@ void glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt);
 
 void glw_tex_purge(glw_root_t *gr);
 
+void glw_tex_memory_pressure(glw_root_t *gr);
+
 void glw_tex_autoflush(glw_root_t *gr);
 
 void glw_tex_flush_all(glw_root_t *gr);
@@ -140,6 +142,13 @@ void glw_tex_backend_layout(glw_root_t *gr, glw_loadable_texture_t *glt);
 void glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 		    const pixmap_t *pm, int flags);
 
+/**
+ * Update the x, y, w, h part of a texture previously uploaded from
+ * a pixmap with the same size and format
+ */
+void glw_tex_upload_rect(glw_root_t *gr, glw_backend_texture_t *tex,
+                         const pixmap_t *pm, int x, int y, int w, int h);
+
 void glw_tex_destroy(glw_root_t *gr, glw_backend_texture_t *tex);
 
 #endif /* GLW_TEXTURE_H */
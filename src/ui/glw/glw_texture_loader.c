@@ -26,8 +26,10 @@
 #include "glw.h"
 #include "glw_texture.h"
 
+#include "arch/arch.h"
 #include "backend/backend.h"
 #include "fileaccess/fileaccess.h"
+#include "misc/murmur3.h"
 
 #if 0
 /**
@@ -73,9 +75,9 @@ glt_cancel(glw_loadable_texture_t *glt)
  *
  */
 static void
-glw_tex_purge_stash(glw_root_t *gr, int stash)
+glw_tex_purge_stash(glw_root_t *gr, int stash, int limit)
 {
-  while(gr->gr_tex_stash[stash].size > gr->gr_tex_stash[stash].limit) {
+  while(gr->gr_tex_stash[stash].size > limit) {
     glw_loadable_texture_t *glt = TAILQ_FIRST(&gr->gr_tex_stash[stash].q);
     if(glt == NULL)
       break;
@@ -120,7 +122,7 @@ glw_tex_stash(glw_root_t *gr, glw_loadable_texture_t *glt, int unreferenced)
   TAILQ_INSERT_TAIL(glt->glt_q, glt, glt_work_link);
   gr->gr_tex_stash[stash].size += glt->glt_size;
 
-  glw_tex_purge_stash(gr, stash);
+  glw_tex_purge_stash(gr, stash, gr->gr_tex_stash[stash].limit);
   return 0;
 }
 
@@ -178,6 +180,272 @@ glw_tex_autoflush(glw_root_t *gr)
 }
 
 
+/**
+ * Decoded image kept around after its texture has been purged
+ */
+typedef struct glw_tex_cache_entry {
+  LIST_ENTRY(glw_tex_cache_entry) gtce_hash_link;
+  TAILQ_ENTRY(glw_tex_cache_entry) gtce_lru_link;
+
+  rstr_t *gtce_url;
+  pixmap_t *gtce_pixmap;
+  struct backend *gtce_backend;
+
+  int gtce_flags;
+  int gtce_source_flags;
+  float gtce_req_aspect;
+  int16_t gtce_req_xs;
+  int16_t gtce_req_ys;
+  int16_t gtce_radius;
+  int16_t gtce_shadow;
+  int gtce_max_width;
+  int gtce_max_height;
+
+  int gtce_size;
+  uint8_t gtce_origin_type;
+  uint8_t gtce_orientation;
+  uint8_t gtce_expired;    // Decoded from expired data, not yet refreshed
+  int64_t gtce_validated;  // gr_frame_start when last loaded or refreshed
+} glw_tex_cache_entry_t;
+
+/**
+ * Hits on entries older than this go thru the loader again so
+ * the backend gets a chance to check if the source has expired
+ */
+#define GLW_TEX_CACHE_REVALIDATE (300 * 1000000LL)
+
+
+/**
+ *
+ */
+static unsigned int
+glw_tex_cache_hash(const glw_loadable_texture_t *glt)
+{
+  const char *url = rstr_get(glt->glt_url);
+  return MurHash3_32(url, strlen(url), glt->glt_req_xs ^
+                     (glt->glt_req_ys << 16)) &
+    (GLW_TEX_CACHE_HASH_SIZE - 1);
+}
+
+
+/**
+ *
+ */
+static int
+glw_tex_cache_match(const glw_root_t *gr, const glw_tex_cache_entry_t *gtce,
+                    const glw_loadable_texture_t *glt)
+{
+  return gtce->gtce_flags == glt->glt_flags &&
+    gtce->gtce_req_xs == glt->glt_req_xs &&
+    gtce->gtce_req_ys == glt->glt_req_ys &&
+    gtce->gtce_radius == glt->glt_radius &&
+    gtce->gtce_shadow == glt->glt_shadow &&
+    gtce->gtce_req_aspect == glt->glt_req_aspect &&
+    gtce->gtce_source_flags == glt->glt_source_flags &&
+    gtce->gtce_backend == glt->glt_backend &&
+    gtce->gtce_max_width == gr->gr_width &&
+    gtce->gtce_max_height == gr->gr_height &&
+    !strcmp(rstr_get(gtce->gtce_url), rstr_get(glt->glt_url));
+}
+
+
+/**
+ *
+ */
+static glw_tex_cache_entry_t *
+glw_tex_cache_find(glw_root_t *gr, const glw_loadable_texture_t *glt)
+{
+  glw_tex_cache_entry_t *gtce;
+  const unsigned int h = glw_tex_cache_hash(glt);
+
+  LIST_FOREACH(gtce, &gr->gr_tex_cache.hash[h], gtce_hash_link)
+    if(glw_tex_cache_match(gr, gtce, glt))
+      return gtce;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+glw_tex_cache_entry_destroy(glw_root_t *gr, glw_tex_cache_entry_t *gtce)
+{
+  LIST_REMOVE(gtce, gtce_hash_link);
+  TAILQ_REMOVE(&gr->gr_tex_cache.lru, gtce, gtce_lru_link);
+  gr->gr_tex_cache.size -= gtce->gtce_size;
+  rstr_release(gtce->gtce_url);
+  pixmap_release(gtce->gtce_pixmap);
+  if(gtce->gtce_backend)
+    backend_release(gtce->gtce_backend);
+  free(gtce);
+}
+
+
+/**
+ * Drop least recently used images until we're below the given size
+ */
+static void
+glw_tex_cache_trim(glw_root_t *gr, int limit)
+{
+  glw_tex_cache_entry_t *gtce;
+
+  while(gr->gr_tex_cache.size > limit &&
+        (gtce = TAILQ_FIRST(&gr->gr_tex_cache.lru)) != NULL)
+    glw_tex_cache_entry_destroy(gr, gtce);
+}
+
+
+/**
+ *
+ */
+static void
+glw_tex_cache_insert(glw_root_t *gr, const glw_loadable_texture_t *glt,
+                     pixmap_t *pm, int expired)
+{
+  glw_tex_cache_entry_t *gtce;
+  const int size = pm->pm_linesize * pm->pm_height;
+
+  if(glt->glt_url == NULL || size > gr->gr_tex_cache.limit / 4)
+    return;
+
+  if(mystrbegins(rstr_get(glt->glt_url), "pixmap:"))
+    return; // Already in memory
+
+  if((gtce = glw_tex_cache_find(gr, glt)) != NULL)
+    glw_tex_cache_entry_destroy(gr, gtce);
+
+  gtce = calloc(1, sizeof(glw_tex_cache_entry_t));
+  gtce->gtce_url          = rstr_dup(glt->glt_url);
+  gtce->gtce_pixmap       = pixmap_dup(pm);
+  gtce->gtce_backend      = backend_retain(glt->glt_backend);
+  gtce->gtce_flags        = glt->glt_flags;
+  gtce->gtce_source_flags = glt->glt_source_flags;
+  gtce->gtce_req_aspect   = glt->glt_req_aspect;
+  gtce->gtce_req_xs       = glt->glt_req_xs;
+  gtce->gtce_req_ys       = glt->glt_req_ys;
+  gtce->gtce_radius       = glt->glt_radius;
+  gtce->gtce_shadow       = glt->glt_shadow;
+  gtce->gtce_max_width    = gr->gr_width;
+  gtce->gtce_max_height   = gr->gr_height;
+  gtce->gtce_size         = size;
+  gtce->gtce_origin_type  = glt->glt_origin_type;
+  gtce->gtce_orientation  = glt->glt_orientation;
+  gtce->gtce_expired      = expired;
+  gtce->gtce_validated    = gr->gr_frame_start;
+
+  LIST_INSERT_HEAD(&gr->gr_tex_cache.hash[glw_tex_cache_hash(glt)],
+                   gtce, gtce_hash_link);
+  TAILQ_INSERT_TAIL(&gr->gr_tex_cache.lru, gtce, gtce_lru_link);
+  gr->gr_tex_cache.size += size;
+
+  glw_tex_cache_trim(gr, gr->gr_tex_cache.limit);
+}
+
+
+/**
+ * Hand a decoded pixmap to the render backend
+ */
+static void
+glt_load_pixmap(glw_root_t *gr, glw_loadable_texture_t *glt, pixmap_t *pm)
+{
+  glt->glt_aspect        = pm->pm_aspect;
+  glt->glt_margin        = pm->pm_margin;
+  glt->glt_xs            = pm->pm_width;
+  glt->glt_ys            = pm->pm_height;
+  glt->glt_intensity     = pm->pm_intensity;
+  glt->glt_primary_color[0] = pm->pm_primary_color[0];
+  glt->glt_primary_color[1] = pm->pm_primary_color[1];
+  glt->glt_primary_color[2] = pm->pm_primary_color[2];
+  glt->glt_opaque = !!(pm->pm_flags & PIXMAP_OPAQUE);
+
+  glt->glt_size          = glw_tex_backend_load(gr, glt, pm);
+  glw_need_refresh(gr, 0);
+}
+
+
+/**
+ * A refresh found that the source of a cached image is unchanged
+ */
+static void
+glw_tex_cache_validated(glw_root_t *gr, const glw_loadable_texture_t *glt)
+{
+  glw_tex_cache_entry_t *gtce = glw_tex_cache_find(gr, glt);
+
+  if(gtce == NULL)
+    return;
+  gtce->gtce_expired = 0;
+  gtce->gtce_validated = gr->gr_frame_start;
+}
+
+
+static void glt_enqueue(glw_root_t *gr, glw_loadable_texture_t *glt, int q);
+
+/**
+ * Try to load texture from the decoded image cache.
+ * Return 1 if the texture is valid
+ *
+ * The cached copy is shown right away but, just as when loading
+ * from the blobcache, it's queued for a refresh if the data it was
+ * decoded from had expired or it has not been checked for a while
+ */
+static int
+glw_tex_cache_load(glw_root_t *gr, glw_loadable_texture_t *glt)
+{
+  glw_tex_cache_entry_t *gtce = glw_tex_cache_find(gr, glt);
+
+  if(gtce == NULL) {
+    gr->gr_tex_cache.misses++;
+    return 0;
+  }
+
+  gr->gr_tex_cache.hits++;
+
+  TAILQ_REMOVE(&gr->gr_tex_cache.lru, gtce, gtce_lru_link);
+  TAILQ_INSERT_TAIL(&gr->gr_tex_cache.lru, gtce, gtce_lru_link);
+
+  glt->glt_origin_type = gtce->gtce_origin_type;
+  glt->glt_orientation = gtce->gtce_orientation;
+  glt_load_pixmap(gr, glt, gtce->gtce_pixmap);
+  glt_set_state(glt, GLT_STATE_VALID);
+
+  if(glt->glt_source_flags & GLW_SOURCE_FLAG_ALWAYS_LOCAL)
+    return 1;
+
+  if(gtce->gtce_expired) {
+    glt_enqueue(gr, glt, LQ_REFRESH);
+  } else if(gr->gr_frame_start >
+            gtce->gtce_validated + GLW_TEX_CACHE_REVALIDATE) {
+    gtce->gtce_validated = gr->gr_frame_start;
+    glt_enqueue(gr, glt, LQ_TENTATIVE);
+  }
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+glw_tex_cache_stats(glw_root_t *gr)
+{
+  if(gr->gr_frame_start < gr->gr_tex_cache.stats_published + 1000000)
+    return;
+
+  gr->gr_tex_cache.stats_published = gr->gr_frame_start;
+
+  const int hits   = gr->gr_tex_cache.hits;
+  const int misses = gr->gr_tex_cache.misses;
+
+  prop_set(gr->gr_tex_cache.stats, "hits",   PROP_SET_INT, hits);
+  prop_set(gr->gr_tex_cache.stats, "misses", PROP_SET_INT, misses);
+  prop_set(gr->gr_tex_cache.stats, "hitratio", PROP_SET_FLOAT,
+           hits + misses ? (float)hits / (hits + misses) : 0.0f);
+  prop_set(gr->gr_tex_cache.stats, "size", PROP_SET_INT,
+           gr->gr_tex_cache.size / 1024);
+}
+
+
 /**
  *
  */
@@ -382,15 +650,19 @@ loader_thread(void *aux)
       } else {
 
 	if(glt->glt_state == GLT_STATE_LOADING) {
+	  const int expired =
+	    glt->glt_q == &gr->gr_tex_load_queue[LQ_TENTATIVE] &&
+	    cache_control == 1;
 
-	  if(glt->glt_q == &gr->gr_tex_load_queue[LQ_TENTATIVE] &&
-	     cache_control == 1) {
+	  if(expired) {
 	    glt_enqueue(gr, glt, LQ_REFRESH);
 	  } else {
             glt_set_state(glt, GLT_STATE_VALID);
 	  }
 
-	  if(img != NOT_MODIFIED) {
+	  if(img == NOT_MODIFIED) {
+            glw_tex_cache_validated(gr, glt);
+          } else {
 
             // Actually upload the texture to the render backend
 
@@ -400,27 +672,16 @@ loader_thread(void *aux)
 
             pixmap_t *pm = ic->pm;
 
-	    glt->glt_aspect        = pm->pm_aspect;
-	    glt->glt_margin        = pm->pm_margin;
-            glt->glt_xs            = pm->pm_width;
-            glt->glt_ys            = pm->pm_height;
-
             glt->glt_origin_type   = img->im_origin_coded_type;
 	    glt->glt_orientation   = img->im_orientation;
-            glt->glt_intensity     = pm->pm_intensity;
-            glt->glt_primary_color[0] = pm->pm_primary_color[0];
-            glt->glt_primary_color[1] = pm->pm_primary_color[1];
-            glt->glt_primary_color[2] = pm->pm_primary_color[2];
-            glt->glt_opaque = !!(pm->pm_flags & PIXMAP_OPAQUE);
 
             if(gconf.enable_image_debug)
               TRACE(TRACE_DEBUG, "GLW",
                     "Loaded %s (%d x %d)",
                     rstr_get(url), pm->pm_width, pm->pm_height);
 
-
-	    glt->glt_size          = glw_tex_backend_load(gr, glt, pm);
-	    glw_need_refresh(gr, 0);
+            glt_load_pixmap(gr, glt, pm);
+            glw_tex_cache_insert(gr, glt, pm, expired);
 	  }
 	}
 
@@ -449,6 +710,29 @@ spawn_loader(glw_root_t *gr, int only_fast, int idx)
 			     THREAD_PRIO_UI_WORKER_LOW);
 }
 
+/**
+ * Drop all decoded images and stashed textures on next purge.
+ * Textures in use are left alone. glw lock must be held
+ */
+void
+glw_tex_memory_pressure(glw_root_t *gr)
+{
+  gr->gr_tex_cache.pressure = 1;
+  glw_need_refresh(gr, 0);
+}
+
+
+/**
+ *
+ */
+static void
+glw_tex_lowmem(void *opaque, int v)
+{
+  if(v)
+    glw_tex_memory_pressure(opaque);
+}
+
+
 /**
  *
  */
@@ -466,6 +750,21 @@ glw_tex_init(glw_root_t *gr)
   gr->gr_tex_stash[0].limit = 16 * 1024 * 1024;
   gr->gr_tex_stash[1].limit = 16 * 1024 * 1024;
 
+  for(i = 0; i < GLW_TEX_CACHE_HASH_SIZE; i++)
+    LIST_INIT(&gr->gr_tex_cache.hash[i]);
+  TAILQ_INIT(&gr->gr_tex_cache.lru);
+  gr->gr_tex_cache.limit = 24 * 1024 * 1024;
+  gr->gr_tex_cache.stats = prop_create(gr->gr_prop_ui, "imagecache");
+  gr->gr_tex_cache.lowmem_sub =
+    prop_subscribe(0,
+                   PROP_TAG_CALLBACK_INT, glw_tex_lowmem, gr,
+                   PROP_TAG_NAME("global", "system", "mem", "lowMemory"),
+                   PROP_TAG_COURIER, gr->gr_courier,
+                   NULL);
+
+  gr->gr_prefetch.budget = 48 * 1024 * 1024;
+  gr->gr_prefetch.stats = prop_create(gr->gr_prop_ui, "decodeahead");
+
   for(i = 0; i < LQ_num; i++)
     TAILQ_INIT(&gr->gr_tex_load_queue[i]);
 
@@ -481,6 +780,8 @@ void
 glw_tex_fini(glw_root_t *gr)
 {
   int i;
+  prop_unsubscribe(gr->gr_tex_cache.lowmem_sub);
+
   glw_lock(gr);
   gr->gr_tex_threads_running = 0;
   hts_cond_broadcast(&gr->gr_tex_load_cond);
@@ -488,6 +789,8 @@ glw_tex_fini(glw_root_t *gr)
 
   for(i = 0; i < GLW_TEXTURE_THREADS; i++)
     hts_thread_join(&gr->gr_tex_threads[i]);
+
+  glw_tex_cache_trim(gr, 0);
 }
 
 /**
@@ -558,6 +861,14 @@ glw_tex_purge(glw_root_t *gr)
     glw_tex_backend_free_render_resources(gr, glt);
     glt_destroy(glt);
   }
+
+  if(gr->gr_tex_cache.pressure) {
+    gr->gr_tex_cache.pressure = 0;
+    glw_tex_cache_trim(gr, 0);
+    glw_tex_purge_stash(gr, 0, 0);
+    glw_tex_purge_stash(gr, 1, 0);
+  }
+  glw_tex_cache_stats(gr);
 }
 
 /**
@@ -690,6 +1001,8 @@ glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
 
   switch(glt->glt_state) {
   case GLT_STATE_INACTIVE:
+    if(glt->glt_url != NULL && glw_tex_cache_load(gr, glt))
+      break;
     gl_tex_req_load(gr, glt);
     break;
 
@@ -713,3 +1026,139 @@ glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
   }
   LIST_INSERT_HEAD(&gr->gr_tex_active_list, glt, glt_flush_link);
 }
+
+
+/**
+ * How far ahead (and back) a container may load full screen images
+ * without exceeding the decode-ahead budget. Never less than one as
+ * the immediate neighbours have always been kept loaded
+ */
+int
+glw_prefetch_limit(glw_root_t *gr, int count)
+{
+  const int size = gr->gr_width * gr->gr_height * 4;
+
+  if(size > 0)
+    count = MIN(count, gr->gr_prefetch.budget / size / 2);
+  return MAX(count, 1);
+}
+
+
+/**
+ * Lay out the items at distance 'first' to 'count' from 'c', ahead
+ * before behind, wrapping around the ends. Any texture loads they
+ * start are queued to the loader threads. Once an item drops out of
+ * the window it is no longer laid out and the autoflush will cancel
+ * or stash its textures
+ */
+void
+glw_prefetch_layout(glw_t *c, int first, int count, const glw_rctx_t *rc,
+                    glw_t *skip)
+{
+  glw_t *p = c->glw_parent;
+  glw_t *n = c;
+  glw_t *w = c;
+  int i;
+
+  for(i = 1; i <= count; i++) {
+    n = glw_next_widget(n) ?: glw_first_widget(p);
+    if(n == c)
+      return;
+    if(i >= first && n != skip)
+      glw_layout0(n, rc);
+  }
+
+  for(i = 1; i <= count; i++) {
+    w = glw_prev_widget(w) ?: glw_last_widget(p);
+    if(w == c || w == n)
+      return;
+    if(i >= first && w != skip)
+      glw_layout0(w, rc);
+  }
+}
+
+
+/**
+ * Return 1 if any visible image in the widget tree is still loading
+ */
+int
+glw_is_loading(glw_t *w)
+{
+  glw_t *c;
+
+  if(w->glw_class->gc_status != NULL &&
+     w->glw_class->gc_status(w) == GLW_STATUS_LOADING)
+    return 1;
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link)
+    if(!(c->glw_flags & GLW_HIDDEN) && glw_is_loading(c))
+      return 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+glw_prefetch_stats(glw_root_t *gr, int64_t stall)
+{
+  gr->gr_prefetch.transitions++;
+
+  if(stall) {
+    gr->gr_prefetch.stalls++;
+    gr->gr_prefetch.stall_total += stall;
+    gr->gr_prefetch.stall_max = MAX(gr->gr_prefetch.stall_max, stall);
+
+    if(gconf.enable_image_debug)
+      TRACE(TRACE_DEBUG, "GLW", "Transition stalled for %d ms",
+            (int)(stall / 1000));
+  }
+
+  prop_t *p = gr->gr_prefetch.stats;
+  const int stalls = gr->gr_prefetch.stalls;
+
+  prop_set(p, "transitions", PROP_SET_INT, gr->gr_prefetch.transitions);
+  prop_set(p, "stalls",      PROP_SET_INT, stalls);
+  prop_set(p, "avgstall", PROP_SET_INT,
+           stalls ? (int)(gr->gr_prefetch.stall_total / stalls / 1000) : 0);
+  prop_set(p, "maxstall", PROP_SET_INT,
+           (int)(gr->gr_prefetch.stall_max / 1000));
+}
+
+
+/**
+ * Start waiting for 'w' to become ready for display
+ */
+void
+glw_stall_meter_start(glw_stall_meter_t *gsm, glw_t *w)
+{
+  gsm->gsm_widget = w;
+  gsm->gsm_start = arch_get_ts();
+  gsm->gsm_stalled = 0;
+}
+
+
+/**
+ * Call after the widget has been laid out. Returns 1 if it's ready
+ * (or nothing is being waited for). The time spent waiting is
+ * accounted as a transition stall
+ */
+int
+glw_stall_meter_check(glw_root_t *gr, glw_stall_meter_t *gsm)
+{
+  glw_t *w = gsm->gsm_widget;
+
+  if(w == NULL)
+    return 1;
+
+  if(glw_is_loading(w)) {
+    gsm->gsm_stalled = 1;
+    return 0;
+  }
+
+  glw_prefetch_stats(gr, gsm->gsm_stalled ?
+                     MAX(arch_get_ts() - gsm->gsm_start, 1) : 0);
+  gsm->gsm_widget = NULL;
+  return 1;
+}
@@ -227,6 +227,49 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 }
 
 
+/**
+ * Rows are copied to a tight buffer unless full width as GLES has no
+ * GL_UNPACK_ROW_LENGTH
+ */
+void
+glw_tex_upload_rect(glw_root_t *gr, glw_backend_texture_t *tex,
+                    const pixmap_t *pm, int x, int y, int w, int h)
+{
+  const int bpp = bytes_per_pixel(pm->pm_type);
+  int format;
+
+  switch(pm->pm_type) {
+  case PIXMAP_IA:
+    format = GL_LUMINANCE_ALPHA;
+    break;
+
+  default:
+    glw_tex_upload(gr, tex, pm, 0);
+    return;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, tex->textures[0]);
+
+  const uint8_t *src = pm->pm_data + y * pm->pm_linesize + x * bpp;
+
+  if(w == pm->pm_width && pm->pm_linesize == w * bpp) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, format,
+                    GL_UNSIGNED_BYTE, src);
+    return;
+  }
+
+  uint8_t *tmp = malloc(w * h * bpp);
+  for(int i = 0; i < h; i++)
+    memcpy(tmp + i * w * bpp, src + i * pm->pm_linesize, w * bpp);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, format,
+                  GL_UNSIGNED_BYTE, tmp);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, PIXMAP_ROW_ALIGN);
+  free(tmp);
+}
+
+
 /**
  *
  */
@@ -310,6 +310,32 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 }
 
 
+/**
+ * Texture memory is mapped, just copy the rows that changed
+ */
+void
+glw_tex_upload_rect(glw_root_t *gr, glw_backend_texture_t *tex,
+                    const pixmap_t *pm, int x, int y, int w, int h)
+{
+  if(pm->pm_type != PIXMAP_IA ||
+     tex->size != pm->pm_linesize * pm->pm_height) {
+    glw_tex_upload(gr, tex, pm, 0);
+    return;
+  }
+
+  const int bpp = bytes_per_pixel(pm->pm_type);
+  const int offset = y * pm->pm_linesize + x * bpp;
+  uint8_t *dst = (uint8_t *)rsx_to_ppu(tex->tex.offset) + offset;
+  const uint8_t *src = pm->pm_data + offset;
+
+  for(int i = 0; i < h; i++) {
+    memcpy(dst, src, w * bpp);
+    dst += pm->pm_linesize;
+    src += pm->pm_linesize;
+  }
+}
+
+
 /**
  *
  */
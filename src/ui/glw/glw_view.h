@@ -255,7 +255,7 @@ typedef struct glw_clone {
   prop_t *c_prop;
   prop_t *c_clone_root;
 
-  uint16_t c_pos;
+  int c_pos;
   char c_evaluated;
 
 } glw_clone_t;
@@ -38,6 +38,7 @@
 #include "glw_text_bitmap.h"
 #include "prop/prop_window.h"
 #include "glw_texture.h"
+#include "glw_virtual.h"
 
 LIST_HEAD(clone_list, glw_clone);
 TAILQ_HEAD(vectorizer_element_queue, vectorizer_element);
@@ -121,6 +122,18 @@ typedef struct sub_cloner {
 
   struct clone_list sc_clones;
 
+  /*
+   * Virtualized parent, see cloner_set_window()
+   */
+  glw_virtual_t *sc_virtual;
+
+  glw_clone_t **sc_vec;    // All clones in item order
+  int sc_vec_size;
+
+  glw_t **sc_pool;         // Unbound widgets
+  int sc_pool_len;
+  int sc_pool_size;
+
 } sub_cloner_t;
 
 
@@ -162,6 +175,8 @@ static int subscribe_prop(glw_view_eval_context_t *ec, struct token *self,
 
 static void clone_free(glw_root_t *gr, glw_clone_t *c);
 
+static void cloner_virtual_cleanup(sub_cloner_t *sc);
+
 
 /**
  *
@@ -176,6 +191,9 @@ cloner_cleanup(glw_root_t *gr, sub_cloner_t *sc)
     clone_free(gr, c);
   }
 
+  if(sc->sc_virtual != NULL)
+    cloner_virtual_cleanup(sc);
+
   if(sc->sc_cloner_body != NULL)
     glw_view_free_chain(gr, sc->sc_cloner_body);
 }
@@ -1389,6 +1407,14 @@ cloner_resequence(sub_cloner_t *sc)
   glw_t *w;
   glw_signal_handler_t *gsh;
   int pos = 0;
+
+  if(sc->sc_virtual != NULL) {
+    for(pos = 0; pos < sc->sc_entries; pos++)
+      sc->sc_vec[pos]->c_pos = pos;
+    sc->sc_positions_valid = 1;
+    return;
+  }
+
   TAILQ_FOREACH(w, &sc->sc_sub.gps_widget->glw_childs, glw_parent_link) {
     LIST_FOREACH(gsh, &w->glw_signal_handlers, gsh_link) {
       if(gsh->gsh_func == clone_sig_handler) {
@@ -1406,6 +1432,383 @@ cloner_resequence(sub_cloner_t *sc)
 
 
 
+/**
+ * Virtualized cloning
+ *
+ * If the parent only lays out a window of its items (see glw_virtual.h)
+ * all clones are kept in sc_vec but only those inside the window have
+ * a widget. Widgets leaving the window are hidden and kept in sc_pool.
+ * They are rebound to other items by relinking the SELF and CLONE
+ * props of their scope, so the cloner body is evaluated once per
+ * widget and not once per item.
+ */
+static int
+clone_slot_sig_handler(glw_t *w, void *opaque, glw_signal_t signal,
+                       void *extra)
+{
+  sub_cloner_t *sc = opaque;
+  glw_clone_t *c = w->glw_clone;
+  glw_scope_t *scope;
+  int i;
+
+  switch(signal) {
+  case GLW_SIGNAL_MOVE:
+    if(c != NULL)
+      clone_req_move(sc, w, extra);
+    return 1;
+
+  case GLW_SIGNAL_DESTROY:
+    scope = w->glw_scope;
+    prop_destroy(scope->gs_roots[GLW_ROOT_SELF].p);
+    prop_destroy(scope->gs_roots[GLW_ROOT_CLONE].p);
+
+    if(c != NULL) {
+      c->c_w = NULL;
+      w->glw_clone = NULL;
+      sc->sc_virtual->gv_changed = 1;
+      break;
+    }
+
+    for(i = 0; i < sc->sc_pool_len; i++) {
+      if(sc->sc_pool[i] == w) {
+        sc->sc_pool[i] = sc->sc_pool[--sc->sc_pool_len];
+        break;
+      }
+    }
+    break;
+
+  case GLW_SIGNAL_WRAP_CHECK:
+    *(int *)extra = sc->sc_have_more != 1;
+    return 0;
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+clone_slot_destroy(sub_cloner_t *sc, glw_t *w)
+{
+  glw_scope_t *scope = w->glw_scope;
+
+  glw_signal_handler_unregister(w, clone_slot_sig_handler, sc);
+  prop_destroy(scope->gs_roots[GLW_ROOT_SELF].p);
+  prop_destroy(scope->gs_roots[GLW_ROOT_CLONE].p);
+  glw_retire_child(w);
+}
+
+
+/**
+ *
+ */
+static void
+clone_unbind(sub_cloner_t *sc, glw_clone_t *c)
+{
+  glw_t *w = c->c_w;
+
+  c->c_w = NULL;
+  w->glw_clone = NULL;
+
+  glw_hide(w);
+  glw_move(w, sc->sc_anchor);
+
+  if(sc->sc_pool_len == sc->sc_pool_size) {
+    sc->sc_pool_size = MAX(16, sc->sc_pool_size * 2);
+    sc->sc_pool = realloc(sc->sc_pool, sc->sc_pool_size * sizeof(glw_t *));
+  }
+  sc->sc_pool[sc->sc_pool_len++] = w;
+}
+
+
+/**
+ * Give the clone a widget, either a recycled one or a new one
+ */
+static void
+clone_bind(sub_cloner_t *sc, glw_clone_t *c, glw_t *before)
+{
+  glw_t *parent = sc->sc_sub.gps_widget;
+  glw_root_t *gr = parent->glw_root;
+  glw_scope_t *scope;
+  glw_t *w;
+
+  if(c->c_clone_root == NULL)
+    c->c_clone_root = prop_create_root(NULL);
+
+  if(sc->sc_pool_len > 0) {
+    w = sc->sc_pool[--sc->sc_pool_len];
+    scope = w->glw_scope;
+
+    prop_link(c->c_prop,       scope->gs_roots[GLW_ROOT_SELF].p);
+    prop_link(c->c_clone_root, scope->gs_roots[GLW_ROOT_CLONE].p);
+
+    prop_ref_dec(w->glw_originating_prop);
+    w->glw_originating_prop = prop_ref_inc(c->c_prop);
+
+    c->c_w = w;
+    w->glw_clone = c;
+
+    glw_move(w, before);
+    glw_unhide(w);
+    return;
+  }
+
+  scope = glw_scope_dup(sc->sc_sub.gps_scope,
+                        (1 << GLW_ROOT_SELF) |
+                        (1 << GLW_ROOT_PARENT) |
+                        (1 << GLW_ROOT_CLONE));
+
+  scope->gs_roots[GLW_ROOT_SELF].p   = prop_ref_inc(prop_create_root(NULL));
+  scope->gs_roots[GLW_ROOT_PARENT].p = prop_ref_inc(sc->sc_originating_prop);
+  scope->gs_roots[GLW_ROOT_CLONE].p  = prop_ref_inc(prop_create_root(NULL));
+
+  prop_link(c->c_prop,       scope->gs_roots[GLW_ROOT_SELF].p);
+  prop_link(c->c_clone_root, scope->gs_roots[GLW_ROOT_CLONE].p);
+
+  w = glw_create(gr, sc->sc_cloner_class, parent, before, c->c_prop,
+                 scope,
+                 sc->sc_cloner_body->file,
+                 sc->sc_cloner_body->line);
+
+  c->c_w = w;
+  w->glw_clone = c;
+
+  glw_signal_handler_register(w, clone_slot_sig_handler, sc);
+
+  clone_eval(c, scope);
+
+  glw_scope_release(scope);
+}
+
+
+/**
+ * Called by the parent during layout with the items it wants widgets for
+ */
+static void
+cloner_set_window(void *opaque, int first, int last)
+{
+  sub_cloner_t *sc = opaque;
+  glw_t *parent = sc->sc_sub.gps_widget;
+  glw_t *w, *next, *before;
+  glw_clone_t *c;
+  int i;
+
+  if(!sc->sc_positions_valid)
+    cloner_resequence(sc);
+
+  /*
+   * The focused item keeps its widget even when scrolled out of the
+   * window. Hiding it would make glw_hide() crawl the focus somewhere
+   * else and the parent would remember a widget that now shows
+   * another item
+   */
+  before = sc->sc_anchor;
+
+  for(w = TAILQ_FIRST(&parent->glw_childs); w != NULL; w = next) {
+    next = TAILQ_NEXT(w, glw_parent_link);
+    c = w->glw_clone;
+    if(c == NULL || c->c_sc != sc || (c->c_pos >= first && c->c_pos < last))
+      continue;
+
+    if(parent->glw_focused != w)
+      clone_unbind(sc, c);
+    else if(c->c_pos >= last)
+      before = w;
+  }
+
+  // Back to front so there is always a widget to insert before
+
+  for(i = last - 1; i >= first; i--) {
+    c = sc->sc_vec[i];
+    if(c->c_w == NULL)
+      clone_bind(sc, c, before);
+    before = c->c_w;
+  }
+
+  if(sc->sc_pending_select != NULL &&
+     (c = prop_tag_get(sc->sc_pending_select, sc)) != NULL &&
+     c->c_w != NULL) {
+    sc->sc_pending_select = NULL;
+    if(parent->glw_class->gc_select_child != NULL)
+      parent->glw_class->gc_select_child(parent, c->c_w, NULL);
+  }
+
+  sc->sc_lowest_active = first;
+  sc->sc_highest_active = last - 1;
+  cloner_pagination_check(sc);
+}
+
+
+/**
+ *
+ */
+static int
+cloner_index_of(void *opaque, glw_t *w)
+{
+  sub_cloner_t *sc = opaque;
+  glw_clone_t *c = w->glw_clone;
+
+  if(c == NULL || c->c_sc != sc)
+    return -1;
+
+  if(!sc->sc_positions_valid)
+    cloner_resequence(sc);
+  return c->c_pos;
+}
+
+
+/**
+ *
+ */
+static void
+cloner_virtual_cleanup(sub_cloner_t *sc)
+{
+  while(sc->sc_pool_len > 0)
+    clone_slot_destroy(sc, sc->sc_pool[--sc->sc_pool_len]);
+
+  free(sc->sc_pool);
+  sc->sc_pool = NULL;
+  sc->sc_pool_size = 0;
+
+  free(sc->sc_vec);
+  sc->sc_vec = NULL;
+  sc->sc_vec_size = 0;
+  sc->sc_entries = 0;
+
+  glw_virtual_detach(sc->sc_virtual, sc);
+  sc->sc_virtual = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+cloner_add_child_virtual(sub_cloner_t *sc, prop_t *p, prop_t *before,
+                         int flags)
+{
+  glw_root_t *gr = sc->sc_sub.gps_widget->glw_root;
+  glw_clone_t *c = pool_get(gr->gr_clone_pool);
+  int pos = sc->sc_entries;
+
+  if(before != NULL) {
+    glw_clone_t *bb = prop_tag_get(before, sc);
+    assert(bb != NULL);
+    if(!sc->sc_positions_valid)
+      cloner_resequence(sc);
+    pos = bb->c_pos;
+    sc->sc_positions_valid = 0;
+  }
+
+  LIST_INSERT_HEAD(&sc->sc_clones, c, c_link);
+  c->c_sc = sc;
+  c->c_w = NULL;
+  c->c_prop = prop_ref_inc(p);
+  c->c_clone_root = NULL;
+  c->c_pos = pos;
+
+  if(sc->sc_entries == sc->sc_vec_size) {
+    sc->sc_vec_size = MAX(64, sc->sc_vec_size * 2);
+    sc->sc_vec = realloc(sc->sc_vec, sc->sc_vec_size * sizeof(glw_clone_t *));
+  }
+  memmove(sc->sc_vec + pos + 1, sc->sc_vec + pos,
+          (sc->sc_entries - pos) * sizeof(glw_clone_t *));
+  sc->sc_vec[pos] = c;
+  sc->sc_entries++;
+
+  prop_tag_set(p, sc, c);
+
+  glw_virtual_insert(sc->sc_virtual, pos);
+
+  if(flags & PROP_ADD_SELECTED) {
+    sc->sc_pending_select = p;
+    sc->sc_virtual->gv_scroll_to = pos;
+  }
+  glw_need_refresh(gr, 0);
+}
+
+
+/**
+ *
+ */
+static void
+cloner_del_child_virtual(glw_root_t *gr, sub_cloner_t *sc, glw_clone_t *c)
+{
+  if(!sc->sc_positions_valid)
+    cloner_resequence(sc);
+
+  const int pos = c->c_pos;
+
+  sc->sc_entries--;
+  memmove(sc->sc_vec + pos, sc->sc_vec + pos + 1,
+          (sc->sc_entries - pos) * sizeof(glw_clone_t *));
+  if(pos != sc->sc_entries)
+    sc->sc_positions_valid = 0;
+
+  glw_virtual_remove(sc->sc_virtual, pos);
+
+  if(sc->sc_pending_select == c->c_prop)
+    sc->sc_pending_select = NULL;
+
+  if(c->c_w != NULL)
+    clone_unbind(sc, c);
+
+  clone_free(gr, c);
+  glw_need_refresh(gr, 0);
+}
+
+
+/**
+ *
+ */
+static void
+cloner_move_child_virtual(sub_cloner_t *sc, glw_clone_t *c, glw_clone_t *b)
+{
+  glw_virtual_t *gv = sc->sc_virtual;
+  int i;
+
+  if(!sc->sc_positions_valid)
+    cloner_resequence(sc);
+
+  const int from = c->c_pos;
+  int to = b != NULL ? b->c_pos : sc->sc_entries;
+  if(to > from)
+    to--;
+
+  if(from == to)
+    return;
+
+  if(from < to)
+    memmove(sc->sc_vec + from, sc->sc_vec + from + 1,
+            (to - from) * sizeof(glw_clone_t *));
+  else
+    memmove(sc->sc_vec + to + 1, sc->sc_vec + to,
+            (from - to) * sizeof(glw_clone_t *));
+  sc->sc_vec[to] = c;
+  sc->sc_positions_valid = 0;
+
+  glw_virtual_move(gv, from, to);
+
+  if(c->c_w == NULL)
+    return;
+
+  // Keep widgets in item order, anything bound is within the window
+
+  glw_t *before = sc->sc_anchor;
+  for(i = to + 1; i < sc->sc_entries && i <= gv->gv_last; i++) {
+    if(sc->sc_vec[i]->c_w != NULL) {
+      before = sc->sc_vec[i]->c_w;
+      break;
+    }
+  }
+  glw_move(c->c_w, before);
+}
+
+
 /**
  *
  */
@@ -1415,6 +1818,12 @@ cloner_add_child0(sub_cloner_t *sc, prop_t *p, prop_t *before,
 {
   glw_t *b;
   glw_root_t *gr = parent->glw_root;
+
+  if(sc->sc_virtual != NULL) {
+    cloner_add_child_virtual(sc, p, before, flags);
+    return;
+  }
+
   glw_clone_t *c = pool_get(gr->gr_clone_pool);
 
   LIST_INSERT_HEAD(&sc->sc_clones, c, c_link);
@@ -1514,6 +1923,11 @@ cloner_move_child0(sub_cloner_t *sc, prop_t *p, prop_t *before,
   glw_clone_t *c =          prop_tag_get(p, sc);
   glw_clone_t *b = before ? prop_tag_get(before, sc) : NULL;
 
+  if(sc->sc_virtual != NULL) {
+    cloner_move_child_virtual(sc, c, b);
+    return;
+  }
+
   sc->sc_positions_valid = 0;
   glw_move(c->c_w, b ? b->c_w : sc->sc_anchor);
 }
@@ -1555,8 +1969,12 @@ clone_free(glw_root_t *gr, glw_clone_t *c)
   glw_t *w = c->c_w;
   if(w != NULL) {
     w->glw_clone = NULL;
-    glw_signal_handler_unregister(w, clone_sig_handler, c);
-    glw_retire_child(w);
+    if(c->c_sc->sc_virtual != NULL) {
+      clone_slot_destroy(c->c_sc, w);
+    } else {
+      glw_signal_handler_unregister(w, clone_sig_handler, c);
+      glw_retire_child(w);
+    }
   }
 
   LIST_REMOVE(c, c_link);
@@ -1576,6 +1994,11 @@ cloner_del_child(glw_root_t *gr, sub_cloner_t *sc, prop_t *p, glw_t *parent)
   glw_prop_sub_pending_t *gpsp;
 
   if((c = prop_tag_clear(p, sc)) != NULL) {
+    if(sc->sc_virtual != NULL) {
+      cloner_del_child_virtual(gr, sc, c);
+      return;
+    }
+
     sc->sc_entries--;
     glw_t *w = c->c_w;
 
@@ -1611,6 +2034,15 @@ cloner_select_child(sub_cloner_t *sc, prop_t *p, glw_t *parent, prop_t *extra)
   }
 
   if((c = prop_tag_get(p, sc)) != NULL) {
+    if(c->c_w == NULL) {
+      // Virtualized and not instantiated, select once it's scrolled to
+      if(!sc->sc_positions_valid)
+        cloner_resequence(sc);
+      sc->sc_pending_select = p;
+      sc->sc_virtual->gv_scroll_to = c->c_pos;
+      glw_need_refresh(parent->glw_root, 0);
+      return;
+    }
     if(parent->glw_class->gc_select_child != NULL)
       parent->glw_class->gc_select_child(parent, c->c_w, extra);
     sc->sc_pending_select = NULL;
@@ -1629,7 +2061,7 @@ cloner_suggest_focus(sub_cloner_t *sc, prop_t *p, glw_t *parent)
 {
   glw_clone_t *c;
 
-  if((c = prop_tag_get(p, sc)) != NULL) {
+  if((c = prop_tag_get(p, sc)) != NULL && c->c_w != NULL) {
     if(parent->glw_class->gc_suggest_focus != NULL)
       parent->glw_class->gc_suggest_focus(parent, c->c_w);
   }
@@ -3111,7 +3543,7 @@ glwf_cloner(glw_view_eval_context_t *ec, struct token *self,
   /* Destroy any previous cloned entries */
   while((w = TAILQ_PREV((glw_t *)self->t_extra,
 			glw_queue, glw_parent_link)) != NULL &&
-	w->glw_clone != NULL) {
+	w->glw_clone != NULL && w->glw_clone->c_sc->sc_virtual == NULL) {
     prop_tag_clear(w->glw_clone->c_prop, w->glw_clone->c_sc);
     clone_free(ec->gr, w->glw_clone);
   }
@@ -3125,18 +3557,34 @@ glwf_cloner(glw_view_eval_context_t *ec, struct token *self,
     sc->sc_cloner_body = glw_view_clone_chain(ec->gr, c, NULL);
     sc->sc_cloner_class = cl;
 
+    if(parent->glw_class->gc_get_virtual != NULL &&
+       (sc->sc_virtual = parent->glw_class->gc_get_virtual(parent)) != NULL) {
+      if(glw_virtual_is_attached(sc->sc_virtual))
+        sc->sc_virtual = NULL; // Only one cloner can feed the window
+      else
+        glw_virtual_attach(sc->sc_virtual, sc, cloner_set_window,
+                           cloner_index_of);
+    }
+
     /* Create pending childs */
+    prop_t *selected = NULL;
     while((gpsp = TAILQ_FIRST(&sc->sc_pending)) != NULL) {
       TAILQ_REMOVE(&sc->sc_pending, gpsp, gpsp_link);
 
       f = gpsp->gpsp_prop == sc->sc_pending_select ? PROP_ADD_SELECTED : 0;
+      if(f)
+        selected = gpsp->gpsp_prop;
 
       cloner_add_child0(sc, gpsp->gpsp_prop, NULL, parent, ec->ei, f);
       prop_tag_clear(gpsp->gpsp_prop, &sc->sc_pending);
       prop_ref_dec(gpsp->gpsp_prop);
       free(gpsp);
     }
-    sc->sc_pending_select = NULL;
+    /*
+     * A virtualized child has no widget yet, cloner_set_window() selects
+     * it once it's been scrolled into the window
+     */
+    sc->sc_pending_select = sc->sc_virtual != NULL ? selected : NULL;
   }
 
   return 0;
@@ -0,0 +1,722 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "glw.h"
+#include "glw_virtual.h"
+
+/**
+ *
+ */
+static void
+gei_rebuild(glw_extent_index_t *gei)
+{
+  const int n = gei->gei_num;
+  int i;
+
+  for(i = 1; i <= n; i++) {
+    const int e = gei->gei_extent[i - 1];
+    gei->gei_sum[i]   = e >= 0 ? e : 0;
+    gei->gei_known[i] = e >= 0;
+  }
+
+  for(i = 1; i <= n; i++) {
+    const int j = i + (i & -i);
+    if(j <= n) {
+      gei->gei_sum[j]   += gei->gei_sum[i];
+      gei->gei_known[j] += gei->gei_known[i];
+    }
+  }
+  gei->gei_dirty = 0;
+}
+
+
+/**
+ *
+ */
+static void
+gei_grow(glw_extent_index_t *gei)
+{
+  if(gei->gei_num < gei->gei_capacity)
+    return;
+
+  gei->gei_capacity = MAX(gei->gei_capacity * 2, 256);
+  gei->gei_extent = realloc(gei->gei_extent,
+                            gei->gei_capacity * sizeof(int));
+  gei->gei_sum    = realloc(gei->gei_sum,
+                            (gei->gei_capacity + 1) * sizeof(int));
+  gei->gei_known  = realloc(gei->gei_known,
+                            (gei->gei_capacity + 1) * sizeof(int));
+}
+
+
+/**
+ * Add an item with unknown extent before 'pos'. Appending keeps the
+ * trees valid, anything else rebuilds them on next query
+ */
+void
+glw_extent_index_insert(glw_extent_index_t *gei, int pos)
+{
+  gei_grow(gei);
+
+  if(pos == gei->gei_num && !gei->gei_dirty) {
+    // The new node covers (n - lowbit(n), n], sum up its children
+    const int n = ++gei->gei_num;
+    int s = 0, k = 0;
+    for(int step = 1; step < (n & -n); step <<= 1) {
+      s += gei->gei_sum[n - step];
+      k += gei->gei_known[n - step];
+    }
+    gei->gei_extent[n - 1] = -1;
+    gei->gei_sum[n] = s;
+    gei->gei_known[n] = k;
+    return;
+  }
+
+  memmove(gei->gei_extent + pos + 1, gei->gei_extent + pos,
+          (gei->gei_num - pos) * sizeof(int));
+  gei->gei_extent[pos] = -1;
+  gei->gei_num++;
+  gei->gei_dirty = 1;
+}
+
+
+/**
+ *
+ */
+void
+glw_extent_index_remove(glw_extent_index_t *gei, int pos)
+{
+  gei->gei_num--;
+  if(pos == gei->gei_num)
+    return;
+
+  memmove(gei->gei_extent + pos, gei->gei_extent + pos + 1,
+          (gei->gei_num - pos) * sizeof(int));
+  gei->gei_dirty = 1;
+}
+
+
+/**
+ * Move item at 'from' so it ends up at index 'to'
+ */
+void
+glw_extent_index_move(glw_extent_index_t *gei, int from, int to)
+{
+  const int e = gei->gei_extent[from];
+
+  if(from == to)
+    return;
+
+  if(from < to)
+    memmove(gei->gei_extent + from, gei->gei_extent + from + 1,
+            (to - from) * sizeof(int));
+  else
+    memmove(gei->gei_extent + to + 1, gei->gei_extent + to,
+            (from - to) * sizeof(int));
+
+  gei->gei_extent[to] = e;
+  gei->gei_dirty = 1;
+}
+
+
+/**
+ * Returns 1 if the extent changed
+ */
+int
+glw_extent_index_set(glw_extent_index_t *gei, int item, int extent)
+{
+  const int old = gei->gei_extent[item];
+
+  if(old == extent)
+    return 0;
+
+  gei->gei_extent[item] = extent;
+
+  if(gei->gei_dirty)
+    return 1;
+
+  const int ds = (extent >= 0 ? extent : 0) - (old >= 0 ? old : 0);
+  const int dk = (extent >= 0) - (old >= 0);
+
+  for(int i = item + 1; i <= gei->gei_num; i += i & -i) {
+    gei->gei_sum[i]   += ds;
+    gei->gei_known[i] += dk;
+  }
+  return 1;
+}
+
+
+/**
+ *
+ */
+int
+glw_extent_index_get(glw_extent_index_t *gei, int item)
+{
+  const int e = gei->gei_extent[item];
+  return e >= 0 ? e : gei->gei_estimate;
+}
+
+
+/**
+ * Position of 'item', ie. the sum of extents of all items before it
+ */
+int
+glw_extent_index_offset(glw_extent_index_t *gei, int item)
+{
+  int s = 0, k = 0;
+
+  if(gei->gei_dirty)
+    gei_rebuild(gei);
+
+  for(int i = item; i > 0; i -= i & -i) {
+    s += gei->gei_sum[i];
+    k += gei->gei_known[i];
+  }
+  return s + (item - k) * gei->gei_estimate;
+}
+
+
+/**
+ * Item covering position 'pos'
+ */
+int
+glw_extent_index_find(glw_extent_index_t *gei, int pos)
+{
+  const int n = gei->gei_num;
+  int step = 1, idx = 0;
+
+  if(n == 0)
+    return 0;
+
+  if(gei->gei_dirty)
+    gei_rebuild(gei);
+
+  while(step * 2 <= n)
+    step *= 2;
+
+  for(; step > 0; step >>= 1) {
+    const int i = idx + step;
+    if(i > n)
+      continue;
+
+    // Node 'i' covers exactly 'step' items
+    const int v = gei->gei_sum[i] +
+      (step - gei->gei_known[i]) * gei->gei_estimate;
+
+    if(v <= pos) {
+      idx = i;
+      pos -= v;
+    }
+  }
+  return MIN(idx, n - 1);
+}
+
+
+/**
+ * Estimate is the average of what is known, or 'fallback' if nothing is
+ */
+void
+glw_extent_index_set_estimate(glw_extent_index_t *gei, int fallback)
+{
+  int s = 0, k = 0;
+
+  if(gei->gei_dirty)
+    gei_rebuild(gei);
+
+  for(int i = gei->gei_num; i > 0; i -= i & -i) {
+    s += gei->gei_sum[i];
+    k += gei->gei_known[i];
+  }
+  gei->gei_estimate = MAX(1, k ? s / k : fallback);
+}
+
+
+/**
+ *
+ */
+void
+glw_extent_index_free(glw_extent_index_t *gei)
+{
+  free(gei->gei_extent);
+  free(gei->gei_sum);
+  free(gei->gei_known);
+  memset(gei, 0, sizeof(glw_extent_index_t));
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_init(glw_virtual_t *gv)
+{
+  memset(gv, 0, sizeof(glw_virtual_t));
+  gv->gv_scroll_to = -1;
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_attach(glw_virtual_t *gv, void *opaque,
+                   void (*set_window)(void *opaque, int first, int last),
+                   int (*index_of)(void *opaque, struct glw *w))
+{
+  gv->gv_opaque = opaque;
+  gv->gv_set_window = set_window;
+  gv->gv_index_of = index_of;
+  gv->gv_changed = 1;
+}
+
+
+/**
+ * The items go away with the source
+ */
+void
+glw_virtual_detach(glw_virtual_t *gv, void *opaque)
+{
+  if(gv->gv_opaque != opaque)
+    return;
+
+  gv->gv_opaque = NULL;
+  gv->gv_set_window = NULL;
+  gv->gv_index_of = NULL;
+  gv->gv_index.gei_num = 0;
+  gv->gv_index.gei_dirty = 0;
+  gv->gv_first = gv->gv_last = 0;
+  gv->gv_scroll_to = -1;
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_insert(glw_virtual_t *gv, int pos)
+{
+  glw_extent_index_insert(&gv->gv_index, pos);
+  gv->gv_changed = 1;
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_remove(glw_virtual_t *gv, int pos)
+{
+  glw_extent_index_remove(&gv->gv_index, pos);
+  if(gv->gv_scroll_to == pos)
+    gv->gv_scroll_to = -1;
+  else if(gv->gv_scroll_to > pos)
+    gv->gv_scroll_to--;
+  gv->gv_changed = 1;
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_move(glw_virtual_t *gv, int from, int to)
+{
+  glw_extent_index_move(&gv->gv_index, from, to);
+  gv->gv_changed = 1;
+}
+
+
+/**
+ * Ask the source to instantiate items [first, last). Calling this with
+ * the same window as before is cheap unless the items changed
+ */
+void
+glw_virtual_set_window(glw_virtual_t *gv, int first, int last)
+{
+  first = MAX(first, 0);
+  last = MIN(last, gv->gv_index.gei_num);
+  last = MIN(last, first + GLW_VIRTUAL_MAX_WINDOW);
+  last = MAX(last, first);
+
+  if(first == gv->gv_first && last == gv->gv_last && !gv->gv_changed)
+    return;
+
+  gv->gv_first = first;
+  gv->gv_last = last;
+  gv->gv_changed = 0;
+
+  if(gv->gv_set_window != NULL)
+    gv->gv_set_window(gv->gv_opaque, first, last);
+}
+
+
+/**
+ * Item index of child widget 'w', -1 if it's not bound to an item
+ */
+int
+glw_virtual_index(glw_virtual_t *gv, struct glw *w)
+{
+  if(gv->gv_index_of == NULL)
+    return -1;
+  return gv->gv_index_of(gv->gv_opaque, w);
+}
+
+
+/**
+ *
+ */
+void
+glw_virtual_free(glw_virtual_t *gv)
+{
+  glw_extent_index_free(&gv->gv_index);
+}
+
+
+
+#ifdef GLW_VIRTUAL_BENCHMARK
+
+#define BENCH_ROWS  100000
+#define BENCH_PAGE  720
+#define BENCH_SPEED 30
+
+/**
+ * Stands in for the cloner. Binds items to slots and recycles slots
+ * of items that leave the window
+ */
+typedef struct bench_source {
+  glw_virtual_t *bs_gv;
+  int *bs_slot_of;     // Per item, -1 if not bound
+  int *bs_pool;
+  int bs_pool_len;
+  int bs_num_slots;
+  int bs_first;
+  int bs_last;
+  int64_t bs_binds;
+  int64_t bs_recycled;
+  int bs_max_bound;
+  int bs_pending_select; // Item to select once bound, -1 if none
+  int bs_selected;
+} bench_source_t;
+
+
+/**
+ * Track rows with a larger header row every 25 items
+ */
+static int
+bench_row_height(int item)
+{
+  return item % 25 ? 40 : 64;
+}
+
+
+/**
+ *
+ */
+static void
+bench_set_window(void *opaque, int first, int last)
+{
+  bench_source_t *bs = opaque;
+  int i;
+
+  for(i = bs->bs_first; i < bs->bs_last; i++) {
+    if(i >= first && i < last)
+      continue;
+    bs->bs_pool[bs->bs_pool_len++] = bs->bs_slot_of[i];
+    bs->bs_slot_of[i] = -1;
+  }
+
+  for(i = first; i < last; i++) {
+    if(bs->bs_slot_of[i] != -1)
+      continue;
+    bs->bs_binds++;
+    if(bs->bs_pool_len > 0) {
+      bs->bs_slot_of[i] = bs->bs_pool[--bs->bs_pool_len];
+      bs->bs_recycled++;
+    } else {
+      bs->bs_slot_of[i] = bs->bs_num_slots++;
+    }
+  }
+  bs->bs_first = first;
+  bs->bs_last = last;
+  bs->bs_max_bound = MAX(bs->bs_max_bound, last - first);
+
+  // Same as cloner_set_window() with sc_pending_select
+
+  if(bs->bs_pending_select >= first && bs->bs_pending_select < last) {
+    bs->bs_selected = bs->bs_pending_select;
+    bs->bs_pending_select = -1;
+  }
+}
+
+
+/**
+ * What glw_list_layout_y() does for a virtualized list
+ */
+static unsigned int
+bench_layout_virtual(glw_virtual_t *gv, int scroll)
+{
+  glw_extent_index_t *gei = &gv->gv_index;
+  unsigned int sum = 0;
+
+  glw_extent_index_set_estimate(gei, 40);
+
+  if(gv->gv_scroll_to >= 0) {
+    scroll = glw_extent_index_offset(gei, gv->gv_scroll_to);
+    gv->gv_scroll_to = -1;
+  }
+
+  const int first = glw_extent_index_find(gei, scroll - BENCH_PAGE);
+  const int last = glw_extent_index_find(gei, scroll + BENCH_PAGE * 2) + 1;
+  glw_virtual_set_window(gv, first, last);
+
+  for(int i = gv->gv_first; i < gv->gv_last; i++) {
+    glw_extent_index_set(gei, i, bench_row_height(i));
+    sum += glw_extent_index_offset(gei, i);
+  }
+  return sum + glw_extent_index_total(gei);
+}
+
+
+/**
+ * What glw_list_layout_y() did before, walking one widget per item
+ */
+typedef struct bench_widget {
+  struct bench_widget *next;
+  int height;
+  float pos;
+  char pad[200];
+} bench_widget_t;
+
+static unsigned int
+bench_layout_full(bench_widget_t *w, int scroll)
+{
+  unsigned int sum = 0;
+  int ypos = 0;
+  for(; w != NULL; w = w->next) {
+    w->pos = ypos;
+    if(ypos - scroll > -BENCH_PAGE && ypos - scroll < BENCH_PAGE * 2)
+      sum += ypos;
+    ypos += w->height;
+  }
+  return sum + ypos;
+}
+
+
+/**
+ *
+ */
+static int
+bench_verify(glw_extent_index_t *gei, const int *ext, int n)
+{
+  int bad = 0, pos = 0;
+  uint32_t x = 1;
+
+  for(int i = 0; i < n; i++) {
+    if(glw_extent_index_offset(gei, i) != pos)
+      bad++;
+    if(glw_extent_index_get(gei, i) != ext[i])
+      bad++;
+    if(ext[i] > 0) {
+      x = x * 1664525 + 1013904223;
+      if(glw_extent_index_find(gei, pos + x % ext[i]) != i)
+        bad++;
+    }
+    pos += ext[i];
+  }
+  if(glw_extent_index_total(gei) != pos)
+    bad++;
+  return bad;
+}
+
+
+/**
+ * Scroll through a list of 100k rows, one frame at a time, and jump to
+ * random positions. Build with -DGLW_VIRTUAL_BENCHMARK.
+ * The process exits when done
+ */
+static void *
+glw_virtual_benchmark(void *aux)
+{
+  glw_virtual_t gv;
+  bench_source_t bs = {0};
+  int i, bad = 0;
+  volatile unsigned int sink = 0;
+  int64_t ts;
+
+  glw_virtual_init(&gv);
+
+  bs.bs_gv = &gv;
+  bs.bs_slot_of = malloc(BENCH_ROWS * sizeof(int));
+  bs.bs_pending_select = -1;
+  bs.bs_selected = -1;
+  bs.bs_pool = malloc(GLW_VIRTUAL_MAX_WINDOW * 2 * sizeof(int));
+  for(i = 0; i < BENCH_ROWS; i++)
+    bs.bs_slot_of[i] = -1;
+
+  glw_virtual_attach(&gv, &bs, bench_set_window, NULL);
+
+  ts = arch_get_ts();
+  for(i = 0; i < BENCH_ROWS; i++)
+    glw_virtual_insert(&gv, i);
+  const int64_t insert_time = arch_get_ts() - ts;
+
+  glw_extent_index_set_estimate(&gv.gv_index, 40);
+
+  // Scroll from top to bottom
+
+  int frames = 0;
+  ts = arch_get_ts();
+  for(int scroll = 0; scroll < glw_extent_index_total(&gv.gv_index);
+      scroll += BENCH_SPEED, frames++)
+    sink += bench_layout_virtual(&gv, scroll);
+  const int64_t scroll_time = arch_get_ts() - ts;
+
+  const int64_t scroll_binds = bs.bs_binds;
+
+  // Jump around
+
+  const int jumps = 100000;
+  uint32_t x = 1;
+  const int total = glw_extent_index_total(&gv.gv_index);
+  ts = arch_get_ts();
+  for(i = 0; i < jumps; i++) {
+    x = x * 1664525 + 1013904223;
+    sink += bench_layout_virtual(&gv, x % total);
+  }
+  const int64_t jump_time = arch_get_ts() - ts;
+
+  // Compare with prefix sums
+
+  int *ext = malloc((BENCH_ROWS + 1000) * sizeof(int));
+  for(i = 0; i < BENCH_ROWS; i++)
+    ext[i] = bench_row_height(i);
+  bad += bench_verify(&gv.gv_index, ext, BENCH_ROWS);
+
+  // Insert, remove and move in the middle
+
+  glw_extent_index_t *gei = &gv.gv_index;
+  for(i = 0; i < 1000; i++) {
+    x = x * 1664525 + 1013904223;
+    const int n = gei->gei_num;
+    const int p = x % n;
+    const int q = (x >> 8) % n;
+    switch(i % 3) {
+    case 0:
+      glw_extent_index_insert(gei, p);
+      glw_extent_index_set(gei, p, 17);
+      memmove(ext + p + 1, ext + p, (n - p) * sizeof(int));
+      ext[p] = 17;
+      break;
+    case 1:
+      glw_extent_index_remove(gei, p);
+      memmove(ext + p, ext + p + 1, (n - p - 1) * sizeof(int));
+      break;
+    case 2: {
+      const int e = ext[p];
+      glw_extent_index_move(gei, p, q);
+      if(p < q)
+        memmove(ext + p, ext + p + 1, (q - p) * sizeof(int));
+      else
+        memmove(ext + q + 1, ext + q, (p - q) * sizeof(int));
+      ext[q] = e;
+      break;
+    }
+    }
+    if(i % 100 == 0)
+      bad += bench_verify(gei, ext, gei->gei_num);
+  }
+  bad += bench_verify(gei, ext, gei->gei_num);
+
+  /*
+   * Refill with a row far outside the initial window marked as selected,
+   * like when going back to a track list. It must be scrolled to and
+   * selected on the first layout
+   */
+  bench_set_window(&bs, 0, 0);
+  glw_virtual_detach(&gv, &bs);
+  glw_virtual_attach(&gv, &bs, bench_set_window, NULL);
+
+  const int select_row = BENCH_ROWS * 3 / 4;
+  for(i = 0; i < BENCH_ROWS; i++) {
+    glw_virtual_insert(&gv, i);
+    if(i == select_row) {
+      bs.bs_pending_select = i;
+      gv.gv_scroll_to = i;
+    }
+  }
+  sink += bench_layout_virtual(&gv, 0);
+  const int select_ok = bs.bs_selected == select_row &&
+    bs.bs_pending_select == -1 &&
+    bs.bs_slot_of[select_row] != -1;
+  if(!select_ok)
+    bad++;
+
+  // The old way, a widget per row
+
+  bench_widget_t *head = NULL;
+  for(i = BENCH_ROWS - 1; i >= 0; i--) {
+    bench_widget_t *w = malloc(sizeof(bench_widget_t));
+    w->next = head;
+    w->height = bench_row_height(i);
+    head = w;
+  }
+
+  const int full_frames = 500;
+  ts = arch_get_ts();
+  for(i = 0; i < full_frames; i++)
+    sink += bench_layout_full(head, i * BENCH_SPEED);
+  const int64_t full_time = arch_get_ts() - ts;
+
+  printf("%d rows\n"
+         "  Insert: %.1f ns per item\n"
+         "  Scroll: %d frames, %.0f ns per frame, %"PRId64" binds\n"
+         "  Jumps: %.0f ns per jump\n"
+         "  Walking all rows: %.0f ns per frame\n"
+         "  Slots: %d (largest window %d), %"PRId64" of %"PRId64
+         " binds recycled\n"
+         "  Select row %d on refill: %s\n"
+         "  Mismatches: %d\n",
+         BENCH_ROWS,
+         insert_time * 1000.0 / BENCH_ROWS,
+         frames, scroll_time * 1000.0 / frames, scroll_binds,
+         jump_time * 1000.0 / jumps,
+         full_time * 1000.0 / full_frames,
+         bs.bs_num_slots, bs.bs_max_bound, bs.bs_recycled, bs.bs_binds,
+         select_row, select_ok ? "ok" : "FAILED",
+         bad);
+  exit(0);
+}
+
+
+/**
+ *
+ */
+static void
+glw_virtual_benchmark_init(void)
+{
+  hts_thread_create_detached("glwvirtual", glw_virtual_benchmark, NULL,
+                             THREAD_PRIO_BGTASK);
+}
+
+INITME(INIT_GROUP_API, glw_virtual_benchmark_init, NULL, 0);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ *  Copyright (C) 2007-2015 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+struct glw;
+
+/**
+ * Extent index
+ *
+ * Fenwick trees over the extent (size along the scroll axis, including
+ * spacing) of every item in a virtualized container. Items that have
+ * not been laid out yet count as 'gei_estimate'.
+ */
+typedef struct glw_extent_index {
+  int *gei_extent;     // Per item, -1 if not known
+  int *gei_sum;        // Sum of known extents
+  int *gei_known;      // Number of known extents
+  int gei_num;
+  int gei_capacity;
+  int gei_estimate;
+  int gei_dirty;       // Trees must be rebuilt before next query
+} glw_extent_index_t;
+
+void glw_extent_index_insert(glw_extent_index_t *gei, int pos);
+
+void glw_extent_index_remove(glw_extent_index_t *gei, int pos);
+
+void glw_extent_index_move(glw_extent_index_t *gei, int from, int to);
+
+int glw_extent_index_set(glw_extent_index_t *gei, int item, int extent);
+
+int glw_extent_index_get(glw_extent_index_t *gei, int item);
+
+int glw_extent_index_offset(glw_extent_index_t *gei, int item);
+
+int glw_extent_index_find(glw_extent_index_t *gei, int pos);
+
+void glw_extent_index_set_estimate(glw_extent_index_t *gei, int fallback);
+
+void glw_extent_index_free(glw_extent_index_t *gei);
+
+#define glw_extent_index_total(gei) \
+  glw_extent_index_offset(gei, (gei)->gei_num)
+
+
+/**
+ * Virtualized container
+ *
+ * Embedded in containers that can lay out a window of their items
+ * without having widgets for all of them. The source (the cloner) owns
+ * the items, keeps the index in sync with them and instantiates widgets
+ * for the window the container asks for.
+ *
+ * Widgets of the window are children of the container in item order.
+ * Children that are not bound to an item (index_of returns -1) are
+ * always hidden.
+ */
+#define GLW_VIRTUAL_MAX_WINDOW 1024
+
+typedef struct glw_virtual {
+  glw_extent_index_t gv_index;
+
+  int gv_first;         // Window currently instantiated [first, last)
+  int gv_last;
+  int gv_scroll_to;     // Item the source wants on screen, -1 if none
+  int gv_changed;       // Items were added, moved or removed
+
+  void *gv_opaque;
+  void (*gv_set_window)(void *opaque, int first, int last);
+  int (*gv_index_of)(void *opaque, struct glw *w);
+
+} glw_virtual_t;
+
+void glw_virtual_init(glw_virtual_t *gv);
+
+void glw_virtual_attach(glw_virtual_t *gv, void *opaque,
+                        void (*set_window)(void *opaque, int first, int last),
+                        int (*index_of)(void *opaque, struct glw *w));
+
+void glw_virtual_detach(glw_virtual_t *gv, void *opaque);
+
+void glw_virtual_insert(glw_virtual_t *gv, int pos);
+
+void glw_virtual_remove(glw_virtual_t *gv, int pos);
+
+void glw_virtual_move(glw_virtual_t *gv, int from, int to);
+
+void glw_virtual_set_window(glw_virtual_t *gv, int first, int last);
+
+int glw_virtual_index(glw_virtual_t *gv, struct glw *w);
+
+void glw_virtual_free(glw_virtual_t *gv);
+
+#define glw_virtual_is_attached(gv) ((gv)->gv_set_window != NULL)
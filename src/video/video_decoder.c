@@ -330,6 +330,9 @@ vd_thread(void *aux)
       dvdspu_flush_locked(mp);
       hts_mutex_unlock(&mp->mp_overlay_mutex);
 
+      if(vd->vd_ext_subtitles != NULL)
+        subtitles_flush(vd->vd_ext_subtitles);
+
       mp->mp_video_frame_deliver(NULL, mp->mp_video_frame_opaque);
 
       if(mc_current != NULL)
@@ -455,6 +458,9 @@ vd_thread(void *aux)
       hts_mutex_lock(&mp->mp_overlay_mutex);
       video_overlay_flush_locked(mp, 1);
       hts_mutex_unlock(&mp->mp_overlay_mutex);
+
+      if(vd->vd_ext_subtitles != NULL)
+        subtitles_flush(vd->vd_ext_subtitles);
       break;
 
     case MB_CTRL_EXT_SUBTITLE:
@@ -216,4 +216,21 @@ video_settings_init(void)
                  SETTING_STORE("videoplayback", "videobuffersize"),
                  SETTING_WRITE_INT(&video_settings.video_buffer_size),
                  NULL);
+
+  setting_create(SETTING_INT, s, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Streaming segments to prefetch")),
+                 SETTING_VALUE(2),
+                 SETTING_RANGE(0, 8),
+                 SETTING_STORE("videoplayback", "hlsprefetch"),
+                 SETTING_WRITE_INT(&video_settings.hls_prefetch_segments),
+                 NULL);
+
+  setting_create(SETTING_MULTIOPT, s, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Adaptive bitrate strategy")),
+                 SETTING_STORE("videoplayback", "hlsabr"),
+                 SETTING_WRITE_INT(&video_settings.hls_abr_strategy),
+                 SETTING_OPTION("0", _p("Automatic")),
+                 SETTING_OPTION("1", _p("Throughput based")),
+                 SETTING_OPTION("2", _p("Buffer based")),
+                 NULL);
 }
@@ -53,6 +53,8 @@ struct video_settings {
   int seek_fwd_step;
 
   int video_buffer_size;
+  int hls_prefetch_segments;
+  int hls_abr_strategy;
 };
 
 extern struct video_settings video_settings;